@@ -0,0 +1,40 @@
+# - Try to find Arrow and its Parquet library
+#
+# The following variables are optionally searched for defaults
+#  ARROW_ROOT_DIR:           Base directory where all Arrow components are found
+#
+# The following are set after configuration is done:
+#  ARROW_FOUND
+#  ARROW_INCLUDE_DIRS
+#  ARROW_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(ARROW_ROOT_DIR "" CACHE PATH "Folder contains Arrow")
+
+if (NOT "$ENV{Arrow_DIR}" STREQUAL "")
+  set(ARROW_ROOT_DIR $ENV{Arrow_DIR})
+endif()
+
+find_path(ARROW_INCLUDE_DIR arrow/api.h
+  HINTS ${ARROW_ROOT_DIR}/include)
+
+find_library(ARROW_LIBRARY arrow
+  HINTS ${ARROW_ROOT_DIR}
+  PATH_SUFFIXES
+    lib
+    lib64)
+
+find_library(PARQUET_LIBRARY parquet
+  HINTS ${ARROW_ROOT_DIR}
+  PATH_SUFFIXES
+    lib
+    lib64)
+
+find_package_handle_standard_args(ARROW DEFAULT_MSG
+  ARROW_INCLUDE_DIR ARROW_LIBRARY PARQUET_LIBRARY)
+
+if(ARROW_FOUND)
+  set(ARROW_INCLUDE_DIRS ${ARROW_INCLUDE_DIR})
+  set(ARROW_LIBRARIES ${PARQUET_LIBRARY} ${ARROW_LIBRARY})
+endif()
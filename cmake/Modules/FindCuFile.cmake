@@ -0,0 +1,34 @@
+# - Try to find cuFile, the GPUDirect Storage library of CUDA
+#
+# The following variables are optionally searched for defaults
+#  CUFILE_ROOT_DIR:          Base directory where all cuFile components are found
+#
+# The following are set after configuration is done:
+#  CUFILE_FOUND
+#  CUFILE_INCLUDE_DIRS
+#  CUFILE_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(CUFILE_ROOT_DIR "" CACHE PATH "Folder contains cuFile")
+
+if (NOT "$ENV{CuFile_DIR}" STREQUAL "")
+  set(CUFILE_ROOT_DIR $ENV{CuFile_DIR})
+endif()
+
+find_path(CUFILE_INCLUDE_DIR cufile.h
+  HINTS ${CUFILE_ROOT_DIR}/include ${CUDA_TOOLKIT_ROOT_DIR}/include)
+
+find_library(CUFILE_LIBRARY cufile
+  HINTS ${CUFILE_ROOT_DIR} ${CUDA_TOOLKIT_ROOT_DIR}
+  PATH_SUFFIXES
+    lib
+    lib64)
+
+find_package_handle_standard_args(CUFILE DEFAULT_MSG
+  CUFILE_INCLUDE_DIR CUFILE_LIBRARY)
+
+if(CUFILE_FOUND)
+  set(CUFILE_INCLUDE_DIRS ${CUFILE_INCLUDE_DIR})
+  set(CUFILE_LIBRARIES ${CUFILE_LIBRARY})
+endif()
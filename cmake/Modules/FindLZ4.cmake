@@ -0,0 +1,34 @@
+# - Try to find LZ4
+#
+# The following variables are optionally searched for defaults
+#  LZ4_ROOT_DIR:            Base directory where all LZ4 components are found
+#
+# The following are set after configuration is done:
+#  LZ4_FOUND
+#  LZ4_INCLUDE_DIRS
+#  LZ4_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(LZ4_ROOT_DIR "" CACHE PATH "Folder contains LZ4")
+
+if (NOT "$ENV{LZ4_DIR}" STREQUAL "")
+  set(LZ4_ROOT_DIR $ENV{LZ4_DIR})
+endif()
+
+find_path(LZ4_INCLUDE_DIR lz4.h
+  HINTS ${LZ4_ROOT_DIR}/include)
+
+find_library(LZ4_LIBRARY lz4
+  HINTS ${LZ4_ROOT_DIR}
+  PATH_SUFFIXES
+    lib
+    lib64)
+
+find_package_handle_standard_args(LZ4 DEFAULT_MSG
+  LZ4_INCLUDE_DIR LZ4_LIBRARY)
+
+if(LZ4_FOUND)
+  set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+  set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+endif()
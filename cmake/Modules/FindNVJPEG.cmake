@@ -0,0 +1,34 @@
+# - Try to find nvJPEG, the JPEG codec library of CUDA
+#
+# The following variables are optionally searched for defaults
+#  NVJPEG_ROOT_DIR:          Base directory where all nvJPEG components are found
+#
+# The following are set after configuration is done:
+#  NVJPEG_FOUND
+#  NVJPEG_INCLUDE_DIRS
+#  NVJPEG_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(NVJPEG_ROOT_DIR "" CACHE PATH "Folder contains nvJPEG")
+
+if (NOT "$ENV{NVJPEG_DIR}" STREQUAL "")
+  set(NVJPEG_ROOT_DIR $ENV{NVJPEG_DIR})
+endif()
+
+find_path(NVJPEG_INCLUDE_DIR nvjpeg.h
+  HINTS ${NVJPEG_ROOT_DIR}/include ${CUDA_TOOLKIT_ROOT_DIR}/include)
+
+find_library(NVJPEG_LIBRARY nvjpeg
+  HINTS ${NVJPEG_ROOT_DIR} ${CUDA_TOOLKIT_ROOT_DIR}
+  PATH_SUFFIXES
+    lib
+    lib64)
+
+find_package_handle_standard_args(NVJPEG DEFAULT_MSG
+  NVJPEG_INCLUDE_DIR NVJPEG_LIBRARY)
+
+if(NVJPEG_FOUND)
+  set(NVJPEG_INCLUDE_DIRS ${NVJPEG_INCLUDE_DIR})
+  set(NVJPEG_LIBRARIES ${NVJPEG_LIBRARY})
+endif()
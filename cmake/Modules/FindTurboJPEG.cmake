@@ -0,0 +1,34 @@
+# - Try to find the TurboJPEG API of libjpeg-turbo
+#
+# The following variables are optionally searched for defaults
+#  TURBOJPEG_ROOT_DIR:       Base directory where all TurboJPEG components are found
+#
+# The following are set after configuration is done:
+#  TURBOJPEG_FOUND
+#  TURBOJPEG_INCLUDE_DIRS
+#  TURBOJPEG_LIBRARIES
+
+include(FindPackageHandleStandardArgs)
+
+set(TURBOJPEG_ROOT_DIR "" CACHE PATH "Folder contains libjpeg-turbo")
+
+if (NOT "$ENV{TurboJPEG_DIR}" STREQUAL "")
+  set(TURBOJPEG_ROOT_DIR $ENV{TurboJPEG_DIR})
+endif()
+
+find_path(TURBOJPEG_INCLUDE_DIR turbojpeg.h
+  HINTS ${TURBOJPEG_ROOT_DIR}/include /opt/libjpeg-turbo/include)
+
+find_library(TURBOJPEG_LIBRARY turbojpeg
+  HINTS ${TURBOJPEG_ROOT_DIR} /opt/libjpeg-turbo
+  PATH_SUFFIXES
+    lib
+    lib64)
+
+find_package_handle_standard_args(TURBOJPEG DEFAULT_MSG
+  TURBOJPEG_INCLUDE_DIR TURBOJPEG_LIBRARY)
+
+if(TURBOJPEG_FOUND)
+  set(TURBOJPEG_INCLUDE_DIRS ${TURBOJPEG_INCLUDE_DIR})
+  set(TURBOJPEG_LIBRARIES ${TURBOJPEG_LIBRARY})
+endif()
@@ -1,5 +1,6 @@
 from scannerpy import Database, DeviceType, Job
 from scannerpy.stdlib import parsers
+from scannerpy.stdlib.montage import assemble_montage
 from scipy.spatial import distance
 from subprocess import check_call as run
 import numpy as np
@@ -95,11 +96,9 @@ def make_montage_scanner(db, table, shot_starts):
     job = Job(columns = [montage], name = 'montage_image')
     montage_table = db.run(job, force=True)
 
-    montage_img = np.zeros((1, target_width * row_length, 3), dtype=np.uint8)
-    for _, img in montage_table.load(['montage']):
-        if len(img[0]) > 100:
-            img = np.flip(img, 2)
-            montage_img = np.vstack((montage_img, img))
+    montage_img = assemble_montage(
+        img[0] for _, img in montage_table.load(['montage']))
+    montage_img = np.flip(montage_img, 2)
     return montage_img
 
 
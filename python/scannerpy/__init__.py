@@ -1,3 +1,4 @@
 from common import ScannerException, DeviceType, Job
-from database import Database, ProtobufGenerator, start_master, start_worker
+from database import Database, JobHandle, ProtobufGenerator, start_master, \
+    start_worker, drain_worker
 from config import Config
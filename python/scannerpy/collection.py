@@ -1,5 +1,9 @@
 from common import *
 from sampler import SamplerOp
+from multiprocessing.pool import ThreadPool
+
+# Tables of a collection loaded at once
+LOAD_TABLE_THREADS = 8
 
 
 class Collection:
@@ -21,9 +25,43 @@ class Collection:
 
     def tables(self, index=None):
         if self._tables is None:
-            self._tables = [self._db.table(t) for t in self._descriptor.tables]
+            self._tables = self._db.tables(self._descriptor.tables)
         return self._tables[index] if index is not None else self._tables
 
+    def load(self, columns, fn=None, rows=None, threads=LOAD_TABLE_THREADS):
+        """
+        Loads columns of every table of the collection, several tables at a
+        time.
+
+        Args:
+            columns: Columns to load, as for Table.load.
+
+        Kwargs:
+            fn: Function to apply to the values of each row.
+            rows: Rows to load from each table, or None for all of them.
+            threads: Tables loaded at once.
+
+        Returns:
+            Generator that yields (table, rows) as each table finishes, where
+            rows is the list Table.load yields. Tables are not yielded in the
+            order of the collection.
+        """
+        def load_table(table):
+            return (table, list(table.load(columns, fn=fn, rows=rows)))
+
+        tables = self.tables()
+        pool = ThreadPool(threads)
+        try:
+            # Windows of tables keep loaded results that have not been
+            # consumed from piling up
+            window = threads * 4
+            for i in range(0, len(tables), window):
+                for result in pool.imap_unordered(load_table,
+                                                  tables[i:i + window]):
+                    yield result
+        finally:
+            pool.terminate()
+
     def profiler(self):
         return self._db.profiler(self._descriptor.job_id)
 
@@ -1,3 +1,4 @@
+import bisect
 import struct
 import cv2
 import math
@@ -7,6 +8,23 @@ from subprocess import Popen, PIPE
 import tempfile
 import os
 
+# First word of column item files that start with an offset table, see
+# ItemFileHeader in scanner/engine/metadata.h
+ITEM_FILE_OFFSETS_MAGIC = 0xffffffff00000001
+# First word of item files of Tensor columns, see ITEM_FILE_TENSOR_MAGIC
+ITEM_FILE_TENSOR_MAGIC = 0xffffffff00000003
+# First word of packed item files holding every column of an item, see
+# PACKED_ITEM_MAGIC in scanner/engine/metadata.h
+PACKED_ITEM_MAGIC = 0xffffffff00000002
+# Items read at once when loading a column, and the most threads reading
+# them. Batches of fewer items use a thread per item.
+LOAD_BATCH_ITEMS = 64
+LOAD_THREADS = 16
+# Numpy types of the Column.TensorType values in scanner/metadata.proto
+TENSOR_DTYPES = [np.uint8, np.int32, np.int64, np.float32, np.float64]
+# Threads building and searching vector indexes
+INDEX_THREADS = 16
+
 class Column:
     """
     A column of a Table.
@@ -33,79 +51,274 @@ class Column:
     def id(self):
         return self._descriptor.id
 
-    def _load_output_file(self, item_id, rows, fn=None):
-        assert len(rows) > 0
-
-        path = '{}/tables/{}/{}_{}.bin'.format(
-            self._db_path, self._table._descriptor.id,
-            self._descriptor.id, item_id)
+    def _read_item_column(self, item_id):
+        table_id = self._table._descriptor.id
+        packed = self._table._descriptor.packed_items
+        if packed:
+            path = '{}/tables/{:d}/item_{:d}.bin'.format(
+                self._db_path, table_id, item_id)
+        else:
+            path = '{}/tables/{:d}/{:d}_{:d}.bin'.format(
+                self._db_path, table_id, self._descriptor.id, item_id)
         try:
             contents = self._storage.read(path)
         except UserWarning:
             raise ScannerException('Path {} does not exist'.format(path))
+        if not packed:
+            return contents
 
-        lens = []
-        start_pos = None
-        pos = 0
-        (num_rows,) = struct.unpack("=Q", contents[:8])
-
-        i = 8
-        rows = rows if len(rows) > 0 else range(num_rows)
-        for fi in range(num_rows):
-            (buf_len,) = struct.unpack("=Q", contents[i:i+8])
-            i += 8
-            old_pos = pos
-            pos += buf_len
-            if start_pos is None:
-                start_pos = old_pos
-            lens.append(buf_len)
-
-        rows_idx = 0
-        i = 8 + num_rows * 8 + start_pos
-        for j, buf_len in enumerate(lens):
-            if rows_idx < len(rows) and j == rows[rows_idx]:
-                buf = contents[i:i+buf_len]
-                if fn is not None:
-                    yield fn(buf, self._db)
-                else:
-                    yield buf
-                rows_idx += 1
-            i += buf_len
+        (magic, num_columns) = struct.unpack("=QQ", contents[:16])
+        if magic != PACKED_ITEM_MAGIC:
+            raise ScannerException(
+                'Packed item file {} has a bad index'.format(path))
+        offsets = struct.unpack("={}Q".format(num_columns + 1),
+                                contents[16:16 + (num_columns + 1) * 8])
+        data_start = 16 + (num_columns + 1) * 8
+        column_id = self._descriptor.id
+        return contents[data_start + offsets[column_id]:
+                        data_start + offsets[column_id + 1]]
+
+    def _item_batches(self, rows):
+        """
+        Splits the items into batches read at once, with the rows of each
+        batch, or [] for all of them if rows is None. Batches without
+        requested rows are skipped.
+        """
+        end_rows = self._table._descriptor.end_rows
+        for begin_item in range(0, len(end_rows), LOAD_BATCH_ITEMS):
+            end_item = min(begin_item + LOAD_BATCH_ITEMS, len(end_rows))
+            if rows is None:
+                yield (begin_item, end_item, [])
+                continue
+            first_row = end_rows[begin_item - 1] if begin_item > 0 else 0
+            batch_rows = rows[bisect.bisect_left(rows, first_row):
+                              bisect.bisect_left(rows,
+                                                 end_rows[end_item - 1])]
+            if batch_rows:
+                yield (begin_item, end_item, batch_rows)
 
     def _load(self, fn=None, rows=None):
+        descriptor = self._table._descriptor.SerializeToString()
+        # Items are read in parallel by the bindings, a batch of them at a
+        # time so that large columns are not held in memory at once
+        i = 0
+        for (begin_item, end_item, batch_rows) in self._item_batches(rows):
+            bufs = self._db._bindings.read_column_rows(
+                self._db.config.storage_config, self._db_path, descriptor,
+                self._descriptor.id, begin_item, end_item, batch_rows,
+                min(LOAD_THREADS, end_item - begin_item))
+            for buf in bufs:
+                yield (i, fn(buf, self._db) if fn is not None else buf)
+                i += 1
+
+    def _map_item(self, item_id, dtype, shape):
+        """
+        Memory maps the rows of an item of a local, uncompressed column, or
+        returns None if its file predates the offset table.
+        """
+        path = '{}/tables/{:d}/{:d}_{:d}.bin'.format(
+            self._db_path, self._table._descriptor.id, self._descriptor.id,
+            item_id)
+        (magic, num_rows, first) = np.fromfile(path, dtype=np.uint64,
+                                               count=3)
+        num_rows = int(num_rows)
+        row_size = dtype.itemsize * int(np.prod(shape))
+        if magic == ITEM_FILE_TENSOR_MAGIC:
+            # Tensor items have one element size instead of offsets
+            row_sizes_match = first == row_size
+            data_start = 24
+        elif magic == ITEM_FILE_OFFSETS_MAGIC:
+            offsets = np.fromfile(path, dtype=np.uint64,
+                                  count=num_rows + 3)[2:]
+            row_sizes_match = (np.diff(offsets) == row_size).all()
+            data_start = 16 + (num_rows + 1) * 8 + int(offsets[0])
+        else:
+            return None
+        if not row_sizes_match:
+            raise ScannerException(
+                'Column {} does not have rows of {:d} bytes'.format(
+                    self.name(), row_size))
+        if num_rows == 0:
+            return np.zeros((0,) + shape, dtype=dtype)
+        return np.memmap(path, dtype=dtype, mode='r', offset=data_start,
+                         shape=(num_rows,) + shape)
+
+    def _load_frame_batches(self, rows):
+        descriptor = self._table._descriptor.SerializeToString()
+        for (begin_item, end_item, batch_rows) in self._item_batches(rows):
+            (data, height, width) = self._db._bindings.decode_video_rows(
+                self._db.config.storage_config, self._db_path, descriptor,
+                self._descriptor.id, begin_item, end_item, batch_rows,
+                min(LOAD_THREADS, end_item - begin_item))
+            if height == 0:
+                raise ScannerException(
+                    'Videos of column {} do not all have the same size'
+                    .format(self.name()))
+            yield np.frombuffer(data, dtype=np.uint8).reshape(
+                (-1, height, width, 3))
+
+    def load_frames(self, rows=None):
+        """
+        Decodes rows of a compressed video column without running a job.
+
+        Kwargs:
+            rows: Sorted rows to decode, or None for all of them.
+
+        Returns:
+            RGB frames of the rows as one array of shape
+            (rows, height, width, 3).
+        """
+        if not (self._descriptor.type == self._db.protobufs.Video and
+                self._video_descriptor.codec_type !=
+                self._db.protobufs.VideoDescriptor.RAW):
+            raise ScannerException(
+                'Column {} is not a compressed video'.format(self.name()))
+        batches = list(self._load_frame_batches(rows))
+        if len(batches) == 0:
+            return np.zeros((0, self._video_descriptor.height,
+                             self._video_descriptor.width, 3),
+                            dtype=np.uint8)
+        if len(batches) == 1:
+            return batches[0]
+        return np.concatenate(batches)
+
+    def tensor_type(self):
+        """
+        Returns the numpy dtype and row shape of a Tensor column.
+        """
+        if self._descriptor.type != self._db.protobufs.Tensor:
+            raise ScannerException(
+                'Column {} is not a tensor column'.format(self.name()))
+        dtype = TENSOR_DTYPES[self._descriptor.tensor_type]
+        return (np.dtype(dtype), tuple(self._descriptor.tensor_shape))
+
+    def load_array(self, dtype=None, shape=None, rows=None):
+        """
+        Loads a column whose rows all have the same size, such as histograms
+        or embeddings, as one array instead of a buffer per row.
+
+        Kwargs:
+            dtype: Type of the elements of each row. Defaults to the tensor
+                   type of Tensor columns.
+            shape: Shape of each row, () for a single element. Defaults to
+                   the tensor shape of Tensor columns, () otherwise.
+            rows: Sorted rows to load, or None for all of them.
+
+        Returns:
+            Array of shape (rows,) + shape. Whole columns of local,
+            uncompressed, unpacked tables are memory mapped rather than
+            read.
+        """
+        if dtype is None:
+            (dtype, tensor_shape) = self.tensor_type()
+            shape = tensor_shape if shape is None else shape
+        dtype = np.dtype(dtype)
+        shape = () if shape is None else tuple(shape)
         table_descriptor = self._table._descriptor
-        total_rows = table_descriptor.end_rows[-1]
+        arrays = None
+        if (rows is None and
+            self._db.config.config['storage']['type'] == 'posix' and
+            not table_descriptor.packed_items and
+            self._descriptor.block_codec == self._db.protobufs.Column.NONE):
+            arrays = [self._map_item(item_id, dtype, shape)
+                      for item_id in range(len(table_descriptor.end_rows))]
+            if any(a is None for a in arrays):
+                arrays = None
+        if arrays is None:
+            row_size = dtype.itemsize * int(np.prod(shape))
+            descriptor = table_descriptor.SerializeToString()
+            arrays = []
+            for (begin_item, end_item, batch_rows) in \
+                    self._item_batches(rows):
+                (data, element_size) = self._db._bindings.read_column_data(
+                    self._db.config.storage_config, self._db_path,
+                    descriptor, self._descriptor.id, begin_item, end_item,
+                    batch_rows, min(LOAD_THREADS, end_item - begin_item))
+                if element_size not in (0, row_size):
+                    raise ScannerException(
+                        'Column {} does not have rows of {:d} bytes'.format(
+                            self.name(), row_size))
+                arrays.append(np.frombuffer(data, dtype=dtype).reshape(
+                    (-1,) + shape))
+        if len(arrays) == 0:
+            return np.zeros((0,) + shape, dtype=dtype)
+        if len(arrays) == 1:
+            return arrays[0]
+        return np.concatenate(arrays)
+
+    def build_index(self, dimension=None, num_lists=None,
+                    num_subquantizers=None, threads=INDEX_THREADS):
+        """
+        Builds an approximate nearest neighbor index over the embeddings of
+        the column, which is stored with the table and used by search.
+
+        The index is an inverted file of product quantized embeddings
+        (IVF-PQ), built by the bindings in parallel over the items of the
+        column. Rows added to the table afterwards are not indexed until the
+        index is built again.
+
+        Kwargs:
+            dimension: Values of each float32 embedding. Float32 Tensor
+                       columns have one embedding per row and need none.
+                       Rows of other columns may hold several embeddings
+                       back to back, e.g. one per face, each indexed under
+                       its row.
+            num_lists: Clusters the embeddings are split into, about four
+                       times the square root of the rows by default.
+            num_subquantizers: Bytes each embedding is compressed to, which
+                               must divide its dimension. Defaults to a
+                               quarter of the dimension, at most 64.
+            threads: Items encoded at once.
+        """
+        if dimension is None:
+            (dtype, shape) = self.tensor_type()
+            dimension = int(np.prod(shape))
+        if num_lists is None:
+            num_lists = min(max(int(4 * math.sqrt(self._table.num_rows())),
+                                1), 65536)
+        if num_subquantizers is None:
+            num_subquantizers = max(
+                m for m in range(1, max(min(64, dimension // 4), 1) + 1)
+                if dimension % m == 0)
+        result = self._db._bindings.build_vector_index(
+            self._db.config.storage_config, self._db_path,
+            self._table._descriptor.SerializeToString(), self._descriptor.id,
+            dimension, num_lists, num_subquantizers, threads)
+        if not result.success():
+            raise ScannerException(result.msg())
+
+    def search(self, queries, k=10, num_probes=16, threads=INDEX_THREADS):
+        """
+        Finds the embeddings nearest to queries by L2 distance with the
+        index from build_index, reading only the clusters nearest to each
+        query.
+
+        Args:
+            queries: Array of one query or of a query per row.
+
+        Kwargs:
+            k: Embeddings found per query.
+            num_probes: Clusters searched per query. More find more of the
+                        true neighbors but read more of the index.
+            threads: Queries searched at once.
+
+        Returns:
+            Arrays of the rows of the embeddings and their approximate
+            squared distances, of shape (queries, k) and nearest first.
+            Rows are -1 where the clusters had fewer than k embeddings.
+        """
+        queries = np.asarray(queries, dtype=np.float32)
+        if queries.ndim == 1:
+            queries = queries.reshape((1, -1))
+        (result, rows, distances) = self._db._bindings.search_vector_index(
+            self._db.config.storage_config, self._db_path,
+            self._table._descriptor.SerializeToString(), self._descriptor.id,
+            queries.tobytes(), k, num_probes, threads)
+        if not result.success():
+            raise ScannerException(result.msg())
+        return (np.frombuffer(rows, dtype=np.int64).reshape((-1, k)),
+                np.frombuffer(distances, dtype=np.float32).reshape((-1, k)))
 
-        # Integer divide, round up
-        num_items = len(table_descriptor.end_rows)
-        bufs = []
-        input_rows = list(range(self._table.num_rows()))
-        assert len(input_rows) == total_rows
-        i = 0
-        rows_so_far = 0
-        rows_idx = 0
-        rows = range(total_rows) if rows is None else rows
-        prev = 0
-        for item_id in range(num_items):
-            start_row = prev
-            end_row = table_descriptor.end_rows[item_id]
-            item_rows = end_row - start_row
-            prev = end_row
-            select_rows = []
-            while rows_idx < len(rows):
-                r = rows[rows_idx]
-                if r >= start_row and r < end_row:
-                    select_rows.append(r - start_row)
-                    rows_idx += 1
-                else:
-                    break
-            if select_rows:
-                for output in self._load_output_file(item_id, select_rows, fn):
-                    yield (input_rows[i], output)
-                    i += 1
-            rows_so_far += item_rows
-
-    # TODO(wcrichto): don't show progress bar when running decode png
     def load(self, fn=None, rows=None):
         """
         Loads the results of a Scanner computation into Python.
@@ -120,28 +333,13 @@ class Column:
             `fn`).
         """
 
-        # If the column is a video, then dump the requested frames to disk as
-        # PNGs and return the decoded PNGs
+        # Compressed videos are decoded by the bindings a batch of items at
+        # a time
         if (self._descriptor.type == self._db.protobufs.Video and
-            self._video_descriptor.codec_type ==
-            self._db.protobufs.VideoDescriptor.H264):
-            png_table_name = self._db._png_dump_prefix.format(self._table.name())
-            if self._db.has_table(png_table_name):
-                png_table = self._db.table(png_table_name)
-                if rows is None and \
-                   png_table.num_rows() == self._table.num_rows() and \
-                   png_table._descriptor.timestamp > \
-                   self._table._descriptor.timestamp:
-                    return png_table.load(['img'], parsers.image)
-            pair = [(self._table.name(), png_table_name)]
-            if rows is None:
-                frame = self._table.as_op().all()
-            else:
-                frame = self._table.as_op().gather(rows)
-            img = self._db.ops.ImageEncoder(frame = frame)
-            job = Job(columns = [img], name = png_table_name)
-            [out_tbl] = self._db.run([job], force=True, show_progress=False)
-            return out_tbl.load(['img'], parsers.image)
+            self._video_descriptor.codec_type !=
+            self._db.protobufs.VideoDescriptor.RAW):
+            return enumerate(frame for frames in self._load_frame_batches(rows)
+                             for frame in frames)
         elif self._descriptor.type == self._db.protobufs.Video:
             frame_type = self._video_descriptor.frame_type
             if frame_type == self._db.protobufs.U8:
@@ -150,6 +348,8 @@ class Column:
                 dtype = np.float32
             elif frame_type == self._db.protobufs.F64:
                 dtype = np.float64
+            elif frame_type == self._db.protobufs.F16:
+                dtype = np.float16
             parser_fn = parsers.raw_frame_gen(self._video_descriptor.height,
                                               self._video_descriptor.width,
                                               self._video_descriptor.channels,
@@ -160,27 +360,27 @@ class Column:
 
     def save_mp4(self, output_name, fps=None, scale=None):
         if not (self._descriptor.type == self._db.protobufs.Video and
-                self._video_descriptor.codec_type ==
-                self._db.protobufs.VideoDescriptor.H264):
-            raise ScannerException('Attempted to save a non-h264-compressed '
+                self._video_descriptor.codec_type !=
+                self._db.protobufs.VideoDescriptor.RAW):
+            raise ScannerException('Attempted to save a non-compressed '
                                    'column as an mp4. Try compressing the '
                                    'column first by saving the output as '
                                    'an RGB24 frame')
+        if self._video_descriptor.source_path:
+            raise ScannerException('Column was ingested in place and is '
+                                   'the video {}'.format(
+                                       self._video_descriptor.source_path))
         num_items = len(self._table._descriptor.end_rows)
 
-        paths = ['{}/tables/{:d}/{:d}_{:d}.bin'.format(
-            self._db._db_path,
-            self._table._descriptor.id, self._descriptor.id, item_id)
-                          for item_id in range(num_items)]
         temp_paths = []
-        for _ in range(len(paths)):
+        for _ in range(num_items):
             fd, p = tempfile.mkstemp()
             os.close(fd)
             temp_paths.append(p)
         # Copy all files locally before calling ffmpeg
-        for in_path, temp_path in zip(paths, temp_paths):
+        for item_id, temp_path in enumerate(temp_paths):
             with open(temp_path, 'w') as f:
-                f.write(self._storage.read(in_path))
+                f.write(self._read_item_column(item_id))
 
         files = '|'.join(temp_paths)
 
@@ -195,7 +395,7 @@ class Column:
         cmd = (
             'ffmpeg -y '
             '-r {fps:f} ' # set the input fps
-            '-i "concat:{input_files:s}" ' # concatenate the h264 files
+            '-i "concat:{input_files:s}" ' # concatenate the h264/hevc files
             '-c:v libx264 '
             '-filter:v "setpts=N" ' # h264 does not have pts' in it
             '{extra_args:s}'
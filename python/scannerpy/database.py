@@ -16,17 +16,23 @@ from multiprocessing import Process, Queue
 from subprocess import Popen, PIPE
 from random import choice
 from string import ascii_uppercase
-from threading import Thread
+from threading import Thread, Condition
+from multiprocessing.pool import ThreadPool
 # Scanner imports
 from common import *
 from profiler import Profiler
+from tuner import Tuner
 from config import Config
 from op import OpGenerator, Op, OpColumn
-from sampler import TableSampler
+from sampler import TableSampler, DEFAULT_TASK_SIZE
 from collection import Collection
 from table import Table
+from table_writer import TableWriter, WRITE_THREADS
 from column import Column
 
+# Threads reading the descriptors of tables missing from the manifest
+DESCRIPTOR_READ_THREADS = 16
+
 def start_master(port=None, config=None, config_path=None, block=False):
     """
     Start a master server instance on this node.
@@ -99,6 +105,23 @@ def start_worker(master_address, port=None, config=None, config_path=None,
     return result
 
 
+def drain_worker(worker_address):
+    """
+    Removes a worker from the cluster without failing the jobs it runs.
+
+    The master hands the worker no more work, and the worker shuts down once
+    it has finished the items it holds. Blocks until then.
+
+    Args:
+        worker_address: The address of the worker, e.g. 'host:5002'.
+    """
+    import scanner.engine.rpc_pb2 as rpc_types
+    worker = rpc_types.WorkerStub(grpc.insecure_channel(worker_address))
+    result = worker.Drain(rpc_types.Empty())
+    if not result.success:
+        raise ScannerException('Failed to drain worker: {}'.format(result.msg))
+
+
 class Database:
     """
     Entrypoint for all Scanner operations.
@@ -135,6 +158,8 @@ class Database:
         self._debug = debug or (master is None and workers is None)
 
         self._master = None
+        # Temporary tables run by this client, deleted when it stops
+        self._local_tables = set()
 
         import libscanner as bindings
         self._bindings = bindings
@@ -143,7 +168,7 @@ class Database:
         self._db_path = self.config.db_path
         self._storage = self.config.storage
         self._cached_db_metadata = None
-        self._png_dump_prefix = '__png_dump_{:s}'
+        self._cached_manifest = None
 
         self.ops = OpGenerator(self)
         self.protobufs = ProtobufGenerator(self.config)
@@ -266,8 +291,34 @@ class Database:
                 self.protobufs.DatabaseDescriptor,
                 'db_metadata.bin')
             self._cached_db_metadata = desc
+            self._cached_manifest = None
         return self._cached_db_metadata
 
+    def _load_manifest(self):
+        """
+        Loads the table and video descriptors collected in the database
+        manifest, keyed by table id and by (table id, column id, item id).
+        """
+        db_meta = self._load_db_metadata()
+        if self._cached_manifest is None:
+            tables = {}
+            videos = {}
+            for i in range(db_meta.manifest_base, db_meta.manifest_next):
+                try:
+                    segment = self._load_descriptor(
+                        self.protobufs.DatabaseManifest,
+                        'manifest/{:d}.bin'.format(i))
+                except Exception:
+                    # Descriptors missing from the manifest are read
+                    # individually
+                    continue
+                for t in segment.tables:
+                    tables[t.id] = t
+                for v in segment.videos:
+                    videos[(v.table_id, v.column_id, v.item_id)] = v
+            self._cached_manifest = (tables, videos)
+        return self._cached_manifest
+
     def _connect_to_master(self):
         channel = grpc.insecure_channel(
             self._master_address,
@@ -438,6 +489,8 @@ class Database:
                      '{}/stdlib_pb2.py'.format(stdlib_path))
 
     def stop_cluster(self):
+        if self._local_tables:
+            self._delete_local_tables()
         if self._master:
             # Stop heartbeat
             self._stop_heartbeat()
@@ -488,13 +541,39 @@ class Database:
         op_path.path = so_path
         self._try_rpc(lambda: self._master.LoadOp(op_path))
 
-    def register_python_op(self, kernel_path):
+    def register_python_op(self, kernel_path, subprocess=False):
+        """
+        Makes a Python file with a Kernel class usable as an op.
+
+        The Kernel is constructed with the keyword arguments given to the op.
+        Its execute(cols) method is called once per row with a numpy array
+        for each frame column and a str for each other column, and returns
+        one output per column. If the Kernel defines execute_batch(cols)
+        that is called once per batch instead: each frame column is one
+        (rows, height, width, channels) array, each other column is a list,
+        and each output is either an array with a row per input row or a
+        list of one output per row. Outputs can be str or any object with
+        the buffer protocol, such as a numpy array.
+
+        Args:
+            kernel_path: Path to the Python file of the kernel.
+
+        Kwargs:
+            subprocess: Run each instance of the kernel in its own Python
+                        process, so that pipeline instances of the op are not
+                        serialized by the GIL of the worker. Rows and outputs
+                        are passed through shared memory.
+
+        Returns:
+            A function that builds the op from its inputs and arguments.
+        """
         kernel_path = os.path.abspath(kernel_path)
         def make_op(*args, **kwargs):
             return self.ops.Python(
                 *args,
                 py_args = pickle.dumps(kwargs),
-                kernel_path = kernel_path)
+                kernel_path = kernel_path,
+                subprocess = subprocess)
 
         return make_op
 
@@ -549,7 +628,11 @@ class Database:
 
         return self.collection(collection_name)
 
-    def ingest_videos(self, videos, force=False):
+    def ingest_videos(self, videos, force=False, num_threads=0,
+                      segment_size=0, in_place=False, append=False,
+                      transcode_keyframe_distance=0, transcode_width=0,
+                      transcode_height=0, transcode_quality=0,
+                      proxy_height=0):
         """
         Creates a Table from a video.
 
@@ -559,6 +642,30 @@ class Database:
 
         Kwargs:
             force: TODO(wcrichto)
+            num_threads: Number of videos to ingest at once. Ingest is mostly
+                bound by I/O, so this can usefully exceed the number of
+                cores. 0 uses one thread per core.
+            segment_size: Videos larger than this many bytes are split at
+                keyframes into segments that are ingested in parallel, each
+                becoming an item of the video's table. 0 never splits.
+            in_place: Only index the videos instead of copying them into the
+                database. They are read from their paths, which must not
+                move, whenever they are used. Videos whose container does
+                not store packets as is are copied anyway.
+            append: Add videos named after existing ingested tables to the
+                end of those tables as new items instead of failing. Jobs
+                run with resume=True then only process the new rows.
+            transcode_keyframe_distance: Re-encode the videos as H.264 with
+                a keyframe every this many frames, so that sampling a few
+                frames does not decode whole long GOPs of the source. 0
+                keeps the source bytestream.
+            transcode_width, transcode_height: Size of re-encoded videos. 0
+                keeps the source size, or its aspect ratio when only the
+                other one is given.
+            transcode_quality: CRF of the encoder for re-encoded videos, 0
+                for its default.
+            proxy_height: If not 0, also makes a proxy of each ingested video
+                this many rows tall, see make_proxy.
 
         Returns:
             (list of created Tables, list of (path, reason) failures to ingest)
@@ -569,7 +676,7 @@ class Database:
 
         [table_names, paths] = zip(*videos)
         for table_name in table_names:
-            if self.has_table(table_name):
+            if self.has_table(table_name) and not append:
                 if force is True:
                     self._delete_table(table_name)
                 else:
@@ -580,6 +687,15 @@ class Database:
         ingest_params = self.protobufs.IngestParameters()
         ingest_params.table_names.extend(table_names)
         ingest_params.video_paths.extend(paths)
+        ingest_params.num_threads = num_threads
+        ingest_params.segment_size = segment_size
+        ingest_params.in_place = in_place
+        ingest_params.append = append
+        ingest_params.transcode.keyframe_distance = \
+            transcode_keyframe_distance
+        ingest_params.transcode.width = transcode_width
+        ingest_params.transcode.height = transcode_height
+        ingest_params.transcode.quality = transcode_quality
         ingest_result = self._try_rpc(
             lambda: self._master.IngestVideos(ingest_params))
         if not ingest_result.result.success:
@@ -587,9 +703,186 @@ class Database:
         failures = zip(ingest_result.failed_paths, ingest_result.failed_messages)
 
         self._cached_db_metadata = None
-        return ([self.table(t) for (t, p) in videos
-                if p not in ingest_result.failed_paths],
-                failures)
+        tables = [self.table(t) for (t, p) in videos
+                  if p not in ingest_result.failed_paths]
+        if proxy_height > 0:
+            self.make_proxy(tables, proxy_height, force=True)
+        return (tables, failures)
+
+    def make_proxy(self, tables, height, force=False):
+        """
+        Saves a copy of the frame column of each table, resized to be height
+        rows tall with the same aspect ratio and encoded as H.264. Videos no
+        taller are copied at their size.
+
+        Jobs over a table whose ops reading its frames all declare a
+        max_input_height of at least height decode the tallest such proxy
+        instead of the video, which is much cheaper for sources of a far
+        higher resolution. A proxy stops being used once rows are appended
+        to its table, until it is made again with force.
+
+        Args:
+            tables: List of Tables or table names with a frame column.
+            height: Rows of the proxy frames.
+
+        Kwargs:
+            force: Replace existing proxies of the same height.
+
+        Returns:
+            List of the proxy Tables.
+        """
+
+        proxies = []
+        for table in tables:
+            if isinstance(table, basestring):
+                table = self.table(table)
+            frame = table.as_op().all()
+            resized = self.ops.Resize(frame=frame, height=height,
+                                      preserve_aspect=True, min=True)
+            name = self._proxy_table_name(table.name(), height)
+            proxies.append(self.run(
+                Job(columns=[resized.compress_video()], name=name),
+                force=force, show_progress=False))
+        return proxies
+
+    def _proxy_table_name(self, table_name, height):
+        return '__proxy_{:d}_{}'.format(height, table_name)
+
+    def _use_proxies(self, ops, tasks):
+        """
+        Replaces the video tables sampled by tasks with their proxies, when
+        every op reading the input frames declares a max_input_height and
+        a proxy that tall or less is current.
+        """
+        limit = None
+        for op in ops[1:]:
+            if not any(i.op_index == 0 and
+                       any(c != 'index' for c in i.columns)
+                       for i in op.inputs):
+                continue
+            height = (self._get_op_info(op.name).max_input_height
+                      if op.name != 'OutputTable' else 0)
+            if height <= 0:
+                return
+            limit = height if limit is None else min(limit, height)
+        if limit is None:
+            return
+
+        db_meta = self._load_db_metadata()
+        prefix = '__proxy_'
+        for task in tasks:
+            for sample in task.samples:
+                if any(c not in ('index', 'frame')
+                       for c in sample.column_names):
+                    continue
+                suffix = '_' + sample.table_name
+                num_rows = None
+                best = None
+                for t in db_meta.tables:
+                    if not (t.name.startswith(prefix) and
+                            t.name.endswith(suffix)):
+                        continue
+                    height = t.name[len(prefix):-len(suffix)]
+                    if (not height.isdigit() or int(height) > limit or
+                        (best is not None and int(height) <= best[0])):
+                        continue
+                    if num_rows is None:
+                        num_rows = self.table(sample.table_name).num_rows()
+                    # Proxies of tables with rows appended since are stale
+                    if self.table(t.name).num_rows() == num_rows:
+                        best = (int(height), t.name)
+                if best is not None:
+                    sample.table_name = best[1]
+
+    def ingest_stream(self, table_name, url, item_frames=0, max_items=0,
+                      force=False):
+        """
+        Creates a Table from a live video stream, adding an item to it each
+        time the stream passes a keyframe. Blocks until the stream is done,
+        so it is usually called from its own thread while run_standing
+        processes the items as they arrive.
+
+        Args:
+            table_name: String name of the Table to create.
+            url: Address of the stream, such as rtsp://... or an HLS
+                 playlist.
+
+        Kwargs:
+            item_frames: An item is cut at the first keyframe after this many
+                         frames. 0 cuts at every keyframe, which keeps the
+                         latency of jobs over the stream lowest.
+            max_items: Stop after this many items. 0 ingests until the stream
+                       ends.
+            force: Replace an existing table of the same name.
+
+        Returns:
+            The ingested Table.
+        """
+
+        if self.has_table(table_name):
+            if force is True:
+                self.delete_table(table_name)
+            else:
+                raise ScannerException(
+                    'Attempted to ingest over existing table {}'
+                    .format(table_name))
+        stream_params = self.protobufs.IngestStreamParameters()
+        stream_params.table_name = table_name
+        stream_params.url = url
+        stream_params.item_frames = item_frames
+        stream_params.max_items = max_items
+        self._try_rpc(lambda: self._master.IngestStream(stream_params))
+
+        self._cached_db_metadata = None
+        return self.table(table_name)
+
+    def ingest_images(self, table_name, paths, num_threads=0,
+                      images_per_item=0, force=False):
+        """
+        Creates a Table from a list of JPEG, PNG or BMP images, with an img
+        column of the encoded images and a path column of their paths.
+
+        Args:
+            table_name: String name of the Table to create.
+            paths: List of image paths.
+
+        Kwargs:
+            num_threads: Number of threads reading and writing images. 0 uses
+                         one thread per core.
+            images_per_item: Images packed into each item. Rows are grouped
+                             by encoding, color space and size, and an item
+                             only holds images of one group. 0 uses 1024.
+            force: Replace an existing table of the same name.
+
+        Returns:
+            (Table, list of (path, reason) failures to ingest)
+        """
+
+        if len(paths) == 0:
+            raise ScannerException('Must ingest at least one image.')
+
+        if self.has_table(table_name):
+            if force is True:
+                self._delete_table(table_name)
+                self._save_descriptor(self._load_db_metadata(),
+                                      'db_metadata.bin')
+            else:
+                raise ScannerException(
+                    'Attempted to ingest over existing table {}'
+                    .format(table_name))
+        ingest_params = self.protobufs.IngestImagesParameters()
+        ingest_params.table_name = table_name
+        ingest_params.image_paths.extend(paths)
+        ingest_params.num_threads = num_threads
+        ingest_params.images_per_item = images_per_item
+        ingest_result = self._try_rpc(
+            lambda: self._master.IngestImages(ingest_params))
+        if not ingest_result.result.success:
+            raise ScannerException(ingest_result.result.msg)
+        failures = zip(ingest_result.failed_paths, ingest_result.failed_messages)
+
+        self._cached_db_metadata = None
+        return self.table(table_name), failures
 
     def ingest_video_collection(self, collection_name, videos, force=False):
         """
@@ -639,10 +932,26 @@ class Database:
         for i, t in enumerate(db_meta.tables):
             if t.id == table.id():
                 del db_meta.tables[i]
+                # The master deletes the files of the table between jobs
+                db_meta.deleted_tables.append(t.id)
                 return
         assert False
 
+    def _delete_local_tables(self):
+        # Workers remove the items of these tables from their disks when
+        # they next start a job
+        names = [name for name in self._local_tables if self.has_table(name)]
+        self._local_tables = set()
+        for name in names:
+            self._delete_table(name)
+        if len(names) > 0:
+            self._save_descriptor(self._load_db_metadata(), 'db_metadata.bin')
+
     def delete_table(self, name):
+        """
+        Removes a table from the database. Only the metadata is written
+        here, the master deletes the files of the table in the background.
+        """
         self._delete_table(name)
         self._save_descriptor(self._load_db_metadata(), 'db_metadata.bin')
 
@@ -682,6 +991,41 @@ class Database:
         self._cached_db_metadata = None
         return self.table(name)
 
+    def table_writer(self, name, columns, rows_per_item=DEFAULT_TASK_SIZE,
+                     threads=WRITE_THREADS, force=False):
+        """
+        Creates a new table from chunks of rows, such as features computed
+        outside of Scanner, without holding every row in memory.
+
+        The rows are written in parallel by the bindings, an item at a time,
+        in the same format as new_table. numpy arrays become Tensor columns,
+        so that Column.load_array reads them back as arrays.
+
+            with db.table_writer('features', ['embedding']) as writer:
+                for embeddings in batches:
+                    writer.write([embeddings])
+
+        Args:
+            name: String name of the table to create
+            columns: List of names of table columns
+
+        Kwargs:
+            rows_per_item: Rows written to each item of the table.
+            threads: Items written at once.
+            force: Deletes an existing table with the name.
+
+        Returns:
+            A TableWriter, whose commit returns the new table object.
+        """
+
+        if self.has_table(name):
+            if force:
+                self.delete_table(name)
+            else:
+                raise ScannerException('Attempted to create table with existing '
+                                       'name {}'.format(name))
+        return TableWriter(self, name, columns, rows_per_item, threads)
+
     def table(self, name):
         db_meta = self._load_db_metadata()
 
@@ -702,11 +1046,60 @@ class Database:
         else:
             raise ScannerException('Invalid table identifier')
 
-        descriptor = self._load_descriptor(
-            self.protobufs.TableDescriptor,
-            'tables/{}/descriptor.bin'.format(table_id))
+        tables, _ = self._load_manifest()
+        if table_id in tables:
+            descriptor = tables[table_id]
+        else:
+            descriptor = self._load_descriptor(
+                self.protobufs.TableDescriptor,
+                'tables/{}/descriptor.bin'.format(table_id))
         return Table(self, descriptor)
 
+    def tables(self, names):
+        """
+        Returns the tables with the given names or ids, in order.
+
+        Names are looked up with one pass over the database metadata and
+        descriptors missing from the manifest are read in parallel, so this
+        is much faster than calling table() for each of many tables.
+        """
+        db_meta = self._load_db_metadata()
+        name_ids = {}
+        for table in db_meta.tables:
+            if name_ids.get(table.name, table.id) != table.id:
+                raise ScannerException(
+                    'Internal error: multiple tables with same name: {}'
+                    .format(table.name))
+            name_ids[table.name] = table.id
+
+        table_ids = []
+        for name in names:
+            if isinstance(name, basestring):
+                if name not in name_ids:
+                    raise ScannerException(
+                        'Table with name {} not found'.format(name))
+                table_ids.append(name_ids[name])
+            elif isinstance(name, int):
+                table_ids.append(name)
+            else:
+                raise ScannerException('Invalid table identifier')
+
+        tables, _ = self._load_manifest()
+        descriptors = {}
+        missing = list(set(i for i in table_ids if i not in tables))
+        if len(missing) > 0:
+            def read(table_id):
+                return self._load_descriptor(
+                    self.protobufs.TableDescriptor,
+                    'tables/{}/descriptor.bin'.format(table_id))
+            pool = ThreadPool(min(DESCRIPTOR_READ_THREADS, len(missing)))
+            try:
+                descriptors = dict(zip(missing, pool.map(read, missing)))
+            finally:
+                pool.close()
+        return [Table(self, tables[i] if i in tables else descriptors[i])
+                for i in table_ids]
+
     def profiler(self, job_name):
         db_meta = self._load_db_metadata()
         if isinstance(job_name, basestring):
@@ -722,6 +1115,38 @@ class Database:
 
         return Profiler(self, job_id)
 
+    def ingest_profiler(self):
+        """
+        Returns a Profiler of the last video ingest.
+
+        Its 'ingest' workers are the ingest threads of each node, with node
+        -1 for the master, and record time spent opening, reading, demuxing,
+        indexing, transcoding and writing videos and committing the
+        database metadata.
+        """
+        return Profiler(self)
+
+    def metrics(self):
+        """
+        Returns the live metrics of the master and of every worker that
+        answers in time.
+
+        The result maps 'master' to the master's metrics and 'workers' to a
+        list of each worker's. Each holds its 'node_id' and 'counters' and
+        'gauges' dicts from Prometheus-style names, e.g.
+        scanner_queue_depth{job="3",queue="load_work"}, to values.
+        """
+        metrics = self._try_rpc(
+            lambda: self._master.GetMetrics(self.protobufs.Empty()))
+
+        def node(m):
+            return {'node_id': m.node_id,
+                    'counters': dict(m.counters),
+                    'gauges': dict(m.gauges)}
+
+        return {'master': node(metrics.master),
+                'workers': [node(w) for w in metrics.workers]}
+
     def _get_op_info(self, op_name):
         op_info_args = self.protobufs.OpInfoArgs()
         op_info_args.op_name = op_name
@@ -834,8 +1259,224 @@ class Database:
         for t in input_tables[1:]:
             task.samples.extend(t._generator().samples)
 
+        memoized = [i for i, e in enumerate(eval_sorted) if e._memoize]
+
         return [e.to_proto(eval_index) for e in eval_sorted], \
-          task, input_tables[0]
+          task, input_tables[0], memoized
+
+    def _resize_decode_size(self, ops):
+        """
+        Returns the (width, height) every op reading the input columns
+        resizes them to, or None if they are not all fixed size Resize ops.
+        """
+        size = None
+        for op in ops[1:]:
+            if not any(i.op_index == 0 and
+                       any(c != 'index' for c in i.columns)
+                       for i in op.inputs):
+                continue
+            if op.name != 'Resize':
+                return None
+            args = self.protobufs.ResizeArgs()
+            args.ParseFromString(op.kernel_args)
+            if (args.width <= 0 or args.height <= 0 or args.min or
+                args.preserve_aspect):
+                return None
+            if size is not None and size != (args.width, args.height):
+                return None
+            size = (args.width, args.height)
+        return size
+
+    def _merge_jobs(self, jobs):
+        """
+        Returns a single job computing the outputs of all jobs, with their
+        input ops over the same samples of the same tables shared so that
+        the inputs are loaded and decoded once, and the output table of each
+        of its output columns, as an index into jobs.
+        """
+        canonical = {}
+        merged_inputs = None
+        columns = []
+        column_tables = []
+        for j, job in enumerate(jobs):
+            op = job.op(self)
+            inputs = []
+            explored = set()
+            stack = [op]
+            while len(stack) > 0:
+                c = stack.pop()
+                explored.add(c)
+                for col in c._inputs:
+                    if col._op._name == "InputTable":
+                        if col._op._collection is not None:
+                            raise ScannerException(
+                                'Jobs over collections can not be merged')
+                        key = col._op._generator().SerializeToString()
+                        col._op = canonical.setdefault(key, col._op)
+                        if col._op not in inputs:
+                            inputs.append(col._op)
+                    elif col._op not in explored:
+                        stack.append(col._op)
+            if merged_inputs is None:
+                merged_inputs = set(inputs)
+            elif merged_inputs != set(inputs):
+                raise ScannerException(
+                    'Job {} does not read the same samples as job {}, so '
+                    'they can not be merged'.format(job.name(),
+                                                    jobs[0].name()))
+            if j > 0:
+                # The first index column is added when the job is sorted
+                columns.append(OpColumn(self, inputs[0], 'index',
+                                        self.protobufs.Other))
+                column_tables.append(j)
+            columns.extend(op.inputs())
+            column_tables.extend([j] * len(op.inputs()))
+        return Job(columns, jobs[0].name()), [0] + column_tables
+
+    def _memo_key(self, ops, index, keys, decode_size):
+        """
+        Returns a hash of op index and the ops it reads from, by name, kernel
+        args, stencil, warmup and device, and of the size the input frames
+        are decoded at, which identifies its outputs for the same samples of
+        the same tables.
+        """
+        if index in keys:
+            return keys[index]
+        op = ops[index]
+        h = hashlib.sha1(op.name)
+        if index == 0:
+            h.update(str(decode_size))
+        else:
+            h.update(op.kernel_args)
+            h.update(str(list(op.stencil)))
+            h.update(str(op.warmup))
+            h.update(str(op.device_type))
+            for inp in op.inputs:
+                h.update(self._memo_key(ops, inp.op_index, keys, decode_size))
+                h.update(str(list(inp.columns)))
+        keys[index] = h.hexdigest()
+        return keys[index]
+
+    def _memo_table_name(self, op_key, task):
+        """
+        Returns the name of the table holding the outputs of the op with key
+        op_key for the samples of task. Tables are identified by id,
+        timestamp and number of rows, so rows appended since or a table
+        ingested again under the same name give a new cache entry.
+        """
+        h = hashlib.sha1(op_key)
+        for sample in task.samples:
+            table = self.table(sample.table_name)._descriptor
+            num_rows = table.end_rows[-1] if len(table.end_rows) > 0 else 0
+            h.update(str((table.id, table.timestamp, num_rows)))
+            h.update(str(list(sample.column_names)))
+            h.update(sample.sampling_function)
+            h.update(sample.sampling_args)
+        return '__memo_' + h.hexdigest()
+
+    def _substitute_memoized(self, job_params, m):
+        """
+        Replaces op m of job_params, and the ops it reads from, with reads of
+        tables holding its outputs for each task. Tables which earlier jobs
+        did not save are first computed by a job of just those ops.
+        """
+        task_set = job_params.task_set
+        ops = list(task_set.ops)
+        subgraph = set()
+        stack = [m]
+        while len(stack) > 0:
+            i = stack.pop()
+            if i == 0 or i in subgraph:
+                continue
+            subgraph.add(i)
+            stack.extend([inp.op_index for inp in ops[i].inputs])
+        # The ops after it may only read its outputs and the row index
+        for i, op in enumerate(ops[1:], 1):
+            if i in subgraph:
+                continue
+            for inp in op.inputs:
+                if ((inp.op_index in subgraph and inp.op_index != m) or
+                    (inp.op_index == 0 and
+                     any(c != 'index' for c in inp.columns))):
+                    raise ScannerException(
+                        'Op {} is memoized but op {} reads columns of the '
+                        'ops before it'.format(ops[m].name, op.name))
+
+        columns = ['index'] + [c.name for c in
+                               self._get_output_columns(ops[m].name)]
+        op_key = self._memo_key(
+            ops, m, {}, (job_params.decode_width, job_params.decode_height))
+        memo_tables = [self._memo_table_name(op_key, t)
+                       for t in task_set.tasks]
+        missing = [(t, name) for t, name in zip(task_set.tasks, memo_tables)
+                   if not self.has_table(name)]
+        if len(missing) > 0:
+            order = [0] + sorted(subgraph)
+            indices = {old: new for new, old in enumerate(order)}
+            memo_params = self.protobufs.JobParameters()
+            memo_params.CopyFrom(job_params)
+            memo_params.job_name = ''.join(
+                choice(ascii_uppercase) for _ in range(12))
+            memo_params.resume = False
+            memo_params.ClearField('task_set')
+            # Memo tables are always written in full and never streamed
+            memo_params.ClearField('stream_columns')
+            memo_params.stream_only = False
+            memo_params.max_items = 0
+            memo_params.ClearField('zone_map_columns')
+            # Memo tables are reused by later clients
+            memo_params.ClearField('local_tables')
+            for i in order:
+                op = memo_params.task_set.ops.add()
+                op.CopyFrom(ops[i])
+                if i > 0:
+                    for inp in op.inputs:
+                        inp.op_index = indices[inp.op_index]
+            output = memo_params.task_set.ops.add()
+            output.name = 'OutputTable'
+            output.batch = -1
+            output.device_type = DeviceType.to_proto(self, DeviceType.CPU)
+            for i, c in enumerate(columns):
+                inp = output.inputs.add()
+                inp.op_index = 0 if i == 0 else indices[m]
+                inp.columns.append(c)
+                opts = memo_params.task_set.compression.add()
+                opts.codec = 'default'
+            for t, name in missing:
+                task = memo_params.task_set.tasks.add()
+                task.CopyFrom(t)
+                task.output_table_name = name
+            self._try_rpc(lambda: self._master.NewJob(memo_params))
+            self._cached_db_metadata = None
+
+        # Read the saved outputs in place of the ops that computed them
+        remaining = [i for i in range(1, len(ops)) if i not in subgraph]
+        indices = {0: 0, m: 0}
+        for new, old in enumerate(remaining, 1):
+            indices[old] = new
+        input_op = self.protobufs.Op()
+        input_op.CopyFrom(ops[0])
+        del input_op.inputs[0].columns[:]
+        input_op.inputs[0].columns.extend(columns)
+        task_set.ClearField('ops')
+        task_set.ops.add().CopyFrom(input_op)
+        for i in remaining:
+            op = task_set.ops.add()
+            op.CopyFrom(ops[i])
+            for inp in op.inputs:
+                inp.op_index = indices[inp.op_index]
+        for task, name in zip(task_set.tasks, memo_tables):
+            del task.samples[:]
+            sampler_args = self.protobufs.AllSamplerArgs()
+            sampler_args.sample_size = DEFAULT_TASK_SIZE
+            sample = task.samples.add()
+            sample.table_name = name
+            sample.column_names.extend(columns)
+            sample.sampling_function = 'All'
+            sample.sampling_args = sampler_args.SerializeToString()
+        # The inputs are no longer the decoded videos
+        job_params.decode_width = 0
+        job_params.decode_height = 0
 
     def _parse_size_string(self, s):
         (prefix, suffix) = (s[:-1], s[-1])
@@ -854,11 +1495,49 @@ class Database:
             work_item_size=250,
             cpu_pool=None,
             gpu_pool=None,
+            gpu_staging='64M',
+            cpu_huge_pages=None,
+            pool_soft_limit=None,
+            pool_overflow=None,
             pipeline_instances_per_node=None,
             show_progress=True,
             profiling=False,
             load_sparsity_threshold=8,
-            tasks_in_queue_per_pu=4):
+            read_coalesce_gap='256K',
+            load_read_parallelism=4,
+            load_mmap=False,
+            direct_reads=False,
+            load_readahead_items=2,
+            load_readahead_size='512M',
+            save_upload_parallelism=8,
+            save_upload_size='1G',
+            pack_output_items=False,
+            decode_size=None,
+            decode_parallelism=1,
+            encode_parallelism=1,
+            codec_threads=0,
+            codec_slice_threads=False,
+            gpu_decode_surfaces=0,
+            balance_gpu_decode=False,
+            batch_latency_ms=0,
+            cpu_pipeline_instances=0,
+            tasks_in_queue_per_pu=4,
+            min_lease_size=1,
+            max_lease_size=0,
+            resume=False,
+            merge_jobs=False,
+            priority=1,
+            stream_columns=None,
+            stream_fn=None,
+            stream_ordered=False,
+            stream_only=False,
+            task_fn=None,
+            zone_map_columns=None,
+            local_tables=False,
+            tune=False,
+            tune_items=32,
+            tune_memory_limit=None,
+            _calibration_items=0):
         """
         Runs a computation over a set of inputs.
 
@@ -874,17 +1553,202 @@ class Database:
                                this name will be created for all the output
                                tables.
             force: TODO(wcrichto)
-            work_item_size: TODO(wcrichto)
+            work_item_size: Rows evaluated at once by each pipeline
+                            instance. Rounded up to a multiple of the batch
+                            sizes of the ops.
             cpu_pool: TODO(wcrichto)
             gpu_pool: TODO(wcrichto)
+            gpu_staging: Size of the pinned host buffer per GPU used to copy
+                         pageable host data to the GPU, e.g. '64M'. None
+                         disables it. Unused with a pinned CPU pool.
+            cpu_huge_pages: Size of the huge pages to back the CPU pool with,
+                            either '2M' or '1G'. Smaller pages are used if
+                            not enough huge pages are reserved. None uses
+                            ordinary pages.
+            pool_soft_limit: Fraction of the CPU and GPU pools, e.g. 0.9, that
+                             may be in use before workers stop loading new
+                             items until memory drains. None disables it.
+            pool_overflow: Memory a full pool may additionally allocate from
+                           the system, e.g. '2G', before the worker fails.
             pipeline_instances_per_node: TODO(wcrichto)
             show_progress: TODO(wcrichto)
+            read_coalesce_gap: Video byte ranges at most this far apart,
+                               e.g. '256K', are fetched with a single read
+                               when loading strided samples.
+            load_read_parallelism: Number of reads for one io item, across
+                                   columns and items, that each load worker
+                                   issues at once.
+            load_mmap: If true and the database is on local disk, loaded
+                       elements point into memory mapped item files instead
+                       of being copied.
+            direct_reads: If true and the database is on local disk,
+                          uncompressed columns are read by each pipeline
+                          instance straight into the memory of the device
+                          of its first op, with GPUDirect Storage if it is
+                          available.
+            load_readahead_items: Number of queued io items whose bytes are
+                                  read into the worker block cache while
+                                  earlier items are processed.
+            load_readahead_size: Most bytes, e.g. '512M', read ahead for
+                                 items that have not started loading.
+            save_upload_parallelism: Number of background uploads of
+                                     finished items per worker. Zero writes
+                                     items out on the save threads.
+            save_upload_size: Most bytes, e.g. '1G', of finished items held
+                              in memory while waiting to be uploaded.
+            pack_output_items: If true, all columns of each output item are
+                               written to a single file, which saves
+                               requests on object stores when items are
+                               small.
+            decode_size: (width, height) to decode videos at when it is
+                         smaller than the video, which is much cheaper than
+                         resizing full resolution frames later. 'auto' uses
+                         the size of the Resize ops if they are the only
+                         readers of the input frames. None decodes at full
+                         resolution.
+            decode_parallelism: Decoders per video column in each pipeline
+                                instance. Items with many independent
+                                keyframe intervals, as from sparse sampling,
+                                spread them over the decoders.
+            encode_parallelism: Segments of each output video column
+                                encoded concurrently in each pipeline
+                                instance. Every segment starts at a
+                                keyframe, so segments are as long as the
+                                keyframe distance.
+            codec_threads: Threads of each software video decoder and
+                           encoder. Zero divides the CPUs of each node
+                           between its pipeline instances.
+            codec_slice_threads: If true, codec threads split frames into
+                                 slices instead of working on several
+                                 frames at once. This avoids the latency of
+                                 frame threading for small sparse samples,
+                                 but only helps videos encoded with slices.
+            gpu_decode_surfaces: Surfaces each GPU decoder copies frames
+                                 out of at once, each on its own stream, so
+                                 that the copies overlap with decoding.
+                                 Zero keeps the default of 8.
+            balance_gpu_decode: If true, GPU decode sessions are spread over
+                                all GPUs of each node and the frames copied
+                                to the GPU that uses them, so that decode
+                                engines of GPUs without kernels are used.
+            batch_latency_ms: Milliseconds a task of a single work item,
+                              as from sparse sampling, may wait for the
+                              following tasks so that they are evaluated
+                              together and batched kernels see full
+                              batches. Zero evaluates each task on its own.
+                              Kernels are only reset once for the tasks
+                              evaluated together.
+            cpu_pipeline_instances: Pipeline instances per node, on top of
+                                    pipeline_instances_per_node, that run
+                                    the GPU ops which also have a CPU kernel
+                                    on the CPU. All instances pull work items
+                                    from one queue, so each takes them as
+                                    fast as it finishes them.
+            min_lease_size: Fewest io items the master will hand a worker in
+                            a single request once the job has started.
+            max_lease_size: Most io items the master will hand a worker in a
+                            single request. Zero means no limit.
+            resume: If the output tables already exist from an earlier run of
+                    the same job, only compute the items that were not
+                    written out, including those of rows appended to the
+                    input tables since.
+            merge_jobs: If true and jobs is a list of jobs with different
+                        outputs over the same inputs, they run together as a
+                        single job. Each input is loaded and decoded once
+                        for all of them and the outputs of each job are
+                        written to its own table. Merged jobs can not be
+                        resumed or contain filter ops.
+            priority: Weight of the job's share of the workers while other
+                      jobs run at the same time. Each worker holds the items
+                      of the jobs with work left in proportion to their
+                      priorities, so a small job started next to a long one
+                      finishes without waiting for it.
+            stream_columns: Names of output columns whose rows are sent
+                            straight to this client as each io item
+                            finishes, instead of only being read back from
+                            the output tables. Video columns can not be
+                            streamed.
+            stream_fn: Called with the output table name, the rows of the
+                       first input table the item was computed from and a
+                       dict from each streamed column to the serialized
+                       elements of those rows, for every finished item.
+            stream_ordered: If true, items are streamed in the order of the
+                            tasks and their rows instead of as they finish.
+            stream_only: If true, the output is only streamed and no output
+                         tables are written.
+            task_fn: Called with the names of the output tables of each
+                     task once all of its items are written, so that they
+                     can be read while later tasks are still running.
+            zone_map_columns: Names of Tensor output columns whose smallest
+                              and largest values are saved for each io
+                              item, so that later jobs can skip the items
+                              with TableSampler.zone_map.
+            local_tables: True, or a list of names of output tables, for
+                          temporary tables such as the inputs of a later
+                          job. Each item of them is kept on the local disk
+                          of the worker that computed it instead of in
+                          storage, and only jobs run on the same workers
+                          can read them, which run the items reading an
+                          item on its worker. They are deleted when this
+                          Database stops its cluster.
+            tune: If true, pipeline_instances_per_node, work_item_size and
+                  the batch sizes of batched ops are first picked from
+                  calibration runs of tune_items io items each, see
+                  scannerpy.tuner. The values picked are saved for the ops
+                  of the computation and reused by later tuned runs.
+            tune_items: Io items each calibration run computes.
+            tune_memory_limit: Most CPU memory a node may use in the runs
+                               whose values are picked, e.g. '8G'. None
+                               means no limit.
+
+        Ops created with memoize=True have their outputs saved to a table
+        for each task, named __memo_ followed by a hash of the op, the ops
+        it reads from, their args, stencils and warmup, the size frames are
+        decoded at and the sampled rows and versions of the input tables. Later jobs with the same hash read those tables
+        instead of computing the op again, so only the ops after it run. The
+        ops after it may only read its outputs and the row index. If several
+        ops are memoized, the last one is reused. Memo tables can be removed
+        with delete_table.
 
         Returns:
             Either the output Collection if output_collection is specified
-            or a list of Table objects.
+            or a list of Table objects. None if stream_only is set.
         """
 
+        if tune:
+            run_kwargs = dict(locals())
+            for k in ['self', 'jobs', 'tune', 'tune_items',
+                      'tune_memory_limit', '_calibration_items']:
+                del run_kwargs[k]
+            if resume or merge_jobs or stream_only:
+                raise ScannerException(
+                    'Tuned runs can not resume, merge jobs or only stream')
+            if tune_memory_limit is not None:
+                tune_memory_limit = self._parse_size_string(tune_memory_limit)
+            tuner = Tuner(self, jobs, tune_items, tune_memory_limit)
+            return self.run(jobs, **tuner.tune(run_kwargs))
+
+        if _calibration_items > 0:
+            # Calibration runs write tables of their own and are not seen by
+            # the caller, see Tuner
+            show_progress = False
+            stream_columns = None
+            task_fn = None
+
+        if stream_columns and stream_fn is None:
+            raise ScannerException('Streamed columns need a stream_fn')
+
+        # Output table of each output column of merged jobs
+        column_tables = []
+        shared_table_names = []
+        if merge_jobs and isinstance(jobs, list) and len(jobs) > 1:
+            if resume:
+                raise ScannerException('Merged jobs can not be resumed')
+            if any(job.name() is None for job in jobs):
+                raise ScannerException('Merged jobs must all be named')
+            shared_table_names = [job.name() for job in jobs[1:]]
+            jobs, column_tables = self._merge_jobs(jobs)
+
         # Get compression annotations
 
         compression_options = []
@@ -896,7 +1760,7 @@ class Database:
         for out_col in output_op.inputs():
             opts = self.protobufs.OutputColumnCompression()
             opts.codec = 'default'
-            if out_col._type == self.protobufs.Video:
+            if out_col._encode_options is not None:
                 for k, v in out_col._encode_options.iteritems():
                     if k == 'codec':
                         opts.codec = v
@@ -906,16 +1770,18 @@ class Database:
 
         output_collection = None
         if isinstance(jobs, list):
-            ops, task, _ = self._toposort(jobs[0])
+            ops, task, _, memoized = self._toposort(jobs[0])
             tasks = [task] + [self._toposort(job)[1] for job in jobs[1:]]
         else:
             job = jobs
-            ops, task, input_op = self._toposort(job)
+            ops, task, input_op, memoized = self._toposort(job)
+            task.shared_output_table_names.extend(shared_table_names)
             tasks = [task]
             collection = input_op._collection
-            if collection is not None:
+            if collection is not None and _calibration_items == 0:
                 output_collection = job.name()
-                if self.has_collection(output_collection) and not force:
+                if (self.has_collection(output_collection) and not force
+                    and not resume):
                     raise ScannerException(
                         'Collection with name {} already exists'
                         .format(output_collection))
@@ -926,13 +1792,23 @@ class Database:
                         t.name().split(':')[-1])
                     tasks.append(t_task)
 
-        for task in tasks:
-            if self.has_table(task.output_table_name):
-                if force:
-                    self._delete_table(task.output_table_name)
+        # Resumed jobs keep reading the tables their earlier items read
+        if not resume:
+            self._use_proxies(ops, tasks)
+
+        if _calibration_items > 0:
+            for t in tasks:
+                t.output_table_name = '__tune_' + t.output_table_name
+
+        for name in [t.output_table_name for t in tasks] + shared_table_names:
+            if self.has_table(name):
+                if resume:
+                    continue
+                if force or _calibration_items > 0:
+                    self._delete_table(name)
                 else:
                     raise ScannerException('Job would overwrite existing table {}'
-                                           .format(task.output_table_name))
+                                           .format(name))
         self._save_descriptor(self._load_db_metadata(), 'db_metadata.bin')
 
         job_params = self.protobufs.JobParameters()
@@ -941,12 +1817,52 @@ class Database:
         job_params.task_set.tasks.extend(tasks)
         job_params.task_set.ops.extend(ops)
         job_params.task_set.compression.extend(compression_options)
+        job_params.task_set.output_column_tables.extend(column_tables)
         job_params.pipeline_instances_per_node = pipeline_instances_per_node or -1
         job_params.work_item_size = work_item_size
         job_params.show_progress = show_progress
         job_params.profiling = profiling
         job_params.tasks_in_queue_per_pu = tasks_in_queue_per_pu
         job_params.load_sparsity_threshold = load_sparsity_threshold
+        job_params.read_coalesce_gap = \
+            self._parse_size_string(read_coalesce_gap)
+        job_params.load_read_parallelism = load_read_parallelism
+        job_params.load_mmap = load_mmap
+        job_params.direct_reads = direct_reads
+        job_params.load_readahead_items = load_readahead_items
+        job_params.load_readahead_size = \
+            self._parse_size_string(load_readahead_size)
+        job_params.save_upload_parallelism = save_upload_parallelism
+        job_params.save_upload_size = \
+            self._parse_size_string(save_upload_size)
+        job_params.pack_output_items = pack_output_items
+        if decode_size == 'auto':
+            decode_size = self._resize_decode_size(ops)
+        if decode_size is not None:
+            (job_params.decode_width, job_params.decode_height) = decode_size
+        job_params.decode_parallelism = decode_parallelism
+        job_params.encode_parallelism = encode_parallelism
+        job_params.codec_threads = codec_threads
+        job_params.codec_slice_threads = codec_slice_threads
+        job_params.gpu_decode_surfaces = gpu_decode_surfaces
+        job_params.balance_gpu_decode = balance_gpu_decode
+        job_params.batch_latency_ms = batch_latency_ms
+        job_params.cpu_pipeline_instances = cpu_pipeline_instances
+        job_params.min_lease_size = min_lease_size
+        job_params.max_lease_size = max_lease_size
+        job_params.resume = resume
+        job_params.priority = priority
+        job_params.stream_columns.extend(stream_columns or [])
+        job_params.stream_ordered = stream_ordered
+        job_params.stream_only = stream_only
+        job_params.zone_map_columns.extend(zone_map_columns or [])
+        job_params.max_items = _calibration_items
+        if local_tables is True:
+            local_tables = [t.output_table_name for t in tasks] + \
+                           shared_table_names
+        job_params.local_tables.extend(local_tables or [])
+        if _calibration_items == 0 and not stream_only:
+            self._local_tables.update(job_params.local_tables)
 
         job_params.memory_pool_config.pinned_cpu = False
         if cpu_pool is not None:
@@ -962,11 +1878,37 @@ class Database:
             size = self._parse_size_string(gpu_pool)
             job_params.memory_pool_config.gpu.free_space = size
 
+        if gpu_staging is not None:
+            job_params.memory_pool_config.gpu_staging_size = \
+                self._parse_size_string(gpu_staging)
+
+        for pool in [job_params.memory_pool_config.cpu,
+                     job_params.memory_pool_config.gpu]:
+            if pool_soft_limit is not None:
+                pool.soft_limit = pool_soft_limit
+            if pool_overflow is not None:
+                pool.overflow_size = self._parse_size_string(pool_overflow)
+
+        if cpu_huge_pages is not None:
+            job_params.memory_pool_config.cpu_huge_page_size = \
+                self._parse_size_string(cpu_huge_pages)
+
+        # Ops after the last memoized op read its saved outputs
+        if len(memoized) > 0:
+            self._substitute_memoized(job_params, memoized[-1])
+
         # Run the job
-        self._try_rpc(lambda: self._master.NewJob(job_params))
+        if stream_columns or task_fn is not None:
+            self._stream_job(job_params, stream_fn, task_fn)
+        else:
+            self._try_rpc(lambda: self._master.NewJob(job_params))
 
         # Invalidate db metadata because of job run
         self._cached_db_metadata = None
+        if stream_only:
+            return None
+        if _calibration_items > 0:
+            return job_name
 
         db_meta = self._load_db_metadata()
         job_id = None
@@ -979,14 +1921,174 @@ class Database:
         # Return a new collection if the input was a collection, otherwise
         # return a table list
         table_names = [task.output_table_name for task in tasks]
+        if len(shared_table_names) > 0:
+            return [self.table(t) for t in table_names + shared_table_names]
         if output_collection is not None:
-            return self.new_collection(output_collection, table_names, force, job_id)
+            return self.new_collection(output_collection, table_names,
+                                       force or resume, job_id)
         else:
             if isinstance(jobs, list):
                 return [self.table(t) for t in table_names]
             else:
                 return self.table(table_names[0])
 
+    def run_async(self, jobs, **kwargs):
+        """
+        Starts a computation like run without waiting for it to finish.
+
+        Args:
+            jobs: As for run.
+
+        Kwargs:
+            As for run.
+
+        Returns:
+            A JobHandle for the computation.
+        """
+
+        return JobHandle(self, jobs, kwargs)
+
+    def _stream_job(self, job_params, stream_fn, task_fn):
+        result = None
+        try:
+            for output in self._master.StreamJob(job_params):
+                if output.finished:
+                    result = output.result
+                    break
+                if output.HasField('task'):
+                    if task_fn is not None:
+                        # Readers of the table need the current metadata
+                        self._cached_db_metadata = None
+                        task_fn(list(output.task.table_names))
+                    continue
+                item = output.item
+                stream_fn(item.table_name, list(item.rows),
+                          {c.name: list(c.elements) for c in item.columns})
+        except grpc.RpcError as e:
+            raise ScannerException(e)
+
+        if result is None:
+            raise ScannerException('Job stream ended before the job finished')
+        if not result.success:
+            raise ScannerException(result.msg)
+
+    def run_standing(self, jobs, until, interval=1.0, **kwargs):
+        """
+        Runs a computation over and over with resume, so that each run only
+        processes the rows added to its input tables since the last one, such
+        as the items of a stream being ingested by ingest_stream.
+
+        Args:
+            jobs: As for run.
+            until: Function of no arguments returning True once the inputs
+                   stop growing. The computation is run once more after that
+                   to catch the last rows.
+
+        Kwargs:
+            interval: Seconds to wait between runs.
+            Any other keyword argument is passed on to run.
+
+        Returns:
+            What the last run returned.
+        """
+
+        while True:
+            done = until()
+            # Pick up the tables and rows added since the last run
+            self._cached_db_metadata = None
+            output = self.run(jobs, resume=True, **kwargs)
+            if done:
+                return output
+            time.sleep(interval)
+
+
+class JobHandle:
+    """
+    A computation started by Database.run_async, which runs in the
+    background. The output tables of each task can be read as soon as the
+    task is finished, while later tasks are still running.
+    """
+
+    def __init__(self, db, jobs, kwargs):
+        self._cond = Condition()
+        self._finished = []
+        self._done = False
+        self._result = None
+        self._error = None
+        user_task_fn = kwargs.pop('task_fn', None)
+
+        def task_fn(table_names):
+            with self._cond:
+                self._finished.append(table_names)
+                self._cond.notify_all()
+            if user_task_fn is not None:
+                user_task_fn(table_names)
+
+        def run():
+            result = None
+            error = None
+            try:
+                result = db.run(jobs, task_fn=task_fn, **kwargs)
+            except Exception as e:
+                error = e
+            with self._cond:
+                self._result = result
+                self._error = error
+                self._done = True
+                self._cond.notify_all()
+
+        self._thread = Thread(target=run)
+        self._thread.daemon = True
+        self._thread.start()
+
+    def done(self):
+        """Whether the computation has finished."""
+        with self._cond:
+            return self._done
+
+    def finished_tasks(self):
+        """
+        Lists the output table names of each task finished so far, in the
+        order they finished.
+        """
+        with self._cond:
+            return list(self._finished)
+
+    def tasks(self):
+        """
+        Yields the output table names of each task as it finishes, until the
+        computation is done.
+        """
+        i = 0
+        while True:
+            with self._cond:
+                while i == len(self._finished) and not self._done:
+                    self._cond.wait(1.0)
+                if i == len(self._finished):
+                    return
+                table_names = self._finished[i]
+            i += 1
+            yield table_names
+
+    def wait(self, timeout=None):
+        """
+        Waits for the computation to finish.
+
+        Kwargs:
+            timeout: Most seconds to wait, or None to wait until it is done.
+
+        Returns:
+            What run returned, or None if the computation is still running
+            after timeout seconds.
+        """
+        self._thread.join(timeout)
+        with self._cond:
+            if not self._done:
+                return None
+            if self._error is not None:
+                raise self._error
+            return self._result
+
 
 class ProtobufGenerator:
     def __init__(self, cfg):
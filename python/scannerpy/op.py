@@ -13,6 +13,8 @@ class OpColumn:
             self._encode_options = {'codec': 'default'}
 
     def compress(self, codec = 'video', **kwargs):
+        if codec in ['lz4', 'zstd']:
+            return self.compress_blocks(codec, **kwargs)
         self._assert_is_video()
         codecs = {'video': self.compress_video,
                   'default': self.compress_default,
@@ -44,6 +46,19 @@ class OpColumn:
         encode_options = {'codec': 'default'}
         return self._new_compressed_column(encode_options)
 
+    def compress_blocks(self, codec = 'lz4', level = 0):
+        """
+        Compresses the element data of a non-video column in blocks with
+        codec, either 'lz4' for speed or 'zstd' for density. A level of 0
+        uses the codec default.
+        """
+        if self._type == self._db.protobufs.Video:
+            raise ScannerException(
+                'Block compression is not supported for video column {}.'
+                .format(self._col))
+        encode_options = {'codec': codec, 'level': level}
+        return self._new_compressed_column(encode_options)
+
     def _assert_is_video(self):
         if self._type != self._db.protobufs.Video:
             raise ScannerException(
@@ -95,8 +110,10 @@ class OpGenerator:
             warmup = kwargs.pop('warmup', 0)
             stencil = kwargs.pop('stencil', [])
             args = kwargs.pop('args', None)
+            memoize = kwargs.pop('memoize', False)
             op = Op(self._db, name, inputs, device, batch, warmup, stencil,
                     kwargs if args is None else args)
+            op._memoize = memoize
             return op.outputs()
 
         return make_op
@@ -113,6 +130,8 @@ class Op:
         self._stencil = stencil
         self._args = args
         self._task = None
+        # Whether outputs are saved and reused by later jobs, see Database.run
+        self._memoize = False
 
     @classmethod
     def input(cls, db, inputs, generator, collection):
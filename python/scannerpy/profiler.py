@@ -2,6 +2,13 @@ import struct
 import json
 from common import *
 
+# Starts a section in format version 2 or later; version 1 sections start
+# with the node id instead
+PROFILER_SECTION_MAGIC = 0x454c49464f525053
+
+# Pipeline stages an item passes through, in order
+STAGES = ['load', 'pre', 'eval', 'post', 'save']
+
 
 def read_advance(fmt, buf, offset):
     new_offset = offset + struct.calcsize(fmt)
@@ -9,23 +16,89 @@ def read_advance(fmt, buf, offset):
 
 
 def unpack_string(buf, offset):
-    s = ''
-    while True:
-        t, offset = read_advance('B', buf, offset)
-        c = t[0]
-        if c == 0:
-            break
-        s += str(chr(c))
-    return s, offset
+    end = buf.index(b'\0', offset)
+    s = buf[offset:end]
+    if not isinstance(s, str):
+        s = s.decode('utf-8')
+    return s, end + 1
+
+
+def decode_varints(buf, offset, size, count):
+    """Decodes count LEB128 varints from the size bytes at offset in buf."""
+    if count == 0:
+        return np.zeros(0, dtype=np.uint64)
+    data = np.frombuffer(buf, dtype=np.uint8, count=size, offset=offset)
+    # Every varint ends at the first byte without the continuation bit
+    ends = np.flatnonzero(data < 0x80)
+    assert len(ends) == count
+    starts = np.empty_like(ends)
+    starts[0] = 0
+    starts[1:] = ends[:-1] + 1
+    shifts = (np.arange(size) - np.repeat(starts, ends - starts + 1)) * 7
+    values = ((data & 0x7f).astype(np.uint64) <<
+              shifts.astype(np.uint64))
+    return np.add.reduceat(values, starts)
+
+
+def decode_zigzag(values):
+    one = np.uint64(1)
+    return ((values >> one).astype(np.int64) ^
+            -(values & one).astype(np.int64))
+
+
+class Intervals(object):
+    """
+    Intervals of one profiler, kept as columns.
+
+    Iterating yields (key, start, end) tuples in nanoseconds. items holds
+    the work item of each interval, or -1 for those not spent on one.
+    """
+
+    def __init__(self, names, key_ids, starts, ends, items=None):
+        self.names = names
+        self.key_ids = key_ids
+        self.starts = starts
+        self.ends = ends
+        self.items = (items if items is not None else
+                      np.full(len(key_ids), -1, dtype=np.int64))
+
+    def __len__(self):
+        return len(self.key_ids)
+
+    def __iter__(self):
+        names = self.names
+        for key_id, start, end in zip(self.key_ids.tolist(),
+                                      self.starts.tolist(),
+                                      self.ends.tolist()):
+            yield (names[key_id], start, end)
+
+    def shifted(self, offset):
+        return Intervals(self.names, self.key_ids, self.starts + offset,
+                         self.ends + offset, self.items)
+
+    def durations(self):
+        """Returns a dictionary from key to the total time spent in it."""
+        if len(self) == 0:
+            return {}
+        totals = np.bincount(self.key_ids, weights=self.ends - self.starts,
+                             minlength=len(self.names))
+        used = np.bincount(self.key_ids, minlength=len(self.names)) > 0
+        return {self.names[k]: float(totals[k])
+                for k in np.flatnonzero(used).tolist()}
 
 
 class Profiler:
     """
-    Contains profiling information about Scanner jobs.
+    Contains profiling information about Scanner jobs, or about the last
+    video ingest if no job is given.
     """
 
-    def __init__(self, db, job_id):
+    def __init__(self, db, job_id=None):
         self._storage = db._storage
+        if job_id is None:
+            path = '{}/ingest_profile.bin'.format(db._db_path)
+            self._profilers = self._parse_ingest_profile_file(path)
+            return
         job = db._load_descriptor(
             db.protobufs.JobDescriptor,
             'jobs/{}/descriptor.bin'.format(job_id))
@@ -42,6 +115,7 @@ class Profiler:
 
         To visualize the trace, visit [chrome://tracing](chrome://tracing) in
         Google Chrome and click "Load" in the top left to load the trace.
+        Flow arrows link the intervals each work item went through.
 
         Args:
             path: Output path to write the trace.
@@ -53,27 +127,43 @@ class Profiler:
         }
         traces = []
         next_tid = 0
+        # Track of each profiler, by id
+        tids = {}
+
+        def thread_name(proc, tid, name):
+            return {
+                'name': 'thread_name',
+                'ph': 'M',
+                'pid': proc,
+                'tid': tid,
+                'args': {'name': name}}
+
         for proc, (_, worker_profiler_groups) in self._profilers.iteritems():
-            for worker_type, profs in [('load', worker_profiler_groups['load']),
-                                       ('decode', worker_profiler_groups['decode']),
-                                       ('eval', worker_profiler_groups['eval']),
-                                       ('save', worker_profiler_groups['save'])]:
+            for worker_type in ['load', 'decode', 'eval', 'save', 'control',
+                                'ingest']:
+                profs = worker_profiler_groups[worker_type]
                 for i, prof in enumerate(profs):
-                    tid = next_tid
-                    next_tid += 1
                     worker_num = prof['worker_num']
                     tag = prof['worker_tag']
-                    traces.append({
-                        'name': 'thread_name',
-                        'ph': 'M',
-                        'pid': proc,
-                        'tid': tid,
-                        'args': {
-                            'name': '{}_{:02d}_{:02d}'.format(
-                                worker_type, proc, worker_num) + (
-                                    "_" + str(tag) if tag else "")
-                        }})
+                    name = '{}_{:02d}_{:02d}'.format(
+                        worker_type, proc, worker_num) + (
+                            "_" + str(tag) if tag else "")
+                    tid = next_tid
+                    next_tid += 1
+                    traces.append(thread_name(proc, tid, name))
+                    tids[id(prof)] = tid
+                    # Batches timed on the GPU get a track of their own, as
+                    # they overlap the host intervals that queued them
+                    gpu_tid = None
                     for interval in prof['intervals']:
+                        track_tid = tid
+                        if interval[0].startswith('gpu:'):
+                            if gpu_tid is None:
+                                gpu_tid = next_tid
+                                next_tid += 1
+                                traces.append(thread_name(
+                                    proc, gpu_tid, name + '_gpu'))
+                            track_tid = gpu_tid
                         trace = {
                             'name': interval[0],
                             'cat': worker_type,
@@ -81,12 +171,34 @@ class Profiler:
                             'ts': interval[1] / 1000,  # ns to microseconds
                             'dur': (interval[2] - interval[1]) / 1000,
                             'pid': proc,
-                            'tid': tid,
+                            'tid': track_tid,
                             'args': {}
                         }
                         if interval[0] in colors:
                             trace['cname'] = colors[interval[0]]
                         traces.append(trace)
+            # Flow steps bind to the interval of the item they start in
+            steps = defaultdict(list)
+            for item, _, start, _, prof in self._item_tasks(
+                    worker_profiler_groups):
+                steps[item].append((start, tids[id(prof)]))
+            for item, item_steps in steps.iteritems():
+                if len(item_steps) < 2:
+                    continue
+                item_steps.sort()
+                for i, (start, tid) in enumerate(item_steps):
+                    phase = ('s' if i == 0 else
+                             'f' if i == len(item_steps) - 1 else 't')
+                    traces.append({
+                        'name': 'item',
+                        'cat': 'flow',
+                        'ph': phase,
+                        'id': '{}:{}'.format(proc, item),
+                        'bp': 'e',
+                        'ts': start / 1000,
+                        'pid': proc,
+                        'tid': tid
+                    })
         with open(path, 'w') as f:
             f.write(json.dumps(traces))
 
@@ -109,10 +221,11 @@ class Profiler:
                 if kind not in totals:
                     totals[kind] = {}
                 for thread in profiler[kind]:
-                    for (key, start, end) in thread['intervals']:
+                    durations = thread['intervals'].durations()
+                    for (key, time) in durations.iteritems():
                         if key not in totals[kind]:
                             totals[kind][key] = 0.0
-                        totals[kind][key] += end-start
+                        totals[kind][key] += time
                     for (name, value) in thread['counters'].iteritems():
                         if name not in totals[kind]:
                             totals[kind][name] = 0
@@ -122,7 +235,186 @@ class Profiler:
         readable_totals = self._convert_time(totals)
         return readable_totals
 
+    def bottleneck(self):
+        """
+        Returns the pipeline stage that held back each node the longest.
+
+        The stage controller of a node records which stage it found to be
+        the bottleneck. Profiles without those records fall back to the
+        stage with the highest utilization.
+
+        Returns:
+            Dictionary from node to one of 'load', 'eval' or 'save' as
+            recorded by the stage controller, to a stage of STAGES otherwise,
+            or None if the profile has no stage intervals.
+        """
+        stages = {}
+        utilization = None
+        for node, (_, profiler) in self._profilers.iteritems():
+            times = defaultdict(int)
+            for prof in profiler['control']:
+                for (key, time) in prof['intervals'].durations().iteritems():
+                    if key.startswith('bottleneck_'):
+                        times[key[len('bottleneck_'):]] += time
+            if len(times) == 0:
+                if utilization is None:
+                    utilization = self.utilization()
+                times = {stage: u['utilization']
+                         for (stage, u) in utilization[node].iteritems()
+                         if u['busy'] > 0}
+            stages[node] = (max(times.iterkeys(), key=lambda k: times[k])
+                            if len(times) > 0 else None)
+        return stages
+
+    def _stage_profilers(self, profiler):
+        """Yields the (stage, profiler) pairs of the threads of a node."""
+        for prof in profiler['load']:
+            yield ('load', prof)
+        for prof in profiler['eval']:
+            if prof['worker_tag'] in STAGES:
+                yield (prof['worker_tag'], prof)
+        for prof in profiler['save']:
+            yield ('save', prof)
+
+    def utilization(self):
+        """
+        Returns how busy the threads of each pipeline stage were.
+
+        A stage is busy while its threads work on items. Load and save
+        threads are the threads of the same IO pool, so the time either
+        leaves idle is time the pool spent on the other stage or waiting.
+
+        Returns:
+            Dictionary from node to a dictionary from stage to a dictionary
+            with the number of 'workers', the 'busy' and 'idle' time of
+            all of them in nanoseconds, and the busy fraction 'utilization'.
+        """
+        usage = {}
+        for node, ((start, end), profiler) in self._profilers.iteritems():
+            workers = defaultdict(int)
+            busy = defaultdict(float)
+            for stage, prof in self._stage_profilers(profiler):
+                workers[stage] += 1
+                busy[stage] += prof['intervals'].durations().get('task', 0.0)
+            usage[node] = {}
+            for stage in STAGES:
+                capacity = float(workers[stage] * (end - start))
+                usage[node][stage] = {
+                    'workers': workers[stage],
+                    'busy': busy[stage],
+                    'idle': max(capacity - busy[stage], 0.0),
+                    'utilization': (busy[stage] / capacity
+                                    if capacity > 0 else 0.0)
+                }
+        return usage
+
+    def _item_tasks(self, profiler):
+        """
+        Yields (item, stage, start, end, prof) for each interval a thread of
+        a node spent on an item.
+        """
+        for stage, prof in self._stage_profilers(profiler):
+            intervals = prof['intervals']
+            names = intervals.names
+            for key_id, start, end, item in zip(intervals.key_ids.tolist(),
+                                                intervals.starts.tolist(),
+                                                intervals.ends.tolist(),
+                                                intervals.items.tolist()):
+                if item >= 0 and names[key_id] in ('task', 'task_shared'):
+                    yield (item, stage, start, end, prof)
+
+    def item_flows(self):
+        """
+        Returns the path of each work item through the pipeline.
+
+        Requires a profile written in format version 3 or later, which links
+        intervals to the items they were spent on.
+
+        Returns:
+            Dictionary from node to a dictionary from item index to a list of
+            (stage, start, end) tuples in stage order, where start and end
+            are the first and last time a thread of the stage worked on the
+            item. The time between the end of one stage and the start of the
+            next is time the item spent queued.
+        """
+        flows = {}
+        for node, (_, profiler) in self._profilers.iteritems():
+            spans = defaultdict(dict)
+            for item, stage, start, end, _ in self._item_tasks(profiler):
+                if stage in spans[item]:
+                    s, e = spans[item][stage]
+                    start, end = min(s, start), max(e, end)
+                spans[item][stage] = (start, end)
+            flows[node] = {
+                item: [(stage,) + stages[stage] for stage in STAGES
+                       if stage in stages]
+                for (item, stages) in spans.iteritems()}
+        return flows
+
+    def memory(self):
+        """
+        Returns the memory held by each pipeline stage and op.
+
+        Allocations are attributed to the stage ('load', 'decode', 'eval',
+        'post', 'save') or kernel ('kernel:<op name>') that made them.
+
+        Returns:
+            Dictionary from node to a dictionary from tag to a dictionary
+            with 'cpu_peak', 'cpu_live', 'gpu_peak' and 'gpu_live' bytes.
+            Live bytes are those still held when the job finished. The
+            'cpu_pool_page_size' entry holds the page size that backed the
+            CPU pool, which shows whether huge pages were obtained.
+        """
+        usage = {}
+        for node, (_, profiler) in self._profilers.iteritems():
+            tags = defaultdict(lambda: defaultdict(int))
+            for prof in profiler['memory']:
+                for (name, value) in prof['counters'].iteritems():
+                    if ':' not in name:
+                        continue
+                    kind, tag = name.split(':', 1)
+                    tags[tag][kind] = value
+            usage[node] = {tag: dict(v) for (tag, v) in tags.iteritems()}
+            for prof in profiler['memory']:
+                if 'cpu_pool_page_size' in prof['counters']:
+                    usage[node]['cpu_pool_page_size'] = \
+                        prof['counters']['cpu_pool_page_size']
+        return usage
+
+    def storage_throttling(self):
+        """
+        Returns how much the storage backend throttled each node.
+
+        Returns:
+            Dictionary from node to a dictionary with the number of
+            'throttled' storage requests, the 'wait_seconds' requests spent
+            waiting for a slot or backing off, and the 'request_limit' on
+            requests in flight when the job finished. Jobs which ran at the
+            same time on a node count each other's requests.
+        """
+        throttling = {}
+        for node, (_, profiler) in self._profilers.iteritems():
+            for prof in profiler.get('control', []):
+                counters = prof['counters']
+                if 'storage_throttled' not in counters:
+                    continue
+                throttling[node] = {
+                    'throttled': counters['storage_throttled'],
+                    'wait_seconds':
+                    counters['storage_throttle_wait_us'] / 1e6,
+                    'request_limit': counters['storage_request_limit']
+                }
+        return throttling
+
     def _parse_profiler_output(self, bytes_buffer, offset):
+        t, _ = read_advance('q', bytes_buffer, offset)
+        version = 1
+        if t[0] == PROFILER_SECTION_MAGIC:
+            t, offset = read_advance('=qI', bytes_buffer, offset)
+            version = t[1]
+            if version not in (2, 3):
+                raise ScannerException(
+                    'Unsupported profiler format version {}'.format(version))
         # Node
         t, offset = read_advance('q', bytes_buffer, offset)
         node = t[0]
@@ -136,26 +428,12 @@ class Profiler:
         # Number of keys
         t, offset = read_advance('q', bytes_buffer, offset)
         num_keys = t[0]
-        # Key dictionary encoding
-        key_dictionary = {}
-        for i in range(num_keys):
-            key_name, offset = unpack_string(bytes_buffer, offset)
-            t, offset = read_advance('B', bytes_buffer, offset)
-            key_index = t[0]
-            key_dictionary[key_index] = key_name
-        # Intervals
-        t, offset = read_advance('q', bytes_buffer, offset)
-        num_intervals = t[0]
-        intervals = []
-        for i in range(num_intervals):
-            # Key index
-            t, offset = read_advance('B', bytes_buffer, offset)
-            key_index = t[0]
-            t, offset = read_advance('q', bytes_buffer, offset)
-            start = t[0]
-            t, offset = read_advance('q', bytes_buffer, offset)
-            end = t[0]
-            intervals.append((key_dictionary[key_index], start, end))
+        if version == 1:
+            intervals, offset = self._parse_intervals_v1(
+                bytes_buffer, offset, num_keys)
+        else:
+            intervals, offset = self._parse_intervals_v2(
+                bytes_buffer, offset, num_keys, version)
         # Counters
         t, offset = read_advance('q', bytes_buffer, offset)
         num_counters = t[0]
@@ -177,6 +455,48 @@ class Profiler:
             'counters': counters
         }, offset
 
+    def _parse_intervals_v1(self, bytes_buffer, offset, num_keys):
+        # Key dictionary encoding
+        names = [None] * 256
+        for i in range(num_keys):
+            key_name, offset = unpack_string(bytes_buffer, offset)
+            t, offset = read_advance('B', bytes_buffer, offset)
+            names[t[0]] = key_name
+        # Intervals, as fixed size records
+        t, offset = read_advance('q', bytes_buffer, offset)
+        num_intervals = t[0]
+        record = np.dtype([('key', 'u1'), ('start', '<i8'), ('end', '<i8')])
+        records = np.frombuffer(bytes_buffer, dtype=record,
+                                count=num_intervals, offset=offset)
+        offset += num_intervals * record.itemsize
+        intervals = Intervals(names, records['key'].astype(np.int64),
+                              records['start'].copy(), records['end'].copy())
+        return intervals, offset
+
+    def _parse_intervals_v2(self, bytes_buffer, offset, num_keys, version):
+        # Key ids are indices into the names
+        names = []
+        for i in range(num_keys):
+            key_name, offset = unpack_string(bytes_buffer, offset)
+            names.append(key_name)
+        t, offset = read_advance('q', bytes_buffer, offset)
+        num_intervals = t[0]
+        # Version 3 adds the item column
+        columns = []
+        for i in range(3 if version == 2 else 4):
+            t, offset = read_advance('q', bytes_buffer, offset)
+            size = t[0]
+            columns.append(decode_varints(bytes_buffer, offset, size,
+                                          num_intervals))
+            offset += size
+        key_ids = columns[0].astype(np.int64)
+        starts = np.cumsum(decode_zigzag(columns[1]))
+        ends = starts + decode_zigzag(columns[2])
+        items = None
+        if version >= 3:
+            items = np.cumsum(decode_zigzag(columns[3])) - 1
+        return Intervals(names, key_ids, starts, ends, items), offset
+
     def _parse_profiler_file(self, profiler_path):
         bytes_buffer = self._storage.read(profiler_path)
         offset = 0
@@ -208,4 +528,28 @@ class Profiler:
         for i in range(num_save_workers):
             prof, offset = self._parse_profiler_output(bytes_buffer, offset)
             profilers[prof['worker_type']].append(prof)
+        # Stage controller and memory profilers (absent in older profiles)
+        if offset < len(bytes_buffer):
+            t, offset = read_advance('B', bytes_buffer, offset)
+            num_controllers = t[0]
+            for i in range(num_controllers):
+                prof, offset = self._parse_profiler_output(bytes_buffer, offset)
+                profilers[prof['worker_type']].append(prof)
         return (start_time, end_time), profilers
+
+    def _parse_ingest_profile_file(self, profiler_path):
+        bytes_buffer = self._storage.read(profiler_path)
+        offset = 0
+        t, offset = read_advance('q', bytes_buffer, offset)
+        start_time = t[0]
+        t, offset = read_advance('q', bytes_buffer, offset)
+        end_time = t[0]
+        # Intervals are in absolute time, so that those of every node line
+        # up, and are made relative to the start of the ingest here
+        nodes = defaultdict(lambda: defaultdict(list))
+        while offset < len(bytes_buffer):
+            prof, offset = self._parse_profiler_output(bytes_buffer, offset)
+            prof['intervals'] = prof['intervals'].shifted(-start_time)
+            nodes[prof['node']][prof['worker_type']].append(prof)
+        return {node: ((0, end_time - start_time), profilers)
+                for (node, profilers) in nodes.iteritems()}
@@ -2,6 +2,42 @@ from common import *
 
 DEFAULT_TASK_SIZE = 250
 
+
+def row_runs(rows):
+    """Splits rows into (start, count, stride) runs of evenly spaced rows."""
+    runs = []
+    i = 0
+    while i < len(rows):
+        j = i + 1
+        stride = rows[j] - rows[i] if j < len(rows) else 1
+        if stride <= 0:
+            stride = 1
+        else:
+            while j < len(rows) and rows[j] - rows[j - 1] == stride:
+                j += 1
+        runs.append((rows[i], j - i, stride))
+        i = j
+    return runs
+
+
+def encode_gather_rows(sample, rows):
+    """
+    Stores rows in a GatherSamplerArgs sample as runs when they are mostly
+    evenly spaced, and as deltas otherwise, both far smaller than the rows.
+    """
+    rows = list(rows)
+    runs = row_runs(rows)
+    if len(runs) * 3 <= len(rows):
+        for run in runs:
+            sample.row_runs.extend(run)
+    else:
+        previous = 0
+        deltas = []
+        for row in rows:
+            deltas.append(row - previous)
+            previous = row
+        sample.row_deltas.extend(deltas)
+
 class TableSampler:
     """
     Utility for specifying which frames of a video (or which rows of a table)
@@ -12,10 +48,17 @@ class TableSampler:
         self._table = table
         self._db = table._db
 
-    def all(self, task_size=DEFAULT_TASK_SIZE, warmup_size=0):
+    def all(self, task_size=DEFAULT_TASK_SIZE, warmup_size=0,
+            align_keyframes=False):
+        """
+        Selects every row. With align_keyframes, tasks begin at keyframes of
+        the table's video where one is near, so that they do not decode the
+        frames before their first row.
+        """
         sampler_args = self._db.protobufs.AllSamplerArgs()
         sampler_args.sample_size = task_size
         sampler_args.warmup_size = warmup_size
+        sampler_args.align_keyframes = align_keyframes
         task = self._db.protobufs.Task()
         #task.output_table_name = output_table_name
         column_names = [c.name() for c in self._table.columns()]
@@ -51,20 +94,85 @@ class TableSampler:
         s = 0
         while s < len(rows):
             e = min(s + task_size, len(rows))
-            sampler_args_sample = sampler_args.samples.add()
-            sampler_args_sample.rows[:] = rows[s:e]
+            encode_gather_rows(sampler_args.samples.add(), rows[s:e])
             s = e
         sample.sampling_args = sampler_args.SerializeToString()
         return task
 
+    def nearest_keyframes(self, rows, task_size=DEFAULT_TASK_SIZE):
+        """
+        Selects the keyframe of the table's video nearest to each of rows,
+        once for rows that share one. Only keyframes are decoded, so this is
+        much cheaper than gather when approximate frames will do.
+        """
+        task = self._db.protobufs.Task()
+        column_names = [c.name() for c in self._table.columns()]
+        sample = task.samples.add()
+        sample.table_name = self._table.name()
+        sample.column_names.extend(column_names)
+        sample.sampling_function = "NearestKeyframe"
+        sampler_args = self._db.protobufs.NearestKeyframeSamplerArgs()
+        sampler_args.rows[:] = rows
+        sampler_args.sample_size = task_size
+        sample.sampling_args = sampler_args.SerializeToString()
+        return task
+
+    def time(self, fps, start=0, end=0, task_size=DEFAULT_TASK_SIZE):
+        """
+        Selects the rows shown at fps frames a second of video time, from
+        start to end seconds into the video (0 for its end). The master maps
+        times to rows with the keyframe timestamps of the table's video, so
+        videos of any frame rate are sampled at the same rate.
+        """
+        task = self._db.protobufs.Task()
+        column_names = [c.name() for c in self._table.columns()]
+        sample = task.samples.add()
+        sample.table_name = self._table.name()
+        sample.column_names.extend(column_names)
+        sample.sampling_function = "Time"
+        sampler_args = self._db.protobufs.TimeSamplerArgs()
+        sampler_args.fps = fps
+        sampler_args.start = start
+        sampler_args.end = end
+        sampler_args.sample_size = task_size
+        sample.sampling_args = sampler_args.SerializeToString()
+        return task
+
+    def zone_map(self, column, min, max):
+        """
+        Selects every row of the io items of the table whose values of
+        column may lie in [min, max]. column must have been written with a
+        zone map, see the zone_map_columns of Database.run. The master skips
+        the other items from their zone maps without reading them, so a job
+        which filters on column only computes the items that can pass.
+        """
+        task = self._db.protobufs.Task()
+        column_names = [c.name() for c in self._table.columns()]
+        sample = task.samples.add()
+        sample.table_name = self._table.name()
+        sample.column_names.extend(column_names)
+        sample.sampling_function = "ZoneMap"
+        sampler_args = self._db.protobufs.ZoneMapSamplerArgs()
+        sampler_args.column = column
+        sampler_args.min = min
+        sampler_args.max = max
+        sample.sampling_args = sampler_args.SerializeToString()
+        return task
+
     def strided_range(self, start, end, stride, task_size=DEFAULT_TASK_SIZE,
-                      warmup_size=0):
+                      warmup_size=0, align_keyframes=False):
         return self.strided_ranges([(start, end)], stride,
                                    task_size=task_size,
-                                   warmup_size=warmup_size)
+                                   warmup_size=warmup_size,
+                                   align_keyframes=align_keyframes)
 
     def strided_ranges(self, intervals, stride, task_size=DEFAULT_TASK_SIZE,
-                      warmup_size=0):
+                      warmup_size=0, align_keyframes=False):
+        """
+        Selects every stride-th row of each interval. With align_keyframes,
+        the master splits intervals into tasks that begin at keyframes of the
+        table's video where one is near.
+        """
         task = self._db.protobufs.Task()
         #task.output_table_name = output_table_name
         num_rows = self._table.num_rows()
@@ -75,7 +183,15 @@ class TableSampler:
         sample.sampling_function = "StridedRange"
         sampler_args = self._db.protobufs.StridedRangeSamplerArgs()
         sampler_args.stride = stride
+        if align_keyframes:
+            sampler_args.keyframe_sample_size = task_size
         for start, end in intervals:
+            if align_keyframes:
+                sampler_args.warmup_starts.append(
+                    max(0, start - warmup_size * stride))
+                sampler_args.starts.append(start)
+                sampler_args.ends.append(end)
+                continue
             s = start
             while s < end:
                 ws = max(0, s - warmup_size * stride)
@@ -2,6 +2,58 @@ from ..table import Table
 import numpy as np
 import cv2
 import parsers
+import struct
+
+# Boxes packed as arrays of each field, see PackedBBoxes in
+# scanner/util/serialize.h
+PACKED_BBOXES_MAGIC = 0xffffffff0bb00001
+PACKED_BBOX_FIELDS = [
+    ('track_score', np.float64), ('x1', np.float32), ('y1', np.float32),
+    ('x2', np.float32), ('y2', np.float32), ('score', np.float32),
+    ('label', np.int32), ('track_id', np.int32)]
+
+
+def is_packed(buf):
+    return (len(buf) >= 16 and
+            struct.unpack('=Q', buf[:8])[0] == PACKED_BBOXES_MAGIC)
+
+
+def unpack(buf, db=None):
+    """
+    Returns the fields of the boxes of an element as a dict of arrays.
+
+    Arrays of packed elements are views of buf. Elements serialized as
+    BoundingBox protos are parsed, which needs db.
+    """
+    if not is_packed(buf):
+        boxes = parsers.bboxes([buf], db)
+        return dict((name, np.array([getattr(b, name) for b in boxes],
+                                    dtype=dtype))
+                    for (name, dtype) in PACKED_BBOX_FIELDS)
+    (num_boxes,) = struct.unpack('=Q', buf[8:16])
+    fields = {}
+    offset = 16
+    for (name, dtype) in PACKED_BBOX_FIELDS:
+        fields[name] = np.frombuffer(buf, dtype=dtype, count=num_boxes,
+                                     offset=offset)
+        offset += num_boxes * np.dtype(dtype).itemsize
+    return fields
+
+
+def pack(boxes):
+    """
+    Packs BoundingBox protos, or a dict of field arrays as returned by
+    unpack, into an element.
+    """
+    if not isinstance(boxes, dict):
+        boxes = dict((name, [getattr(b, name) for b in boxes])
+                     for (name, _) in PACKED_BBOX_FIELDS)
+    num_boxes = len(boxes['x1'])
+    data = [struct.pack('=QQ', PACKED_BBOXES_MAGIC, num_boxes)]
+    for (name, dtype) in PACKED_BBOX_FIELDS:
+        values = boxes.get(name, np.zeros(num_boxes))
+        data.append(np.asarray(values, dtype=dtype).tobytes())
+    return ''.join(data)
 
 def nms(orig_boxes, overlapThresh):
     # if there are no boxes, return an empty list
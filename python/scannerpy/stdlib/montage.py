@@ -24,3 +24,12 @@ def make_montage(n, frames, frame_width=64, frames_per_row=16):
         place_image(i + 1, frame)
 
     return img
+
+
+def assemble_montage(tiles):
+    """Stacks the tiles of a Montage op run with rows_per_tile into one image.
+
+    tiles yields the frames of the montage column in row order. The 2x2
+    placeholders emitted for rows that did not complete a tile are skipped.
+    """
+    return np.vstack([t for t in tiles if t.shape[:2] != (2, 2)])
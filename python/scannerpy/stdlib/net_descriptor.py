@@ -21,7 +21,8 @@ class NetDescriptor:
         d = self._descriptor
         net = args['net']
         d.model_path = net['model']
-        d.model_weights_path = net['weights']
+        # ONNX models keep their weights in the model file
+        d.model_weights_path = self._val(net, 'weights', '')
         d.input_layer_names.extend(net['input_layers'])
         d.output_layer_names.extend(net['output_layers'])
         d.input_width = self._val(net, 'input_width', -1)
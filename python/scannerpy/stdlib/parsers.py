@@ -5,6 +5,16 @@ import struct
 
 def bboxes(bufs, db):
     buf = bufs[0]
+    import bboxes as packed_bboxes
+    if packed_bboxes.is_packed(buf):
+        fields = packed_bboxes.unpack(buf)
+        boxes = []
+        for i in range(len(fields['x1'])):
+            box = db.protobufs.BoundingBox()
+            for (name, _) in packed_bboxes.PACKED_BBOX_FIELDS:
+                setattr(box, name, fields[name][i].item())
+            boxes.append(box)
+        return boxes
     (num_bboxes,) = struct.unpack("=Q", buf[:8])
     buf = buf[8:]
     bboxes = []
@@ -44,6 +54,11 @@ def histograms(bufs, db):
     return np.split(np.frombuffer(bufs[0], dtype=np.dtype(np.int32)), 3)
 
 
+def histograms_array(column, rows=None, bins=16):
+    """Loads a histogram column as one (rows, 3, bins) array."""
+    return column.load_array(np.int32, shape=(3, bins), rows=rows)
+
+
 def frame_info(buf, db):
     info = db.protobufs.FrameInfo()
     info.ParseFromString(buf)
@@ -62,6 +77,11 @@ def array(ty):
     return parser
 
 
+def flow_array(column, height, width, rows=None):
+    """Loads a flow column of height x width frames as one array."""
+    return column.load_array(np.float32, shape=(height, width, 2), rows=rows)
+
+
 def image(bufs, db):
     return cv2.imdecode(np.frombuffer(bufs[0], dtype=np.dtype(np.uint8)),
                         cv2.IMREAD_COLOR)
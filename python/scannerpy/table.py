@@ -5,6 +5,9 @@ from itertools import izip
 from sampler import SamplerOp
 from timeit import default_timer as now
 
+# Threads converting items of a table to record batches when exporting it
+EXPORT_THREADS = 8
+
 class Table:
     """
     A table in a Database.
@@ -27,11 +30,16 @@ class Table:
         for c in self._descriptor.columns:
             video_descriptor = None
             if c.type == self._db.protobufs.Video:
-                video_descriptor = self._db._load_descriptor(
-                    self._db.protobufs.VideoDescriptor,
-                    'tables/{:d}/{:d}_0_video_metadata.bin'.format(
-                        self._descriptor.id,
-                        c.id))
+                _, videos = self._db._load_manifest()
+                key = (self._descriptor.id, c.id, 0)
+                if key in videos:
+                    video_descriptor = videos[key]
+                else:
+                    video_descriptor = self._db._load_descriptor(
+                        self._db.protobufs.VideoDescriptor,
+                        'tables/{:d}/{:d}_0_video_metadata.bin'.format(
+                            self._descriptor.id,
+                            c.id))
             self._columns.append(Column(self, c, video_descriptor))
 
     def _load_job(self):
@@ -41,7 +49,8 @@ class Table:
                 'jobs/{}/descriptor.bin'.format(self._job_id))
             self._task = None
             for task in self._job.tasks:
-                if task.output_table_name == self._descriptor.name:
+                if (task.output_table_name == self._descriptor.name or
+                    self._descriptor.name in task.shared_output_table_names):
                     self._task = task
             if self._task is None:
                 raise ScannerException('Table {} not found in job {}'
@@ -97,6 +106,55 @@ class Table:
 
         return [i for _, i in self.load(['index'], fn=self._parse_index)]
 
+    def source_rows(self):
+        """
+        Returns the input table row of each row of a table output by a job
+        with filter ops, which only kept some of the rows.
+        """
+        if not self._descriptor.filtered_rows:
+            raise ScannerException('Table {} was not filtered'
+                                   .format(self.name()))
+
+        rows = []
+        storage = self._db.config.storage
+        for item_id in range(len(self._descriptor.end_rows)):
+            path = '{}/tables/{:d}/item_{:d}_rows.bin'.format(
+                self._db.config.db_path, self._descriptor.id, item_id)
+            contents = storage.read(path)
+            rows.extend(struct.unpack('={}q'.format(len(contents) / 8),
+                                      contents))
+        return rows
+
+    def export(self, path, columns=None, format='parquet',
+               threads=EXPORT_THREADS):
+        """
+        Writes columns of the table to a local Arrow or Parquet file, which
+        pandas and Spark read without converting rows in Python.
+
+        The file has an int64 "row" column with the row of each row in this
+        table, and "source_row" with the input table row if filters dropped
+        rows. Other columns are binary and tensor columns are fixed size
+        lists of their values.
+
+        Args:
+          path: Local path of the file to write.
+          columns: Names of the columns to export, all but video columns
+            by default.
+          format: 'parquet', with a row group per item, or 'arrow' for an
+            Arrow IPC file with a record batch per item.
+          threads: Items read and converted at once.
+        """
+        if columns is None:
+            columns = [c.name for c in self._descriptor.columns
+                       if c.type != self._db.protobufs.Video]
+        column_ids = [self.columns(c)._descriptor.id for c in columns]
+        result = self._db._bindings.export_table(
+            self._db.config.storage_config, self._db.config.db_path,
+            self._descriptor.SerializeToString(), column_ids, path, format,
+            threads)
+        if not result.success():
+            raise ScannerException(result.msg())
+
     def profiler(self):
         if self._job_id != -1:
             return self._db.profiler(self._job_id)
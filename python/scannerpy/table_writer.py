@@ -0,0 +1,131 @@
+from common import *
+from column import TENSOR_DTYPES
+
+# Threads writing items, and the most items queued behind them
+WRITE_THREADS = 8
+
+
+class TableWriter:
+    """
+    Writes a new table in chunks of rows, see Database.table_writer.
+
+    Each chunk has an entry per column, either a numpy array with a row per
+    entry of its first axis or a list of strings. The first chunk decides
+    the type of each column: arrays make Tensor columns of their dtype and
+    row shape, which later chunks must match, and lists make Other columns.
+    Rows are gathered into items of rows_per_item rows that are written in
+    parallel, and the table only shows up in the database once it is
+    committed.
+
+    Used as a context manager, the table is committed on exit unless an
+    exception was raised.
+    """
+
+    def __init__(self, db, name, columns, rows_per_item, threads):
+        self._db = db
+        self._name = name
+        self._columns = columns
+        self._rows_per_item = rows_per_item
+        self._threads = threads
+        self._writer = None
+        self._tensors = None
+        self._pending = [[] for _ in columns]
+        self._pending_rows = 0
+
+    def write(self, chunk):
+        """Appends the rows of a chunk to the table."""
+        if len(chunk) != len(self._columns):
+            raise ScannerException(
+                'Chunk has {:d} columns, table {} has {:d}'.format(
+                    len(chunk), self._name, len(self._columns)))
+        num_rows = len(chunk[0])
+        if any(len(c) != num_rows for c in chunk):
+            raise ScannerException('Columns of a chunk have different rows')
+        if self._writer is None:
+            self._start(chunk)
+        chunk = list(chunk)
+        for i, tensor in enumerate(self._tensors):
+            if tensor is not None:
+                chunk[i] = np.asarray(chunk[i])
+                if (chunk[i].dtype, chunk[i].shape[1:]) != tensor:
+                    raise ScannerException(
+                        'Rows of column {} are {} {}, not {} {}'.format(
+                            self._columns[i], chunk[i].dtype,
+                            chunk[i].shape[1:], tensor[0], tensor[1]))
+        # Slices end on item boundaries, so each item is the concatenation
+        # of the pending slices
+        start = 0
+        while start < num_rows:
+            end = min(num_rows,
+                      start + self._rows_per_item - self._pending_rows)
+            for i, c in enumerate(chunk):
+                self._pending[i].append(c[start:end])
+            self._pending_rows += end - start
+            start = end
+            if self._pending_rows == self._rows_per_item:
+                self._write_item()
+
+    def write_chunks(self, chunks):
+        """Appends the rows of each chunk of an iterable."""
+        for chunk in chunks:
+            self.write(chunk)
+
+    def commit(self):
+        """Writes the remaining rows and adds the table to the database."""
+        if self._writer is None:
+            raise ScannerException('Table {} has no rows'.format(self._name))
+        if self._pending_rows > 0:
+            self._write_item()
+        result = self._writer.commit()
+        if not result.success():
+            raise ScannerException(result.msg())
+        self._db._cached_db_metadata = None
+        return self._db.table(self._name)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exception_type, value, traceback):
+        if exception_type is None:
+            self.commit()
+
+    def _start(self, chunk):
+        descriptor = self._db.protobufs.TableDescriptor()
+        descriptor.name = self._name
+        self._tensors = []
+        for name, c in zip(self._columns, chunk):
+            column = descriptor.columns.add()
+            column.name = name
+            if isinstance(c, np.ndarray):
+                dtypes = [np.dtype(t) for t in TENSOR_DTYPES]
+                if c.dtype not in dtypes:
+                    raise ScannerException(
+                        'Column {} has unsupported dtype {}'.format(
+                            name, c.dtype))
+                column.type = self._db.protobufs.Tensor
+                column.tensor_type = dtypes.index(c.dtype)
+                column.tensor_shape.extend(c.shape[1:])
+                self._tensors.append((c.dtype, c.shape[1:]))
+            else:
+                column.type = self._db.protobufs.Other
+                self._tensors.append(None)
+        self._writer = self._db._bindings.new_table_writer(
+            self._db.config.storage_config, self._db.config.db_path,
+            descriptor.SerializeToString(), self._threads)
+
+    def _write_item(self):
+        data = []
+        sizes = []
+        for i, tensor in enumerate(self._tensors):
+            if tensor is not None:
+                data.append(np.concatenate(self._pending[i]).tobytes())
+                sizes.append([])
+            else:
+                rows = [r for part in self._pending[i] for r in part]
+                data.append(''.join(rows))
+                sizes.append([len(r) for r in rows])
+            self._pending[i] = []
+        result = self._writer.write_item(self._pending_rows, data, sizes)
+        self._pending_rows = 0
+        if not result.success():
+            raise ScannerException(result.msg())
@@ -0,0 +1,136 @@
+from common import *
+from op import OpColumn
+from timeit import default_timer as now
+import hashlib
+import json
+
+# Values tried for each tuned parameter, besides the one run was given
+PIPELINE_INSTANCES = [1, 2, 4]
+WORK_ITEM_SIZES = [64, 128, 250, 512]
+# Factors applied to the batch size of each batched op
+BATCH_FACTORS = [0.5, 2]
+
+
+class Tuner:
+    """
+    Picks the pipeline instances, work item size and op batch sizes of a
+    computation from short calibration runs, see Database.run.
+
+    Parameters are tuned one at a time, each keeping the best values found
+    so far for the others, and scored by the items computed per second.
+    Runs whose peak CPU memory on a node goes over the memory limit, or
+    which fail, are not chosen. The chosen values are saved in the database
+    under a hash of the ops, so later runs of the same ops reuse them
+    without calibrating.
+    """
+
+    def __init__(self, db, jobs, items, memory_limit):
+        self._db = db
+        self._jobs = jobs
+        self._items = items
+        self._memory_limit = memory_limit
+        self._ops = self._batched_ops()
+
+    def tune(self, run_kwargs):
+        """
+        Returns run_kwargs with the tuned values, and sets the batch sizes
+        of the batched ops to theirs.
+        """
+        path = '{}/pydb/tuning_{}.json'.format(self._db._db_path,
+                                               self._key())
+        if self._db._storage.get_file_info(path).file_exists:
+            config = json.loads(self._db._storage.read(path))
+        else:
+            config = self._search(run_kwargs)
+            self._db._storage.write(path, json.dumps(config))
+        self._set_batches(config['batches'])
+        return self._kwargs(run_kwargs, config)
+
+    def _search(self, run_kwargs):
+        best = {
+            'pipeline_instances_per_node':
+            run_kwargs['pipeline_instances_per_node'],
+            'work_item_size': run_kwargs['work_item_size'],
+            'batches': [op._batch for op in self._ops]
+        }
+        best_score = self._score(run_kwargs, best)
+
+        candidates = [('pipeline_instances_per_node', v)
+                      for v in PIPELINE_INSTANCES]
+        candidates += [('work_item_size', v) for v in WORK_ITEM_SIZES]
+        for i, batch in enumerate(best['batches']):
+            candidates += [(i, max(int(batch * f), 1))
+                           for f in BATCH_FACTORS]
+
+        for key, value in candidates:
+            config = dict(best, batches=list(best['batches']))
+            if isinstance(key, int):
+                config['batches'][key] = value
+            else:
+                config[key] = value
+            if config == best:
+                continue
+            score = self._score(run_kwargs, config)
+            if score is not None and (best_score is None or
+                                      score > best_score):
+                best, best_score = config, score
+        return best
+
+    def _score(self, run_kwargs, config):
+        """Items per second of a calibration run, or None if rejected."""
+        self._set_batches(config['batches'])
+        start = now()
+        try:
+            job_name = self._db.run(
+                self._jobs, _calibration_items=self._items,
+                **self._kwargs(run_kwargs, config))
+        except ScannerException:
+            return None
+        seconds = now() - start
+        if self._memory_limit is not None:
+            memory = self._db.profiler(job_name).memory()
+            for tags in memory.itervalues():
+                peak = sum(usage.get('cpu_peak', 0)
+                           for usage in tags.itervalues()
+                           if isinstance(usage, dict))
+                if peak > self._memory_limit:
+                    return None
+        return self._items / seconds
+
+    def _kwargs(self, run_kwargs, config):
+        kwargs = dict(run_kwargs)
+        kwargs['pipeline_instances_per_node'] = \
+            config['pipeline_instances_per_node']
+        kwargs['work_item_size'] = config['work_item_size']
+        return kwargs
+
+    def _graph_ops(self):
+        """Ops of the computation, in a fixed order."""
+        job = self._jobs[0] if isinstance(self._jobs, list) else self._jobs
+        ops = []
+        stack = [job.op(self._db)]
+        while len(stack) > 0:
+            op = stack.pop()
+            if op in ops:
+                continue
+            ops.append(op)
+            stack.extend(reversed([c._op for c in op._inputs
+                                   if isinstance(c, OpColumn)]))
+        return ops
+
+    def _batched_ops(self):
+        return [op for op in self._graph_ops() if op._batch > 1]
+
+    def _set_batches(self, batches):
+        for op, batch in zip(self._ops, batches):
+            op._batch = batch
+
+    def _key(self):
+        # Batch sizes are left out since they are tuned
+        ops = []
+        for op in self._graph_ops():
+            args = op._args
+            if isinstance(args, dict):
+                args = sorted(args.items())
+            ops.append(repr((op._name, op._device, op._batch > 1, args)))
+        return hashlib.sha1('\n'.join(ops)).hexdigest()
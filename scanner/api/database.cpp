@@ -31,6 +31,7 @@
 #include <grpc++/server_builder.h>
 #include <grpc/support/log.h>
 
+#include <limits>
 #include <thread>
 
 namespace scanner {
@@ -41,6 +42,8 @@ std::unique_ptr<grpc::Server> start(T& service, const std::string& port) {
   std::string server_address("0.0.0.0:" + port);
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  // Reports of finished work carry the streamed output of their items
+  builder.SetMaxMessageSize(std::numeric_limits<i32>::max());
   builder.RegisterService(service.get());
   std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
   LOG_IF(FATAL, server.get() == nullptr) << "Failed to start server";
@@ -167,6 +170,10 @@ internal::DatabaseParameters machine_params_to_db_params(
   db.num_load_workers = params.num_load_workers;
   db.num_save_workers = params.num_save_workers;
   db.gpu_ids = params.gpu_ids;
+  db.block_cache_size = params.block_cache_size;
+  db.block_cache_dir = params.block_cache_dir;
+  db.block_cache_disk_size = params.block_cache_disk_size;
+  db.local_table_dir = params.local_table_dir;
   return db;
 }
 }
@@ -176,6 +183,9 @@ MachineParameters default_machine_params() {
   machine_params.num_cpus = std::thread::hardware_concurrency();
   machine_params.num_load_workers = 8;
   machine_params.num_save_workers = 2;
+  machine_params.block_cache_size = 1024 * 1024 * 1024;
+  machine_params.block_cache_disk_size = 0;
+  machine_params.local_table_dir = "/tmp/scanner_local_tables";
 #ifdef HAVE_CUDA
   i32 gpu_count;
   CU_CHECK(cudaGetDeviceCount(&gpu_count));
@@ -254,9 +264,13 @@ Result Database::start_worker(const MachineParameters& machine_params,
 
 Result Database::ingest_videos(const std::vector<std::string>& table_names,
                                const std::vector<std::string>& paths,
-                               std::vector<FailedVideo>& failed_videos) {
+                               std::vector<FailedVideo>& failed_videos,
+                               i32 num_threads, i64 segment_size,
+                               bool in_place, bool append,
+                               const proto::TranscodeOptions& transcode) {
   internal::ingest_videos(storage_config_, db_path_, table_names, paths,
-                          failed_videos);
+                          failed_videos, num_threads, segment_size, in_place,
+                          append, transcode);
   Result result;
   result.set_success(true);
   return result;
@@ -274,6 +288,7 @@ Result Database::ingest_videos(const std::vector<std::string>& table_names,
   for (auto& p : paths) {
     params.add_video_paths(p);
   }
+  params.set_num_threads(num_threads);
   proto::IngestResult job_result;
   grpc::Status status = master_->IngestVideos(&context, params, &job_result);
   LOG_IF(FATAL, !status.ok())
@@ -287,6 +302,36 @@ Result Database::ingest_videos(const std::vector<std::string>& table_names,
   return job_result.result();
 }
 
+Result Database::ingest_images(const std::string& table_name,
+                               const std::vector<std::string>& paths,
+                               std::vector<FailedVideo>& failed_images,
+                               i32 num_threads, i64 images_per_item) {
+  auto channel =
+      grpc::CreateChannel(master_address_, grpc::InsecureChannelCredentials());
+  std::unique_ptr<proto::Master::Stub> master_ =
+      proto::Master::NewStub(channel);
+
+  grpc::ClientContext context;
+  proto::IngestImagesParameters params;
+  params.set_table_name(table_name);
+  for (auto& p : paths) {
+    params.add_image_paths(p);
+  }
+  params.set_num_threads(num_threads);
+  params.set_images_per_item(images_per_item);
+  proto::IngestResult job_result;
+  grpc::Status status = master_->IngestImages(&context, params, &job_result);
+  LOG_IF(FATAL, !status.ok())
+      << "Could not contact master server: " << status.error_message();
+  for (i32 i = 0; i < job_result.failed_paths().size(); ++i) {
+    FailedVideo failed;
+    failed.path = job_result.failed_paths(i);
+    failed.message = job_result.failed_messages(i);
+    failed_images.push_back(failed);
+  }
+  return job_result.result();
+}
+
 Result Database::new_job(JobParameters& params) {
   auto channel =
       grpc::CreateChannel(master_address_, grpc::InsecureChannelCredentials());
@@ -301,6 +346,29 @@ Result Database::new_job(JobParameters& params) {
   job_params.set_work_item_size(params.work_item_size);
   job_params.set_load_sparsity_threshold(params.load_sparsity_threshold);
   job_params.set_tasks_in_queue_per_pu(params.tasks_in_queue_per_pu);
+  job_params.set_read_coalesce_gap(params.read_coalesce_gap);
+  job_params.set_load_read_parallelism(params.load_read_parallelism);
+  job_params.set_load_mmap(params.load_mmap);
+  job_params.set_load_readahead_items(params.load_readahead_items);
+  job_params.set_load_readahead_size(params.load_readahead_size);
+  job_params.set_save_upload_parallelism(params.save_upload_parallelism);
+  job_params.set_save_upload_size(params.save_upload_size);
+  job_params.set_pack_output_items(params.pack_output_items);
+  job_params.set_decode_width(params.decode_width);
+  job_params.set_decode_height(params.decode_height);
+  job_params.set_decode_parallelism(params.decode_parallelism);
+  job_params.set_encode_parallelism(params.encode_parallelism);
+  job_params.set_direct_reads(params.direct_reads);
+  job_params.set_codec_threads(params.codec_threads);
+  job_params.set_codec_slice_threads(params.codec_slice_threads);
+  job_params.set_gpu_decode_surfaces(params.gpu_decode_surfaces);
+  job_params.set_balance_gpu_decode(params.balance_gpu_decode);
+  job_params.set_batch_latency_ms(params.batch_latency_ms);
+  job_params.set_cpu_pipeline_instances(params.cpu_pipeline_instances);
+  job_params.set_priority(params.priority);
+  for (const std::string& name : params.local_tables) {
+    job_params.add_local_tables(name);
+  }
   proto::TaskSet set = consume_task_set(params.task_set);
   job_params.mutable_task_set()->Swap(&set);
   Result job_result;
@@ -337,6 +405,9 @@ Result Database::new_table(const std::string& table_name,
 
   internal::write_table_metadata(storage_.get(),
                                  internal::TableMetadata(table_desc));
+  proto::DatabaseManifest segment;
+  segment.add_tables()->CopyFrom(table_desc);
+  internal::append_manifest(storage_.get(), meta, segment);
   internal::write_database_metadata(storage_.get(), meta);
 
   assert(rows[0].size() == columns.size());
@@ -349,18 +420,18 @@ Result Database::new_table(const std::string& table_name,
                                        output_file);
 
     u64 num_rows = rows.size();
-    s_write(output_file.get(), num_rows);
+    std::vector<i64> element_sizes;
     for (size_t i = 0; i < num_rows; ++i) {
-      i64 buffer_size = rows[i][j].size();
-      s_write(output_file.get(), buffer_size);
+      element_sizes.push_back(rows[i][j].size());
     }
+    internal::write_item_file_header(output_file.get(), element_sizes);
     for (size_t i = 0; i < num_rows; ++i) {
       i64 buffer_size = rows[i][j].size();
       u8* buffer = (u8*)rows[i][j].data();
       s_write(output_file.get(), buffer, buffer_size);
     }
 
-    BACKOFF_FAIL(output_file->save());
+    STORE_CHECK(output_file->save());
   }
 
   proto::Result result;
@@ -379,11 +450,12 @@ Result Database::delete_table(const std::string& table_name) {
     return result;
   }
 
+  // The master deletes the files of the table between jobs
   meta.remove_table(id);
   internal::write_database_metadata(storage_.get(), meta);
 
-  internal::TableMetadata table = internal::read_table_metadata(
-      storage_.get(), internal::TableMetadata::descriptor_path(id));
+  result.set_success(true);
+  return result;
 }
 
 Result Database::shutdown_master() {
@@ -395,10 +467,16 @@ Result Database::shutdown_master() {
 }
 
 Result Database::shutdown_worker() {
-  LOG(FATAL) << "Not implemented yet!";
-
   Result result;
   result.set_success(true);
+  for (auto& state : worker_states_) {
+    auto worker =
+        std::static_pointer_cast<internal::WorkerImpl>(state->service);
+    Result worker_result = worker->drain();
+    if (!worker_result.success()) {
+      result = worker_result;
+    }
+  }
   return result;
 }
 
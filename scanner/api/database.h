@@ -33,6 +33,10 @@ struct MachineParameters {
   i32 num_save_workers;
   std::vector<i32>
       gpu_ids;  //!< List of CUDA device IDs that Scanner should use.
+  i64 block_cache_size;  //!< Bytes of storage reads to cache in memory.
+  std::string block_cache_dir;  //!< Local directory for evicted blocks.
+  i64 block_cache_disk_size;    //!< Bytes of blocks to keep on local disk.
+  std::string local_table_dir;  //!< Local directory for local table items.
 };
 
 //! Pick smart defaults for the current machine.
@@ -74,6 +78,28 @@ struct JobParameters {
   i64 work_item_size;
   i32 load_sparsity_threshold;
   i32 tasks_in_queue_per_pu;
+  i64 read_coalesce_gap;
+  i32 load_read_parallelism;
+  bool load_mmap;
+  bool direct_reads;
+  i32 load_readahead_items;
+  i64 load_readahead_size;
+  i32 save_upload_parallelism;
+  i64 save_upload_size;
+  bool pack_output_items;
+  i32 decode_width;
+  i32 decode_height;
+  i32 decode_parallelism;
+  i32 encode_parallelism;
+  i32 codec_threads;
+  bool codec_slice_threads;
+  i32 gpu_decode_surfaces;
+  bool balance_gpu_decode;
+  i32 batch_latency_ms;
+  i32 cpu_pipeline_instances;
+  i32 priority;
+  //! Output tables kept on the local disk of the workers that write them.
+  std::vector<std::string> local_tables;
 };
 
 //! Info about a video that fails to ingest.
@@ -94,14 +120,30 @@ class Database {
   Result start_worker(const MachineParameters& params, const std::string& port,
                       bool watchdog = true);
 
+  //! Ingests num_threads videos at once, or one per core if num_threads is
+  //! not positive. Videos larger than a positive segment_size bytes are
+  //! split at keyframes into items that are ingested in parallel. Videos
+  //! ingested in_place are only indexed and are read from their paths,
+  //! which must stay in place, instead of being copied into the database.
+  //! With append, videos named after tables they ingested earlier are added
+  //! to those tables as new items. Videos are re-encoded as H.264 with the
+  //! keyframe distance and size in transcode if its keyframe distance is
+  //! positive, which speeds up sparse sampling of long-GOP sources.
   Result ingest_videos(const std::vector<std::string>& table_names,
                        const std::vector<std::string>& paths,
-                       std::vector<FailedVideo>& failed_videos);
-
-  // void ingest_images(storehouse::StorageConfig *storage_config,
-  //                    const std::string &db_path, const std::string
-  //                    &table_name,
-  //                    const std::vector<std::string> &paths);
+                       std::vector<FailedVideo>& failed_videos,
+                       i32 num_threads = 0, i64 segment_size = 0,
+                       bool in_place = false, bool append = false,
+                       const proto::TranscodeOptions& transcode =
+                           proto::TranscodeOptions());
+
+  //! Ingests JPEG, PNG and BMP images into a table with img and path
+  //! columns, packing up to images_per_item images of one encoding, color
+  //! space and size into each item.
+  Result ingest_images(const std::string& table_name,
+                       const std::vector<std::string>& paths,
+                       std::vector<FailedVideo>& failed_images,
+                       i32 num_threads = 0, i64 images_per_item = 0);
 
   Result new_job(JobParameters& params);
 
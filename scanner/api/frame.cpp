@@ -30,11 +30,15 @@ size_t size_of_frame_type(FrameType type) {
     case FrameType::F64:
       s = sizeof(f64);
       break;
+    case FrameType::F16:
+      s = sizeof(u16);
+      break;
   }
   return s;
 }
 
-FrameInfo::FrameInfo(int shape0, int shape1, int shape2, FrameType t) {
+FrameInfo::FrameInfo(int shape0, int shape1, int shape2, FrameType t,
+                     FrameLayout l) {
   assert(shape0 >= 0);
   assert(shape1 >= 0);
   assert(shape2 >= 0);
@@ -43,10 +47,11 @@ FrameInfo::FrameInfo(int shape0, int shape1, int shape2, FrameType t) {
   shape[1] = shape1;
   shape[2] = shape2;
   type = t;
+  layout = l;
 }
 
 bool FrameInfo::operator==(const FrameInfo& other) const {
-  bool same = (type == other.type);
+  bool same = (type == other.type && layout == other.layout);
   for (int i = 0; i < FRAME_DIMS; ++i) {
     same &= (shape[i] == other.shape[i]);
   }
@@ -58,6 +63,9 @@ bool FrameInfo::operator!=(const FrameInfo& other) const {
 }
 
 size_t FrameInfo::size() const {
+  if (layout == FrameLayout::NV12) {
+    return (size_t)shape[0] * shape[1] * 3 / 2;
+  }
   size_t s = size_of_frame_type(type);
   for (int i = 0; i < FRAME_DIMS; ++i) {
     s *= shape[i];
@@ -75,10 +83,11 @@ int FrameInfo::channels() const { return shape[2]; }
 Frame::Frame(FrameInfo info, u8* b) : data(b) {
   memcpy(shape, info.shape, sizeof(int) * FRAME_DIMS);
   type = info.type;
+  layout = info.layout;
 }
 
 FrameInfo Frame::as_frame_info() const {
-  return FrameInfo(shape[0], shape[1], shape[2], type);
+  return FrameInfo(shape[0], shape[1], shape[2], type, layout);
 }
 
 size_t Frame::size() const { return as_frame_info().size(); }
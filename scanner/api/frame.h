@@ -29,6 +29,23 @@ size_t size_of_frame_type(FrameType type);
 
 const i32 FRAME_DIMS = 3;
 
+//! Memory layout of the pixels of a U8 frame
+enum class FrameLayout {
+  //! Interleaved (height, width, channels)
+  HWC,
+  //! Full resolution luma plane followed by a half resolution plane of
+  //! interleaved Cb/Cr pairs. Shape stays (height, width, 3) but size() is
+  //! only height * width * 3 / 2 bytes. Only used for even dimensions.
+  NV12,
+  //! F32 motion field of an H.264 frame with one (dx, dy, intra) triple per
+  //! 16x16 macroblock: the displacement in pixels of the block from where it
+  //! was predicted from, and 1 for intra coded blocks, which have no motion
+  //! vector and a displacement of 0. Shape is (macroblock rows, macroblock
+  //! columns, 3). Only made by the software decoder, see
+  //! OpBuilder::motion_vector_inputs.
+  MOTION_VECTORS,
+};
+
 //! FrameInfo
 struct FrameInfo {
   FrameInfo() = default;
@@ -36,7 +53,8 @@ struct FrameInfo {
   FrameInfo(FrameInfo&& info) = default;
   FrameInfo& operator=(const FrameInfo&) = default;
 
-  FrameInfo(int shape0, int shape1, int shape2, FrameType type);
+  FrameInfo(int shape0, int shape1, int shape2, FrameType type,
+            FrameLayout layout = FrameLayout::HWC);
 
   bool operator==(const FrameInfo& other) const;
   bool operator!=(const FrameInfo& other) const;
@@ -54,6 +72,7 @@ struct FrameInfo {
 
   int shape[FRAME_DIMS];
   FrameType type;
+  FrameLayout layout = FrameLayout::HWC;
 };
 
 //! Frame
@@ -76,6 +95,7 @@ class Frame {
 
   int shape[FRAME_DIMS];
   FrameType type;
+  FrameLayout layout;
   u8* data;
 };
 
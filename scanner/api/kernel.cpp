@@ -97,13 +97,15 @@ void Kernel::execute_kernel(
 void VideoKernel::check_frame(const DeviceHandle& device,
                               const Element& element) {
   const Frame* frame = element.as_const_frame();
-  bool same = (frame->type == frame_info_.type);
+  bool same = (frame->type == frame_info_.type &&
+               frame->layout == frame_info_.layout);
   for (i32 i = 0; i < 3; ++i) {
     same &= (frame->shape[i] == frame_info_.shape[i]);
   }
   if (!same) {
     memcpy(frame_info_.shape, frame->shape, sizeof(int) * 3);
     frame_info_.type = frame->type;
+    frame_info_.layout = frame->layout;
     new_frame_info();
   }
 }
@@ -134,9 +136,15 @@ KernelRegistration::KernelRegistration(const KernelBuilder& builder) {
   i32 num_devices = builder.num_devices_;
   bool can_batch = builder.can_batch_;
   i32 preferred_batch = builder.preferred_batch_size_;
+  i32 max_batch = builder.max_batch_size_;
+  bool accepts_nv12 = builder.accepts_nv12_frames_;
+  bool parallel = builder.parallel_;
+  bool shared = builder.shared_;
+  i64 device_memory = builder.device_memory_;
   KernelConstructor constructor = builder.constructor_;
   internal::KernelFactory* factory = new internal::KernelFactory(
-      name, type, num_devices, can_batch, preferred_batch, constructor);
+      name, type, num_devices, can_batch, preferred_batch, max_batch,
+      accepts_nv12, parallel, shared, device_memory, constructor);
   internal::KernelRegistry* registry = internal::get_kernel_registry();
   registry->add_kernel(name, factory);
 }
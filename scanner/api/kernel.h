@@ -36,6 +36,11 @@ struct Element {
   inline const FrameInfo* as_const_frame_info() const {
     return reinterpret_cast<FrameInfo*>(buffer);
   }
+  //! Rows of Tensor columns are dense arrays of the column's tensor type
+  template <typename T>
+  inline const T* as_tensor() const {
+    return reinterpret_cast<const T*>(buffer);
+  }
 
   Element() = default;
   Element(const Element&) = default;
@@ -88,6 +93,21 @@ inline void add_element_ref(DeviceHandle device, Element& element) {
   }
 }
 
+//! Returns an element that shares the buffer of the given element.
+//!
+//! Both elements must be deleted with delete_element. Frames get their own
+//! Frame header so that deleting one does not invalidate the other.
+inline Element share_element(DeviceHandle device, Element& element) {
+  if (element.is_frame) {
+    Frame* frame = element.as_frame();
+    add_buffer_ref(device, frame->data);
+    return ::scanner::Element{new Frame(frame->as_frame_info(), frame->data)};
+  } else {
+    add_buffer_ref(device, element.buffer);
+    return ::scanner::Element{element.buffer, element.size};
+  }
+}
+
 inline void delete_element(DeviceHandle device, Element& element) {
   if (element.is_frame) {
     Frame* frame = element.as_frame();
@@ -98,6 +118,9 @@ inline void delete_element(DeviceHandle device, Element& element) {
   }
 }
 
+// cudaStream_t without the CUDA headers
+struct CUstream_st;
+
 //! Kernel parameters provided at instantiation.
 struct KernelConfig {
   std::vector<DeviceHandle> devices;  //! Non-empty set of devices provided to
@@ -108,6 +131,11 @@ struct KernelConfig {
   i32 work_item_size;
   i32 node_id;
   i32 node_count;
+  //! CUDA stream of a GPU kernel, or null. Work the kernel queues on it may
+  //! still be running when execute returns: the engine waits for the stream
+  //! before it reads the outputs or frees the inputs. Kernels that
+  //! synchronize their own work can ignore it.
+  CUstream_st* stream = nullptr;
 };
 
 /**
@@ -154,11 +182,22 @@ class BaseKernel {
   //! Do not call this function.
   virtual void set_profiler(Profiler* profiler) { profiler_ = profiler; }
 
+  //! Do not call this function.
+  void set_rows(std::vector<i64> rows) { rows_.swap(rows); }
+
   /**
    * The profiler allows an op to save profiling data for later
    * visualization. It is not guaranteed to be non-null, so check before use.
    */
   Profiler* profiler_ = nullptr;
+
+  /**
+   * Ids of the rows of the current call to execute, in the order of its
+   * inputs. Stateful kernels can use them to tell whether a call continues
+   * from the rows of the previous one. Empty for parallel and shared kernels,
+   * whose calls may overlap.
+   */
+  std::vector<i64> rows_;
 };
 
 
@@ -393,7 +432,12 @@ class KernelBuilder {
       device_type_(DeviceType::CPU),
       num_devices_(1),
       can_batch_(false),
-      preferred_batch_size_(1) {}
+      preferred_batch_size_(1),
+      max_batch_size_(0),
+      accepts_nv12_frames_(false),
+      parallel_(false),
+      shared_(false),
+      device_memory_(0) {}
 
   KernelBuilder& device(DeviceType device_type) {
     device_type_ = device_type;
@@ -405,9 +449,53 @@ class KernelBuilder {
     return *this;
   }
 
+  //! Kernel executes several rows at once. Ops that do not set a batch size
+  //! use preferred_batch_size.
   KernelBuilder& batch(i32 preferred_batch_size = 1) {
     can_batch_ = true;
-    preferred_batch_size = preferred_batch_size;
+    preferred_batch_size_ = preferred_batch_size;
+    return *this;
+  }
+
+  //! Largest batch the kernel can execute, such as the batch a network was
+  //! allocated for. Ops may not set a larger batch size.
+  KernelBuilder& max_batch(i32 max_batch_size) {
+    max_batch_size_ = max_batch_size;
+    return *this;
+  }
+
+  //! Kernel handles frames with FrameLayout::NV12, so decoders can skip the
+  //! conversion to RGB when it is the only reader of a video column.
+  KernelBuilder& accepts_nv12_frames() {
+    accepts_nv12_frames_ = true;
+    return *this;
+  }
+
+  //! Kernel execute may run on different rows at the same time from several
+  //! threads, so the engine spreads the rows of each batch over a thread
+  //! pool. Ops that do not set a batch size use preferred_batch_size.
+  KernelBuilder& parallel(i32 preferred_batch_size = 16) {
+    parallel_ = true;
+    preferred_batch_size_ = preferred_batch_size;
+    return *this;
+  }
+
+  //! Kernel execute may be called from several threads at once, either
+  //! because it is thread safe or because it queues calls itself, so the
+  //! pipeline instances on a device share one instance of the kernel. Shared
+  //! kernels are not reset between tasks.
+  KernelBuilder& shared() {
+    shared_ = true;
+    return *this;
+  }
+
+  //! Bytes of memory an instance of the kernel needs on each of its GPUs,
+  //! such as the weights and workspace of a network. Kernel groups of jobs
+  //! with such kernels are placed on the GPUs with the most room left for
+  //! them, and buffers the kernel allocates from the pools past its budget
+  //! fail as if the pool were full.
+  KernelBuilder& device_memory(i64 bytes) {
+    device_memory_ = bytes;
     return *this;
   }
 
@@ -418,6 +506,11 @@ class KernelBuilder {
   i32 num_devices_;
   bool can_batch_;
   i32 preferred_batch_size_;
+  i32 max_batch_size_;
+  bool accepts_nv12_frames_;
+  bool parallel_;
+  bool shared_;
+  i64 device_memory_;
 };
 }
 
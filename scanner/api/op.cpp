@@ -77,18 +77,20 @@ OpRegistration::OpRegistration(const OpBuilder& builder) {
   }
   std::vector<Column> output_columns;
   i = 0;
-  for (auto& name_type : builder.output_columns_) {
-    Column col;
+  for (const Column& column : builder.output_columns_) {
+    Column col = column;
     col.set_id(i++);
-    col.set_name(std::get<0>(name_type));
-    col.set_type(std::get<1>(name_type));
     output_columns.push_back(col);
   }
+  if (builder.filter_ && output_columns.empty()) {
+    LOG(FATAL) << "Filter op " << name << " must have an output column";
+  }
   bool can_stencil = builder.can_stencil_;
   const std::vector<i32>& stencil = builder.preferred_stencil_;
   OpInfo* info =
       new OpInfo(name, variadic_inputs, input_columns, output_columns,
-                 can_stencil, stencil);
+                 can_stencil, stencil, builder.filter_,
+                 builder.max_input_height_, builder.motion_vector_inputs_);
   OpRegistry* registry = get_op_registry();
   registry->add_op(name, info);
 }
@@ -92,7 +92,12 @@ class OpBuilder {
   friend class OpRegistration;
 
   OpBuilder(const std::string& name)
-    : name_(name), variadic_inputs_(false), can_stencil_(false) {}
+    : name_(name),
+      variadic_inputs_(false),
+      can_stencil_(false),
+      filter_(false),
+      max_input_height_(0),
+      motion_vector_inputs_(false) {}
 
   OpBuilder& variadic_inputs() {
     if (input_columns_.size() > 0) {
@@ -119,7 +124,10 @@ class OpBuilder {
 
   OpBuilder& output(const std::string& name,
                     ColumnType type = ColumnType::Other) {
-    output_columns_.push_back(std::make_tuple(name, type));
+    Column column;
+    column.set_name(name);
+    column.set_type(type);
+    output_columns_.push_back(column);
     return *this;
   }
 
@@ -127,19 +135,61 @@ class OpBuilder {
     return output(name, ColumnType::Video);
   }
 
+  //! Adds an output whose rows are all dense arrays of type and shape, which
+  //! are saved without a size per row and can be read as typed arrays.
+  OpBuilder& tensor_output(const std::string& name, Column::TensorType type,
+                           const std::vector<i64>& shape = {}) {
+    output(name, ColumnType::Tensor);
+    output_columns_.back().set_tensor_type(type);
+    for (i64 dim : shape) {
+      output_columns_.back().add_tensor_shape(dim);
+    }
+    return *this;
+  }
+
   OpBuilder& stencil(const std::vector<int>& stencil = {0}) {
     can_stencil_ = true;
     preferred_stencil_ = stencil;
     return *this;
   }
 
+  //! Marks the op as a filter. The first byte of each element of its first
+  //! output column decides whether the row is kept: rows where it is zero,
+  //! or whose element is empty, are dropped for the ops after it and from
+  //! the output table.
+  OpBuilder& filter() {
+    filter_ = true;
+    return *this;
+  }
+
+  //! Marks the op as needing frames at most height rows tall. Jobs whose
+  //! ops reading the input video all set one read a proxy of the video
+  //! instead, when one no taller than the smallest of them was made with
+  //! Database.make_proxy.
+  OpBuilder& max_input_height(i32 height) {
+    max_input_height_ = height;
+    return *this;
+  }
+
+  //! Marks the op as reading only the motion vectors of its video inputs
+  //! from the input table. Those columns are decoded into
+  //! FrameLayout::MOTION_VECTORS frames, without the deblocking filter or
+  //! the conversion to RGB, so every op reading them must set this too.
+  OpBuilder& motion_vector_inputs() {
+    motion_vector_inputs_ = true;
+    return *this;
+  }
+
  private:
   std::string name_;
   bool variadic_inputs_;
   std::vector<std::tuple<std::string, ColumnType>> input_columns_;
-  std::vector<std::tuple<std::string, ColumnType>> output_columns_;
+  std::vector<Column> output_columns_;
   bool can_stencil_;
   std::vector<int> preferred_stencil_ = {0};
+  bool filter_;
+  i32 max_input_height_;
+  bool motion_vector_inputs_;
 };
 }
 
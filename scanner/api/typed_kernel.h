@@ -0,0 +1,174 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+
+#include <tuple>
+#include <utility>
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// Typed kernels
+//
+// A kernel deriving from TypedKernel declares the kinds of its columns as
+// template arguments and implements a non-virtual execute_row, which gets
+// each row already converted:
+//
+//   class ThumbnailKernel
+//     : public TypedKernel<ThumbnailKernel, Inputs<FrameIn>,
+//                          Outputs<FrameOut, TensorOut<f32, 4>>> {
+//    public:
+//     void execute_row(const Frame* frame, Frame*& thumbnail, f32* stats);
+//   };
+//
+// The adapter from the engine's columns to execute_row is generated at
+// compile time: each row costs one call the compiler can inline, with no
+// Columns vectors built per row and no lookups of columns by index. Tensor
+// outputs of a batch share one allocation.
+//
+// Rows are passed without their stencil, so ops with a stencil other than
+// {0} need a StenciledKernel. Ops registered with parallel() have
+// execute_row called from several threads at once.
+
+//! Input column of frames, passed as const Frame*.
+struct FrameIn {
+  using Arg = const Frame*;
+  static Arg get(const Element& element) { return element.as_const_frame(); }
+};
+
+//! Input column of byte rows, passed as the const Element& holding them.
+struct BytesIn {
+  using Arg = const Element&;
+  static Arg get(const Element& element) { return element; }
+};
+
+//! Input column of tensors of T, passed as const T* to the row's values.
+template <typename T>
+struct TensorIn {
+  using Arg = const T*;
+  static Arg get(const Element& element) { return element.as_tensor<T>(); }
+};
+
+//! Output column of frames. execute_row sets the Frame*& it is passed to a
+//! frame from new_frame.
+struct FrameOut {
+  struct State {
+    Frame* frame = nullptr;
+  };
+  using Arg = Frame*&;
+  static void begin(State& state, DeviceHandle device, size_t rows) {}
+  static Arg get(State& state, size_t row) { return state.frame; }
+  static void end_row(State& state, size_t row, ElementList& column) {
+    insert_frame(column, state.frame);
+    state.frame = nullptr;
+  }
+};
+
+//! Output column of byte rows. execute_row fills the Element& it is passed,
+//! e.g. with insert_element.
+struct BytesOut {
+  struct State {
+    Element element;
+  };
+  using Arg = Element&;
+  static void begin(State& state, DeviceHandle device, size_t rows) {}
+  static Arg get(State& state, size_t row) { return state.element; }
+  static void end_row(State& state, size_t row, ElementList& column) {
+    column.push_back(state.element);
+  }
+};
+
+//! Output column of N values of T per row, such as a tensor column.
+//! execute_row writes the values of its row to the T* it is passed, which
+//! points into one buffer on the kernel's device for the whole batch.
+template <typename T, size_t N>
+struct TensorOut {
+  static constexpr size_t ROW_SIZE = N * sizeof(T);
+  struct State {
+    u8* block = nullptr;
+  };
+  using Arg = T*;
+  static void begin(State& state, DeviceHandle device, size_t rows) {
+    if (rows > 0) {
+      state.block = new_block_buffer(device, ROW_SIZE * rows, rows);
+    }
+  }
+  static Arg get(State& state, size_t row) {
+    return reinterpret_cast<T*>(state.block + row * ROW_SIZE);
+  }
+  static void end_row(State& state, size_t row, ElementList& column) {
+    insert_element(column, state.block + row * ROW_SIZE, ROW_SIZE);
+  }
+};
+
+template <typename... Columns>
+struct Inputs {};
+
+template <typename... Columns>
+struct Outputs {};
+
+template <typename Derived, typename In, typename Out>
+class TypedKernel;
+
+//! Kernel whose rows are converted to the types of its columns at compile
+//! time. See the description above.
+template <typename Derived, typename... In, typename... Out>
+class TypedKernel<Derived, Inputs<In...>, Outputs<Out...>>
+    : public BaseKernel {
+ public:
+  TypedKernel(const KernelConfig& config)
+    : BaseKernel(config), device_(config.devices[0]) {}
+
+  void execute_kernel(const StenciledBatchedColumns& input_columns,
+                      BatchedColumns& output_columns) final {
+    LOG_IF(FATAL, input_columns.size() != sizeof...(In) ||
+                      output_columns.size() != sizeof...(Out))
+        << "Kernel declares " << sizeof...(In) << " inputs and "
+        << sizeof...(Out) << " outputs, but was given "
+        << input_columns.size() << " and " << output_columns.size();
+    size_t rows = input_columns.empty() ? 0 : input_columns[0].size();
+    execute_rows(input_columns, output_columns, rows,
+                 std::index_sequence_for<In...>(),
+                 std::index_sequence_for<Out...>());
+  }
+
+ protected:
+  DeviceHandle device_;
+
+ private:
+  template <size_t... I, size_t... O>
+  void execute_rows(const StenciledBatchedColumns& input_columns,
+                    BatchedColumns& output_columns, size_t rows,
+                    std::index_sequence<I...>, std::index_sequence<O...>) {
+    std::tuple<typename Out::State...> states;
+    // Expands a statement over the output columns
+    using expand = int[];
+    (void)expand{0, (Out::begin(std::get<O>(states), device_, rows),
+                     output_columns[O].reserve(output_columns[O].size() +
+                                               rows),
+                     0)...};
+    Derived* kernel = static_cast<Derived*>(this);
+    for (size_t r = 0; r < rows; ++r) {
+      kernel->execute_row(In::get(input_columns[I][r][0])...,
+                          Out::get(std::get<O>(states), r)...);
+      (void)expand{
+          0, (Out::end_row(std::get<O>(states), r, output_columns[O]), 0)...};
+    }
+  }
+};
+}
@@ -0,0 +1,314 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/column_reader.h"
+#include "scanner/engine/load_worker.h"
+#include "scanner/engine/metadata_cache.h"
+#include "scanner/util/storehouse.h"
+#include "scanner/util/thread_pool.h"
+#include "scanner/video/decode_cost_model.h"
+#include "scanner/video/decoder_pool.h"
+#include "storehouse/storage_backend.h"
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+
+namespace scanner {
+namespace internal {
+namespace {
+
+// Rows of an item that are more than this many rows apart on average are
+// read one at a time instead of with one read of the range they cover
+const i64 SPARSITY_THRESHOLD = 8;
+
+// Reads rows, relative to the start of the item, of one item of a column
+void read_item_rows(storehouse::StorageBackend* storage,
+                    const TableMetadata& table, i32 column_id, i32 item_id,
+                    const i64* rows, size_t num_rows, std::string* output) {
+  std::unique_ptr<storehouse::RandomReadFile> file;
+  STORE_CHECK(open_item_file(storage, table.packed_items(), table.id(),
+                             column_id, item_id, file));
+  ItemFileHeader header = read_item_file_header(file.get());
+
+  i64 first = rows[0];
+  i64 last = rows[num_rows - 1] + 1;
+  u64 start_offset = header.element_offsets[first];
+  u64 end_offset = header.element_offsets[last];
+  bool sparse = (last - first) / (i64)num_rows >= SPARSITY_THRESHOLD;
+
+  proto::Column::BlockCodec codec = table.column_block_codec(column_id);
+  if (codec != proto::Column::NONE) {
+    // Offsets are into the decompressed data, which the reader only
+    // decompresses the blocks of
+    CompressedItemReader reader(file.get(), codec, header.data_start);
+    for (size_t i = 0; i < num_rows; ++i) {
+      i64 row = rows[i];
+      output[i].resize(header.element_size(row));
+      reader.read(header.element_offsets[row],
+                  header.element_offsets[row + 1], (u8*)&output[i][0]);
+    }
+    return;
+  }
+
+  if (sparse) {
+    for (size_t i = 0; i < num_rows; ++i) {
+      i64 row = rows[i];
+      output[i].resize(header.element_size(row));
+      s_read(file.get(), (u8*)&output[i][0], output[i].size(),
+             header.data_start + header.element_offsets[row]);
+    }
+    return;
+  }
+
+  std::vector<u8> element_data(end_offset - start_offset);
+  s_read(file.get(), element_data.data(), element_data.size(),
+         header.data_start + start_offset);
+  for (size_t i = 0; i < num_rows; ++i) {
+    i64 row = rows[i];
+    const u8* element =
+        element_data.data() + header.element_offsets[row] - start_offset;
+    output[i].assign((const char*)element, header.element_size(row));
+  }
+}
+
+// Splits sorted rows of the table within items [begin_item, end_item), or
+// all of their rows if rows is empty, into rows relative to their item.
+// Rows of item i are [item_starts[i - begin_item],
+// item_starts[i - begin_item + 1]) of item_rows.
+void split_item_rows(const TableMetadata& table, i32 begin_item,
+                     i32 end_item, const std::vector<i64>& rows,
+                     std::vector<i64>& item_rows,
+                     std::vector<size_t>& item_starts) {
+  std::vector<i64> end_rows = table.end_rows();
+  LOG_IF(FATAL, begin_item < 0 || end_item > (i32)end_rows.size() ||
+                    begin_item > end_item)
+      << "Items [" << begin_item << ", " << end_item << ") are not in table "
+      << table.name();
+  i64 first_row = begin_item == 0 ? 0 : end_rows[begin_item - 1];
+  i64 last_row = begin_item == end_item ? first_row : end_rows[end_item - 1];
+  std::vector<i64> all_rows;
+  const std::vector<i64>* requested = &rows;
+  if (rows.empty()) {
+    all_rows.resize(last_row - first_row);
+    for (size_t i = 0; i < all_rows.size(); ++i) {
+      all_rows[i] = first_row + i;
+    }
+    requested = &all_rows;
+  }
+
+  item_rows.resize(requested->size());
+  item_starts.assign(end_item - begin_item + 1, 0);
+  size_t pos = 0;
+  for (i32 item = begin_item; item < end_item; ++item) {
+    i64 item_start = item == 0 ? 0 : end_rows[item - 1];
+    item_starts[item - begin_item] = pos;
+    while (pos < requested->size() && (*requested)[pos] < end_rows[item]) {
+      LOG_IF(FATAL, (*requested)[pos] < item_start ||
+                        (pos > 0 && (*requested)[pos] < (*requested)[pos - 1]))
+          << "Rows must be sorted and within the items read from table "
+          << table.name();
+      item_rows[pos] = (*requested)[pos] - item_start;
+      pos++;
+    }
+  }
+  item_starts[end_item - begin_item] = pos;
+  LOG_IF(FATAL, pos != requested->size())
+      << "Row " << (*requested)[pos] << " is past the items read from table "
+      << table.name();
+}
+
+std::vector<std::unique_ptr<storehouse::StorageBackend>> make_storages(
+    storehouse::StorageConfig* config, i32 num_threads) {
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> storages(
+      num_threads);
+  for (auto& storage : storages) {
+    storage.reset(storehouse::StorageBackend::make_from_config(config));
+  }
+  return storages;
+}
+}
+
+std::vector<std::string> read_column_rows(
+    storehouse::StorageConfig* config, const TableMetadata& table,
+    i32 column_id, i32 begin_item, i32 end_item, const std::vector<i64>& rows,
+    i32 num_threads) {
+  // Rows relative to their item, and where each item's rows begin
+  std::vector<i64> item_rows;
+  std::vector<size_t> item_starts;
+  split_item_rows(table, begin_item, end_item, rows, item_rows, item_starts);
+
+  std::vector<std::string> output(item_rows.size());
+  num_threads = std::max(1, num_threads);
+  auto storages = make_storages(config, num_threads);
+  WorkStealingPool pool(num_threads);
+  for (i32 item = begin_item; item < end_item; ++item) {
+    size_t begin = item_starts[item - begin_item];
+    size_t end = item_starts[item - begin_item + 1];
+    if (begin == end) {
+      continue;
+    }
+    pool.submit([&, item, begin, end](i32 thread_id) {
+      read_item_rows(storages[thread_id].get(), table, column_id, item,
+                     item_rows.data() + begin, end - begin,
+                     output.data() + begin);
+    });
+  }
+  pool.wait_idle();
+  return output;
+}
+
+std::string read_column_data(storehouse::StorageConfig* config,
+                             const TableMetadata& table, i32 column_id,
+                             i32 begin_item, i32 end_item,
+                             const std::vector<i64>& rows, i32 num_threads,
+                             i64& element_size) {
+  std::vector<std::string> elements =
+      read_column_rows(config, table, column_id, begin_item, end_item, rows,
+                       num_threads);
+  element_size = elements.empty() ? 0 : elements[0].size();
+  for (const std::string& element : elements) {
+    if ((i64)element.size() != element_size) {
+      element_size = -1;
+      return std::string();
+    }
+  }
+  std::string data;
+  data.reserve(element_size * elements.size());
+  for (std::string& element : elements) {
+    data.append(element);
+    std::string().swap(element);
+  }
+  return data;
+}
+
+std::string decode_video_rows(storehouse::StorageConfig* config,
+                              const TableMetadata& table, i32 column_id,
+                              i32 begin_item, i32 end_item,
+                              const std::vector<i64>& rows, i32 num_threads,
+                              FrameInfo& info) {
+  std::vector<i64> item_rows;
+  std::vector<size_t> item_starts;
+  split_item_rows(table, begin_item, end_item, rows, item_rows, item_starts);
+  info = FrameInfo();
+  if (item_rows.empty()) {
+    return std::string();
+  }
+
+  num_threads = std::max(1, num_threads);
+  auto storages = make_storages(config, num_threads);
+  std::vector<Profiler> profilers(num_threads, Profiler(now()));
+  WorkStealingPool pool(num_threads);
+  std::vector<i64> end_rows = table.end_rows();
+  f64 seek_cost = decode_cost_model(VideoDecoderType::SOFTWARE).seek_cost();
+
+  // Keyframe intervals of each item, read the same way as by the load
+  // worker
+  i32 num_items = end_item - begin_item;
+  std::vector<std::vector<proto::DecodeArgs>> item_args(num_items);
+  std::vector<std::shared_ptr<const VideoIndexEntry>> entries(num_items);
+  for (i32 item = begin_item; item < end_item; ++item) {
+    size_t begin = item_starts[item - begin_item];
+    size_t end = item_starts[item - begin_item + 1];
+    if (begin == end) {
+      continue;
+    }
+    pool.submit([&, item, begin, end](i32 thread_id) {
+      storehouse::StorageBackend* storage = storages[thread_id].get();
+      std::shared_ptr<const VideoIndexEntry> entry =
+          metadata_cache().video_index(storage, table.id(), column_id, item);
+      LOG_IF(FATAL, entry->codec_type == proto::VideoDescriptor::RAW)
+          << "Column " << column_id << " of table " << table.name()
+          << " holds raw frames, which are read without decoding";
+      VideoIndexEntry storage_entry = *entry;
+      storage_entry.storage = storage;
+      std::vector<i64> offsets(item_rows.begin() + begin,
+                               item_rows.begin() + end);
+      ElementList elements;
+      read_video_column(profilers[thread_id], storage_entry, offsets,
+                        item == 0 ? 0 : end_rows[item - 1], elements, 0,
+                        true, seek_cost);
+      auto& args = item_args[item - begin_item];
+      for (Element& element : elements) {
+        args.emplace_back();
+        take_decode_args(element, args.back());
+      }
+      entries[item - begin_item] = entry;
+    });
+  }
+  pool.wait_idle();
+
+  std::vector<proto::DecodeArgs> args;
+  std::shared_ptr<const VideoIndexEntry> first_entry;
+  bool same_shape = true;
+  for (i32 i = 0; i < num_items; ++i) {
+    if (!entries[i]) {
+      continue;
+    }
+    if (!first_entry) {
+      first_entry = entries[i];
+    }
+    same_shape &= entries[i]->width == first_entry->width &&
+                  entries[i]->height == first_entry->height &&
+                  entries[i]->codec_type == first_entry->codec_type;
+    std::move(item_args[i].begin(), item_args[i].end(),
+              std::back_inserter(args));
+  }
+  if (!same_shape) {
+    // Frames of different sizes can not share one buffer
+    for (auto& da : args) {
+      delete_buffer(CPU_DEVICE, (u8*)da.encoded_video());
+    }
+    return std::string();
+  }
+
+  // Intervals are split into contiguous runs, one per decoder, so that each
+  // decoder writes its frames to one range of the output
+  info = FrameInfo(first_entry->height, first_entry->width, 3, FrameType::U8);
+  std::string data(item_rows.size() * info.size(), '\0');
+  DecoderKey key{first_entry->codec_type,
+                 VideoDecoderType::SOFTWARE,
+                 CPU_DEVICE,
+                 1,
+                 false,
+                 0,
+                 first_entry->width,
+                 first_entry->height,
+                 info};
+  size_t num_decoders = std::min((size_t)num_threads, args.size());
+  i64 frame_offset = 0;
+  for (size_t d = 0; d < num_decoders; ++d) {
+    size_t begin = d * args.size() / num_decoders;
+    size_t end = (d + 1) * args.size() / num_decoders;
+    i64 num_frames = 0;
+    for (size_t i = begin; i < end; ++i) {
+      num_frames += args[i].valid_frames_size();
+    }
+    u8* buffer = (u8*)&data[frame_offset * info.size()];
+    pool.submit([&, begin, end, num_frames, buffer](i32 thread_id) {
+      std::unique_ptr<DecoderAutomata> decoder = decoder_pool().acquire(key);
+      decoder->initialize(std::vector<proto::DecodeArgs>(
+                              args.begin() + begin, args.begin() + end),
+                          info);
+      decoder->get_frames(buffer, num_frames);
+      decoder_pool().release(key, std::move(decoder));
+    });
+    frame_offset += num_frames;
+  }
+  pool.wait_idle();
+  return data;
+}
+}
+}
@@ -0,0 +1,65 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/api/frame.h"
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+#include "storehouse/storage_config.h"
+
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+//! Reads rows of a column of a table outside of a job, for clients loading
+//! results. Items are read in parallel on num_threads threads. Like the
+//! load worker, each item takes one read of the range its rows cover, or
+//! one read per row if they are sparse.
+//
+// rows are sorted rows of the table within items [begin_item, end_item),
+// or all of their rows if empty, so that clients can bound the memory of a
+// call. Returns the bytes of each row in order.
+std::vector<std::string> read_column_rows(
+    storehouse::StorageConfig* config, const TableMetadata& table,
+    i32 column_id, i32 begin_item, i32 end_item, const std::vector<i64>& rows,
+    i32 num_threads);
+
+//! Reads rows like read_column_rows into one contiguous buffer, for columns
+//! whose rows all have the same size. element_size is set to that size, or
+//! to -1 if the rows differ in size.
+std::string read_column_data(storehouse::StorageConfig* config,
+                             const TableMetadata& table, i32 column_id,
+                             i32 begin_item, i32 end_item,
+                             const std::vector<i64>& rows, i32 num_threads,
+                             i64& element_size);
+
+//! Decodes rows of a compressed video column outside of a job, with
+//! software decoders borrowed from the decoder pool of the process. The
+//! keyframe intervals of each item are planned like the load worker plans
+//! them, and are then split over num_threads decoders.
+//
+// Returns the RGB frames of the rows in order in one buffer and sets info
+// to their shape, or returns an empty buffer with an empty info if the
+// items differ in size.
+std::string decode_video_rows(storehouse::StorageConfig* config,
+                              const TableMetadata& table, i32 column_id,
+                              i32 begin_item, i32 end_item,
+                              const std::vector<i64>& rows, i32 num_threads,
+                              FrameInfo& info);
+}
+}
@@ -1,21 +1,128 @@
 #include "scanner/engine/evaluate_worker.h"
 
+#include "scanner/engine/load_worker.h"
 #include "scanner/engine/op_registry.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/direct_read.h"
+#include "scanner/util/metrics.h"
+#include "scanner/video/decoder_pool.h"
 
-#include <google/protobuf/io/coded_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
 
 namespace scanner {
 namespace internal {
 
+#ifdef HAVE_CUDA
+namespace {
+// Age at which the event GPU batches are timed against is recorded anew. The
+// elapsed times CUDA reports are single precision milliseconds, which keep
+// microseconds for about this long.
+const i64 GPU_CLOCK_ANCHOR_SECONDS = 10;
+}
+#endif
+
+// Drops the first num_rows valid frames of args, along with the intervals and
+// leading keyframes that are no longer needed to decode the rest
+static void drop_leading_rows(std::vector<proto::DecodeArgs>& args,
+                              i64 num_rows) {
+  size_t dropped = 0;
+  while (num_rows > 0) {
+    proto::DecodeArgs& da = args[dropped];
+    if (num_rows >= da.valid_frames_size()) {
+      num_rows -= da.valid_frames_size();
+      delete_buffer(CPU_DEVICE, (u8*)da.encoded_video());
+      dropped++;
+      continue;
+    }
+    std::vector<i64> valid_frames(da.valid_frames().begin() + num_rows,
+                                  da.valid_frames().end());
+    da.clear_valid_frames();
+    for (i64 f : valid_frames) {
+      da.add_valid_frames(f);
+    }
+    // Start at the last keyframe before the first remaining row. The last
+    // keyframe ends the interval and is always kept.
+    i32 k = 0;
+    while (k + 2 < da.keyframes_size() &&
+           da.keyframes(k + 1) <= valid_frames[0]) {
+      k++;
+    }
+    if (k > 0) {
+      std::vector<i64> keyframes(da.keyframes().begin() + k,
+                                 da.keyframes().end());
+      std::vector<i64> offsets(da.keyframe_byte_offsets().begin() + k,
+                               da.keyframe_byte_offsets().end());
+      da.clear_keyframes();
+      da.clear_keyframe_byte_offsets();
+      for (size_t i = 0; i < keyframes.size(); ++i) {
+        da.add_keyframes(keyframes[i]);
+        da.add_keyframe_byte_offsets(offsets[i]);
+      }
+      da.set_start_keyframe(keyframes[0]);
+    }
+    num_rows = 0;
+  }
+  args.erase(args.begin(), args.begin() + dropped);
+}
+
+// Whether a filter op keeps the row of element, from its first byte
+static bool filter_keeps(DeviceHandle device, Element& element) {
+  const u8* data = element.is_frame ? element.as_frame()->data : element.buffer;
+  size_t size = element.is_frame ? element.as_frame()->size() : element.size;
+  if (size == 0) {
+    return false;
+  }
+  u8 flag;
+  memcpy_buffer(&flag, CPU_DEVICE, data, device, 1);
+  return flag != 0;
+}
+
 PreEvaluateWorker::PreEvaluateWorker(const PreEvaluateWorkerArgs& args)
   : node_id_(args.node_id),
     worker_id_(args.worker_id),
     device_handle_(args.device_handle),
     num_cpus_(args.num_cpus),
+    nv12_frames_(args.nv12_frames),
+    decode_width_(args.decode_width),
+    decode_height_(args.decode_height),
+    decode_parallelism_(std::max(args.decode_parallelism, 1)),
+    codec_threads_(args.codec_threads),
+    codec_slice_threads_(args.codec_slice_threads),
+    gpu_decode_surfaces_(args.gpu_decode_surfaces),
+    decode_gpu_ids_(args.decode_gpu_ids),
+    stencil_overlap_rows_(args.stencil_overlap_rows),
+    motion_vector_columns_(args.motion_vector_columns),
     profiler_(args.profiler) {
+  // Select a decoder type based on the type of the first op and
+  // the available decoders
+  if (device_handle_.type == DeviceType::GPU &&
+      VideoDecoder::has_decoder_type(VideoDecoderType::NVIDIA)) {
+    decoder_type_ = VideoDecoderType::NVIDIA;
+    decoder_num_devices_ = 1;
+  } else if (device_handle_.type == DeviceType::CPU &&
+             VideoDecoder::has_decoder_type(VideoDecoderType::INTEL)) {
+    // An integrated GPU takes decoding off the cores of CPU pipelines
+    decoder_type_ = VideoDecoderType::INTEL;
+    decoder_num_devices_ = 1;
+  } else {
+    decoder_type_ = VideoDecoderType::SOFTWARE;
+    decoder_num_devices_ = codec_threads_;
+  }
+  if (decode_parallelism_ > 1) {
+    decode_pool_.reset(new WorkStealingPool(decode_parallelism_));
+  }
+}
+
+PreEvaluateWorker::~PreEvaluateWorker() {
+  clear_frame_cache();
+  for (size_t i = 0; i < decoders_.size(); ++i) {
+    for (auto& decoder : decoders_[i]) {
+      decoder_pool().release(decoder_keys_[i], std::move(decoder));
+    }
+  }
 }
 
 void PreEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
@@ -44,65 +151,153 @@ void PreEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
         std::max(total_rows_, (i64)work_entry.columns[i].size());
   }
 
-  // FIXME: do we need this w/ multiple videos of different resolutions in the same
-  // task?
-  if (needs_configure_) {
-    // decoders_.clear();
-  }
-
-  // Setup decoders if they have not been initialized yet
-  if (decoders_.empty()) {
-    auto init_start = now();
-    VideoDecoderType decoder_type;
-    i32 num_devices;
-    // Select a decoder type based on the type of the first op and
-    // the available decoders
-    if (device_handle_.type == DeviceType::GPU &&
-        VideoDecoder::has_decoder_type(VideoDecoderType::NVIDIA)) {
-      decoder_output_handle_.type = DeviceType::GPU;
-      decoder_output_handle_.id = device_handle_.id;
-      decoder_type = VideoDecoderType::NVIDIA;
-      num_devices = 1;
-    } else {
-      decoder_output_handle_ = CPU_DEVICE;
-      decoder_type = VideoDecoderType::SOFTWARE;
-      num_devices = num_cpus_;
-    }
-    for (size_t c = 0; c < work_entry.columns.size(); ++c) {
-      if (work_entry.column_types[c] == ColumnType::Video) {
-        decoders_.emplace_back(
-            new DecoderAutomata(device_handle_, num_devices, decoder_type));
-        decoders_.back()->set_profiler(&profiler_);
-      }
-    }
-    profiler_.add_interval("init", init_start, now());
-  }
-
   i32 media_col_idx = 0;
   auto setup_start = now();
   // Deserialize all decode args into protobufs
-  decode_args_.clear();
   for (size_t c = 0; c < work_entry.columns.size(); ++c) {
-    if (work_entry.column_types[c] == ColumnType::Video &&
-        work_entry.video_encoding_type[media_col_idx] ==
-            proto::VideoDescriptor::H264) {
-      decode_args_.emplace_back();
-      auto& args = decode_args_.back();
-      for (Element element : work_entry.columns[c]) {
+    if (work_entry.column_types[c] != ColumnType::Video) {
+      continue;
+    }
+    if ((size_t)media_col_idx >= decoders_.size()) {
+      decoders_.emplace_back();
+      decoder_keys_.emplace_back();
+      decode_runs_.emplace_back();
+      decode_infos_.emplace_back();
+      column_rows_.emplace_back();
+      cached_frames_.emplace_back();
+    }
+    column_rows_[media_col_idx].clear();
+    cached_frames_[media_col_idx].clear();
+    if (work_entry.video_encoding_type[media_col_idx] !=
+        proto::VideoDescriptor::RAW) {
+      std::vector<proto::DecodeArgs> args;
+      args.reserve(work_entry.columns[c].size());
+      for (Element& element : work_entry.columns[c]) {
         args.emplace_back();
-        proto::DecodeArgs& da = args.back();
-        google::protobuf::io::ArrayInputStream in_stream(element.buffer,
-                                                         element.size);
-        google::protobuf::io::CodedInputStream cstream(&in_stream);
-        cstream.SetTotalBytesLimit(element.size + 1, element.size + 1);
-        bool result = da.ParseFromCodedStream(&cstream);
-        assert(result);
-        delete_element(CPU_DEVICE, element);
+        take_decode_args(element, args.back());
+      }
+      bool motion_vectors =
+          c < motion_vector_columns_.size() && motion_vector_columns_[c];
+      if (motion_vectors) {
+        // One motion vector per macroblock, which only the software
+        // decoder exports
+        decode_infos_[media_col_idx] =
+            FrameInfo((args[0].height() + 15) / 16,
+                      (args[0].width() + 15) / 16, 3, FrameType::F32,
+                      FrameLayout::MOTION_VECTORS);
+      } else {
+        // Scale down while decoding instead of materializing full
+        // resolution frames. The size is kept even so that NVDEC can scale
+        // to it and the frames can be laid out as NV12.
+        i32 width = args[0].width();
+        i32 height = args[0].height();
+        if (decode_width_ > 0 && decode_height_ > 0 &&
+            decode_width_ <= width && decode_height_ <= height) {
+          width = std::max(decode_width_ / 2 * 2, 2);
+          height = std::max(decode_height_ / 2 * 2, 2);
+        }
+        // NV12 stores chroma at half resolution, so odd sizes stay RGB
+        FrameLayout layout = FrameLayout::HWC;
+        if (nv12_frames_ && width % 2 == 0 && height % 2 == 0) {
+          layout = FrameLayout::NV12;
+        }
+        decode_infos_[media_col_idx] =
+            FrameInfo(height, width, 3, FrameType::U8, layout);
+      }
+
+      // Reuse the decoder of the previous item if the shape is the same,
+      // otherwise borrow one configured for this shape from the pool
+      DecoderKey key{work_entry.video_encoding_type[media_col_idx],
+                     motion_vectors ? VideoDecoderType::SOFTWARE
+                                    : decoder_type_,
+                     motion_vectors ? CPU_DEVICE : device_handle_,
+                     motion_vectors ? codec_threads_ : decoder_num_devices_,
+                     codec_slice_threads_,
+                     gpu_decode_surfaces_,
+                     args[0].width(),
+                     args[0].height(),
+                     decode_infos_[media_col_idx]};
+      auto& decoders = decoders_[media_col_idx];
+      if (!decoders.empty()) {
+        // Decoders stay on the GPU they were placed on
+        key.device_handle = decoder_keys_[media_col_idx].device_handle;
+        if (decoder_keys_[media_col_idx] != key) {
+          for (auto& decoder : decoders) {
+            decoder_pool().release(decoder_keys_[media_col_idx],
+                                   std::move(decoder));
+          }
+          decoders.clear();
+          // Frames of a different shape need the encoders set up again
+          needs_configure_ = true;
+        }
+      }
+      if (decoders.empty() && key.decoder_type == VideoDecoderType::NVIDIA &&
+          !decode_gpu_ids_.empty()) {
+        // Place new sessions on the GPU of the node with the fewest of them,
+        // the frames are copied to the GPU of the first kernel after
+        // decoding
+        key.device_handle.id = decoder_pool().least_loaded_gpu(
+            decode_gpu_ids_, device_handle_.id);
+      }
+      decoder_keys_[media_col_idx] = key;
+
+      // Leading rows that the last item also decoded are taken from the
+      // frame cache instead
+      auto& rows = column_rows_[media_col_idx];
+      for (auto& da : args) {
+        rows.insert(rows.end(), da.valid_frames().begin(),
+                    da.valid_frames().end());
+      }
+      auto& cached = cached_frames_[media_col_idx];
+      for (i64 row : rows) {
+        auto it = frame_cache_.find(
+            std::make_tuple(io_item.table_id(), (i32)c, row));
+        if (it == frame_cache_.end()) {
+          break;
+        }
+        cached.push_back(it->second);
+        frame_cache_.erase(it);
+      }
+      drop_leading_rows(args, cached.size());
+      profiler_.increment("decode_cached_rows", (i64)cached.size());
+
+      // Intervals start at keyframes, so they are dealt out to the decoders
+      // in turn and the rows of each chunk are spread over all of them
+      size_t num_decoders =
+          std::min((size_t)decode_parallelism_, args.size());
+      std::vector<std::vector<proto::DecodeArgs>> decoder_args(num_decoders);
+      auto& runs = decode_runs_[media_col_idx];
+      runs.clear();
+      for (size_t i = 0; i < args.size(); ++i) {
+        i32 d = i % num_decoders;
+        i64 rows = args[i].valid_frames_size();
+        if (!runs.empty() && std::get<0>(runs.back()) == d) {
+          std::get<1>(runs.back()) += rows;
+        } else {
+          runs.emplace_back(d, rows);
+        }
+        decoder_args[d].push_back(std::move(args[i]));
+      }
+      while (decoders.size() < num_decoders) {
+        auto init_start = now();
+        decoders.push_back(decoder_pool().acquire(key));
+        decoders.back()->set_profiler(&profiler_);
+        profiler_.add_interval("init", init_start, now());
+      }
+      for (size_t d = 0; d < decoders.size(); ++d) {
+        if (d < num_decoders) {
+          decoders[d]->initialize(decoder_args[d],
+                                  decode_infos_[media_col_idx]);
+        } else {
+          decoders[d]->finish();
+        }
       }
-      decoders_[media_col_idx]->initialize(args);
-      media_col_idx++;
     }
+    media_col_idx++;
   }
+  // Rows of other items are not read again by this worker
+  clear_frame_cache();
+  cache_rows_ = work_entry.warmup_rows + stencil_overlap_rows_;
   first_item_ = true;
   current_row_ = 0;
   profiler_.add_interval("feed", feed_start, now());
@@ -128,6 +323,7 @@ bool PreEvaluateWorker::yield(i32 item_size,
   entry.needs_reset = first_item_ ? needs_reset_ : false;
   entry.last_in_task = (r + item_size >= total_rows_) ? true : false;
   entry.warmup_rows = work_entry.warmup_rows;
+  entry.frame_rate = work_entry.frame_rate;
   entry.columns.resize(work_entry.columns.size());
 
   i64 start = r;
@@ -136,20 +332,56 @@ bool PreEvaluateWorker::yield(i32 item_size,
     if (work_entry.column_types[c] == ColumnType::Video) {
       // Perform decoding
       i64 num_rows = end - start;
-      if (work_entry.video_encoding_type[media_col_idx] ==
-          proto::VideoDescriptor::H264) {
+      if (work_entry.video_encoding_type[media_col_idx] !=
+          proto::VideoDescriptor::RAW) {
         // Encoded as video
-        FrameInfo frame_info(decode_args_[media_col_idx][0].height(),
-                             decode_args_[media_col_idx][0].width(), 3,
-                             FrameType::U8);
-        u8* buffer = new_block_buffer(decoder_output_handle_,
-                                      num_rows * frame_info.size(), num_rows);
-        decoders_[media_col_idx]->get_frames(buffer, num_rows);
-        for (i64 n = 0; n < num_rows; ++n) {
+        const FrameInfo& frame_info = decode_infos_[media_col_idx];
+        const DecoderKey& key = decoder_keys_[media_col_idx];
+        DeviceHandle output_handle =
+            key.decoder_type == VideoDecoderType::NVIDIA ? key.device_handle
+                                                         : CPU_DEVICE;
+        auto& cached = cached_frames_[media_col_idx];
+        i64 num_cached =
+            std::max(std::min((i64)cached.size() - start, num_rows), (i64)0);
+        for (i64 n = 0; n < num_cached; ++n) {
           insert_frame(entry.columns[c],
-                       new Frame(frame_info, buffer + frame_info.size() * n));
+                       new Frame(frame_info, cached[start + n]));
+        }
+        i64 num_decoded = num_rows - num_cached;
+        if (num_decoded > 0) {
+          u8* buffer = new_block_buffer(
+              output_handle, num_decoded * frame_info.size(), num_decoded);
+          decode_rows(media_col_idx, buffer, num_decoded);
+          ElementList decoded;
+          for (i64 n = 0; n < num_decoded; ++n) {
+            insert_frame(decoded,
+                         new Frame(frame_info, buffer + frame_info.size() * n));
+          }
+          // Frames decoded on the CPU or on another GPU are moved here, so
+          // the transfer overlaps the evaluate stage instead of stalling it
+          auto transfer_start = now();
+          move_if_different_address_space(profiler_, output_handle,
+                                          device_handle_, decoded);
+          if (!output_handle.is_same_address_space(device_handle_)) {
+            profiler_.add_interval("decode_transfer", transfer_start, now());
+          }
+          entry.columns[c].insert(entry.columns[c].end(), decoded.begin(),
+                                  decoded.end());
+        }
+        // Keep the rows the next item may share with this one
+        const auto& rows = column_rows_[media_col_idx];
+        i64 cache_start = std::max(start, (i64)rows.size() - cache_rows_);
+        for (i64 n = cache_start; n < end && n < (i64)rows.size(); ++n) {
+          u8* data = entry.columns[c][n - start].as_frame()->data;
+          add_buffer_ref(device_handle_, data);
+          auto key = std::make_tuple(io_item.table_id(), (i32)c, rows[n]);
+          auto it = frame_cache_.find(key);
+          if (it != frame_cache_.end()) {
+            delete_buffer(device_handle_, it->second);
+          }
+          frame_cache_[key] = data;
         }
-        entry.column_handles.push_back(decoder_output_handle_);
+        entry.column_handles.push_back(device_handle_);
       } else {
         // Encoded as raw data
         FrameInfo frame_info = work_entry.frame_sizes[media_col_idx];
@@ -161,6 +393,39 @@ bool PreEvaluateWorker::yield(i32 item_size,
         entry.column_handles.push_back(work_entry.column_handles[c]);
       }
       media_col_idx++;
+    } else if (!work_entry.direct_reads.empty() &&
+               work_entry.direct_reads[c]) {
+      // Read the rows from their files into a block on the device of the
+      // first kernel
+      i64 num_rows = end - start;
+      std::vector<proto::DirectReadArgs> args(num_rows);
+      size_t total_size = 0;
+      for (i64 n = 0; n < num_rows; ++n) {
+        Element& element = work_entry.columns[c][start + n];
+        bool result = args[n].ParseFromArray(element.buffer, element.size);
+        assert(result);
+        delete_element(CPU_DEVICE, element);
+        total_size += args[n].size();
+      }
+      auto read_start = now();
+      u8* block = new_block_buffer(
+          device_handle_, std::max(total_size, (size_t)1), num_rows);
+      std::vector<FileRange> ranges;
+      u8* buffer = block;
+      for (auto& ra : args) {
+        ranges.push_back(FileRange{ra.path(), (u64)ra.offset(),
+                                   (size_t)ra.size(), buffer});
+        insert_element(entry.columns[c], buffer, ra.size());
+        buffer += ra.size();
+      }
+      LOG_IF(FATAL, !read_file_ranges(device_handle_, ranges))
+          << "Failed to read rows of column " << c << " from disk";
+      profiler_.add_interval("direct_read", read_start, now());
+      profiler_.increment("io_direct", (i64)total_size);
+      static std::atomic<i64>& read_bytes =
+          metric_counter("scanner_io_read_bytes_total");
+      read_bytes += total_size;
+      entry.column_handles.push_back(device_handle_);
     } else {
       entry.columns[c] =
           std::vector<Element>(work_entry.columns[c].begin() + start,
@@ -176,17 +441,103 @@ bool PreEvaluateWorker::yield(i32 item_size,
   return true;
 }
 
+void PreEvaluateWorker::decode_rows(i32 media_col_idx, u8* buffer,
+                                    i64 num_rows) {
+  auto& decoders = decoders_[media_col_idx];
+  auto& runs = decode_runs_[media_col_idx];
+  size_t frame_size = decode_infos_[media_col_idx].size();
+
+  // Parts of the buffer each decoder fills, in the order it produces them
+  std::vector<std::vector<std::tuple<u8*, i64>>> parts(decoders.size());
+  i32 active_decoders = 0;
+  u8* part_buffer = buffer;
+  while (num_rows > 0) {
+    assert(!runs.empty());
+    i32 d = std::get<0>(runs.front());
+    i64& run_rows = std::get<1>(runs.front());
+    i64 rows = std::min(num_rows, run_rows);
+    if (parts[d].empty()) {
+      active_decoders++;
+    }
+    parts[d].emplace_back(part_buffer, rows);
+    part_buffer += rows * frame_size;
+    num_rows -= rows;
+    run_rows -= rows;
+    if (run_rows == 0) {
+      runs.pop_front();
+    }
+  }
+
+  auto decode_parts = [&decoders, &parts](i32 d) {
+    for (auto& part : parts[d]) {
+      decoders[d]->get_frames(std::get<0>(part), std::get<1>(part));
+    }
+  };
+  if (active_decoders > 1 && decode_pool_) {
+    for (size_t d = 0; d < parts.size(); ++d) {
+      if (!parts[d].empty()) {
+        decode_pool_->submit([&decode_parts, d](i32 thread_id) {
+          decode_parts(d);
+        });
+      }
+    }
+    decode_pool_->wait_idle();
+  } else {
+    for (size_t d = 0; d < parts.size(); ++d) {
+      decode_parts(d);
+    }
+  }
+}
+
+void PreEvaluateWorker::clear_frame_cache() {
+  for (auto& kv : frame_cache_) {
+    delete_buffer(device_handle_, kv.second);
+  }
+  frame_cache_.clear();
+}
+
+SharedKernel::~SharedKernel() {
+  CachedKernel cached;
+  cached.kernel = std::move(kernel);
+  cached.device = device;
+#ifdef HAVE_CUDA
+  cached.stream = stream;
+#endif
+  if (cached.kernel) {
+    // Later jobs with the same op and args on this device reuse it
+    kernel_cache().release(key, std::move(cached));
+  } else {
+    KernelCache::destroy(cached);
+  }
+}
+
+std::shared_ptr<SharedKernel> SharedKernels::get(i32 kg, i32 k,
+                                                 KernelFactory* factory,
+                                                 DeviceHandle device) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::shared_ptr<SharedKernel>& shared =
+      kernels_[std::make_tuple(kg, k, factory, device.id)];
+  if (!shared) {
+    shared.reset(new SharedKernel);
+    shared->device = device;
+  }
+  return shared;
+}
+
 EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
   : node_id_(args.node_id),
     worker_id_(worker_id_),
     profiler_(args.profiler),
+    kernel_pool_(args.kernel_pool),
     kernel_factories_(args.kernel_factories),
     live_columns_(args.live_columns),
     dead_columns_(args.dead_columns),
     unused_outputs_(args.unused_outputs),
     column_mapping_(args.column_mapping),
     kernel_stencils_(args.kernel_stencils),
-    kernel_batch_sizes_(args.kernel_batch_sizes) {
+    kernel_batch_sizes_(args.kernel_batch_sizes),
+    kernel_fuse_with_next_(args.kernel_fuse_with_next),
+    kernel_consumer_devices_(args.kernel_consumer_devices) {
   for (auto& col : column_mapping_) {
     column_mapping_set_.emplace_back(col.begin(), col.end());
   }
@@ -197,41 +548,211 @@ EvaluateWorker::EvaluateWorker(const EvaluateWorkerArgs& args)
       KernelFactory* factory = std::get<0>(kernel_factories_[i]);
       const KernelConfig& config = std::get<1>(kernel_factories_[i]);
       kernel_devices_.push_back(config.devices[0]);
+      kernel_memory_tags_.push_back(
+          memory_tag_id("kernel:" + factory->get_op_name()));
       kernel_num_outputs_.push_back(registry->get_op_info(factory->get_op_name())
                                        ->output_columns()
                                        .size());
+      kernel_parallel_.push_back(factory->parallel() &&
+                                 config.devices[0].type == DeviceType::CPU);
+      kernel_filter_.push_back(
+          registry->get_op_info(factory->get_op_name())->is_filter());
+
+      // Shared kernels are created by the first pipeline instance on their
+      // device, and the others use that instance and its stream
+      bool shared = factory->shared() && args.shared_kernels != nullptr;
+      kernel_shared_.push_back(shared);
+      std::shared_ptr<SharedKernel> shared_kernel;
+      std::unique_lock<std::mutex> shared_lock;
+      if (shared) {
+        shared_kernel = args.shared_kernels->get(args.kg, i, factory,
+                                                 config.devices[0]);
+        shared_lock = std::unique_lock<std::mutex>(shared_kernel->mutex);
+        if (shared_kernel->kernel) {
+#ifdef HAVE_CUDA
+          kernel_streams_.push_back(shared_kernel->stream);
+#endif
+          kernels_.emplace_back(shared_kernel, shared_kernel->kernel.get());
+          continue;
+        }
+      }
 
 #ifdef HAVE_CUDA
       cudaSetDevice(0);
 #endif
-      auto kernel = factory->new_instance(config);
-      kernel->validate(&args.result);
-      VLOG(1) << "Kernel finished validation " << args.result.success();
-      if (!args.result.success()) {
-        VLOG(1) << "Kernel validate failed: " << args.result.msg();
-        THREAD_RETURN_SUCCESS();
+      KernelConfig kernel_config = config;
+      // A kernel an earlier job created with the same op and args on the
+      // same devices keeps the stream it was created with
+      KernelKey key = make_kernel_key(factory, config);
+      CachedKernel cached;
+      BaseKernel* kernel = nullptr;
+      if (kernel_cache().acquire(key, cached)) {
+        kernel = cached.kernel.release();
+        kernel_config.stream = cached.stream;
+      }
+#ifdef HAVE_CUDA
+      // Each GPU kernel queues its batches on its own stream so that the
+      // next batch is staged while the previous one runs
+      cudaStream_t stream = kernel_config.stream;
+      if (config.devices[0].type == DeviceType::GPU && stream == nullptr) {
+        CU_CHECK(cudaSetDevice(config.devices[0].id));
+        CU_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+        CU_CHECK(cudaSetDevice(0));
+      }
+      kernel_streams_.push_back(stream);
+      kernel_config.stream = stream;
+      if (shared) {
+        shared_kernel->stream = stream;
+      }
+#endif
+      if (kernel == nullptr) {
+        MemoryTagScope memory_tag(kernel_memory_tags_.back());
+        kernel = factory->new_instance(kernel_config);
+        kernel->validate(&args.result);
+        VLOG(1) << "Kernel finished validation " << args.result.success();
+        if (!args.result.success()) {
+          VLOG(1) << "Kernel validate failed: " << args.result.msg();
+          CachedKernel failed;
+          failed.kernel.reset(kernel);
+          failed.device = config.devices[0];
+          if (!shared) {
+            failed.stream = kernel_config.stream;
+          }
+          KernelCache::destroy(failed);
+          THREAD_RETURN_SUCCESS();
+        }
+      }
+      kernel->set_profiler(&args.profiler);
+      if (shared) {
+        shared_kernel->key = key;
+        shared_kernel->kernel.reset(kernel);
+        kernels_.emplace_back(shared_kernel, kernel);
+      } else {
+        // Hands the kernel and its stream to the cache when the job is done
+        DeviceHandle device = config.devices[0];
+        CUstream_st* kernel_stream = kernel_config.stream;
+        kernels_.emplace_back(
+            kernel, [key, device, kernel_stream](BaseKernel* k) {
+              CachedKernel done;
+              done.kernel.reset(k);
+              done.device = device;
+              done.stream = kernel_stream;
+              kernel_cache().release(key, std::move(done));
+            });
       }
-      kernels_.emplace_back(kernel);
     }
   }
   assert(kernels_.size() > 0);
-
-  for (auto& kernel : kernels_) {
-    kernel->set_profiler(&args.profiler);
-  }
   // Setup kernel cache sizes
-  stencil_cache_row_ids_.resize(kernel_factories_.size());
   stencil_cache_.resize(kernel_factories_.size());
   stencil_cache_devices_.resize(kernel_factories_.size());
   for (size_t i = 0; i < kernel_factories_.size(); ++i) {
-    // Resize stencil cache to be the same size as the number of side output
-    // columns at that kernel since we need to save all columns
-    stencil_cache_[i].resize(live_columns_[i].size());
+    // The stencil cache saves all side output columns at that kernel, and
+    // holds at least the rows of the stencil of one batch
+    std::vector<i32>& stencil = kernel_stencils_[i];
+    stencil_cache_[i].init(
+        live_columns_[i].size(),
+        stencil.back() - stencil.front() + kernel_batch_sizes_[i]);
   }
   valid_output_rows_.resize(kernel_factories_.size());
   current_valid_idx_.assign(kernel_factories_.size(), 0);
+  warmup_end_row_ = -1;
 }
 
+EvaluateWorker::~EvaluateWorker() {
+#ifdef HAVE_CUDA
+  // Kernels go to the kernel cache along with their streams. Shared kernels
+  // go with the last pipeline instance using them.
+  kernels_.clear();
+  for (auto& kv : timing_events_) {
+    cudaSetDevice(kv.first);
+    for (cudaEvent_t event : kv.second) {
+      cudaEventDestroy(event);
+    }
+  }
+  for (auto& kv : copy_streams_) {
+    cudaSetDevice(kv.first);
+    cudaStreamDestroy(kv.second);
+  }
+  for (auto& kv : copy_events_) {
+    cudaSetDevice(kv.first);
+    for (cudaEvent_t event : kv.second) {
+      cudaEventDestroy(event);
+    }
+  }
+  for (auto& kv : gpu_clocks_) {
+    cudaSetDevice(kv.first);
+    cudaStreamDestroy(kv.second.stream);
+    cudaEventDestroy(kv.second.anchor);
+  }
+#endif
+}
+
+#ifdef HAVE_CUDA
+cudaStream_t EvaluateWorker::copy_stream_for_device(i32 device_id) {
+  auto it = copy_streams_.find(device_id);
+  if (it != copy_streams_.end()) {
+    return it->second;
+  }
+  cudaStream_t stream;
+  CU_CHECK(cudaSetDevice(device_id));
+  CU_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  copy_streams_[device_id] = stream;
+  return stream;
+}
+
+std::vector<cudaEvent_t>& EvaluateWorker::copy_events_for_device(
+    i32 device_id, size_t count) {
+  std::vector<cudaEvent_t>& events = copy_events_[device_id];
+  if (events.size() < count) {
+    CU_CHECK(cudaSetDevice(device_id));
+  }
+  while (events.size() < count) {
+    cudaEvent_t event;
+    CU_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    events.push_back(event);
+  }
+  return events;
+}
+
+std::vector<cudaEvent_t>& EvaluateWorker::timing_events_for_device(
+    i32 device_id, size_t count) {
+  std::vector<cudaEvent_t>& events = timing_events_[device_id];
+  if (events.size() < count) {
+    CU_CHECK(cudaSetDevice(device_id));
+  }
+  while (events.size() < count) {
+    cudaEvent_t event;
+    CU_CHECK(cudaEventCreate(&event));
+    events.push_back(event);
+  }
+  return events;
+}
+
+cudaEvent_t EvaluateWorker::gpu_clock_for_device(i32 device_id,
+                                                 timepoint_t& anchor_time) {
+  auto it = gpu_clocks_.find(device_id);
+  if (it == gpu_clocks_.end() ||
+      now() - it->second.anchor_time >
+          std::chrono::seconds(GPU_CLOCK_ANCHOR_SECONDS)) {
+    CU_CHECK(cudaSetDevice(device_id));
+    if (it == gpu_clocks_.end()) {
+      GpuClock clock;
+      CU_CHECK(
+          cudaStreamCreateWithFlags(&clock.stream, cudaStreamNonBlocking));
+      CU_CHECK(cudaEventCreate(&clock.anchor));
+      it = gpu_clocks_.emplace(device_id, clock).first;
+    }
+    GpuClock& clock = it->second;
+    CU_CHECK(cudaEventRecord(clock.anchor, clock.stream));
+    CU_CHECK(cudaEventSynchronize(clock.anchor));
+    clock.anchor_time = now();
+  }
+  anchor_time = it->second.anchor_time;
+  return it->second.anchor;
+}
+#endif
+
 void EvaluateWorker::new_task(const std::vector<TaskStream>& task_streams) {
   for (size_t i = 0; i < kernel_factories_.size(); ++i) {
     assert(valid_output_rows_[i].size() == current_valid_idx_[i]);
@@ -245,10 +766,21 @@ void EvaluateWorker::new_task(const std::vector<TaskStream>& task_streams) {
                                                    ts.valid_output_rows.end()));
     current_valid_idx_.push_back(0);
   }
+  filtered_rows_.clear();
+  warmup_end_row_ = -1;
+  for (auto& ts : task_streams) {
+    if (ts.warmup_rows > 0) {
+      warmup_end_row_ = std::max(
+          warmup_end_row_, ts.valid_output_rows[ts.warmup_rows - 1]);
+    }
+  }
 
-  // Make the op aware of the format of the data
-  for (auto& kernel : kernels_) {
-    kernel->reset();
+  // Make the op aware of the format of the data. Shared kernels may be in
+  // the middle of the tasks of other pipeline instances.
+  for (size_t k = 0; k < kernels_.size(); ++k) {
+    if (!kernel_shared_[k]) {
+      kernels_[k]->reset();
+    }
   }
 
   outputs_yielded_ = 0;
@@ -256,28 +788,27 @@ void EvaluateWorker::new_task(const std::vector<TaskStream>& task_streams) {
   final_output_columns_.clear();
   final_row_ids_.clear();
 
+  for (auto& kv : replicas_) {
+    for (auto& replica : kv.second) {
+      delete_element(std::get<0>(replica.second), std::get<1>(replica.second));
+    }
+  }
+  replicas_.clear();
+
   // Clear the stencil cache
   for (size_t k = 0; k < kernel_factories_.size(); ++k) {
     std::vector<i32>& kernel_stencil = kernel_stencils_[k];
     bool degenerate_stencil =
         (kernel_stencil.size() == 1 && kernel_stencil[0] == 0);
-    std::vector<std::deque<Element>>& kernel_cache = stencil_cache_[k];
+    StencilCache& kernel_cache = stencil_cache_[k];
     std::vector<DeviceHandle>& kernel_cache_devices = stencil_cache_devices_[k];
-    std::deque<i64>& kernel_cache_row_ids = stencil_cache_row_ids_[k];
-    auto& row_id_deque = kernel_cache_row_ids;
-    while (row_id_deque.size() > 0) {
-      assert(!kernel_cache_devices.empty());
-      row_id_deque.pop_front();
-      for (size_t i = 0; i < kernel_cache.size(); ++i) {
-        auto& cache_deque = kernel_cache[i];
-        Element element = cache_deque.front();
-        // If this kernel has a non-degenerate stencil...
-        if (!degenerate_stencil) {
-          delete_element(kernel_cache_devices[i], element);
-        }
-        cache_deque.pop_front();
+    assert(kernel_cache.empty() || !kernel_cache_devices.empty());
+    kernel_cache.clear([&](i32 c, Element& element) {
+      // If this kernel has a non-degenerate stencil...
+      if (!degenerate_stencil) {
+        delete_element(kernel_cache_devices[c], element);
       }
-    }
+    });
   }
 }
 
@@ -299,251 +830,694 @@ void EvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
   std::vector<DeviceHandle> side_output_handles = work_entry.column_handles;
   BatchedColumns side_output_columns = work_entry.columns;
   std::vector<i64> side_row_ids = work_entry.row_ids;
+  // Rows dropped by filters of earlier groups never reach this one
+  if (!work_entry.filtered_rows.empty()) {
+    drop_valid_rows(0, std::set<i64>(work_entry.filtered_rows.begin(),
+                                     work_entry.filtered_rows.end()));
+    filtered_rows_.insert(filtered_rows_.end(),
+                          work_entry.filtered_rows.begin(),
+                          work_entry.filtered_rows.end());
+  }
+  for (auto& kv : work_entry.replicas) {
+    ColumnReplicas& replicas = replicas_[kv.first];
+    for (auto& replica : kv.second) {
+      if (!replicas.insert(replica).second) {
+        delete_element(std::get<0>(replica.second),
+                       std::get<1>(replica.second));
+      }
+    }
+  }
 
   // For each kernel, produce as much output as can be produced given current
-  // input rows and stencil cache.
-  for (size_t k = 0; k < kernels_.size(); ++k) {
-    const std::string& op_name =
-        std::get<0>(kernel_factories_[k])->get_op_name();
-    DeviceHandle current_handle = kernel_devices_[k];
-    std::unique_ptr<BaseKernel>& kernel = kernels_[k];
-    i32 num_output_columns = kernel_num_outputs_[k];
-    std::vector<i32>& kernel_stencil = kernel_stencils_[k];
-    i32 kernel_batch_size = kernel_batch_sizes_[k];
-    std::vector<i64>& kernel_valid_rows = valid_output_rows_[k];
-    std::set<i64>& kernel_valid_rows_set = valid_output_rows_set_[k];
-    std::vector<std::deque<Element>>& kernel_cache = stencil_cache_[k];
-    std::vector<DeviceHandle>& kernel_cache_devices = stencil_cache_devices_[k];
-    std::deque<i64>& kernel_cache_row_ids = stencil_cache_row_ids_[k];
-    std::vector<i32>& input_column_idx = column_mapping_[k];
-    std::set<i32>& input_column_idx_set = column_mapping_set_[k];
-
-    // Move all required values in the side output columns to the proper device
-    // for this kernel
-    for (i32 i = 0; i < input_column_idx.size(); ++i) {
-      i32 in_col_idx = input_column_idx[i];
-      assert(in_col_idx < side_output_columns.size());
-
-      // If current op type and input buffer type differ, then move
-      // the data in the input buffer into a new buffer which has the same
-      // type as the op input
-      auto copy_start = now();
-      move_if_different_address_space(
-          profiler_, side_output_handles[in_col_idx], current_handle,
-          side_output_columns[in_col_idx]);
-      side_output_handles[in_col_idx] = current_handle;
-      profiler_.add_interval("op_marshal", copy_start, now());
+  // input rows and stencil cache. Runs of kernels fused by the planner go
+  // through the item a tile of rows at a time instead.
+  for (size_t k = 0; k < kernels_.size();) {
+    size_t run_end = k + 1;
+    while (run_end < kernels_.size() && kernel_fuse_with_next_[run_end - 1]) {
+      run_end++;
     }
+    if (run_end == k + 1) {
+      // Kernels after a filter produce no rows if it dropped all of them
+      evaluate_kernel(k, side_output_handles, side_output_columns,
+                      side_row_ids);
+    } else {
+      evaluate_fused_kernels(k, run_end, side_output_handles,
+                             side_output_columns, side_row_ids);
+    }
+    k = run_end;
+  }
 
-    // Copy all side_output_columns into the stencil cache so that we can
-    // realign them later when the kernel is able to produce a value
-    // at that index
-    i64 max_row_id_seen = -1;
-    for (i32 i = 0; i < side_row_ids.size(); ++i) {
-      kernel_cache_row_ids.push_back(side_row_ids[i]);
-      max_row_id_seen = std::max(side_row_ids[i], max_row_id_seen);
+  final_output_handles_ = side_output_handles;
+  if (final_output_columns_.size() == 0) {
+    final_output_columns_.resize(side_output_columns.size());
+  }
+  for (size_t i = 0; i < side_output_columns.size(); ++i) {
+    final_output_columns_[i].insert(final_output_columns_[i].end(),
+                                    side_output_columns[i].begin(),
+                                    side_output_columns[i].end());
+  }
+
+  profiler_.add_interval("feed", feed_start, now());
+}
+
+i64 EvaluateWorker::evaluate_kernel(
+    size_t k, std::vector<DeviceHandle>& side_output_handles,
+    BatchedColumns& side_output_columns, std::vector<i64>& side_row_ids) {
+  const std::string& op_name =
+      std::get<0>(kernel_factories_[k])->get_op_name();
+  DeviceHandle current_handle = kernel_devices_[k];
+  std::shared_ptr<BaseKernel>& kernel = kernels_[k];
+  i32 num_output_columns = kernel_num_outputs_[k];
+  std::vector<i32>& kernel_stencil = kernel_stencils_[k];
+  i32 kernel_batch_size = kernel_batch_sizes_[k];
+  std::vector<i64>& kernel_valid_rows = valid_output_rows_[k];
+  std::set<i64>& kernel_valid_rows_set = valid_output_rows_set_[k];
+  StencilCache& kernel_cache = stencil_cache_[k];
+  std::vector<DeviceHandle>& kernel_cache_devices = stencil_cache_devices_[k];
+  std::vector<i32>& input_column_idx = column_mapping_[k];
+  std::set<i32>& input_column_idx_set = column_mapping_set_[k];
+
+  // Move all required values in the side output columns to the proper device
+  // for this kernel
+#ifdef HAVE_CUDA
+  // Host to GPU moves are queued on a copy stream a batch of rows at a
+  // time, each followed by an event. A batch only waits for the moves of
+  // its own rows, so the moves of later batches overlap it.
+  struct AsyncMove {
+    i32 in_col_idx;
+    DeviceHandle source_handle;
+    std::vector<size_t> rows;
+  };
+  std::vector<AsyncMove> async_moves;
+  std::vector<cudaEvent_t>* copy_events = nullptr;
+  // Smallest row id of each chunk of moves, and the sources to release
+  // once it is done
+  std::vector<i64> copy_chunk_rows;
+  std::vector<std::vector<std::tuple<DeviceHandle, u8*>>> moved_buffers;
+  size_t copy_chunks_waited = 0;
+  // Batches of kernels with a stream are queued without waiting for the
+  // previous one, so elements they read or write are only freed once the
+  // stream is done
+  cudaStream_t kernel_stream = kernel_streams_[k];
+  bool async_kernel = kernel_stream != nullptr;
+#else
+  bool async_kernel = false;
+#endif
+  // Filters read their keep flags after the last batch, so those are
+  // released afterwards as well
+  std::vector<std::tuple<DeviceHandle, Element>> released_elements;
+  std::vector<Element> filter_flags;
+  auto release_element = [&](DeviceHandle device, Element& element) {
+    if (async_kernel || kernel_filter_[k]) {
+      released_elements.emplace_back(device, element);
+    } else {
+      delete_element(device, element);
+    }
+  };
+  i64 reused_replicas = 0;
+  for (i32 i = 0; i < input_column_idx.size(); ++i) {
+    i32 in_col_idx = input_column_idx[i];
+    assert(in_col_idx < side_output_columns.size());
+    DeviceHandle source_handle = side_output_handles[in_col_idx];
+    ElementList& column = side_output_columns[in_col_idx];
+    if (source_handle.is_same_address_space(current_handle) ||
+        column.empty()) {
+      side_output_handles[in_col_idx] = current_handle;
+      continue;
     }
-    side_row_ids.clear();
-    for (i32 i = 0; i < side_output_columns.size(); ++i) {
-      i32 col_idx = i;
 
-      // Update stencil cache by taking the reference to the side output columns
-      // and clearing them, since we will initialize them with the proper
-      // data once we have determined how many rows can be produced
-      for (i64 r = 0; r < side_output_columns[i].size(); ++r) {
-        kernel_cache[i].push_back(side_output_columns[col_idx][r]);
+    // If current op type and input buffer type differ, then the rows with a
+    // replica on this device use it and the rest are moved into new buffers
+    // of the same type as the op input. A later kernel on the device the
+    // column is on keeps the elements left behind as its replica.
+    auto copy_start = now();
+    ColumnReplicas& replicas = replicas_[live_columns_[k][in_col_idx]];
+    bool keep_source = consumed_later(k, in_col_idx, source_handle.type);
+    auto leave_behind = [&](i64 row, Element& element) {
+      if (keep_source && replicas.count(row) == 0) {
+        replicas[row] = std::make_tuple(source_handle, element);
+      } else {
+        release_element(source_handle, element);
+      }
+    };
+    ElementList to_move;
+    std::vector<size_t> to_move_rows;
+    for (size_t r = 0; r < column.size(); ++r) {
+      auto it = replicas.find(side_row_ids[r]);
+      if (it != replicas.end() &&
+          std::get<0>(it->second).is_same_address_space(current_handle)) {
+        Element source = column[r];
+        column[r] = std::get<1>(it->second);
+        replicas.erase(it);
+        leave_behind(side_row_ids[r], source);
+        reused_replicas++;
+      } else {
+        to_move.push_back(column[r]);
+        to_move_rows.push_back(r);
+      }
+    }
+    if (keep_source && !to_move.empty()) {
+      ElementList moved = duplicate_elements(profiler_, source_handle,
+                                             current_handle, to_move);
+      for (size_t j = 0; j < to_move.size(); ++j) {
+        leave_behind(side_row_ids[to_move_rows[j]], to_move[j]);
+        to_move[j] = moved[j];
       }
-      if (kernel_cache_devices.empty()) {
-        kernel_cache_devices = side_output_handles;
+    }
+#ifdef HAVE_CUDA
+    else if (current_handle.type == DeviceType::GPU &&
+             source_handle.type == DeviceType::CPU) {
+      // Queued below once every column is known
+      async_moves.push_back({in_col_idx, source_handle, to_move_rows});
+    }
+#endif
+    else {
+      move_if_different_address_space(profiler_, source_handle,
+                                      current_handle, to_move);
+    }
+    for (size_t j = 0; j < to_move.size(); ++j) {
+      column[to_move_rows[j]] = to_move[j];
+    }
+    side_output_handles[in_col_idx] = current_handle;
+    profiler_.add_interval("op_marshal", copy_start, now());
+  }
+  if (reused_replicas > 0) {
+    profiler_.increment("reused_replicas", reused_replicas);
+  }
+#ifdef HAVE_CUDA
+  if (!async_moves.empty()) {
+    auto copy_start = now();
+    cudaStream_t copy_stream = copy_stream_for_device(current_handle.id);
+    size_t num_rows = side_row_ids.size();
+    size_t num_chunks = (num_rows + kernel_batch_size - 1) / kernel_batch_size;
+    copy_events = &copy_events_for_device(current_handle.id, num_chunks);
+    moved_buffers.resize(num_chunks);
+    CU_CHECK(cudaSetDevice(current_handle.id));
+    for (size_t c = 0; c < num_chunks; ++c) {
+      size_t chunk_start = c * kernel_batch_size;
+      size_t chunk_end = std::min(chunk_start + kernel_batch_size, num_rows);
+      copy_chunk_rows.push_back(
+          *std::min_element(side_row_ids.begin() + chunk_start,
+                            side_row_ids.begin() + chunk_end));
+      for (AsyncMove& move : async_moves) {
+        ElementList& column = side_output_columns[move.in_col_idx];
+        auto first = std::lower_bound(move.rows.begin(), move.rows.end(),
+                                      chunk_start);
+        auto last = std::lower_bound(first, move.rows.end(), chunk_end);
+        ElementList chunk;
+        for (auto it = first; it != last; ++it) {
+          chunk.push_back(column[*it]);
+        }
+        move_if_different_address_space_async(
+            profiler_, move.source_handle, current_handle, chunk, copy_stream,
+            (*copy_events)[c], moved_buffers[c]);
+        for (auto it = first; it != last; ++it) {
+          column[*it] = chunk[it - first];
+        }
       }
-      side_output_columns[i].clear();
+      // Recorded for chunks with nothing to move as well, so each batch
+      // has an event to wait on
+      CU_CHECK(cudaEventRecord((*copy_events)[c], copy_stream));
     }
+    profiler_.add_interval("op_marshal", copy_start, now());
+  }
+#endif
 
-    // Determine how many elements can be produced given stencil requirements
-    // and the currrent stencil cache extent
-    i64 producible_rows = 0;
-    for (i64 i = current_valid_idx_[k]; i < kernel_valid_rows.size(); ++i) {
-      i64 row = kernel_valid_rows[i];
-      if (row + kernel_stencil.back() > max_row_id_seen) {
-        break;
+  // Copy all side_output_columns into the stencil cache so that we can
+  // realign them later when the kernel is able to produce a value
+  // at that index. The cache takes the reference of the side output columns,
+  // which are cleared and initialized with the proper data once we have
+  // determined how many rows can be produced.
+  if (kernel_cache_devices.empty()) {
+    kernel_cache_devices = side_output_handles;
+  }
+  i64 max_row_id_seen = -1;
+  for (i32 i = 0; i < side_row_ids.size(); ++i) {
+    max_row_id_seen = std::max(side_row_ids[i], max_row_id_seen);
+    // Earlier kernels produce warmup rows this one may skip
+    bool used = kernel_valid_rows_set.count(side_row_ids[i]) > 0;
+    for (size_t s = 0; s < kernel_stencil.size() && !used; ++s) {
+      used = kernel_valid_rows_set.count(side_row_ids[i] -
+                                         kernel_stencil[s]) > 0;
+    }
+    if (!used ||
+        !kernel_cache.insert(side_row_ids[i], side_output_columns, i)) {
+      // The cached copy of the row, if any, is the one the kernel reads
+      for (i32 c = 0; c < side_output_columns.size(); ++c) {
+        delete_element(side_output_handles[c], side_output_columns[c][i]);
       }
-      producible_rows++;
     }
-    assert(producible_rows > 0);
+  }
+  side_row_ids.clear();
+  for (i32 i = 0; i < side_output_columns.size(); ++i) {
+    side_output_columns[i].clear();
+  }
 
-    // Setup side output columns to reflect the number of valid rows that will
-    // be produced from this kernel
-    {
-      std::vector<ElementList> producible_elements(side_output_columns.size());
-      i64 s_idx = 0;
-      for (i64 i = 0; i < producible_rows; ++i) {
-        // Iterate over all elements in the stencil cache to check if they
-        // have the proper id
-        i64 valid_row_id = kernel_valid_rows[current_valid_idx_[k] + i];
-        for (; s_idx < kernel_cache_row_ids.size(); ++s_idx) {
-          if (kernel_cache_row_ids[s_idx] == valid_row_id) {
-            side_row_ids.push_back(valid_row_id);
-            for (i64 c = 0; c < kernel_cache.size(); ++c) {
-              producible_elements[c].push_back(kernel_cache[c][s_idx]);
-            }
-            s_idx++;
-            break;
-          }
+  // Determine how many elements can be produced given stencil requirements
+  // and the currrent stencil cache extent
+  i64 producible_rows = 0;
+  for (i64 i = current_valid_idx_[k]; i < kernel_valid_rows.size(); ++i) {
+    i64 row = kernel_valid_rows[i];
+    if (row + kernel_stencil.back() > max_row_id_seen) {
+      break;
+    }
+    producible_rows++;
+  }
+
+  // Setup side output columns to reflect the number of valid rows that will
+  // be produced from this kernel
+  {
+    std::vector<ElementList> producible_elements(side_output_columns.size());
+    for (i64 i = 0; i < producible_rows; ++i) {
+      i64 valid_row_id = kernel_valid_rows[current_valid_idx_[k] + i];
+      if (kernel_cache.contains(valid_row_id)) {
+        side_row_ids.push_back(valid_row_id);
+        for (i64 c = 0; c < producible_elements.size(); ++c) {
+          producible_elements[c].push_back(
+              kernel_cache.element(c, valid_row_id));
         }
       }
-      assert(producible_elements[0].size() == producible_rows);
-
-      // Update side output data by copying data since we don't have
-      // reference counting for all pointers :(
-      if (!(kernel_stencil.size() == 1 && kernel_stencil[0] == 0)) {
-        for (i64 c = 0; c < side_output_columns.size(); ++c) {
-          side_output_columns[c] = duplicate_elements(
-              profiler_, side_output_handles[c], side_output_handles[c],
-              producible_elements[c]);
+    }
+    assert(producible_elements[0].size() == producible_rows);
+
+    // The stencil cache keeps its elements for later rows, so the side
+    // output takes its own reference to the same buffers
+    if (!(kernel_stencil.size() == 1 && kernel_stencil[0] == 0)) {
+      for (i64 c = 0; c < side_output_columns.size(); ++c) {
+        ElementList& shared = side_output_columns[c];
+        shared.clear();
+        for (Element& element : producible_elements[c]) {
+          shared.push_back(share_element(side_output_handles[c], element));
         }
-      } else {
-        // However, if we aren't stenciling, then we don't need to copy since we
-        // know it will only be used once
-        side_output_columns.swap(producible_elements);
-      }
-    }
-
-    // NOTE(apoms): the number of producible rows should be a multiple of the
-    // batch size. If not, then this should be the last batch in the task.
-    // We should add an assert to verify this is the case.
-    i64 row_start = current_valid_idx_[k];
-    i64 row_end = current_valid_idx_[k] + producible_rows;
-    current_valid_idx_[k] += producible_rows;
-
-    for (i32 c = 0; c < num_output_columns; ++c) {
-      side_output_handles.push_back(current_handle);
-      side_output_columns.emplace_back();
-    }
-    for (i32 start = row_start; start < row_end; start += kernel_batch_size) {
-      i32 batch = std::min((i64)kernel_batch_size, row_end - start);
-      i32 end = start + batch;
-      // Stage inputs to the kernel using the stencil cache
-      StenciledBatchedColumns input_columns(input_column_idx.size());
-      // For each column
-      auto& cache_row_deque = kernel_cache_row_ids;
-      for (size_t i = 0; i < input_column_idx.size(); ++i) {
-        i32 col_id = input_column_idx[i];
-        auto& cache_deque = kernel_cache[col_id];
-        auto& col = input_columns[i];
-        col.resize(batch);
-        // For each batch element
-        for (i64 r = start; r < end; ++r) {
-          auto& input_stencil = col[r - start];
-          i64 last_cache_element = 0;
-          // Place elements in "stencil" dimension of input columns
-          i64 curr_row = kernel_valid_rows[r];
-          for (i64 s : kernel_stencil) {
-            i64 desired_row = curr_row + s;
-            // Search for desired stencil element
-            for (; last_cache_element < cache_row_deque.size();
-                 ++last_cache_element) {
-              i64 cache_row_id = cache_row_deque[last_cache_element];
-              if (desired_row == cache_row_id) {
-                input_stencil.push_back(cache_deque[last_cache_element]);
-                break;
-              }
-            }
+      }
+    } else {
+      // However, if we aren't stenciling, then we don't need to copy since we
+      // know it will only be used once
+      side_output_columns.swap(producible_elements);
+    }
+  }
+
+  // NOTE(apoms): the number of producible rows should be a multiple of the
+  // batch size. If not, then this should be the last batch in the task.
+  // We should add an assert to verify this is the case.
+  i64 row_start = current_valid_idx_[k];
+  i64 row_end = current_valid_idx_[k] + producible_rows;
+  current_valid_idx_[k] += producible_rows;
+
+  for (i32 c = 0; c < num_output_columns; ++c) {
+    side_output_handles.push_back(current_handle);
+    side_output_columns.emplace_back();
+  }
+#ifdef HAVE_CUDA
+  // GPU time of the batches on the kernel stream
+  i64 num_batches = (row_end - row_start + kernel_batch_size - 1) /
+                    kernel_batch_size;
+  std::vector<cudaEvent_t> no_timing_events;
+  std::vector<cudaEvent_t>& timing_events =
+      async_kernel
+          ? timing_events_for_device(current_handle.id, 2 * num_batches)
+          : no_timing_events;
+  timepoint_t gpu_anchor_time;
+  cudaEvent_t gpu_anchor =
+      async_kernel ? gpu_clock_for_device(current_handle.id, gpu_anchor_time)
+                   : nullptr;
+  i64 batches_queued = 0;
+#endif
+  for (i32 start = row_start; start < row_end; start += kernel_batch_size) {
+    i32 batch = std::min((i64)kernel_batch_size, row_end - start);
+    i32 end = start + batch;
+    // Stage inputs to the kernel using the stencil cache
+    StenciledBatchedColumns input_columns(input_column_idx.size());
+    // For each column
+    for (size_t i = 0; i < input_column_idx.size(); ++i) {
+      i32 col_id = input_column_idx[i];
+      auto& col = input_columns[i];
+      col.resize(batch);
+      // For each batch element
+      for (i64 r = start; r < end; ++r) {
+        auto& input_stencil = col[r - start];
+        // Place elements in "stencil" dimension of input columns
+        i64 curr_row = kernel_valid_rows[r];
+        for (i64 s : kernel_stencil) {
+          i64 desired_row = curr_row + s;
+          if (kernel_cache.contains(desired_row)) {
+            input_stencil.push_back(kernel_cache.element(col_id, desired_row));
           }
-          assert(input_stencil.size() == kernel_stencil.size());
         }
+        assert(input_stencil.size() == kernel_stencil.size());
       }
+    }
+
+    // Setup output buffers to receive op output
+    DeviceHandle output_handle = current_handle;
+    BatchedColumns output_columns;
+    output_columns.resize(num_output_columns);
 
-      // Setup output buffers to receive op output
-      DeviceHandle output_handle = current_handle;
-      BatchedColumns output_columns;
-      output_columns.resize(num_output_columns);
-
-      // Map from previous output columns to the set of input columns needed
-      // by the kernel
-      auto eval_start = now();
-      kernel->execute_kernel(input_columns, output_columns);
-      profiler_.add_interval("evaluate:" + op_name, eval_start, now());
-      // Delete unused outputs
-      for (size_t y = 0; y < unused_outputs_[k].size(); ++y) {
-        i32 unused_col_idx =
-            unused_outputs_[k][unused_outputs_[k].size() - 1 - y];
-        ElementList& column = output_columns[unused_col_idx];
-        for (Element& element : column) {
-          delete_element(current_handle, element);
+#ifdef HAVE_CUDA
+    // Only the chunks holding rows this batch reads are waited for. The copy
+    // stream runs them in order, so the last of those covers the others.
+    i64 last_needed_row = kernel_valid_rows[end - 1] + kernel_stencil.back();
+    size_t copy_chunks_needed = copy_chunks_waited;
+    for (size_t c = copy_chunks_waited; c < copy_chunk_rows.size(); ++c) {
+      if (copy_chunk_rows[c] <= last_needed_row) {
+        copy_chunks_needed = c + 1;
+      }
+    }
+    if (copy_chunks_needed > copy_chunks_waited && async_kernel) {
+      // The kernel stream waits for the copies instead of this thread
+      CU_CHECK(cudaStreamWaitEvent(
+          kernel_stream, (*copy_events)[copy_chunks_needed - 1], 0));
+      copy_chunks_waited = copy_chunks_needed;
+    } else if (copy_chunks_needed > copy_chunks_waited) {
+      auto wait_start = now();
+      CU_CHECK(
+          cudaEventSynchronize((*copy_events)[copy_chunks_needed - 1]));
+      for (; copy_chunks_waited < copy_chunks_needed; ++copy_chunks_waited) {
+        for (auto& moved : moved_buffers[copy_chunks_waited]) {
+          delete_buffer(std::get<0>(moved), std::get<1>(moved));
         }
-        output_columns.erase(output_columns.begin() + unused_col_idx);
+        moved_buffers[copy_chunks_waited].clear();
       }
+      profiler_.add_interval("op_marshal_wait", wait_start, now());
+    }
+    if (async_kernel) {
+      CU_CHECK(cudaEventRecord(timing_events[2 * batches_queued],
+                               kernel_stream));
+    }
+#endif
 
-      // Verify the kernel produced the correct amount of output
-      for (size_t i = 0; i < output_columns.size(); ++i) {
-        LOG_IF(FATAL, output_columns[i].size() != batch)
-            << "Op " << k << " produced " << output_columns[i].size()
-            << " output elements for column " << i << ". Expected "
-            << batch << " outputs.";
+    // Map from previous output columns to the set of input columns needed
+    // by the kernel
+    auto eval_start = now();
+    {
+      MemoryTagScope memory_tag(kernel_memory_tags_[k]);
+      if (kernel_parallel_[k] && batch > 1) {
+        execute_rows_in_parallel(k, batch, input_columns, output_columns);
+      } else {
+        if (!kernel_parallel_[k] && !kernel_shared_[k]) {
+          kernel->set_rows(std::vector<i64>(kernel_valid_rows.begin() + start,
+                                            kernel_valid_rows.begin() + end));
+        }
+        kernel->execute_kernel(input_columns, output_columns);
+      }
+    }
+    profiler_.add_interval("evaluate:" + op_name, eval_start, now());
+#ifdef HAVE_CUDA
+    if (async_kernel) {
+      CU_CHECK(cudaEventRecord(timing_events[2 * batches_queued + 1],
+                               kernel_stream));
+      batches_queued++;
+    }
+#endif
+    if (kernel_filter_[k]) {
+      filter_flags.insert(filter_flags.end(), output_columns[0].begin(),
+                          output_columns[0].end());
+    }
+    // Delete unused outputs
+    for (size_t y = 0; y < unused_outputs_[k].size(); ++y) {
+      i32 unused_col_idx =
+          unused_outputs_[k][unused_outputs_[k].size() - 1 - y];
+      ElementList& column = output_columns[unused_col_idx];
+      for (Element& element : column) {
+        release_element(current_handle, element);
       }
+      output_columns.erase(output_columns.begin() + unused_col_idx);
+    }
+
+    // Verify the kernel produced the correct amount of output
+    for (size_t i = 0; i < output_columns.size(); ++i) {
+      LOG_IF(FATAL, output_columns[i].size() != batch)
+          << "Op " << k << " produced " << output_columns[i].size()
+          << " output elements for column " << i << ". Expected "
+          << batch << " outputs.";
+    }
 
-      // Add new output columns
-      for (size_t cidx = 0; cidx < output_columns.size(); ++cidx) {
-        const ElementList& column = output_columns[cidx];
-        i32 col_idx =
-            side_output_columns.size() - num_output_columns + cidx;
-        side_output_columns[col_idx].insert(side_output_columns[col_idx].end(),
-                                            column.begin(), column.end());
+    // Add new output columns
+    for (size_t cidx = 0; cidx < output_columns.size(); ++cidx) {
+      const ElementList& column = output_columns[cidx];
+      i32 col_idx =
+          side_output_columns.size() - num_output_columns + cidx;
+      side_output_columns[col_idx].insert(side_output_columns[col_idx].end(),
+                                          column.begin(), column.end());
+    }
+
+    // Remove elements from the stencil cache we won't access anymore
+    bool degenerate_stencil =
+        (kernel_stencil.size() == 1 && kernel_stencil[0] == 0);
+    i64 min_used_row =
+        kernel_valid_rows[start + batch - kernel_stencil[0]];
+    kernel_cache.erase_before(min_used_row, [&](i32 c, Element& element) {
+      // If this kernel has a non-degenerate stencil...
+      if (!degenerate_stencil) {
+        release_element(side_output_handles[c], element);
       }
+    });
+  }
 
-      // Remove elements from the stencil cache we won't access anymore
-      bool degenerate_stencil =
-          (kernel_stencil.size() == 1 && kernel_stencil[0] == 0);
-      i64 last_cache_element = 0;
-      i64 min_used_row =
-          kernel_valid_rows[start + batch - kernel_stencil[0]];
+#ifdef HAVE_CUDA
+  if (batches_queued > 0) {
+    auto wait_start = now();
+    CU_CHECK(cudaStreamSynchronize(kernel_stream));
+    profiler_.add_interval("evaluate_wait:" + op_name, wait_start, now());
+    // Each batch becomes an interval of when it ran on the GPU, next to the
+    // host side evaluate intervals, which only cover queueing it
+    i32 gpu_key = profiler_key("gpu:" + op_name);
+    f32 gpu_ms = 0;
+    for (i64 b = 0; b < batches_queued; ++b) {
+      f32 offset_ms;
+      f32 batch_ms;
+      CU_CHECK(
+          cudaEventElapsedTime(&offset_ms, gpu_anchor, timing_events[2 * b]));
+      CU_CHECK(cudaEventElapsedTime(&batch_ms, timing_events[2 * b],
+                                    timing_events[2 * b + 1]));
+      timepoint_t batch_start =
+          gpu_anchor_time + std::chrono::nanoseconds((i64)(offset_ms * 1e6));
+      profiler_.add_interval(
+          gpu_key, batch_start,
+          batch_start + std::chrono::nanoseconds((i64)(batch_ms * 1e6)));
+      gpu_ms += batch_ms;
+    }
+    profiler_.increment("gpu_us:" + op_name, (i64)(gpu_ms * 1000));
+  }
+  // Rows no batch read yet stay in the stencil cache for later items, so
+  // every chunk is done before their sources are released
+  if (!copy_chunk_rows.empty()) {
+    CU_CHECK(cudaEventSynchronize((*copy_events)[copy_chunk_rows.size() - 1]));
+  }
+  for (auto& chunk : moved_buffers) {
+    for (auto& moved : chunk) {
+      delete_buffer(std::get<0>(moved), std::get<1>(moved));
+    }
+  }
+#endif
+  std::vector<bool> keep;
+  for (Element& element : filter_flags) {
+    keep.push_back(filter_keeps(current_handle, element));
+  }
+  for (auto& released : released_elements) {
+    delete_element(std::get<0>(released), std::get<1>(released));
+  }
+  if (kernel_filter_[k]) {
+    apply_filter(k, keep, side_output_handles, side_output_columns,
+                 side_row_ids);
+  }
+
+  // Delete dead columns
+  for (size_t y = 0; y < dead_columns_[k].size(); ++y) {
+    i32 dead_col_idx = dead_columns_[k][dead_columns_[k].size() - 1 - y];
+    ElementList& column = side_output_columns[dead_col_idx];
+    for (Element& element : column) {
+      delete_element(side_output_handles[dead_col_idx], element);
+    }
+    side_output_columns.erase(side_output_columns.begin() + dead_col_idx);
+    side_output_handles.erase(side_output_handles.begin() + dead_col_idx);
+  }
+  prune_replicas(k);
+  return producible_rows;
+}
+
+void EvaluateWorker::execute_rows_in_parallel(
+    size_t k, i32 batch, const StenciledBatchedColumns& input_columns,
+    BatchedColumns& output_columns) {
+  BaseKernel* kernel = kernels_[k].get();
+  i32 memory_tag = kernel_memory_tags_[k];
+  std::vector<BatchedColumns> row_outputs(
+      batch, BatchedColumns(output_columns.size()));
+  std::mutex mutex;
+  std::condition_variable done;
+  i32 remaining_rows = batch;
+  for (i32 r = 0; r < batch; ++r) {
+    kernel_pool_->submit([&, r](i32 thread_id) {
+      StenciledBatchedColumns row_inputs(input_columns.size());
+      for (size_t c = 0; c < input_columns.size(); ++c) {
+        row_inputs[c].push_back(input_columns[c][r]);
+      }
       {
-        auto& row_id_deque = kernel_cache_row_ids;
-        while (row_id_deque.size() > 0) {
-          i64 cache_row = row_id_deque.front();
-          if (cache_row < min_used_row) {
-            row_id_deque.pop_front();
-            for (size_t i = 0; i < kernel_cache.size(); ++i) {
-              auto device = side_output_handles[i];
-              auto& cache_deque = kernel_cache[i];
-              Element element = cache_deque.front();
-              // If this kernel has a non-degenerate stencil...
-              if (!degenerate_stencil) {
-                delete_element(device, element);
-              }
-              cache_deque.pop_front();
-            }
-          } else {
-            break;
-          }
-        }
+        MemoryTagScope row_memory_tag(memory_tag);
+        kernel->execute_kernel(row_inputs, row_outputs[r]);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--remaining_rows == 0) {
+        done.notify_one();
+      }
+    });
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return remaining_rows == 0; });
+  }
+  for (i32 r = 0; r < batch; ++r) {
+    for (size_t c = 0; c < output_columns.size(); ++c) {
+      output_columns[c].insert(output_columns[c].end(),
+                               row_outputs[r][c].begin(),
+                               row_outputs[r][c].end());
+    }
+  }
+}
+
+bool EvaluateWorker::consumed_later(size_t k, i32 col_idx,
+                                    DeviceType type) const {
+  const std::vector<DeviceType>& devices =
+      kernel_consumer_devices_[k][col_idx];
+  return std::find(devices.begin(), devices.end(), type) != devices.end();
+}
+
+void EvaluateWorker::prune_replicas(size_t k) {
+  const std::vector<std::tuple<i32, std::string>>& columns = live_columns_[k];
+  for (auto it = replicas_.begin(); it != replicas_.end();) {
+    i32 col_idx =
+        std::find(columns.begin(), columns.end(), it->first) - columns.begin();
+    ColumnReplicas& replicas = it->second;
+    for (auto r = replicas.begin(); r != replicas.end();) {
+      DeviceHandle device = std::get<0>(r->second);
+      if (col_idx == (i32)columns.size() ||
+          !consumed_later(k, col_idx, device.type)) {
+        delete_element(device, std::get<1>(r->second));
+        r = replicas.erase(r);
+      } else {
+        ++r;
       }
     }
+    if (replicas.empty()) {
+      it = replicas_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
 
-    // Delete dead columns
-    for (size_t y = 0; y < dead_columns_[k].size(); ++y) {
-      i32 dead_col_idx = dead_columns_[k][dead_columns_[k].size() - 1 - y];
-      ElementList& column = side_output_columns[dead_col_idx];
-      for (Element& element : column) {
-        delete_element(side_output_handles[dead_col_idx], element);
+void EvaluateWorker::apply_filter(
+    size_t k, const std::vector<bool>& keep,
+    std::vector<DeviceHandle>& side_output_handles,
+    BatchedColumns& side_output_columns, std::vector<i64>& side_row_ids) {
+  assert(keep.size() == side_row_ids.size());
+  std::set<i64> dropped;
+  size_t kept = 0;
+  for (size_t i = 0; i < side_row_ids.size(); ++i) {
+    if (keep[i] || side_row_ids[i] <= warmup_end_row_) {
+      for (size_t c = 0; c < side_output_columns.size(); ++c) {
+        side_output_columns[c][kept] = side_output_columns[c][i];
       }
-      side_output_columns.erase(side_output_columns.begin() + dead_col_idx);
-      side_output_handles.erase(side_output_handles.begin() + dead_col_idx);
+      side_row_ids[kept] = side_row_ids[i];
+      kept++;
+    } else {
+      for (size_t c = 0; c < side_output_columns.size(); ++c) {
+        delete_element(side_output_handles[c], side_output_columns[c][i]);
+      }
+      dropped.insert(side_row_ids[i]);
     }
-    // Delete elements from stencil cache that will no longer be used
   }
+  for (ElementList& column : side_output_columns) {
+    column.resize(kept);
+  }
+  side_row_ids.resize(kept);
+  if (dropped.empty()) {
+    return;
+  }
+  profiler_.increment("filtered_rows", dropped.size());
+  filtered_rows_.insert(filtered_rows_.end(), dropped.begin(), dropped.end());
+  drop_valid_rows(k, dropped);
+}
 
-  final_output_handles_ = side_output_handles;
-  if (final_output_columns_.size() == 0) {
-    final_output_columns_.resize(side_output_columns.size());
+void EvaluateWorker::drop_valid_rows(size_t first_kernel,
+                                     const std::set<i64>& rows) {
+  for (size_t k = first_kernel; k < valid_output_rows_.size(); ++k) {
+    std::vector<i64>& valid_rows = valid_output_rows_[k];
+    size_t kept = 0;
+    i64 produced = 0;
+    for (size_t i = 0; i < valid_rows.size(); ++i) {
+      if (rows.count(valid_rows[i]) > 0) {
+        valid_output_rows_set_[k].erase(valid_rows[i]);
+        continue;
+      }
+      if ((i64)i < current_valid_idx_[k]) {
+        produced++;
+      }
+      valid_rows[kept++] = valid_rows[i];
+    }
+    valid_rows.resize(kept);
+    current_valid_idx_[k] = produced;
   }
-  for (size_t i = 0; i < side_output_columns.size(); ++i) {
-    final_output_columns_[i].insert(final_output_columns_[i].end(),
-                                    side_output_columns[i].begin(),
-                                    side_output_columns[i].end());
+}
+
+void EvaluateWorker::evaluate_fused_kernels(
+    size_t first, size_t last, std::vector<DeviceHandle>& side_output_handles,
+    BatchedColumns& side_output_columns, std::vector<i64>& side_row_ids) {
+  // Tiles of whole batches of every kernel in the run, so that each kernel
+  // sees the same batches it would if it ran over the whole item
+  i64 tile_rows = 1;
+  for (size_t k = first; k < last; ++k) {
+    i64 a = tile_rows;
+    i64 b = kernel_batch_sizes_[k];
+    while (b != 0) {
+      i64 t = a % b;
+      a = b;
+      b = t;
+    }
+    tile_rows = tile_rows / a * kernel_batch_sizes_[k];
+  }
+  i64 num_rows = side_row_ids.size();
+  if (num_rows <= tile_rows) {
+    for (size_t k = first; k < last; ++k) {
+      evaluate_kernel(k, side_output_handles, side_output_columns,
+                      side_row_ids);
+    }
+    return;
   }
 
-  profiler_.add_interval("feed", feed_start, now());
+  // The stencils of fused kernels are degenerate, so a kernel only needs the
+  // rows of the current tile and the intermediate columns of a tile are freed
+  // before the next tile is evaluated. Unlike a whole item, a tile may hold
+  // none of the rows a later kernel in the run produces.
+  std::vector<DeviceHandle> fused_handles;
+  BatchedColumns fused_columns;
+  std::vector<i64> fused_row_ids;
+  for (i64 start = 0; start < num_rows; start += tile_rows) {
+    i64 end = std::min(start + tile_rows, num_rows);
+    std::vector<DeviceHandle> tile_handles = side_output_handles;
+    BatchedColumns tile_columns(side_output_columns.size());
+    for (size_t c = 0; c < side_output_columns.size(); ++c) {
+      tile_columns[c].assign(side_output_columns[c].begin() + start,
+                             side_output_columns[c].begin() + end);
+    }
+    std::vector<i64> tile_row_ids(side_row_ids.begin() + start,
+                                  side_row_ids.begin() + end);
+    for (size_t k = first; k < last; ++k) {
+      evaluate_kernel(k, tile_handles, tile_columns, tile_row_ids);
+    }
+    fused_handles = tile_handles;
+    fused_columns.resize(tile_columns.size());
+    for (size_t c = 0; c < tile_columns.size(); ++c) {
+      fused_columns[c].insert(fused_columns[c].end(), tile_columns[c].begin(),
+                              tile_columns[c].end());
+    }
+    fused_row_ids.insert(fused_row_ids.end(), tile_row_ids.begin(),
+                         tile_row_ids.end());
+  }
+  profiler_.increment("fused_tiles", (num_rows + tile_rows - 1) / tile_rows);
+  side_output_handles.swap(fused_handles);
+  side_output_columns.swap(fused_columns);
+  side_row_ids.swap(fused_row_ids);
 }
 
 bool EvaluateWorker::yield(i32 item_size,
@@ -558,7 +1532,7 @@ bool EvaluateWorker::yield(i32 item_size,
   output_work_entry.needs_configure = work_entry.needs_configure;
   output_work_entry.needs_reset = work_entry.needs_reset;
   output_work_entry.last_in_task = work_entry.last_in_task;
-  output_work_entry.warmup_rows = work_entry.warmup_rows;
+  output_work_entry.frame_rate = work_entry.frame_rate;
 
   BatchedColumns& work_item_output_columns = output_work_entry.columns;
   std::vector<DeviceHandle>& work_item_output_handles =
@@ -589,6 +1563,34 @@ bool EvaluateWorker::yield(i32 item_size,
 
   assert(output_work_entry.row_ids.size() ==
          work_item_output_columns[0].size());
+  // Outputs at the warmup rows are dropped after the last kernel group
+  const std::vector<i64>& yielded_rows = output_work_entry.row_ids;
+  output_work_entry.warmup_rows =
+      std::upper_bound(yielded_rows.begin(), yielded_rows.end(),
+                       warmup_end_row_) -
+      yielded_rows.begin();
+
+  // The replicas of the yielded rows go with them to the next kernel group.
+  // Those of earlier rows belong to rows the next group never sees.
+  if (!output_work_entry.row_ids.empty()) {
+    const std::vector<i64>& rows = output_work_entry.row_ids;
+    std::set<i64> yielded_rows(rows.begin(), rows.end());
+    for (auto& kv : replicas_) {
+      ColumnReplicas& replicas = kv.second;
+      auto end = replicas.upper_bound(rows.back());
+      for (auto it = replicas.begin(); it != end; ++it) {
+        if (yielded_rows.count(it->first) > 0) {
+          output_work_entry.replicas[kv.first].insert(*it);
+        } else {
+          delete_element(std::get<0>(it->second), std::get<1>(it->second));
+        }
+      }
+      replicas.erase(replicas.begin(), end);
+    }
+  }
+
+  output_work_entry.filtered_rows.swap(filtered_rows_);
+  filtered_rows_.clear();
 
   outputs_yielded_ += yieldable_rows;
 
@@ -599,25 +1601,51 @@ bool EvaluateWorker::yield(i32 item_size,
   return true;
 }
 
+namespace {
+// Keyframe distance of the software encoder if the column sets none
+const i64 DEFAULT_KEYFRAME_DISTANCE = 120;
+
+// Appends the packets the encoder has ready to packets
+void get_packets(VideoEncoder* encoder, bool new_packet,
+                 ElementList& packets) {
+  while (new_packet) {
+    size_t buffer_size = 4 * 1024 * 1024;
+    u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
+    size_t actual_size;
+    new_packet = encoder->get_packet(buffer, buffer_size, actual_size);
+    LOG_IF(FATAL, new_packet && actual_size > buffer_size)
+        << "Packet buffer not large enough (" << buffer_size << " vs "
+        << actual_size << ")";
+    insert_element(packets, buffer, actual_size);
+  }
+}
+}
+
 PostEvaluateWorker::PostEvaluateWorker(const PostEvaluateWorkerArgs& args)
   : profiler_(args.profiler),
     column_mapping_(args.column_mapping),
     columns_(args.columns),
-    column_set_(args.column_mapping.begin(), args.column_mapping.end()) {
+    column_set_(args.column_mapping.begin(), args.column_mapping.end()),
+    codec_threads_(args.codec_threads),
+    codec_slice_threads_(args.codec_slice_threads),
+    encode_parallelism_(std::max(args.encode_parallelism, 1)) {
   assert(args.column_mapping.size() == args.columns.size());
 
   encoder_handle_ = CPU_DEVICE;
   encoder_type_ = VideoEncoderType::SOFTWARE;
 
-  // Setup video encoders
-  // TODO(apoms): Make this dynamic based on the encoded column type
+  // Setup video encoders. Each starts on the CPU and moves to the GPU its
+  // frames are produced on once it sees them, if that GPU has an encoder.
   for (size_t i = 0; i < args.columns.size(); ++i) {
     auto& col = args.columns[i];
     auto& compression_opts = args.column_compression[i];
     ColumnType type = col.type();
     if (type != ColumnType::Video || compression_opts.codec == "raw") continue;
     encoders_.emplace_back(
-        VideoEncoder::make_from_config(encoder_handle_, 1, encoder_type_));
+        VideoEncoder::make_from_config(encoder_handle_, args.codec_threads,
+                                       encoder_type_,
+                                       args.codec_slice_threads));
+    encoder_handles_.push_back(encoder_handle_);
     encoder_configured_.push_back(false);
 
     EncodeOptions opts;
@@ -628,6 +1656,24 @@ PostEvaluateWorker::PostEvaluateWorker(const PostEvaluateWorkerArgs& args)
           std::atoi(compression_opts.options.at("keyframe_distance").c_str());
     }
     encode_options_.push_back(opts);
+
+    if (encode_parallelism_ > 1) {
+      segment_encoders_.emplace_back();
+      for (i32 e = 0; e < encode_parallelism_; ++e) {
+        segment_encoders_.back().emplace_back(VideoEncoder::make_from_config(
+            encoder_handle_, args.codec_threads, encoder_type_,
+            args.codec_slice_threads));
+      }
+      segment_frames_.push_back(opts.keyframe_distance > 0
+                                    ? opts.keyframe_distance
+                                    : DEFAULT_KEYFRAME_DISTANCE);
+      next_segment_encoder_.push_back(0);
+    }
+  }
+  if (!segment_encoders_.empty()) {
+    encode_pool_.reset(new WorkStealingPool(encode_parallelism_));
+    gathered_frames_.resize(segment_encoders_.size());
+    pending_segments_.resize(segment_encoders_.size());
   }
   for (auto& compression_opts : args.column_compression) {
     auto& codec = compression_opts.codec;
@@ -641,13 +1687,125 @@ PostEvaluateWorker::PostEvaluateWorker(const PostEvaluateWorkerArgs& args)
   current_offset_ = 0;
 }
 
+PostEvaluateWorker::~PostEvaluateWorker() {
+  // Segments of a job that failed before its tasks were flushed
+  if (encode_pool_) {
+    encode_pool_->wait_idle();
+  }
+  for (auto& pending : pending_segments_) {
+    for (auto& segment : pending) {
+      for (Element& packet : segment->packets) {
+        delete_element(CPU_DEVICE, packet);
+      }
+    }
+  }
+  for (auto& frames : gathered_frames_) {
+    for (Element& frame : frames) {
+      delete_element(encoder_handle_, frame);
+    }
+  }
+}
+
+void PostEvaluateWorker::select_encoder(i32 encoder_idx,
+                                        DeviceHandle frame_handle) {
+  DeviceHandle handle = encoder_handle_;
+  VideoEncoderType type = encoder_type_;
+  if (frame_handle.type == DeviceType::GPU &&
+      VideoEncoder::has_encoder_type(VideoEncoderType::NVIDIA)) {
+    handle = frame_handle;
+    type = VideoEncoderType::NVIDIA;
+  }
+  if (handle == encoder_handles_[encoder_idx]) {
+    return;
+  }
+  encoders_[encoder_idx].reset(VideoEncoder::make_from_config(
+      handle, codec_threads_, type, codec_slice_threads_));
+  encoder_handles_[encoder_idx] = handle;
+}
+
+void PostEvaluateWorker::submit_segment(i32 encoder_idx, i32 column) {
+  // The oldest segment used the encoder this one gets, and waiting for it
+  // bounds the frames held by segments
+  collect_segments(encoder_idx, column, encode_parallelism_ - 1);
+  std::shared_ptr<EncodeSegment> segment(new EncodeSegment);
+  segment->frames.swap(gathered_frames_[encoder_idx]);
+  pending_segments_[encoder_idx].push_back(segment);
+  VideoEncoder* encoder =
+      segment_encoders_[encoder_idx]
+                       [next_segment_encoder_[encoder_idx]++ %
+                        encode_parallelism_]
+                           .get();
+  EncodeOptions opts = encode_options_[encoder_idx];
+  DeviceHandle handle = encoder_handle_;
+  encode_pool_->submit([this, segment, encoder, opts, handle](i32 thread_id) {
+    // Configuring starts a new stream, whose first frame is a keyframe
+    encoder->configure(segment->frames[0].as_frame()->as_frame_info(), opts);
+    for (Element& element : segment->frames) {
+      Frame* frame = element.as_frame();
+      get_packets(encoder, encoder->feed(frame->data, frame->size()),
+                  segment->packets);
+      delete_element(handle, element);
+    }
+    get_packets(encoder, encoder->flush(), segment->packets);
+    segment->frames.clear();
+    std::lock_guard<std::mutex> lock(encode_mutex_);
+    segment->done = true;
+    segment_done_.notify_all();
+  });
+}
+
+void PostEvaluateWorker::collect_segments(i32 encoder_idx, i32 column,
+                                          size_t max_pending) {
+  auto& pending = pending_segments_[encoder_idx];
+  std::unique_lock<std::mutex> lock(encode_mutex_);
+  while (!pending.empty()) {
+    std::shared_ptr<EncodeSegment> segment = pending.front();
+    if (!segment->done) {
+      if (pending.size() <= max_pending) {
+        break;
+      }
+      segment_done_.wait(lock, [&] { return segment->done; });
+    }
+    buffered_entry_.columns[column].insert(
+        buffered_entry_.columns[column].end(), segment->packets.begin(),
+        segment->packets.end());
+    pending.pop_front();
+  }
+}
+
 void PostEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
   IOItem& io_item = std::get<0>(entry);
   EvalWorkEntry& work_entry = std::get<1>(entry);
 
+  // Output columns that read the same live column, such as the index columns
+  // of merged jobs, each get a copy of its elements since they are encoded
+  // and deleted separately
+  size_t num_live_columns = work_entry.columns.size();
+  std::vector<i32> column_mapping = column_mapping_;
+  if (column_set_.size() < column_mapping.size()) {
+    std::vector<bool> mapped(num_live_columns);
+    for (size_t i = 0; i < column_mapping.size(); ++i) {
+      i32 col_idx = column_mapping[i];
+      if (!mapped[col_idx]) {
+        mapped[col_idx] = true;
+        continue;
+      }
+      DeviceHandle handle = work_entry.column_handles[col_idx];
+      ElementList copy;
+      if (!work_entry.columns[col_idx].empty()) {
+        copy = duplicate_elements(profiler_, handle, handle,
+                                  work_entry.columns[col_idx]);
+      }
+      work_entry.columns.push_back(copy);
+      work_entry.column_handles.push_back(handle);
+      column_mapping[i] = work_entry.columns.size() - 1;
+    }
+  }
+
   // Setup row buffer if it was emptied
   if (buffered_entry_.columns.size() == 0) {
     buffered_entry_.io_item_index = work_entry.io_item_index;
+    buffered_entry_.row_ids.clear();
     buffered_entry_.columns.resize(column_mapping_.size());
     assert(work_entry.column_handles.size() == columns_.size());
     for (size_t i = 0; i < columns_.size(); ++i) {
@@ -670,11 +1828,18 @@ void PostEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
   i64 num_rows = work_entry.columns[0].size();
   i32 warmup_frames = work_entry.warmup_rows;
   current_offset_ += num_rows;
+  // Input table rows of the rows that are kept, which the save worker
+  // records for tables that filters dropped rows of
+  buffered_entry_.row_ids.insert(
+      buffered_entry_.row_ids.end(),
+      work_entry.row_ids.begin() +
+          std::min((size_t)warmup_frames, work_entry.row_ids.size()),
+      work_entry.row_ids.end());
 
   i32 encoder_idx = 0;
   // Swizzle columns correctly
-  for (size_t i = 0; i < column_mapping_.size(); ++i) {
-    i32 col_idx = column_mapping_[i];
+  for (size_t i = 0; i < column_mapping.size(); ++i) {
+    i32 col_idx = column_mapping[i];
     ColumnType column_type = columns_[i].type();
     // Delete warmup frame outputs
     for (i32 w = 0; w < warmup_frames; ++w) {
@@ -689,37 +1854,46 @@ void PostEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
         auto warmup_end = work_entry.columns[col_idx].begin() + warmup_frames;
         work_entry.columns[col_idx].erase(start, warmup_end);
       }
-      auto& encoder = encoders_[encoder_idx];
-      if (!encoder_configured_[encoder_idx]) {
-        // Configure encoder
+      bool configure = !encoder_configured_[encoder_idx];
+      if (configure) {
         encoder_configured_[encoder_idx] = true;
-        Frame* frame = work_entry.columns[col_idx][0].as_frame();
-        encoder->configure(frame->as_frame_info(),
-
-                           encode_options_[encoder_idx]);
+        select_encoder(encoder_idx, work_entry.column_handles[col_idx]);
+        encode_options_[encoder_idx].frame_rate = work_entry.frame_rate;
       }
+      DeviceHandle handle = encoder_handles_[encoder_idx];
 
       // Move frames to device for the encoder
       move_if_different_address_space(
-          profiler_, work_entry.column_handles[col_idx], encoder_handle_,
+          profiler_, work_entry.column_handles[col_idx], handle,
           work_entry.columns[col_idx]);
 
-      // Pass frames into encoder
       auto encode_start = now();
-      for (auto& row : work_entry.columns[col_idx]) {
-        Frame* frame = row.as_frame();
-        bool new_packet = encoder->feed(frame->data, frame->size());
-        while (new_packet) {
-          size_t buffer_size = 4 * 1024 * 1024;
-          u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-          size_t actual_size;
-          new_packet = encoder->get_packet(buffer, buffer_size, actual_size);
-          LOG_IF(FATAL, new_packet && actual_size > buffer_size)
-              << "Packet buffer not large enough (" << buffer_size << " vs "
-              << actual_size << ")";
-          insert_element(buffered_entry_.columns[i], buffer, actual_size);
+      if (encode_pool_ && handle.type == DeviceType::CPU) {
+        // Frames are gathered into segments of one keyframe interval, which
+        // are encoded concurrently as independent streams
+        auto& gathered = gathered_frames_[encoder_idx];
+        for (auto& row : work_entry.columns[col_idx]) {
+          gathered.push_back(row);
+          if ((i64)gathered.size() == segment_frames_[encoder_idx]) {
+            submit_segment(encoder_idx, i);
+          }
+        }
+        collect_segments(encoder_idx, i, encode_parallelism_);
+      } else {
+        auto& encoder = encoders_[encoder_idx];
+        if (configure) {
+          Frame* frame = work_entry.columns[col_idx][0].as_frame();
+          encoder->configure(frame->as_frame_info(),
+                             encode_options_[encoder_idx]);
+        }
+
+        // Pass frames into encoder
+        for (auto& row : work_entry.columns[col_idx]) {
+          Frame* frame = row.as_frame();
+          get_packets(encoder.get(), encoder->feed(frame->data, frame->size()),
+                      buffered_entry_.columns[i]);
+          delete_element(handle, row);
         }
-        delete_element(encoder_handle_, row);
       }
       profiler_.add_interval("encode", encode_start, now());
       encoder_idx++;
@@ -736,7 +1910,7 @@ void PostEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
     }
   }
   // Delete unused columns
-  for (size_t i = 0; i < work_entry.columns.size(); ++i) {
+  for (size_t i = 0; i < num_live_columns; ++i) {
     if (column_set_.count(i) > 0) {
       continue;
     }
@@ -754,20 +1928,18 @@ void PostEvaluateWorker::feed(std::tuple<IOItem, EvalWorkEntry>& entry) {
       ColumnType column_type = columns_[i].type();
       if (compression_enabled_[i] && column_type == ColumnType::Video &&
           buffered_entry_.frame_sizes[encoder_idx].type == FrameType::U8) {
-        auto& encoder = encoders_[encoder_idx];
-
         // Get last packets in encoder
         auto encode_flush_start = now();
-        bool new_packet = encoder->flush();
-        while (new_packet) {
-          size_t buffer_size = 4 * 1024 * 1024;
-          u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-          size_t actual_size;
-          new_packet = encoder->get_packet(buffer, buffer_size, actual_size);
-          LOG_IF(FATAL, new_packet && actual_size > buffer_size)
-              << "Packet buffer not large enough (" << buffer_size << " vs "
-              << actual_size << ")";
-          insert_element(buffered_entry_.columns[i], buffer, actual_size);
+        if (encode_pool_ &&
+            encoder_handles_[encoder_idx].type == DeviceType::CPU) {
+          if (!gathered_frames_[encoder_idx].empty()) {
+            submit_segment(encoder_idx, i);
+          }
+          collect_segments(encoder_idx, i, 0);
+        } else {
+          auto& encoder = encoders_[encoder_idx];
+          get_packets(encoder.get(), encoder->flush(),
+                      buffered_entry_.columns[i]);
         }
         profiler_.add_interval("encode_flush", encode_flush_start, now());
         encoder_configured_[encoder_idx] = false;
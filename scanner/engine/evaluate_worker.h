@@ -15,13 +15,22 @@
 
 #pragma once
 
+#include "scanner/engine/kernel_cache.h"
 #include "scanner/engine/kernel_factory.h"
 #include "scanner/engine/runtime.h"
+#include "scanner/engine/stencil_cache.h"
 #include "scanner/util/common.h"
 #include "scanner/util/queue.h"
-#include "scanner/video/decoder_automata.h"
+#include "scanner/util/thread_pool.h"
+#include "scanner/video/decoder_pool.h"
 #include "scanner/video/video_encoder.h"
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+
 namespace scanner {
 namespace internal {
 
@@ -36,6 +45,28 @@ struct PreEvaluateWorkerArgs {
   // Uniform arguments
   i32 node_id;
   i32 num_cpus;
+  // Every op reading the input columns accepts FrameLayout::NV12 frames
+  bool nv12_frames;
+  // Size to decode videos at if it is smaller than the video, zero for the
+  // size of the video
+  i32 decode_width;
+  i32 decode_height;
+  // Decoders per video column that the intervals of an item are spread over
+  i32 decode_parallelism;
+  // Threads of each software decoder and whether they split frames into
+  // slices instead of decoding several frames at once
+  i32 codec_threads;
+  bool codec_slice_threads;
+  // Surfaces each NVIDIA decoder copies frames out of at once, zero for the
+  // default
+  i32 gpu_decode_surfaces;
+  // GPUs that NVIDIA decoders are balanced over, empty to decode on the GPU
+  // of the first kernel
+  std::vector<i32> decode_gpu_ids;
+  // Rows shared by consecutive items because of kernel stencils
+  i32 stencil_overlap_rows;
+  // Input columns decoded into FrameLayout::MOTION_VECTORS frames
+  std::vector<bool> motion_vector_columns;
 
   // Per worker arguments
   i32 worker_id;
@@ -46,16 +77,33 @@ struct PreEvaluateWorkerArgs {
 class PreEvaluateWorker {
  public:
   PreEvaluateWorker(const PreEvaluateWorkerArgs& args);
+  ~PreEvaluateWorker();
 
   void feed(std::tuple<IOItem, EvalWorkEntry>& entry);
 
   bool yield(i32 item_size, std::tuple<IOItem, EvalWorkEntry>& output);
 
  private:
+  //! Decodes the next num_rows rows of a video column into buffer.
+  void decode_rows(i32 media_col_idx, u8* buffer, i64 num_rows);
+
+  //! Releases the frames in frame_cache_.
+  void clear_frame_cache();
+
   const i32 node_id_;
   const i32 worker_id_;
   const DeviceHandle device_handle_;
   const i32 num_cpus_;
+  const bool nv12_frames_;
+  const i32 decode_width_;
+  const i32 decode_height_;
+  const i32 decode_parallelism_;
+  const i32 codec_threads_;
+  const bool codec_slice_threads_;
+  const i32 gpu_decode_surfaces_;
+  const std::vector<i32> decode_gpu_ids_;
+  const i32 stencil_overlap_rows_;
+  const std::vector<bool> motion_vector_columns_;
 
   Profiler& profiler_;
 
@@ -63,8 +111,17 @@ class PreEvaluateWorker {
   i32 last_end_row_ = -1;
   i32 last_item_id_ = -1;
 
-  DeviceHandle decoder_output_handle_;
-  std::vector<std::unique_ptr<DecoderAutomata>> decoders_;
+  VideoDecoderType decoder_type_;
+  i32 decoder_num_devices_;
+  // Decoders of each video column and the shape they are configured for,
+  // borrowed from the decoder pool and returned to it when the shape changes
+  std::vector<std::vector<std::unique_ptr<DecoderAutomata>>> decoders_;
+  std::vector<DecoderKey> decoder_keys_;
+  // Rows of each video column still to be decoded, as runs of consecutive
+  // rows produced by the same decoder
+  std::vector<std::deque<std::tuple<i32, i64>>> decode_runs_;
+  // Runs the decoders of a column concurrently if decode_parallelism > 1
+  std::unique_ptr<WorkStealingPool> decode_pool_;
 
   // Continuation state
   bool first_item_;
@@ -74,12 +131,59 @@ class PreEvaluateWorker {
   i64 current_row_;
   i64 total_rows_;
 
-  std::vector<std::vector<proto::DecodeArgs>> decode_args_;
+  // Frames produced by the decoder of each video column
+  std::vector<FrameInfo> decode_infos_;
+
+  // Decoded frames at the end of the last item, by (table, column, row), so
+  // that the warmup and stencil rows the next item shares with it are not
+  // decoded again. Each holds a reference to a buffer on device_handle_.
+  std::map<std::tuple<i32, i32, i64>, u8*> frame_cache_;
+  i64 cache_rows_ = 0;
+  // Rows of each video column in the order they are yielded
+  std::vector<std::vector<i64>> column_rows_;
+  // Frames of the leading rows of each video column taken from frame_cache_
+  std::vector<std::vector<u8*>> cached_frames_;
+};
+
+//! A kernel instance that the pipeline instances on one device share.
+struct SharedKernel {
+  ~SharedKernel();
+
+  //! Held while the kernel is created.
+  std::mutex mutex;
+  DeviceHandle device;
+  KernelKey key;
+  std::unique_ptr<BaseKernel> kernel;
+#ifdef HAVE_CUDA
+  cudaStream_t stream = nullptr;
+#endif
+};
+
+//! The shared kernels of a job, one for each op and device.
+class SharedKernels {
+ public:
+  //! The instance of kernel k of kernel group kg on device. Its kernel is
+  //! null until the first pipeline instance to get it has created it.
+  std::shared_ptr<SharedKernel> get(i32 kg, i32 k, KernelFactory* factory,
+                                    DeviceHandle device);
+
+ private:
+  std::mutex mutex_;
+  std::map<std::tuple<i32, i32, KernelFactory*, i32>,
+           std::shared_ptr<SharedKernel>>
+      kernels_;
 };
 
 struct EvaluateWorkerArgs {
   // Uniform arguments
   i32 node_id;
+  // Milliseconds a single item task waits to be evaluated together with the
+  // next ones. Zero disables this.
+  i32 batch_latency_ms;
+  // Runs the rows of the batches of parallel kernels
+  WorkStealingPool* kernel_pool;
+  // Instances of shared kernels of the job
+  SharedKernels* shared_kernels;
 
   // Per worker arguments
   i32 ki;
@@ -96,6 +200,12 @@ struct EvaluateWorkerArgs {
   std::vector<std::vector<i32>> kernel_stencils;
   // Batch size needed by kernels
   std::vector<i32> kernel_batch_sizes;
+  // Whether each kernel is evaluated together with the next one a tile of
+  // rows at a time
+  std::vector<bool> kernel_fuse_with_next;
+  // Per kernel -> per live column -> device types of the later kernels,
+  // including those of later groups, that read it
+  std::vector<std::vector<std::vector<DeviceType>>> kernel_consumer_devices;
 
   Profiler& profiler;
   proto::Result& result;
@@ -106,6 +216,8 @@ class EvaluateWorker {
  public:
   EvaluateWorker(const EvaluateWorkerArgs& args);
 
+  ~EvaluateWorker();
+
   void new_task(const std::vector<TaskStream>& task_streams);
 
   void feed(std::tuple<IOItem, EvalWorkEntry>& entry);
@@ -113,15 +225,79 @@ class EvaluateWorker {
   bool yield(i32 item_size, std::tuple<IOItem, EvalWorkEntry>& output);
 
  private:
+#ifdef HAVE_CUDA
+  cudaStream_t copy_stream_for_device(i32 device_id);
+
+  //! Events on device_id marking the ends of the first count chunks of
+  //! input moves queued on its copy stream.
+  std::vector<cudaEvent_t>& copy_events_for_device(i32 device_id,
+                                                   size_t count);
+
+  //! Events on device_id for timing the first count / 2 batches, in pairs.
+  std::vector<cudaEvent_t>& timing_events_for_device(i32 device_id,
+                                                     size_t count);
+
+  //! Event on device_id with a known host time, which the timing events of
+  //! the next batches are placed against. It is recorded anew when it grows
+  //! old enough to cost the single precision elapsed times their accuracy.
+  cudaEvent_t gpu_clock_for_device(i32 device_id, timepoint_t& anchor_time);
+#endif
+
+  //! Feeds the side outputs to kernel k and replaces them with its outputs.
+  //! Returns the number of rows the kernel produced.
+  i64 evaluate_kernel(size_t k, std::vector<DeviceHandle>& side_output_handles,
+                      BatchedColumns& side_output_columns,
+                      std::vector<i64>& side_row_ids);
+
+  //! Evaluates the fused kernels [first, last) over tiles of the side outputs
+  //! instead of one kernel at a time over all of them.
+  void evaluate_fused_kernels(size_t first, size_t last,
+                              std::vector<DeviceHandle>& side_output_handles,
+                              BatchedColumns& side_output_columns,
+                              std::vector<i64>& side_row_ids);
+
+  //! Executes each row of a batch of kernel k as its own call on the kernel
+  //! pool.
+  void execute_rows_in_parallel(size_t k, i32 batch,
+                                const StenciledBatchedColumns& input_columns,
+                                BatchedColumns& output_columns);
+
+  //! Whether a kernel after kernel k reads its live column col_idx on a
+  //! device of the given type.
+  bool consumed_later(size_t k, i32 col_idx, DeviceType type) const;
+
+  //! Deletes the replicas that no kernel after kernel k reads.
+  void prune_replicas(size_t k);
+
+  //! Drops the rows that the filter kernel k did not keep, by its flag for
+  //! each of the rows it produced, from the side outputs and the valid rows
+  //! of the kernels from k on.
+  void apply_filter(size_t k, const std::vector<bool>& keep,
+                    std::vector<DeviceHandle>& side_output_handles,
+                    BatchedColumns& side_output_columns,
+                    std::vector<i64>& side_row_ids);
+
+  //! Removes rows from the valid rows of the kernels from first_kernel on.
+  void drop_valid_rows(size_t first_kernel, const std::set<i64>& rows);
+
   const i32 node_id_;
   const i32 worker_id_;
 
   Profiler& profiler_;
+  WorkStealingPool* kernel_pool_;
 
   std::vector<std::tuple<KernelFactory*, KernelConfig>> kernel_factories_;
   std::vector<DeviceHandle> kernel_devices_;
+  // Memory tag each kernel's allocations are attributed to
+  std::vector<i32> kernel_memory_tags_;
   std::vector<i32> kernel_num_outputs_;
-  std::vector<std::unique_ptr<BaseKernel>> kernels_;
+  // Whether the rows of each kernel's batches run on kernel_pool_
+  std::vector<bool> kernel_parallel_;
+  // Whether each kernel is shared with other pipeline instances
+  std::vector<bool> kernel_shared_;
+  // Whether each kernel is of a filter op
+  std::vector<bool> kernel_filter_;
+  std::vector<std::shared_ptr<BaseKernel>> kernels_;
 
   std::vector<std::vector<std::tuple<i32, std::string>>> live_columns_;
   std::vector<std::vector<i32>> dead_columns_;
@@ -129,6 +305,8 @@ class EvaluateWorker {
   std::vector<std::vector<i32>> column_mapping_;
   std::vector<std::vector<i32>> kernel_stencils_;
   std::vector<i32> kernel_batch_sizes_;
+  std::vector<bool> kernel_fuse_with_next_;
+  std::vector<std::vector<std::vector<DeviceType>>> kernel_consumer_devices_;
 
   // Used for computing complement of column mapping
   std::vector<std::set<i32>> column_mapping_set_;
@@ -137,12 +315,17 @@ class EvaluateWorker {
   std::vector<std::set<i64>> valid_output_rows_set_;
   std::vector<std::vector<i64>> valid_output_rows_;
   std::vector<i64> current_valid_idx_;
-  // Per kernel -> per input column -> deque of element)
-  std::vector<std::vector<std::deque<Element>>> stencil_cache_;
+  // Rows of the task dropped by filter kernels, in this group or earlier ones
+  std::vector<i64> filtered_rows_;
+  // Filters keep the warmup rows, which are up to this row
+  i64 warmup_end_row_;
+  // Per kernel -> elements of the input columns by row
+  std::vector<StencilCache> stencil_cache_;
   // Per kernel -> per input column -> device handle
   std::vector<std::vector<DeviceHandle>> stencil_cache_devices_;
-  // Per kernel -> deque of row ids
-  std::vector<std::deque<i64>> stencil_cache_row_ids_;
+  // Copies of live columns on the device they were moved off, kept for the
+  // later kernels that read them there
+  std::map<std::tuple<i32, std::string>, ColumnReplicas> replicas_;
 
   // Continutation state
   std::tuple<IOItem, EvalWorkEntry> entry_;
@@ -153,6 +336,24 @@ class EvaluateWorker {
   std::vector<DeviceHandle> final_output_handles_;
   std::vector<std::deque<Element>> final_output_columns_;
   std::vector<i64> final_row_ids_;
+
+#ifdef HAVE_CUDA
+  // GPU id -> stream used to move kernel inputs onto that GPU, and the
+  // events after each batch of rows moved on it
+  std::map<i32, cudaStream_t> copy_streams_;
+  std::map<i32, std::vector<cudaEvent_t>> copy_events_;
+  // Stream each GPU kernel executes on, or null for CPU kernels
+  std::vector<cudaStream_t> kernel_streams_;
+  // GPU id -> events that time the batches of the kernel being evaluated
+  std::map<i32, std::vector<cudaEvent_t>> timing_events_;
+  struct GpuClock {
+    // Otherwise idle, so that the anchor completes as soon as it is recorded
+    cudaStream_t stream;
+    cudaEvent_t anchor;
+    timepoint_t anchor_time;
+  };
+  std::map<i32, GpuClock> gpu_clocks_;
+#endif
 };
 
 struct ColumnCompressionOptions {
@@ -163,6 +364,12 @@ struct ColumnCompressionOptions {
 struct PostEvaluateWorkerArgs {
   // Uniform arguments
   i32 node_id;
+  // Threads of each software encoder and whether they split frames into
+  // slices instead of encoding several frames at once
+  i32 codec_threads;
+  bool codec_slice_threads;
+  // Segments of each video column encoded concurrently
+  i32 encode_parallelism;
 
   // Per worker arguments
   i32 id;
@@ -177,23 +384,69 @@ class PostEvaluateWorker {
  public:
   PostEvaluateWorker(const PostEvaluateWorkerArgs& args);
 
+  ~PostEvaluateWorker();
+
   void feed(std::tuple<IOItem, EvalWorkEntry>& entry);
 
   bool yield(std::tuple<IOItem, EvalWorkEntry>& output);
 
  private:
+  //! Frames of a video column from one keyframe up to the next, encoded on
+  //! encode_pool_ into packets of their own stream.
+  struct EncodeSegment {
+    std::vector<Element> frames;
+    ElementList packets;
+    bool done = false;
+  };
+
+  //! Replaces encoder encoder_idx by an NVIDIA encoder on the GPU of the
+  //! frames if they are on a GPU that has one, or by a software encoder if
+  //! they are not, unless it is of that kind already.
+  void select_encoder(i32 encoder_idx, DeviceHandle frame_handle);
+
+  //! Hands the gathered frames of encoder_idx to the next of its encoders,
+  //! first waiting for the oldest segment if all of them are busy.
+  void submit_segment(i32 encoder_idx, i32 column);
+
+  //! Appends the packets of the finished segments of encoder_idx to column
+  //! in the order the segments were submitted, waiting for segments until
+  //! at most max_pending remain unfinished.
+  void collect_segments(i32 encoder_idx, i32 column, size_t max_pending);
+
   Profiler& profiler_;
   std::vector<i32> column_mapping_;
   std::vector<Column> columns_;
   std::set<i32> column_set_;
 
+  const i32 codec_threads_;
+  const bool codec_slice_threads_;
+
+  // Device and type of the software encoders
   DeviceHandle encoder_handle_;
   VideoEncoderType encoder_type_;
   std::vector<std::unique_ptr<VideoEncoder>> encoders_;
+  // Device each encoder in encoders_ takes frames on
+  std::vector<DeviceHandle> encoder_handles_;
   std::vector<bool> encoder_configured_;
   std::vector<EncodeOptions> encode_options_;
   std::vector<bool> compression_enabled_;
 
+  // Used instead of software encoders_ if encode_parallelism > 1. Each
+  // video column has encode_parallelism encoders, taken in turn by its
+  // segments.
+  i32 encode_parallelism_;
+  std::unique_ptr<WorkStealingPool> encode_pool_;
+  std::vector<std::vector<std::unique_ptr<VideoEncoder>>> segment_encoders_;
+  // Frames in a segment of each video column, its keyframe distance
+  std::vector<i64> segment_frames_;
+  std::vector<i64> next_segment_encoder_;
+  // Frames of the segment being gathered for each video column
+  std::vector<std::vector<Element>> gathered_frames_;
+  // Submitted segments of each video column that are not collected yet
+  std::vector<std::deque<std::shared_ptr<EncodeSegment>>> pending_segments_;
+  std::mutex encode_mutex_;
+  std::condition_variable segment_done_;
+
   // Generator state
   EvalWorkEntry buffered_entry_;
   i64 current_offset_;
@@ -17,7 +17,10 @@
 #include "scanner/api/frame.h"
 #include "scanner/engine/metadata.h"
 #include "scanner/video/h264_byte_stream_index_creator.h"
+#include "scanner/video/hevc_byte_stream_index_creator.h"
+#include "scanner/video/video_encoder.h"
 
+#include "scanner/util/annexb.h"
 #include "scanner/util/common.h"
 #include "scanner/util/h264.h"
 #include "scanner/util/util.h"
@@ -25,7 +28,13 @@
 #include "storehouse/storage_backend.h"
 
 #include <glog/logging.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <numeric>
 #include <thread>
+#include <tuple>
 
 // For video
 extern "C" {
@@ -34,12 +43,14 @@ extern "C" {
 #include "libavformat/avformat.h"
 #include "libavformat/avio.h"
 #include "libavutil/error.h"
+#include "libavutil/imgutils.h"
 #include "libavutil/opt.h"
 #include "libavutil/pixdesc.h"
 #include "libswscale/swscale.h"
 }
 
 #include <cassert>
+#include <cstdlib>
 #include <fstream>
 
 using storehouse::StoreResult;
@@ -52,6 +63,31 @@ namespace {
 
 const std::string BAD_VIDEOS_FILE_PATH = "bad_videos.txt";
 
+// Segments a video is split into at most when ingesting it in parallel
+const u64 MAX_VIDEO_SEGMENTS = 64;
+
+// Images packed into an item when ingest is not told otherwise
+const i64 DEFAULT_IMAGES_PER_ITEM = 1024;
+
+// Bytes read from the start of an image for its header. JPEG frame headers
+// can come after EXIF data of up to 64KB, in which case the rest is read.
+const u64 IMAGE_HEADER_BYTES = 4096;
+
+// Runs fn on up to num_threads threads, but no more than there is work for,
+// passing each the index of its thread
+void run_threads(i32 num_threads, size_t num_work,
+                 const std::function<void(i32)>& fn) {
+  std::vector<std::thread> threads;
+  size_t used_threads =
+      std::max(std::min((size_t)num_threads, num_work), (size_t)1);
+  for (size_t t = 0; t < used_threads; ++t) {
+    threads.emplace_back(fn, (i32)t);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
 struct FFStorehouseState {
   std::unique_ptr<RandomReadFile> file = nullptr;
   size_t size = 0;  // total file size
@@ -60,6 +96,9 @@ struct FFStorehouseState {
   u64 buffer_start = 0;
   u64 buffer_end = 0;
   std::vector<u8> buffer;
+
+  // Records reads from storage if set
+  Profiler* profiler = nullptr;
 };
 
 // For custom AVIOContext that loads from memory
@@ -71,12 +110,17 @@ i32 read_packet(void* opaque, u8* buf, i32 buf_size) {
     fs->buffer.resize(buffer_size);
     size_t size_read;
     storehouse::StoreResult result;
-    EXP_BACKOFF(
+    auto read_start = now();
+    STORE_RETRY(
         fs->file->read(fs->pos, buffer_size, fs->buffer.data(), size_read),
         result);
     if (result != storehouse::StoreResult::EndOfFile) {
       exit_on_error(result);
     }
+    if (fs->profiler != nullptr) {
+      fs->profiler->add_interval("read", read_start, now());
+      fs->profiler->increment("bytes_read", size_read);
+    }
 
     fs->buffer_start = fs->pos;
     fs->buffer_end = fs->pos + size_read;
@@ -108,6 +152,48 @@ i64 seek(void* opaque, i64 offset, i32 whence) {
   return fs->size - fs->pos;
 }
 
+// Whether the data of packet is stored as is at its position in the file,
+// which holds for MP4 but not for containers that frame it, so that a video
+// ingested in place can be read back from there
+bool packet_in_source(FFStorehouseState& fs, const AVPacket& packet) {
+  if (packet.pos < 0) {
+    return false;
+  }
+  u64 start = static_cast<u64>(packet.pos);
+  u64 end = start + packet.size;
+  if (fs.buffer_start <= start && end <= fs.buffer_end) {
+    return memcmp(fs.buffer.data() + (start - fs.buffer_start), packet.data,
+                  packet.size) == 0;
+  }
+  std::vector<u8> data(packet.size);
+  size_t size_read = 0;
+  StoreResult result;
+  STORE_RETRY(fs.file->read(start, packet.size, data.data(), size_read),
+              result);
+  return (result == StoreResult::Success ||
+          result == StoreResult::EndOfFile) &&
+         size_read == (size_t)packet.size &&
+         memcmp(data.data(), packet.data, packet.size) == 0;
+}
+
+// Collects what an index creator writes for a packet of a video ingested in
+// place, which is checked against the packet instead of being stored
+class PacketSink : public WriteFile {
+ public:
+  using WriteFile::append;
+
+  StoreResult append(size_t size, const u8* data) override {
+    bytes.insert(bytes.end(), data, data + size);
+    return StoreResult::Success;
+  }
+
+  StoreResult save() override { return StoreResult::Success; }
+
+  const std::string path() override { return ""; }
+
+  std::vector<u8> bytes;
+};
+
 struct CodecState {
   AVPacket av_packet;
   AVFrame* picture;
@@ -120,28 +206,11 @@ struct CodecState {
 #endif
   i32 video_stream_index;
   AVBitStreamFilterContext* annexb;
+  proto::VideoDescriptor::VideoCodecType codec_type;
 };
 
-bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
-  VLOG(1) << "Setting up video codec";
-  av_init_packet(&state.av_packet);
-  state.picture = av_frame_alloc();
-  state.format_context = avformat_alloc_context();
-
-  size_t avio_context_buffer_size = 4096;
-  u8* avio_context_buffer =
-      static_cast<u8*>(av_malloc(avio_context_buffer_size));
-  state.io_context =
-      avio_alloc_context(avio_context_buffer, avio_context_buffer_size, 0, fs,
-                         &read_packet, NULL, &seek);
-  state.format_context->pb = state.io_context;
-
-  // Read file header
-  VLOG(1) << "Opening input file to read format";
-  if (avformat_open_input(&state.format_context, NULL, NULL, NULL) < 0) {
-    LOG(ERROR) << "open input failed";
-    return false;
-  }
+// Finds the video stream of an opened format context and sets up its decoder
+bool open_video_codec(CodecState& state) {
   // Some formats don't have a header
   if (avformat_find_stream_info(state.format_context, NULL) < 0) {
     LOG(ERROR) << "find stream info failed";
@@ -162,9 +231,26 @@ bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
   AVStream const* const in_stream =
       state.format_context->streams[state.video_stream_index];
 
-  state.in_codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+  const char* annexb_filter;
+  switch (in_stream->codec->codec_id) {
+    case AV_CODEC_ID_H264:
+      state.codec_type = proto::VideoDescriptor::H264;
+      annexb_filter = "h264_mp4toannexb";
+      break;
+    case AV_CODEC_ID_HEVC:
+      state.codec_type = proto::VideoDescriptor::HEVC;
+      annexb_filter = "hevc_mp4toannexb";
+      break;
+    default:
+      LOG(ERROR) << "unsupported video codec "
+                 << avcodec_get_name(in_stream->codec->codec_id);
+      return false;
+  }
+
+  state.in_codec = avcodec_find_decoder(in_stream->codec->codec_id);
   if (state.in_codec == NULL) {
-    LOG(FATAL) << "could not find h264 decoder";
+    LOG(FATAL) << "could not find "
+               << avcodec_get_name(in_stream->codec->codec_id) << " decoder";
   }
 
   state.in_cc = avcodec_alloc_context3(state.in_codec);
@@ -191,11 +277,243 @@ bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
     return false;
   }
 
-  state.annexb = av_bitstream_filter_init("h264_mp4toannexb");
+  state.annexb = av_bitstream_filter_init(annexb_filter);
 
   return true;
 }
 
+bool setup_video_codec(FFStorehouseState* fs, CodecState& state) {
+  VLOG(1) << "Setting up video codec";
+  av_init_packet(&state.av_packet);
+  state.picture = av_frame_alloc();
+  state.format_context = avformat_alloc_context();
+
+  size_t avio_context_buffer_size = 4096;
+  u8* avio_context_buffer =
+      static_cast<u8*>(av_malloc(avio_context_buffer_size));
+  state.io_context =
+      avio_alloc_context(avio_context_buffer, avio_context_buffer_size, 0, fs,
+                         &read_packet, NULL, &seek);
+  state.format_context->pb = state.io_context;
+
+  // Read file header
+  VLOG(1) << "Opening input file to read format";
+  if (avformat_open_input(&state.format_context, NULL, NULL, NULL) < 0) {
+    LOG(ERROR) << "open input failed";
+    return false;
+  }
+  return open_video_codec(state);
+}
+
+// Opens a network stream, such as an RTSP or HLS address, which FFmpeg reads
+// itself instead of through storehouse
+bool setup_stream_codec(const std::string& url, CodecState& state) {
+  VLOG(1) << "Opening stream " << url;
+  av_init_packet(&state.av_packet);
+  state.picture = av_frame_alloc();
+  state.format_context = nullptr;
+  state.io_context = nullptr;
+
+  AVDictionary* options = nullptr;
+  // Interleaving RTP over the RTSP connection does not drop packets
+  av_dict_set(&options, "rtsp_transport", "tcp", 0);
+  i32 err = avformat_open_input(&state.format_context, url.c_str(), NULL,
+                                &options);
+  av_dict_free(&options);
+  if (err < 0) {
+    LOG(ERROR) << "open stream failed";
+    return false;
+  }
+  return open_video_codec(state);
+}
+
+// Sets the item and format of a video descriptor
+void describe_video_format(const CodecState& state, i32 table_id,
+                           i32 item_id,
+                           proto::VideoDescriptor& video_descriptor) {
+  video_descriptor.set_table_id(table_id);
+  video_descriptor.set_column_id(1);
+  video_descriptor.set_item_id(item_id);
+
+  video_descriptor.set_width(state.in_cc->width);
+  video_descriptor.set_height(state.in_cc->height);
+  video_descriptor.set_channels(3);
+  video_descriptor.set_frame_type(FrameType::U8);
+  video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
+  video_descriptor.set_codec_type(state.codec_type);
+  video_descriptor.set_time_base_num(state.in_cc->time_base.num);
+  video_descriptor.set_time_base_denom(state.in_cc->time_base.den);
+}
+
+// Sets the frames and keyframe index of a video descriptor from the index
+// creator that wrote its bytestream
+void describe_video_index(ByteStreamIndexCreator& index_creator,
+                          proto::VideoDescriptor& video_descriptor) {
+  const std::vector<u8>& metadata_bytes = index_creator.metadata_bytes();
+  video_descriptor.set_frames(index_creator.frames());
+  video_descriptor.set_metadata_packets(metadata_bytes.data(),
+                                        metadata_bytes.size());
+  for (i64 v : index_creator.keyframe_positions()) {
+    video_descriptor.add_keyframe_positions(v);
+  }
+  for (i64 v : index_creator.keyframe_timestamps()) {
+    video_descriptor.add_keyframe_timestamps(v);
+  }
+  for (i64 v : index_creator.keyframe_byte_offsets()) {
+    video_descriptor.add_keyframe_byte_offsets(v);
+  }
+  for (i64 v : index_creator.keyframe_packet_sizes()) {
+    video_descriptor.add_keyframe_packet_sizes(v);
+  }
+}
+
+std::unique_ptr<ByteStreamIndexCreator> make_index_creator(
+    proto::VideoDescriptor::VideoCodecType codec_type, WriteFile* bytestream) {
+  if (codec_type == proto::VideoDescriptor::HEVC) {
+    return std::unique_ptr<ByteStreamIndexCreator>(
+        new HEVCByteStreamIndexCreator(bytestream));
+  }
+  return std::unique_ptr<ByteStreamIndexCreator>(
+      new H264ByteStreamIndexCreator(bytestream));
+}
+
+// Decodes the packets of a video and encodes its frames again as H.264 with
+// the keyframe distance, size and quality of a TranscodeOptions, feeding the
+// encoded packets to an index creator
+class Transcoder {
+ public:
+  Transcoder(AVCodecContext* decoder, const proto::TranscodeOptions& options,
+             ByteStreamIndexCreator& index_creator)
+    : decoder_(decoder), index_creator_(index_creator), packet_(1024 * 1024) {
+    width_ = options.width();
+    height_ = options.height();
+    if (width_ <= 0 && height_ <= 0) {
+      width_ = decoder->width;
+      height_ = decoder->height;
+    } else if (width_ <= 0) {
+      width_ = (i64)decoder->width * height_ / decoder->height;
+    } else if (height_ <= 0) {
+      height_ = (i64)decoder->height * width_ / decoder->width;
+    }
+    // The encoder needs an even size
+    width_ = std::max(width_ & ~1, 2);
+    height_ = std::max(height_ & ~1, 2);
+
+    EncodeOptions encode_options;
+    encode_options.keyframe_distance = options.keyframe_distance();
+    if (options.quality() > 0) {
+      encode_options.quality = options.quality();
+    }
+    encoder_.reset(VideoEncoder::make_from_config(CPU_DEVICE, 1,
+                                                  VideoEncoderType::SOFTWARE));
+    encoder_->configure(FrameInfo(height_, width_, 3, FrameType::U8),
+                        encode_options);
+    rgb_.resize(
+        av_image_get_buffer_size(AV_PIX_FMT_RGB24, width_, height_, 1));
+    frame_ = av_frame_alloc();
+  }
+
+  ~Transcoder() {
+    av_frame_free(&frame_);
+    if (sws_context_) {
+      sws_freeContext(sws_context_);
+    }
+  }
+
+  //! Decodes packet and encodes the frames it completes, or drains the
+  //! decoder and the encoder if packet is null.
+  bool feed(AVPacket* packet) {
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 25, 0)
+    i32 err = avcodec_send_packet(decoder_, packet);
+    if (err < 0 && err != AVERROR_EOF) {
+      return av_error("Error while decoding frame", err);
+    }
+    while (true) {
+      err = avcodec_receive_frame(decoder_, frame_);
+      if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+        break;
+      } else if (err < 0) {
+        return av_error("Error while decoding frame", err);
+      }
+      if (!encode_frame()) {
+        return false;
+      }
+    }
+    if (packet == nullptr) {
+      return write_packets(encoder_->flush());
+    }
+    return true;
+#else
+    error_message_ = "Transcoding requires libavcodec >= 57.25.0";
+    return false;
+#endif
+  }
+
+  i32 width() const { return width_; }
+
+  i32 height() const { return height_; }
+
+  const std::string& error_message() const { return error_message_; }
+
+ private:
+  bool av_error(const std::string& what, i32 err) {
+    char err_msg[256];
+    av_strerror(err, err_msg, 256);
+    error_message_ = what + " " + std::to_string(index_creator_.frames()) +
+                     " (" + std::to_string(err) + "): " + err_msg;
+    return false;
+  }
+
+  // Scales the decoded frame to RGB, which the encoder takes
+  bool encode_frame() {
+    sws_context_ = sws_getCachedContext(
+        sws_context_, frame_->width, frame_->height,
+        (AVPixelFormat)frame_->format, width_, height_, AV_PIX_FMT_RGB24,
+        SWS_BICUBIC, NULL, NULL, NULL);
+    if (sws_context_ == NULL) {
+      error_message_ = "Can not convert decoded frames to RGB";
+      return false;
+    }
+    u8* out_slices[4];
+    i32 out_linesizes[4];
+    av_image_fill_arrays(out_slices, out_linesizes, rgb_.data(),
+                         AV_PIX_FMT_RGB24, width_, height_, 1);
+    sws_scale(sws_context_, frame_->data, frame_->linesize, 0,
+              frame_->height, out_slices, out_linesizes);
+    av_frame_unref(frame_);
+    return write_packets(encoder_->feed(rgb_.data(), rgb_.size()));
+  }
+
+  bool write_packets(bool more) {
+    while (more) {
+      size_t size;
+      more = encoder_->get_packet(packet_.data(), packet_.size(), size);
+      if (size > packet_.size()) {
+        // Left in the encoder until it fits
+        packet_.resize(size);
+        more = true;
+        continue;
+      }
+      if (size > 0 && !index_creator_.feed_packet(packet_.data(), size)) {
+        error_message_ = index_creator_.error_message();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  AVCodecContext* decoder_;
+  ByteStreamIndexCreator& index_creator_;
+  i32 width_;
+  i32 height_;
+  std::unique_ptr<VideoEncoder> encoder_;
+  SwsContext* sws_context_ = nullptr;
+  AVFrame* frame_;
+  std::vector<u8> rgb_;
+  std::vector<u8> packet_;
+  std::string error_message_;
+};
+
 void cleanup_video_codec(CodecState state) {
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 34, 0)
   avcodec_parameters_free(&state.in_cc_params);
@@ -215,42 +533,36 @@ void cleanup_video_codec(CodecState state) {
   av_bitstream_filter_close(state.annexb);
 }
 
-bool parse_and_write_video(storehouse::StorageBackend* storage,
-                           const std::string& table_name, i32 table_id,
-                           const std::string& path,
-                           std::string& error_message) {
-  proto::TableDescriptor table_desc;
-  table_desc.set_id(table_id);
-  table_desc.set_name(table_name);
-  table_desc.set_job_id(-1);
-  table_desc.set_timestamp(
-      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
-          .count());
-
-  {
-    Column* index_col = table_desc.add_columns();
-    index_col->set_name(index_column_name());
-    index_col->set_id(0);
-    index_col->set_type(ColumnType::Other);
-
-    Column* frame_col = table_desc.add_columns();
-    frame_col->set_name(frame_column_name());
-    frame_col->set_id(1);
-    frame_col->set_type(ColumnType::Video);
-  }
+// Demuxes one of num_segments equally long stretches of the video at path
+// into item segment of its table. A segment past the first starts at the
+// first keyframe at or after its start time and a segment before the last
+// ends before the first keyframe at or after its end time, so that the
+// segments of a video hold each of its packets once. Segments ingested
+// in_place only index where their packets are in the file at path. With a
+// positive transcode keyframe distance the segment is re-encoded instead of
+// copied. Segment s is written as item first_item + s.
+bool parse_and_write_segment(storehouse::StorageBackend* storage, i32 table_id,
+                             i32 first_item, const std::string& path,
+                             i32 segment, i32 num_segments, bool in_place,
+                             const proto::TranscodeOptions& transcode,
+                             proto::VideoDescriptor& video_descriptor,
+                             std::string& error_message, Profiler& profiler) {
+  bool transcoding = transcode.keyframe_distance() > 0;
 
   // Setup custom buffer for libavcodec so that we can read from a storehouse
   // file instead of a posix file
+  auto open_start = now();
   FFStorehouseState file_state{};
+  file_state.profiler = &profiler;
   StoreResult result;
-  EXP_BACKOFF(make_unique_random_read_file(storage, path, file_state.file),
+  STORE_RETRY(make_unique_random_read_file(storage, path, file_state.file),
               result);
   if (result != StoreResult::Success) {
     error_message = "Can not open video file";
     return false;
   }
 
-  EXP_BACKOFF(file_state.file->get_size(file_state.size), result);
+  STORE_RETRY(file_state.file->get_size(file_state.size), result);
   if (result != StoreResult::Success) {
     error_message = "Can not get file size";
     return false;
@@ -267,29 +579,102 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
     error_message = "Failed to set up video codec";
     return false;
   }
+  profiler.add_interval("open", open_start, now());
+
+  // Segment boundaries in the time base of the video stream
+  i64 start_pts = 0;
+  i64 end_pts = 0;
+  if (num_segments > 1) {
+    AVStream const* const in_stream =
+        state.format_context->streams[state.video_stream_index];
+    i64 stream_start =
+        in_stream->start_time == AV_NOPTS_VALUE ? 0 : in_stream->start_time;
+    i64 duration = in_stream->duration;
+    if (duration == AV_NOPTS_VALUE || duration <= 0) {
+      duration = state.format_context->duration == AV_NOPTS_VALUE
+                     ? 0
+                     : av_rescale_q(state.format_context->duration,
+                                    AV_TIME_BASE_Q, in_stream->time_base);
+    }
+    if (duration <= 0) {
+      cleanup_video_codec(state);
+      error_message = "Video has no duration to split into segments";
+      return false;
+    }
+    start_pts = stream_start + duration * segment / num_segments;
+    end_pts = stream_start + duration * (segment + 1) / num_segments;
+    if (segment > 0 &&
+        av_seek_frame(state.format_context, state.video_stream_index,
+                      start_pts, AVSEEK_FLAG_BACKWARD) < 0) {
+      cleanup_video_codec(state);
+      error_message = "Can not seek to segment " + std::to_string(segment);
+      return false;
+    }
+  }
 
-  VideoMetadata video_meta;
-  proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
-  video_descriptor.set_table_id(table_id);
-  video_descriptor.set_column_id(1);
-  video_descriptor.set_item_id(0);
+  // The index creator sees packets of videos ingested in place as reading
+  // them back produces them, with parameter sets from the extradata
+  i32 nal_length_size = 0;
+  std::vector<u8> parameter_sets;
+  if (in_place) {
+    const u8* extradata = state.in_cc->extradata;
+    size_t extradata_size = state.in_cc->extradata_size;
+    if (extradata_size > 0 && extradata[0] == 1) {
+      bool parsed = state.codec_type == proto::VideoDescriptor::HEVC
+                        ? parse_hvcc_extradata(extradata, extradata_size,
+                                               nal_length_size, parameter_sets)
+                        : parse_avcc_extradata(extradata, extradata_size,
+                                               nal_length_size, parameter_sets);
+      if (!parsed || nal_length_size != 4) {
+        cleanup_video_codec(state);
+        error_message = "Can not read the NAL units of the video in place";
+        return false;
+      }
+    } else {
+      // Annex B already
+      parameter_sets.assign(extradata, extradata + extradata_size);
+    }
+  }
 
-  video_descriptor.set_width(state.in_cc->width);
-  video_descriptor.set_height(state.in_cc->height);
-  video_descriptor.set_channels(3);
-  video_descriptor.set_frame_type(FrameType::U8);
-  video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
-  video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
+  describe_video_format(state, table_id, first_item + segment,
+                        video_descriptor);
 
-  std::string data_path = table_item_output_path(table_id, 1, 0);
+  std::string data_path =
+      table_item_output_path(table_id, 1, first_item + segment);
   std::unique_ptr<WriteFile> demuxed_bytestream{};
-  BACKOFF_FAIL(make_unique_write_file(storage, data_path, demuxed_bytestream));
-
-  bool succeeded = true;
-  H264ByteStreamIndexCreator index_creator(demuxed_bytestream.get());
+  STORE_CHECK(make_unique_write_file(storage, data_path, demuxed_bytestream));
+
+  // Videos ingested in place leave their item file empty, which keeps the
+  // item complete for anything that looks for the file
+  PacketSink sink;
+  WriteFile* bytestream = in_place ? &sink : demuxed_bytestream.get();
+  std::unique_ptr<ByteStreamIndexCreator> index_creator_ptr =
+      make_index_creator(
+          transcoding ? proto::VideoDescriptor::H264 : state.codec_type,
+          bytestream);
+  ByteStreamIndexCreator& index_creator = *index_creator_ptr;
+  std::unique_ptr<Transcoder> transcoder;
+  if (transcoding) {
+    transcoder.reset(new Transcoder(state.in_cc, transcode, index_creator));
+    video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
+    video_descriptor.set_width(transcoder->width());
+    video_descriptor.set_height(transcoder->height());
+    video_descriptor.mutable_transcode()->CopyFrom(transcode);
+  }
+  bool in_segment = segment == 0;
+  std::vector<u8> annexb_packet;
+  if (in_place && !parameter_sets.empty() &&
+      !index_creator.feed_packet(parameter_sets.data(),
+                                 parameter_sets.size())) {
+    cleanup_video_codec(state);
+    error_message = index_creator.error_message();
+    return false;
+  }
   while (true) {
     // Read from format context
+    auto demux_start = now();
     i32 err = av_read_frame(state.format_context, &state.av_packet);
+    profiler.add_interval("demux", demux_start, now());
     if (err == AVERROR_EOF) {
       av_packet_unref(&state.av_packet);
       break;
@@ -310,6 +695,87 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
       continue;
     }
 
+    if (num_segments > 1) {
+      bool boundary = (state.av_packet.flags & AV_PKT_FLAG_KEY) &&
+                      state.av_packet.pts != AV_NOPTS_VALUE;
+      if (boundary && segment + 1 < num_segments &&
+          state.av_packet.pts >= end_pts) {
+        av_packet_unref(&state.av_packet);
+        break;
+      }
+      if (!in_segment) {
+        if (!(boundary && state.av_packet.pts >= start_pts)) {
+          // Belongs to the previous segment
+          av_packet_unref(&state.av_packet);
+          continue;
+        }
+        in_segment = true;
+      }
+    }
+
+    if (transcoding) {
+      auto transcode_start = now();
+      bool fed = transcoder->feed(&state.av_packet);
+      profiler.add_interval("transcode", transcode_start, now());
+      av_packet_unref(&state.av_packet);
+      if (!fed) {
+        error_message = transcoder->error_message();
+        cleanup_video_codec(state);
+        return false;
+      }
+      continue;
+    }
+
+    if (in_place) {
+      // Only where the packet is in the source is recorded. The creator
+      // writes it with its size, after the parameter sets for keyframes.
+      annexb_packet.clear();
+      sink.bytes.clear();
+      auto index_start = now();
+      bool readable = packet_in_source(file_state, state.av_packet) &&
+                      length_prefixed_to_annexb(
+                          state.av_packet.data, state.av_packet.size,
+                          nal_length_size, annexb_packet);
+      if (readable && !index_creator.feed_packet(annexb_packet.data(),
+                                                 annexb_packet.size())) {
+        error_message = index_creator.error_message();
+        av_packet_unref(&state.av_packet);
+        cleanup_video_codec(state);
+        return false;
+      }
+      profiler.add_interval("index", index_start, now());
+      if (readable && !sink.bytes.empty()) {
+        // One write of the whole packet, after the same parameter sets for
+        // every keyframe
+        readable = sink.bytes.size() >= sizeof(i32) + annexb_packet.size();
+        if (readable) {
+          i32 written_size;
+          memcpy(&written_size, sink.bytes.data(), sizeof(i32));
+          std::string prefix(sink.bytes.begin() + sizeof(i32),
+                             sink.bytes.end() - annexb_packet.size());
+          const std::string& known_prefix =
+              video_descriptor.source_parameter_sets();
+          readable = written_size + sizeof(i32) == sink.bytes.size() &&
+                     (prefix.empty() || known_prefix.empty() ||
+                      prefix == known_prefix);
+          if (readable && !prefix.empty()) {
+            video_descriptor.set_source_parameter_sets(prefix);
+          }
+        }
+        video_descriptor.add_source_packet_offsets(state.av_packet.pos);
+        video_descriptor.add_source_packet_sizes(state.av_packet.size);
+      }
+      if (!readable) {
+        error_message = "Packet " + std::to_string(index_creator.frames()) +
+                        " can not be read in place";
+        av_packet_unref(&state.av_packet);
+        cleanup_video_codec(state);
+        return false;
+      }
+      av_packet_unref(&state.av_packet);
+      continue;
+    }
+
     /* NOTE1: some codecs are stream based (mpegvideo, mpegaudio)
        and this is the only method to use them because you cannot
        know the compressed data size before analysing it.
@@ -331,10 +797,12 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
 
     u8* filtered_data;
     i32 filtered_data_size;
+    auto filter_start = now();
     err = av_bitstream_filter_filter(state.annexb, state.in_cc, NULL,
                                      &filtered_data, &filtered_data_size,
                                      state.av_packet.data, state.av_packet.size,
                                      state.av_packet.flags & AV_PKT_FLAG_KEY);
+    profiler.add_interval("demux", filter_start, now());
     if (err < 0) {
       int frame = index_creator.frames();
       char err_msg[256];
@@ -347,27 +815,35 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
       return false;
     }
 
+    auto index_start = now();
     if (!index_creator.feed_packet(filtered_data, filtered_data_size)) {
       error_message = index_creator.error_message();
+      free(filtered_data);
+      av_packet_unref(&state.av_packet);
+      cleanup_video_codec(state);
       return false;
     }
+    profiler.add_interval("index", index_start, now());
     free(filtered_data);
 
     av_packet_unref(&state.av_packet);
   }
-
-  video_descriptor.set_time_base_num(state.in_cc->time_base.num);
-  video_descriptor.set_time_base_denom(state.in_cc->time_base.den);
+  // Frames still in the decoder and encoder
+  auto flush_start = now();
+  if (transcoding && !transcoder->feed(nullptr)) {
+    error_message = transcoder->error_message();
+    cleanup_video_codec(state);
+    return false;
+  }
+  transcoder.reset();
+  if (transcoding) {
+    profiler.add_interval("transcode", flush_start, now());
+  }
 
   i64 frame = index_creator.frames();
   i32 num_non_ref_frames = index_creator.num_non_ref_frames();
-  const std::vector<u8>& metadata_bytes = index_creator.metadata_bytes();
   const std::vector<i64>& keyframe_positions =
       index_creator.keyframe_positions();
-  const std::vector<i64>& keyframe_timestamps =
-      index_creator.keyframe_timestamps();
-  const std::vector<i64>& keyframe_byte_offsets =
-      index_creator.keyframe_byte_offsets();
 
   VLOG(1) << "Num frames: " << frame;
   VLOG(1) << "Num non-reference frames: " << num_non_ref_frames;
@@ -377,378 +853,343 @@ bool parse_and_write_video(storehouse::StorageBackend* storage,
   // Cleanup video decoder
   cleanup_video_codec(state);
 
+  // Items are decoded on their own, so a segment has to start with a
+  // keyframe the index creator recognizes, such as an IDR picture rather
+  // than an open GOP intra picture the container marks as a keyframe
+  if (num_segments > 1 && (keyframe_positions.empty() ||
+                           keyframe_positions[0] != 0 || frame == 0)) {
+    error_message =
+        "Segment " + std::to_string(segment) + " does not start at a keyframe";
+    return false;
+  }
+
   // Save demuxed stream
-  BACKOFF_FAIL(demuxed_bytestream->save());
+  auto write_start = now();
+  STORE_CHECK(demuxed_bytestream->save());
+  profiler.add_interval("write", write_start, now());
+  profiler.increment("frames", frame);
+
+  describe_video_index(index_creator, video_descriptor);
+  if (in_place) {
+    video_descriptor.set_source_path(path);
+    video_descriptor.set_source_nal_length_size(nal_length_size);
+  }
 
-  // Create index column
-  std::string index_path = table_item_output_path(table_id, 0, 0);
-  std::unique_ptr<WriteFile> index_file{};
-  BACKOFF_FAIL(make_unique_write_file(storage, index_path, index_file));
-  s_write<i64>(index_file.get(), frame);
-  for (i64 i = 0; i < frame; ++i) {
-    s_write(index_file.get(), sizeof(i64));
+  return true;
+}
+
+// Descriptor of a video table without items
+proto::TableDescriptor video_table_descriptor(const std::string& table_name,
+                                              i32 table_id) {
+  proto::TableDescriptor table_desc;
+  table_desc.set_id(table_id);
+  table_desc.set_name(table_name);
+  table_desc.set_job_id(-1);
+
+  Column* index_col = table_desc.add_columns();
+  index_col->set_name(index_column_name());
+  index_col->set_id(0);
+  index_col->set_type(ColumnType::Other);
+
+  Column* frame_col = table_desc.add_columns();
+  frame_col->set_name(frame_column_name());
+  frame_col->set_id(1);
+  frame_col->set_type(ColumnType::Video);
+  return table_desc;
+}
+
+// Writes the index column and video metadata of the segments of a video,
+// which become the items after those of table_desc, and then the table
+// descriptor
+void write_video_table(storehouse::StorageBackend* storage,
+                       proto::TableDescriptor table_desc,
+                       const std::vector<proto::VideoDescriptor>& segments,
+                       proto::DatabaseManifest& manifest) {
+  i32 table_id = table_desc.id();
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+
+  // Rows of appended items continue from the existing ones
+  i64 start_row = table_desc.end_rows_size() > 0
+                      ? table_desc.end_rows(table_desc.end_rows_size() - 1)
+                      : 0;
+  for (const proto::VideoDescriptor& video_descriptor : segments) {
+    i64 frame = video_descriptor.frames();
+
+    // Create index column
+    std::string index_path =
+        table_item_output_path(table_id, 0, video_descriptor.item_id());
+    std::unique_ptr<WriteFile> index_file{};
+    STORE_CHECK(make_unique_write_file(storage, index_path, index_file));
+    write_item_file_header(index_file.get(),
+                           std::vector<i64>(frame, sizeof(i64)));
+    for (i64 i = start_row; i < start_row + frame; ++i) {
+      s_write(index_file.get(), i);
+    }
+    STORE_CHECK(index_file->save());
+
+    start_row += frame;
+    table_desc.add_end_rows(start_row);
+
+    // Save our metadata for the frame column
+    write_video_metadata(storage, VideoMetadata(video_descriptor));
+    manifest.add_videos()->CopyFrom(video_descriptor);
   }
-  for (i64 i = 0; i < frame; ++i) {
-    s_write(index_file.get(), i);
+
+  // Save the table descriptor
+  write_table_metadata(storage, TableMetadata(table_desc));
+
+  manifest.add_tables()->CopyFrom(table_desc);
+}
+
+bool parse_and_write_video(storehouse::StorageBackend* storage,
+                           const proto::TableDescriptor& table_desc,
+                           const std::string& path,
+                           const proto::TranscodeOptions& transcode,
+                           std::string& error_message,
+                           proto::DatabaseManifest& manifest,
+                           Profiler& profiler) {
+  std::vector<proto::VideoDescriptor> segments(1);
+  if (!parse_and_write_segment(storage, table_desc.id(),
+                               table_desc.end_rows_size(), path, 0, 1, false,
+                               transcode, segments[0], error_message,
+                               profiler)) {
+    return false;
   }
-  BACKOFF_FAIL(index_file->save());
+  auto write_start = now();
+  write_video_table(storage, table_desc, segments, manifest);
+  profiler.add_interval("write", write_start, now());
+  return true;
+}
 
-  table_desc.add_end_rows(frame);
-  video_descriptor.set_frames(frame);
-  video_descriptor.set_metadata_packets(metadata_bytes.data(),
-                                        metadata_bytes.size());
+// Encoding, color space and size of an image, which images are grouped by so
+// that each item holds images that decode to frames of one shape
+struct ImageFormat {
+  proto::ImageEncodingType encoding_type = proto::ImageEncodingType::JPEG;
+  proto::ImageColorSpace color_space = proto::ImageColorSpace::RGB;
+  i32 width = 0;
+  i32 height = 0;
+
+  bool operator<(const ImageFormat& other) const {
+    return std::tie(encoding_type, color_space, width, height) <
+           std::tie(other.encoding_type, other.color_space, other.width,
+                    other.height);
+  }
+};
 
-  for (i64 v : keyframe_positions) {
-    video_descriptor.add_keyframe_positions(v);
+inline u32 read_little_endian(const u8* data, i32 bytes) {
+  u32 v = 0;
+  for (i32 i = bytes - 1; i >= 0; --i) {
+    v = (v << 8) | data[i];
   }
-  for (i64 v : keyframe_timestamps) {
-    video_descriptor.add_keyframe_timestamps(v);
+  return v;
+}
+
+// Reads the frame header of a JPEG, which follows the markers before it
+bool parse_jpeg_header(const u8* data, size_t size, ImageFormat& format) {
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (data[pos] != 0xFF) {
+      return false;
+    }
+    u8 marker = data[pos + 1];
+    // Fill bytes before a marker
+    if (marker == 0xFF) {
+      pos++;
+      continue;
+    }
+    // Markers without a length
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+      pos += 2;
+      continue;
+    }
+    // Start of scan, after which there is no frame header
+    if (marker == 0xDA) {
+      return false;
+    }
+    u32 length = read_big_endian(data + pos + 2, 2);
+    // Start of frame markers, other than DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (pos + 10 > size) {
+        return false;
+      }
+      format.encoding_type = proto::ImageEncodingType::JPEG;
+      format.height = read_big_endian(data + pos + 5, 2);
+      format.width = read_big_endian(data + pos + 7, 2);
+      format.color_space = data[pos + 9] == 1 ? proto::ImageColorSpace::Gray
+                                              : proto::ImageColorSpace::RGB;
+      return true;
+    }
+    pos += 2 + length;
   }
-  for (i64 v : keyframe_byte_offsets) {
-    video_descriptor.add_keyframe_byte_offsets(v);
+  return false;
+}
+
+// Reads the IHDR chunk, which comes first in a PNG
+bool parse_png_header(const u8* data, size_t size, ImageFormat& format) {
+  if (size < 26) {
+    return false;
+  }
+  format.encoding_type = proto::ImageEncodingType::PNG;
+  format.width = read_big_endian(data + 16, 4);
+  format.height = read_big_endian(data + 20, 4);
+  switch (data[25]) {
+    case 0:
+    case 4:
+      format.color_space = proto::ImageColorSpace::Gray;
+      break;
+    case 6:
+      format.color_space = proto::ImageColorSpace::RGBA;
+      break;
+    default:
+      format.color_space = proto::ImageColorSpace::RGB;
   }
+  return true;
+}
 
-  // Save our metadata for the frame column
-  write_video_metadata(storage, video_meta);
+// Reads the info header of a BMP, whose height is negative for rows stored
+// top down
+bool parse_bmp_header(const u8* data, size_t size, ImageFormat& format) {
+  if (size < 30) {
+    return false;
+  }
+  format.encoding_type = proto::ImageEncodingType::BMP;
+  format.width = std::abs((i32)read_little_endian(data + 18, 4));
+  format.height = std::abs((i32)read_little_endian(data + 22, 4));
+  format.color_space = read_little_endian(data + 28, 2) == 32
+                           ? proto::ImageColorSpace::RGBA
+                           : proto::ImageColorSpace::RGB;
+  return true;
+}
 
-  // Save the table descriptor
-  write_table_metadata(storage, TableMetadata(table_desc));
+bool parse_image_header(const u8* data, size_t size, ImageFormat& format,
+                        std::string& error_message) {
+  const u8 PNG_SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  bool parsed;
+  if (size >= 2 && data[0] == 0xFF && data[1] == 0xD8) {
+    parsed = parse_jpeg_header(data, size, format);
+  } else if (size >= 8 && std::equal(data, data + 8, PNG_SIGNATURE)) {
+    parsed = parse_png_header(data, size, format);
+  } else if (size >= 2 && data[0] == 'B' && data[1] == 'M') {
+    parsed = parse_bmp_header(data, size, format);
+  } else {
+    error_message = "Not a JPEG, PNG or BMP image";
+    return false;
+  }
+  if (!parsed || format.width <= 0 || format.height <= 0) {
+    error_message = "Could not read the image header";
+    return false;
+  }
+  return true;
+}
 
-  return succeeded;
-}
-
-// void ingest_images(storehouse::StorageBackend* storage,
-//                    const std::string& table_name,
-//                    std::vector<std::string>& image_paths) {
-//   i64 total_images{};
-
-//   i64 min_width{};
-//   i64 average_width{};
-//   i64 max_width{};
-
-//   i64 min_height{};
-//   i64 average_height{};
-//   i64 max_height{};
-
-//   descriptor.set_type(DatasetType_Image);
-
-//   DatasetDescriptor::ImageMetadata& metadata =
-//   *descriptor.mutable_image_data();
-//   std::vector<ImageFormatGroupDescriptor> format_descriptors;
-//   std::vector<std::unique_ptr<WriteFile>> output_files;
-//   std::vector<size_t> image_idx_to_format_group;
-//   std::vector<size_t> bad_image_indices;
-//   for (size_t i = 0; i < image_paths.size(); ++i) {
-//     const std::string& path = image_paths[i];
-
-//     VLOG(1) << "Ingesting image " << path << "..." << std::endl;
-
-//     // Figure out file type from extension
-//     ImageEncodingType image_type;
-//     {
-//       std::string base_name = basename_s(path);
-//       std::vector<std::string> parts;
-//       split(base_name, '.', parts);
-//       if (parts.size() != 2) {
-//         LOG(WARNING) << "File " << path << " does not have a valid name. File
-//         "
-//                      << "must only have a single '.' followed by an image "
-//                      << "extension. Ignoring this file.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       std::string extension = parts[1];
-//       if (!string_to_image_encoding_type(extension, image_type)) {
-//         LOG(WARNING)
-//             << "File " << path << " is not an image with a supported "
-//             << "type. Supported types are: jpeg, png. Ignoring this file";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//     }
-
-//     // Read image data into a buffer to inspect for color space, width,
-//     // and height
-//     std::vector<u8> image_bytes;
-//     {
-//       std::unique_ptr<RandomReadFile> in_file;
-//       BACKOFF_FAIL(make_unique_random_read_file(storage, path, in_file));
-//       u64 pos = 0;
-//       image_bytes = read_entire_file(in_file.get(), pos);
-//     }
-
-//     VLOG(1) << "path " << path;
-//     VLOG(1) << "image size " << image_bytes.size() / 1024;
-//     i32 image_width;
-//     i32 image_height;
-//     ImageColorSpace color_space;
-//     switch (image_type) {
-//     case ImageEncodingType::JPEG: {
-//       JPEGReader reader;
-//       reader.header_mem(image_bytes.data(), image_bytes.size());
-//       if (reader.warnings() != "") {
-//         LOG(WARNING) << "JPEG file " << path
-//                      << " header could not be parsed: " << reader.warnings()
-//                      << ". Ignoring.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       image_width = reader.width();
-//       image_height = reader.height();
-//       switch (reader.colorSpace()) {
-//       case JPEG::COLOR_GRAYSCALE:
-//         color_space = ImageColorSpace::Gray;
-//         break;
-//       case JPEG::COLOR_RGB:
-//       case JPEG::COLOR_YCC:
-//       case JPEG::COLOR_CMYK:
-//       case JPEG::COLOR_YCCK:
-//         color_space = ImageColorSpace::RGB;
-//         break;
-//       case JPEG::COLOR_UNKNOWN:
-//         LOG(WARNING) << "JPEG file " << path << " is of unsupported type: "
-//                      << "COLOR_UNKNOWN. Ignoring.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//         break;
-//       }
-//       break;
-//     }
-//     case ImageEncodingType::PNG: {
-//       unsigned w;
-//       unsigned h;
-//       LodePNGState png_state;
-//       lodepng_state_init(&png_state);
-//       unsigned error = lodepng_inspect(
-//         &w, &h, &png_state,
-//         reinterpret_cast<const unsigned char*>(image_bytes.data()),
-//         image_bytes.size());
-//       if (error) {
-//         LOG(WARNING) << "PNG file " << path << " header could not be parsed:
-//         "
-//                      << lodepng_error_text(error) << ". Ignoring";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       image_width = w;
-//       image_height = h;
-//       switch (png_state.info_png.color.colortype) {
-//       case LCT_GREY:
-//         color_space = ImageColorSpace::Gray;
-//         break;
-//       case LCT_RGB:
-//         color_space = ImageColorSpace::RGB;
-//         break;
-//       case LCT_RGBA:
-//         color_space = ImageColorSpace::RGBA;
-//         break;
-//       case LCT_PALETTE:
-//         // NOTE(apoms): We force a paletted file to RGB
-//         color_space = ImageColorSpace::RGB;
-//         break;
-//         ;
-//       case LCT_GREY_ALPHA: {
-//         LOG(WARNING) << "PNG file " << path << " is of unsupported type: "
-//                      << "GREY_ALPHA. Ignoring.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       }
-
-//       lodepng_state_cleanup(&png_state);
-//       break;
-//     }
-//     case ImageEncodingType::BMP: {
-//       bitmap::BitmapMetadata metadata;
-//       bitmap::DecodeResult result =
-//         bitmap::bitmap_metadata(image_bytes.data(), image_bytes.size(),
-//         metadata);
-//       if (result != bitmap::DecodeResult::Success) {
-//         LOG(WARNING) << "BMP file " << path << " is invalid.";
-//         bad_image_indices.push_back(i);
-//         image_idx_to_format_group.push_back(0);
-//         continue;
-//       }
-//       image_width = metadata.width;
-//       image_height = metadata.height;
-//       color_space = metadata.color_space == bitmap::ImageColorSpace::RGB ?
-//         ImageColorSpace::RGB :
-//         ImageColorSpace::RGBA;
-//       break;
-//     }
-//     default:
-//       assert(false);
-//     }
-
-//     // Check if image is of the same type as an existing set of images. If
-//     so,
-//     // write to that file, otherwise create a new format group.
-//     i32 format_idx = -1;
-//     for (i32 i = 0; i < metadata.format_groups_size(); ++i) {
-//       DatasetDescriptor::ImageMetadata::FormatGroup& group =
-//           *metadata.mutable_format_groups(i);
-//       if (image_type == group.encoding_type() &&
-//           color_space == group.color_space() && image_width == group.width()
-//           &&
-//           image_height == group.height()) {
-//         format_idx = i;
-//         break;
-//       }
-//     }
-//     if (format_idx == -1) {
-//       // Create new format group
-//       format_descriptors.emplace_back();
-//       ImageFormatGroupDescriptor& desc = format_descriptors.back();
-//       DatasetDescriptor::ImageMetadata::FormatGroup& group =
-//           *metadata.add_format_groups();
-//       group.set_encoding_type(image_type);
-//       group.set_color_space(color_space);
-//       group.set_width(image_width);
-//       group.set_height(image_height);
-//       group.set_num_images(1);
-
-//       desc.set_encoding_type(image_type);
-//       desc.set_color_space(color_space);
-//       desc.set_width(image_width);
-//       desc.set_height(image_height);
-//       desc.set_num_images(1);
-
-//       format_idx = metadata.format_groups_size() - 1;
-//       desc.set_id(format_idx);
-//       // Create output file for writing to format group
-//       WriteFile* file;
-//       std::string item_path =
-//           dataset_item_data_path(dataset_name, std::to_string(format_idx));
-//       BACKOFF_FAIL(storage->make_write_file(item_path, file));
-//       output_files.emplace_back(file);
-//     } else {
-//       // Add to existing format group
-//       ImageFormatGroupDescriptor& desc = format_descriptors[format_idx];
-//       DatasetDescriptor::ImageMetadata::FormatGroup& group =
-//           *metadata.mutable_format_groups(format_idx);
-//       group.set_num_images(group.num_images() + 1);
-//       desc.set_num_images(desc.num_images() + 1);
-//     }
-//     image_idx_to_format_group.push_back(format_idx);
-
-//     // Write out compressed image data
-//     std::unique_ptr<WriteFile>& output_file = output_files[format_idx];
-//     i64 image_size = image_bytes.size();
-//     BACKOFF_FAIL(output_file->append(image_bytes));
-
-//     ImageFormatGroupDescriptor& desc = format_descriptors[format_idx];
-//     desc.add_compressed_sizes(image_size);
-
-//     total_images++;
-
-//     // We are summing into the average variables but we will divide
-//     // by the number of entries at the end
-//     min_width = std::min(min_width, (i64)image_width);
-//     average_width += image_width;
-//     max_width = std::max(max_width, (i64)image_width);
-
-//     min_height = std::min(min_height, (i64)image_height);
-//     average_height += image_height;
-//     max_height = std::max(max_height, (i64)image_height);
-
-//     VLOG(1) << "Finished ingesting image " << path << "." << std::endl;
-//   }
-
-//   // Write out all image paths which failed the ingest process
-//   if (!bad_image_indices.empty()) {
-//     LOG(WARNING) << "Writing the path of all ill formatted images which "
-//                  << "failed to ingest to " << BAD_VIDEOS_FILE_PATH << ".";
-
-//     std::fstream bad_paths_file(BAD_VIDEOS_FILE_PATH, std::fstream::out);
-//     for (size_t i : bad_image_indices) {
-//       const std::string& bad_path = image_paths[i];
-//       bad_paths_file << bad_path << std::endl;
-//     }
-//     bad_paths_file.close();
-//   }
-
-//   metadata.set_total_images(total_images);
-
-//   metadata.set_min_width(min_width);
-//   metadata.set_average_width(average_width);
-//   metadata.set_max_width(max_width);
-
-//   metadata.set_min_height(min_height);
-//   metadata.set_average_height(average_height);
-//   metadata.set_max_height(max_height);
-
-//   if (total_images > 0) {
-//     metadata.set_average_width(average_width / total_images);
-//     metadata.set_average_height(average_height / total_images);
-//   }
-
-//   VLOG(1)
-//     << "max width " << max_width
-//     << ",  max_height " << max_height;
-
-//   for (size_t i = 0; i < image_paths.size(); ++i) {
-//     const std::string& path = image_paths[i];
-//     metadata.add_original_image_paths(path);
-//   }
-
-//   // Remove bad paths
-//   size_t num_bad_images = bad_image_indices.size();
-//   for (size_t i = 0; i < num_bad_images; ++i) {
-//     size_t bad_index = bad_image_indices[num_bad_images - 1 - i];
-//     image_paths.erase(image_paths.begin() + bad_index);
-//   }
-
-//   LOG_IF(FATAL, total_images == 0)
-//       << "Dataset would be created with zero images! Exiting.";
-
-//   for (size_t i = 0; i < image_paths.size(); ++i) {
-//     const std::string& path = image_paths[i];
-//     metadata.add_valid_image_paths(path);
-//   }
-
-//   for (size_t i = 0; i < format_descriptors.size(); ++i) {
-//     // Flush image binary files
-//     std::unique_ptr<WriteFile>& file = output_files[i];
-//     BACKOFF_FAIL(file->save());
-
-//     // Write out format descriptors for each group
-//     ImageFormatGroupDescriptor& desc = format_descriptors[i];
-//     std::string metadata_path =
-//         dataset_item_metadata_path(dataset_name, std::to_string(i));
-//     std::unique_ptr<WriteFile> metadata_file;
-//     BACKOFF_FAIL(make_unique_write_file(storage, metadata_path,
-//     metadata_file));
-
-//     ImageFormatGroupMetadata m{desc};
-//     serialize_image_format_group_metadata(metadata_file.get(), m);
-//     BACKOFF_FAIL(metadata_file->save());
-//   }
-// }
+// Reads the format and size of the image at path, reading past the first
+// IMAGE_HEADER_BYTES only if the header is not within them
+bool read_image_format(storehouse::StorageBackend* storage,
+                       const std::string& path, ImageFormat& format,
+                       u64& file_size, std::string& error_message) {
+  std::unique_ptr<RandomReadFile> file;
+  StoreResult result;
+  STORE_RETRY(make_unique_random_read_file(storage, path, file), result);
+  if (result != StoreResult::Success) {
+    error_message = "Could not open image";
+    return false;
+  }
+  STORE_RETRY(file->get_size(file_size), result);
+  if (result != StoreResult::Success) {
+    error_message = "Could not get the size of the image";
+    return false;
+  }
+  std::vector<u8> header(std::min(file_size, IMAGE_HEADER_BYTES));
+  size_t size_read;
+  STORE_RETRY(file->read(0, header.size(), header.data(), size_read), result);
+  if ((result != StoreResult::Success && result != StoreResult::EndOfFile) ||
+      size_read != header.size()) {
+    error_message = "Could not read image";
+    return false;
+  }
+  if (parse_image_header(header.data(), header.size(), format,
+                         error_message)) {
+    return true;
+  }
+  if (file_size <= header.size()) {
+    return false;
+  }
+  u64 pos = 0;
+  std::vector<u8> data = storehouse::read_entire_file(file.get(), pos);
+  return parse_image_header(data.data(), data.size(), format, error_message);
+}
+
+// Writes an item of the image column from the files of its images, along
+// with its index and path columns
+bool write_image_item(storehouse::StorageBackend* storage, i32 table_id,
+                      i32 item_id, i64 start_row,
+                      const std::vector<std::string>& paths,
+                      const std::vector<u64>& file_sizes,
+                      std::vector<u8>& buffer, std::string& error_message) {
+  std::string index_path = table_item_output_path(table_id, 0, item_id);
+  std::unique_ptr<WriteFile> index_file{};
+  STORE_CHECK(make_unique_write_file(storage, index_path, index_file));
+  write_item_file_header(index_file.get(),
+                         std::vector<i64>(paths.size(), sizeof(i64)));
+  for (i64 i = start_row; i < start_row + (i64)paths.size(); ++i) {
+    s_write(index_file.get(), i);
+  }
+  STORE_CHECK(index_file->save());
+
+  std::string path_path = table_item_output_path(table_id, 2, item_id);
+  std::unique_ptr<WriteFile> path_file{};
+  STORE_CHECK(make_unique_write_file(storage, path_path, path_file));
+  std::vector<i64> path_sizes;
+  for (const std::string& path : paths) {
+    path_sizes.push_back(path.size());
+  }
+  write_item_file_header(path_file.get(), path_sizes);
+  for (const std::string& path : paths) {
+    s_write(path_file.get(), (const u8*)path.data(), path.size());
+  }
+  STORE_CHECK(path_file->save());
+
+  // The sizes from reading the headers go first, so the images are copied
+  // into the item one at a time
+  std::string image_path = table_item_output_path(table_id, 1, item_id);
+  std::unique_ptr<WriteFile> image_file{};
+  STORE_CHECK(make_unique_write_file(storage, image_path, image_file));
+  write_item_file_header(image_file.get(), std::vector<i64>(file_sizes.begin(),
+                                                            file_sizes.end()));
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::unique_ptr<RandomReadFile> file;
+    StoreResult result;
+    STORE_RETRY(make_unique_random_read_file(storage, paths[i], file), result);
+    if (result != StoreResult::Success) {
+      error_message = "Could not open image " + paths[i];
+      return false;
+    }
+    buffer.resize(file_sizes[i]);
+    size_t size_read;
+    STORE_RETRY(file->read(0, buffer.size(), buffer.data(), size_read),
+                result);
+    if ((result != StoreResult::Success &&
+         result != StoreResult::EndOfFile) ||
+        size_read != buffer.size()) {
+      error_message = "Image " + paths[i] + " changed during ingest";
+      return false;
+    }
+    s_write(image_file.get(), buffer.data(), buffer.size());
+  }
+  STORE_CHECK(image_file->save());
+  return true;
+}
 }  // end anonymous namespace
 
-Result ingest_videos(storehouse::StorageConfig* storage_config,
-                     const std::string& db_path,
-                     const std::vector<std::string>& table_names,
-                     const std::vector<std::string>& paths,
-                     std::vector<FailedVideo>& failed_videos) {
+Result add_ingest_tables(DatabaseMetadata& meta,
+                         const std::vector<std::string>& table_names,
+                         bool append, std::vector<i32>& table_ids,
+                         std::vector<u8>& appended) {
   Result result;
   result.set_success(true);
-
-  internal::set_database_path(db_path);
-  av_register_all();
-
-  std::unique_ptr<storehouse::StorageBackend> storage{
-      storehouse::StorageBackend::make_from_config(storage_config)};
-
-  internal::DatabaseMetadata meta = internal::read_database_metadata(
-      storage.get(), internal::DatabaseMetadata::descriptor_path());
-  std::vector<i32> table_ids;
   std::set<std::string> inserted_table_names;
   for (size_t i = 0; i < table_names.size(); ++i) {
     if (inserted_table_names.count(table_names[i]) > 0) {
@@ -756,6 +1197,12 @@ Result ingest_videos(storehouse::StorageConfig* storage_config,
                    table_names[i].c_str());
       break;
     }
+    if (append && meta.has_table(table_names[i])) {
+      table_ids.push_back(meta.get_table_id(table_names[i]));
+      appended.push_back(true);
+      inserted_table_names.insert(table_names[i]);
+      continue;
+    }
     i32 table_id = meta.add_table(table_names[i]);
     if (table_id == -1) {
       RESULT_ERROR(&result, "Table name %s already exists in databse.",
@@ -763,69 +1210,576 @@ Result ingest_videos(storehouse::StorageConfig* storage_config,
       break;
     }
     table_ids.push_back(table_id);
+    appended.push_back(false);
     inserted_table_names.insert(table_names[i]);
   }
-  if (!result.success()) {
-    return result;
+  return result;
+}
+
+void ingest_video_tables(storehouse::StorageBackend* storage,
+                         const std::vector<std::string>& table_names,
+                         const std::vector<i32>& table_ids,
+                         const std::vector<u8>& appended,
+                         const std::vector<std::string>& paths,
+                         i32 num_threads, i64 segment_size, bool in_place,
+                         const proto::TranscodeOptions& transcode,
+                         std::vector<u8>& failed,
+                         std::vector<std::string>& failed_messages,
+                         proto::DatabaseManifest& manifest,
+                         std::vector<Profiler>& profilers) {
+  av_register_all();
+  // Re-encoded videos are always copied
+  in_place = in_place && transcode.keyframe_distance() <= 0;
+
+  // A byte per video rather than a vector<bool>, since threads set
+  // neighbouring flags at once
+  failed.assign(table_names.size(), false);
+  failed_messages.assign(table_names.size(), "");
+
+  // Videos appended to a table become the items after its existing ones
+  std::vector<proto::TableDescriptor> table_descs(table_names.size());
+  for (size_t i = 0; i < table_names.size(); ++i) {
+    if (!appended[i]) {
+      table_descs[i] = video_table_descriptor(table_names[i], table_ids[i]);
+      continue;
+    }
+    table_descs[i] = read_table_metadata(
+        storage, TableMetadata::descriptor_path(table_ids[i])).get_descriptor();
+    const proto::TableDescriptor& desc = table_descs[i];
+    if (desc.job_id() != -1 || desc.packed_items() ||
+        desc.columns_size() != 2 ||
+        desc.columns(1).type() != ColumnType::Video) {
+      failed[i] = true;
+      failed_messages[i] = "Videos can only be appended to tables created "
+                           "by ingesting videos";
+    }
   }
-  std::vector<bool> bad_videos(table_names.size(), false);
-  std::vector<std::string> bad_messages(table_names.size());
-  std::vector<std::thread> ingest_threads;
-  i32 num_threads = std::thread::hardware_concurrency();
-  i32 videos_allocated = 0;
-  for (i32 t = 0; t < num_threads; ++t) {
-    i32 to_allocate =
-        (table_names.size() - videos_allocated) / (num_threads - t);
-    i32 start = videos_allocated;
-    videos_allocated += to_allocate;
-    videos_allocated = std::min((size_t)videos_allocated, table_names.size());
-    i32 end = videos_allocated;
-    ingest_threads.emplace_back([&, start, end]() {
-      for (i32 i = start; i < end; ++i) {
-        if (!internal::parse_and_write_video(storage.get(), table_names[i],
-                                             table_ids[i], paths[i],
-                                             bad_messages[i])) {
-          // Did not ingest correctly, skip it
-          bad_videos[i] = true;
-        }
+  std::vector<proto::DatabaseManifest> manifests(table_names.size());
+  // Ingest mostly waits on storage, so it may use more threads than cores
+  if (num_threads <= 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  // Intervals are kept in absolute time so that the profiles of all nodes
+  // taking part in an ingest line up
+  profilers.clear();
+  profilers.reserve(std::max(num_threads, 1));
+  for (i32 t = 0; t < std::max(num_threads, 1); ++t) {
+    profilers.emplace_back(timepoint_t());
+  }
+
+  // Threads take videos from a shared queue, largest first, so that a few
+  // long videos do not all end up on one thread and finish last
+  std::vector<u64> file_sizes(table_names.size(), 0);
+  std::atomic<size_t> next_video{0};
+  run_threads(num_threads, paths.size(), [&](i32 t) {
+    for (size_t i = next_video++; i < paths.size(); i = next_video++) {
+      // Videos that can not be opened fail when they are ingested
+      auto open_start = now();
+      std::unique_ptr<RandomReadFile> file;
+      StoreResult result;
+      STORE_RETRY(make_unique_random_read_file(storage, paths[i], file),
+                  result);
+      if (result == StoreResult::Success) {
+        file->get_size(file_sizes[i]);
       }
-    });
+      profilers[t].add_interval("open", open_start, now());
+    }
+  });
+
+  // Videos larger than segment_size are split into segments which are
+  // demuxed in parallel and become the items of the video's table
+  std::vector<i32> num_segments(table_names.size(), 1);
+  std::vector<std::tuple<size_t, i32>> segments;
+  for (size_t i = 0; i < table_names.size(); ++i) {
+    if (failed[i]) {
+      continue;
+    }
+    if (segment_size > 0) {
+      num_segments[i] = static_cast<i32>(std::min(
+          std::max((file_sizes[i] + segment_size - 1) / segment_size, (u64)1),
+          (u64)MAX_VIDEO_SEGMENTS));
+    }
+    for (i32 s = 0; s < num_segments[i]; ++s) {
+      segments.emplace_back(i, s);
+    }
   }
-  for (i32 t = 0; t < num_threads; ++t) {
-    ingest_threads[t].join();
+  std::stable_sort(segments.begin(), segments.end(),
+                   [&](const std::tuple<size_t, i32>& a,
+                       const std::tuple<size_t, i32>& b) {
+                     size_t va = std::get<0>(a);
+                     size_t vb = std::get<0>(b);
+                     return file_sizes[va] / num_segments[va] >
+                            file_sizes[vb] / num_segments[vb];
+                   });
+
+  std::vector<std::vector<proto::VideoDescriptor>> descriptors(
+      table_names.size());
+  std::vector<std::vector<u8>> segment_failed(table_names.size());
+  std::vector<std::vector<std::string>> segment_messages(table_names.size());
+  for (size_t i = 0; i < table_names.size(); ++i) {
+    descriptors[i].resize(num_segments[i]);
+    segment_failed[i].assign(num_segments[i], false);
+    segment_messages[i].resize(num_segments[i]);
   }
 
-  size_t num_bad_videos = 0;
+  next_video = 0;
+  run_threads(num_threads, segments.size(), [&](i32 t) {
+    for (size_t n = next_video++; n < segments.size(); n = next_video++) {
+      size_t i = std::get<0>(segments[n]);
+      i32 s = std::get<1>(segments[n]);
+      if (!parse_and_write_segment(storage, table_ids[i],
+                                   table_descs[i].end_rows_size(), paths[i],
+                                   s, num_segments[i], in_place, transcode,
+                                   descriptors[i][s], segment_messages[i][s],
+                                   profilers[t])) {
+        segment_failed[i][s] = true;
+      }
+    }
+  });
+
+  next_video = 0;
+  run_threads(num_threads, paths.size(), [&](i32 t) {
+    for (size_t i = next_video++; i < paths.size(); i = next_video++) {
+      if (failed[i]) {
+        continue;
+      }
+      auto it = std::find(segment_failed[i].begin(), segment_failed[i].end(),
+                          true);
+      if (it == segment_failed[i].end()) {
+        auto write_start = now();
+        write_video_table(storage, table_descs[i], descriptors[i],
+                          manifests[i]);
+        profilers[t].add_interval("write", write_start, now());
+        profilers[t].increment("videos", 1);
+        continue;
+      }
+      std::string& message =
+          segment_messages[i][it - segment_failed[i].begin()];
+      if (num_segments[i] == 1 && !in_place) {
+        // Did not ingest correctly, skip it
+        failed[i] = true;
+        failed_messages[i] = message;
+        continue;
+      }
+      // Streams which can not be cut at their keyframes, or read back from
+      // their container, are copied whole
+      LOG(WARNING) << "Could not ingest video " << paths[i]
+                   << (in_place ? " in place" : " in segments") << " ("
+                   << message << "), copying it as one item";
+      i32 first_item = table_descs[i].end_rows_size();
+      for (i32 s = 1; s < num_segments[i]; ++s) {
+        storage->delete_file(
+            table_item_output_path(table_ids[i], 1, first_item + s));
+      }
+      if (!parse_and_write_video(storage, table_descs[i], paths[i],
+                                 transcode, failed_messages[i], manifests[i],
+                                 profilers[t])) {
+        failed[i] = true;
+        continue;
+      }
+      profilers[t].increment("videos", 1);
+    }
+  });
+
   for (size_t i = 0; i < table_names.size(); ++i) {
-    if (bad_videos[i]) {
+    if (!failed[i]) {
+      manifest.MergeFrom(manifests[i]);
+    }
+  }
+}
+
+Result commit_ingest(storehouse::StorageBackend* storage,
+                     DatabaseMetadata& meta,
+                     const std::vector<i32>& table_ids,
+                     const std::vector<u8>& appended,
+                     const std::vector<std::string>& paths,
+                     const std::vector<u8>& failed,
+                     const std::vector<std::string>& failed_messages,
+                     const proto::DatabaseManifest& manifest,
+                     std::vector<FailedVideo>& failed_videos) {
+  Result result;
+  result.set_success(true);
+  size_t num_bad_videos = 0;
+  for (size_t i = 0; i < table_ids.size(); ++i) {
+    if (failed[i]) {
       num_bad_videos++;
       LOG(WARNING) << "Failed to ingest video " << paths[i] << "!";
-      failed_videos.push_back({paths[i], bad_messages[i]});
-      meta.remove_table(table_ids[i]);
+      failed_videos.push_back({paths[i], failed_messages[i]});
+      // Tables appended to keep the items they had
+      if (!appended[i]) {
+        meta.remove_table(table_ids[i]);
+      }
     }
   }
-  if (num_bad_videos == table_names.size()) {
+  if (num_bad_videos == table_ids.size()) {
     RESULT_ERROR(&result, "All videos failed to ingest properly");
   }
 
   if (result.success()) {
+    append_manifest(storage, meta, manifest);
     // Save the db metadata
-    internal::write_database_metadata(storage.get(), meta);
+    write_database_metadata(storage, meta);
   }
   return result;
 }
 
-void ingest_images(storehouse::StorageConfig* storage_config,
-                   const std::string& db_path, const std::string& table_name,
-                   const std::vector<std::string>& paths) {
+std::string serialize_ingest_profilers(i64 node, const std::string& tag,
+                                      const std::vector<Profiler>& profilers) {
+  PacketSink sink;
+  for (size_t t = 0; t < profilers.size(); ++t) {
+    write_profiler_to_file(&sink, node, "ingest", tag, t, profilers[t]);
+  }
+  return std::string(sink.bytes.begin(), sink.bytes.end());
+}
+
+void write_ingest_profile(storehouse::StorageBackend* storage,
+                          timepoint_t start, timepoint_t end,
+                          const std::vector<std::string>& profiles) {
+  std::unique_ptr<WriteFile> file;
+  STORE_CHECK(make_unique_write_file(storage, ingest_profiler_path(), file));
+  i64 start_ns = std::chrono::time_point_cast<std::chrono::nanoseconds>(start)
+                     .time_since_epoch()
+                     .count();
+  i64 end_ns = std::chrono::time_point_cast<std::chrono::nanoseconds>(end)
+                   .time_since_epoch()
+                   .count();
+  s_write(file.get(), start_ns);
+  s_write(file.get(), end_ns);
+  for (const std::string& profile : profiles) {
+    s_write(file.get(), (const u8*)profile.data(), profile.size());
+  }
+  STORE_CHECK(file->save());
+}
+
+Result ingest_videos(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path,
+                     const std::vector<std::string>& table_names,
+                     const std::vector<std::string>& paths,
+                     std::vector<FailedVideo>& failed_videos,
+                     i32 num_threads, i64 segment_size, bool in_place,
+                     bool append, const proto::TranscodeOptions& transcode) {
   internal::set_database_path(db_path);
 
   std::unique_ptr<storehouse::StorageBackend> storage{
       storehouse::StorageBackend::make_from_config(storage_config)};
 
-  LOG(FATAL) << "Image ingest under construction!" << std::endl;
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage.get(), internal::DatabaseMetadata::descriptor_path());
+  std::vector<i32> table_ids;
+  std::vector<u8> appended;
+  Result result =
+      add_ingest_tables(meta, table_names, append, table_ids, appended);
+  if (!result.success()) {
+    return result;
+  }
+  auto start = now();
+  std::vector<u8> failed;
+  std::vector<std::string> failed_messages;
+  proto::DatabaseManifest manifest;
+  std::vector<Profiler> profilers;
+  ingest_video_tables(storage.get(), table_names, table_ids, appended, paths,
+                      num_threads, segment_size, in_place, transcode,
+                      failed, failed_messages, manifest, profilers);
+  std::vector<Profiler> commit_profiler = {Profiler(timepoint_t())};
+  auto commit_start = now();
+  result = commit_ingest(storage.get(), meta, table_ids, appended, paths,
+                         failed, failed_messages, manifest, failed_videos);
+  commit_profiler[0].add_interval("commit", commit_start, now());
+  write_ingest_profile(
+      storage.get(), start, now(),
+      {serialize_ingest_profilers(MASTER_PROFILER_NODE, "", profilers),
+       serialize_ingest_profilers(MASTER_PROFILER_NODE, "commit",
+                                  commit_profiler)});
+  return result;
+}
+
+Result ingest_stream(storehouse::StorageBackend* storage,
+                     const std::string& table_name, const std::string& url,
+                     i64 item_frames, i64 max_items,
+                     const std::function<void()>& item_ingested) {
+  av_register_all();
+  avformat_network_init();
+
+  DatabaseMetadata meta =
+      read_database_metadata(storage, DatabaseMetadata::descriptor_path());
+  std::vector<i32> table_ids;
+  std::vector<u8> appended;
+  Result result =
+      add_ingest_tables(meta, {table_name}, false, table_ids, appended);
+  if (!result.success()) {
+    return result;
+  }
+  i32 table_id = table_ids[0];
+
+  CodecState state;
+  if (!setup_stream_codec(url, state)) {
+    RESULT_ERROR(&result, "Can not open stream %s", url.c_str());
+    return result;
+  }
+
+  // The table is saved without items right away so that jobs can be set up
+  // over it while the stream is ingested
+  proto::TableDescriptor table_desc =
+      video_table_descriptor(table_name, table_id);
+  {
+    proto::DatabaseManifest item_manifest;
+    write_video_table(storage, table_desc, {}, item_manifest);
+    table_desc = item_manifest.tables(0);
+  }
+  write_database_metadata(storage, meta);
+
+  // Streams described by SDP or carried in MPEG-TS keep Annex B parameter
+  // sets in their extradata, which the packets need not repeat, so each item
+  // starts with them
+  std::vector<u8> parameter_sets;
+  if (state.in_cc->extradata_size > 0 && state.in_cc->extradata[0] != 1) {
+    parameter_sets.assign(state.in_cc->extradata,
+                          state.in_cc->extradata + state.in_cc->extradata_size);
+  }
+
+  proto::DatabaseManifest segment;
+  std::unique_ptr<WriteFile> bytestream;
+  std::unique_ptr<ByteStreamIndexCreator> index_creator;
+  i32 item_id = 0;
+  auto start_item = [&]() {
+    STORE_CHECK(make_unique_write_file(
+        storage, table_item_output_path(table_id, 1, item_id), bytestream));
+    index_creator = make_index_creator(state.codec_type, bytestream.get());
+    if (!parameter_sets.empty() &&
+        !index_creator->feed_packet(parameter_sets.data(),
+                                    parameter_sets.size())) {
+      RESULT_ERROR(&result, "%s", index_creator->error_message().c_str());
+    }
+  };
+  // Writes out the item being demuxed and the table descriptor that ends
+  // with it, after which jobs can read it
+  auto finish_item = [&]() {
+    proto::VideoDescriptor video_descriptor;
+    describe_video_format(state, table_id, item_id, video_descriptor);
+    describe_video_index(*index_creator, video_descriptor);
+    if (video_descriptor.keyframe_positions_size() == 0 ||
+        video_descriptor.keyframe_positions(0) != 0) {
+      RESULT_ERROR(&result, "Stream item %d does not start at a keyframe",
+                   item_id);
+      return;
+    }
+    STORE_CHECK(bytestream->save());
+    proto::DatabaseManifest item_manifest;
+    write_video_table(storage, table_desc, {video_descriptor}, item_manifest);
+    table_desc = item_manifest.tables(0);
+    segment.add_videos()->CopyFrom(video_descriptor);
+    VLOG(1) << "Ingested item " << item_id << " of stream " << url << " ("
+            << video_descriptor.frames() << " frames)";
+    item_id++;
+    index_creator.reset();
+    bytestream.reset();
+    item_ingested();
+  };
+
+  while (result.success() && (max_items <= 0 || item_id < max_items)) {
+    i32 err = av_read_frame(state.format_context, &state.av_packet);
+    if (err == AVERROR_EOF) {
+      av_packet_unref(&state.av_packet);
+      break;
+    } else if (err != 0) {
+      char err_msg[256];
+      av_strerror(err, err_msg, 256);
+      RESULT_ERROR(&result, "Error while reading stream (%d): %s", err,
+                   err_msg);
+      break;
+    }
+    if (state.av_packet.stream_index != state.video_stream_index) {
+      av_packet_unref(&state.av_packet);
+      continue;
+    }
+
+    // Items are cut at the first keyframe after item_frames frames, or at
+    // every keyframe if item_frames is not positive
+    bool keyframe = state.av_packet.flags & AV_PKT_FLAG_KEY;
+    if (keyframe && index_creator &&
+        index_creator->frames() >= std::max(item_frames, (i64)1)) {
+      finish_item();
+      if (!result.success() || (max_items > 0 && item_id >= max_items)) {
+        av_packet_unref(&state.av_packet);
+        break;
+      }
+    }
+    if (!index_creator) {
+      // Packets before the first keyframe can not be decoded
+      if (!keyframe) {
+        av_packet_unref(&state.av_packet);
+        continue;
+      }
+      start_item();
+      if (!result.success()) {
+        av_packet_unref(&state.av_packet);
+        break;
+      }
+    }
+
+    u8* filtered_data;
+    i32 filtered_data_size;
+    err = av_bitstream_filter_filter(state.annexb, state.in_cc, NULL,
+                                     &filtered_data, &filtered_data_size,
+                                     state.av_packet.data, state.av_packet.size,
+                                     keyframe);
+    if (err < 0) {
+      char err_msg[256];
+      av_strerror(err, err_msg, 256);
+      RESULT_ERROR(&result, "Error while filtering stream (%d): %s", err,
+                   err_msg);
+      av_packet_unref(&state.av_packet);
+      break;
+    }
+    if (!index_creator->feed_packet(filtered_data, filtered_data_size)) {
+      RESULT_ERROR(&result, "%s", index_creator->error_message().c_str());
+    }
+    if (filtered_data != state.av_packet.data) {
+      free(filtered_data);
+    }
+    av_packet_unref(&state.av_packet);
+  }
+  // The frames since the last keyframe become the last item
+  if (result.success() && index_creator && index_creator->frames() > 0) {
+    finish_item();
+  }
+  cleanup_video_codec(state);
+
+  // Jobs over the stream may have saved the database metadata since it was
+  // read, so the manifest goes into a fresh copy
+  segment.add_tables()->CopyFrom(table_desc);
+  meta = read_database_metadata(storage, DatabaseMetadata::descriptor_path());
+  append_manifest(storage, meta, segment);
+  write_database_metadata(storage, meta);
+  return result;
+}
+
+Result ingest_images(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path, const std::string& table_name,
+                     const std::vector<std::string>& paths,
+                     std::vector<FailedVideo>& failed_images, i32 num_threads,
+                     i64 images_per_item) {
+  internal::set_database_path(db_path);
+
+  std::unique_ptr<storehouse::StorageBackend> storage{
+      storehouse::StorageBackend::make_from_config(storage_config)};
 
   VLOG(1) << "Creating image table " << table_name << "..." << std::endl;
+
+  DatabaseMetadata meta = read_database_metadata(
+      storage.get(), DatabaseMetadata::descriptor_path());
+  Result result;
+  result.set_success(true);
+  i32 table_id = meta.add_table(table_name);
+  if (table_id == -1) {
+    RESULT_ERROR(&result, "Table name %s already exists in databse.",
+                 table_name.c_str());
+    return result;
+  }
+  if (num_threads <= 0) {
+    num_threads = std::thread::hardware_concurrency();
+  }
+  if (images_per_item <= 0) {
+    images_per_item = DEFAULT_IMAGES_PER_ITEM;
+  }
+
+  // Read the image headers in parallel
+  std::vector<ImageFormat> formats(paths.size());
+  std::vector<u64> file_sizes(paths.size(), 0);
+  std::vector<u8> failed(paths.size(), false);
+  std::vector<std::string> failed_messages(paths.size());
+  std::atomic<size_t> next_image{0};
+  run_threads(num_threads, paths.size(), [&](i32 t) {
+    for (size_t i = next_image++; i < paths.size(); i = next_image++) {
+      if (!read_image_format(storage.get(), paths[i], formats[i],
+                             file_sizes[i], failed_messages[i])) {
+        failed[i] = true;
+      }
+    }
+  });
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (failed[i]) {
+      LOG(WARNING) << "Failed to ingest image " << paths[i] << "!";
+      failed_images.push_back({paths[i], failed_messages[i]});
+    }
+  }
+  if (failed_images.size() == paths.size()) {
+    RESULT_ERROR(&result, "All images failed to ingest properly");
+    return result;
+  }
+
+  // Rows are ordered by format, and each item holds up to images_per_item
+  // images of one format so that decoders get batches of frames of one shape
+  std::map<ImageFormat, std::vector<size_t>> groups;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!failed[i]) {
+      groups[formats[i]].push_back(i);
+    }
+  }
+  std::vector<std::vector<size_t>> items;
+  for (auto& kv : groups) {
+    const std::vector<size_t>& images = kv.second;
+    for (size_t i = 0; i < images.size(); i += images_per_item) {
+      size_t end = std::min(i + images_per_item, images.size());
+      items.emplace_back(images.begin() + i, images.begin() + end);
+    }
+  }
+
+  proto::TableDescriptor table_desc;
+  table_desc.set_id(table_id);
+  table_desc.set_name(table_name);
+  table_desc.set_job_id(-1);
+  table_desc.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+  const std::vector<std::string> column_names = {index_column_name(), "img",
+                                                 "path"};
+  for (size_t c = 0; c < column_names.size(); ++c) {
+    Column* col = table_desc.add_columns();
+    col->set_name(column_names[c]);
+    col->set_id(c);
+    col->set_type(ColumnType::Other);
+  }
+  i64 end_row = 0;
+  for (const std::vector<size_t>& item : items) {
+    end_row += item.size();
+    table_desc.add_end_rows(end_row);
+  }
+
+  // Write the items in parallel, each thread reusing one buffer for the
+  // images it copies
+  std::vector<u8> item_failed(items.size(), false);
+  std::vector<std::string> item_messages(items.size());
+  std::atomic<size_t> next_item{0};
+  run_threads(num_threads, items.size(), [&](i32 t) {
+    std::vector<u8> buffer;
+    for (size_t n = next_item++; n < items.size(); n = next_item++) {
+      std::vector<std::string> item_paths;
+      std::vector<u64> item_sizes;
+      for (size_t i : items[n]) {
+        item_paths.push_back(paths[i]);
+        item_sizes.push_back(file_sizes[i]);
+      }
+      i64 start_row = n > 0 ? table_desc.end_rows(n - 1) : 0;
+      if (!write_image_item(storage.get(), table_id, n, start_row, item_paths,
+                            item_sizes, buffer, item_messages[n])) {
+        item_failed[n] = true;
+      }
+    }
+  });
+  for (size_t n = 0; n < items.size(); ++n) {
+    if (item_failed[n]) {
+      RESULT_ERROR(&result, "%s", item_messages[n].c_str());
+      return result;
+    }
+  }
+
+  write_table_metadata(storage.get(), TableMetadata(table_desc));
+  proto::DatabaseManifest manifest;
+  manifest.add_tables()->CopyFrom(table_desc);
+  append_manifest(storage.get(), meta, manifest);
+  write_database_metadata(storage.get(), meta);
+  return result;
 }
 }
 }
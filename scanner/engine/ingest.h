@@ -16,24 +16,119 @@
 #pragma once
 
 #include "scanner/api/database.h"
+#include "scanner/engine/metadata.h"
 #include "scanner/util/common.h"
 
 #include "storehouse/storage_backend.h"
 #include "storehouse/storage_config.h"
 
+#include <functional>
 #include <string>
 
 namespace scanner {
 namespace internal {
 
+//! Adds a table to meta for each name in table_names and returns their ids
+//! in table_ids. With append, names already in use keep their table and are
+//! marked in appended. Fails if a name is repeated or, without append,
+//! already in use.
+Result add_ingest_tables(DatabaseMetadata& meta,
+                         const std::vector<std::string>& table_names,
+                         bool append, std::vector<i32>& table_ids,
+                         std::vector<u8>& appended);
+
+//! Writes out paths[i] as the table table_ids[i], using num_threads threads
+//! or one per core if num_threads is not positive. Videos larger than a
+//! positive segment_size are split at keyframes into segments of about that
+//! many bytes, which are demuxed in parallel into the items of their table.
+//! Videos ingested in_place are only indexed and read from paths[i] later,
+//! unless their container does not allow it. Videos of appended tables
+//! become items after the existing ones. With a positive keyframe distance
+//! in transcode, videos are re-encoded as H.264 with that keyframe distance
+//! and the size in transcode, and never ingested in place. Sets failed[i] and
+//! failed_messages[i] for videos that could not be ingested and adds the
+//! descriptors of the others to manifest. Sets profilers to one per thread,
+//! recording in absolute time where the thread spent its time opening,
+//! reading, demuxing, indexing, transcoding and writing videos.
+void ingest_video_tables(storehouse::StorageBackend* storage,
+                         const std::vector<std::string>& table_names,
+                         const std::vector<i32>& table_ids,
+                         const std::vector<u8>& appended,
+                         const std::vector<std::string>& paths,
+                         i32 num_threads, i64 segment_size, bool in_place,
+                         const proto::TranscodeOptions& transcode,
+                         std::vector<u8>& failed,
+                         std::vector<std::string>& failed_messages,
+                         proto::DatabaseManifest& manifest,
+                         std::vector<Profiler>& profilers);
+
+//! Drops the tables of failed videos, other than appended ones, from meta
+//! and saves it along with the manifest of the ingested ones.
+Result commit_ingest(storehouse::StorageBackend* storage,
+                     DatabaseMetadata& meta,
+                     const std::vector<i32>& table_ids,
+                     const std::vector<u8>& appended,
+                     const std::vector<std::string>& paths,
+                     const std::vector<u8>& failed,
+                     const std::vector<std::string>& failed_messages,
+                     const proto::DatabaseManifest& manifest,
+                     std::vector<FailedVideo>& failed_videos);
+
+//! Node of the profilers of ingest threads run by the master itself
+const i64 MASTER_PROFILER_NODE = -1;
+
+//! Serializes the profilers of the ingest threads of node in the format of
+//! job profiles, as "ingest" workers with tag.
+std::string serialize_ingest_profilers(i64 node, const std::string& tag,
+                                       const std::vector<Profiler>& profilers);
+
+//! Writes the profile of an ingest that ran from start to end, made of the
+//! serialized profilers of the nodes that took part, to
+//! ingest_profiler_path().
+void write_ingest_profile(storehouse::StorageBackend* storage,
+                          timepoint_t start, timepoint_t end,
+                          const std::vector<std::string>& profiles);
+
+//! Ingests each video into its own table using num_threads threads, or one
+//! per core if num_threads is not positive, splitting videos larger than a
+//! positive segment_size into items and indexing videos in_place as
+//! ingest_video_tables does. With append, videos named after existing
+//! tables are added to them. Videos are re-encoded according to transcode
+//! as ingest_video_tables does. Writes the profile of the ingest with
+//! write_ingest_profile.
 Result ingest_videos(storehouse::StorageConfig* storage_config,
                      const std::string& db_path,
                      const std::vector<std::string>& table_names,
                      const std::vector<std::string>& paths,
-                     std::vector<FailedVideo>& failed_videos);
+                     std::vector<FailedVideo>& failed_videos,
+                     i32 num_threads = 0, i64 segment_size = 0,
+                     bool in_place = false, bool append = false,
+                     const proto::TranscodeOptions& transcode =
+                         proto::TranscodeOptions());
 
-// void ingest_images(storehouse::StorageConfig *storage_config,
-//                    const std::string &db_path, const std::string &table_name,
-//                    const std::vector<std::string> &paths);
+//! Ingests the live video stream at url, such as an RTSP address or an HLS
+//! playlist, into a new table. The stream is cut into an item at the first
+//! keyframe after every item_frames frames, or at every keyframe if
+//! item_frames is not positive. Each item is written out with the table
+//! descriptor as soon as it is cut, and then item_ingested is called.
+//! Stops after max_items items if max_items is positive, and otherwise when
+//! the stream ends.
+Result ingest_stream(storehouse::StorageBackend* storage,
+                     const std::string& table_name, const std::string& url,
+                     i64 item_frames, i64 max_items,
+                     const std::function<void()>& item_ingested);
+
+//! Ingests images into a table with an index, an img column of the encoded
+//! images and a path column of where they came from, reading their headers
+//! and writing items on num_threads threads, or one per core if num_threads
+//! is not positive. Rows are grouped by encoding, color space and size, and
+//! each item holds up to images_per_item images of one group, or 1024 if
+//! images_per_item is not positive. Images that can not be read or are not
+//! JPEG, PNG or BMP are left out and added to failed_images.
+Result ingest_images(storehouse::StorageConfig* storage_config,
+                     const std::string& db_path, const std::string& table_name,
+                     const std::vector<std::string>& paths,
+                     std::vector<FailedVideo>& failed_images,
+                     i32 num_threads = 0, i64 images_per_item = 0);
 }
 }
@@ -0,0 +1,130 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/kernel_cache.h"
+#include "scanner/util/cuda.h"
+
+namespace scanner {
+namespace internal {
+
+bool KernelKey::operator==(const KernelKey& other) const {
+  return factory == other.factory && device_type == other.device_type &&
+         device_ids == other.device_ids &&
+         input_columns == other.input_columns &&
+         output_columns == other.output_columns && args == other.args &&
+         work_item_size == other.work_item_size && node_id == other.node_id &&
+         node_count == other.node_count;
+}
+
+bool KernelKey::operator!=(const KernelKey& other) const {
+  return !(*this == other);
+}
+
+KernelKey make_kernel_key(KernelFactory* factory, const KernelConfig& config) {
+  KernelKey key;
+  key.factory = factory;
+  key.device_type = config.devices[0].type;
+  for (const DeviceHandle& device : config.devices) {
+    key.device_ids.push_back(device.id);
+  }
+  key.input_columns = config.input_columns;
+  key.output_columns = config.output_columns;
+  key.args = config.args;
+  key.work_item_size = config.work_item_size;
+  key.node_id = config.node_id;
+  key.node_count = config.node_count;
+  return key;
+}
+
+bool KernelCache::acquire(const KernelKey& key, CachedKernel& kernel) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Prefer the most recently returned kernel
+    for (auto it = idle_.rbegin(); it != idle_.rend(); ++it) {
+      if (std::get<0>(*it) == key) {
+        kernel = std::move(std::get<1>(*it));
+        idle_.erase(std::next(it).base());
+        break;
+      }
+    }
+  }
+  if (!kernel.kernel) {
+    return false;
+  }
+  // The next job does not continue the rows of the last one
+  kernel.kernel->reset();
+  return true;
+}
+
+void KernelCache::release(const KernelKey& key, CachedKernel kernel) {
+  // The profiler belongs to the current job
+  kernel.kernel->set_profiler(nullptr);
+  std::list<std::tuple<KernelKey, CachedKernel, timepoint_t>> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.emplace_back(key, std::move(kernel), now());
+    if (idle_.size() > MAX_IDLE_KERNELS) {
+      evicted.splice(evicted.end(), idle_, idle_.begin());
+    }
+  }
+  for (auto& entry : evicted) {
+    destroy(std::get<1>(entry));
+  }
+}
+
+void KernelCache::evict_idle() {
+  std::list<std::tuple<KernelKey, CachedKernel, timepoint_t>> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Entries are in the order they were returned, so the oldest come first
+    while (!idle_.empty() &&
+           nano_since(std::get<2>(idle_.front())) / 1e9 >
+               IDLE_TIMEOUT_SECONDS) {
+      evicted.splice(evicted.end(), idle_, idle_.begin());
+    }
+  }
+  for (auto& entry : evicted) {
+    destroy(std::get<1>(entry));
+  }
+}
+
+void KernelCache::clear() {
+  std::list<std::tuple<KernelKey, CachedKernel, timepoint_t>> idle;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle.swap(idle_);
+  }
+  for (auto& entry : idle) {
+    destroy(std::get<1>(entry));
+  }
+}
+
+void KernelCache::destroy(CachedKernel& kernel) {
+  kernel.kernel.reset();
+#ifdef HAVE_CUDA
+  if (kernel.stream != nullptr) {
+    cudaSetDevice(kernel.device.id);
+    cudaStreamDestroy(kernel.stream);
+    kernel.stream = nullptr;
+  }
+#endif
+}
+
+KernelCache& kernel_cache() {
+  static KernelCache cache;
+  return cache;
+}
+}
+}
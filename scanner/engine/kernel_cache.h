@@ -0,0 +1,97 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/engine/kernel_factory.h"
+#include "scanner/util/common.h"
+#include "scanner/util/util.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+//! Identifies kernels that can evaluate the work of a later job without
+//! being created again, which for kernels such as Caffe nets means loading
+//! their weights again.
+struct KernelKey {
+  bool operator==(const KernelKey& other) const;
+  bool operator!=(const KernelKey& other) const;
+
+  KernelFactory* factory;
+  DeviceType device_type;
+  std::vector<i32> device_ids;
+  std::vector<std::string> input_columns;
+  std::vector<std::string> output_columns;
+  std::vector<u8> args;
+  i32 work_item_size;
+  i32 node_id;
+  i32 node_count;
+};
+
+//! The key of the kernels factory creates for config.
+KernelKey make_kernel_key(KernelFactory* factory, const KernelConfig& config);
+
+//! A kernel along with the stream it queues its work on, which it may keep
+//! using for as long as it lives.
+struct CachedKernel {
+  std::unique_ptr<BaseKernel> kernel;
+  DeviceHandle device;
+  CUstream_st* stream = nullptr;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// KernelCache
+//! Keeps the kernels of finished jobs so that later jobs with the same ops
+//! and args on the same devices reuse them. Kernels idle for longer than
+//! IDLE_TIMEOUT_SECONDS are destroyed.
+class KernelCache {
+ public:
+  //! Takes an idle kernel created for key, returning false if there is
+  //! none. The kernel is reset before it is returned.
+  bool acquire(const KernelKey& key, CachedKernel& kernel);
+
+  //! Hands a kernel created for key back to the cache, destroying the least
+  //! recently returned kernel if more than MAX_IDLE_KERNELS are idle.
+  void release(const KernelKey& key, CachedKernel kernel);
+
+  //! Destroys the kernels that have been idle for too long.
+  void evict_idle();
+
+  //! Destroys all idle kernels.
+  void clear();
+
+  //! Destroys the kernel and then its stream.
+  static void destroy(CachedKernel& kernel);
+
+ private:
+  const size_t MAX_IDLE_KERNELS = 32;
+  const f64 IDLE_TIMEOUT_SECONDS = 300;
+
+  std::mutex mutex_;
+  std::list<std::tuple<KernelKey, CachedKernel, timepoint_t>> idle_;
+};
+
+//! The kernel cache shared by the jobs of this process.
+KernelCache& kernel_cache();
+}
+}
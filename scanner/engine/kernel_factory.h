@@ -38,12 +38,19 @@ namespace internal {
 class KernelFactory {
  public:
   KernelFactory(const std::string& op_name, DeviceType type, i32 max_devices,
-                bool can_batch, i32 batch_size, KernelConstructor constructor)
+                bool can_batch, i32 batch_size, i32 max_batch_size,
+                bool accepts_nv12_frames, bool parallel, bool shared,
+                i64 device_memory, KernelConstructor constructor)
     : op_name_(op_name),
       type_(type),
       max_devices_(max_devices),
       can_batch_(can_batch),
       preferred_batch_size_(batch_size),
+      max_batch_size_(max_batch_size),
+      accepts_nv12_frames_(accepts_nv12_frames),
+      parallel_(parallel),
+      shared_(shared),
+      device_memory_(device_memory),
       constructor_(constructor) {}
 
   const std::string& get_op_name() const { return op_name_; }
@@ -57,6 +64,20 @@ class KernelFactory {
 
   i32 preferred_batch_size() const { return preferred_batch_size_; }
 
+  //! Largest batch the kernel accepts, or 0 if there is no limit.
+  i32 max_batch_size() const { return max_batch_size_; }
+
+  bool accepts_nv12_frames() const { return accepts_nv12_frames_; }
+
+  //! Whether the rows of a batch may be executed concurrently.
+  bool parallel() const { return parallel_; }
+
+  //! Whether pipeline instances on the same device share one instance.
+  bool shared() const { return shared_; }
+
+  //! Bytes an instance needs on each of its GPUs, or 0 if not declared.
+  i64 device_memory() const { return device_memory_; }
+
   /* @brief Constructs a kernel to be used for processing elements of data.
    */
   BaseKernel* new_instance(const KernelConfig& config) {
@@ -69,6 +90,11 @@ class KernelFactory {
   i32 max_devices_;
   bool can_batch_;
   i32 preferred_batch_size_;
+  i32 max_batch_size_;
+  bool accepts_nv12_frames_;
+  bool parallel_;
+  bool shared_;
+  i64 device_memory_;
   KernelConstructor constructor_;
 };
 }
@@ -14,10 +14,18 @@
  */
 
 #include "scanner/engine/load_worker.h"
+#include "scanner/engine/metadata_cache.h"
+#include "scanner/util/block_cache.h"
+#include "scanner/video/decode_cost_model.h"
 
 #include "storehouse/storage_backend.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <glog/logging.h>
+#include <new>
 
 using storehouse::StoreResult;
 using storehouse::WriteFile;
@@ -37,6 +45,8 @@ struct RowIntervals {
 struct VideoIntervals {
   std::vector<std::tuple<size_t, size_t>> keyframe_index_intervals;
   std::vector<std::vector<i64>> valid_frames;
+  // Only the packet of the starting keyframe needs to be read and decoded
+  std::vector<bool> keyframe_only;
 };
 
 // Gets the list of work items for a sequence of rows in the job
@@ -116,43 +126,122 @@ RowIntervals slice_into_row_intervals(const TableMetadata& table,
   return info;
 }
 
+// Slices rows into intervals that each decode from one keyframe. Since an
+// interval is decoded up to the keyframe after its last row, seeking to the
+// keyframe before the next row only saves decoding the whole GOPs in between,
+// so a new interval is started once those outweigh seek_cost frames.
 VideoIntervals slice_into_video_intervals(
-    const std::vector<i64>& keyframe_positions, const std::vector<i64>& rows) {
+    const std::vector<i64>& keyframe_positions, const std::vector<i64>& rows,
+    f64 seek_cost) {
   VideoIntervals info;
   assert(keyframe_positions.size() >= 2);
   size_t start_keyframe_index = 0;
   size_t end_keyframe_index = 1;
-  i64 next_keyframe = keyframe_positions[end_keyframe_index];
   std::vector<i64> valid_frames;
   for (i64 row : rows) {
-    if (row >= next_keyframe) {
-      assert(end_keyframe_index < keyframe_positions.size() - 1);
-      next_keyframe = keyframe_positions[++end_keyframe_index];
-      if (row >= next_keyframe) {
-        // Skipped a keyframe, so make a new interval
-        if (!valid_frames.empty()) {
-          info.keyframe_index_intervals.push_back(
-              std::make_tuple(start_keyframe_index, end_keyframe_index - 1));
-          info.valid_frames.push_back(valid_frames);
-        }
-
-        while (row >= keyframe_positions[end_keyframe_index]) {
-          end_keyframe_index++;
-          assert(end_keyframe_index < keyframe_positions.size());
-        }
+    size_t row_keyframe_index = end_keyframe_index - 1;
+    while (row >= keyframe_positions[row_keyframe_index + 1]) {
+      row_keyframe_index++;
+      assert(row_keyframe_index < keyframe_positions.size() - 1);
+    }
+    if (valid_frames.empty()) {
+      start_keyframe_index = row_keyframe_index;
+    } else if (row_keyframe_index >= end_keyframe_index) {
+      i64 skipped_frames = keyframe_positions[row_keyframe_index] -
+                           keyframe_positions[end_keyframe_index];
+      if (skipped_frames > seek_cost) {
+        info.keyframe_index_intervals.push_back(
+            std::make_tuple(start_keyframe_index, end_keyframe_index));
+        info.valid_frames.push_back(valid_frames);
         valid_frames.clear();
-        start_keyframe_index = end_keyframe_index - 1;
-        next_keyframe = keyframe_positions[end_keyframe_index];
+        start_keyframe_index = row_keyframe_index;
       }
     }
+    end_keyframe_index = row_keyframe_index + 1;
     valid_frames.push_back(row);
   }
   info.keyframe_index_intervals.push_back(
       std::make_tuple(start_keyframe_index, end_keyframe_index));
   info.valid_frames.push_back(valid_frames);
+  info.keyframe_only.resize(info.valid_frames.size(), false);
   return info;
 }
 
+// Splits keyframes whose GOP holds no other requested row out into their own
+// intervals, since those decode from the keyframe packet alone. With strides
+// of a GOP this avoids reading and decoding every frame in between.
+VideoIntervals split_keyframe_only_intervals(
+    const VideoIndexEntry& index_entry, const VideoIntervals& intervals) {
+  const std::vector<i64>& keyframe_positions = index_entry.keyframe_positions;
+  const std::vector<i64>& packet_sizes = index_entry.keyframe_packet_sizes;
+  if (packet_sizes.empty()) {
+    return intervals;
+  }
+  VideoIntervals info;
+  auto add_interval = [&info](size_t start, size_t end,
+                              const std::vector<i64>& frames,
+                              bool keyframe_only) {
+    info.keyframe_index_intervals.push_back(std::make_tuple(start, end));
+    info.valid_frames.push_back(frames);
+    info.keyframe_only.push_back(keyframe_only);
+  };
+  for (size_t i = 0; i < intervals.keyframe_index_intervals.size(); ++i) {
+    size_t start_keyframe_index;
+    size_t end_keyframe_index;
+    std::tie(start_keyframe_index, end_keyframe_index) =
+        intervals.keyframe_index_intervals[i];
+    const std::vector<i64>& valid_frames = intervals.valid_frames[i];
+
+    size_t f = 0;
+    size_t run_start = start_keyframe_index;
+    std::vector<i64> run_frames;
+    for (size_t k = start_keyframe_index; k < end_keyframe_index; ++k) {
+      std::vector<i64> gop_frames;
+      while (f < valid_frames.size() &&
+             valid_frames[f] < keyframe_positions[k + 1]) {
+        gop_frames.push_back(valid_frames[f++]);
+      }
+      if (gop_frames.size() == 1 && gop_frames[0] == keyframe_positions[k] &&
+          k < packet_sizes.size()) {
+        if (!run_frames.empty()) {
+          add_interval(run_start, k, run_frames, false);
+          run_frames.clear();
+        }
+        add_interval(k, k + 1, gop_frames, true);
+        continue;
+      }
+      if (run_frames.empty()) {
+        run_start = k;
+      }
+      run_frames.insert(run_frames.end(), gop_frames.begin(),
+                        gop_frames.end());
+    }
+    if (!run_frames.empty()) {
+      add_interval(run_start, end_keyframe_index, run_frames, false);
+    }
+  }
+  return info;
+}
+
+// Byte range of the video file holding interval i
+std::tuple<u64, u64> video_interval_byte_range(
+    const VideoIndexEntry& index_entry, const VideoIntervals& intervals,
+    size_t i) {
+  size_t start_keyframe_index;
+  size_t end_keyframe_index;
+  std::tie(start_keyframe_index, end_keyframe_index) =
+      intervals.keyframe_index_intervals[i];
+  u64 start =
+      static_cast<u64>(index_entry.keyframe_byte_offsets[start_keyframe_index]);
+  if (intervals.keyframe_only[i]) {
+    return std::make_tuple(
+        start, start + index_entry.keyframe_packet_sizes[start_keyframe_index]);
+  }
+  return std::make_tuple(
+      start,
+      static_cast<u64>(index_entry.keyframe_byte_offsets[end_keyframe_index]));
+}
+
 std::tuple<size_t, size_t> find_keyframe_indices(
     i32 start_frame, i32 end_frame,
     const std::vector<i64>& keyframe_positions) {
@@ -175,15 +264,101 @@ std::tuple<size_t, size_t> find_keyframe_indices(
   assert(end_keyframe_index != 0);
   return std::make_tuple(start_keyframe_index, end_keyframe_index);
 }
+
+// Maps the file at path into memory as an external buffer with refs
+// references, or returns nullptr if it is not a file on local disk, e.g.
+// when the database lives in cloud storage
+u8* map_local_file(const std::string& path, u64 file_size, i32 refs) {
+  if (file_size == 0 || refs <= 0) {
+    return nullptr;
+  }
+  i32 fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (u64)st.st_size != file_size) {
+    close(fd);
+    return nullptr;
+  }
+  // Private writable mappings keep the file safe from anything that
+  // scribbles on its input
+  void* data =
+      mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  return new_external_buffer((u8*)data, file_size, refs, [data, file_size]() {
+    munmap(data, file_size);
+  });
+}
+
+// Maps the bytes of a column of an item on local disk with refs references.
+// Columns of packed items are located in the packed file through file, the
+// opened column.
+u8* map_item_column(bool packed, RandomReadFile* file, i32 table_id,
+                    i32 column_id, i32 item_id, u64 column_size, i32 refs) {
+  if (!packed) {
+    return map_local_file(
+        item_file_path(table_id,
+                       table_item_output_path(table_id, column_id, item_id)),
+        column_size, refs);
+  }
+  auto view = dynamic_cast<ItemFileView*>(file);
+  u64 packed_size = 0;
+  if (view == nullptr ||
+      view->file()->get_size(packed_size) != StoreResult::Success) {
+    return nullptr;
+  }
+  u8* mapped_file = map_local_file(
+      item_file_path(table_id, table_item_packed_path(table_id, item_id)),
+      packed_size, refs);
+  return mapped_file == nullptr ? nullptr : mapped_file + view->start();
+}
+
+// Path of the file on local disk that holds a column of an item, or an empty
+// string if it is not on local disk
+std::string local_item_path(bool packed, i32 table_id, i32 column_id,
+                            i32 item_id) {
+  std::string path = item_file_path(
+      table_id, packed ? table_item_packed_path(table_id, item_id)
+                       : table_item_output_path(table_id, column_id, item_id));
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return "";
+  }
+  return path;
+}
+
+// Starts paging in the range of a mapping ahead of its first use
+void prefetch_mapped_range(u8* base, u64 start, u64 end) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t page_start = (size_t)(base + start) / page_size * page_size;
+  madvise((void*)page_start, (size_t)(base + end) - page_start,
+          MADV_WILLNEED);
+}
 }
 
 LoadWorker::LoadWorker(const LoadWorkerArgs& args)
   : node_id_(args.node_id),
     worker_id_(args.worker_id),
     profiler_(args.profiler),
-    load_sparsity_threshold_(args.load_sparsity_threshold) {
+    load_sparsity_threshold_(args.load_sparsity_threshold),
+    read_coalesce_gap_(args.read_coalesce_gap),
+    mmap_reads_(args.mmap_reads),
+    direct_reads_(args.direct_reads),
+    decoder_type_(args.decoder_type) {
   storage_.reset(
       storehouse::StorageBackend::make_from_config(args.storage_config));
+  if (args.read_parallelism > 1) {
+    for (i32 i = 0; i < args.read_parallelism; ++i) {
+      read_storage_.emplace_back(
+          storehouse::StorageBackend::make_from_config(args.storage_config));
+    }
+    read_pool_.reset(new WorkStealingPool(args.read_parallelism));
+    read_memory_tag_ = memory_tag_id("load");
+  }
 }
 
 std::tuple<IOItem, EvalWorkEntry> LoadWorker::execute(
@@ -194,12 +369,6 @@ std::tuple<IOItem, EvalWorkEntry> LoadWorker::execute(
 
   const auto& samples = load_work_entry.samples();
 
-  if (io_item.table_id() != last_table_id_) {
-    // Not from the same task so clear cached data
-    last_table_id_ = io_item.table_id();
-    index_.clear();
-  }
-
   EvalWorkEntry eval_work_entry;
   eval_work_entry.io_item_index = load_work_entry.io_item_index();
   eval_work_entry.row_ids =
@@ -218,18 +387,19 @@ std::tuple<IOItem, EvalWorkEntry> LoadWorker::execute(
     num_columns += samples.Get(i).column_ids_size();
   }
   eval_work_entry.columns.resize(num_columns);
+  f64 seek_cost = decode_cost_model(decoder_type_).seek_cost();
 
+  // Metadata and indices are read up front so that only item reads, which
+  // are independent of each other, are left to run in parallel
+  std::vector<std::tuple<i32, ReadTask>> reads;
   i32 media_col_idx = 0;
   i32 out_col_idx = 0;
   for (const proto::LoadSample& sample : samples) {
     i32 table_id = sample.table_id();
-    auto it = table_metadata_.find(table_id);
-    if (it == table_metadata_.end()) {
-      table_metadata_[table_id] = read_table_metadata(
-          storage_.get(), TableMetadata::descriptor_path(table_id));
-      it = table_metadata_.find(table_id);
-    }
-    const TableMetadata& table_meta = it->second;
+    std::shared_ptr<const TableMetadata> table_meta_ptr =
+        table_metadata(table_id);
+    const TableMetadata& table_meta = *table_meta_ptr;
+    bool packed = table_meta.packed_items();
 
     const google::protobuf::RepeatedField<i64>& sample_rows = sample.rows();
     std::vector<i64> rows(sample_rows.begin(), sample_rows.end());
@@ -248,37 +418,62 @@ std::tuple<IOItem, EvalWorkEntry> LoadWorker::execute(
           i64 item_start_row = intervals.item_start_offsets[i];
           const std::vector<i64>& valid_offsets = intervals.valid_offsets[i];
 
-          auto key = std::make_tuple(table_id, col_id, item_id);
-          if (index_.count(key) == 0) {
-            index_[key] =
-                read_video_index(storage_.get(), table_id, col_id, item_id);
+          std::shared_ptr<const VideoIndexEntry> entry =
+              video_index(table_id, col_id, item_id);
+          info = FrameInfo(entry->height, entry->width, entry->channels,
+                           entry->frame_type);
+          encoding_type = entry->codec_type;
+          if (eval_work_entry.frame_rate == 0) {
+            eval_work_entry.frame_rate = entry->frame_rate;
           }
-          const VideoIndexEntry& entry = index_.at(key);
-          info = FrameInfo(entry.height, entry.width, entry.channels,
-                           entry.frame_type);
-          encoding_type = entry.codec_type;
-          if (entry.codec_type == proto::VideoDescriptor::H264) {
-            // Video was encoded using h264
-            read_video_column(profiler_, entry, valid_offsets, item_start_row,
-                              eval_work_entry.columns[out_col_idx]);
+          if (entry->codec_type != proto::VideoDescriptor::RAW) {
+            // Video was encoded using h264 or hevc
+            reads.emplace_back(
+                out_col_idx, [this, entry, &valid_offsets, item_start_row,
+                              seek_cost](
+                                 storehouse::StorageBackend* storage,
+                                 ElementList& element_list) {
+                  // The cached entry may have been read by another thread
+                  VideoIndexEntry storage_entry = *entry;
+                  storage_entry.storage = storage;
+                  read_video_column(profiler_, storage_entry, valid_offsets,
+                                    item_start_row, element_list,
+                                    read_coalesce_gap_, mmap_reads_,
+                                    seek_cost);
+                });
           } else {
             // Video was encoded as individual images
-            i32 item_id = intervals.item_ids[i];
             i64 item_start;
             i64 item_end;
             std::tie(item_start, item_end) = intervals.item_intervals[i];
 
-            read_other_column(table_id, col_id, item_id, item_start, item_end,
-                              valid_offsets,
-                              eval_work_entry.columns[out_col_idx]);
+            reads.emplace_back(
+                out_col_idx,
+                [this, packed, table_id, col_id, item_id, item_start,
+                 item_end, &valid_offsets](storehouse::StorageBackend* storage,
+                                           ElementList& element_list) {
+                  read_other_column(storage, packed, Column::NONE, table_id,
+                                    col_id, item_id, item_start, item_end,
+                                    valid_offsets, element_list);
+                });
           }
         }
         assert(num_items > 0);
         eval_work_entry.frame_sizes.push_back(info);
         eval_work_entry.video_encoding_type.push_back(encoding_type);
+        eval_work_entry.direct_reads.push_back(false);
         media_col_idx++;
       } else {
         // regular column
+        Column::BlockCodec codec = table_meta.column_block_codec(col_id);
+        // Compressed columns must be decompressed on the host, and columns
+        // in remote storage can not be read by the pipelines directly
+        bool direct = direct_reads_ && codec == Column::NONE &&
+                      num_items > 0 &&
+                      !local_item_path(packed, table_id, col_id,
+                                       intervals.item_ids[0])
+                           .empty();
+        eval_work_entry.direct_reads.push_back(direct);
         for (size_t i = 0; i < num_items; ++i) {
           i32 item_id = intervals.item_ids[i];
           i64 item_start;
@@ -286,25 +481,227 @@ std::tuple<IOItem, EvalWorkEntry> LoadWorker::execute(
           std::tie(item_start, item_end) = intervals.item_intervals[i];
           const std::vector<i64>& valid_offsets = intervals.valid_offsets[i];
 
-          read_other_column(table_id, col_id, item_id, item_start,
-                            item_end, valid_offsets,
-                            eval_work_entry.columns[out_col_idx]);
+          if (direct) {
+            reads.emplace_back(
+                out_col_idx,
+                [this, packed, table_id, col_id, item_id, &valid_offsets](
+                    storehouse::StorageBackend* storage,
+                    ElementList& element_list) {
+                  read_direct_column(storage, packed, table_id, col_id,
+                                     item_id, valid_offsets, element_list);
+                });
+            continue;
+          }
+          reads.emplace_back(
+              out_col_idx,
+              [this, packed, codec, table_id, col_id, item_id, item_start,
+               item_end, &valid_offsets](storehouse::StorageBackend* storage,
+                                         ElementList& element_list) {
+                read_other_column(storage, packed, codec, table_id, col_id,
+                                  item_id, item_start, item_end,
+                                  valid_offsets, element_list);
+              });
         }
       }
       eval_work_entry.column_types.push_back(column_type);
       eval_work_entry.column_handles.push_back(CPU_DEVICE);
       out_col_idx++;
     }
+    // The reads refer to this sample's intervals, so run them before they
+    // go out of scope
+    run_reads(reads, eval_work_entry.columns);
+    reads.clear();
   }
 
   return std::make_tuple(io_item, eval_work_entry);
 }
 
+i64 LoadWorker::decoded_bytes(storehouse::StorageBackend* storage,
+                              const LoadWorkEntry& entry, i32 decode_width,
+                              i32 decode_height, bool nv12_frames) {
+  i64 bytes = 0;
+  for (const proto::LoadSample& sample : entry.samples()) {
+    std::shared_ptr<const TableMetadata> table_meta =
+        metadata_cache().table(storage, sample.table_id());
+    std::vector<i64> rows(sample.rows().begin(), sample.rows().end());
+    RowIntervals intervals = slice_into_row_intervals(*table_meta, rows);
+    for (i32 col_id : sample.column_ids()) {
+      if (table_meta->column_type(col_id) != ColumnType::Video) {
+        continue;
+      }
+      for (size_t i = 0; i < intervals.item_ids.size(); ++i) {
+        std::shared_ptr<const VideoIndexEntry> index =
+            metadata_cache().video_index(storage, sample.table_id(), col_id,
+                                         intervals.item_ids[i]);
+        // Same as in PreEvaluateWorker
+        i32 width = index->width;
+        i32 height = index->height;
+        if (decode_width > 0 && decode_height > 0 && decode_width <= width &&
+            decode_height <= height) {
+          width = std::max(decode_width / 2 * 2, 2);
+          height = std::max(decode_height / 2 * 2, 2);
+        }
+        FrameLayout layout = FrameLayout::HWC;
+        if (nv12_frames && width % 2 == 0 && height % 2 == 0) {
+          layout = FrameLayout::NV12;
+        }
+        FrameInfo info(height, width, 3, FrameType::U8, layout);
+        bytes += (i64)info.size() * intervals.valid_offsets[i].size();
+      }
+    }
+  }
+  return bytes;
+}
+
+i64 LoadWorker::prefetch(const LoadWorkEntry& entry, i64 max_bytes) {
+  if (!block_cache_enabled()) {
+    return 0;
+  }
+  i64 requested_bytes = 0;
+  // Opens the item through the cache and warms the given byte ranges
+  auto prefetch_ranges = [&](bool packed, i32 table_id, i32 column_id,
+                             i32 item_id,
+                             const std::vector<std::tuple<u64, u64>>& ranges) {
+    std::unique_ptr<RandomReadFile> file;
+    if (open_item_file(storage_.get(), packed, table_id, column_id, item_id,
+                       file, &profiler_) != StoreResult::Success) {
+      return;
+    }
+    // Columns of packed items are a range of the cached packed file
+    u64 file_start = 0;
+    RandomReadFile* base_file = file.get();
+    if (auto view = dynamic_cast<ItemFileView*>(file.get())) {
+      file_start = view->start();
+      base_file = view->file();
+    }
+    auto cached_file = dynamic_cast<CachedRandomReadFile*>(base_file);
+    for (auto& range : ranges) {
+      u64 start = file_start + std::get<0>(range);
+      u64 end = file_start + std::get<1>(range);
+      if (requested_bytes > max_bytes || cached_file == nullptr) {
+        return;
+      }
+      cached_file->prefetch(start, end - start);
+      requested_bytes += end - start;
+    }
+  };
+
+  auto prefetch_start = now();
+  f64 seek_cost = decode_cost_model(decoder_type_).seek_cost();
+  for (const proto::LoadSample& sample : entry.samples()) {
+    i32 table_id = sample.table_id();
+    std::shared_ptr<const TableMetadata> table_meta_ptr =
+        table_metadata(table_id);
+    const TableMetadata& table_meta = *table_meta_ptr;
+    bool packed = table_meta.packed_items();
+    std::vector<i64> rows(sample.rows().begin(), sample.rows().end());
+    if (rows.empty()) {
+      continue;
+    }
+    RowIntervals intervals = slice_into_row_intervals(table_meta, rows);
+    for (i32 col_id : sample.column_ids()) {
+      for (size_t i = 0; i < intervals.item_ids.size(); ++i) {
+        if (requested_bytes > max_bytes) {
+          break;
+        }
+        i32 item_id = intervals.item_ids[i];
+        const std::vector<i64>& valid_offsets = intervals.valid_offsets[i];
+        std::vector<std::tuple<u64, u64>> ranges;
+        std::shared_ptr<const VideoIndexEntry> index_entry;
+        if (table_meta.column_type(col_id) == ColumnType::Video) {
+          index_entry = video_index(table_id, col_id, item_id);
+          // Byte ranges of videos ingested in place are not ranges of their
+          // item file
+          if (index_entry->source) {
+            continue;
+          }
+        }
+        if (index_entry &&
+            index_entry->codec_type != proto::VideoDescriptor::RAW) {
+          VideoIntervals video_intervals = split_keyframe_only_intervals(
+              *index_entry,
+              slice_into_video_intervals(index_entry->keyframe_positions,
+                                         valid_offsets, seek_cost));
+          for (size_t v = 0; v < video_intervals.valid_frames.size(); ++v) {
+            ranges.push_back(
+                video_interval_byte_range(*index_entry, video_intervals, v));
+          }
+        } else {
+          std::unique_ptr<RandomReadFile> file;
+          if (open_item_file(storage_.get(), packed, table_id, col_id,
+                             item_id, file,
+                             &profiler_) != StoreResult::Success) {
+            continue;
+          }
+          ItemFileHeader header = read_item_file_header(file.get());
+          i64 item_start;
+          i64 item_end;
+          std::tie(item_start, item_end) = intervals.item_intervals[i];
+          if (table_meta.column_block_codec(col_id) != Column::NONE) {
+            // Offsets are into the decompressed data, so warm all blocks
+            u64 file_size = 0;
+            if (file->get_size(file_size) == StoreResult::Success) {
+              ranges.emplace_back(header.data_start, file_size);
+            }
+          } else {
+            ranges.emplace_back(
+                header.data_start + header.element_offsets[item_start],
+                header.data_start + header.element_offsets[item_end]);
+          }
+        }
+        prefetch_ranges(packed, table_id, col_id, item_id, ranges);
+      }
+    }
+  }
+  profiler_.add_interval("prefetch", prefetch_start, now());
+  profiler_.increment("prefetch_bytes", requested_bytes);
+  return requested_bytes;
+}
+
+std::shared_ptr<const TableMetadata> LoadWorker::table_metadata(
+    i32 table_id) {
+  return metadata_cache().table(storage_.get(), table_id);
+}
+
+std::shared_ptr<const VideoIndexEntry> LoadWorker::video_index(
+    i32 table_id, i32 column_id, i32 item_id) {
+  return metadata_cache().video_index(storage_.get(), table_id, column_id,
+                                      item_id);
+}
+
+void LoadWorker::run_reads(const std::vector<std::tuple<i32, ReadTask>>& reads,
+                           std::vector<ElementList>& columns) {
+  if (!read_pool_ || reads.size() <= 1) {
+    for (auto& read : reads) {
+      std::get<1>(read)(storage_.get(), columns[std::get<0>(read)]);
+    }
+    return;
+  }
+  auto read_start = now();
+  std::vector<ElementList> results(reads.size());
+  for (size_t i = 0; i < reads.size(); ++i) {
+    const ReadTask& task = std::get<1>(reads[i]);
+    ElementList& result = results[i];
+    read_pool_->submit([this, &task, &result](i32 thread_id) {
+      // Charge buffers allocated on pool threads to the load stage
+      MemoryTagScope memory_tag(read_memory_tag_);
+      task(read_storage_[thread_id].get(), result);
+    });
+  }
+  read_pool_->wait_idle();
+  for (size_t i = 0; i < reads.size(); ++i) {
+    ElementList& column = columns[std::get<0>(reads[i])];
+    column.insert(column.end(), results[i].begin(), results[i].end());
+  }
+  profiler_.add_interval("parallel_read", read_start, now());
+  profiler_.increment("parallel_reads", reads.size());
+}
+
 void read_video_column(Profiler& profiler,
                        const VideoIndexEntry& index_entry,
                        const std::vector<i64>& rows, i64 start_frame,
-                       ElementList& element_list) {
-  std::unique_ptr<RandomReadFile> video_file = index_entry.open_file();
+                       ElementList& element_list, i64 read_coalesce_gap,
+                       bool mmap_reads, f64 seek_cost) {
   u64 file_size = index_entry.file_size;
   const std::vector<i64>& keyframe_positions = index_entry.keyframe_positions;
   const std::vector<i64>& keyframe_byte_offsets =
@@ -315,75 +712,160 @@ void read_video_column(Profiler& profiler,
   // the bytes starting at the iframe at or preceding the first frame
   // we are interested and will continue up to the bytes before the
   // iframe at or after the last frame we are interested in.
-  VideoIntervals intervals =
-      slice_into_video_intervals(keyframe_positions, rows);
+  VideoIntervals intervals = split_keyframe_only_intervals(
+      index_entry,
+      slice_into_video_intervals(keyframe_positions, rows, seek_cost));
   size_t num_intervals = intervals.keyframe_index_intervals.size();
-  for (size_t i = 0; i < num_intervals; ++i) {
-    size_t start_keyframe_index;
-    size_t end_keyframe_index;
-    std::tie(start_keyframe_index, end_keyframe_index) =
-        intervals.keyframe_index_intervals[i];
 
-    u64 start_keyframe_byte_offset =
-        static_cast<u64>(keyframe_byte_offsets[start_keyframe_index]);
-    u64 end_keyframe_byte_offset =
-        static_cast<u64>(keyframe_byte_offsets[end_keyframe_index]);
+  // Every interval holds one reference to the mapping, if there is one
+  u8* mapped_file = nullptr;
+  std::unique_ptr<RandomReadFile> video_file;
+  if (index_entry.packed) {
+    // Needed to locate the column within the packed file
+    video_file = index_entry.open_file(&profiler);
+  }
+  // Videos ingested in place are produced from their source as they are read
+  if (mmap_reads && !index_entry.source) {
+    mapped_file = map_item_column(index_entry.packed, video_file.get(),
+                                  index_entry.table_id, index_entry.column_id,
+                                  index_entry.item_id, file_size,
+                                  num_intervals);
+  }
+  if (mapped_file == nullptr && !video_file) {
+    video_file = index_entry.open_file(&profiler);
+  }
 
-    i64 start_keyframe = keyframe_positions[start_keyframe_index];
-    i64 end_keyframe = keyframe_positions[end_keyframe_index];
-    std::vector<i64> all_keyframes;
-    for (size_t i = start_keyframe_index; i < end_keyframe_index + 1; ++i) {
-      all_keyframes.push_back(keyframe_positions[i]);
+  // Group intervals whose byte ranges are close enough that reading the gap
+  // between them is cheaper than issuing another read
+  struct ReadGroup {
+    u64 start;
+    u64 end;
+    size_t first_interval;
+    size_t num_intervals;
+  };
+  std::vector<ReadGroup> groups;
+  i64 keyframe_only_intervals = 0;
+  for (size_t i = 0; i < num_intervals; ++i) {
+    u64 start;
+    u64 end;
+    std::tie(start, end) = video_interval_byte_range(index_entry, intervals, i);
+    keyframe_only_intervals += intervals.keyframe_only[i] ? 1 : 0;
+    if (!groups.empty()) {
+      ReadGroup& group = groups.back();
+      if (start >= group.start && start <= group.end + read_coalesce_gap) {
+        group.end = std::max(group.end, end);
+        group.num_intervals++;
+        continue;
+      }
     }
+    groups.push_back(ReadGroup{start, end, i, 1});
+  }
 
-    std::vector<i64> all_keyframes_byte_offsets;
-    for (size_t i = start_keyframe_index; i < end_keyframe_index + 1; ++i) {
-      all_keyframes_byte_offsets.push_back(keyframe_byte_offsets[i] -
-                                           start_keyframe_byte_offset);
+  for (const ReadGroup& group : groups) {
+    size_t read_size = group.end - group.start;
+    u8* read_buffer;
+    if (mapped_file != nullptr) {
+      read_buffer = mapped_file + group.start;
+      prefetch_mapped_range(mapped_file, group.start, group.end);
+      profiler.increment("io_mapped", static_cast<i64>(read_size));
+    } else {
+      // Each element frees its own slice, so slices of a shared read need a
+      // block buffer with one reference per slice
+      read_buffer =
+          group.num_intervals == 1
+              ? new_buffer(CPU_DEVICE, read_size)
+              : new_block_buffer(CPU_DEVICE, read_size, group.num_intervals);
+
+      auto io_start = now();
+
+      u64 pos = group.start;
+      s_read(video_file.get(), read_buffer, read_size, pos);
+
+      profiler.add_interval("io", io_start, now());
+      profiler.increment("io_read", static_cast<i64>(read_size));
     }
 
-    size_t buffer_size = end_keyframe_byte_offset - start_keyframe_byte_offset;
-    u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-
-    auto io_start = now();
-
-    u64 pos = start_keyframe_byte_offset;
-    s_read(video_file.get(), buffer, buffer_size, pos);
-
-    profiler.add_interval("io", io_start, now());
-    profiler.increment("io_read", static_cast<i64>(buffer_size));
+    size_t used_size = 0;
+    for (size_t i = group.first_interval;
+         i < group.first_interval + group.num_intervals; ++i) {
+      size_t start_keyframe_index;
+      size_t end_keyframe_index;
+      std::tie(start_keyframe_index, end_keyframe_index) =
+          intervals.keyframe_index_intervals[i];
+
+      u64 start_keyframe_byte_offset;
+      u64 end_keyframe_byte_offset;
+      std::tie(start_keyframe_byte_offset, end_keyframe_byte_offset) =
+          video_interval_byte_range(index_entry, intervals, i);
+
+      std::vector<i64> all_keyframes;
+      for (size_t k = start_keyframe_index; k < end_keyframe_index + 1; ++k) {
+        all_keyframes.push_back(keyframe_positions[k]);
+      }
 
-    proto::DecodeArgs decode_args;
-    decode_args.set_width(index_entry.width);
-    decode_args.set_height(index_entry.height);
-    // We add the start frame of this item to all frames since the decoder
-    // works in terms of absolute frame numbers, instead of item relative
-    // frame numbers
-    decode_args.set_start_keyframe(keyframe_positions[start_keyframe_index] +
+      std::vector<i64> all_keyframes_byte_offsets;
+      for (size_t k = start_keyframe_index; k < end_keyframe_index + 1; ++k) {
+        all_keyframes_byte_offsets.push_back(keyframe_byte_offsets[k] -
+                                             start_keyframe_byte_offset);
+      }
+      // The buffer ends after the keyframe packet
+      all_keyframes_byte_offsets.back() =
+          end_keyframe_byte_offset - start_keyframe_byte_offset;
+
+      size_t buffer_size =
+          end_keyframe_byte_offset - start_keyframe_byte_offset;
+      u8* buffer = read_buffer + (start_keyframe_byte_offset - group.start);
+      used_size += buffer_size;
+
+      u8* decode_args_buffer =
+          new_buffer(CPU_DEVICE, sizeof(proto::DecodeArgs));
+      proto::DecodeArgs& decode_args =
+          *new (decode_args_buffer) proto::DecodeArgs();
+      decode_args.set_width(index_entry.width);
+      decode_args.set_height(index_entry.height);
+      // We add the start frame of this item to all frames since the decoder
+      // works in terms of absolute frame numbers, instead of item relative
+      // frame numbers
+      decode_args.set_start_keyframe(keyframe_positions[start_keyframe_index] +
+                                     start_frame);
+      decode_args.set_end_keyframe(keyframe_positions[end_keyframe_index] +
                                    start_frame);
-    decode_args.set_end_keyframe(keyframe_positions[end_keyframe_index] +
-                                 start_frame);
-    for (i64 k : all_keyframes) {
-      decode_args.add_keyframes(k + start_frame);
-    }
-    for (i64 k : all_keyframes_byte_offsets) {
-      decode_args.add_keyframe_byte_offsets(k);
+      for (i64 k : all_keyframes) {
+        decode_args.add_keyframes(k + start_frame);
+      }
+      for (i64 k : all_keyframes_byte_offsets) {
+        decode_args.add_keyframe_byte_offsets(k);
+      }
+      for (size_t j = 0; j < intervals.valid_frames[i].size(); ++j) {
+        decode_args.add_valid_frames(intervals.valid_frames[i][j] +
+                                     start_frame);
+      }
+      decode_args.set_encoded_video((i64)buffer);
+      decode_args.set_encoded_video_size(buffer_size);
+      insert_element(element_list, decode_args_buffer,
+                     sizeof(proto::DecodeArgs));
     }
-    for (size_t j = 0; j < intervals.valid_frames[i].size(); ++j) {
-      decode_args.add_valid_frames(intervals.valid_frames[i][j] + start_frame);
+    // Bytes read only to bridge the gaps between intervals
+    if (mapped_file == nullptr && used_size < read_size) {
+      profiler.increment("io_read_gap",
+                         static_cast<i64>(read_size - used_size));
     }
-    decode_args.set_encoded_video((i64)buffer);
-    decode_args.set_encoded_video_size(buffer_size);
-
-    size_t size = decode_args.ByteSizeLong();
-    u8* decode_args_buffer = new_buffer(CPU_DEVICE, size);
-    bool result = decode_args.SerializeToArray(decode_args_buffer, size);
-    assert(result);
-    insert_element(element_list, decode_args_buffer, size);
   }
+  profiler.increment("keyframe_only_intervals", keyframe_only_intervals);
 }
 
-void LoadWorker::read_other_column(i32 table_id, i32 column_id, i32 item_id,
+void take_decode_args(Element& element, proto::DecodeArgs& args) {
+  assert(element.size == sizeof(proto::DecodeArgs));
+  proto::DecodeArgs* element_args = (proto::DecodeArgs*)element.buffer;
+  args.Swap(element_args);
+  element_args->~DecodeArgs();
+  delete_element(CPU_DEVICE, element);
+}
+
+void LoadWorker::read_other_column(storehouse::StorageBackend* storage,
+                                   bool packed,
+                                   proto::Column::BlockCodec codec,
+                                   i32 table_id, i32 column_id, i32 item_id,
                                    i32 item_start, i32 item_end,
                                    const std::vector<i64>& rows,
                                    ElementList& element_list) {
@@ -391,43 +873,78 @@ void LoadWorker::read_other_column(i32 table_id, i32 column_id, i32 item_id,
 
   std::unique_ptr<RandomReadFile> file;
   StoreResult result;
-  BACKOFF_FAIL(make_unique_random_read_file(
-      storage_.get(), table_item_output_path(table_id, column_id, item_id),
-      file));
+  STORE_CHECK(open_item_file(storage, packed, table_id, column_id, item_id,
+                             file, &profiler_));
 
   u64 file_size = 0;
-  BACKOFF_FAIL(file->get_size(file_size));
-
-  // Read number of elements in file
-  u64 pos = 0;
-  u64 num_elements = s_read<u64>(file.get(), pos);
-
-  // Read element sizes from work item file header
-  std::vector<i64> element_sizes(num_elements);
-  s_read(file.get(), reinterpret_cast<u8*>(element_sizes.data()),
-         element_sizes.size() * sizeof(i64), pos);
+  STORE_CHECK(file->get_size(file_size));
+
+  ItemFileHeader header = read_item_file_header(file.get());
+  u64 pos = header.data_start;
+
+  if (codec != Column::NONE) {
+    // Element offsets are into the decompressed data, so every element is
+    // copied out of the blocks that cover it
+    CompressedItemReader reader(file.get(), codec, header.data_start);
+    bool sparse =
+        (item_end - item_start) / rows.size() >= load_sparsity_threshold_;
+    if (sparse) {
+      for (i64 row : valid_offsets) {
+        size_t buffer_size = static_cast<size_t>(header.element_size(row));
+        u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
+        reader.read(header.element_offsets[row],
+                    header.element_offsets[row + 1], buffer);
+        insert_element(element_list, buffer, buffer_size);
+      }
+    } else {
+      u64 start_offset = header.element_offsets[item_start];
+      u64 end_offset = header.element_offsets[item_end];
+      std::vector<u8> element_data(end_offset - start_offset);
+      reader.read(start_offset, end_offset, element_data.data());
+      for (i64 row : valid_offsets) {
+        size_t buffer_size = static_cast<size_t>(header.element_size(row));
+        u64 offset = header.element_offsets[row] - start_offset;
+        u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
+        memcpy(buffer, element_data.data() + offset, buffer_size);
+        insert_element(element_list, buffer, buffer_size);
+      }
+    }
+    profiler_.increment("io_compressed_read", reader.bytes_read());
+    return;
+  }
 
-  // Determine start and end position of elements to read in file
-  u64 start_offset = 0;
-  for (i64 i = 0; i < item_start; ++i) {
-    start_offset += element_sizes[i];
+  // Elements of a local file point straight into a mapping of it, which
+  // each element holds a reference to
+  u8* mapped_file = nullptr;
+  if (mmap_reads_) {
+    mapped_file = map_item_column(packed, file.get(), table_id, column_id,
+                                  item_id, file_size, valid_offsets.size());
   }
-  u64 end_offset = start_offset;
-  for (i64 i = item_start; i < item_end; ++i) {
-    end_offset += element_sizes[i];
+  if (mapped_file != nullptr) {
+    u64 start = pos + header.element_offsets[item_start];
+    u64 end = pos + header.element_offsets[item_end];
+    prefetch_mapped_range(mapped_file, start, end);
+    for (i64 row : valid_offsets) {
+      size_t buffer_size = static_cast<size_t>(header.element_size(row));
+      u8* buffer = mapped_file + pos + header.element_offsets[row];
+      insert_element(element_list, buffer, buffer_size);
+    }
+    profiler_.increment("io_mapped", static_cast<i64>(end - start));
+    return;
   }
 
+  // Determine start and end position of elements to read in file
+  u64 start_offset = header.element_offsets[item_start];
+  u64 end_offset = header.element_offsets[item_end];
+
   // If the requested elements are sufficiently sparse by some threshold, we
   // read each element individually. Otherwise, we read the entire block and
   // copy out only the necessary elements.
   if ((item_end - item_start) / rows.size() >= load_sparsity_threshold_) {
     for (i32 row : rows) {
-      size_t buffer_size = static_cast<size_t>(element_sizes[row]);
+      size_t buffer_size = static_cast<size_t>(header.element_size(row));
       u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-      u64 row_offset = pos + start_offset;
-      for (i32 i = item_start; i < row; ++i) {
-        row_offset += element_sizes[i];
-      }
+      u64 row_offset = pos + header.element_offsets[row];
       s_read(file.get(), buffer, buffer_size, row_offset);
       insert_element(element_list, buffer, buffer_size);
     }
@@ -441,21 +958,47 @@ void LoadWorker::read_other_column(i32 table_id, i32 column_id, i32 item_id,
     s_read(file.get(), element_data.data(), element_data.size(), pos);
 
     // Extract individual elements and insert into output work entry
-    u64 offset = 0;
-    size_t valid_idx = 0;
-    for (i32 i = item_start; i < item_end; ++i) {
-      size_t buffer_size = static_cast<size_t>(element_sizes[i]);
-      if (i == valid_offsets[valid_idx]) {
-        u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
-        memcpy(buffer, element_data.data() + offset, buffer_size);
-        insert_element(element_list, buffer, buffer_size);
-        valid_idx++;
-      }
-      offset += buffer_size;
+    for (i64 row : valid_offsets) {
+      size_t buffer_size = static_cast<size_t>(header.element_size(row));
+      u64 offset = header.element_offsets[row] - start_offset;
+      u8* buffer = new_buffer(CPU_DEVICE, buffer_size);
+      memcpy(buffer, element_data.data() + offset, buffer_size);
+      insert_element(element_list, buffer, buffer_size);
     }
-    assert(valid_idx == valid_offsets.size());
   }
 }
 
+void LoadWorker::read_direct_column(storehouse::StorageBackend* storage,
+                                    bool packed, i32 table_id,
+                                    i32 column_id, i32 item_id,
+                                    const std::vector<i64>& rows,
+                                    ElementList& element_list) {
+  std::unique_ptr<RandomReadFile> file;
+  StoreResult result;
+  STORE_CHECK(open_item_file(storage, packed, table_id, column_id, item_id,
+                             file, &profiler_));
+  ItemFileHeader header = read_item_file_header(file.get());
+  u64 pos = header.data_start;
+  if (packed) {
+    auto view = dynamic_cast<ItemFileView*>(file.get());
+    assert(view != nullptr);
+    pos += view->start();
+  }
+  std::string path = item_file_path(
+      table_id, packed ? table_item_packed_path(table_id, item_id)
+                       : table_item_output_path(table_id, column_id, item_id));
+  for (i64 row : rows) {
+    proto::DirectReadArgs args;
+    args.set_path(path);
+    args.set_offset(pos + header.element_offsets[row]);
+    args.set_size(header.element_size(row));
+
+    size_t size = args.ByteSizeLong();
+    u8* args_buffer = new_buffer(CPU_DEVICE, size);
+    bool serialized = args.SerializeToArray(args_buffer, size);
+    assert(serialized);
+    insert_element(element_list, args_buffer, size);
+  }
+}
 }
 }
@@ -19,6 +19,8 @@
 #include "scanner/engine/video_index_entry.h"
 #include "scanner/util/common.h"
 #include "scanner/util/queue.h"
+#include "scanner/util/thread_pool.h"
+#include "scanner/video/video_decoder.h"
 
 namespace scanner {
 namespace internal {
@@ -31,6 +33,12 @@ struct LoadWorkerArgs {
   storehouse::StorageConfig* storage_config;
   Profiler& profiler;
   i32 load_sparsity_threshold;
+  i64 read_coalesce_gap;
+  i32 read_parallelism;
+  bool mmap_reads;
+  bool direct_reads;
+  // Decoder the pipelines decode with, whose cost model decides when to seek
+  VideoDecoderType decoder_type;
 };
 
 class LoadWorker {
@@ -40,28 +48,95 @@ class LoadWorker {
   std::tuple<IOItem, EvalWorkEntry> execute(
       std::tuple<IOItem, LoadWorkEntry>& entry);
 
+  //! Reads the bytes that executing entry will need into the block cache,
+  //! stopping once more than max_bytes have been requested, so that the
+  //! later execute is served from memory. Returns the bytes requested.
+  i64 prefetch(const LoadWorkEntry& entry, i64 max_bytes);
+
+  //! Estimates the bytes of the frames that decoding the video columns of
+  //! entry will hold, from the FrameInfo of each item and its number of
+  //! rows, so that the item can wait until the memory pool has room for
+  //! them. Frames are sized as the pre-evaluate stage decodes them.
+  static i64 decoded_bytes(storehouse::StorageBackend* storage,
+                           const LoadWorkEntry& entry, i32 decode_width,
+                           i32 decode_height, bool nv12_frames);
+
  private:
-  void read_other_column(i32 table_id, i32 column_id, i32 item_id,
-                         i32 item_start, i32 item_end,
-                         const std::vector<i64>& rows,
+  std::shared_ptr<const TableMetadata> table_metadata(i32 table_id);
+
+  std::shared_ptr<const VideoIndexEntry> video_index(i32 table_id,
+                                                     i32 column_id,
+                                                     i32 item_id);
+
+  //! Reads one item of one column into element_list using storage.
+  using ReadTask = std::function<void(storehouse::StorageBackend* storage,
+                                      ElementList& element_list)>;
+
+  //! Runs every read of an io item, in parallel if a read pool exists, and
+  //! appends the results to each read's column in the order they were
+  //! added.
+  void run_reads(const std::vector<std::tuple<i32, ReadTask>>& reads,
+                 std::vector<ElementList>& columns);
+
+  //! Reads rows of an item of a column, decompressing its element data
+  //! if the column has a block codec.
+  void read_other_column(storehouse::StorageBackend* storage, bool packed,
+                         proto::Column::BlockCodec codec, i32 table_id,
+                         i32 column_id, i32 item_id, i32 item_start,
+                         i32 item_end, const std::vector<i64>& rows,
                          ElementList& element_list);
+
+  //! Describes where the bytes of rows of an uncompressed item of a column
+  //! are in the local file that holds them, as a DirectReadArgs per row,
+  //! for the pre-evaluate stage to read into the memory of its device.
+  void read_direct_column(storehouse::StorageBackend* storage, bool packed,
+                          i32 table_id, i32 column_id, i32 item_id,
+                          const std::vector<i64>& rows,
+                          ElementList& element_list);
+
   const i32 node_id_;
   const i32 worker_id_;
   Profiler& profiler_;
   // Setup a distinct storage backend for each IO thread
   std::unique_ptr<storehouse::StorageBackend> storage_;
-  // Caching table metadata
-  std::map<i32, TableMetadata> table_metadata_;
-  // To ammortize opening files
-  i32 last_table_id_ = -1;
-  std::map<std::tuple<i32, i32, i32>, VideoIndexEntry> index_;
   i32 load_sparsity_threshold_;
-
+  i64 read_coalesce_gap_;
+  bool mmap_reads_;
+  bool direct_reads_;
+  VideoDecoderType decoder_type_;
+  // Issues the reads of an io item concurrently, each pool thread with its
+  // own storage backend
+  std::unique_ptr<WorkStealingPool> read_pool_;
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> read_storage_;
+  i32 read_memory_tag_ = 0;
 };
 
+//! Reads the keyframe intervals of the video needed to decode rows. Each
+//! element holds the proto::DecodeArgs of an interval, which
+//! take_decode_args moves out.
+//!
+//! Intervals whose byte ranges are at most read_coalesce_gap bytes apart are
+//! fetched with a single read, so the encoded video of every interval of
+//! such a group points into one shared block buffer.
+//!
+//! If mmap_reads is set and the video is a file on local disk, the encoded
+//! video points directly into a mapping of the file instead.
+//!
+//! A new interval is started at the keyframe before a row only if that skips
+//! decoding more than seek_cost frames.
 void read_video_column(Profiler& profiler,
                        const VideoIndexEntry& index_entry,
                        const std::vector<i64>& rows, i64 start_offset,
-                       ElementList& element_list);
+                       ElementList& element_list, i64 read_coalesce_gap = 0,
+                       bool mmap_reads = false, f64 seek_cost = 0);
+
+//! Moves the decode args out of an element of read_video_column into args,
+//! and frees the element.
+//
+// The args are built in place in the element's buffer rather than
+// serialized into it, since the element never leaves the process. This
+// saves a serialize and parse per interval, which adds up for sparse
+// samples with thousands of intervals per item.
+void take_decode_args(Element& element, proto::DecodeArgs& args);
 }
 }
@@ -15,17 +15,162 @@
 
 #include "scanner/engine/master.h"
 #include <grpc/support/log.h>
+#include <algorithm>
+#include <cmath>
 #include <mutex>
 #include "scanner/engine/ingest.h"
 #include "scanner/engine/sampler.h"
+#include "scanner/engine/vector_index.h"
+#include "scanner/util/block_codec.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/metrics.h"
 #include "scanner/util/progress_bar.h"
+#include "scanner/util/thread_pool.h"
 #include "scanner/util/util.h"
 namespace scanner {
 namespace internal {
 namespace {
+// Target amount of work, in seconds, granted to a worker per lease
+const f64 LEASE_TARGET_SECONDS = 2.0;
+// Weight given to the newest sample when estimating worker throughput
+const f64 LEASE_RATE_SMOOTHING = 0.5;
+// An item is considered a straggler once it has been running this many times
+// longer than the average item
+const f64 STRAGGLER_SLOWDOWN_FACTOR = 1.5;
+// Maximum number of workers concurrently assigned the same item
+const size_t MAX_ITEM_COPIES = 2;
+// Workers that do not answer a heartbeat within this time are considered dead
+const i64 WORKER_HEARTBEAT_TIMEOUT_MS = 5000;
+// Batches of videos handed to a worker per ingest request. Several batches
+// per worker let faster workers take more of them.
+const size_t INGEST_BATCHES_PER_WORKER = 4;
+const size_t MAX_INGEST_BATCH_SIZE = 64;
+// Tasks whose samplers are built ahead of the one handing out items
+const i64 TASK_SAMPLER_LOOKAHEAD = 64;
+// Time a worker that registers during a job has to start serving before it
+// is left out of the job
+const i64 WORKER_JOIN_TIMEOUT_S = 30;
+// Items sampled ahead of the one handed out, among which a worker is given
+// one whose inputs it read recently
+const size_t LOCALITY_LOOKAHEAD = 64;
+// Times an item may be passed over for items whose inputs the asking worker
+// has cached, before it is handed to whichever worker asks next
+const i32 LOCALITY_MAX_SKIPS = 8;
+// Input items remembered as read per worker, about what its caches hold
+const size_t LOCALITY_TRACKED_ITEMS = 4096;
+// Time between passes deleting the files of removed tables
+const i64 GC_INTERVAL_MS = 10000;
+// Threads deleting files, and the files each of their tasks deletes. Object
+// stores take about as long to delete a file as to read a small one, so
+// many deletes are kept in flight.
+const i32 GC_THREADS = 32;
+const size_t GC_BATCH_SIZE = 64;
+
+// Input items, as (table id, item id), which an io item reads
+std::vector<std::tuple<i32, i64>> item_inputs(
+    const std::map<i32, std::vector<i64>>& input_end_rows,
+    const proto::NewWork& work) {
+  std::vector<std::tuple<i32, i64>> inputs;
+  for (auto& sample : work.load_work().samples()) {
+    auto end_rows_it = input_end_rows.find(sample.table_id());
+    if (end_rows_it == input_end_rows.end()) {
+      continue;
+    }
+    const std::vector<i64>& end_rows = end_rows_it->second;
+    i64 last_item = -1;
+    for (i64 row : sample.rows()) {
+      i64 item = std::upper_bound(end_rows.begin(), end_rows.end(), row) -
+                 end_rows.begin();
+      if (item != last_item) {
+        inputs.emplace_back(sample.table_id(), item);
+        last_item = item;
+      }
+    }
+  }
+  std::sort(inputs.begin(), inputs.end());
+  inputs.erase(std::unique(inputs.begin(), inputs.end()), inputs.end());
+  return inputs;
+}
+
+// Whether each column of the input op is read by an op. A sample none of
+// whose columns are read keeps its first one, which gives the rows of its
+// items. All columns are kept if the tasks sample different columns.
+std::vector<bool> used_input_columns(const proto::TaskSet& task_set) {
+  auto& input_columns = task_set.ops(0).inputs(0).columns();
+  if (task_set.tasks_size() == 0) {
+    return std::vector<bool>(input_columns.size(), true);
+  }
+  std::vector<bool> used(input_columns.size(), false);
+  for (i32 i = 1; i < task_set.ops_size(); ++i) {
+    for (auto& input : task_set.ops(i).inputs()) {
+      if (input.op_index() != 0) {
+        continue;
+      }
+      for (const std::string& column : input.columns()) {
+        for (i32 c = 0; c < input_columns.size(); ++c) {
+          if (input_columns.Get(c) == column) {
+            used[c] = true;
+          }
+        }
+      }
+    }
+  }
+
+  auto& samples = task_set.tasks(0).samples();
+  for (auto& task : task_set.tasks()) {
+    bool same = task.samples_size() == samples.size();
+    for (i32 s = 0; same && s < samples.size(); ++s) {
+      same = task.samples(s).column_names_size() ==
+             samples.Get(s).column_names_size();
+    }
+    if (!same) {
+      return std::vector<bool>(input_columns.size(), true);
+    }
+  }
+  size_t offset = 0;
+  for (auto& sample : samples) {
+    size_t end = offset + sample.column_names_size();
+    if (end > used.size()) {
+      return std::vector<bool>(input_columns.size(), true);
+    }
+    if (std::find(used.begin() + offset, used.begin() + end, true) ==
+        used.begin() + end) {
+      used[offset] = true;
+    }
+    offset = end;
+  }
+  return used;
+}
+
+// Removes the input columns that are not used from the input op and the
+// samples of the tasks, so that they are not loaded
+void prune_input_columns(proto::TaskSet& task_set,
+                         const std::vector<bool>& used) {
+  auto& input_columns =
+      *task_set.mutable_ops(0)->mutable_inputs(0)->mutable_columns();
+  google::protobuf::RepeatedPtrField<std::string> kept_columns;
+  for (i32 c = 0; c < input_columns.size(); ++c) {
+    if (used[c]) {
+      *kept_columns.Add() = input_columns.Get(c);
+    }
+  }
+  input_columns.Swap(&kept_columns);
+  for (proto::Task& task : *task_set.mutable_tasks()) {
+    size_t offset = 0;
+    for (proto::TableSample& sample : *task.mutable_samples()) {
+      google::protobuf::RepeatedPtrField<std::string> kept;
+      for (const std::string& name : sample.column_names()) {
+        if (used[offset++]) {
+          *kept.Add() = name;
+        }
+      }
+      sample.mutable_column_names()->Swap(&kept);
+    }
+  }
+}
+
 void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
-                       Result* result) {
+                       bool resume, Result* result) {
   auto& tasks = task_set.tasks();
   // Validate tasks
   std::set<std::string> task_output_table_names;
@@ -35,7 +180,7 @@ void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
                       "tables can not have empty names";
       result->set_success(false);
     }
-    if (meta.has_table(task.output_table_name())) {
+    if (!resume && meta.has_table(task.output_table_name())) {
       LOG(WARNING) << "Task specified with duplicate output table name. "
                    << "A table with name " << task.output_table_name() << " "
                    << "already exists.";
@@ -48,6 +193,19 @@ void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
       result->set_success(false);
     }
     task_output_table_names.insert(task.output_table_name());
+    for (auto& name : task.shared_output_table_names()) {
+      if (meta.has_table(name) || task_output_table_names.count(name) > 0) {
+        LOG(WARNING) << "Task specified shared output table " << name
+                     << " which already exists or is output by another task";
+        result->set_success(false);
+      }
+      task_output_table_names.insert(name);
+    }
+    if (task.shared_output_table_names_size() > 0 && resume) {
+      LOG(WARNING) << "Task " << task.output_table_name() << " has shared "
+                   << "output tables, which can not be resumed";
+      result->set_success(false);
+    }
     if (task.samples().size() == 0) {
       LOG(WARNING) << "Task " << task.output_table_name() << " did not "
                    << "specify any tables to sample from. Tasks must sample "
@@ -81,6 +239,9 @@ void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
     i32 op_idx = 0;
     std::vector<std::string> op_names;
     std::vector<std::vector<std::string>> op_outputs;
+    bool after_filter = false;
+    // Whether the ops reading each input column read motion vectors
+    std::map<std::string, std::set<bool>> motion_vector_readers;
     for (auto& op : task_set.ops()) {
       op_names.push_back(op.name());
 
@@ -128,7 +289,13 @@ void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
           std::string& input_op_name = op_names.at(input.op_index());
           std::vector<std::string>& inputs = op_outputs.at(input.op_index());
           input_count += input.columns().size();
+          bool motion_vectors =
+              op.name() != "OutputTable" && op_registry->has_op(op.name()) &&
+              op_registry->get_op_info(op.name())->motion_vector_inputs();
           for (auto& col : input.columns()) {
+            if (input.op_index() == 0) {
+              motion_vector_readers[col].insert(motion_vectors);
+            }
             bool found = false;
             for (auto& out_col : inputs) {
               if (col == out_col) {
@@ -177,17 +344,57 @@ void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
               op.name().c_str(), op_idx);
         }
         // Check that a stencil is not set on a non-stenciling kernel
-        if (!factory->can_batch() && op.batch() > 1) {
+        if (!factory->can_batch() && !factory->parallel() &&
+            op.batch() > 1) {
           RESULT_ERROR(
               result,
               "Op %s at index %d specified a batch size but the Kernel for "
-              "that Op was not declared to support batching. Add .batch() to "
-              "the Kernel declaration to support batching.",
+              "that Op was not declared to support batching. Add .batch() or "
+              ".parallel() to the Kernel declaration to support batching.",
               op.name().c_str(), op_idx);
         }
+        if (factory->max_batch_size() > 0 &&
+            op.batch() > factory->max_batch_size()) {
+          RESULT_ERROR(
+              result,
+              "Op %s at index %d specified a batch size of %d but the Kernel "
+              "for that Op executes batches of at most %d rows.",
+              op.name().c_str(), op_idx, op.batch(),
+              factory->max_batch_size());
+        }
+        // Rows dropped by a filter are not there for the stencils of the ops
+        // after it
+        std::vector<i32> stencil(op.stencil().begin(), op.stencil().end());
+        if (stencil.empty()) {
+          stencil = info->preferred_stencil();
+        }
+        if (after_filter && !(stencil.size() == 1 && stencil[0] == 0)) {
+          RESULT_ERROR(result,
+                       "Op %s at index %d specified a stencil but comes after "
+                       "a filter Op. Ops after filters can not stencil.",
+                       op.name().c_str(), op_idx);
+        }
+        if (info->is_filter()) {
+          if (resume) {
+            RESULT_ERROR(result,
+                         "Filter Op %s at index %d can not be used when "
+                         "resuming a job.",
+                         op.name().c_str(), op_idx);
+          }
+          after_filter = true;
+        }
       }
       op_idx++;
     }
+    // A column is decoded either into motion vectors or into frames
+    for (auto& kv : motion_vector_readers) {
+      if (kv.second.size() > 1) {
+        RESULT_ERROR(result,
+                     "Input column %s is read as motion vectors by some Ops "
+                     "and as frames by others",
+                     kv.first.c_str());
+      }
+    }
     if (op_names.size() < 3) {
       RESULT_ERROR(result,
                    "Task set must specify at least three Ops: "
@@ -207,8 +414,80 @@ void validate_task_set(DatabaseMetadata& meta, const proto::TaskSet& task_set,
   }
 }
 
+// Returns the ids of items in an existing output table which have had every
+// one of their files saved. Workers that stopped while uploading an item
+// leave some of its files, maybe cut short, but not its commit file.
+std::set<i64> completed_table_items(storehouse::StorageBackend* storage,
+                                    const TableMetadata& table,
+                                    i64 num_items) {
+  std::set<i64> completed;
+  for (i64 item = 0; item < num_items; ++item) {
+    storehouse::FileInfo info;
+    if (storage->get_file_info(table_item_commit_path(table.id(), item),
+                               info) == storehouse::StoreResult::Success) {
+      completed.insert(item);
+    }
+  }
+  return completed;
+}
+
+// Files of the items of a table, which jobs that failed may not have
+// written all of
+std::vector<std::string> table_item_paths(const TableMetadata& table) {
+  std::vector<std::string> paths;
+  i64 num_items = table.end_rows().size();
+  for (i64 item = 0; item < num_items; ++item) {
+    paths.push_back(table_item_commit_path(table.id(), item));
+    if (table.packed_items()) {
+      paths.push_back(table_item_packed_path(table.id(), item));
+    }
+    if (table.filtered_rows()) {
+      paths.push_back(table_item_rows_path(table.id(), item));
+    }
+    for (auto& col : table.columns()) {
+      if (!table.packed_items()) {
+        paths.push_back(table_item_output_path(table.id(), col.id(), item));
+      }
+      if (col.type() == ColumnType::Video) {
+        paths.push_back(
+            table_item_video_metadata_path(table.id(), col.id(), item));
+      }
+      if (col.zone_map()) {
+        paths.push_back(table_item_zone_map_path(table.id(), col.id(), item));
+      }
+    }
+  }
+  return paths;
+}
+
+// Zone map of each item of the named column of table, if it was written
+// with them
+bool read_zone_maps(storehouse::StorageBackend* storage,
+                    const TableMetadata& table, const std::string& column,
+                    std::vector<proto::ZoneMapDescriptor>& zones) {
+  for (const Column& col : table.columns()) {
+    if (col.name() != column || !col.zone_map()) {
+      continue;
+    }
+    zones.clear();
+    for (i64 item = 0; item < (i64)table.end_rows().size(); ++item) {
+      std::unique_ptr<storehouse::RandomReadFile> file;
+      STORE_CHECK(make_unique_random_read_file(
+          storage, table_item_zone_map_path(table.id(), col.id(), item),
+          file));
+      u64 pos = 0;
+      zones.push_back(
+          deserialize_db_proto<proto::ZoneMapDescriptor>(file.get(), pos));
+    }
+    return true;
+  }
+  return false;
+}
+
 Result get_task_end_rows(
     const std::map<std::string, TableMetadata>& table_metas,
+    const std::map<std::string, KeyframeIndex>& table_keyframes,
+    const std::map<std::string, ZoneMaps>& table_zone_maps,
     const proto::Task& task, i64 min_stencil, i64 max_stencil,
     std::vector<i64>& rows) {
   Result result;
@@ -219,7 +498,7 @@ Result get_task_end_rows(
     table_num_rows.push_back(table_metas.at(s.table_name()).num_rows());
   }
 
-  TaskSampler sampler(table_metas, task);
+  TaskSampler sampler(table_metas, table_keyframes, table_zone_maps, task);
   result = sampler.validate();
   if (!result.success()) {
     return result;
@@ -275,10 +554,11 @@ Result get_task_end_rows(
 }
 
 MasterImpl::MasterImpl(DatabaseParameters& params)
-  : watchdog_awake_(true), db_params_(params), bar_(nullptr) {
+  : watchdog_awake_(true), db_params_(params) {
   storage_ =
       storehouse::StorageBackend::make_from_config(db_params_.storage_config);
   set_database_path(params.db_path);
+  gc_thread_ = std::thread([this]() { collect_deleted_tables(); });
 }
 
 MasterImpl::~MasterImpl() {
@@ -286,6 +566,10 @@ MasterImpl::~MasterImpl() {
   if (watchdog_thread_.joinable()) {
     watchdog_thread_.join();
   }
+  gc_thread_.join();
+  for (std::thread& thread : join_threads_) {
+    thread.join();
+  }
   delete storage_;
 }
 
@@ -312,6 +596,8 @@ std::string MasterImpl::get_worker_address_from_grpc_context(
 grpc::Status MasterImpl::RegisterWorker(grpc::ServerContext* context,
                                         const proto::WorkerParams* worker_info,
                                         proto::Registration* registration) {
+  // Running jobs read the workers while sending themselves out
+  std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
   std::unique_lock<std::mutex> lk(work_mutex_);
 
   set_database_path(db_params_.db_path);
@@ -320,14 +606,42 @@ grpc::Status MasterImpl::RegisterWorker(grpc::ServerContext* context,
   worker_address += ":" + worker_info->port();
 
   VLOG(1) << "Adding worker: " << worker_address;
-  workers_.push_back(proto::Worker::NewStub(
-      grpc::CreateChannel(worker_address, grpc::InsecureChannelCredentials())));
-  registration->set_node_id(workers_.size() - 1);
+  std::shared_ptr<grpc::Channel> channel =
+      grpc::CreateChannel(worker_address, grpc::InsecureChannelCredentials());
+  workers_.push_back(proto::Worker::NewStub(channel));
+  i32 node_id = workers_.size() - 1;
+  registration->set_node_id(node_id);
   addresses_.push_back(worker_address);
+  worker_table_versions_.emplace_back();
+
+  if (!jobs_.empty() || !op_paths_.empty()) {
+    // The worker only starts serving once it has its node id
+    proto::Worker::Stub* worker = workers_.back().get();
+    std::vector<std::string> op_paths = op_paths_;
+    join_threads_.emplace_back([this, channel, worker, node_id, op_paths]() {
+      join_worker(channel, worker, node_id, op_paths);
+    });
+  }
 
   return grpc::Status::OK;
 }
 
+grpc::Status MasterImpl::UnregisterWorker(grpc::ServerContext* context,
+                                          const proto::NodeInfo* node_info,
+                                          proto::Empty* empty) {
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  i32 node_id = node_info->node_id();
+  VLOG(1) << "Worker " << node_id << " (" << addresses_.at(node_id)
+          << ") is leaving";
+  // Items the worker holds are still committed, so it is only marked dead
+  // once the running jobs are done with it
+  departed_workers_.insert(node_id);
+  if (jobs_.empty()) {
+    dead_workers_.insert(node_id);
+  }
+  return grpc::Status::OK;
+}
+
 grpc::Status MasterImpl::ActiveWorkers(
     grpc::ServerContext* context, const proto::Empty* empty,
     proto::RegisteredWorkers* registered_workers) {
@@ -348,13 +662,28 @@ grpc::Status MasterImpl::IngestVideos(grpc::ServerContext* context,
                                       const proto::IngestParameters* params,
                                       proto::IngestResult* result) {
   std::vector<FailedVideo> failed_videos;
-  result->mutable_result()->CopyFrom(
-      ingest_videos(db_params_.storage_config, db_params_.db_path,
-                    std::vector<std::string>(params->table_names().begin(),
-                                             params->table_names().end()),
-                    std::vector<std::string>(params->video_paths().begin(),
-                                             params->video_paths().end()),
-                    failed_videos));
+  bool has_workers;
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    has_workers = dead_workers_.size() < workers_.size();
+  }
+  if (has_workers) {
+    result->mutable_result()->CopyFrom(
+        ingest_on_workers(*params, failed_videos));
+  } else {
+    result->mutable_result()->CopyFrom(ingest_videos(
+        db_params_.storage_config, db_params_.db_path,
+        std::vector<std::string>(params->table_names().begin(),
+                                 params->table_names().end()),
+        std::vector<std::string>(params->video_paths().begin(),
+                                 params->video_paths().end()),
+        failed_videos, params->num_threads(), params->segment_size(),
+        params->in_place(), params->append(), params->transcode()));
+  }
+  if (params->append()) {
+    uncache_tables(std::vector<std::string>(params->table_names().begin(),
+                                            params->table_names().end()));
+  }
   for (auto& failed : failed_videos) {
     result->add_failed_paths(failed.path);
     result->add_failed_messages(failed.message);
@@ -362,54 +691,225 @@ grpc::Status MasterImpl::IngestVideos(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status MasterImpl::IngestStream(
+    grpc::ServerContext* context, const proto::IngestStreamParameters* params,
+    proto::Result* result) {
+  set_database_path(db_params_.db_path);
+  // Each item is picked up by the next job as soon as it is written
+  std::vector<std::string> table_names = {params->table_name()};
+  result->CopyFrom(ingest_stream(storage_, params->table_name(),
+                                 params->url(), params->item_frames(),
+                                 params->max_items(),
+                                 [&]() { uncache_tables(table_names); }));
+  uncache_tables(table_names);
+  return grpc::Status::OK;
+}
+
+grpc::Status MasterImpl::IngestImages(
+    grpc::ServerContext* context, const proto::IngestImagesParameters* params,
+    proto::IngestResult* result) {
+  std::vector<FailedVideo> failed_images;
+  result->mutable_result()->CopyFrom(ingest_images(
+      db_params_.storage_config, db_params_.db_path, params->table_name(),
+      std::vector<std::string>(params->image_paths().begin(),
+                               params->image_paths().end()),
+      failed_images, params->num_threads(), params->images_per_item()));
+  for (auto& failed : failed_images) {
+    result->add_failed_paths(failed.path);
+    result->add_failed_messages(failed.message);
+  }
+  return grpc::Status::OK;
+}
+
 grpc::Status MasterImpl::NextWork(grpc::ServerContext* context,
                                   const proto::NodeInfo* node_info,
-                                  proto::NewWork* new_work) {
+                                  proto::WorkLease* lease) {
   std::unique_lock<std::mutex> lk(work_mutex_);
-  if (samples_left_ <= 0) {
-    if (next_task_ < num_tasks_ && task_result_.success()) {
-      // More tasks left
-      task_sampler_.reset(new TaskSampler(
-          table_metas_, job_params_.task_set().tasks(next_task_)));
-      task_result_ = task_sampler_->validate();
-      if (task_result_.success()) {
-        samples_left_ = task_sampler_->total_samples();
-        next_task_++;
-        VLOG(1) << "Tasks left: " << num_tasks_ - next_task_;
-      }
-    } else {
-      // No more tasks left
-      new_work->mutable_io_item()->set_item_id(-1);
-      return grpc::Status::OK;
-    }
+  i32 node_id = node_info->node_id();
+  if (dead_workers_.count(node_id) > 0) {
+    // Items held by this worker have already been handed to other workers
+    return grpc::Status::OK;
   }
-  if (!task_result_.success()) {
-    new_work->mutable_io_item()->set_item_id(-1);
+  if (departed_workers_.count(node_id) > 0) {
+    // An empty lease ends the job on a worker that is leaving
     return grpc::Status::OK;
   }
-
-  assert(samples_left_ > 0);
-  task_result_ = task_sampler_->next_work(*new_work);
-  if (!task_result_.success()) {
-    new_work->mutable_io_item()->set_item_id(-1);
+  auto job_it = jobs_.find(node_info->job_id());
+  if (job_it == jobs_.end()) {
+    // The job already finished, so an empty lease ends it on the worker
     return grpc::Status::OK;
   }
+  JobState& job = *job_it->second;
+  i32 items_requested =
+      lease_size(job, node_id, std::max(node_info->num_items(), 1));
+  items_requested = fair_share(job, node_id, items_requested);
+  job.lease_stats[node_id].last_lease_size = items_requested;
+  for (i32 i = 0; i < items_requested; ++i) {
+    proto::NewWork* new_work = lease->add_work();
+    if (!next_work_item(job, node_id, *new_work)) {
+      lease->mutable_work()->RemoveLast();
+      break;
+    }
+    const proto::IOItem& item = new_work->io_item();
+    ActiveItem& active =
+        job.active_items[std::make_tuple(item.table_id(), item.item_id())];
+    active.work.CopyFrom(*new_work);
+    active.start = now();
+    active.nodes.insert(node_id);
+  }
+  if (items_requested == 0) {
+    // Other jobs are using this worker's share of the cluster
+    lease->set_retry(true);
+  } else if (lease->work_size() == 0 && job.task_result.success() &&
+             !job.active_items.empty()) {
+    // The sample pool is exhausted, so hand idle workers copies of the
+    // slowest outstanding items
+    proto::NewWork new_work;
+    if (next_speculative_item(job, node_id, new_work)) {
+      lease->add_work()->CopyFrom(new_work);
+    } else {
+      lease->set_retry(true);
+    }
+  } else if (lease->work_size() == 0 && job.task_result.success() &&
+             (!job.pending_items.empty() || !job.reassigned_work.empty())) {
+    // The items left read local items held by other workers
+    lease->set_retry(true);
+  }
+  for (auto& item : cancelled_items_[node_id]) {
+    lease->add_cancelled_items()->CopyFrom(item);
+  }
+  cancelled_items_[node_id].clear();
+  if (job.bar) {
+    job.bar->Progressed(job.total_samples_used);
+  }
+  return grpc::Status::OK;
+}
 
-  samples_left_--;
-  total_samples_used_++;
-  if (bar_) {
-    bar_->Progressed(total_samples_used_);
+grpc::Status MasterImpl::FinishedWork(
+    grpc::ServerContext* context, const proto::FinishedWorkParameters* params,
+    proto::FinishedWorkReply* reply) {
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  i32 node_id = params->node_id();
+  auto job_it = jobs_.find(params->job_id());
+  if (job_it != jobs_.end()) {
+    // Outputs are kept until their item is committed, so that only the copy
+    // of the worker which commits it is sent
+    JobState& job = *job_it->second;
+    for (auto& output : params->outputs()) {
+      auto key = std::make_tuple(output.io_item().table_id(),
+                                 output.io_item().item_id());
+      if (job.stream != nullptr && job.active_items.count(key) > 0) {
+        job.uncommitted_outputs[key].CopyFrom(output);
+      }
+    }
+  }
+  for (auto& item : params->io_items()) {
+    if (job_it == jobs_.end()) {
+      break;
+    }
+    JobState& job = *job_it->second;
+    auto it = job.active_items.find(
+        std::make_tuple(item.table_id(), item.item_id()));
+    if (it == job.active_items.end()) {
+      // Another worker already committed this item
+      continue;
+    }
+    job.filtered_item_rows[it->first] = item.output_rows();
+    if (job.params.local_tables_size() > 0) {
+      job.item_nodes[it->first] = addresses_.at(node_id);
+    }
+    ActiveItem& active = it->second;
+    job.committed_item_seconds += nano_since(active.start) / 1e9;
+    job.committed_items++;
+    if (job.stream != nullptr) {
+      auto output_it = job.uncommitted_outputs.find(it->first);
+      bool has_output = output_it != job.uncommitted_outputs.end();
+      stream_item(job, item.table_id(), item.item_id(),
+                  has_output ? &output_it->second : nullptr);
+      if (has_output) {
+        job.uncommitted_outputs.erase(output_it);
+      }
+    }
+    for (i32 other_node : active.nodes) {
+      if (other_node != node_id) {
+        cancelled_items_[other_node].push_back(item);
+      }
+    }
+    job.active_items.erase(it);
   }
+  for (auto& item : cancelled_items_[node_id]) {
+    reply->add_cancelled_items()->CopyFrom(item);
+  }
+  cancelled_items_[node_id].clear();
   return grpc::Status::OK;
 }
 
 grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
                                 const proto::JobParameters* job_params,
                                 proto::Result* job_result) {
+  run_job(job_params, nullptr, job_result);
+  return grpc::Status::OK;
+}
+
+grpc::Status MasterImpl::StreamJob(
+    grpc::ServerContext* context, const proto::JobParameters* job_params,
+    grpc::ServerWriter<proto::JobOutput>* writer) {
+  OutputStream stream;
+  proto::Result job_result;
+  std::thread job_thread([&]() {
+    run_job(job_params, &stream, &job_result);
+    {
+      std::unique_lock<std::mutex> lk(stream.mutex);
+      stream.finished = true;
+    }
+    stream.ready.notify_all();
+  });
+  // A client that went away still lets the job run to completion
+  bool connected = true;
+  bool finished = false;
+  while (!finished) {
+    std::deque<proto::JobOutput> outputs;
+    std::deque<TableMetadata> tables;
+    {
+      std::unique_lock<std::mutex> lk(stream.mutex);
+      stream.ready.wait(
+          lk, [&] { return stream.finished || !stream.outputs.empty(); });
+      outputs.swap(stream.outputs);
+      tables.swap(stream.tables);
+      finished = stream.finished;
+    }
+    if (!tables.empty()) {
+      // The tables of finished tasks must be complete before the client
+      // reads them
+      std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
+      for (auto& table : tables) {
+        write_table_metadata(storage_, table);
+      }
+    }
+    for (auto& output : outputs) {
+      connected = connected && writer->Write(output);
+    }
+  }
+  job_thread.join();
+
+  proto::JobOutput output;
+  output.set_finished(true);
+  output.mutable_result()->CopyFrom(job_result);
+  if (connected) {
+    writer->Write(output);
+  }
+  return grpc::Status::OK;
+}
+
+void MasterImpl::run_job(const proto::JobParameters* job_params,
+                         OutputStream* stream, proto::Result* job_result) {
   job_result->set_success(true);
   set_database_path(db_params_.db_path);
 
-  job_params_.CopyFrom(*job_params);
+  std::unique_ptr<JobState> job_state(new JobState);
+  JobState& job = *job_state;
+  job.params.CopyFrom(*job_params);
+  job.stream = stream;
 
   const i32 io_item_size = job_params->io_item_size();
   const i32 work_item_size = job_params->work_item_size();
@@ -417,29 +917,65 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
   i32 warmup_size = 0;
   i32 total_rows = 0;
 
+  // Other jobs may be adding tables at the same time, so the metadata is
+  // only read and written while holding the lock
+  std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
   DatabaseMetadata meta =
       read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
-  DatabaseMetadata meta_copy =
-      read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
 
-  validate_task_set(meta, job_params->task_set(), job_result);
+  validate_task_set(meta, job_params->task_set(), job_params->resume(),
+                    job_result);
   if (!job_result->success()) {
     // No database changes made at this point, so just return
-    return grpc::Status::OK;
+    return;
   }
 
-  // Read all table metadata
-  for (const std::string& table_name : meta.table_names()) {
-    std::string table_path =
-        TableMetadata::descriptor_path(meta.get_table_id(table_name));
-    table_metas_[table_name] = read_table_metadata(storage_, table_path);
+  // Columns of the input tables which no op reads are left out of the
+  // samples, so that workers do not load them
+  proto::JobParameters pruned_params;
+  std::vector<bool> used_columns =
+      used_input_columns(job_params->task_set());
+  if (std::find(used_columns.begin(), used_columns.end(), false) !=
+      used_columns.end()) {
+    pruned_params.CopyFrom(*job_params);
+    prune_input_columns(*pruned_params.mutable_task_set(), used_columns);
+    job_params = &pruned_params;
+    job.params.CopyFrom(pruned_params);
+  }
+
+  // Read metadata of tables added since the last job
+  refresh_table_cache(meta);
+  for (auto& kv : table_cache_) {
+    job.table_metas[kv.second.name()] = kv.second;
+  }
+  for (auto& task : job_params->task_set().tasks()) {
+    for (auto& sample : task.samples()) {
+      if (job.table_keyframes.count(sample.table_name()) == 0) {
+        job.table_keyframes[sample.table_name()] =
+            cached_keyframe_index(job.table_metas.at(sample.table_name()));
+      }
+      // Samplers which skip items by their values need the zone maps of
+      // the column they select by
+      proto::ZoneMapSamplerArgs zone_args;
+      if (sample.sampling_function() == "ZoneMap" &&
+          zone_args.ParseFromString(sample.sampling_args())) {
+        ZoneMaps& zone_maps = job.table_zone_maps[sample.table_name()];
+        if (zone_maps.count(zone_args.column()) == 0) {
+          const TableMetadata& table = job.table_metas.at(sample.table_name());
+          std::vector<proto::ZoneMapDescriptor> zones;
+          if (read_zone_maps(storage_, table, zone_args.column(), zones)) {
+            zone_maps[zone_args.column()] = zones;
+          }
+        }
+      }
+    }
   }
 
   // Get output columns from last output op
   std::vector<Column> input_table_columns;
   {
     for (auto& sample : job_params->task_set().tasks(0).samples()) {
-      TableMetadata& table = table_metas_[sample.table_name()];
+      TableMetadata& table = job.table_metas[sample.table_name()];
       std::vector<Column> table_columns = table.columns();
       for (const std::string& c : sample.column_names()) {
         for (Column& col : table_columns) {
@@ -456,6 +992,10 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
 
   auto& ops = job_params->task_set().ops();
   OpRegistry* op_registry = get_op_registry();
+  bool filtered = false;
+  for (size_t i = 1; i + 1 < (size_t)ops.size(); ++i) {
+    filtered |= op_registry->get_op_info(ops.Get(i).name())->is_filter();
+  }
   auto& last_op = ops.Get(ops.size() - 1);
   assert(last_op.name() == "OutputTable");
   std::vector<Column> output_columns;
@@ -476,6 +1016,8 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
           c.set_id(output_columns.size());
           c.set_name(name);
           c.set_type(col.type());
+          c.set_tensor_type(col.tensor_type());
+          c.mutable_tensor_shape()->CopyFrom(col.tensor_shape());
           output_columns.push_back(c);
           found = true;
           break;
@@ -484,6 +1026,138 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
       assert(found);
     }
   }
+  // Columns of each output table of a task, for task sets that merge jobs
+  auto& column_tables = job_params->task_set().output_column_tables();
+  i32 num_output_tables = 1;
+  if (column_tables.size() > 0) {
+    if (column_tables.size() != (i32)output_columns.size()) {
+      RESULT_ERROR(job_result,
+                   "Task set assigns %d output columns to tables but has "
+                   "%lu output columns",
+                   column_tables.size(), output_columns.size());
+      return;
+    }
+    for (i32 t : column_tables) {
+      if (t < 0) {
+        RESULT_ERROR(job_result, "Output column table %d is negative", t);
+        return;
+      }
+      num_output_tables = std::max(num_output_tables, t + 1);
+    }
+    for (auto& task : job_params->task_set().tasks()) {
+      if (task.shared_output_table_names_size() + 1 != num_output_tables) {
+        RESULT_ERROR(job_result,
+                     "Task %s names %d shared output tables but the task set "
+                     "outputs %d tables",
+                     task.output_table_name().c_str(),
+                     task.shared_output_table_names_size(),
+                     num_output_tables - 1);
+        return;
+      }
+    }
+    if (filtered) {
+      // Filters of one job would drop the rows of the others
+      RESULT_ERROR(job_result,
+                   "Jobs with filter Ops can not be merged with other jobs");
+      return;
+    }
+  }
+  if (filtered) {
+    // Video items are indexed by frame, so they can not skip rows
+    for (const Column& column : output_columns) {
+      if (column.type() == ColumnType::Video) {
+        RESULT_ERROR(job_result,
+                     "Video column %s can not be output by a job with filter "
+                     "Ops",
+                     column.name().c_str());
+        return;
+      }
+    }
+  }
+  // Streamed columns are sent as the elements the save workers get, which
+  // are encoded packets for videos
+  for (const std::string& name : job_params->stream_columns()) {
+    auto it = std::find_if(
+        output_columns.begin(), output_columns.end(),
+        [&](const Column& column) { return column.name() == name; });
+    if (it == output_columns.end()) {
+      RESULT_ERROR(job_result, "Streamed column %s is not an output column",
+                   name.c_str());
+      return;
+    }
+    if (it->type() == ColumnType::Video) {
+      RESULT_ERROR(job_result, "Video column %s can not be streamed",
+                   name.c_str());
+      return;
+    }
+  }
+  if (job_params->stream_columns_size() > 0 && stream == nullptr) {
+    RESULT_ERROR(job_result, "Only jobs run with StreamJob can stream columns");
+    return;
+  }
+  if (job_params->stream_only() && job_params->stream_columns_size() == 0) {
+    RESULT_ERROR(job_result,
+                 "Job only streams its output but has no streamed columns");
+    return;
+  }
+  if (job_params->stream_only() && job_params->resume()) {
+    // The resumed tables would list items that are never written
+    RESULT_ERROR(job_result,
+                 "Jobs which only stream their output can not be resumed");
+    return;
+  }
+  // The save workers summarize the values of these columns in each item
+  for (const std::string& name : job_params->zone_map_columns()) {
+    auto it = std::find_if(
+        output_columns.begin(), output_columns.end(),
+        [&](const Column& column) { return column.name() == name; });
+    if (it == output_columns.end()) {
+      RESULT_ERROR(job_result, "Zone map column %s is not an output column",
+                   name.c_str());
+      return;
+    }
+    if (it->type() != ColumnType::Tensor) {
+      RESULT_ERROR(job_result,
+                   "Zone map column %s is not a Tensor column, so its "
+                   "values can not be summarized",
+                   name.c_str());
+      return;
+    }
+    it->set_zone_map(true);
+  }
+  // Columns other than video may have their element data block compressed
+  auto& compression = job_params->task_set().compression();
+  for (size_t i = 0;
+       i < output_columns.size() && i < (size_t)compression.size(); ++i) {
+    Column::BlockCodec codec;
+    if (!parse_block_codec(compression.Get(i).codec(), codec)) {
+      continue;
+    }
+    Column& column = output_columns[i];
+    if (column.type() == ColumnType::Video) {
+      RESULT_ERROR(job_result,
+                   "Video column %s can not be compressed with codec %s",
+                   column.name().c_str(), compression.Get(i).codec().c_str());
+      return;
+    }
+    if (!block_codec_available(codec)) {
+      RESULT_ERROR(job_result, "Scanner was built without codec %s",
+                   compression.Get(i).codec().c_str());
+      return;
+    }
+    column.set_block_codec(codec);
+    auto& options = compression.Get(i).options();
+    if (options.count("level") > 0) {
+      column.set_block_codec_level(std::atoi(options.at("level").c_str()));
+    }
+  }
+  std::vector<std::vector<Column>> table_columns(num_output_tables);
+  for (size_t i = 0; i < output_columns.size(); ++i) {
+    i32 t = column_tables.size() > 0 ? column_tables.Get(i) : 0;
+    Column column = output_columns[i];
+    column.set_id(table_columns[t].size());
+    table_columns[t].push_back(column);
+  }
   proto::JobDescriptor job_descriptor;
   job_descriptor.set_io_item_size(io_item_size);
   job_descriptor.set_work_item_size(work_item_size);
@@ -506,10 +1180,53 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
   i64 min_stencil, max_stencil;
   std::tie(min_stencil, max_stencil) =
       determine_stencil_bounds(job_params->task_set());
-  total_samples_used_ = 0;
-  total_samples_ = 0;
-  for (auto& task : job_params->task_set().tasks()) {
-    i32 table_id = meta.add_table(task.output_table_name());
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    if (jobs_.empty()) {
+      // Unresponsive workers get another chance once no job is running
+      cancelled_items_.clear();
+      dead_workers_ = departed_workers_;
+    }
+  }
+  // Splitting the tasks into items validates their samplers, which takes a
+  // while for jobs with many tasks, so it is done in parallel up front. The
+  // output tables only need to exist for it.
+  auto& job_tasks = job_params->task_set().tasks();
+  std::vector<std::vector<i64>> task_end_rows(job_tasks.size());
+  std::vector<Result> task_results(job_tasks.size());
+  {
+    std::map<std::string, TableMetadata> sampling_metas = job.table_metas;
+    for (auto& task : job_tasks) {
+      proto::TableDescriptor placeholder;
+      placeholder.set_name(task.output_table_name());
+      sampling_metas.emplace(task.output_table_name(),
+                             TableMetadata(placeholder));
+    }
+    WorkStealingPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    for (i32 t = 0; t < job_tasks.size(); ++t) {
+      pool.submit([&, t](i32) {
+        task_results[t] = get_task_end_rows(
+            sampling_metas, job.table_keyframes, job.table_zone_maps,
+            job_tasks.Get(t), min_stencil, max_stencil, task_end_rows[t]);
+      });
+    }
+    pool.wait_idle();
+  }
+  // Tables added by this job, which are removed again if it fails
+  std::vector<i32> created_tables;
+  for (i32 t = 0; t < job_tasks.size(); ++t) {
+    auto& task = job_tasks.Get(t);
+    bool resuming =
+        job_params->resume() && meta.has_table(task.output_table_name());
+    TableMetadata previous_table;
+    i32 table_id;
+    if (resuming) {
+      table_id = meta.get_table_id(task.output_table_name());
+      previous_table = table_cache_.at(table_id);
+    } else {
+      table_id = meta.add_table(task.output_table_name());
+      created_tables.push_back(table_id);
+    }
     proto::TableDescriptor table_desc;
     table_desc.set_id(table_id);
     table_desc.set_name(task.output_table_name());
@@ -517,118 +1234,625 @@ grpc::Status MasterImpl::NewJob(grpc::ServerContext* context,
                                  now().time_since_epoch())
                                  .count());
     // Set columns equal to the last op's output columns
-    for (size_t i = 0; i < output_columns.size(); ++i) {
-      Column* col = table_desc.add_columns();
-      col->CopyFrom(output_columns[i]);
-    }
-    table_metas_[task.output_table_name()] = TableMetadata(table_desc);
-    std::vector<i64> end_rows;
-    Result result = get_task_end_rows(table_metas_, task, min_stencil,
-                                      max_stencil, end_rows);
-    if (!result.success()) {
-      *job_result = result;
+    for (const Column& column : table_columns[0]) {
+      table_desc.add_columns()->CopyFrom(column);
+    }
+    job.table_metas[task.output_table_name()] = TableMetadata(table_desc);
+    const std::vector<i64>& end_rows = task_end_rows[t];
+    if (!task_results[t].success()) {
+      *job_result = task_results[t];
       break;
     }
-    total_samples_ += end_rows.size();
+    size_t completed_items = 0;
+    if (resuming) {
+      // Only skip items if the previous run split the table the same way
+      const std::vector<Column>& columns = table_columns[0];
+      bool same_codecs = previous_table.columns().size() == columns.size();
+      for (size_t i = 0; same_codecs && i < columns.size(); ++i) {
+        same_codecs = previous_table.columns()[i].block_codec() ==
+                          columns[i].block_codec() &&
+                      previous_table.columns()[i].zone_map() ==
+                          columns[i].zone_map();
+      }
+      // Items after those the two runs share, such as the rows appended to
+      // the input since, are computed afresh. The last previous item may
+      // have been cut short by the end of the input then.
+      const std::vector<i64>& previous_rows = previous_table.end_rows();
+      size_t shared_items = 0;
+      while (shared_items < previous_rows.size() &&
+             shared_items < end_rows.size() &&
+             previous_rows[shared_items] == end_rows[shared_items]) {
+        shared_items++;
+      }
+      bool grown = !previous_rows.empty() && !end_rows.empty() &&
+                   shared_items + 1 == previous_rows.size() &&
+                   previous_rows.back() < end_rows.back();
+      if ((shared_items < previous_rows.size() && !grown) || !same_codecs) {
+        RESULT_ERROR(job_result,
+                     "Can not resume table %s since it was created with a "
+                     "different set of items or columns",
+                     task.output_table_name().c_str());
+        break;
+      }
+      // The last item of a grown table was computed without the rows after
+      // it that its stencil reaches
+      if (max_stencil > 0 && shared_items == previous_rows.size() &&
+          shared_items < end_rows.size() && shared_items > 0) {
+        shared_items--;
+      }
+      std::set<i64> completed =
+          completed_table_items(storage_, previous_table, shared_items);
+      // Previous items that are computed again could be cut short as well,
+      // so they must not keep their old commit files
+      for (i64 item = shared_items; item < (i64)previous_rows.size();
+           ++item) {
+        storage_->delete_file(table_item_commit_path(table_id, item));
+      }
+      VLOG(1) << "Resuming table " << task.output_table_name() << ": "
+              << completed.size() << " of " << end_rows.size()
+              << " items already completed";
+      for (i64 item : completed) {
+        job.completed_items.insert(std::make_tuple(table_id, item));
+      }
+      job.total_samples -= completed.size();
+      completed_items = completed.size();
+    }
+    job.total_samples += end_rows.size();
+    job.table_tasks[table_id] = job.task_items.size();
+    job.task_tables.push_back(table_id);
+    job.task_items.push_back(end_rows.size());
+    job.task_items_left.push_back(end_rows.size() - completed_items);
     for (i64 r : end_rows) {
       table_desc.add_end_rows(r);
     }
     table_desc.set_job_id(job_id);
+    // Resumed tables keep the layout they were first written with
+    table_desc.set_packed_items(resuming ? previous_table.packed_items()
+                                         : job_params->pack_output_items());
+    table_desc.set_local_items(
+        resuming ? previous_table.local_items()
+                 : std::find(job_params->local_tables().begin(),
+                             job_params->local_tables().end(),
+                             task.output_table_name()) !=
+                       job_params->local_tables().end());
+    table_desc.set_filtered_rows(filtered);
 
     write_table_metadata(storage_, TableMetadata(table_desc));
-    table_metas_[task.output_table_name()] = TableMetadata(table_desc);
+    cache_table(TableMetadata(table_desc));
+    job.table_metas[task.output_table_name()] = TableMetadata(table_desc);
+
+    // The tables of merged jobs have the same items as the first one
+    for (i32 t = 1; t < num_output_tables; ++t) {
+      const std::string& name = task.shared_output_table_names(t - 1);
+      proto::TableDescriptor shared_desc;
+      shared_desc.CopyFrom(table_desc);
+      shared_desc.set_id(meta.add_table(name));
+      created_tables.push_back(shared_desc.id());
+      shared_desc.set_name(name);
+      shared_desc.clear_columns();
+      for (const Column& column : table_columns[t]) {
+        shared_desc.add_columns()->CopyFrom(column);
+      }
+      write_table_metadata(storage_, TableMetadata(shared_desc));
+      cache_table(TableMetadata(shared_desc));
+      job.table_metas[name] = TableMetadata(shared_desc);
+    }
   }
   if (!job_result->success()) {
     // No database changes made at this point, so just return
-    return grpc::Status::OK;
+    return;
   }
 
   // Write out database metadata so that workers can read it
   write_job_metadata(storage_, JobMetadata(job_descriptor));
 
   // Setup initial task sampler
-  task_result_.set_success(true);
-  samples_left_ = 0;
-  next_task_ = 0;
-  num_tasks_ = job_params->task_set().tasks_size();
+  job.task_result.set_success(true);
+  job.samples_left = 0;
+  job.next_task = 0;
+  job.num_tasks = job_params->task_set().tasks_size();
+  job.task_samplers.reset(new TaskSamplerQueue(
+      job.table_metas, job.table_keyframes, job.table_zone_maps,
+      job.params.task_set().tasks(), TASK_SAMPLER_LOOKAHEAD));
 
   write_database_metadata(storage_, meta);
 
-  VLOG(1) << "Total tasks: " << num_tasks_;
-
-  grpc::CompletionQueue cq;
-  std::vector<grpc::ClientContext> client_contexts(workers_.size());
-  std::vector<grpc::Status> statuses(workers_.size());
-  std::vector<proto::Result> replies(workers_.size());
-  std::vector<std::unique_ptr<grpc::ClientAsyncResponseReader<proto::Result>>>
-      rpcs;
+  VLOG(1) << "Total tasks: " << job.num_tasks;
 
   if (job_params->show_progress()) {
-    bar_.reset(new ProgressBar(total_samples_, ""));
-  } else {
-    bar_.reset(nullptr);
+    job.bar.reset(new ProgressBar(job.total_samples, ""));
   }
 
-  std::map<std::string, i32> local_ids;
-  std::map<std::string, i32> local_totals;
-  for (std::string& address : addresses_) {
-    // Strip port
-    std::vector<std::string> split_addr = split(address, ':');
-    std::string sans_port = split_addr[0];
-    if (local_totals.count(sans_port) == 0) {
-      local_totals[sans_port] = 0;
+  // Tables read or written by the job, which workers need descriptors for
+  for (auto& task : job_params->task_set().tasks()) {
+    job.worker_tables.insert(meta.get_table_id(task.output_table_name()));
+    for (auto& name : task.shared_output_table_names()) {
+      job.worker_tables.insert(meta.get_table_id(name));
+    }
+    for (auto& sample : task.samples()) {
+      i32 table_id = meta.get_table_id(sample.table_name());
+      job.worker_tables.insert(table_id);
+      if (job.input_end_rows.count(table_id) == 0) {
+        const TableMetadata& table = job.table_metas.at(sample.table_name());
+        job.input_end_rows[table_id] = table.end_rows();
+        if (table.local_items()) {
+          job.input_item_nodes[table_id] = table.item_nodes();
+        }
+      }
     }
-    local_totals[sans_port] += 1;
   }
-
-  proto::JobParameters w_job_params;
-  w_job_params.CopyFrom(*job_params);
-  w_job_params.set_global_total(workers_.size());
-  for (size_t i = 0; i < workers_.size(); ++i) {
-    auto& worker = workers_[i];
-    std::string& address = addresses_[i];
-    std::vector<std::string> split_addr = split(address, ':');
-    std::string sans_port = split_addr[0];
-    w_job_params.set_local_id(local_ids[sans_port]);
-    w_job_params.set_local_total(local_totals[sans_port]);
-    local_ids[sans_port] += 1;
-    rpcs.emplace_back(
-        worker->AsyncNewJob(&client_contexts[i], w_job_params, &cq));
-    rpcs[i]->Finish(&replies[i], &statuses[i], (void*)i);
+  // Workers get the rows of each item along with it, so the samples of the
+  // tasks, which for large gathers dwarf everything else, stay here and in
+  // the job descriptor. Only the output tables of the tasks are sent.
+  job.worker_params.CopyFrom(*job_params);
+  job.worker_params.set_job_id(job_id);
+  for (proto::Task& task :
+       *job.worker_params.mutable_task_set()->mutable_tasks()) {
+    task.clear_samples();
   }
 
-  for (size_t i = 0; i < workers_.size(); ++i) {
+  {
+    // Workers start asking for the job's items once they get it
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    jobs_[job_id] = std::move(job_state);
+    for (i32 i = 0; i < (i32)workers_.size(); ++i) {
+      if (departed_workers_.count(i) == 0) {
+        send_job(job, i);
+      }
+    }
+    if (stream != nullptr) {
+      // Tasks which a previous run already finished
+      std::vector<proto::JobOutput> outputs;
+      std::vector<TableMetadata> tables;
+      if (job_params->stream_ordered()) {
+        advance_ordered_stream(job, outputs, tables);
+      } else {
+        for (i64 t = 0; t < job.num_tasks; ++t) {
+          if (job.task_items_left[t] == 0) {
+            outputs.push_back(finished_task_output(job, t, tables));
+          }
+        }
+      }
+      send_outputs(job, outputs, tables);
+    }
+  }
+  meta_lk.unlock();
+
+  // Workers which register while the job runs add their calls, so the
+  // job is closed to them once every call made so far has returned
+  size_t finished_calls = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      if (finished_calls == job.worker_calls.size()) {
+        job.closed = true;
+        break;
+      }
+    }
     void* got_tag;
     bool ok = false;
-    GPR_ASSERT(cq.Next(&got_tag, &ok));
-    GPR_ASSERT((i64)got_tag < workers_.size());
+    GPR_ASSERT(job.worker_cq.Next(&got_tag, &ok));
     assert(ok);
+    finished_calls++;
 
-    i64 worker_id = (i64)got_tag;
+    WorkerCall* call = (WorkerCall*)got_tag;
+    i32 worker_id = call->node_id;
 
-    if (!replies[worker_id].success()) {
+    if (!call->status.ok()) {
+      // Lost contact with the worker, so give its items to the others
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      remove_worker(worker_id);
+      continue;
+    }
+    if (!call->reply.success()) {
       LOG(WARNING) << "Worker " << worker_id
-                   << " returned error: " << replies[worker_id].msg();
+                   << " returned error: " << call->reply.msg();
       job_result->set_success(false);
-      job_result->set_msg(replies[worker_id].msg());
-      next_task_ = num_tasks_;
+      job_result->set_msg(call->reply.msg());
+      // Stop handing out work and release workers waiting on items that
+      // will never be committed
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      job.next_task = job.num_tasks;
+      job.active_items.clear();
+      job.pending_items.clear();
     }
   }
+  job.worker_cq.Shutdown();
+  {
+    void* got_tag;
+    bool ok;
+    while (job.worker_cq.Next(&got_tag, &ok)) {
+    }
+  }
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    if (job_result->success() &&
+        (!job.active_items.empty() || !job.reassigned_work.empty() ||
+         !job.pending_items.empty() || job.samples_left > 0 ||
+         job.next_task < job.num_tasks)) {
+      RESULT_ERROR(job_result,
+                   "All workers stopped responding before the job finished");
+    }
+    // The job's tables change below, which the queue reads
+    job.task_samplers.reset();
+  }
 
-  if (!job_result->success()) {
-    // Overwrite database metadata with copy from prior to modification
-    write_database_metadata(storage_, meta_copy);
+  // Jobs which ran at the same time may have committed their own tables
+  // since, so the changes of this job are applied to the latest metadata
+  meta_lk.lock();
+  meta = read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
+  // The client of the job waits for it instead of writing the metadata, so
+  // this is when tombstones can be cleared without losing its changes
+  for (i32 table_id : collected_tables_) {
+    meta.clear_deleted_table(table_id);
   }
-  if (!task_result_.success()) {
-    job_result->CopyFrom(task_result_);
+  collected_tables_.clear();
+  if (!job_result->success() || job_params->stream_only()) {
+    // The output tables of jobs which only stream it were never written
+    for (i32 table_id : created_tables) {
+      meta.remove_table(table_id);
+    }
+    meta.remove_job(job_id);
+    write_database_metadata(storage_, meta);
+  } else if (job_params->max_items() > 0) {
+    // Calibration runs only wrote some of the items of their tables. The
+    // job stays so that its profile can be read.
+    for (i32 table_id : created_tables) {
+      meta.remove_table(table_id);
+    }
+    write_database_metadata(storage_, meta);
   } else {
-    assert(next_task_ == num_tasks_);
-    if (bar_) {
-      bar_->Progressed(total_samples_);
+    // Add the output tables to the manifest so that later jobs and clients
+    // do not have to read their descriptors one by one
+    proto::DatabaseManifest segment;
+    for (auto& task : job_params->task_set().tasks()) {
+      if (filtered) {
+        // Each item holds only the rows kept by the filters
+        TableMetadata& table = job.table_metas[task.output_table_name()];
+        proto::TableDescriptor& table_desc = table.get_descriptor();
+        i64 end_row = 0;
+        for (i64 item = 0; item < table_desc.end_rows_size(); ++item) {
+          end_row +=
+              job.filtered_item_rows.at(std::make_tuple(table.id(), item));
+          table_desc.set_end_rows(item, end_row);
+        }
+        write_table_metadata(storage_, table);
+      }
+      std::vector<std::string> names = {task.output_table_name()};
+      names.insert(names.end(), task.shared_output_table_names().begin(),
+                   task.shared_output_table_names().end());
+      // Later jobs run the items reading a local item on the worker that
+      // holds it
+      i32 task_table_id = job.table_metas[task.output_table_name()].id();
+      for (const std::string& name : names) {
+        TableMetadata& table = job.table_metas[name];
+        if (!table.local_items()) {
+          continue;
+        }
+        proto::TableDescriptor& table_desc = table.get_descriptor();
+        table_desc.clear_item_nodes();
+        for (i64 item = 0; item < table_desc.end_rows_size(); ++item) {
+          auto it = job.item_nodes.find(std::make_tuple(task_table_id, item));
+          table_desc.add_item_nodes(it == job.item_nodes.end() ? ""
+                                                               : it->second);
+        }
+        write_table_metadata(storage_, table);
+      }
+      for (const std::string& name : names) {
+        const TableMetadata& table = job.table_metas[name];
+        segment.add_tables()->CopyFrom(table.get_descriptor());
+        std::vector<proto::VideoDescriptor> videos;
+        for (const Column& column : table.columns()) {
+          if (column.type() != ColumnType::Video) {
+            continue;
+          }
+          for (i64 item = 0; item < (i64)table.end_rows().size(); ++item) {
+            VideoMetadata video = read_video_metadata(
+                storage_,
+                VideoMetadata::descriptor_path(table.id(), column.id(), item));
+            segment.add_videos()->CopyFrom(video.get_descriptor());
+            videos.push_back(video.get_descriptor());
+          }
+        }
+        cache_table(table, videos);
+      }
     }
+    append_manifest(storage_, meta, segment);
+    write_database_metadata(storage_, meta);
   }
+  meta_lk.unlock();
 
-  return grpc::Status::OK;
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  if (!job.task_result.success()) {
+    job_result->CopyFrom(job.task_result);
+  } else {
+    assert(job.next_task == job.num_tasks);
+    if (job.bar) {
+      job.bar->Progressed(job.total_samples);
+    }
+  }
+  jobs_.erase(job_id);
+  if (jobs_.empty()) {
+    // Workers that left during the job are done with it now
+    dead_workers_.insert(departed_workers_.begin(), departed_workers_.end());
+  }
+}
+
+void MasterImpl::send_job(JobState& job, i32 node_id) {
+  proto::JobParameters params;
+  params.CopyFrom(job.worker_params);
+  i32 local_id, local_total;
+  std::tie(local_id, local_total) = local_worker_index(node_id);
+  params.set_local_id(local_id);
+  params.set_local_total(local_total);
+  params.set_global_total(workers_.size());
+  params.set_metadata_version(metadata_version_);
+  // Only send descriptors the worker does not have yet
+  std::map<i32, i64>& sent_versions = worker_table_versions_[node_id];
+  for (i32 table_id : job.worker_tables) {
+    auto sent = sent_versions.find(table_id);
+    if (sent != sent_versions.end() &&
+        sent->second == table_versions_.at(table_id)) {
+      continue;
+    }
+    params.add_table_descriptors()->CopyFrom(
+        table_cache_.at(table_id).get_descriptor());
+    for (auto& video : table_videos_[table_id]) {
+      params.add_video_descriptors()->CopyFrom(video);
+    }
+    sent_versions[table_id] = table_versions_.at(table_id);
+  }
+  std::unique_ptr<WorkerCall> call(new WorkerCall);
+  call->node_id = node_id;
+  call->rpc =
+      workers_[node_id]->AsyncNewJob(&call->context, params, &job.worker_cq);
+  call->rpc->Finish(&call->reply, &call->status, call.get());
+  job.worker_calls.push_back(std::move(call));
+  job.worker_nodes.insert(node_id);
+}
+
+std::tuple<i32, i32> MasterImpl::local_worker_index(i32 node_id) {
+  std::string host = split(addresses_[node_id], ':')[0];
+  i32 local_id = 0;
+  i32 local_total = 0;
+  for (i32 i = 0; i < (i32)addresses_.size(); ++i) {
+    if (split(addresses_[i], ':')[0] == host) {
+      if (i < node_id) {
+        local_id++;
+      }
+      local_total++;
+    }
+  }
+  return std::make_tuple(local_id, local_total);
+}
+
+void MasterImpl::join_worker(std::shared_ptr<grpc::Channel> channel,
+                             proto::Worker::Stub* worker, i32 node_id,
+                             std::vector<std::string> op_paths) {
+  auto deadline = std::chrono::system_clock::now() +
+                  std::chrono::seconds(WORKER_JOIN_TIMEOUT_S);
+  if (!channel->WaitForConnected(deadline)) {
+    LOG(WARNING) << "Worker " << node_id
+                 << " did not start serving, so it gets no running jobs";
+    return;
+  }
+  for (const std::string& path : op_paths) {
+    grpc::ClientContext ctx;
+    proto::OpPath op_path;
+    op_path.set_path(path);
+    proto::Empty empty;
+    worker->LoadOp(&ctx, op_path, &empty);
+  }
+
+  std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
+  std::unique_lock<std::mutex> lk(work_mutex_);
+  if (dead_workers_.count(node_id) > 0 ||
+      departed_workers_.count(node_id) > 0) {
+    return;
+  }
+  for (auto& kv : jobs_) {
+    JobState& job = *kv.second;
+    if (!job.closed && job.worker_nodes.count(node_id) == 0) {
+      VLOG(1) << "Sending job " << kv.first << " to worker " << node_id
+              << ", which registered while it ran";
+      send_job(job, node_id);
+    }
+  }
+}
+
+void MasterImpl::stream_item(JobState& job, i32 table_id, i64 item,
+                             proto::StreamedItem* output) {
+  i64 task = job.table_tasks.at(table_id);
+  if (output != nullptr) {
+    output->set_table_name(
+        job.params.task_set().tasks(task).output_table_name());
+  }
+  job.task_items_left[task]--;
+  std::vector<proto::JobOutput> outputs;
+  std::vector<TableMetadata> tables;
+  if (!job.params.stream_ordered()) {
+    if (output != nullptr) {
+      outputs.emplace_back();
+      outputs.back().mutable_item()->Swap(output);
+    }
+    if (job.task_items_left[task] == 0) {
+      outputs.push_back(finished_task_output(job, task, tables));
+    }
+  } else {
+    // Committed items without output are kept as empty entries
+    proto::StreamedItem& pending =
+        job.ordered_outputs[std::make_tuple(task, item)];
+    if (output != nullptr) {
+      pending.Swap(output);
+    }
+    advance_ordered_stream(job, outputs, tables);
+  }
+  send_outputs(job, outputs, tables);
+}
+
+void MasterImpl::advance_ordered_stream(
+    JobState& job, std::vector<proto::JobOutput>& outputs,
+    std::vector<TableMetadata>& tables) {
+  while (job.next_stream_task < job.num_tasks) {
+    i64 t = job.next_stream_task;
+    i64 item = job.next_stream_item;
+    if (item >= job.task_items[t]) {
+      outputs.push_back(finished_task_output(job, t, tables));
+      job.next_stream_task++;
+      job.next_stream_item = 0;
+      continue;
+    }
+    // Items written by a previous run are not computed again
+    if (job.completed_items.count(
+            std::make_tuple(job.task_tables[t], item)) == 0) {
+      auto it = job.ordered_outputs.find(std::make_tuple(t, item));
+      if (it == job.ordered_outputs.end()) {
+        break;
+      }
+      if (it->second.has_io_item()) {
+        outputs.emplace_back();
+        outputs.back().mutable_item()->Swap(&it->second);
+      }
+      job.ordered_outputs.erase(it);
+    }
+    job.next_stream_item++;
+  }
+}
+
+proto::JobOutput MasterImpl::finished_task_output(
+    JobState& job, i64 task, std::vector<TableMetadata>& tables) {
+  const proto::Task& t = job.params.task_set().tasks(task);
+  proto::JobOutput output;
+  proto::FinishedTask* finished = output.mutable_task();
+  finished->set_task_index(task);
+  finished->add_table_names(t.output_table_name());
+  for (auto& name : t.shared_output_table_names()) {
+    finished->add_table_names(name);
+  }
+  // Each item of a filtered table holds only the rows the filters kept, so
+  // its end rows are known once all of them are committed
+  TableMetadata table = job.table_metas.at(t.output_table_name());
+  if (table.filtered_rows()) {
+    proto::TableDescriptor& table_desc = table.get_descriptor();
+    i64 end_row = 0;
+    for (i64 item = 0; item < table_desc.end_rows_size(); ++item) {
+      auto it = job.filtered_item_rows.find(std::make_tuple(table.id(), item));
+      if (it == job.filtered_item_rows.end()) {
+        return output;
+      }
+      end_row += it->second;
+      table_desc.set_end_rows(item, end_row);
+    }
+    tables.push_back(table);
+  }
+  return output;
+}
+
+void MasterImpl::send_outputs(JobState& job,
+                              std::vector<proto::JobOutput>& outputs,
+                              std::vector<TableMetadata>& tables) {
+  if (outputs.empty()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lk(job.stream->mutex);
+    for (auto& table : tables) {
+      job.stream->tables.push_back(table);
+    }
+    for (auto& output : outputs) {
+      job.stream->outputs.emplace_back();
+      job.stream->outputs.back().Swap(&output);
+    }
+  }
+  job.stream->ready.notify_all();
+}
+
+void MasterImpl::refresh_table_cache(const DatabaseMetadata& meta) {
+  std::set<std::string> stale_tables;
+  {
+    std::lock_guard<std::mutex> lock(stale_tables_mutex_);
+    stale_tables.swap(stale_tables_);
+  }
+  for (auto it = table_cache_.begin(); it != table_cache_.end();) {
+    if (!meta.has_table(it->first) ||
+        stale_tables.count(it->second.name()) > 0) {
+      table_versions_.erase(it->first);
+      table_videos_.erase(it->first);
+      it = table_cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  std::set<i32> missing_tables;
+  for (const std::string& table_name : meta.table_names()) {
+    i32 table_id = meta.get_table_id(table_name);
+    if (table_cache_.count(table_id) == 0) {
+      missing_tables.insert(table_id);
+    }
+  }
+  if (missing_tables.empty()) {
+    return;
+  }
+  // Tables are only rewritten by the master, which drops those it adds
+  // items to, so new ids are the only ones that need reading
+  Manifest manifest = read_manifest(storage_, meta);
+  metadata_version_++;
+  for (auto& kv : manifest.videos) {
+    i32 table_id = std::get<0>(kv.first);
+    if (missing_tables.count(table_id) > 0) {
+      table_videos_[table_id].push_back(kv.second);
+    }
+  }
+  for (i32 table_id : missing_tables) {
+    auto it = manifest.tables.find(table_id);
+    if (it != manifest.tables.end()) {
+      table_cache_[table_id] = TableMetadata(it->second);
+    } else {
+      table_cache_[table_id] = read_table_metadata(
+          storage_, TableMetadata::descriptor_path(table_id));
+    }
+    table_versions_[table_id] = metadata_version_;
+  }
+  VLOG(1) << "Read metadata of " << missing_tables.size() << " new tables";
+}
+
+void MasterImpl::uncache_tables(const std::vector<std::string>& table_names) {
+  std::lock_guard<std::mutex> lock(stale_tables_mutex_);
+  stale_tables_.insert(table_names.begin(), table_names.end());
+}
+
+KeyframeIndex MasterImpl::cached_keyframe_index(const TableMetadata& table) {
+  std::vector<proto::VideoDescriptor>& videos = table_videos_[table.id()];
+  std::set<std::tuple<i32, i32>> cached;
+  for (const proto::VideoDescriptor& video : videos) {
+    cached.insert(std::make_tuple(video.column_id(), video.item_id()));
+  }
+  i32 num_items = table.end_rows().size();
+  for (const Column& column : table.columns()) {
+    if (column.type() != ColumnType::Video) {
+      continue;
+    }
+    for (i32 item = 0; item < num_items; ++item) {
+      if (cached.count(std::make_tuple(column.id(), item)) == 0) {
+        videos.push_back(
+            read_video_metadata(storage_, VideoMetadata::descriptor_path(
+                                              table.id(), column.id(), item))
+                .get_descriptor());
+      }
+    }
+    // Only the first video column is aligned to
+    break;
+  }
+  return table_keyframe_index(table, videos);
+}
+
+void MasterImpl::cache_table(
+    const TableMetadata& table,
+    const std::vector<proto::VideoDescriptor>& videos) {
+  metadata_version_++;
+  table_cache_[table.id()] = table;
+  table_videos_[table.id()] = videos;
+  table_versions_[table.id()] = metadata_version_;
 }
 
 grpc::Status MasterImpl::Ping(grpc::ServerContext* context,
@@ -651,6 +1875,7 @@ grpc::Status MasterImpl::GetOpInfo(grpc::ServerContext* context,
   OpInfo* info = registry->get_op_info(op_name);
 
   op_info->set_variadic_inputs(info->variadic_inputs());
+  op_info->set_max_input_height(info->max_input_height());
   for (auto& input_column : info->input_columns()) {
     Column* info = op_info->add_input_columns();
     info->CopyFrom(input_column);
@@ -681,6 +1906,13 @@ grpc::Status MasterImpl::LoadOp(grpc::ServerContext* context,
     return grpc::Status::OK;
   }
 
+  // Workers register under this lock, and those registering later load the
+  // recorded libraries when they join
+  std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    op_paths_.push_back(so_path);
+  }
   for (auto& worker : workers_) {
     grpc::ClientContext ctx;
     proto::Empty empty;
@@ -698,19 +1930,652 @@ grpc::Status MasterImpl::Shutdown(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status MasterImpl::GetMetrics(grpc::ServerContext* context,
+                                    const proto::Empty* empty,
+                                    proto::Metrics* metrics) {
+  proto::NodeMetrics* master = metrics->mutable_master();
+  master->set_node_id(-1);
+  MetricValues values = metric_values();
+  master->mutable_counters()->insert(values.counters.begin(),
+                                     values.counters.end());
+  master->mutable_gauges()->insert(values.gauges.begin(),
+                                   values.gauges.end());
+  std::vector<i32> live_workers;
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    auto& gauges = *master->mutable_gauges();
+    for (auto& kv : jobs_) {
+      std::string labels = "{job=\"" + std::to_string(kv.first) + "\"}";
+      JobState& job = *kv.second;
+      gauges["scanner_job_tasks" + labels] = job.num_tasks;
+      gauges["scanner_job_committed_items" + labels] = job.committed_items;
+      gauges["scanner_job_active_items" + labels] = job.active_items.size();
+    }
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      if (dead_workers_.count(i) == 0) {
+        live_workers.push_back(i);
+      }
+    }
+  }
+  // A worker that does not answer in time is left out rather than holding up
+  // the report
+  for (i32 i : live_workers) {
+    grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() +
+                     std::chrono::milliseconds(WORKER_HEARTBEAT_TIMEOUT_MS));
+    proto::NodeMetrics worker_metrics;
+    grpc::Status status =
+        workers_[i]->GetMetrics(&ctx, *empty, &worker_metrics);
+    if (status.ok()) {
+      metrics->add_workers()->Swap(&worker_metrics);
+    }
+  }
+  return grpc::Status::OK;
+}
+
 grpc::Status MasterImpl::PokeWatchdog(grpc::ServerContext* context,
                                       const proto::Empty* empty,
                                       proto::Empty* result) {
   watchdog_awake_ = true;
-  for (auto& w : workers_) {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    {
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      if (dead_workers_.count(i) > 0) {
+        continue;
+      }
+    }
     grpc::ClientContext ctx;
+    ctx.set_deadline(std::chrono::system_clock::now() +
+                     std::chrono::milliseconds(WORKER_HEARTBEAT_TIMEOUT_MS));
     proto::Empty empty;
     proto::Empty empty2;
-    w->PokeWatchdog(&ctx, empty, &empty2);
+    grpc::Status status = workers_[i]->PokeWatchdog(&ctx, empty, &empty2);
+    if (!status.ok()) {
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      remove_worker(i);
+    }
   }
   return grpc::Status::OK;
 }
 
+bool MasterImpl::next_work_item(JobState& job, i32 node_id,
+                                proto::NewWork& new_work) {
+  // Items from dead workers take priority over new items since the job
+  // can not finish without them
+  for (auto it = job.reassigned_work.begin(); it != job.reassigned_work.end();
+       ++it) {
+    std::vector<std::tuple<i32, i64>> inputs =
+        item_inputs(job.input_end_rows, *it);
+    if (runs_on(job, inputs, node_id)) {
+      new_work.CopyFrom(*it);
+      job.reassigned_work.erase(it);
+      record_reads(node_id, inputs);
+      return true;
+    }
+  }
+  if (job.params.max_items() > 0 &&
+      job.total_samples_used >= job.params.max_items()) {
+    // A calibration run ends here, as if it had run out of work
+    job.next_task = job.num_tasks;
+    job.samples_left = 0;
+    job.pending_items.clear();
+    return false;
+  }
+  while (job.pending_items.size() < LOCALITY_LOOKAHEAD) {
+    PendingItem pending;
+    if (!next_sampled_item(job, pending.work)) {
+      break;
+    }
+    pending.inputs = item_inputs(job.input_end_rows, pending.work);
+    job.pending_items.push_back(std::move(pending));
+  }
+  if (!job.task_result.success() || job.pending_items.empty()) {
+    return false;
+  }
+  std::vector<u8> runnable;
+  for (const PendingItem& pending : job.pending_items) {
+    runnable.push_back(runs_on(job, pending.inputs, node_id));
+  }
+  auto first_runnable =
+      std::find(runnable.begin(), runnable.end(), true) - runnable.begin();
+  if (first_runnable == (i64)runnable.size()) {
+    return false;
+  }
+
+  auto cached_on = [this](const PendingItem& pending, i32 node) {
+    auto reads = node_reads_.find(node);
+    if (reads == node_reads_.end()) {
+      return false;
+    }
+    for (auto& input : pending.inputs) {
+      if (reads->second.items.count(input) > 0) {
+        return true;
+      }
+    }
+    return false;
+  };
+  auto chosen = job.pending_items.begin() + first_runnable;
+  if (workers_.size() - dead_workers_.size() > 1 &&
+      chosen->skips < LOCALITY_MAX_SKIPS) {
+    // An item with inputs this worker read, or else one no other worker
+    // read, so that the items other workers have cached are left to them
+    auto cold = job.pending_items.end();
+    auto warm = job.pending_items.end();
+    for (auto it = job.pending_items.begin(); it != job.pending_items.end();
+         ++it) {
+      if (!runnable[it - job.pending_items.begin()]) {
+        continue;
+      }
+      if (cached_on(*it, node_id)) {
+        warm = it;
+        break;
+      }
+      if (cold != job.pending_items.end()) {
+        continue;
+      }
+      bool cached_elsewhere = false;
+      for (auto& kv : node_reads_) {
+        if (kv.first != node_id && dead_workers_.count(kv.first) == 0 &&
+            cached_on(*it, kv.first)) {
+          cached_elsewhere = true;
+          break;
+        }
+      }
+      if (!cached_elsewhere) {
+        cold = it;
+      }
+    }
+    if (warm != job.pending_items.end()) {
+      chosen = warm;
+    } else if (cold != job.pending_items.end()) {
+      chosen = cold;
+    }
+    for (auto it = job.pending_items.begin(); it != chosen; ++it) {
+      if (runnable[it - job.pending_items.begin()]) {
+        it->skips++;
+      }
+    }
+  }
+  new_work.Swap(&chosen->work);
+  record_reads(node_id, chosen->inputs);
+  job.pending_items.erase(chosen);
+  job.total_samples_used++;
+  return true;
+}
+
+bool MasterImpl::next_sampled_item(JobState& job, proto::NewWork& new_work) {
+  // Skip over items which were completed by a previous run of the job
+  while (true) {
+    if (job.samples_left <= 0) {
+      if (job.next_task < job.num_tasks && job.task_result.success()) {
+        // More tasks left
+        job.task_sampler = job.task_samplers->next();
+        job.task_result = job.task_sampler->validate();
+        if (job.task_result.success()) {
+          job.samples_left = job.task_sampler->total_samples();
+          job.next_task++;
+          VLOG(1) << "Tasks left: " << job.num_tasks - job.next_task;
+        }
+      } else {
+        // No more tasks left
+        return false;
+      }
+    }
+    if (!job.task_result.success()) {
+      return false;
+    }
+
+    assert(job.samples_left > 0);
+    job.task_result = job.task_sampler->next_work(new_work);
+    if (!job.task_result.success()) {
+      return false;
+    }
+
+    job.samples_left--;
+    const proto::IOItem& item = new_work.io_item();
+    if (job.completed_items.count(
+            std::make_tuple(item.table_id(), item.item_id())) > 0) {
+      // Already written out by a previous run of this job
+      new_work.Clear();
+      continue;
+    }
+    return true;
+  }
+}
+
+void MasterImpl::record_reads(
+    i32 node_id, const std::vector<std::tuple<i32, i64>>& inputs) {
+  NodeReads& reads = node_reads_[node_id];
+  for (auto& input : inputs) {
+    auto it = reads.items.find(input);
+    if (it != reads.items.end()) {
+      reads.order.erase(it->second);
+    }
+    reads.order.push_front(input);
+    reads.items[input] = reads.order.begin();
+    if (reads.order.size() > LOCALITY_TRACKED_ITEMS) {
+      reads.items.erase(reads.order.back());
+      reads.order.pop_back();
+    }
+  }
+}
+
+bool MasterImpl::runs_on(JobState& job,
+                         const std::vector<std::tuple<i32, i64>>& inputs,
+                         i32 node_id) {
+  std::string owner;
+  for (auto& input : inputs) {
+    auto it = job.input_item_nodes.find(std::get<0>(input));
+    if (it == job.input_item_nodes.end() ||
+        std::get<1>(input) >= (i64)it->second.size() ||
+        it->second[std::get<1>(input)].empty()) {
+      continue;
+    }
+    const std::string& address = it->second[std::get<1>(input)];
+    if (!owner.empty() && address != owner) {
+      if (job.task_result.success()) {
+        RESULT_ERROR(&job.task_result,
+                     "An item reads local items held by workers %s and %s",
+                     owner.c_str(), address.c_str());
+      }
+      return false;
+    }
+    owner = address;
+  }
+  if (owner.empty() || addresses_.at(node_id) == owner) {
+    return true;
+  }
+  for (i32 i = 0; i < (i32)addresses_.size(); ++i) {
+    if (addresses_[i] == owner && dead_workers_.count(i) == 0 &&
+        departed_workers_.count(i) == 0) {
+      return false;
+    }
+  }
+  if (job.task_result.success()) {
+    RESULT_ERROR(&job.task_result,
+                 "Worker %s, which holds local items the job reads, is no "
+                 "longer in the cluster",
+                 owner.c_str());
+  }
+  return false;
+}
+
+bool MasterImpl::next_speculative_item(JobState& job, i32 node_id,
+                                       proto::NewWork& new_work) {
+  f64 average_seconds = job.committed_items > 0
+                            ? job.committed_item_seconds / job.committed_items
+                            : 0;
+  ActiveItem* slowest = nullptr;
+  f64 slowest_seconds = 0;
+  for (auto& kv : job.active_items) {
+    ActiveItem& active = kv.second;
+    if (active.nodes.count(node_id) > 0 ||
+        active.nodes.size() >= MAX_ITEM_COPIES ||
+        !runs_on(job, item_inputs(job.input_end_rows, active.work),
+                 node_id)) {
+      continue;
+    }
+    f64 elapsed = nano_since(active.start) / 1e9;
+    if (elapsed > slowest_seconds) {
+      slowest = &active;
+      slowest_seconds = elapsed;
+    }
+  }
+  if (slowest == nullptr || job.committed_items == 0 ||
+      slowest_seconds < average_seconds * STRAGGLER_SLOWDOWN_FACTOR) {
+    return false;
+  }
+  VLOG(1) << "Speculatively re-executing item "
+          << slowest->work.io_item().item_id() << " of table "
+          << slowest->work.io_item().table_id() << " on node " << node_id;
+  new_work.CopyFrom(slowest->work);
+  slowest->nodes.insert(node_id);
+  return true;
+}
+
+Result MasterImpl::ingest_on_workers(const proto::IngestParameters& params,
+                                     std::vector<FailedVideo>& failed_videos) {
+  set_database_path(db_params_.db_path);
+  std::vector<std::string> table_names(params.table_names().begin(),
+                                       params.table_names().end());
+  std::vector<std::string> paths(params.video_paths().begin(),
+                                 params.video_paths().end());
+
+  DatabaseMetadata meta =
+      read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
+  std::vector<i32> table_ids;
+  std::vector<u8> appended;
+  Result result = add_ingest_tables(meta, table_names, params.append(),
+                                    table_ids, appended);
+  if (!result.success()) {
+    return result;
+  }
+
+  auto start = now();
+  std::vector<i32> worker_ids;
+  {
+    std::unique_lock<std::mutex> lk(work_mutex_);
+    for (i32 i = 0; i < (i32)workers_.size(); ++i) {
+      if (dead_workers_.count(i) == 0) {
+        worker_ids.push_back(i);
+      }
+    }
+  }
+  size_t num_videos = table_names.size();
+  size_t batch_size = std::max(
+      std::min(num_videos / (worker_ids.size() * INGEST_BATCHES_PER_WORKER),
+               MAX_INGEST_BATCH_SIZE),
+      (size_t)1);
+  std::deque<std::vector<size_t>> batches;
+  for (size_t i = 0; i < num_videos; i += batch_size) {
+    batches.emplace_back();
+    for (size_t j = i; j < std::min(i + batch_size, num_videos); ++j) {
+      batches.back().push_back(j);
+    }
+  }
+
+  std::mutex ingest_mutex;
+  std::vector<u8> failed(num_videos, false);
+  std::vector<std::string> failed_messages(num_videos);
+  proto::DatabaseManifest manifest;
+  // Serialized profilers of each batch
+  std::vector<std::string> profiles;
+  std::vector<std::thread> threads;
+  for (i32 worker_id : worker_ids) {
+    threads.emplace_back([&, worker_id]() {
+      while (true) {
+        std::vector<size_t> batch;
+        {
+          std::unique_lock<std::mutex> lk(ingest_mutex);
+          if (batches.empty()) {
+            return;
+          }
+          batch = std::move(batches.front());
+          batches.pop_front();
+        }
+        proto::IngestWork work;
+        for (size_t i : batch) {
+          work.add_table_names(table_names[i]);
+          work.add_table_ids(table_ids[i]);
+          work.add_video_paths(paths[i]);
+          work.add_appended(appended[i]);
+        }
+        work.set_num_threads(params.num_threads());
+        work.set_segment_size(params.segment_size());
+        work.set_in_place(params.in_place());
+        work.mutable_transcode()->CopyFrom(params.transcode());
+
+        grpc::ClientContext ctx;
+        proto::IngestWorkResult reply;
+        grpc::Status status =
+            workers_[worker_id]->IngestVideos(&ctx, work, &reply);
+        if (!status.ok()) {
+          // Another worker, or the master, picks the batch up instead
+          {
+            std::unique_lock<std::mutex> lk(work_mutex_);
+            remove_worker(worker_id);
+          }
+          std::unique_lock<std::mutex> lk(ingest_mutex);
+          batches.push_back(std::move(batch));
+          return;
+        }
+        std::unique_lock<std::mutex> lk(ingest_mutex);
+        manifest.MergeFrom(reply.manifest());
+        profiles.push_back(reply.profile());
+        for (i32 f = 0; f < reply.failed_videos_size(); ++f) {
+          size_t i = batch[reply.failed_videos(f)];
+          failed[i] = true;
+          failed_messages[i] = reply.failed_messages(f);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (!batches.empty()) {
+    std::vector<size_t> left;
+    for (auto& batch : batches) {
+      left.insert(left.end(), batch.begin(), batch.end());
+    }
+    LOG(WARNING) << "Ingesting " << left.size()
+                 << " videos on the master since no worker could take them";
+    std::vector<std::string> left_names;
+    std::vector<i32> left_ids;
+    std::vector<u8> left_appended;
+    std::vector<std::string> left_paths;
+    for (size_t i : left) {
+      left_names.push_back(table_names[i]);
+      left_ids.push_back(table_ids[i]);
+      left_appended.push_back(appended[i]);
+      left_paths.push_back(paths[i]);
+    }
+    std::vector<u8> left_failed;
+    std::vector<std::string> left_messages;
+    std::vector<Profiler> profilers;
+    ingest_video_tables(storage_, left_names, left_ids, left_appended,
+                        left_paths, params.num_threads(),
+                        params.segment_size(), params.in_place(),
+                        params.transcode(), left_failed, left_messages,
+                        manifest, profilers);
+    profiles.push_back(
+        serialize_ingest_profilers(MASTER_PROFILER_NODE, "", profilers));
+    for (size_t j = 0; j < left.size(); ++j) {
+      failed[left[j]] = left_failed[j];
+      failed_messages[left[j]] = left_messages[j];
+    }
+  }
+
+  std::vector<Profiler> commit_profiler = {Profiler(timepoint_t())};
+  auto commit_start = now();
+  result = commit_ingest(storage_, meta, table_ids, appended, paths, failed,
+                         failed_messages, manifest, failed_videos);
+  commit_profiler[0].add_interval("commit", commit_start, now());
+  profiles.push_back(serialize_ingest_profilers(MASTER_PROFILER_NODE, "commit",
+                                                commit_profiler));
+  write_ingest_profile(storage_, start, now(), profiles);
+  return result;
+}
+
+void MasterImpl::remove_worker(i32 node_id) {
+  if (dead_workers_.count(node_id) > 0) {
+    return;
+  }
+  LOG(WARNING) << "Worker " << node_id << " (" << addresses_[node_id]
+               << ") stopped responding. Reassigning its work.";
+  dead_workers_.insert(node_id);
+  cancelled_items_.erase(node_id);
+  node_reads_.erase(node_id);
+  for (auto& kv : jobs_) {
+    JobState& job = *kv.second;
+    job.lease_stats.erase(node_id);
+    for (auto it = job.active_items.begin(); it != job.active_items.end();) {
+      ActiveItem& active = it->second;
+      active.nodes.erase(node_id);
+      if (active.nodes.empty()) {
+        job.reassigned_work.push_back(active.work);
+        it = job.active_items.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+i32 MasterImpl::lease_size(JobState& job, i32 node_id, i32 items_requested) {
+  timepoint_t current_time = now();
+  i32 min_size = std::max(job.params.min_lease_size(), 1);
+  i32 max_size = job.params.max_lease_size();
+
+  i32 granted = items_requested;
+  auto it = job.lease_stats.find(node_id);
+  if (it == job.lease_stats.end()) {
+    // No history for this worker yet, so start with the smallest lease
+    granted = min_size;
+  } else {
+    // The worker asks for more work once it has room in its queues, so the
+    // time between requests approximates how long the last lease took
+    LeaseStats& stats = it->second;
+    f64 elapsed = nano_since(stats.last_request) / 1e9;
+    if (elapsed > 0 && stats.last_lease_size > 0) {
+      f64 rate = stats.last_lease_size / elapsed;
+      stats.items_per_second =
+          stats.items_per_second == 0
+              ? rate
+              : LEASE_RATE_SMOOTHING * rate +
+                    (1 - LEASE_RATE_SMOOTHING) * stats.items_per_second;
+    }
+    // Grow leases for fast workers so they make fewer requests
+    i32 target = (i32)(stats.items_per_second * LEASE_TARGET_SECONDS);
+    granted = std::min(granted, std::max(target, min_size));
+  }
+
+  // Shrink leases near the end of the job so no worker is left holding a
+  // long tail of items while others sit idle
+  i64 items_left = job.total_samples - job.total_samples_used;
+  i64 num_workers = std::max((i64)workers_.size(), (i64)1);
+  i64 fair_share = (items_left + 2 * num_workers - 1) / (2 * num_workers);
+  granted = std::min((i64)granted, std::max(fair_share, (i64)min_size));
+
+  if (max_size > 0) {
+    granted = std::min(granted, max_size);
+  }
+  granted = std::max(std::min(granted, items_requested), 1);
+
+  LeaseStats& stats = job.lease_stats[node_id];
+  stats.last_request = current_time;
+  stats.last_lease_size = granted;
+  return granted;
+}
+
+i32 MasterImpl::fair_share(JobState& job, i32 node_id, i32 items_requested) {
+  auto has_work = [](const JobState& state) {
+    return !state.reassigned_work.empty() || !state.pending_items.empty() ||
+           state.samples_left > 0 || state.next_task < state.num_tasks;
+  };
+  if (!has_work(job)) {
+    // Only copies of outstanding items are left, which need no share
+    return items_requested;
+  }
+  // Jobs are weighted by priority among those with items left to hand out,
+  // since the others can not use a larger share
+  f64 total_weight = 0;
+  i64 node_items = 0;
+  i64 job_node_items = 0;
+  for (auto& kv : jobs_) {
+    JobState& other = *kv.second;
+    if (has_work(other)) {
+      total_weight += std::max(other.params.priority(), 1);
+    }
+    for (auto& item : other.active_items) {
+      if (item.second.nodes.count(node_id) > 0) {
+        node_items++;
+        if (&other == &job) {
+          job_node_items++;
+        }
+      }
+    }
+  }
+  f64 weight = std::max(job.params.priority(), 1);
+  if (total_weight <= weight) {
+    // No other job is waiting for work
+    return items_requested;
+  }
+  i64 share = (i64)std::ceil(weight / total_weight *
+                             (node_items + items_requested)) -
+              job_node_items;
+  if (job_node_items == 0) {
+    // Every job keeps making progress on each worker
+    share = std::max(share, (i64)1);
+  }
+  return (i32)std::max(std::min(share, (i64)items_requested), (i64)0);
+}
+
+void MasterImpl::collect_deleted_tables() {
+  storehouse::StorageConfig* config = db_params_.storage_config;
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(config));
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> storages(
+      GC_THREADS);
+  for (auto& s : storages) {
+    s.reset(storehouse::StorageBackend::make_from_config(config));
+  }
+  WorkStealingPool pool(GC_THREADS);
+  while (!trigger_shutdown_.raised()) {
+    trigger_shutdown_.wait_for(GC_INTERVAL_MS);
+    {
+      // Tables removed while a job runs may still be read by it
+      std::unique_lock<std::mutex> lk(work_mutex_);
+      if (!jobs_.empty()) {
+        continue;
+      }
+    }
+    std::vector<i32> table_ids;
+    {
+      std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
+      storehouse::FileInfo info;
+      if (storage->get_file_info(DatabaseMetadata::descriptor_path(), info) !=
+          storehouse::StoreResult::Success) {
+        continue;
+      }
+      for (i32 table_id :
+           read_database_metadata(storage.get(),
+                                  DatabaseMetadata::descriptor_path())
+               .deleted_tables()) {
+        if (collected_tables_.count(table_id) == 0) {
+          table_ids.push_back(table_id);
+        }
+      }
+    }
+    if (table_ids.empty()) {
+      continue;
+    }
+
+    std::vector<i32> deleted;
+    for (i32 table_id : table_ids) {
+      std::string descriptor_path = TableMetadata::descriptor_path(table_id);
+      storehouse::FileInfo info;
+      if (storage->get_file_info(descriptor_path, info) ==
+          storehouse::StoreResult::Success) {
+        TableMetadata table =
+            read_table_metadata(storage.get(), descriptor_path);
+        std::vector<std::string> paths = table_item_paths(table);
+        std::vector<std::string> index_paths;
+        vector_index_paths(storage.get(), table, paths, index_paths);
+        for (size_t start = 0; start < paths.size(); start += GC_BATCH_SIZE) {
+          size_t end = std::min(paths.size(), start + GC_BATCH_SIZE);
+          pool.submit([&, start, end](i32 thread_id) {
+            for (size_t i = start; i < end && !trigger_shutdown_.raised();
+                 ++i) {
+              // Items that were never written fail to delete, which is fine
+              storages[thread_id]->delete_file(paths[i]);
+            }
+          });
+        }
+        pool.wait_idle();
+        if (trigger_shutdown_.raised()) {
+          break;
+        }
+        // The descriptors go last, so a pass that stops early finds the
+        // files they name again
+        for (const std::string& path : index_paths) {
+          storage->delete_file(path);
+        }
+        storage->delete_file(descriptor_path);
+      }
+      deleted.push_back(table_id);
+    }
+
+    // The metadata is not written here, since clients write it directly
+    // between jobs and a read-modify-write would race with them. The
+    // tombstones are cleared when the next job commits.
+    std::unique_lock<std::mutex> meta_lk(metadata_mutex_);
+    collected_tables_.insert(deleted.begin(), deleted.end());
+    VLOG(1) << "Deleted the files of " << deleted.size() << " removed tables";
+  }
+}
+
 void MasterImpl::start_watchdog(grpc::Server* server, i32 timeout_ms) {
   watchdog_thread_ = std::thread([this, server, timeout_ms]() {
     double time_since_check = 0;
@@ -22,7 +22,10 @@
 #include "scanner/util/progress_bar.h"
 #include "scanner/util/util.h"
 
+#include <condition_variable>
+#include <list>
 #include <mutex>
+#include <set>
 #include <thread>
 
 namespace scanner {
@@ -44,6 +47,10 @@ class MasterImpl final : public proto::Master::Service {
                               const proto::WorkerParams* worker_info,
                               proto::Registration* registration);
 
+  grpc::Status UnregisterWorker(grpc::ServerContext* context,
+                                const proto::NodeInfo* node_info,
+                                proto::Empty* empty);
+
   grpc::Status ActiveWorkers(grpc::ServerContext* context,
                              const proto::Empty* empty,
                              proto::RegisteredWorkers* registered_workers);
@@ -52,14 +59,30 @@ class MasterImpl final : public proto::Master::Service {
                             const proto::IngestParameters* params,
                             proto::IngestResult* result);
 
+  grpc::Status IngestStream(grpc::ServerContext* context,
+                            const proto::IngestStreamParameters* params,
+                            proto::Result* result);
+
+  grpc::Status IngestImages(grpc::ServerContext* context,
+                            const proto::IngestImagesParameters* params,
+                            proto::IngestResult* result);
+
   grpc::Status NextWork(grpc::ServerContext* context,
                         const proto::NodeInfo* node_info,
-                        proto::NewWork* new_work);
+                        proto::WorkLease* lease);
+
+  grpc::Status FinishedWork(grpc::ServerContext* context,
+                            const proto::FinishedWorkParameters* params,
+                            proto::FinishedWorkReply* reply);
 
   grpc::Status NewJob(grpc::ServerContext* context,
                       const proto::JobParameters* job_params,
                       proto::Result* job_result);
 
+  grpc::Status StreamJob(grpc::ServerContext* context,
+                         const proto::JobParameters* job_params,
+                         grpc::ServerWriter<proto::JobOutput>* writer);
+
   grpc::Status Ping(grpc::ServerContext* context, const proto::Empty* empty1,
                     proto::Empty* empty2);
 
@@ -76,29 +99,285 @@ class MasterImpl final : public proto::Master::Service {
   grpc::Status PokeWatchdog(grpc::ServerContext* context,
                             const proto::Empty* empty, proto::Empty* result);
 
+  grpc::Status GetMetrics(grpc::ServerContext* context,
+                          const proto::Empty* empty, proto::Metrics* metrics);
+
   void start_watchdog(grpc::Server* server, i32 timeout_ms = 50000);
 
  private:
+  // Items which have been handed out but not yet committed by any worker
+  struct ActiveItem {
+    proto::NewWork work;
+    timepoint_t start;
+    std::set<i32> nodes;
+  };
+
+  // Item pulled from the task samplers but not handed out yet, with the
+  // input items it reads
+  struct PendingItem {
+    proto::NewWork work;
+    std::vector<std::tuple<i32, i64>> inputs;
+    // Times a later item was handed out first
+    i32 skips = 0;
+  };
+
+  // Input items a worker read most recently, newest first
+  struct NodeReads {
+    std::list<std::tuple<i32, i64>> order;
+    std::map<std::tuple<i32, i64>, std::list<std::tuple<i32, i64>>::iterator>
+        items;
+  };
+
+  // Per worker lease history used for adaptive lease sizing
+  struct LeaseStats {
+    timepoint_t last_request;
+    i32 last_lease_size = 0;
+    f64 items_per_second = 0;
+  };
+
+  // Outputs of a job handed from FinishedWork to the StreamJob call that
+  // sends them to the client
+  struct OutputStream {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<proto::JobOutput> outputs;
+    // Descriptors of the filtered tables of finished tasks, which are
+    // written out before the outputs that follow them are sent
+    std::deque<TableMetadata> tables;
+    bool finished = false;
+  };
+
+  // NewJob call to a worker, tagged with itself on the job's queue
+  struct WorkerCall {
+    i32 node_id;
+    grpc::ClientContext context;
+    proto::Result reply;
+    grpc::Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<proto::Result>> rpc;
+  };
+
+  // Work handed out for a job that is running. Several jobs may run at once,
+  // each with its own pipelines on the workers.
+  struct JobState {
+    proto::JobParameters params;
+    std::unique_ptr<ProgressBar> bar;
+    // Tables the job's task samplers read and write
+    std::map<std::string, TableMetadata> table_metas;
+    // GOPs of the tables the job samples, for the samplers that use them
+    std::map<std::string, KeyframeIndex> table_keyframes;
+    // Zone maps of the columns the job's ZoneMap samplers select by
+    std::map<std::string, ZoneMaps> table_zone_maps;
+
+    i64 total_samples_used = 0;
+    i64 total_samples = 0;
+
+    i64 next_task = 0;
+    i64 num_tasks = 0;
+    std::unique_ptr<TaskSampler> task_sampler;
+    // Builds the samplers of the tasks after the current one
+    std::unique_ptr<TaskSamplerQueue> task_samplers;
+    i64 samples_left = 0;
+    Result task_result;
+
+    std::map<i32, LeaseStats> lease_stats;
+    std::map<std::tuple<i32, i64>, ActiveItem> active_items;
+    f64 committed_item_seconds = 0;
+    i64 committed_items = 0;
+    // Items taken back from workers which stopped responding
+    std::deque<proto::NewWork> reassigned_work;
+    // Items sampled ahead of the ones handed out, in sampling order
+    std::deque<PendingItem> pending_items;
+    // End rows of the tables the job samples, to find the items of rows
+    std::map<i32, std::vector<i64>> input_end_rows;
+    // Workers holding the items of the tables the job samples which have
+    // local_items, and of the items the job commits if it writes any
+    std::map<i32, std::vector<std::string>> input_item_nodes;
+    std::map<std::tuple<i32, i64>, std::string> item_nodes;
+    // Items written out by a previous run of a resumed job
+    std::set<std::tuple<i32, i64>> completed_items;
+    // Rows saved for each committed item of a job with filter ops, which
+    // replace the end rows of the output tables once the job finishes
+    std::map<std::tuple<i32, i64>, i64> filtered_item_rows;
+
+    // Client of a job started with StreamJob, null otherwise
+    OutputStream* stream = nullptr;
+    // Output table id -> index of its task, and the output table, number of
+    // items and number of items not committed yet of each task
+    std::map<i32, i64> table_tasks;
+    std::vector<i32> task_tables;
+    std::vector<i64> task_items;
+    std::vector<i64> task_items_left;
+    // Streamed outputs of items that have not been committed yet
+    std::map<std::tuple<i32, i64>, proto::StreamedItem> uncommitted_outputs;
+    // Outputs of ordered streams by (task, item) waiting on the items
+    // before them, and the next item to send
+    std::map<std::tuple<i64, i64>, proto::StreamedItem> ordered_outputs;
+    i64 next_stream_task = 0;
+    i64 next_stream_item = 0;
+
+    // Parameters every worker gets, and the tables it needs descriptors of
+    proto::JobParameters worker_params;
+    std::set<i32> worker_tables;
+    // NewJob calls to the workers, which workers that register while the
+    // job runs are added to until it is closed
+    grpc::CompletionQueue worker_cq;
+    std::vector<std::unique_ptr<WorkerCall>> worker_calls;
+    std::set<i32> worker_nodes;
+    bool closed = false;
+  };
+
+  // Runs a job, handing its streamed outputs to stream if it is not null.
+  void run_job(const proto::JobParameters* job_params, OutputStream* stream,
+               proto::Result* job_result);
+
+  // Sends the output of a committed item of job, if it has one, to the
+  // client, along with its task if that is now finished. Ordered streams
+  // wait until the items before it are sent. Must be called with
+  // work_mutex_ held.
+  void stream_item(JobState& job, i32 table_id, i64 item,
+                   proto::StreamedItem* output);
+
+  // Moves the outputs and finished tasks of an ordered stream that no
+  // longer wait on uncommitted items to outputs.
+  void advance_ordered_stream(JobState& job,
+                              std::vector<proto::JobOutput>& outputs,
+                              std::vector<TableMetadata>& tables);
+
+  // The message announcing a finished task, adding the descriptor of its
+  // table to tables if the final rows of the table are known now.
+  proto::JobOutput finished_task_output(JobState& job, i64 task,
+                                        std::vector<TableMetadata>& tables);
+
+  void send_outputs(JobState& job, std::vector<proto::JobOutput>& outputs,
+                    std::vector<TableMetadata>& tables);
+
+  // Picks the next io item of job for node_id: preferably one whose inputs
+  // the node read recently, so they are likely in its caches, but no item
+  // is passed over more than a few times. Must be called with work_mutex_
+  // held. Returns false when there is no more work.
+  bool next_work_item(JobState& job, i32 node_id, proto::NewWork& new_work);
+
+  // Pulls the next io item from the task samplers of job. Must be called
+  // with work_mutex_ held. Returns false when there is no more work.
+  bool next_sampled_item(JobState& job, proto::NewWork& new_work);
+
+  // Whether node_id can run an item of job with the given inputs. Items
+  // reading local items only run on the worker holding those, and fail the
+  // job if it is gone. Must be called with work_mutex_ held.
+  bool runs_on(JobState& job, const std::vector<std::tuple<i32, i64>>& inputs,
+               i32 node_id);
+
+  // Records that node_id reads the inputs of an item it was handed. Must be
+  // called with work_mutex_ held.
+  void record_reads(i32 node_id,
+                    const std::vector<std::tuple<i32, i64>>& inputs);
+
+  // Picks the longest running item of job not already assigned to node_id
+  // to be re-executed by that node. Must be called with work_mutex_ held.
+  bool next_speculative_item(JobState& job, i32 node_id,
+                             proto::NewWork& new_work);
+
+  // Sends job to a worker. Must be called with metadata_mutex_ and
+  // work_mutex_ held.
+  void send_job(JobState& job, i32 node_id);
+
+  // Index of a worker among the workers on its host, and their number.
+  std::tuple<i32, i32> local_worker_index(i32 node_id);
+
+  // Loads the op libraries into a worker that just registered and sends it
+  // the jobs that are running, once it is serving.
+  void join_worker(std::shared_ptr<grpc::Channel> channel,
+                   proto::Worker::Stub* worker, i32 node_id,
+                   std::vector<std::string> op_paths);
+
+  // Marks a worker as dead and returns the items only it was working on to
+  // the work pool of their job.
+  void remove_worker(i32 node_id);
+
+  // Ingests videos by handing batches of them to the registered workers.
+  // Videos left over by workers that stop responding are ingested here.
+  Result ingest_on_workers(const proto::IngestParameters& params,
+                           std::vector<FailedVideo>& failed_videos);
+
+  // Brings the table cache in line with meta, reading only tables it has
+  // not seen yet. Tables removed from meta are dropped. Must be called with
+  // metadata_mutex_ held.
+  void refresh_table_cache(const DatabaseMetadata& meta);
+
+  // Has the next job read the named tables again, since items were added
+  // to them. Safe to call while a job runs.
+  void uncache_tables(const std::vector<std::string>& table_names);
+
+  // GOPs of the video column of a cached table. Reads the video
+  // descriptors the cache does not have. Must be called with
+  // metadata_mutex_ held.
+  KeyframeIndex cached_keyframe_index(const TableMetadata& table);
+
+  // Stores a table the master just wrote and bumps the metadata version.
+  // Must be called with metadata_mutex_ held.
+  void cache_table(const TableMetadata& table,
+                   const std::vector<proto::VideoDescriptor>& videos = {});
+
+  // Computes how many items to grant a worker based on how quickly it has
+  // been consuming its previous leases and how much work is left in the job.
+  // Must be called with work_mutex_ held.
+  i32 lease_size(JobState& job, i32 node_id, i32 items_requested);
+
+  // Caps the items granted to a worker for job so that it holds no more
+  // than its priority's share of the node's outstanding items while other
+  // jobs have work left to hand out. Must be called with work_mutex_ held.
+  i32 fair_share(JobState& job, i32 node_id, i32 items_requested);
+
+  // Deletes the files of removed tables in the background until shutdown,
+  // in passes between jobs so that no running job reads them.
+  void collect_deleted_tables();
+
   std::thread watchdog_thread_;
+  std::thread gc_thread_;
   std::atomic<bool> watchdog_awake_;
   std::vector<std::unique_ptr<proto::Worker::Stub>> workers_;
   std::vector<std::string> addresses_;
+  // Threads handing running jobs to workers that registered during them
+  std::vector<std::thread> join_threads_;
+  // Op libraries loaded so far, for workers that register later
+  std::vector<std::string> op_paths_;
   Flag trigger_shutdown_;
   DatabaseParameters db_params_;
   storehouse::StorageBackend* storage_;
-  std::map<std::string, TableMetadata> table_metas_;
-  proto::JobParameters job_params_;
-  std::unique_ptr<ProgressBar> bar_;
 
-  i64 total_samples_used_;
-  i64 total_samples_;
+  // Guards the database metadata while jobs add and commit their tables,
+  // along with the table cache below
+  std::mutex metadata_mutex_;
+  // Table descriptors kept across jobs, with the metadata version at which
+  // each last changed. Descriptors are written through when the master
+  // changes them.
+  std::map<i32, TableMetadata> table_cache_;
+  std::map<i32, std::vector<proto::VideoDescriptor>> table_videos_;
+  std::map<i32, i64> table_versions_;
+  // Deleted tables whose files the collector has removed. Clients write the
+  // database metadata between jobs without the master, so their tombstones
+  // are only cleared when the next job commits.
+  std::set<i32> collected_tables_;
+  i64 metadata_version_ = 0;
+  // Tables that got new items, dropped from the cache by the next refresh
+  std::mutex stale_tables_mutex_;
+  std::set<std::string> stale_tables_;
+  // Version of each table descriptor last sent to each worker
+  std::vector<std::map<i32, i64>> worker_table_versions_;
 
   std::mutex work_mutex_;
-  i64 next_task_;
-  i64 num_tasks_;
-  std::unique_ptr<TaskSampler> task_sampler_;
-  i64 samples_left_;
-  Result task_result_;
+  // Running jobs by id
+  std::map<i32, std::unique_ptr<JobState>> jobs_;
+  // Duplicate items per node that were committed elsewhere
+  std::map<i32, std::vector<proto::IOItem>> cancelled_items_;
+  // Workers which stopped responding
+  std::set<i32> dead_workers_;
+  // Workers which are leaving. They get no more items, and become dead
+  // once no job is running.
+  std::set<i32> departed_workers_;
+  // Input items each worker read lately, kept across jobs since the block
+  // caches of the workers are
+  std::map<i32, NodeReads> node_reads_;
 };
 }
 }
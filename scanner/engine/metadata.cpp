@@ -15,18 +15,25 @@
 
 #include "scanner/engine/metadata.h"
 #include "scanner/engine/runtime.h"
+#include "scanner/util/block_cache.h"
+#include "scanner/util/block_codec.h"
 #include "scanner/util/storehouse.h"
 #include "scanner/util/util.h"
 #include "storehouse/storage_backend.h"
 
+#include <dirent.h>
 #include <errno.h>
+#include <ftw.h>
 #include <libgen.h>
 #include <limits.h> /* PATH_MAX */
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h> /* mkdir(2) */
+#include <algorithm>
 #include <cassert>
 #include <cstdarg>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 
 using storehouse::WriteFile;
@@ -101,6 +108,19 @@ const DatabaseDescriptor& DatabaseMetadata::get_descriptor() const {
   return descriptor_;
 }
 
+i32 DatabaseMetadata::manifest_base() const {
+  return descriptor_.manifest_base();
+}
+
+i32 DatabaseMetadata::manifest_next() const {
+  return descriptor_.manifest_next();
+}
+
+void DatabaseMetadata::set_manifest_segments(i32 base, i32 next) {
+  descriptor_.set_manifest_base(base);
+  descriptor_.set_manifest_next(next);
+}
+
 std::string DatabaseMetadata::descriptor_path() {
   return database_metadata_path();
 }
@@ -151,9 +171,35 @@ i32 DatabaseMetadata::add_table(const std::string& table) {
   return table_id;
 }
 
+i32 DatabaseMetadata::reserve_table_id() {
+  return next_table_id_++;
+}
+
+bool DatabaseMetadata::add_reserved_table(const std::string& table,
+                                          i32 table_id) {
+  assert(table_id < next_table_id_);
+  if (has_table(table)) {
+    return false;
+  }
+  table_id_names_[table_id] = table;
+  return true;
+}
+
 void DatabaseMetadata::remove_table(i32 table_id) {
   assert(table_id_names_.count(table_id) > 0);
   table_id_names_.erase(table_id);
+  descriptor_.add_deleted_tables(table_id);
+}
+
+std::vector<i32> DatabaseMetadata::deleted_tables() const {
+  return std::vector<i32>(descriptor_.deleted_tables().begin(),
+                          descriptor_.deleted_tables().end());
+}
+
+void DatabaseMetadata::clear_deleted_table(i32 table_id) {
+  auto* tables = descriptor_.mutable_deleted_tables();
+  tables->erase(std::remove(tables->begin(), tables->end(), table_id),
+                tables->end());
 }
 
 const std::vector<std::string>& DatabaseMetadata::job_names() const {
@@ -242,6 +288,11 @@ std::vector<i64> VideoMetadata::keyframe_byte_offsets() const {
                           descriptor_.keyframe_byte_offsets().end());
 }
 
+std::vector<i64> VideoMetadata::keyframe_packet_sizes() const {
+  return std::vector<i64>(descriptor_.keyframe_packet_sizes().begin(),
+                          descriptor_.keyframe_packet_sizes().end());
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 /// ImageFormatGroupMetadata
 ImageFormatGroupMetadata::ImageFormatGroupMetadata() {}
@@ -397,11 +448,403 @@ ColumnType TableMetadata::column_type(i32 column_id) const {
   LOG(FATAL) << "Column id " << column_id << " not found!";
 }
 
+proto::Column::BlockCodec TableMetadata::column_block_codec(
+    i32 column_id) const {
+  for (auto& c : descriptor_.columns()) {
+    if (c.id() == column_id) {
+      return c.block_codec();
+    }
+  }
+  LOG(FATAL) << "Column id " << column_id << " not found!";
+}
+
+bool TableMetadata::packed_items() const { return descriptor_.packed_items(); }
+
+bool TableMetadata::filtered_rows() const {
+  return descriptor_.filtered_rows();
+}
+
+bool TableMetadata::local_items() const { return descriptor_.local_items(); }
+
+std::vector<std::string> TableMetadata::item_nodes() const {
+  return std::vector<std::string>(descriptor_.item_nodes().begin(),
+                                  descriptor_.item_nodes().end());
+}
+
+u64 write_item_file_header(storehouse::WriteFile* file,
+                           const std::vector<i64>& element_sizes) {
+  u64 num_elements = element_sizes.size();
+  std::vector<u64> header(num_elements + 3);
+  header[0] = ITEM_FILE_OFFSETS_MAGIC;
+  header[1] = num_elements;
+  header[2] = 0;
+  for (u64 i = 0; i < num_elements; ++i) {
+    header[i + 3] = header[i + 2] + element_sizes[i];
+  }
+  u64 header_size = header.size() * sizeof(u64);
+  s_write(file, reinterpret_cast<const u8*>(header.data()), header_size);
+  return header_size;
+}
+
+u64 write_tensor_item_file_header(storehouse::WriteFile* file,
+                                  u64 num_elements, u64 element_size) {
+  u64 header[3] = {ITEM_FILE_TENSOR_MAGIC, num_elements, element_size};
+  s_write(file, reinterpret_cast<const u8*>(header), sizeof(header));
+  return sizeof(header);
+}
+
+i64 tensor_element_size(const proto::Column& column) {
+  i64 size = 0;
+  switch (column.tensor_type()) {
+    case proto::Column::UINT8:
+      size = sizeof(u8);
+      break;
+    case proto::Column::INT32:
+      size = sizeof(i32);
+      break;
+    case proto::Column::INT64:
+      size = sizeof(i64);
+      break;
+    case proto::Column::FLOAT32:
+      size = sizeof(f32);
+      break;
+    case proto::Column::FLOAT64:
+      size = sizeof(f64);
+      break;
+    default:
+      LOG(FATAL) << "Column " << column.name() << " has an unknown tensor type";
+  }
+  for (i64 dim : column.tensor_shape()) {
+    size *= dim;
+  }
+  return size;
+}
+
+ItemFileHeader read_item_file_header(storehouse::RandomReadFile* file) {
+  ItemFileHeader header;
+  u64 pos = 0;
+  u64 first = s_read<u64>(file, pos);
+  if (first == ITEM_FILE_OFFSETS_MAGIC) {
+    u64 num_elements = s_read<u64>(file, pos);
+    header.element_offsets.resize(num_elements + 1);
+    s_read(file, reinterpret_cast<u8*>(header.element_offsets.data()),
+           header.element_offsets.size() * sizeof(u64), pos);
+  } else if (first == ITEM_FILE_TENSOR_MAGIC) {
+    u64 num_elements = s_read<u64>(file, pos);
+    u64 element_size = s_read<u64>(file, pos);
+    header.element_offsets.resize(num_elements + 1);
+    for (u64 i = 0; i <= num_elements; ++i) {
+      header.element_offsets[i] = i * element_size;
+    }
+  } else {
+    // Old format with a size per element
+    u64 num_elements = first;
+    std::vector<i64> element_sizes(num_elements);
+    s_read(file, reinterpret_cast<u8*>(element_sizes.data()),
+           element_sizes.size() * sizeof(i64), pos);
+    header.element_offsets.resize(num_elements + 1);
+    header.element_offsets[0] = 0;
+    for (u64 i = 0; i < num_elements; ++i) {
+      header.element_offsets[i + 1] =
+          header.element_offsets[i] + element_sizes[i];
+    }
+  }
+  header.data_start = pos;
+  return header;
+}
+
+u64 write_compressed_item_data(storehouse::WriteFile* file,
+                               proto::Column::BlockCodec codec, i32 level,
+                               const std::vector<u8>& data) {
+  u64 num_blocks =
+      (data.size() + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+  std::vector<u8> blocks;
+  std::vector<u64> index(num_blocks + 4);
+  index[0] = COMPRESSED_BLOCK_SIZE;
+  index[1] = data.size();
+  index[2] = num_blocks;
+  index[3] = 0;
+  for (u64 i = 0; i < num_blocks; ++i) {
+    u64 start = i * COMPRESSED_BLOCK_SIZE;
+    u64 size = std::min(COMPRESSED_BLOCK_SIZE, data.size() - start);
+    compress_block(codec, level, data.data() + start, size, blocks);
+    index[i + 4] = blocks.size();
+  }
+  u64 index_size = index.size() * sizeof(u64);
+  s_write(file, reinterpret_cast<const u8*>(index.data()), index_size);
+  s_write(file, blocks.data(), blocks.size());
+  return index_size + blocks.size();
+}
+
+CompressedItemReader::CompressedItemReader(storehouse::RandomReadFile* file,
+                                           proto::Column::BlockCodec codec,
+                                           u64 index_start)
+  : file_(file), codec_(codec) {
+  u64 pos = index_start;
+  u64 index_head[3];
+  s_read(file_, reinterpret_cast<u8*>(index_head), sizeof(index_head), pos);
+  block_size_ = index_head[0];
+  data_size_ = index_head[1];
+  block_offsets_.resize(index_head[2] + 1);
+  s_read(file_, reinterpret_cast<u8*>(block_offsets_.data()),
+         block_offsets_.size() * sizeof(u64), pos);
+  blocks_start_ = pos;
+}
+
+void CompressedItemReader::read(u64 start, u64 end, u8* output) {
+  if (end <= start) {
+    return;
+  }
+  assert(end <= data_size_);
+  u64 first_block = start / block_size_;
+  u64 last_block = (end - 1) / block_size_;
+  // Only read the blocks that are not already decompressed
+  u64 read_first = first_block;
+  if (cached_block_ == (i64)first_block) {
+    read_first++;
+  }
+  std::vector<u8> compressed;
+  if (read_first <= last_block) {
+    u64 read_start = block_offsets_[read_first];
+    u64 read_end = block_offsets_[last_block + 1];
+    compressed.resize(read_end - read_start);
+    u64 pos = blocks_start_ + read_start;
+    s_read(file_, compressed.data(), compressed.size(), pos);
+    bytes_read_ += compressed.size();
+  }
+  for (u64 block = first_block; block <= last_block; ++block) {
+    if (cached_block_ != (i64)block) {
+      cached_data_.resize(block_data_size(block));
+      u64 offset = block_offsets_[block] - block_offsets_[read_first];
+      decompress_block(codec_, compressed.data() + offset,
+                       block_offsets_[block + 1] - block_offsets_[block],
+                       cached_data_.data(), cached_data_.size());
+      cached_block_ = block;
+    }
+    u64 block_start = block * block_size_;
+    u64 copy_start = std::max(start, block_start);
+    u64 copy_end = std::min(end, block_start + cached_data_.size());
+    memcpy(output + (copy_start - start),
+           cached_data_.data() + (copy_start - block_start),
+           copy_end - copy_start);
+  }
+}
+
+u64 CompressedItemReader::bytes_read() const { return bytes_read_; }
+
+u64 CompressedItemReader::block_data_size(u64 block) const {
+  return std::min(block_size_, data_size_ - block * block_size_);
+}
+
+u64 write_packed_item_index(storehouse::WriteFile* file,
+                            const std::vector<u64>& column_sizes) {
+  u64 num_columns = column_sizes.size();
+  std::vector<u64> index(num_columns + 3);
+  index[0] = PACKED_ITEM_MAGIC;
+  index[1] = num_columns;
+  index[2] = 0;
+  for (u64 i = 0; i < num_columns; ++i) {
+    index[i + 3] = index[i + 2] + column_sizes[i];
+  }
+  u64 index_size = index.size() * sizeof(u64);
+  s_write(file, reinterpret_cast<const u8*>(index.data()), index_size);
+  return index_size;
+}
+
+ItemFileView::ItemFileView(std::unique_ptr<storehouse::RandomReadFile> file,
+                           u64 start, u64 size)
+  : file_(std::move(file)), start_(start), size_(size) {}
+
+storehouse::StoreResult ItemFileView::read(uint64_t offset, size_t size,
+                                           uint8_t* data, size_t& size_read) {
+  size_read = 0;
+  if (offset >= size_) {
+    return size == 0 ? storehouse::StoreResult::Success
+                     : storehouse::StoreResult::EndOfFile;
+  }
+  size_t view_size = std::min((u64)size, size_ - offset);
+  storehouse::StoreResult result =
+      file_->read(start_ + offset, view_size, data, size_read);
+  if (result == storehouse::StoreResult::Success && view_size < size) {
+    return storehouse::StoreResult::EndOfFile;
+  }
+  return result;
+}
+
+storehouse::StoreResult ItemFileView::get_size(uint64_t& size) {
+  size = size_;
+  return storehouse::StoreResult::Success;
+}
+
+const std::string ItemFileView::path() { return file_->path(); }
+
+u64 ItemFileView::start() const { return start_; }
+
+storehouse::RandomReadFile* ItemFileView::file() { return file_.get(); }
+
+storehouse::StoreResult open_item_file(
+    storehouse::StorageBackend* storage, bool packed, i32 table_id,
+    i32 column_id, i32 item_id,
+    std::unique_ptr<storehouse::RandomReadFile>& file, Profiler* profiler) {
+  if (!packed) {
+    std::string path = item_file_path(
+        table_id, table_item_output_path(table_id, column_id, item_id));
+    return make_cached_random_read_file(item_storage(storage, path), path,
+                                        file, profiler);
+  }
+  std::string path =
+      item_file_path(table_id, table_item_packed_path(table_id, item_id));
+  std::unique_ptr<storehouse::RandomReadFile> packed_file;
+  storehouse::StoreResult result = make_cached_random_read_file(
+      item_storage(storage, path), path, packed_file, profiler);
+  if (result != storehouse::StoreResult::Success) {
+    return result;
+  }
+  u64 pos = 0;
+  u64 index_start[2];
+  s_read(packed_file.get(), reinterpret_cast<u8*>(index_start),
+         sizeof(index_start), pos);
+  u64 num_columns = index_start[1];
+  if (index_start[0] != PACKED_ITEM_MAGIC) {
+    LOG(FATAL) << "Packed item file " << packed_file->path()
+               << " has a bad index";
+  }
+  if (column_id < 0 || (u64)column_id >= num_columns) {
+    LOG(FATAL) << "Packed item file " << packed_file->path()
+               << " has no column " << column_id;
+  }
+  // Only the two offsets bounding the column are needed
+  pos += column_id * sizeof(u64);
+  u64 column_range[2];
+  s_read(packed_file.get(), reinterpret_cast<u8*>(column_range),
+         sizeof(column_range), pos);
+  u64 data_start = (3 + num_columns) * sizeof(u64);
+  file.reset(new ItemFileView(std::move(packed_file),
+                              data_start + column_range[0],
+                              column_range[1] - column_range[0]));
+  return storehouse::StoreResult::Success;
+}
+
+const proto::VideoDescriptor* Manifest::video(i32 table_id, i32 column_id,
+                                              i32 item_id) const {
+  auto it = videos.find(std::make_tuple(table_id, column_id, item_id));
+  return it == videos.end() ? nullptr : &it->second;
+}
+
+namespace {
+
+void add_manifest_segment(Manifest& manifest,
+                          const proto::DatabaseManifest& segment) {
+  for (const proto::TableDescriptor& table : segment.tables()) {
+    manifest.tables[table.id()] = table;
+  }
+  for (const proto::VideoDescriptor& video : segment.videos()) {
+    manifest.videos[std::make_tuple(video.table_id(), video.column_id(),
+                                    video.item_id())] = video;
+  }
+}
+
+void write_manifest_segment(storehouse::StorageBackend* storage, i32 index,
+                            const proto::DatabaseManifest& segment) {
+  std::unique_ptr<storehouse::WriteFile> file;
+  STORE_CHECK(
+      make_unique_write_file(storage, manifest_segment_path(index), file));
+  serialize_db_proto<proto::DatabaseManifest>(file.get(), segment);
+  STORE_CHECK(file->save());
+}
+}
+
+Manifest read_manifest(storehouse::StorageBackend* storage,
+                       const DatabaseMetadata& meta) {
+  Manifest manifest;
+  for (i32 i = meta.manifest_base(); i < meta.manifest_next(); ++i) {
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    StoreResult result;
+    STORE_RETRY(make_unique_random_read_file(
+                    storage, manifest_segment_path(i), file),
+                result);
+    if (result != StoreResult::Success) {
+      // Descriptors missing from the manifest are read individually
+      LOG(WARNING) << "Could not read manifest segment " << i;
+      continue;
+    }
+    u64 pos = 0;
+    add_manifest_segment(
+        manifest,
+        deserialize_db_proto<proto::DatabaseManifest>(file.get(), pos));
+  }
+  return manifest;
+}
+
+void append_manifest(storehouse::StorageBackend* storage,
+                     DatabaseMetadata& meta,
+                     const proto::DatabaseManifest& segment) {
+  i32 base = meta.manifest_base();
+  i32 next = meta.manifest_next();
+  if (next - base + 1 < MANIFEST_COMPACT_SEGMENTS) {
+    write_manifest_segment(storage, next, segment);
+    meta.set_manifest_segments(base, next + 1);
+    return;
+  }
+  // Merge every live segment and the new one into a single segment
+  Manifest manifest = read_manifest(storage, meta);
+  add_manifest_segment(manifest, segment);
+  proto::DatabaseManifest compacted;
+  for (auto& kv : manifest.tables) {
+    if (meta.has_table(kv.first)) {
+      compacted.add_tables()->CopyFrom(kv.second);
+    }
+  }
+  for (auto& kv : manifest.videos) {
+    if (meta.has_table(std::get<0>(kv.first))) {
+      compacted.add_videos()->CopyFrom(kv.second);
+    }
+  }
+  write_manifest_segment(storage, next, compacted);
+  meta.set_manifest_segments(next, next + 1);
+  // Old segments are no longer referenced once meta is written, so failing
+  // to delete them only wastes space
+  for (i32 i = base; i < next; ++i) {
+    storage->delete_file(manifest_segment_path(i));
+  }
+  VLOG(1) << "Compacted " << next - base + 1 << " manifest segments";
+}
+
+std::map<std::string, TableMetadata> read_all_table_metadata(
+    storehouse::StorageBackend* storage, const DatabaseMetadata& meta,
+    const Manifest& manifest) {
+  std::map<std::string, TableMetadata> tables;
+  for (const std::string& table_name : meta.table_names()) {
+    i32 table_id = meta.get_table_id(table_name);
+    auto it = manifest.tables.find(table_id);
+    if (it != manifest.tables.end()) {
+      tables[table_name] = TableMetadata(it->second);
+    } else {
+      tables[table_name] = read_table_metadata(
+          storage, TableMetadata::descriptor_path(table_id));
+    }
+  }
+  return tables;
+}
+
 namespace {
 std::string& get_database_path_ref() {
   static std::string prefix = "";
   return prefix;
 }
+
+std::string& get_local_table_path_ref() {
+  static std::string prefix = "";
+  return prefix;
+}
+
+std::mutex local_tables_mutex;
+std::set<i32> local_tables;
+
+int remove_local_file(const char* path, const struct stat* st, int flag,
+                      struct FTW* ftw) {
+  return ::remove(path);
+}
 }
 
 const std::string& get_database_path() {
@@ -414,5 +857,80 @@ void set_database_path(std::string path) {
   get_database_path_ref() = path + "/";
   std::atomic_thread_fence(std::memory_order_release);
 }
+
+const std::string& get_local_table_path() {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return get_local_table_path_ref();
+}
+
+void set_local_table_path(std::string path) {
+  VLOG(1) << "Setting local table path to " << path;
+  get_local_table_path_ref() = path.empty() ? "" : path + "/";
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void add_local_table(i32 table_id) {
+  std::unique_lock<std::mutex> lk(local_tables_mutex);
+  local_tables.insert(table_id);
+}
+
+std::string item_file_path(i32 table_id, const std::string& path) {
+  const std::string& local_path = get_local_table_path();
+  if (local_path.empty()) {
+    return path;
+  }
+  {
+    std::unique_lock<std::mutex> lk(local_tables_mutex);
+    if (local_tables.count(table_id) == 0) {
+      return path;
+    }
+  }
+  std::string dir = table_directory(table_id);
+  assert(path.compare(0, dir.size(), dir) == 0);
+  return local_path + "tables/" + std::to_string(table_id) +
+         path.substr(dir.size());
+}
+
+storehouse::StorageBackend* item_storage(storehouse::StorageBackend* storage,
+                                         const std::string& path) {
+  const std::string& local_path = get_local_table_path();
+  if (local_path.empty() ||
+      path.compare(0, local_path.size(), local_path) != 0) {
+    return storage;
+  }
+  static std::unique_ptr<storehouse::StorageConfig> local_config(
+      storehouse::StorageConfig::make_posix_config());
+  static std::unique_ptr<storehouse::StorageBackend> local_storage(
+      storehouse::StorageBackend::make_from_config(local_config.get()));
+  return local_storage.get();
+}
+
+void remove_unused_local_tables(const DatabaseMetadata& meta) {
+  const std::string& local_path = get_local_table_path();
+  if (local_path.empty()) {
+    return;
+  }
+  std::string tables_path = local_path + "tables";
+  DIR* dir = opendir(tables_path.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  std::vector<std::string> unused;
+  while (struct dirent* entry = readdir(dir)) {
+    char* end;
+    long table_id = strtol(entry->d_name, &end, 10);
+    if (end == entry->d_name || *end != '\0' || meta.has_table(table_id)) {
+      continue;
+    }
+    unused.push_back(tables_path + "/" + entry->d_name);
+  }
+  closedir(dir);
+  for (const std::string& path : unused) {
+    VLOG(1) << "Removing local items of deleted table " << path;
+    if (nftw(path.c_str(), remove_local_file, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+      LOG(WARNING) << "Failed to remove " << path << ": " << strerror(errno);
+    }
+  }
+}
 }
 }
@@ -16,10 +16,13 @@
 #pragma once
 
 #include "scanner/util/common.h"
+#include "scanner/util/profiler.h"
 #include "scanner/util/storehouse.h"
 #include "storehouse/storage_backend.h"
 
+#include <map>
 #include <set>
+#include <tuple>
 
 namespace scanner {
 namespace internal {
@@ -52,12 +55,54 @@ inline std::string table_item_output_path(i32 table_id, i32 column_id,
          std::to_string(item_id) + ".bin";
 }
 
+inline std::string table_item_packed_path(i32 table_id, i32 item_id) {
+  return table_directory(table_id) + "/item_" + std::to_string(item_id) +
+         ".bin";
+}
+
+// Input table row of each row kept in an item of a table with filtered_rows
+inline std::string table_item_rows_path(i32 table_id, i32 item_id) {
+  return table_directory(table_id) + "/item_" + std::to_string(item_id) +
+         "_rows.bin";
+}
+
+// Empty file saved after every other file of an item, so that jobs resuming
+// the table only keep items that were written out in full
+inline std::string table_item_commit_path(i32 table_id, i32 item_id) {
+  return table_directory(table_id) + "/item_" + std::to_string(item_id) +
+         "_committed.bin";
+}
+
 inline std::string table_item_video_metadata_path(i32 table_id, i32 column_id,
                                                   i32 item_id) {
   return table_directory(table_id) + "/" + std::to_string(column_id) + "_" +
          std::to_string(item_id) + "_video_metadata.bin";
 }
 
+// ZoneMapDescriptor of an item of a column written with a zone map
+inline std::string table_item_zone_map_path(i32 table_id, i32 column_id,
+                                            i32 item_id) {
+  return table_directory(table_id) + "/" + std::to_string(column_id) + "_" +
+         std::to_string(item_id) + "_zone_map.bin";
+}
+
+// VectorIndexDescriptor of the vector index of a column, and the files of
+// its shards
+inline std::string table_vector_index_path(i32 table_id, i32 column_id) {
+  return table_directory(table_id) + "/" + std::to_string(column_id) +
+         "_index.bin";
+}
+
+inline std::string table_vector_index_shard_path(i32 table_id, i32 column_id,
+                                                 i32 shard) {
+  return table_directory(table_id) + "/" + std::to_string(column_id) +
+         "_index_" + std::to_string(shard) + ".bin";
+}
+
+inline std::string manifest_segment_path(i32 segment) {
+  return get_database_path() + "manifest/" + std::to_string(segment) + ".bin";
+}
+
 inline std::string job_directory(i32 job_id) {
   return get_database_path() + "jobs/" + std::to_string(job_id);
 }
@@ -70,6 +115,31 @@ inline std::string job_profiler_path(i32 job_id, i32 node) {
   return job_directory(job_id) + "/profile_" + std::to_string(node) + ".bin";
 }
 
+//! Profile of the last video ingest, holding the profilers of every node
+//! that took part
+inline std::string ingest_profiler_path() {
+  return get_database_path() + "ingest_profile.bin";
+}
+
+//! Directory on the local disk of this node that tables with local_items
+//! keep the item files this node wrote in, which holds the files of one
+//! database only. Empty keeps those files in storage.
+const std::string& get_local_table_path();
+
+void set_local_table_path(std::string path);
+
+//! Marks a table as one with local_items.
+void add_local_table(i32 table_id);
+
+//! Path of an item file of a table, one of the table paths above, which is
+//! under the local table path if the table keeps its items there.
+std::string item_file_path(i32 table_id, const std::string& path);
+
+//! Storage holding a file returned by item_file_path: the local disk for
+//! files under the local table path, and storage otherwise.
+storehouse::StorageBackend* item_storage(storehouse::StorageBackend* storage,
+                                         const std::string& path);
+
 ///////////////////////////////////////////////////////////////////////////////
 /// Common persistent data structs and their serialization helpers
 
@@ -104,7 +174,18 @@ class DatabaseMetadata : public Metadata<proto::DatabaseDescriptor> {
   i32 get_table_id(const std::string& table) const;
   const std::string& get_table_name(i32 table_id) const;
   i32 add_table(const std::string& table);
+  //! Takes the next table id without adding a table under it.
+  i32 reserve_table_id();
+  //! Adds a table under an id from reserve_table_id, returning false if a
+  //! table with the name exists.
+  bool add_reserved_table(const std::string& table, i32 table_id);
+  //! Removes a table from the database. Its files stay until the master
+  //! deletes them, see deleted_tables.
   void remove_table(i32 table_id);
+  //! Removed tables whose files have not been deleted yet.
+  std::vector<i32> deleted_tables() const;
+  //! Forgets a removed table once its files are deleted.
+  void clear_deleted_table(i32 table_id);
 
   const std::vector<std::string>& job_names() const;
 
@@ -115,6 +196,10 @@ class DatabaseMetadata : public Metadata<proto::DatabaseDescriptor> {
   i32 add_job(const std::string& job_name);
   void remove_job(i32 job_id);
 
+  i32 manifest_base() const;
+  i32 manifest_next() const;
+  void set_manifest_segments(i32 base, i32 next);
+
  private:
   i32 next_table_id_;
   i32 next_job_id_;
@@ -142,6 +227,7 @@ class VideoMetadata : public Metadata<proto::VideoDescriptor> {
   proto::VideoDescriptor::VideoCodecType codec_type() const;
   std::vector<i64> keyframe_positions() const;
   std::vector<i64> keyframe_byte_offsets() const;
+  std::vector<i64> keyframe_packet_sizes() const;
 };
 
 class ImageFormatGroupMetadata
@@ -215,6 +301,17 @@ class TableMetadata : public Metadata<proto::TableDescriptor> {
 
   ColumnType column_type(i32 column_id) const;
 
+  proto::Column::BlockCodec column_block_codec(i32 column_id) const;
+
+  bool packed_items() const;
+
+  bool filtered_rows() const;
+
+  bool local_items() const;
+
+  //! Address of the worker holding each item of a table with local_items.
+  std::vector<std::string> item_nodes() const;
+
  private:
   std::vector<proto::Column> columns_;
 };
@@ -231,6 +328,135 @@ inline std::string frame_info_column_name() { return "frame_info"; }
 ///////////////////////////////////////////////////////////////////////////////
 /// Helpers
 
+// Column item files start with a header that locates each element, followed
+// by the element data. The header is ITEM_FILE_OFFSETS_MAGIC, the number of
+// elements n and then n + 1 offsets, where offset i is the start of element i
+// relative to the data, so the byte range of any row is a single lookup.
+// Files written before the offset table hold n followed by the n element
+// sizes instead, and are still read.
+const u64 ITEM_FILE_OFFSETS_MAGIC = 0xffffffff00000001;
+
+struct ItemFileHeader {
+  // Start of each element relative to data_start, plus the end of the last
+  std::vector<u64> element_offsets;
+  u64 data_start;
+
+  u64 num_elements() const { return element_offsets.size() - 1; }
+
+  u64 element_size(u64 i) const {
+    return element_offsets[i + 1] - element_offsets[i];
+  }
+};
+
+//! Writes the header for elements of the given sizes, returning its size.
+u64 write_item_file_header(storehouse::WriteFile* file,
+                           const std::vector<i64>& element_sizes);
+
+// Item files of Tensor columns, whose elements all have the same size,
+// start with ITEM_FILE_TENSOR_MAGIC, the number of elements and the element
+// size instead of an offset table, so the element data is one dense block.
+const u64 ITEM_FILE_TENSOR_MAGIC = 0xffffffff00000003;
+
+//! Writes the header for num_elements elements of element_size bytes,
+//! returning its size.
+u64 write_tensor_item_file_header(storehouse::WriteFile* file,
+                                  u64 num_elements, u64 element_size);
+
+//! Bytes of each row of a Tensor column.
+i64 tensor_element_size(const proto::Column& column);
+
+ItemFileHeader read_item_file_header(storehouse::RandomReadFile* file);
+
+// Item files of block compressed columns keep the same header, with offsets
+// into the uncompressed element data, followed by a block index: the block
+// size, the size of the element data, the number of blocks n and n + 1
+// offsets of the compressed blocks relative to the end of the index. Each
+// block compresses block size bytes of element data, the last one possibly
+// fewer.
+const u64 COMPRESSED_BLOCK_SIZE = 64 * 1024;
+
+//! Compresses element data in blocks and writes the block index followed by
+//! the blocks, returning the number of bytes written.
+u64 write_compressed_item_data(storehouse::WriteFile* file,
+                               proto::Column::BlockCodec codec, i32 level,
+                               const std::vector<u8>& data);
+
+//! Reads ranges of the element data of a block compressed item file. Only
+//! the blocks covering a range are read, each group of them with a single
+//! read, and the last block decompressed is kept for the next range.
+class CompressedItemReader {
+ public:
+  //! index_start is the data_start of the item file header.
+  CompressedItemReader(storehouse::RandomReadFile* file,
+                       proto::Column::BlockCodec codec, u64 index_start);
+
+  //! Copies element data [start, end) to output.
+  void read(u64 start, u64 end, u8* output);
+
+  //! Compressed bytes read so far.
+  u64 bytes_read() const;
+
+ private:
+  u64 block_data_size(u64 block) const;
+
+  storehouse::RandomReadFile* file_;
+  proto::Column::BlockCodec codec_;
+  u64 block_size_;
+  u64 data_size_;
+  std::vector<u64> block_offsets_;
+  u64 blocks_start_;
+  u64 bytes_read_ = 0;
+  i64 cached_block_ = -1;
+  std::vector<u8> cached_data_;
+};
+
+// Tables with packed_items set store all columns of an item in one file, so
+// an item costs one object instead of one per column. The file starts with
+// PACKED_ITEM_MAGIC, the number of columns n and then n + 1 offsets, where
+// offset i is the start of column i relative to the end of this index.
+// Each column's bytes are exactly what its own item file would hold.
+const u64 PACKED_ITEM_MAGIC = 0xffffffff00000002;
+
+//! Writes the index for columns of the given sizes, returning its size.
+u64 write_packed_item_index(storehouse::WriteFile* file,
+                            const std::vector<u64>& column_sizes);
+
+//! Read only view of the byte range [start, start + size) of a file.
+class ItemFileView : public storehouse::RandomReadFile {
+ public:
+  ItemFileView(std::unique_ptr<storehouse::RandomReadFile> file, u64 start,
+               u64 size);
+
+  storehouse::StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                               size_t& size_read) override;
+
+  storehouse::StoreResult get_size(uint64_t& size) override;
+
+  const std::string path() override;
+
+  //! Offset of the view in the underlying file.
+  u64 start() const;
+
+  storehouse::RandomReadFile* file();
+
+ private:
+  std::unique_ptr<storehouse::RandomReadFile> file_;
+  u64 start_;
+  u64 size_;
+};
+
+//! Removes the local item files of tables that are no longer in meta.
+void remove_unused_local_tables(const DatabaseMetadata& meta);
+
+//! Opens the bytes of a column of an item, whichever layout the table uses.
+//! Reads go through the block cache, counting hits in profiler if one is
+//! given.
+storehouse::StoreResult open_item_file(
+    storehouse::StorageBackend* storage, bool packed, i32 table_id,
+    i32 column_id, i32 item_id,
+    std::unique_ptr<storehouse::RandomReadFile>& file,
+    Profiler* profiler = nullptr);
+
 template <typename T>
 void serialize_db_proto(storehouse::WriteFile* file, const T& descriptor) {
   size_t size = descriptor.ByteSizeLong();
@@ -250,18 +476,18 @@ T deserialize_db_proto(storehouse::RandomReadFile* file, u64& pos) {
 template <typename T>
 void write_db_proto(storehouse::StorageBackend* storage, T db_proto) {
   std::unique_ptr<storehouse::WriteFile> output_file;
-  BACKOFF_FAIL(make_unique_write_file(
+  STORE_CHECK(make_unique_write_file(
       storage, db_proto.Metadata<typename T::Descriptor>::descriptor_path(),
       output_file));
   serialize_db_proto<typename T::Descriptor>(output_file.get(),
                                              db_proto.get_descriptor());
-  BACKOFF_FAIL(output_file->save());
+  STORE_CHECK(output_file->save());
 }
 
 template <typename T>
 T read_db_proto(storehouse::StorageBackend* storage, const std::string& path) {
   std::unique_ptr<storehouse::RandomReadFile> db_in_file;
-  BACKOFF_FAIL(make_unique_random_read_file(storage, path, db_in_file));
+  STORE_CHECK(make_unique_random_read_file(storage, path, db_in_file));
   u64 pos = 0;
   return T(deserialize_db_proto<typename T::Descriptor>(db_in_file.get(), pos));
 }
@@ -290,5 +516,42 @@ constexpr WriteFn<VideoMetadata> write_video_metadata =
     write_db_proto<VideoMetadata>;
 constexpr ReadFn<VideoMetadata> read_video_metadata =
     read_db_proto<VideoMetadata>;
+
+///////////////////////////////////////////////////////////////////////////////
+/// Database manifest
+//
+// Table and video descriptors are also collected into numbered manifest
+// segments so that the metadata of a whole database can be loaded with a
+// handful of large reads instead of one small read per descriptor. Writers
+// append a segment holding the descriptors they wrote and then save the
+// DatabaseMetadata recording the new segment range, and once there are
+// MANIFEST_COMPACT_SEGMENTS segments they are merged into one. The
+// individual descriptor files stay authoritative, so anything missing from
+// the manifest is read from them instead.
+
+const i32 MANIFEST_COMPACT_SEGMENTS = 32;
+
+struct Manifest {
+  std::map<i32, proto::TableDescriptor> tables;
+  std::map<std::tuple<i32, i32, i32>, proto::VideoDescriptor> videos;
+
+  const proto::VideoDescriptor* video(i32 table_id, i32 column_id,
+                                      i32 item_id) const;
+};
+
+Manifest read_manifest(storehouse::StorageBackend* storage,
+                       const DatabaseMetadata& meta);
+
+//! Writes segment as the next manifest segment of meta. meta has to be
+//! written out afterwards for the segment to be seen by readers.
+void append_manifest(storehouse::StorageBackend* storage,
+                     DatabaseMetadata& meta,
+                     const proto::DatabaseManifest& segment);
+
+//! Metadata of every table in meta by name, taken from manifest when it has
+//! the table and read from its descriptor otherwise.
+std::map<std::string, TableMetadata> read_all_table_metadata(
+    storehouse::StorageBackend* storage, const DatabaseMetadata& meta,
+    const Manifest& manifest);
 }
 }
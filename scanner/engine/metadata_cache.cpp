@@ -0,0 +1,88 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/metadata_cache.h"
+
+namespace scanner {
+namespace internal {
+
+const size_t MetadataCache::MAX_TABLES;
+const size_t MetadataCache::MAX_VIDEO_INDICES;
+
+MetadataCache::MetadataCache()
+  : tables_(MAX_TABLES), video_indices_(MAX_VIDEO_INDICES) {}
+
+std::shared_ptr<const TableMetadata> MetadataCache::table(
+    storehouse::StorageBackend* storage, i32 table_id) {
+  std::shared_ptr<const TableMetadata> meta = tables_.get(table_id);
+  if (meta) {
+    return meta;
+  }
+  std::shared_ptr<const Manifest> manifest = current_manifest();
+  if (manifest && manifest->tables.count(table_id) > 0) {
+    meta = std::make_shared<const TableMetadata>(
+        manifest->tables.at(table_id));
+  } else {
+    meta = std::make_shared<const TableMetadata>(read_table_metadata(
+        storage, TableMetadata::descriptor_path(table_id)));
+  }
+  return tables_.put(table_id, meta);
+}
+
+std::shared_ptr<const VideoIndexEntry> MetadataCache::video_index(
+    storehouse::StorageBackend* storage, i32 table_id, i32 column_id,
+    i32 item_id) {
+  auto key = std::make_tuple(table_id, column_id, item_id);
+  std::shared_ptr<const VideoIndexEntry> entry = video_indices_.get(key);
+  if (entry) {
+    return entry;
+  }
+  bool packed = table(storage, table_id)->packed_items();
+  std::shared_ptr<const Manifest> manifest = current_manifest();
+  const proto::VideoDescriptor* descriptor =
+      manifest ? manifest->video(table_id, column_id, item_id) : nullptr;
+  if (descriptor != nullptr) {
+    entry = std::make_shared<const VideoIndexEntry>(
+        read_video_index(storage, VideoMetadata(*descriptor), packed));
+  } else {
+    entry = std::make_shared<const VideoIndexEntry>(
+        read_video_index(storage, table_id, column_id, item_id, packed));
+  }
+  return video_indices_.put(key, entry);
+}
+
+void MetadataCache::clear() {
+  tables_.clear();
+  video_indices_.clear();
+  std::lock_guard<std::mutex> guard(manifest_lock_);
+  manifest_.reset();
+}
+
+std::shared_ptr<const Manifest> MetadataCache::current_manifest() {
+  std::lock_guard<std::mutex> guard(manifest_lock_);
+  return manifest_;
+}
+
+void MetadataCache::set_manifest(std::shared_ptr<const Manifest> manifest) {
+  std::lock_guard<std::mutex> guard(manifest_lock_);
+  manifest_ = manifest;
+}
+
+MetadataCache& metadata_cache() {
+  static MetadataCache cache;
+  return cache;
+}
+}
+}
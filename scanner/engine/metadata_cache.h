@@ -0,0 +1,65 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/engine/metadata.h"
+#include "scanner/engine/video_index_entry.h"
+#include "scanner/util/lru_cache.h"
+
+#include "storehouse/storage_backend.h"
+
+namespace scanner {
+namespace internal {
+
+//! Table metadata and video indices shared by every load thread in the
+//! process, so that jobs interleaving many tables do not reread descriptors
+//! for each item.
+//
+// Misses are read with the caller's storage backend outside of any lock,
+// so threads missing on the same entry may both read it. The storage member
+// of cached video indices belongs to whichever thread read it, so callers
+// should open files with their own backend.
+class MetadataCache {
+ public:
+  static const size_t MAX_TABLES = 4096;
+  static const size_t MAX_VIDEO_INDICES = 65536;
+
+  MetadataCache();
+
+  std::shared_ptr<const TableMetadata> table(
+      storehouse::StorageBackend* storage, i32 table_id);
+
+  std::shared_ptr<const VideoIndexEntry> video_index(
+      storehouse::StorageBackend* storage, i32 table_id, i32 column_id,
+      i32 item_id);
+
+  void clear();
+
+  //! Video descriptors found in manifest are used instead of being read.
+  void set_manifest(std::shared_ptr<const Manifest> manifest);
+
+ private:
+  std::shared_ptr<const Manifest> current_manifest();
+
+  LruCache<i32, TableMetadata> tables_;
+  LruCache<std::tuple<i32, i32, i32>, VideoIndexEntry> video_indices_;
+  std::mutex manifest_lock_;
+  std::shared_ptr<const Manifest> manifest_;
+};
+
+MetadataCache& metadata_cache();
+}
+}
@@ -28,13 +28,17 @@ class OpInfo {
   OpInfo(const std::string& name, bool variadic_inputs,
          const std::vector<Column>& input_columns,
          const std::vector<Column>& output_columns, bool can_stencil,
-         const std::vector<i32> preferred_stencil)
+         const std::vector<i32> preferred_stencil, bool filter = false,
+         i32 max_input_height = 0, bool motion_vector_inputs = false)
     : name_(name),
       variadic_inputs_(variadic_inputs),
       input_columns_(input_columns),
       output_columns_(output_columns),
       can_stencil_(can_stencil),
-      preferred_stencil_(preferred_stencil) {}
+      preferred_stencil_(preferred_stencil),
+      filter_(filter),
+      max_input_height_(max_input_height),
+      motion_vector_inputs_(motion_vector_inputs) {}
 
   const std::string& name() const { return name_; }
 
@@ -50,6 +54,14 @@ class OpInfo {
     return preferred_stencil_;
   }
 
+  const bool is_filter() const { return filter_; }
+
+  //! Tallest frames the op needs, or 0 for any
+  i32 max_input_height() const { return max_input_height_; }
+
+  //! Whether the op reads the input table's videos as motion vectors
+  const bool motion_vector_inputs() const { return motion_vector_inputs_; }
+
  private:
   std::string name_;
   bool variadic_inputs_;
@@ -57,6 +69,9 @@ class OpInfo {
   std::vector<Column> output_columns_;
   bool can_stencil_;
   std::vector<i32> preferred_stencil_;
+  bool filter_;
+  i32 max_input_height_;
+  bool motion_vector_inputs_;
 };
 }
 }
@@ -1,6 +1,10 @@
 #include "scanner/api/database.h"
+#include "scanner/engine/column_reader.h"
 #include "scanner/engine/op_info.h"
 #include "scanner/engine/op_registry.h"
+#include "scanner/engine/table_export.h"
+#include "scanner/engine/table_writer.h"
+#include "scanner/engine/vector_index.h"
 #include "scanner/util/common.h"
 
 #include <boost/python.hpp>
@@ -49,6 +53,10 @@ std::string default_machine_params_wrapper() {
   for (auto gpu_id : params.gpu_ids) {
     params_proto.add_gpu_ids(gpu_id);
   }
+  params_proto.set_block_cache_size(params.block_cache_size);
+  params_proto.set_block_cache_dir(params.block_cache_dir);
+  params_proto.set_block_cache_disk_size(params.block_cache_disk_size);
+  params_proto.set_local_table_dir(params.local_table_dir);
 
   std::string output;
   bool success = params_proto.SerializeToString(&output);
@@ -71,6 +79,10 @@ proto::Result start_worker_wrapper(Database& db, const std::string& params_s,
   for (auto gpu_id : params_proto.gpu_ids()) {
     params.gpu_ids.push_back(gpu_id);
   }
+  params.block_cache_size = params_proto.block_cache_size();
+  params.block_cache_dir = params_proto.block_cache_dir();
+  params.block_cache_disk_size = params_proto.block_cache_disk_size();
+  params.local_table_dir = params_proto.local_table_dir();
 
   return db.start_worker(params, port);
 }
@@ -98,6 +110,181 @@ Result new_table_wrapper(Database& db, const std::string& name,
   return db.new_table(name, to_std_vector<std::string>(columns), rows_py2);
 }
 
+py::list read_column_rows_wrapper(storehouse::StorageConfig* config,
+                                  const std::string& db_path,
+                                  const std::string& table_descriptor,
+                                  i32 column_id, i32 begin_item, i32 end_item,
+                                  const py::object rows, i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  internal::TableMetadata table(descriptor);
+  std::vector<i64> row_vector = to_std_vector<i64>(rows);
+  // Other Python threads run while the items are read
+  PyThreadState* state = PyEval_SaveThread();
+  std::vector<std::string> data =
+      internal::read_column_rows(config, table, column_id, begin_item,
+                                 end_item, row_vector, num_threads);
+  PyEval_RestoreThread(state);
+  py::list list;
+  for (std::string& element : data) {
+    list.append(element);
+    std::string().swap(element);
+  }
+  return list;
+}
+
+py::tuple read_column_data_wrapper(storehouse::StorageConfig* config,
+                                   const std::string& db_path,
+                                   const std::string& table_descriptor,
+                                   i32 column_id, i32 begin_item,
+                                   i32 end_item, const py::object rows,
+                                   i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  internal::TableMetadata table(descriptor);
+  std::vector<i64> row_vector = to_std_vector<i64>(rows);
+  i64 element_size;
+  PyThreadState* state = PyEval_SaveThread();
+  std::string data = internal::read_column_data(
+      config, table, column_id, begin_item, end_item, row_vector, num_threads,
+      element_size);
+  PyEval_RestoreThread(state);
+  return py::make_tuple(data, element_size);
+}
+
+py::tuple decode_video_rows_wrapper(storehouse::StorageConfig* config,
+                                    const std::string& db_path,
+                                    const std::string& table_descriptor,
+                                    i32 column_id, i32 begin_item,
+                                    i32 end_item, const py::object rows,
+                                    i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  internal::TableMetadata table(descriptor);
+  std::vector<i64> row_vector = to_std_vector<i64>(rows);
+  FrameInfo info;
+  PyThreadState* state = PyEval_SaveThread();
+  std::string data = internal::decode_video_rows(
+      config, table, column_id, begin_item, end_item, row_vector, num_threads,
+      info);
+  PyEval_RestoreThread(state);
+  return py::make_tuple(data, info.height(), info.width());
+}
+
+proto::Result export_table_wrapper(storehouse::StorageConfig* config,
+                                   const std::string& db_path,
+                                   const std::string& table_descriptor,
+                                   const py::object column_ids,
+                                   const std::string& path,
+                                   const std::string& format_name,
+                                   i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  internal::TableMetadata table(descriptor);
+  std::vector<i32> column_vector = to_std_vector<i32>(column_ids);
+  internal::ExportFormat format;
+  if (!internal::parse_export_format(format_name, format)) {
+    proto::Result result;
+    result.set_success(false);
+    result.set_msg("Unknown export format " + format_name);
+    return result;
+  }
+  PyThreadState* state = PyEval_SaveThread();
+  proto::Result result = internal::export_table(
+      config, table, column_vector, path, format, num_threads);
+  PyEval_RestoreThread(state);
+  return result;
+}
+
+proto::Result build_vector_index_wrapper(storehouse::StorageConfig* config,
+                                         const std::string& db_path,
+                                         const std::string& table_descriptor,
+                                         i32 column_id, i32 num_lists,
+                                         i32 num_subquantizers,
+                                         i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  internal::TableMetadata table(descriptor);
+  PyThreadState* state = PyEval_SaveThread();
+  proto::Result result = internal::build_vector_index(
+      config, table, column_id, num_lists, num_subquantizers, num_threads);
+  PyEval_RestoreThread(state);
+  return result;
+}
+
+py::tuple search_vector_index_wrapper(storehouse::StorageConfig* config,
+                                      const std::string& db_path,
+                                      const std::string& table_descriptor,
+                                      i32 column_id,
+                                      const std::string& queries, i32 k,
+                                      i32 num_probes, i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  internal::TableMetadata table(descriptor);
+  std::vector<f32> query_vector((const f32*)queries.data(),
+                                (const f32*)queries.data() +
+                                    queries.size() / sizeof(f32));
+  std::vector<i64> rows;
+  std::vector<f32> distances;
+  PyThreadState* state = PyEval_SaveThread();
+  proto::Result result = internal::search_vector_index(
+      config, table, column_id, query_vector, k, num_probes, num_threads,
+      rows, distances);
+  PyEval_RestoreThread(state);
+  return py::make_tuple(
+      result, std::string((const char*)rows.data(), rows.size() * sizeof(i64)),
+      std::string((const char*)distances.data(),
+                  distances.size() * sizeof(f32)));
+}
+
+internal::TableWriter* new_table_writer_wrapper(
+    storehouse::StorageConfig* config, const std::string& db_path,
+    const std::string& table_descriptor, i32 num_threads) {
+  internal::set_database_path(db_path);
+  proto::TableDescriptor descriptor;
+  LOG_IF(FATAL, !descriptor.ParseFromString(table_descriptor))
+      << "Failed to parse table descriptor";
+  std::vector<proto::Column> columns(descriptor.columns().begin(),
+                                     descriptor.columns().end());
+  return new internal::TableWriter(config, descriptor.name(), columns,
+                                   num_threads);
+}
+
+proto::Result write_item_wrapper(internal::TableWriter& writer, i64 num_rows,
+                                 const py::list data,
+                                 const py::list element_sizes) {
+  std::vector<std::string> data_vector = to_std_vector<std::string>(data);
+  std::vector<std::vector<i64>> sizes_vector;
+  for (const py::list& sizes : to_std_vector<py::list>(element_sizes)) {
+    sizes_vector.push_back(to_std_vector<i64>(sizes));
+  }
+  // Blocks while the writer has a full queue of items
+  PyThreadState* state = PyEval_SaveThread();
+  proto::Result result = writer.write_item(num_rows, std::move(data_vector),
+                                           std::move(sizes_vector));
+  PyEval_RestoreThread(state);
+  return result;
+}
+
+proto::Result commit_table_wrapper(internal::TableWriter& writer) {
+  PyThreadState* state = PyEval_SaveThread();
+  proto::Result result = writer.commit();
+  PyEval_RestoreThread(state);
+  return result;
+}
+
 BOOST_PYTHON_MODULE(libscanner) {
   using namespace py;
   class_<Database, boost::noncopyable>(
@@ -111,6 +298,9 @@ BOOST_PYTHON_MODULE(libscanner) {
       .def("success", &proto::Result::success,
            return_value_policy<return_by_value>())
       .def("msg", &proto::Result::msg, return_value_policy<return_by_value>());
+  class_<internal::TableWriter, boost::noncopyable>("TableWriter", no_init)
+      .def("write_item", write_item_wrapper)
+      .def("commit", commit_table_wrapper);
   def("start_master", start_master_wrapper);
   def("start_worker", start_worker_wrapper);
   def("ingest_videos", ingest_videos_wrapper);
@@ -119,5 +309,13 @@ BOOST_PYTHON_MODULE(libscanner) {
   def("other_flags", other_flags);
   def("default_machine_params", default_machine_params_wrapper);
   def("new_table", new_table_wrapper);
+  def("read_column_rows", read_column_rows_wrapper);
+  def("read_column_data", read_column_data_wrapper);
+  def("decode_video_rows", decode_video_rows_wrapper);
+  def("export_table", export_table_wrapper);
+  def("build_vector_index", build_vector_index_wrapper);
+  def("search_vector_index", search_vector_index_wrapper);
+  def("new_table_writer", new_table_writer_wrapper,
+      return_value_policy<manage_new_object>());
 }
 }
@@ -30,61 +30,105 @@ WorkerImpl* get_worker_service(DatabaseParameters& params,
   return new WorkerImpl(params, master_address, worker_port);
 }
 
+namespace {
+
+// Allocates a block on target_handle with room for every element of column
+void allocate_column_block(DeviceHandle target_handle, ElementList& column,
+                           std::vector<u8*>& src_buffers,
+                           std::vector<u8*>& dest_buffers,
+                           std::vector<size_t>& sizes) {
+  bool is_frame = column[0].is_frame;
+  if (is_frame) {
+    for (i32 b = 0; b < (i32)column.size(); ++b) {
+      Frame* frame = column[b].as_frame();
+      src_buffers.push_back(frame->data);
+      sizes.push_back(frame->size());
+    }
+  } else {
+    for (i32 b = 0; b < (i32)column.size(); ++b) {
+      src_buffers.push_back(column[b].buffer);
+      sizes.push_back(column[b].size);
+    }
+  }
+
+  size_t total_size = 0;
+  for (i32 b = 0; b < (i32)column.size(); ++b) {
+    total_size += sizes[b];
+  }
+
+  u8* block = new_block_buffer(target_handle, total_size, column.size());
+  for (i32 b = 0; b < (i32)column.size(); ++b) {
+    size_t size = sizes[b];
+    dest_buffers.push_back(block);
+    block += size;
+  }
+}
+
+// Points the elements of column at their new buffers
+void retarget_column(ElementList& column, std::vector<u8*>& dest_buffers) {
+  bool is_frame = column[0].is_frame;
+  for (i32 b = 0; b < (i32)column.size(); ++b) {
+    if (is_frame) {
+      column[b].as_frame()->data = dest_buffers[b];
+    } else {
+      column[b].buffer = dest_buffers[b];
+    }
+  }
+}
+}
+
 void move_if_different_address_space(Profiler& profiler,
                                      DeviceHandle current_handle,
                                      DeviceHandle target_handle,
                                      ElementList& column) {
   if (!current_handle.is_same_address_space(target_handle) &&
       column.size() > 0) {
-    bool is_frame = column[0].is_frame;
-
     std::vector<u8*> src_buffers;
     std::vector<u8*> dest_buffers;
     std::vector<size_t> sizes;
-    if (is_frame) {
-      for (i32 b = 0; b < (i32)column.size(); ++b) {
-        Frame* frame = column[b].as_frame();
-        src_buffers.push_back(frame->data);
-        sizes.push_back(frame->size());
-      }
-    } else {
-      for (i32 b = 0; b < (i32)column.size(); ++b) {
-        src_buffers.push_back(column[b].buffer);
-        sizes.push_back(column[b].size);
-      }
-    }
-
-    size_t total_size = 0;
-    for (i32 b = 0; b < (i32)column.size(); ++b) {
-      total_size += sizes[b];
-    }
-
-    u8* block = new_block_buffer(target_handle, total_size, column.size());
-    for (i32 b = 0; b < (i32)column.size(); ++b) {
-      size_t size = sizes[b];
-      dest_buffers.push_back(block);
-      block += size;
-    }
+    allocate_column_block(target_handle, column, src_buffers, dest_buffers,
+                          sizes);
 
     auto memcpy_start = now();
     memcpy_vec(dest_buffers, target_handle, src_buffers, current_handle, sizes);
     profiler.add_interval("memcpy", memcpy_start, now());
 
-    auto delete_start = now();
-    if (is_frame) {
-      for (i32 b = 0; b < (i32)column.size(); ++b) {
-        Frame* frame = column[b].as_frame();
-        delete_buffer(current_handle, frame->data);
-        frame->data = dest_buffers[b];
-      }
-    } else {
-      for (i32 b = 0; b < (i32)column.size(); ++b) {
-        delete_buffer(current_handle, column[b].buffer);
-        column[b].buffer = dest_buffers[b];
-      }
+    for (u8* buffer : src_buffers) {
+      delete_buffer(current_handle, buffer);
     }
+    retarget_column(column, dest_buffers);
+  }
+}
+
+#ifdef HAVE_CUDA
+bool move_if_different_address_space_async(
+    Profiler& profiler, DeviceHandle current_handle, DeviceHandle target_handle,
+    ElementList& column, cudaStream_t stream, cudaEvent_t done,
+    std::vector<std::tuple<DeviceHandle, u8*>>& release_after_done) {
+  if (current_handle.is_same_address_space(target_handle) ||
+      column.size() == 0) {
+    return false;
+  }
+  std::vector<u8*> src_buffers;
+  std::vector<u8*> dest_buffers;
+  std::vector<size_t> sizes;
+  allocate_column_block(target_handle, column, src_buffers, dest_buffers,
+                        sizes);
+
+  auto memcpy_start = now();
+  memcpy_vec_async(dest_buffers, target_handle, src_buffers, current_handle,
+                   sizes, stream, done);
+  profiler.add_interval("memcpy_issue", memcpy_start, now());
+
+  // The sources may still be read by the copy, so they are released by the
+  // caller once done has completed
+  for (u8* buffer : src_buffers) {
+    release_after_done.emplace_back(current_handle, buffer);
   }
+  retarget_column(column, dest_buffers);
+  return true;
 }
+#endif
 
 void move_if_different_address_space(Profiler& profiler,
                                      DeviceHandle current_handle,
@@ -22,6 +22,7 @@
 #include "scanner/engine/metadata.h"
 #include "scanner/engine/op_registry.h"
 #include "scanner/engine/rpc.grpc.pb.h"
+#include "scanner/util/lockfree_queue.h"
 #include "scanner/util/queue.h"
 
 #include "storehouse/storage_backend.h"
@@ -32,6 +33,9 @@
 #include <grpc++/server_builder.h>
 
 #include <dlfcn.h>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 
@@ -41,6 +45,11 @@ namespace internal {
 ///////////////////////////////////////////////////////////////////////////////
 /// Work structs - structs used to exchange data between workers during
 ///   execution of the run command.
+
+//! Row id -> copy of the element of a column at that row on another device
+//! than the column itself
+using ColumnReplicas = std::map<i64, std::tuple<DeviceHandle, Element>>;
+
 struct EvalWorkEntry {
   i32 io_item_index;
   std::vector<i64> row_ids;
@@ -52,22 +61,39 @@ struct EvalWorkEntry {
   bool needs_reset;
   bool last_in_task;
   i64 warmup_rows;
+  // Copies of live columns, by (op index, column name), that kernels in
+  // later groups read on another device
+  std::map<std::tuple<i32, std::string>, ColumnReplicas> replicas;
+  // Rows of the task that filter ops in earlier kernel groups dropped
+  std::vector<i64> filtered_rows;
   // Only for pre worker
   std::vector<proto::VideoDescriptor::VideoCodecType> video_encoding_type;
   std::vector<i64> work_item_sizes;
+  // Whether each column holds a DirectReadArgs per row in place of its rows
+  std::vector<bool> direct_reads;
   // For save and pre worker
   std::vector<FrameInfo> frame_sizes;
   std::vector<bool> compressed;
+  // Frames a second of the first video column loaded, which videos encoded
+  // from it play at, or 0 if it is not known
+  f64 frame_rate = 0;
 };
 
 struct TaskStream {
   std::vector<i64> valid_output_rows;
+  // Leading valid output rows that are warmup rows of the task
+  i64 warmup_rows = 0;
+};
+
+// Io items handed to this node which another node has already committed.
+// Save workers drop these instead of writing them out a second time.
+struct CancelledItems {
+  std::mutex mutex;
+  std::set<std::tuple<i32, i64>> items;
 };
 
-using LoadInputQueue =
-    Queue<std::tuple<i32, std::deque<TaskStream>, IOItem, LoadWorkEntry>>;
 using EvalQueue =
-    Queue<std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry>>;
+    LockFreeQueue<std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry>>;
 
 struct DatabaseParameters {
   storehouse::StorageConfig* storage_config;
@@ -76,6 +102,10 @@ struct DatabaseParameters {
   i32 num_load_workers;
   i32 num_save_workers;
   std::vector<i32> gpu_ids;
+  i64 block_cache_size;
+  std::string block_cache_dir;
+  i64 block_cache_disk_size;
+  std::string local_table_dir;
 };
 
 class MasterImpl;
@@ -98,6 +128,19 @@ void move_if_different_address_space(Profiler& profiler,
                                      DeviceHandle target_handle,
                                      BatchedColumns& columns);
 
+#ifdef HAVE_CUDA
+//! Queues the move of column on stream and records done once it finishes.
+//!
+//! The elements point at their new buffers immediately, but those are only
+//! valid once done has completed. The old buffers are appended to
+//! release_after_done and must be deleted after that. Returns false if the
+//! column did not need to move.
+bool move_if_different_address_space_async(
+    Profiler& profiler, DeviceHandle current_handle, DeviceHandle target_handle,
+    ElementList& column, cudaStream_t stream, cudaEvent_t done,
+    std::vector<std::tuple<DeviceHandle, u8*>>& release_after_done);
+#endif
+
 ElementList duplicate_elements(Profiler& profiler, DeviceHandle current_handle,
                                DeviceHandle target_handle, ElementList& column);
 
@@ -16,7 +16,11 @@
 #include "scanner/engine/sampler.h"
 #include "scanner/metadata.pb.h"
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
+#include <set>
+#include <tuple>
 #include <vector>
 
 namespace scanner {
@@ -25,12 +29,34 @@ namespace internal {
 namespace {
 
 using SamplerFactory =
-    std::function<Sampler*(const std::vector<u8>&, const TableMetadata&)>;
+    std::function<Sampler*(const std::vector<u8>&, const TableMetadata&,
+                           const KeyframeIndex&, const ZoneMaps&)>;
+
+// Keyframe nearest to row that is after lower, before upper and at most
+// max_distance rows away, or -1 if there is none
+i64 nearest_keyframe(const KeyframeIndex& keyframes, i64 row, i64 lower,
+                     i64 upper, i64 max_distance) {
+  i64 best = -1;
+  auto it = std::lower_bound(keyframes.begin(), keyframes.end(), row);
+  if (it != keyframes.end() && *it > lower && *it < upper &&
+      *it - row <= max_distance) {
+    best = *it;
+  }
+  if (it != keyframes.begin()) {
+    i64 before = *(it - 1);
+    if (before > lower && before < upper && row - before <= max_distance &&
+        (best == -1 || row - before < best - row)) {
+      best = before;
+    }
+  }
+  return best;
+}
 
 class AllSampler : public Sampler {
  public:
-  AllSampler(const std::vector<u8>& args, const TableMetadata& table)
-    : Sampler("All", table) {
+  AllSampler(const std::vector<u8>& args, const TableMetadata& table,
+             const KeyframeIndex& keyframes)
+    : Sampler("All", table, keyframes) {
     valid_.set_success(true);
     if (!args_.ParseFromArray(args.data(), args.size())) {
       RESULT_ERROR(&valid_, "All sampler provided with invalid protobuf args");
@@ -48,17 +74,42 @@ class AllSampler : public Sampler {
                    args_.warmup_size());
       return;
     }
+    if (args_.align_keyframes()) {
+      if (keyframes_.rows.empty()) {
+        RESULT_ERROR(&valid_,
+                     "All sampler can not align samples to keyframes of "
+                     "table %s, which has no video column",
+                     table.name().c_str());
+        return;
+      }
+      // Boundaries only move by up to half a sample, so samples stay near
+      // the requested size when keyframes are far apart
+      i64 num_rows = table.num_rows();
+      i64 s = 0;
+      while (s < num_rows) {
+        i64 e = s + args_.sample_size();
+        if (e < num_rows) {
+          i64 k = nearest_keyframe(keyframes_.rows, e, s, num_rows,
+                                   args_.sample_size() / 2);
+          if (k != -1) {
+            e = k;
+          }
+        }
+        e = std::min(e, num_rows);
+        sample_ends_.push_back(e);
+        s = e;
+      }
+    }
   }
 
-  Result validate() override {
-    Result result;
-    result.set_success(true);
-    return result;
-  }
+  Result validate() override { return valid_; }
 
   i64 total_rows() const override { return table_.num_rows(); }
 
   i64 total_samples() const override {
+    if (args_.align_keyframes()) {
+      return sample_ends_.size();
+    }
     return (int)std::ceil((float)table_.num_rows() / args_.sample_size());
   }
 
@@ -66,7 +117,10 @@ class AllSampler : public Sampler {
     RowSample sample;
     i64 ws = std::max(0l, rows_pos_ - args_.warmup_size());
     i64 s = rows_pos_;
-    i64 e = std::min(total_rows(), rows_pos_ + args_.sample_size());
+    i64 e = args_.align_keyframes()
+                ? sample_ends_[samples_pos_]
+                : std::min(total_rows(), rows_pos_ + args_.sample_size());
+    samples_pos_++;
     rows_pos_ = e;
     assert(rows_pos_ <= total_rows());
     for (i64 i = ws; i < s; ++i) {
@@ -78,18 +132,25 @@ class AllSampler : public Sampler {
     return sample;
   }
 
-  void reset() override { rows_pos_ = 0; }
+  void reset() override {
+    rows_pos_ = 0;
+    samples_pos_ = 0;
+  }
 
  private:
   Result valid_;
   proto::AllSamplerArgs args_;
+  // End row of each sample when aligning to keyframes
+  std::vector<i64> sample_ends_;
   i64 rows_pos_ = 0;
+  size_t samples_pos_ = 0;
 };
 
 class StridedRangeSampler : public Sampler {
  public:
-  StridedRangeSampler(const std::vector<u8>& args, const TableMetadata& table)
-    : Sampler("StridedRange", table) {
+  StridedRangeSampler(const std::vector<u8>& args, const TableMetadata& table,
+                      const KeyframeIndex& keyframes)
+    : Sampler("StridedRange", table, keyframes) {
     valid_.set_success(true);
     if (!args_.ParseFromArray(args.data(), args.size())) {
       RESULT_ERROR(&valid_,
@@ -102,6 +163,20 @@ class StridedRangeSampler : public Sampler {
                    args_.stride());
       return;
     }
+    if (args_.keyframe_sample_size() < 0) {
+      RESULT_ERROR(&valid_,
+                   "StridedRange keyframe sample size (%ld) must be "
+                   "non-negative",
+                   args_.keyframe_sample_size());
+      return;
+    }
+    if (args_.keyframe_sample_size() > 0 && keyframes_.rows.empty()) {
+      RESULT_ERROR(&valid_,
+                   "StridedRange can not split ranges at keyframes of table "
+                   "%s, which has no video column",
+                   table.name().c_str());
+      return;
+    }
     if (args_.warmup_starts_size() != args_.starts_size() ||
         args_.starts_size() != args_.ends_size()) {
       RESULT_ERROR(&valid_,
@@ -131,8 +206,9 @@ class StridedRangeSampler : public Sampler {
       }
       total_rows_ +=
           ceil((args_.ends(i) - args_.starts(i)) / (float)args_.stride());
+      split_range(args_.warmup_starts(i), args_.starts(i), args_.ends(i));
     }
-    total_samples_ = args_.warmup_starts_size();
+    total_samples_ = pieces_.size();
   }
 
   Result validate() override { return valid_; }
@@ -144,25 +220,56 @@ class StridedRangeSampler : public Sampler {
   RowSample next_sample() override {
     RowSample sample;
     i64 stride = args_.stride();
-    i64 ws = args_.warmup_starts(samples_pos_);
-    i64 s = args_.starts(samples_pos_);
-    i64 e = args_.ends(samples_pos_);
-    for (i64 i = ws; i < s; i += stride) {
+    const Piece& piece = pieces_[samples_pos_];
+    for (i64 i = piece.warmup_start; i < piece.start; i += stride) {
       sample.warmup_rows.push_back(i);
     }
-    for (i64 i = s; i < e; i += stride) {
+    for (i64 i = piece.start; i < piece.end; i += stride) {
       sample.rows.push_back(i);
     }
     samples_pos_++;
-    assert(samples_pos_ <= args_.warmup_starts_size());
+    assert(samples_pos_ <= pieces_.size());
     return sample;
   }
 
   void reset() override { samples_pos_ = 0; }
 
  private:
+  struct Piece {
+    i64 warmup_start;
+    i64 start;
+    i64 end;
+  };
+
+  // Adds the samples of a range. Each split begins at the first row of the
+  // range at or after a keyframe, with as much warmup as the range has.
+  void split_range(i64 warmup_start, i64 start, i64 end) {
+    i64 sample_size = args_.keyframe_sample_size();
+    if (sample_size == 0 || start == end) {
+      pieces_.push_back({warmup_start, start, end});
+      return;
+    }
+    i64 stride = args_.stride();
+    i64 warmup = start - warmup_start;
+    i64 p = start;
+    while (p < end) {
+      i64 q = p + sample_size * stride;
+      if (q < end) {
+        i64 k = nearest_keyframe(keyframes_.rows, q, p, end,
+                                 sample_size * stride / 2);
+        if (k != -1) {
+          q = start + (k - start + stride - 1) / stride * stride;
+        }
+      }
+      q = std::min(q, end);
+      pieces_.push_back({std::max(0l, p - warmup), p, q});
+      p = q;
+    }
+  }
+
   Result valid_;
   proto::StridedRangeSamplerArgs args_;
+  std::vector<Piece> pieces_;
   i64 total_rows_ = 0;
   i64 total_samples_ = 0;
   size_t samples_pos_ = 0;
@@ -170,8 +277,9 @@ class StridedRangeSampler : public Sampler {
 
 class StencilSampler : public Sampler {
  public:
-  StencilSampler(const std::vector<u8>& args, const TableMetadata& table)
-    : Sampler("Stencil", table) {
+  StencilSampler(const std::vector<u8>& args, const TableMetadata& table,
+                 const KeyframeIndex& keyframes)
+    : Sampler("Stencil", table, keyframes) {
     valid_.set_success(true);
     if (!args_.ParseFromArray(args.data(), args.size())) {
       RESULT_ERROR(&valid_,
@@ -264,8 +372,9 @@ class StencilSampler : public Sampler {
 
 class GatherSampler : public Sampler {
  public:
-  GatherSampler(const std::vector<u8>& args, const TableMetadata& table)
-    : Sampler("Gather", table) {
+  GatherSampler(const std::vector<u8>& args, const TableMetadata& table,
+                const KeyframeIndex& keyframes)
+    : Sampler("Gather", table, keyframes) {
     valid_.set_success(true);
     if (!args_.ParseFromArray(args.data(), args.size())) {
       RESULT_ERROR(&valid_,
@@ -274,7 +383,27 @@ class GatherSampler : public Sampler {
     }
     for (i32 i = 0; i < args_.samples_size(); ++i) {
       auto& s = args_.samples(i);
-      total_rows_ += args_.samples(i).rows_size();
+      if (s.row_runs_size() % 3 != 0) {
+        RESULT_ERROR(&valid_,
+                     "Gather sample %d row runs (%d values) are not "
+                     "(start, count, stride) triples",
+                     i, s.row_runs_size());
+        return;
+      }
+      total_rows_ += s.rows_size() + s.row_deltas_size();
+      for (i32 r = 0; r < s.row_runs_size(); r += 3) {
+        i64 start = s.row_runs(r);
+        i64 count = s.row_runs(r + 1);
+        i64 stride = s.row_runs(r + 2);
+        if (start < 0 || count < 0 || stride <= 0) {
+          RESULT_ERROR(&valid_,
+                       "Gather sample %d has an invalid row run (start %ld, "
+                       "count %ld, stride %ld)",
+                       i, start, count, stride);
+          return;
+        }
+        total_rows_ += count;
+      }
     }
   }
 
@@ -290,6 +419,19 @@ class GatherSampler : public Sampler {
     sample.warmup_rows =
         std::vector<i64>(s.warmup_rows().begin(), s.warmup_rows().end());
     sample.rows = std::vector<i64>(s.rows().begin(), s.rows().end());
+    for (i32 r = 0; r < s.row_runs_size(); r += 3) {
+      i64 start = s.row_runs(r);
+      i64 count = s.row_runs(r + 1);
+      i64 stride = s.row_runs(r + 2);
+      for (i64 i = 0; i < count; ++i) {
+        sample.rows.push_back(start + i * stride);
+      }
+    }
+    i64 row = 0;
+    for (i64 delta : s.row_deltas()) {
+      row += delta;
+      sample.rows.push_back(row);
+    }
     samples_pos_++;
     assert(samples_pos_ <= args_.samples_size());
     return sample;
@@ -304,23 +446,332 @@ class GatherSampler : public Sampler {
   size_t samples_pos_ = 0;
 };
 
+class NearestKeyframeSampler : public Sampler {
+ public:
+  NearestKeyframeSampler(const std::vector<u8>& args,
+                         const TableMetadata& table,
+                         const KeyframeIndex& keyframes)
+    : Sampler("NearestKeyframe", table, keyframes) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(
+          &valid_,
+          "NearestKeyframe sampler provided with invalid protobuf args");
+      return;
+    }
+    if (args_.sample_size() <= 0) {
+      RESULT_ERROR(&valid_,
+                   "NearestKeyframe sample size (%ld) must be greater than 0",
+                   args_.sample_size());
+      return;
+    }
+    if (keyframes_.rows.empty()) {
+      RESULT_ERROR(&valid_,
+                   "NearestKeyframe sampler needs a video column, which "
+                   "table %s does not have",
+                   table.name().c_str());
+      return;
+    }
+    std::set<i64> rows;
+    for (i64 r : args_.rows()) {
+      if (r < 0 || r >= table.num_rows()) {
+        RESULT_ERROR(&valid_,
+                     "NearestKeyframe row (%ld) should be less than table "
+                     "num rows (%ld)",
+                     r, table.num_rows());
+        return;
+      }
+      rows.insert(nearest_keyframe(keyframes_.rows, r, -1, table.num_rows(),
+                                   std::numeric_limits<i64>::max()));
+    }
+    rows_.assign(rows.begin(), rows.end());
+  }
+
+  Result validate() override { return valid_; }
+
+  i64 total_rows() const override { return rows_.size(); }
+
+  i64 total_samples() const override {
+    return (rows_.size() + args_.sample_size() - 1) / args_.sample_size();
+  }
+
+  RowSample next_sample() override {
+    RowSample sample;
+    size_t e = std::min(rows_.size(), rows_pos_ + (size_t)args_.sample_size());
+    sample.rows.assign(rows_.begin() + rows_pos_, rows_.begin() + e);
+    rows_pos_ = e;
+    return sample;
+  }
+
+  void reset() override { rows_pos_ = 0; }
+
+ private:
+  Result valid_;
+  proto::NearestKeyframeSamplerArgs args_;
+  std::vector<i64> rows_;
+  size_t rows_pos_ = 0;
+};
+
+class TimeSampler : public Sampler {
+ public:
+  TimeSampler(const std::vector<u8>& args, const TableMetadata& table,
+              const KeyframeIndex& keyframes)
+    : Sampler("Time", table, keyframes) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_, "Time sampler provided with invalid protobuf args");
+      return;
+    }
+    if (args_.fps() <= 0) {
+      RESULT_ERROR(&valid_, "Time sampler fps (%f) must be greater than 0",
+                   args_.fps());
+      return;
+    }
+    if (args_.sample_size() <= 0) {
+      RESULT_ERROR(&valid_,
+                   "Time sampler sample size (%ld) must be greater than 0",
+                   args_.sample_size());
+      return;
+    }
+    if (keyframes_.seconds.empty()) {
+      RESULT_ERROR(&valid_,
+                   "Time sampler needs a video column with keyframe "
+                   "timestamps, which table %s does not have",
+                   table.name().c_str());
+      return;
+    }
+    f64 end = args_.end() > 0
+                  ? std::min(args_.end(), keyframes_.end_seconds)
+                  : keyframes_.end_seconds;
+    if (args_.start() < 0 || args_.start() > end) {
+      RESULT_ERROR(&valid_,
+                   "Time sampler start (%f) should be between 0 and the end "
+                   "(%f)",
+                   args_.start(), end);
+      return;
+    }
+    // Frames shown for less than a sampling period appear once
+    for (i64 i = 0;; ++i) {
+      f64 seconds = args_.start() + i / args_.fps();
+      if (seconds >= end) {
+        break;
+      }
+      i64 row = row_at(seconds);
+      if (rows_.empty() || rows_.back() != row) {
+        rows_.push_back(row);
+      }
+    }
+  }
+
+  Result validate() override { return valid_; }
+
+  i64 total_rows() const override { return rows_.size(); }
+
+  i64 total_samples() const override {
+    return (rows_.size() + args_.sample_size() - 1) / args_.sample_size();
+  }
+
+  RowSample next_sample() override {
+    RowSample sample;
+    size_t e = std::min(rows_.size(), rows_pos_ + (size_t)args_.sample_size());
+    sample.rows.assign(rows_.begin() + rows_pos_, rows_.begin() + e);
+    rows_pos_ = e;
+    return sample;
+  }
+
+  void reset() override { rows_pos_ = 0; }
+
+ private:
+  // Row shown at seconds, taking the frames of a GOP to be evenly spaced
+  // between its keyframe and the next
+  i64 row_at(f64 seconds) const {
+    const std::vector<f64>& times = keyframes_.seconds;
+    const std::vector<i64>& rows = keyframes_.rows;
+    size_t k = std::upper_bound(times.begin(), times.end(), seconds) -
+               times.begin();
+    k = k > 0 ? k - 1 : 0;
+    bool last = k + 1 == rows.size();
+    i64 next_row = last ? table_.num_rows() : rows[k + 1];
+    f64 next_seconds = last ? keyframes_.end_seconds : times[k + 1];
+    if (next_row <= rows[k] + 1 || next_seconds <= times[k]) {
+      return rows[k];
+    }
+    f64 frame_seconds = (next_seconds - times[k]) / (next_row - rows[k]);
+    i64 frame = (i64)((seconds - times[k]) / frame_seconds + 1e-6);
+    return std::min(rows[k] + frame, next_row - 1);
+  }
+
+  Result valid_;
+  proto::TimeSamplerArgs args_;
+  std::vector<i64> rows_;
+  size_t rows_pos_ = 0;
+};
+
+class ZoneMapSampler : public Sampler {
+ public:
+  ZoneMapSampler(const std::vector<u8>& args, const TableMetadata& table,
+                 const KeyframeIndex& keyframes, const ZoneMaps& zone_maps)
+    : Sampler("ZoneMap", table, keyframes) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(args.data(), args.size())) {
+      RESULT_ERROR(&valid_,
+                   "ZoneMap sampler provided with invalid protobuf args");
+      return;
+    }
+    if (args_.min() > args_.max()) {
+      RESULT_ERROR(&valid_, "ZoneMap sampler min (%f) is greater than max (%f)",
+                   args_.min(), args_.max());
+      return;
+    }
+    auto it = zone_maps.find(args_.column());
+    if (it == zone_maps.end()) {
+      RESULT_ERROR(&valid_,
+                   "ZoneMap sampler column %s of table %s was not written "
+                   "with a zone map",
+                   args_.column().c_str(), table.name().c_str());
+      return;
+    }
+    std::vector<i64> end_rows = table.end_rows();
+    const std::vector<proto::ZoneMapDescriptor>& zones = it->second;
+    if (zones.size() != end_rows.size()) {
+      RESULT_ERROR(&valid_,
+                   "ZoneMap sampler column %s of table %s has zone maps for "
+                   "%lu of its %lu items",
+                   args_.column().c_str(), table.name().c_str(), zones.size(),
+                   end_rows.size());
+      return;
+    }
+    // Items with no rows, or only NaNs, have no values in any range
+    i64 start = 0;
+    for (size_t i = 0; i < end_rows.size(); ++i) {
+      const proto::ZoneMapDescriptor& zone = zones[i];
+      if (zone.count() > 0 && zone.min() <= args_.max() &&
+          zone.max() >= args_.min()) {
+        items_.emplace_back(start, end_rows[i]);
+        total_rows_ += end_rows[i] - start;
+      }
+      start = end_rows[i];
+    }
+  }
+
+  Result validate() override { return valid_; }
+
+  i64 total_rows() const override { return total_rows_; }
+
+  i64 total_samples() const override { return items_.size(); }
+
+  RowSample next_sample() override {
+    RowSample sample;
+    i64 s, e;
+    std::tie(s, e) = items_[samples_pos_++];
+    for (i64 i = s; i < e; ++i) {
+      sample.rows.push_back(i);
+    }
+    return sample;
+  }
+
+  void reset() override { samples_pos_ = 0; }
+
+ private:
+  Result valid_;
+  proto::ZoneMapSamplerArgs args_;
+  // First and last row + 1 of each selected item
+  std::vector<std::tuple<i64, i64>> items_;
+  i64 total_rows_ = 0;
+  size_t samples_pos_ = 0;
+};
+
 template <typename T>
 SamplerFactory make_factory() {
-  return [](const std::vector<u8>& args, const TableMetadata& table) {
-    return new T(args, table);
+  return [](const std::vector<u8>& args, const TableMetadata& table,
+            const KeyframeIndex& keyframes, const ZoneMaps& zone_maps) {
+    return new T(args, table, keyframes);
+  };
+}
+
+template <>
+SamplerFactory make_factory<ZoneMapSampler>() {
+  return [](const std::vector<u8>& args, const TableMetadata& table,
+            const KeyframeIndex& keyframes, const ZoneMaps& zone_maps) {
+    return new ZoneMapSampler(args, table, keyframes, zone_maps);
   };
 }
 }
 
+KeyframeIndex table_keyframe_index(
+    const TableMetadata& table,
+    const std::vector<proto::VideoDescriptor>& videos) {
+  KeyframeIndex index;
+  i32 column_id = -1;
+  for (const proto::Column& column : table.columns()) {
+    if (column.type() == ColumnType::Video) {
+      column_id = column.id();
+      break;
+    }
+  }
+  if (column_id == -1) {
+    return index;
+  }
+  std::vector<i64> end_rows = table.end_rows();
+  std::map<i32, const proto::VideoDescriptor*> items;
+  for (const proto::VideoDescriptor& video : videos) {
+    if (video.column_id() == column_id) {
+      items[video.item_id()] = &video;
+    }
+  }
+  bool timed = true;
+  // Items follow each other in time, each starting where the last ended
+  f64 item_start_seconds = 0;
+  for (auto& kv : items) {
+    const proto::VideoDescriptor& video = *kv.second;
+    i64 item_start = kv.first == 0 ? 0 : end_rows.at(kv.first - 1);
+    for (i64 k : video.keyframe_positions()) {
+      index.rows.push_back(item_start + k);
+    }
+    i32 keyframes = video.keyframe_positions_size();
+    timed &= keyframes > 0 && video.keyframe_timestamps_size() == keyframes &&
+             video.time_base_num() > 0 && video.time_base_denom() > 0;
+    if (!timed) {
+      continue;
+    }
+    f64 time_base = video.time_base_num() / (f64)video.time_base_denom();
+    i64 first_timestamp = video.keyframe_timestamps(0);
+    for (i64 timestamp : video.keyframe_timestamps()) {
+      index.seconds.push_back(item_start_seconds +
+                              (timestamp - first_timestamp) * time_base);
+    }
+    // Frames after the last keyframe last as long as the average frame
+    // before it, or one time base unit if there is only one GOP
+    i64 last_position = video.keyframe_positions(keyframes - 1);
+    f64 last_seconds = index.seconds.back();
+    f64 frame_seconds =
+        last_position > 0
+            ? (last_seconds - item_start_seconds) / last_position
+            : time_base;
+    item_start_seconds =
+        last_seconds + (video.frames() - last_position) * frame_seconds;
+  }
+  if (timed) {
+    index.end_seconds = item_start_seconds;
+  } else {
+    index.seconds.clear();
+  }
+  return index;
+}
+
 Result make_sampler_instance(const std::string& sampler_type,
                              const std::vector<u8>& sampler_args,
                              const TableMetadata& sampled_table,
-                             Sampler*& sampler) {
+                             const KeyframeIndex& keyframes,
+                             const ZoneMaps& zone_maps, Sampler*& sampler) {
   static std::map<std::string, SamplerFactory> samplers = {
       {"All", make_factory<AllSampler>()},
       {"StridedRange", make_factory<StridedRangeSampler>()},
       {"Stencil", make_factory<StencilSampler>()},
-      {"Gather", make_factory<GatherSampler>()}};
+      {"Gather", make_factory<GatherSampler>()},
+      {"NearestKeyframe", make_factory<NearestKeyframeSampler>()},
+      {"Time", make_factory<TimeSampler>()},
+      {"ZoneMap", make_factory<ZoneMapSampler>()}};
 
   Result result;
   result.set_success(true);
@@ -334,7 +785,8 @@ Result make_sampler_instance(const std::string& sampler_type,
 
   // Validate sampler args
   SamplerFactory factory = it->second;
-  Sampler* potential_sampler = factory(sampler_args, sampled_table);
+  Sampler* potential_sampler =
+      factory(sampler_args, sampled_table, keyframes, zone_maps);
   result = potential_sampler->validate();
   if (!result.success()) {
     delete potential_sampler;
@@ -347,6 +799,8 @@ Result make_sampler_instance(const std::string& sampler_type,
 
 TaskSampler::TaskSampler(
     const std::map<std::string, TableMetadata>& table_metas,
+    const std::map<std::string, KeyframeIndex>& table_keyframes,
+    const std::map<std::string, ZoneMaps>& table_zone_maps,
     const proto::Task& task)
   : table_metas_(table_metas), task_(task) {
   valid_.set_success(true);
@@ -365,9 +819,16 @@ TaskSampler::TaskSampler(
     const TableMetadata& t_meta = table_metas.at(sample.table_name());
     std::vector<u8> sampler_args(sample.sampling_args().begin(),
                                  sample.sampling_args().end());
+    auto keyframes_it = table_keyframes.find(sample.table_name());
+    auto zone_maps_it = table_zone_maps.find(sample.table_name());
     Sampler* sampler = nullptr;
-    valid_ = make_sampler_instance(sample.sampling_function(), sampler_args,
-                                   t_meta, sampler);
+    valid_ = make_sampler_instance(
+        sample.sampling_function(), sampler_args, t_meta,
+        keyframes_it != table_keyframes.end() ? keyframes_it->second
+                                              : KeyframeIndex(),
+        zone_maps_it != table_zone_maps.end() ? zone_maps_it->second
+                                              : ZoneMaps(),
+        sampler);
     if (!valid_.success()) {
       return;
     }
@@ -470,5 +931,59 @@ Result TaskSampler::next_work(proto::NewWork& new_work) {
 
   return valid_;
 }
+
+TaskSamplerQueue::TaskSamplerQueue(
+    const std::map<std::string, TableMetadata>& table_metas,
+    const std::map<std::string, KeyframeIndex>& table_keyframes,
+    const std::map<std::string, ZoneMaps>& table_zone_maps,
+    const google::protobuf::RepeatedPtrField<proto::Task>& tasks,
+    i64 lookahead)
+  : table_metas_(table_metas),
+    table_keyframes_(table_keyframes),
+    table_zone_maps_(table_zone_maps),
+    tasks_(tasks),
+    lookahead_(lookahead) {
+  thread_ = std::thread(&TaskSamplerQueue::run, this);
+}
+
+TaskSamplerQueue::~TaskSamplerQueue() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stopped_ = true;
+  }
+  space_.notify_all();
+  thread_.join();
+}
+
+std::unique_ptr<TaskSampler> TaskSamplerQueue::next() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  ready_.wait(lock, [this] { return !samplers_.empty(); });
+  std::unique_ptr<TaskSampler> sampler = std::move(samplers_.front());
+  samplers_.pop_front();
+  lock.unlock();
+  space_.notify_one();
+  return sampler;
+}
+
+void TaskSamplerQueue::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    space_.wait(lock, [this] {
+      return stopped_ || (next_task_ < tasks_.size() &&
+                          (i64)samplers_.size() < lookahead_);
+    });
+    if (stopped_) {
+      return;
+    }
+    i64 task = next_task_++;
+    lock.unlock();
+    // Validates the task's samplers, which is most of the work
+    std::unique_ptr<TaskSampler> sampler(new TaskSampler(
+        table_metas_, table_keyframes_, table_zone_maps_, tasks_.Get(task)));
+    lock.lock();
+    samplers_.push_back(std::move(sampler));
+    ready_.notify_one();
+  }
+}
 }
 }
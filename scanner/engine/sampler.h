@@ -19,6 +19,10 @@
 #include "scanner/util/common.h"
 #include "scanner/util/profiler.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace scanner {
@@ -30,11 +34,31 @@ namespace internal {
    - Range: select all rows within [start, end)
    - Strided Range: select every Nth row within [start, end)
    - Gather: select arbitrary set of rows
+   - Nearest Keyframe: select the keyframe nearest to each of a set of rows
+   - Time: select the rows shown at a rate of frames per second of video
+     time
+   - Zone Map: select the items whose values of a column may be in a range
 
    Requiring access to more than metadata:
    - Filter: select all rows where some predicate holds on one of the columns
  */
 
+//! Where the GOPs of a table's video column begin, for the samplers that
+//! align to them or sample by time
+struct KeyframeIndex {
+  //! Rows that begin a GOP, in order
+  std::vector<i64> rows;
+  //! Presentation time of each of rows in seconds from the start of the
+  //! table, or empty if the videos have no timestamps
+  std::vector<f64> seconds;
+  //! Presentation time at which the last row ends
+  f64 end_seconds = 0;
+};
+
+//! ZoneMapDescriptor of each item of the columns of a table, by column name,
+//! for the samplers that skip items by their values
+using ZoneMaps = std::map<std::string, std::vector<proto::ZoneMapDescriptor>>;
+
 struct RowSample {
   std::vector<i64> warmup_rows;
   std::vector<i64> rows;
@@ -42,8 +66,9 @@ struct RowSample {
 
 class Sampler {
  public:
-  Sampler(const std::string& name, const TableMetadata& table)
-    : name_(name), table_(table) {}
+  Sampler(const std::string& name, const TableMetadata& table,
+          const KeyframeIndex& keyframes)
+    : name_(name), table_(table), keyframes_(keyframes) {}
 
   virtual ~Sampler() {}
 
@@ -62,16 +87,30 @@ class Sampler {
  protected:
   std::string name_;
   TableMetadata table_;
+  //! GOPs of the table's video column, with no rows if it has none
+  KeyframeIndex keyframes_;
 };
 
 Result make_sampler_instance(const std::string& sampler_type,
                              const std::vector<u8>& sampler_args,
                              const TableMetadata& sampled_table,
-                             Sampler*& sampler);
+                             const KeyframeIndex& keyframes,
+                             const ZoneMaps& zone_maps, Sampler*& sampler);
+
+//! GOPs of the first video column of table, given the descriptors of its
+//! videos. Has no rows if the table has no video column.
+KeyframeIndex table_keyframe_index(
+    const TableMetadata& table,
+    const std::vector<proto::VideoDescriptor>& videos);
 
 class TaskSampler {
  public:
+  //! table_keyframes holds the GOPs of each table the task samples, and
+  //! table_zone_maps the zone maps read for its samplers, for the samplers
+  //! that use them. Tables they do not list have none.
   TaskSampler(const std::map<std::string, TableMetadata>& table_metas,
+              const std::map<std::string, KeyframeIndex>& table_keyframes,
+              const std::map<std::string, ZoneMaps>& table_zone_maps,
               const proto::Task& task);
 
   Result validate();
@@ -93,5 +132,44 @@ class TaskSampler {
   i64 samples_pos_ = 0;
   i64 allocated_rows_ = 0;
 };
+
+//! Builds the task samplers of a job's tasks in order on a background
+//! thread, up to lookahead tasks ahead of the one in use, so that handing
+//! out the first item of a task does not wait on parsing its samples.
+//
+// The table maps and tasks must outlive the queue and not change while it
+// runs.
+class TaskSamplerQueue {
+ public:
+  TaskSamplerQueue(
+      const std::map<std::string, TableMetadata>& table_metas,
+      const std::map<std::string, KeyframeIndex>& table_keyframes,
+      const std::map<std::string, ZoneMaps>& table_zone_maps,
+      const google::protobuf::RepeatedPtrField<proto::Task>& tasks,
+      i64 lookahead);
+
+  ~TaskSamplerQueue();
+
+  //! Sampler of the next task, waiting for it to be built if it is not yet.
+  //! Must be called at most once per task.
+  std::unique_ptr<TaskSampler> next();
+
+ private:
+  void run();
+
+  const std::map<std::string, TableMetadata>& table_metas_;
+  const std::map<std::string, KeyframeIndex>& table_keyframes_;
+  const std::map<std::string, ZoneMaps>& table_zone_maps_;
+  const google::protobuf::RepeatedPtrField<proto::Task>& tasks_;
+  const i64 lookahead_;
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::condition_variable space_;
+  std::deque<std::unique_ptr<TaskSampler>> samplers_;
+  i64 next_task_ = 0;
+  bool stopped_ = false;
+  std::thread thread_;
+};
 }
 }
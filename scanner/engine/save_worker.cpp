@@ -16,6 +16,7 @@
 #include "scanner/engine/save_worker.h"
 
 #include "scanner/engine/metadata.h"
+#include "scanner/engine/metadata_cache.h"
 #include "scanner/util/common.h"
 #include "scanner/util/storehouse.h"
 #include "scanner/video/h264_byte_stream_index_creator.h"
@@ -24,6 +25,9 @@
 
 #include <glog/logging.h>
 
+#include <cmath>
+#include <limits>
+
 using storehouse::StoreResult;
 using storehouse::WriteFile;
 using storehouse::RandomReadFile;
@@ -31,198 +35,578 @@ using storehouse::RandomReadFile;
 namespace scanner {
 namespace internal {
 
-void* save_thread(void* arg) {
-  SaveThreadArgs& args = *reinterpret_cast<SaveThreadArgs*>(arg);
+namespace {
+
+void save_buffered_file(storehouse::StorageBackend* storage,
+                        BufferedWriteFile* file, Profiler& profiler) {
+  auto upload_start = now();
+  std::unique_ptr<WriteFile> output_file;
+  // Items of local tables go to this node's disk instead of storage
+  STORE_CHECK(make_unique_write_file(item_storage(storage, file->path()),
+                                     file->path(), output_file));
+  file->write_to(output_file.get());
+  STORE_CHECK(output_file->save());
+  profiler.add_interval("upload", upload_start, now());
+  profiler.increment("io_write", file->size());
+  static std::atomic<i64>& write_bytes =
+      metric_counter("scanner_io_write_bytes_total");
+  write_bytes += file->size();
+}
 
-  auto setup_start = now();
+template <typename T>
+void summarize_rows(const ElementList& rows, f64& min, f64& max) {
+  for (const Element& element : rows) {
+    const T* values = reinterpret_cast<const T*>(element.buffer);
+    size_t num_values = element.size / sizeof(T);
+    for (size_t i = 0; i < num_values; ++i) {
+      f64 value = values[i];
+      if (std::isnan(value)) {
+        continue;
+      }
+      min = std::min(min, value);
+      max = std::max(max, value);
+    }
+  }
+}
 
-  // Setup a distinct storage backend for each IO thread
-  storehouse::StorageBackend* storage =
-      storehouse::StorageBackend::make_from_config(args.storage_config);
+//! Zone map of the rows of an item of a Tensor column
+proto::ZoneMapDescriptor zone_map(const Column& column,
+                                  const ElementList& rows) {
+  f64 min = std::numeric_limits<f64>::infinity();
+  f64 max = -std::numeric_limits<f64>::infinity();
+  switch (column.tensor_type()) {
+    case Column::UINT8:
+      summarize_rows<u8>(rows, min, max);
+      break;
+    case Column::INT32:
+      summarize_rows<i32>(rows, min, max);
+      break;
+    case Column::INT64:
+      summarize_rows<i64>(rows, min, max);
+      break;
+    case Column::FLOAT32:
+      summarize_rows<f32>(rows, min, max);
+      break;
+    case Column::FLOAT64:
+      summarize_rows<f64>(rows, min, max);
+      break;
+    default:
+      LOG(FATAL) << "Column " << column.name() << " has an unknown tensor type";
+  }
+  proto::ZoneMapDescriptor zone;
+  zone.set_count(rows.size());
+  zone.set_min(min);
+  zone.set_max(max);
+  return zone;
+}
+}
 
-  args.profiler.add_interval("setup", setup_start, now());
+BufferedWriteFile::BufferedWriteFile(const std::string& path) : path_(path) {}
 
-  while (true) {
-    auto idle_start = now();
+BufferedWriteFile::~BufferedWriteFile() {
+  for (u8* buffer : buffers_) {
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+}
 
-    std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry> entry;
-    args.input_work.pop(entry);
-    IOItem& io_item = std::get<1>(entry);
-    EvalWorkEntry& work_entry = std::get<2>(entry);
+StoreResult BufferedWriteFile::append(size_t size, const u8* data) {
+  if (segments_.empty() || segments_.back().chunk < 0) {
+    chunks_.emplace_back();
+    segments_.push_back({(i32)chunks_.size() - 1, nullptr, 0});
+  }
+  std::vector<u8>& chunk = chunks_[segments_.back().chunk];
+  chunk.insert(chunk.end(), data, data + size);
+  segments_.back().size += size;
+  size_ += size;
+  return StoreResult::Success;
+}
 
-    if (work_entry.io_item_index == -1) {
-      break;
+void BufferedWriteFile::append_buffer(size_t size, u8* buffer) {
+  // Rows of a block buffer are adjacent, so they extend the same segment
+  bool follows = !segments_.empty() && segments_.back().chunk < 0 &&
+                 segments_.back().data + segments_.back().size == buffer;
+  if (!follows && size < MIN_BORROWED_SIZE) {
+    append(size, buffer);
+    delete_buffer(CPU_DEVICE, buffer);
+    return;
+  }
+  buffers_.push_back(buffer);
+  if (follows) {
+    segments_.back().size += size;
+  } else {
+    segments_.push_back({-1, buffer, size});
+  }
+  size_ += size;
+}
+
+void BufferedWriteFile::append_file(BufferedWriteFile& other) {
+  for (const Segment& segment : other.segments_) {
+    if (segment.chunk < 0) {
+      segments_.push_back(segment);
+    } else {
+      chunks_.push_back(std::move(other.chunks_[segment.chunk]));
+      segments_.push_back({(i32)chunks_.size() - 1, nullptr, segment.size});
     }
+  }
+  buffers_.insert(buffers_.end(), other.buffers_.begin(),
+                  other.buffers_.end());
+  size_ += other.size_;
+  other.segments_.clear();
+  other.chunks_.clear();
+  other.buffers_.clear();
+  other.size_ = 0;
+}
 
-    VLOG(2) << "Save (N/KI: " << args.node_id << "/" << args.id
-            << "): processing item " << work_entry.io_item_index;
+StoreResult BufferedWriteFile::save() { return StoreResult::Success; }
 
-    args.profiler.add_interval("idle", idle_start, now());
+const std::string BufferedWriteFile::path() { return path_; }
 
-    auto work_start = now();
+size_t BufferedWriteFile::size() const { return size_; }
 
-    // Write out each output column to an individual data file
-    i32 video_col_idx = 0;
-    for (size_t out_idx = 0; out_idx < work_entry.columns.size(); ++out_idx) {
-      u64 num_elements = static_cast<u64>(work_entry.columns[out_idx].size());
+void BufferedWriteFile::write_to(WriteFile* file) const {
+  for (const Segment& segment : segments_) {
+    const u8* data =
+        segment.chunk < 0 ? segment.data : chunks_[segment.chunk].data();
+    s_write(file, data, segment.size);
+  }
+}
 
-      const std::string output_path = table_item_output_path(
-          io_item.table_id(), out_idx, io_item.item_id());
+UploadQueue::UploadQueue(storehouse::StorageConfig* storage_config,
+                         i32 num_threads, i64 max_bytes)
+  : storage_config_(storage_config),
+    max_bytes_(max_bytes),
+    storage_(num_threads),
+    pool_(num_threads) {}
+
+UploadQueue::~UploadQueue() { wait_idle(); }
+
+void UploadQueue::submit(
+    std::vector<std::unique_ptr<BufferedWriteFile>> files,
+    std::vector<std::unique_ptr<BufferedWriteFile>> commit_files,
+    Profiler& profiler, std::function<void()> done) {
+  i64 item_bytes = 0;
+  for (auto& file : files) {
+    item_bytes += file->size();
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto wait_start = now();
+    space_available_.wait(lock, [&] {
+      return bytes_in_flight_ == 0 ||
+             bytes_in_flight_ + item_bytes <= max_bytes_;
+    });
+    profiler.add_interval("upload_wait", wait_start, now());
+    bytes_in_flight_ += item_bytes;
+  }
+  if (files.empty()) {
+    files = std::move(commit_files);
+    commit_files.clear();
+  }
+  if (files.empty()) {
+    done();
+    return;
+  }
 
-      auto io_start = now();
+  // Each file is uploaded as its own task and the last one to finish saves
+  // the commit files and reports the item
+  auto remaining = std::make_shared<std::atomic<i32>>(files.size());
+  auto commits =
+      std::make_shared<std::vector<std::unique_ptr<BufferedWriteFile>>>(
+          std::move(commit_files));
+  for (auto& f : files) {
+    std::shared_ptr<BufferedWriteFile> file(std::move(f));
+    pool_.submit([this, file, remaining, commits, item_bytes, done,
+                  &profiler](i32 thread_id) {
+      upload(thread_id, file.get(), profiler);
+      if (--(*remaining) > 0) {
+        return;
+      }
+      for (auto& commit : *commits) {
+        upload(thread_id, commit.get(), profiler);
+      }
+      done();
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        bytes_in_flight_ -= item_bytes;
+      }
+      space_available_.notify_all();
+    });
+  }
+}
 
-      WriteFile* output_file = nullptr;
-      BACKOFF_FAIL(storage->make_write_file(output_path, output_file));
+void UploadQueue::wait_idle() { pool_.wait_idle(); }
 
-      if (work_entry.columns[out_idx].size() != num_elements) {
-        LOG(FATAL) << "Output layer's element vector has wrong length";
+void UploadQueue::upload(i32 thread_id, BufferedWriteFile* file,
+                         Profiler& profiler) {
+  std::unique_ptr<storehouse::StorageBackend>& storage = storage_[thread_id];
+  if (!storage) {
+    storage.reset(
+        storehouse::StorageBackend::make_from_config(storage_config_));
+  }
+  save_buffered_file(storage.get(), file, profiler);
+}
+
+SaveWorker::SaveWorker(const SaveWorkerArgs& args)
+  : args_(args),
+    storage_(
+        storehouse::StorageBackend::make_from_config(args.storage_config)) {}
+
+void SaveWorker::feed(
+    std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry>& entry) {
+  IOItem& io_item = std::get<1>(entry);
+  EvalWorkEntry& work_entry = std::get<2>(entry);
+
+  VLOG(2) << "Save (N/KI: " << args_.node_id << "/" << args_.id
+          << "): processing item " << work_entry.io_item_index;
+
+  bool cancelled;
+  {
+    std::unique_lock<std::mutex> lk(args_.cancelled_items.mutex);
+    cancelled = args_.cancelled_items.items.count(std::make_tuple(
+                    io_item.table_id(), io_item.item_id())) > 0;
+  }
+  if (cancelled) {
+    // Another node already committed this item, so discard our copy
+    VLOG(2) << "Save (N/KI: " << args_.node_id << "/" << args_.id
+            << "): dropping item " << work_entry.io_item_index
+            << " committed elsewhere";
+    for (size_t out_idx = 0; out_idx < work_entry.columns.size(); ++out_idx) {
+      for (Element& element : work_entry.columns[out_idx]) {
+        delete_element(work_entry.column_handles[out_idx], element);
       }
+    }
+    args_.retired_items++;
+    return;
+  }
 
-      // Ensure the data is on the CPU
-      move_if_different_address_space(args.profiler,
+  auto work_start = now();
+
+  Queue<IOItem>& finished_items = args_.finished_items;
+  Queue<proto::StreamedItem>& streamed_items = args_.streamed_items;
+  std::atomic<i64>& retired_items = args_.retired_items;
+  std::shared_ptr<proto::StreamedItem> streamed;
+  if (!args_.stream_columns.empty()) {
+    auto stream_start = now();
+    streamed.reset(new proto::StreamedItem);
+    for (i64 row : work_entry.row_ids) {
+      streamed->add_rows(row);
+    }
+    for (auto& kv : args_.stream_columns) {
+      i32 out_idx = kv.first;
+      move_if_different_address_space(args_.profiler,
                                       work_entry.column_handles[out_idx],
                                       CPU_DEVICE, work_entry.columns[out_idx]);
+      work_entry.column_handles[out_idx] = CPU_DEVICE;
+      proto::StreamedColumn* column = streamed->add_columns();
+      column->set_name(kv.second);
+      for (Element& element : work_entry.columns[out_idx]) {
+        column->add_elements(element.buffer, element.size);
+      }
+    }
+    args_.profiler.add_interval("stream", stream_start, now());
+  }
+  if (args_.stream_only) {
+    for (size_t out_idx = 0; out_idx < work_entry.columns.size(); ++out_idx) {
+      for (Element& element : work_entry.columns[out_idx]) {
+        delete_element(work_entry.column_handles[out_idx], element);
+      }
+    }
+    io_item.set_output_rows(work_entry.row_ids.size());
+    if (streamed) {
+      streamed->mutable_io_item()->CopyFrom(io_item);
+      streamed_items.push(std::move(*streamed));
+    }
+    finished_items.push(io_item);
+    retired_items++;
+    args_.profiler.add_interval("task", work_start, now(),
+                                work_entry.io_item_index);
+    return;
+  }
 
-      bool compressed = work_entry.compressed[out_idx];
-      // If this is a video...
-      i64 size_written = 0;
-      if (work_entry.column_types[out_idx] == ColumnType::Video) {
-        // Read frame info column
-        assert(work_entry.columns[out_idx].size() > 0);
-        FrameInfo frame_info = work_entry.frame_sizes[video_col_idx];
-
-        // Create index column
-        VideoMetadata video_meta;
-        proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
-        video_descriptor.set_table_id(io_item.table_id());
-        video_descriptor.set_column_id(out_idx);
-        video_descriptor.set_item_id(io_item.item_id());
-
-        video_descriptor.set_width(frame_info.width());
-        video_descriptor.set_height(frame_info.height());
-        video_descriptor.set_channels(frame_info.channels());
-        video_descriptor.set_frame_type(frame_info.type);
-
-        video_descriptor.set_time_base_num(1);
-        video_descriptor.set_time_base_denom(25);
-
-        if (compressed && frame_info.type == FrameType::U8 &&
-            frame_info.channels() == 3) {
-          H264ByteStreamIndexCreator index_creator(output_file);
-          for (size_t i = 0; i < num_elements; ++i) {
-            Element& element = work_entry.columns[out_idx][i];
-            if (!index_creator.feed_packet(element.buffer, element.size)) {
-              LOG(FATAL) << "Error in save worker h264 index creator: "
-                         << index_creator.error_message();
-            }
-            size_written += element.size;
-          }
+  std::shared_ptr<const TableMetadata> table =
+      metadata_cache().table(storage_.get(), io_item.table_id());
+  // Merged jobs write the same item of each of their output tables
+  std::vector<std::shared_ptr<const TableMetadata>> tables = {table};
+  auto shared_it = args_.shared_output_tables.find(io_item.table_id());
+  if (shared_it != args_.shared_output_tables.end()) {
+    for (i32 table_id : shared_it->second) {
+      tables.push_back(metadata_cache().table(storage_.get(), table_id));
+    }
+  }
 
-          i64 frame = index_creator.frames();
-          i32 num_non_ref_frames = index_creator.num_non_ref_frames();
-          const std::vector<u8>& metadata_bytes =
-              index_creator.metadata_bytes();
-          const std::vector<i64>& keyframe_positions =
-              index_creator.keyframe_positions();
-          const std::vector<i64>& keyframe_timestamps =
-              index_creator.keyframe_timestamps();
-          const std::vector<i64>& keyframe_byte_offsets =
-              index_creator.keyframe_byte_offsets();
-
-          video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
-          video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
-
-          video_descriptor.set_frames(frame);
-          video_descriptor.set_metadata_packets(metadata_bytes.data(),
-                                                metadata_bytes.size());
-
-          for (i64 v : keyframe_positions) {
-            video_descriptor.add_keyframe_positions(v);
-          }
-          for (i64 v : keyframe_timestamps) {
-            video_descriptor.add_keyframe_timestamps(v);
-          }
-          for (i64 v : keyframe_byte_offsets) {
-            video_descriptor.add_keyframe_byte_offsets(v);
-          }
-        } else {
-          // Non h264 compressible video column
-          video_descriptor.set_codec_type(proto::VideoDescriptor::RAW);
-          // Need to specify but not used for this type
-          video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
-          video_descriptor.set_frames(num_elements);
-
-          // Write number of elements in the file
-          s_write(output_file, num_elements);
-          // Write out all output sizes first so we can easily index into the
-          // file
-          for (size_t i = 0; i < num_elements; ++i) {
-            Frame* frame = work_entry.columns[out_idx][i].as_frame();
-            i64 buffer_size = frame->size();
-            s_write(output_file, buffer_size);
-            size_written += sizeof(i64);
-          }
-          // Write actual output data
-          for (size_t i = 0; i < num_elements; ++i) {
-            Frame* frame = work_entry.columns[out_idx][i].as_frame();
-            i64 buffer_size = frame->size();
-            u8* buffer = frame->data;
-            s_write(output_file, buffer, buffer_size);
-            size_written += buffer_size;
+  // Write out each output column to an individual data file. Files are
+  // buffered and only saved once the whole item has been serialized.
+  std::vector<std::vector<std::unique_ptr<BufferedWriteFile>>> column_files(
+      tables.size());
+  std::vector<std::unique_ptr<BufferedWriteFile>> files;
+  i32 video_col_idx = 0;
+  for (size_t out_idx = 0; out_idx < work_entry.columns.size(); ++out_idx) {
+    u64 num_elements = static_cast<u64>(work_entry.columns[out_idx].size());
+
+    size_t table_idx = args_.output_column_tables.empty()
+                           ? 0
+                           : args_.output_column_tables[out_idx];
+    const TableMetadata& column_table = *tables.at(table_idx);
+    i32 column_id = column_files[table_idx].size();
+    const std::string output_path = item_file_path(
+        column_table.id(),
+        table_item_output_path(column_table.id(), column_id,
+                               io_item.item_id()));
+
+    auto io_start = now();
+
+    column_files[table_idx].emplace_back(new BufferedWriteFile(output_path));
+    BufferedWriteFile* output_file = column_files[table_idx].back().get();
+
+    if (work_entry.columns[out_idx].size() != num_elements) {
+      LOG(FATAL) << "Output layer's element vector has wrong length";
+    }
+
+    // Ensure the data is on the CPU
+    move_if_different_address_space(args_.profiler,
+                                    work_entry.column_handles[out_idx],
+                                    CPU_DEVICE, work_entry.columns[out_idx]);
+
+    bool compressed = work_entry.compressed[out_idx];
+    // If this is a video...
+    i64 size_written = 0;
+    if (work_entry.column_types[out_idx] == ColumnType::Video) {
+      // Read frame info column
+      assert(work_entry.columns[out_idx].size() > 0);
+      FrameInfo frame_info = work_entry.frame_sizes[video_col_idx];
+
+      // Create index column
+      VideoMetadata video_meta;
+      proto::VideoDescriptor& video_descriptor = video_meta.get_descriptor();
+      video_descriptor.set_table_id(column_table.id());
+      video_descriptor.set_column_id(column_id);
+      video_descriptor.set_item_id(io_item.item_id());
+
+      video_descriptor.set_width(frame_info.width());
+      video_descriptor.set_height(frame_info.height());
+      video_descriptor.set_channels(frame_info.channels());
+      video_descriptor.set_frame_type(frame_info.type);
+
+      video_descriptor.set_time_base_num(1);
+      video_descriptor.set_time_base_denom(25);
+
+      if (compressed && frame_info.type == FrameType::U8 &&
+          frame_info.channels() == 3) {
+        H264ByteStreamIndexCreator index_creator(output_file);
+        for (size_t i = 0; i < num_elements; ++i) {
+          Element& element = work_entry.columns[out_idx][i];
+          if (!index_creator.feed_packet(element.buffer, element.size)) {
+            LOG(FATAL) << "Error in save worker h264 index creator: "
+                       << index_creator.error_message();
           }
+          size_written += element.size;
         }
 
-        // Save our metadata for the frame column
-        write_video_metadata(storage, video_meta);
-
-        video_col_idx++;
+        i64 frame = index_creator.frames();
+        i32 num_non_ref_frames = index_creator.num_non_ref_frames();
+        const std::vector<u8>& metadata_bytes =
+            index_creator.metadata_bytes();
+        const std::vector<i64>& keyframe_positions =
+            index_creator.keyframe_positions();
+        const std::vector<i64>& keyframe_timestamps =
+            index_creator.keyframe_timestamps();
+        const std::vector<i64>& keyframe_byte_offsets =
+            index_creator.keyframe_byte_offsets();
+        const std::vector<i64>& keyframe_packet_sizes =
+            index_creator.keyframe_packet_sizes();
+
+        video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
+        video_descriptor.set_codec_type(proto::VideoDescriptor::H264);
+
+        video_descriptor.set_frames(frame);
+        video_descriptor.set_metadata_packets(metadata_bytes.data(),
+                                              metadata_bytes.size());
+
+        for (i64 v : keyframe_positions) {
+          video_descriptor.add_keyframe_positions(v);
+        }
+        for (i64 v : keyframe_timestamps) {
+          video_descriptor.add_keyframe_timestamps(v);
+        }
+        for (i64 v : keyframe_byte_offsets) {
+          video_descriptor.add_keyframe_byte_offsets(v);
+        }
+        for (i64 v : keyframe_packet_sizes) {
+          video_descriptor.add_keyframe_packet_sizes(v);
+        }
       } else {
-        // Write number of elements in the file
-        s_write(output_file, num_elements);
-        // Write out all output sizes first so we can easily index into the file
+        // Non h264 compressible video column
+        video_descriptor.set_codec_type(proto::VideoDescriptor::RAW);
+        // Need to specify but not used for this type
+        video_descriptor.set_chroma_format(proto::VideoDescriptor::YUV_420);
+        video_descriptor.set_frames(num_elements);
+
+        // Write out the element offsets first so we can easily index into
+        // the file
+        std::vector<i64> element_sizes;
         for (size_t i = 0; i < num_elements; ++i) {
-          i64 buffer_size = work_entry.columns[out_idx][i].size;
-          s_write(output_file, buffer_size);
-          size_written += sizeof(i64);
+          Frame* frame = work_entry.columns[out_idx][i].as_frame();
+          element_sizes.push_back(frame->size());
         }
+        size_written += write_item_file_header(output_file, element_sizes);
         // Write actual output data
         for (size_t i = 0; i < num_elements; ++i) {
-          i64 buffer_size = work_entry.columns[out_idx][i].size;
-          u8* buffer = work_entry.columns[out_idx][i].buffer;
+          Frame* frame = work_entry.columns[out_idx][i].as_frame();
+          i64 buffer_size = frame->size();
+          u8* buffer = frame->data;
           s_write(output_file, buffer, buffer_size);
           size_written += buffer_size;
         }
       }
 
-      BACKOFF_FAIL(output_file->save());
-
-      // TODO(apoms): For now, all evaluators are expected to return CPU
-      //   buffers as output so just assume CPU
-      for (size_t i = 0; i < num_elements; ++i) {
-        delete_element(CPU_DEVICE, work_entry.columns[out_idx][i]);
+      // Save our metadata for the frame column
+      files.emplace_back(new BufferedWriteFile(VideoMetadata::descriptor_path(
+          column_table.id(), column_id, io_item.item_id())));
+      serialize_db_proto<proto::VideoDescriptor>(files.back().get(),
+                                                 video_descriptor);
+
+      video_col_idx++;
+    } else {
+      const Column& column = column_table.columns().at(column_id);
+      if (column.type() == ColumnType::Tensor) {
+        // Every row has the size of the tensor, so no offsets are stored
+        i64 element_size = tensor_element_size(column);
+        for (size_t i = 0; i < num_elements; ++i) {
+          LOG_IF(FATAL,
+                 (i64)work_entry.columns[out_idx][i].size != element_size)
+              << "Row of tensor column " << column.name() << " has "
+              << work_entry.columns[out_idx][i].size << " bytes instead of "
+              << element_size;
+        }
+        size_written += write_tensor_item_file_header(
+            output_file, num_elements, element_size);
+        // Lets the ZoneMap sampler skip the item without reading it
+        if (column.zone_map()) {
+          files.emplace_back(new BufferedWriteFile(table_item_zone_map_path(
+              column_table.id(), column_id, io_item.item_id())));
+          serialize_db_proto<proto::ZoneMapDescriptor>(
+              files.back().get(),
+              zone_map(column, work_entry.columns[out_idx]));
+        }
+      } else {
+        // Write out the element offsets first so we can easily index into
+        // the file
+        std::vector<i64> element_sizes;
+        for (size_t i = 0; i < num_elements; ++i) {
+          element_sizes.push_back(work_entry.columns[out_idx][i].size);
+        }
+        size_written += write_item_file_header(output_file, element_sizes);
       }
+      if (column.block_codec() != Column::NONE) {
+        // Compress the element data in blocks
+        std::vector<u8> data;
+        for (size_t i = 0; i < num_elements; ++i) {
+          Element& element = work_entry.columns[out_idx][i];
+          data.insert(data.end(), element.buffer,
+                      element.buffer + element.size);
+        }
+        size_written += write_compressed_item_data(
+            output_file, column.block_codec(), column.block_codec_level(),
+            data);
+        args_.profiler.increment("io_uncompressed", data.size());
+      } else {
+        // The file takes over the row buffers, which are written from where
+        // the kernels left them once the item is uploaded
+        for (size_t i = 0; i < num_elements; ++i) {
+          Element& element = work_entry.columns[out_idx][i];
+          if (element.is_frame) {
+            s_write(output_file, element.buffer, element.size);
+            delete_element(CPU_DEVICE, element);
+          } else {
+            output_file->append_buffer(element.size, element.buffer);
+          }
+          size_written += element.size;
+        }
+        work_entry.columns[out_idx].clear();
+      }
+    }
 
-      delete output_file;
-
-      args.profiler.add_interval("io", io_start, now());
-      args.profiler.increment("io_write", size_written);
+    // TODO(apoms): For now, all evaluators are expected to return CPU
+    //   buffers as output so just assume CPU
+    for (Element& element : work_entry.columns[out_idx]) {
+      delete_element(CPU_DEVICE, element);
     }
 
-    VLOG(2) << "Save (N/KI: " << args.node_id << "/" << args.id
-            << "): finished item " << work_entry.io_item_index;
+    args_.profiler.add_interval("io", io_start, now());
+    args_.profiler.increment("io_serialized", size_written);
+  }
 
-    args.profiler.add_interval("task", work_start, now());
+  for (size_t t = 0; t < tables.size(); ++t) {
+    // Packed tables store every column of the item in a single file
+    if (tables[t]->packed_items()) {
+      std::unique_ptr<BufferedWriteFile> packed_file(
+          new BufferedWriteFile(item_file_path(
+              tables[t]->id(),
+              table_item_packed_path(tables[t]->id(), io_item.item_id()))));
+      std::vector<u64> column_sizes;
+      for (auto& file : column_files[t]) {
+        column_sizes.push_back(file->size());
+      }
+      write_packed_item_index(packed_file.get(), column_sizes);
+      for (auto& file : column_files[t]) {
+        packed_file->append_file(*file);
+      }
+      files.push_back(std::move(packed_file));
+    } else {
+      for (auto& file : column_files[t]) {
+        files.push_back(std::move(file));
+      }
+    }
+  }
+
+  // Filters dropped rows of the item, so its rows are the input table rows
+  // that were kept
+  if (table->filtered_rows()) {
+    files.emplace_back(new BufferedWriteFile(
+        table_item_rows_path(io_item.table_id(), io_item.item_id())));
+    const std::vector<i64>& rows = work_entry.row_ids;
+    s_write(files.back().get(), (const u8*)rows.data(),
+            rows.size() * sizeof(i64));
+    io_item.set_output_rows(rows.size());
+  }
 
-    args.retired_items++;
+  // Resumed jobs only keep the item once all of its files are saved
+  std::vector<std::unique_ptr<BufferedWriteFile>> commit_files;
+  for (auto& t : tables) {
+    commit_files.emplace_back(new BufferedWriteFile(item_file_path(
+        t->id(), table_item_commit_path(t->id(), io_item.item_id()))));
   }
 
-  VLOG(1) << "Save (N/KI: " << args.node_id << "/" << args.id
-          << "): thread finished ";
+  // The item may only be committed once all of its files are saved
+  if (streamed) {
+    streamed->mutable_io_item()->CopyFrom(io_item);
+  }
+  auto finish = [&finished_items, &streamed_items, &retired_items, io_item,
+                 streamed]() {
+    if (streamed) {
+      streamed_items.push(std::move(*streamed));
+    }
+    finished_items.push(io_item);
+    retired_items++;
+  };
+  if (args_.upload_queue != nullptr) {
+    args_.upload_queue->submit(std::move(files), std::move(commit_files),
+                               args_.profiler, finish);
+  } else {
+    for (auto& file : files) {
+      save_buffered_file(storage_.get(), file.get(), args_.profiler);
+    }
+    for (auto& file : commit_files) {
+      save_buffered_file(storage_.get(), file.get(), args_.profiler);
+    }
+    finish();
+  }
 
-  // Cleanup
-  delete storage;
+  VLOG(2) << "Save (N/KI: " << args_.node_id << "/" << args_.id
+          << "): finished item " << work_entry.io_item_index;
 
-  THREAD_RETURN_SUCCESS();
+  args_.profiler.add_interval("task", work_start, now(),
+                              work_entry.io_item_index);
 }
 }
 }
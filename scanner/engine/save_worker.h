@@ -18,25 +18,153 @@
 #include "scanner/engine/runtime.h"
 #include "scanner/util/common.h"
 #include "scanner/util/queue.h"
+#include "scanner/util/thread_pool.h"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
 
 namespace scanner {
 namespace internal {
 
-struct SaveThreadArgs {
+//! WriteFile which keeps everything appended to it in memory so that it can
+//! be uploaded later.
+//
+// The file is a list of segments. Bytes passed to append are copied into
+// chunks the file owns, while append_buffer keeps the buffer of a row
+// instead of copying it, so the rows of an item are written straight from
+// the buffers kernels produced them in.
+class BufferedWriteFile : public storehouse::WriteFile {
+ public:
+  BufferedWriteFile(const std::string& path);
+
+  //! Frees the buffers handed over with append_buffer.
+  ~BufferedWriteFile();
+
+  storehouse::StoreResult append(size_t size, const u8* data) override;
+
+  //! Appends a CPU buffer from new_buffer or new_block_buffer, taking over
+  //! the reference to it. Small buffers that do not follow the previous one
+  //! in memory are copied and freed, since writing them on their own would
+  //! cost more than the copy.
+  void append_buffer(size_t size, u8* buffer);
+
+  //! Moves the contents of other to the end of this file, leaving it empty.
+  void append_file(BufferedWriteFile& other);
+
+  //! Does nothing, the buffer is saved by an UploadQueue.
+  storehouse::StoreResult save() override;
+
+  const std::string path() override;
+
+  size_t size() const;
+
+  //! Appends the contents of this file to file, with one append per run of
+  //! contiguous bytes.
+  void write_to(storehouse::WriteFile* file) const;
+
+ private:
+  struct Segment {
+    // Index of the chunk holding the bytes, or -1 if they are in a buffer
+    i32 chunk;
+    const u8* data;
+    size_t size;
+  };
+
+  const size_t MIN_BORROWED_SIZE = 16 * 1024;
+
+  std::string path_;
+  size_t size_ = 0;
+  std::vector<Segment> segments_;
+  std::vector<std::vector<u8>> chunks_;
+  std::vector<u8*> buffers_;
+};
+
+//! Write behind queue that uploads the files of finished items on its own
+//! threads, so that save threads do not wait on storage.
+//
+// The files of an item are uploaded concurrently and a callback runs once
+// all of them are saved. Submitting blocks while the buffered bytes of
+// items in flight would exceed the limit, unless nothing is in flight.
+class UploadQueue {
+ public:
+  UploadQueue(storehouse::StorageConfig* storage_config, i32 num_threads,
+              i64 max_bytes);
+
+  //! Waits for every submitted upload to finish.
+  ~UploadQueue();
+
+  //! Uploads files in the background, then the commit files, and calls done
+  //! after the last one is saved. Upload time and bytes are recorded in
+  //! profiler.
+  void submit(std::vector<std::unique_ptr<BufferedWriteFile>> files,
+              std::vector<std::unique_ptr<BufferedWriteFile>> commit_files,
+              Profiler& profiler, std::function<void()> done);
+
+  void wait_idle();
+
+ private:
+  void upload(i32 thread_id, BufferedWriteFile* file, Profiler& profiler);
+
+  storehouse::StorageConfig* storage_config_;
+  i64 max_bytes_;
+  // Created lazily by the upload thread using it
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> storage_;
+
+  std::mutex mutex_;
+  std::condition_variable space_available_;
+  i64 bytes_in_flight_ = 0;
+
+  // Last so that its threads stop before the state above is destroyed
+  WorkStealingPool pool_;
+};
+
+struct SaveWorkerArgs {
   // Uniform arguments
   i32 node_id;
   std::string job_name;
+  // Output table of each output column, as an index into the output table of
+  // the item followed by its shared output tables. Empty if every column is
+  // in the output table.
+  std::vector<i32> output_column_tables;
+  // Output table -> the output tables of the jobs merged into it
+  std::map<i32, std::vector<i32>> shared_output_tables;
+  // Output column index -> name of the columns streamed to the client
+  std::map<i32, std::string> stream_columns;
+  // Items are only streamed instead of written out
+  bool stream_only;
 
   // Per worker arguments
   int id;
   storehouse::StorageConfig* storage_config;
   Profiler& profiler;
 
-  // Queues for communicating work
-  EvalQueue& input_work;
+  // Shared state for reporting work
   std::atomic<i64>& retired_items;
+  // Items written out, to be reported to the master
+  Queue<IOItem>& finished_items;
+  // Streamed columns of items, each pushed before its item is finished
+  Queue<proto::StreamedItem>& streamed_items;
+  CancelledItems& cancelled_items;
+  // Uploads items in the background if set, otherwise they are written out
+  // before feed returns
+  UploadQueue* upload_queue;
 };
 
-void* save_thread(void* arg);
+class SaveWorker {
+ public:
+  SaveWorker(const SaveWorkerArgs& args);
+
+  //! Writes out every column of the item to storage. The item is only
+  //! reported as finished once all of its files are saved. The rows of
+  //! streamed columns are copied out first.
+  void feed(std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry>& entry);
+
+ private:
+  const SaveWorkerArgs args_;
+  // Setup a distinct storage backend for each IO thread
+  std::unique_ptr<storehouse::StorageBackend> storage_;
+};
 }
 }
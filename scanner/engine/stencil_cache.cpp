@@ -0,0 +1,102 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/stencil_cache.h"
+
+#include <cassert>
+
+namespace scanner {
+namespace internal {
+
+void StencilCache::init(i32 num_columns, i64 min_rows) {
+  i64 capacity = 1;
+  while (capacity < min_rows) {
+    capacity *= 2;
+  }
+  mask_ = capacity - 1;
+  head_ = 0;
+  size_ = 0;
+  slot_rows_.assign(capacity, -1);
+  slot_elements_.assign(num_columns, std::vector<Element>(capacity));
+  row_slots_.clear();
+  row_slots_.reserve(capacity);
+}
+
+bool StencilCache::insert(i64 row, const BatchedColumns& columns,
+                          size_t index) {
+  assert(columns.size() == slot_elements_.size());
+  if (contains(row)) {
+    return false;
+  }
+  if (size_ == mask_ + 1) {
+    grow();
+  }
+  i64 slot = (head_ + size_) & mask_;
+  slot_rows_[slot] = row;
+  for (size_t c = 0; c < columns.size(); ++c) {
+    slot_elements_[c][slot] = columns[c][index];
+  }
+  row_slots_[row] = slot;
+  size_++;
+  return true;
+}
+
+void StencilCache::erase_before(
+    i64 row, const std::function<void(i32, Element&)>& release) {
+  while (size_ > 0 && slot_rows_[head_] < row) {
+    for (size_t c = 0; c < slot_elements_.size(); ++c) {
+      release(c, slot_elements_[c][head_]);
+    }
+    row_slots_.erase(slot_rows_[head_]);
+    slot_rows_[head_] = -1;
+    head_ = (head_ + 1) & mask_;
+    size_--;
+  }
+}
+
+void StencilCache::clear(const std::function<void(i32, Element&)>& release) {
+  while (size_ > 0) {
+    for (size_t c = 0; c < slot_elements_.size(); ++c) {
+      release(c, slot_elements_[c][head_]);
+    }
+    slot_rows_[head_] = -1;
+    head_ = (head_ + 1) & mask_;
+    size_--;
+  }
+  head_ = 0;
+  row_slots_.clear();
+}
+
+void StencilCache::grow() {
+  // Unrolls the ring into the front of a buffer twice the size
+  i64 capacity = 2 * (mask_ + 1);
+  std::vector<i64> slot_rows(capacity, -1);
+  std::vector<std::vector<Element>> slot_elements(
+      slot_elements_.size(), std::vector<Element>(capacity));
+  for (i64 i = 0; i < size_; ++i) {
+    i64 slot = (head_ + i) & mask_;
+    slot_rows[i] = slot_rows_[slot];
+    for (size_t c = 0; c < slot_elements_.size(); ++c) {
+      slot_elements[c][i] = slot_elements_[c][slot];
+    }
+    row_slots_[slot_rows_[slot]] = i;
+  }
+  mask_ = capacity - 1;
+  head_ = 0;
+  slot_rows_.swap(slot_rows);
+  slot_elements_.swap(slot_elements);
+}
+}
+}
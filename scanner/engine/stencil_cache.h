@@ -0,0 +1,79 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/util/common.h"
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+///////////////////////////////////////////////////////////////////////////////
+/// StencilCache
+//! The elements of each live column at the rows a kernel still has to read.
+//! Rows are kept in a ring buffer in the order they arrive, which is
+//! increasing row order, with an index from row id to slot so that finding a
+//! row and evicting the oldest rows take constant time.
+class StencilCache {
+ public:
+  //! Empties the cache and sets it up for num_columns columns. The buffer
+  //! starts with room for min_rows rows and grows when it is full.
+  void init(i32 num_columns, i64 min_rows);
+
+  bool empty() const { return size_ == 0; }
+
+  i64 size() const { return size_; }
+
+  bool contains(i64 row) const {
+    return row_slots_.find(row) != row_slots_.end();
+  }
+
+  //! The element of column at a row the cache contains.
+  Element& element(i32 column, i64 row) {
+    return slot_elements_[column][row_slots_.at(row)];
+  }
+
+  //! Adds the elements at index of each column as row. Returns false, and
+  //! does not add them, if row is cached already.
+  bool insert(i64 row, const BatchedColumns& columns, size_t index);
+
+  //! Removes the oldest rows up to the first one that is not before row,
+  //! handing each element with the index of its column to release.
+  void erase_before(i64 row,
+                    const std::function<void(i32, Element&)>& release);
+
+  //! Removes all rows, handing each element to release.
+  void clear(const std::function<void(i32, Element&)>& release);
+
+ private:
+  void grow();
+
+  i64 mask_ = 0;
+  // Slot of the oldest row
+  i64 head_ = 0;
+  i64 size_ = 0;
+  // Row in each slot
+  std::vector<i64> slot_rows_;
+  // Per column -> element in each slot
+  std::vector<std::vector<Element>> slot_elements_;
+  std::unordered_map<i64, i64> row_slots_;
+};
+}
+}
@@ -0,0 +1,262 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/table_export.h"
+#include "scanner/engine/column_reader.h"
+#include "scanner/util/storehouse.h"
+#include "scanner/util/thread_pool.h"
+#include "storehouse/storage_backend.h"
+
+#ifdef HAVE_ARROW
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include <parquet/arrow/writer.h>
+#endif
+
+#include <algorithm>
+#include <memory>
+
+namespace scanner {
+namespace internal {
+
+bool parse_export_format(const std::string& name, ExportFormat& format) {
+  if (name == "arrow") {
+    format = ExportFormat::Arrow;
+  } else if (name == "parquet") {
+    format = ExportFormat::Parquet;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+#ifdef HAVE_ARROW
+namespace {
+
+std::shared_ptr<arrow::DataType> tensor_value_type(
+    const proto::Column& column) {
+  switch (column.tensor_type()) {
+    case proto::Column::UINT8:
+      return arrow::uint8();
+    case proto::Column::INT32:
+      return arrow::int32();
+    case proto::Column::INT64:
+      return arrow::int64();
+    case proto::Column::FLOAT32:
+      return arrow::float32();
+    case proto::Column::FLOAT64:
+      return arrow::float64();
+    default:
+      LOG(FATAL) << "Column " << column.name() << " has an unknown tensor type";
+  }
+  return nullptr;
+}
+
+i32 tensor_values(const proto::Column& column) {
+  i64 values = 1;
+  for (i64 dim : column.tensor_shape()) {
+    values *= dim;
+  }
+  return values;
+}
+
+std::shared_ptr<arrow::Schema> export_schema(
+    const TableMetadata& table, const std::vector<proto::Column>& columns) {
+  std::vector<std::shared_ptr<arrow::Field>> fields = {
+      arrow::field("row", arrow::int64(), false)};
+  if (table.filtered_rows()) {
+    fields.push_back(arrow::field("source_row", arrow::int64(), false));
+  }
+  for (const proto::Column& column : columns) {
+    fields.push_back(arrow::field(
+        column.name(),
+        column.type() == ColumnType::Tensor
+            ? arrow::fixed_size_list(tensor_value_type(column),
+                                     tensor_values(column))
+            : arrow::binary(),
+        false));
+  }
+  return arrow::schema(fields);
+}
+
+// Reads one item of each column into a record batch of schema
+arrow::Status item_batch(storehouse::StorageConfig* config,
+                         storehouse::StorageBackend* storage,
+                         const TableMetadata& table,
+                         const std::vector<proto::Column>& columns,
+                         const std::shared_ptr<arrow::Schema>& schema,
+                         i32 item, std::shared_ptr<arrow::RecordBatch>& batch) {
+  std::vector<i64> end_rows = table.end_rows();
+  i64 first_row = item == 0 ? 0 : end_rows[item - 1];
+  i64 num_rows = end_rows[item] - first_row;
+  std::vector<std::shared_ptr<arrow::Array>> arrays;
+
+  std::vector<i64> rows(num_rows);
+  for (i64 i = 0; i < num_rows; ++i) {
+    rows[i] = first_row + i;
+  }
+  if (table.filtered_rows()) {
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    STORE_CHECK(storehouse::make_unique_random_read_file(
+        storage, table_item_rows_path(table.id(), item), file));
+    std::vector<i64> source_rows(num_rows);
+    u64 pos = 0;
+    s_read(file.get(), (u8*)source_rows.data(), num_rows * sizeof(i64), pos);
+    rows.insert(rows.end(), source_rows.begin(), source_rows.end());
+  }
+  for (size_t start = 0; start < rows.size(); start += num_rows) {
+    arrow::Int64Builder builder;
+    ARROW_RETURN_NOT_OK(builder.AppendValues(rows.data() + start, num_rows));
+    arrays.emplace_back();
+    ARROW_RETURN_NOT_OK(builder.Finish(&arrays.back()));
+  }
+
+  for (const proto::Column& column : columns) {
+    if (column.type() == ColumnType::Tensor) {
+      // The values of the rows are already contiguous, so the array takes
+      // the buffer they were read into
+      i64 element_size;
+      std::string data = read_column_data(config, table, column.id(), item,
+                                          item + 1, {}, 1, element_size);
+      if (num_rows > 0 && element_size != tensor_element_size(column)) {
+        return arrow::Status::Invalid("Rows of column ", column.name(),
+                                      " do not match its tensor shape");
+      }
+      auto values = arrow::MakeArray(arrow::ArrayData::Make(
+          tensor_value_type(column), num_rows * tensor_values(column),
+          {nullptr, arrow::Buffer::FromString(std::move(data))}));
+      arrays.emplace_back();
+      ARROW_ASSIGN_OR_RAISE(arrays.back(),
+                            arrow::FixedSizeListArray::FromArrays(
+                                values, tensor_values(column)));
+    } else {
+      std::vector<std::string> elements = read_column_rows(
+          config, table, column.id(), item, item + 1, {}, 1);
+      arrow::BinaryBuilder builder;
+      ARROW_RETURN_NOT_OK(builder.Reserve(elements.size()));
+      for (const std::string& element : elements) {
+        ARROW_RETURN_NOT_OK(builder.Append(element));
+      }
+      arrays.emplace_back();
+      ARROW_RETURN_NOT_OK(builder.Finish(&arrays.back()));
+    }
+  }
+  batch = arrow::RecordBatch::Make(schema, num_rows, arrays);
+  return arrow::Status::OK();
+}
+
+arrow::Status write_table(storehouse::StorageConfig* config,
+                          const TableMetadata& table,
+                          const std::vector<proto::Column>& columns,
+                          const std::string& path, ExportFormat format,
+                          i32 num_threads) {
+  std::shared_ptr<arrow::Schema> schema = export_schema(table, columns);
+  ARROW_ASSIGN_OR_RAISE(auto sink, arrow::io::FileOutputStream::Open(path));
+  std::shared_ptr<arrow::ipc::RecordBatchWriter> arrow_writer;
+  std::unique_ptr<parquet::arrow::FileWriter> parquet_writer;
+  if (format == ExportFormat::Arrow) {
+    ARROW_ASSIGN_OR_RAISE(arrow_writer,
+                          arrow::ipc::MakeFileWriter(sink, schema));
+  } else {
+    ARROW_RETURN_NOT_OK(parquet::arrow::FileWriter::Open(
+        *schema, arrow::default_memory_pool(), sink,
+        parquet::default_writer_properties(), &parquet_writer));
+  }
+
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> storages(
+      num_threads);
+  for (auto& storage : storages) {
+    storage.reset(storehouse::StorageBackend::make_from_config(config));
+  }
+  WorkStealingPool pool(num_threads);
+  i32 num_items = table.end_rows().size();
+  std::vector<std::shared_ptr<arrow::RecordBatch>> batches(num_threads);
+  std::vector<arrow::Status> statuses(num_threads);
+  for (i32 start = 0; start < num_items; start += num_threads) {
+    i32 end = std::min(num_items, start + num_threads);
+    for (i32 item = start; item < end; ++item) {
+      pool.submit([&, item, start](i32 thread_id) {
+        statuses[item - start] =
+            item_batch(config, storages[thread_id].get(), table, columns,
+                       schema, item, batches[item - start]);
+      });
+    }
+    pool.wait_idle();
+
+    for (i32 i = 0; i < end - start; ++i) {
+      ARROW_RETURN_NOT_OK(statuses[i]);
+      std::shared_ptr<arrow::RecordBatch> batch = std::move(batches[i]);
+      if (arrow_writer) {
+        ARROW_RETURN_NOT_OK(arrow_writer->WriteRecordBatch(*batch));
+      } else if (batch->num_rows() > 0) {
+        ARROW_ASSIGN_OR_RAISE(auto item_table,
+                              arrow::Table::FromRecordBatches({batch}));
+        ARROW_RETURN_NOT_OK(
+            parquet_writer->WriteTable(*item_table, batch->num_rows()));
+      }
+    }
+  }
+
+  if (arrow_writer) {
+    ARROW_RETURN_NOT_OK(arrow_writer->Close());
+  } else {
+    ARROW_RETURN_NOT_OK(parquet_writer->Close());
+  }
+  return sink->Close();
+}
+}
+#endif
+
+proto::Result export_table(storehouse::StorageConfig* config,
+                           const TableMetadata& table,
+                           const std::vector<i32>& column_ids,
+                           const std::string& path, ExportFormat format,
+                           i32 num_threads) {
+  proto::Result result;
+  result.set_success(false);
+#ifdef HAVE_ARROW
+  std::vector<proto::Column> columns;
+  for (i32 column_id : column_ids) {
+    auto it = std::find_if(
+        table.columns().begin(), table.columns().end(),
+        [&](const proto::Column& column) { return column.id() == column_id; });
+    if (it == table.columns().end()) {
+      result.set_msg("Table " + table.name() + " has no column " +
+                     std::to_string(column_id));
+      return result;
+    }
+    if (it->type() == ColumnType::Video) {
+      result.set_msg("Video column " + it->name() + " can not be exported");
+      return result;
+    }
+    columns.push_back(*it);
+  }
+
+  arrow::Status status = write_table(config, table, columns, path, format,
+                                     std::max(1, num_threads));
+  if (!status.ok()) {
+    result.set_msg("Failed to export table " + table.name() + ": " +
+                   status.ToString());
+    return result;
+  }
+  result.set_success(true);
+#else
+  result.set_msg("Scanner was built without Arrow, which exports need");
+#endif
+  return result;
+}
+}
+}
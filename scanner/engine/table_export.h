@@ -0,0 +1,54 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+#include "storehouse/storage_config.h"
+
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+enum class ExportFormat {
+  //! Arrow IPC file, with one record batch per item
+  Arrow,
+  //! Parquet file, with one row group per item
+  Parquet,
+};
+
+//! Parses "arrow" or "parquet", returning false for other names
+bool parse_export_format(const std::string& name, ExportFormat& format);
+
+//! Writes columns of a table to a local file that Arrow readers such as
+//! pandas and Spark load directly, without converting each row. The table
+//! row of each row is the int64 column "row", followed by "source_row" with
+//! the input table row of tables of filtered jobs. Other columns become
+//! binary columns, and tensor columns fixed size lists of their values in
+//! row-major order.
+//
+// Items are read and converted in parallel on num_threads threads, then
+// written in order, so at most num_threads items are held at a time. Video
+// columns can not be exported. Fails if Scanner was built without Arrow.
+proto::Result export_table(storehouse::StorageConfig* config,
+                           const TableMetadata& table,
+                           const std::vector<i32>& column_ids,
+                           const std::string& path, ExportFormat format,
+                           i32 num_threads);
+}
+}
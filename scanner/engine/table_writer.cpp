@@ -0,0 +1,178 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/table_writer.h"
+#include "scanner/util/storehouse.h"
+#include "scanner/util/util.h"
+
+#include <chrono>
+
+namespace scanner {
+namespace internal {
+
+TableWriter::TableWriter(storehouse::StorageConfig* config,
+                         const std::string& name,
+                         const std::vector<proto::Column>& columns,
+                         i32 num_threads)
+  : storage_(storehouse::StorageBackend::make_from_config(config)),
+    storages_(num_threads),
+    pool_(num_threads) {
+  for (auto& storage : storages_) {
+    storage.reset(storehouse::StorageBackend::make_from_config(config));
+  }
+
+  // Reserving the id up front lets the items go to their final paths
+  DatabaseMetadata meta = read_database_metadata(
+      storage_.get(), DatabaseMetadata::descriptor_path());
+  descriptor_.set_id(meta.reserve_table_id());
+  write_database_metadata(storage_.get(), meta);
+
+  descriptor_.set_name(name);
+  descriptor_.set_job_id(-1);
+  proto::Column* index = descriptor_.add_columns();
+  index->set_id(0);
+  index->set_name("index");
+  index->set_type(proto::ColumnType::Other);
+  for (const proto::Column& column : columns) {
+    proto::Column* col = descriptor_.add_columns();
+    col->CopyFrom(column);
+    col->set_id(descriptor_.columns_size() - 1);
+  }
+}
+
+TableWriter::~TableWriter() {
+  pool_.wait_idle();
+}
+
+proto::Result TableWriter::write_item(
+    i64 num_rows, std::vector<std::string> data,
+    std::vector<std::vector<i64>> element_sizes) {
+  proto::Result result;
+  result.set_success(true);
+  i32 num_columns = descriptor_.columns_size() - 1;
+  if (committed_) {
+    RESULT_ERROR(&result, "Table %s was already committed",
+                 descriptor_.name().c_str());
+    return result;
+  }
+  if ((i32)data.size() != num_columns ||
+      (i32)element_sizes.size() != num_columns) {
+    RESULT_ERROR(&result, "Item of table %s has %lu columns, expected %d",
+                 descriptor_.name().c_str(), data.size(), num_columns);
+    return result;
+  }
+  for (i32 c = 0; c < num_columns; ++c) {
+    const proto::Column& column = descriptor_.columns(c + 1);
+    i64 size = 0;
+    if (column.type() == proto::ColumnType::Tensor) {
+      size = num_rows * tensor_element_size(column);
+    } else if ((i64)element_sizes[c].size() == num_rows) {
+      for (i64 element_size : element_sizes[c]) {
+        size += element_size;
+      }
+    } else {
+      size = -1;
+    }
+    if (size != (i64)data[c].size()) {
+      RESULT_ERROR(&result, "Rows of column %s do not match their sizes",
+                   column.name().c_str());
+      return result;
+    }
+  }
+
+  i32 item = descriptor_.end_rows_size();
+  i64 first_row = num_rows_;
+  num_rows_ += num_rows;
+  descriptor_.add_end_rows(num_rows_);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  item_done_.wait(lock,
+                  [&] { return queued_items_ < 2 * pool_.num_threads(); });
+  queued_items_++;
+  lock.unlock();
+
+  auto item_data = std::make_shared<std::vector<std::string>>(std::move(data));
+  auto item_sizes = std::make_shared<std::vector<std::vector<i64>>>(
+      std::move(element_sizes));
+  pool_.submit([this, item, first_row, num_rows, item_data,
+                item_sizes](i32 thread_id) {
+    storehouse::StorageBackend* storage = storages_[thread_id].get();
+    std::string index(num_rows * sizeof(u64), '\0');
+    for (i64 r = 0; r < num_rows; ++r) {
+      ((u64*)&index[0])[r] = first_row + r;
+    }
+    write_column(storage, item, 0, index,
+                 std::vector<i64>(num_rows, sizeof(u64)));
+    for (size_t c = 0; c < item_data->size(); ++c) {
+      write_column(storage, item, c + 1, (*item_data)[c], (*item_sizes)[c]);
+      std::string().swap((*item_data)[c]);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    queued_items_--;
+    item_done_.notify_all();
+  });
+  return result;
+}
+
+proto::Result TableWriter::commit() {
+  pool_.wait_idle();
+  proto::Result result;
+  result.set_success(true);
+  if (committed_) {
+    RESULT_ERROR(&result, "Table %s was already committed",
+                 descriptor_.name().c_str());
+    return result;
+  }
+
+  DatabaseMetadata meta = read_database_metadata(
+      storage_.get(), DatabaseMetadata::descriptor_path());
+  if (!meta.add_reserved_table(descriptor_.name(), descriptor_.id())) {
+    RESULT_ERROR(&result, "Table %s was added while it was being written",
+                 descriptor_.name().c_str());
+    return result;
+  }
+  descriptor_.set_timestamp(
+      std::chrono::duration_cast<std::chrono::seconds>(now().time_since_epoch())
+          .count());
+  write_table_metadata(storage_.get(), TableMetadata(descriptor_));
+  proto::DatabaseManifest segment;
+  segment.add_tables()->CopyFrom(descriptor_);
+  append_manifest(storage_.get(), meta, segment);
+  write_database_metadata(storage_.get(), meta);
+  committed_ = true;
+  return result;
+}
+
+void TableWriter::write_column(storehouse::StorageBackend* storage, i32 item,
+                               i32 column_id, const std::string& data,
+                               const std::vector<i64>& element_sizes) {
+  const proto::Column& column = descriptor_.columns(column_id);
+  std::unique_ptr<storehouse::WriteFile> file;
+  STORE_CHECK(storehouse::make_unique_write_file(
+      storage, table_item_output_path(descriptor_.id(), column_id, item),
+      file));
+  if (column.type() == proto::ColumnType::Tensor) {
+    i64 element_size = tensor_element_size(column);
+    write_tensor_item_file_header(file.get(), data.size() / element_size,
+                                  element_size);
+  } else {
+    write_item_file_header(file.get(), element_sizes);
+  }
+  s_write(file.get(), (const u8*)data.data(), data.size());
+  STORE_CHECK(file->save());
+}
+}
+}
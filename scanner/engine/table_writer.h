@@ -0,0 +1,81 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+#include "scanner/util/thread_pool.h"
+#include "storehouse/storage_backend.h"
+#include "storehouse/storage_config.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+//! Writes a new table from rows computed outside of Scanner, one item at a
+//! time, so the rows never all have to be in memory. The table gets the
+//! index column of Database::new_table before the given columns, and is only
+//! added to the database by commit.
+//
+// The table id is reserved when the writer is created. Items are written on
+// num_threads threads, with at most num_threads items queued behind them.
+// The items of a writer that is never committed stay in storage under the
+// reserved id, which no table uses.
+class TableWriter {
+ public:
+  //! Columns are Other or Tensor columns, and their ids are ignored.
+  TableWriter(storehouse::StorageConfig* config, const std::string& name,
+              const std::vector<proto::Column>& columns, i32 num_threads);
+
+  //! Waits for the queued items.
+  ~TableWriter();
+
+  //! Queues the next item of the table, taking its data. data[c] holds the
+  //! rows of column c back to back, and element_sizes[c] their sizes, which
+  //! are left empty for Tensor columns. Blocks while the queue is full.
+  proto::Result write_item(i64 num_rows, std::vector<std::string> data,
+                           std::vector<std::vector<i64>> element_sizes);
+
+  //! Waits for the queued items and adds the table to the database. Fails if
+  //! a table with the name was added since the writer was created.
+  proto::Result commit();
+
+ private:
+  void write_column(storehouse::StorageBackend* storage, i32 item,
+                    i32 column_id, const std::string& data,
+                    const std::vector<i64>& element_sizes);
+
+  std::unique_ptr<storehouse::StorageBackend> storage_;
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> storages_;
+  // Threads writing items only read the id and columns, while the end rows
+  // of later items are added
+  proto::TableDescriptor descriptor_;
+  i64 num_rows_ = 0;
+  bool committed_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable item_done_;
+  i32 queued_items_ = 0;
+  // Last member, so that its threads stop before the state they use goes
+  WorkStealingPool pool_;
+};
+}
+}
@@ -0,0 +1,552 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/engine/vector_index.h"
+#include "scanner/engine/column_reader.h"
+#include "scanner/util/storehouse.h"
+#include "scanner/util/thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <queue>
+
+namespace scanner {
+namespace internal {
+namespace {
+
+// Centroids of each subquantizer, so that a code fits in a byte
+const i32 PQ_CENTROIDS = 256;
+// Rows sampled per coarse centroid to train the index, and the most sampled
+const i64 TRAIN_ROWS_PER_LIST = 64;
+const i64 MAX_TRAIN_ROWS = 1 << 20;
+const i32 KMEANS_ITERATIONS = 16;
+// Bytes of entries encoded before they are written out as a shard
+const i64 SHARD_BYTES = 256 * 1024 * 1024;
+
+f32 l2_distance(const f32* a, const f32* b, i32 d) {
+  f32 sum = 0;
+  for (i32 i = 0; i < d; ++i) {
+    f32 diff = a[i] - b[i];
+    sum += diff * diff;
+  }
+  return sum;
+}
+
+i32 nearest_centroid(const f32* point, const f32* centroids, i32 k, i32 d) {
+  i32 nearest = 0;
+  f32 nearest_distance = std::numeric_limits<f32>::max();
+  for (i32 c = 0; c < k; ++c) {
+    f32 distance = l2_distance(point, centroids + (i64)c * d, d);
+    if (distance < nearest_distance) {
+      nearest = c;
+      nearest_distance = distance;
+    }
+  }
+  return nearest;
+}
+
+// Runs fn over ranges covering [0, n) on the threads of pool
+void parallel_for(WorkStealingPool& pool, i64 n,
+                  const std::function<void(i64, i64)>& fn) {
+  i64 chunk = std::max((i64)1, n / (pool.num_threads() * 4));
+  for (i64 start = 0; start < n; start += chunk) {
+    i64 end = std::min(n, start + chunk);
+    pool.submit([&fn, start, end](i32 thread_id) { fn(start, end); });
+  }
+  pool.wait_idle();
+}
+
+// Lloyd's k-means over n points of d values, started from evenly spaced
+// points. Centroids left without points move to another point.
+std::vector<f32> kmeans(WorkStealingPool& pool, const f32* points, i64 n,
+                        i32 d, i32 k) {
+  std::vector<f32> centroids((i64)k * d);
+  for (i32 c = 0; c < k; ++c) {
+    const f32* point = points + (c * n / k) * d;
+    std::copy(point, point + d, centroids.begin() + (i64)c * d);
+  }
+  std::vector<i32> assignments(n);
+  for (i32 iter = 0; iter < KMEANS_ITERATIONS; ++iter) {
+    parallel_for(pool, n, [&](i64 start, i64 end) {
+      for (i64 i = start; i < end; ++i) {
+        assignments[i] =
+            nearest_centroid(points + i * d, centroids.data(), k, d);
+      }
+    });
+    std::vector<f64> sums((i64)k * d, 0);
+    std::vector<i64> counts(k, 0);
+    for (i64 i = 0; i < n; ++i) {
+      f64* sum = sums.data() + (i64)assignments[i] * d;
+      for (i32 j = 0; j < d; ++j) {
+        sum[j] += points[i * d + j];
+      }
+      counts[assignments[i]]++;
+    }
+    for (i32 c = 0; c < k; ++c) {
+      f32* centroid = centroids.data() + (i64)c * d;
+      if (counts[c] == 0) {
+        const f32* point = points + (((i64)iter * k + c) * 7919 % n) * d;
+        std::copy(point, point + d, centroid);
+        continue;
+      }
+      for (i32 j = 0; j < d; ++j) {
+        centroid[j] = sums[(i64)c * d + j] / counts[c];
+      }
+    }
+  }
+  return centroids;
+}
+
+// Centroids of an index, which map rows to entries
+struct Quantizer {
+  Quantizer(const proto::VectorIndexDescriptor& descriptor)
+    : d(descriptor.dimension()),
+      num_lists(descriptor.num_lists()),
+      m(descriptor.num_subquantizers()),
+      sub_d(d / m),
+      centroids((const f32*)descriptor.centroids().data()),
+      codebooks((const f32*)descriptor.codebooks().data()) {}
+
+  // Row number followed by the codes
+  i64 entry_size() const { return sizeof(i64) + m; }
+
+  const f32* centroid(i32 list) const { return centroids + (i64)list * d; }
+
+  const f32* codebook(i32 j) const {
+    return codebooks + (i64)j * PQ_CENTROIDS * sub_d;
+  }
+
+  i32 encode(const f32* x, u8* codes) const {
+    i32 list = nearest_centroid(x, centroids, num_lists, d);
+    std::vector<f32> residual(d);
+    for (i32 i = 0; i < d; ++i) {
+      residual[i] = x[i] - centroid(list)[i];
+    }
+    for (i32 j = 0; j < m; ++j) {
+      codes[j] = nearest_centroid(residual.data() + j * sub_d, codebook(j),
+                                  PQ_CENTROIDS, sub_d);
+    }
+    return list;
+  }
+
+  i32 d;
+  i32 num_lists;
+  i32 m;
+  i32 sub_d;
+  const f32* centroids;
+  const f32* codebooks;
+};
+
+void write_shard(storehouse::StorageBackend* storage, const std::string& path,
+                 const std::string& data) {
+  std::unique_ptr<storehouse::WriteFile> file;
+  STORE_CHECK(storehouse::make_unique_write_file(storage, path, file));
+  s_write(file.get(), (const u8*)data.data(), data.size());
+  STORE_CHECK(file->save());
+}
+
+// Reads the embeddings of an item into values, with the row of each in rows
+void read_item_embeddings(storehouse::StorageConfig* config,
+                          const TableMetadata& table,
+                          const proto::Column& column, i32 item, i32 d,
+                          std::vector<f32>& values, std::vector<i64>& rows) {
+  std::vector<i64> end_rows = table.end_rows();
+  i64 first_row = item == 0 ? 0 : end_rows[item - 1];
+  i64 vector_size = d * sizeof(f32);
+  if (column.type() == ColumnType::Tensor) {
+    i64 element_size;
+    std::string data = read_column_data(config, table, column.id(), item,
+                                        item + 1, {}, 1, element_size);
+    const f32* begin = (const f32*)data.data();
+    values.assign(begin, begin + data.size() / sizeof(f32));
+    rows.resize(data.size() / vector_size);
+    for (size_t r = 0; r < rows.size(); ++r) {
+      rows[r] = first_row + r;
+    }
+    return;
+  }
+  std::vector<std::string> elements = read_column_rows(
+      config, table, column.id(), item, item + 1, {}, 1);
+  values.clear();
+  rows.clear();
+  for (size_t r = 0; r < elements.size(); ++r) {
+    const f32* begin = (const f32*)elements[r].data();
+    i64 num_vectors = elements[r].size() / vector_size;
+    values.insert(values.end(), begin, begin + num_vectors * d);
+    rows.insert(rows.end(), num_vectors, first_row + r);
+  }
+}
+
+bool read_index_descriptor(storehouse::StorageBackend* storage,
+                           const std::string& path,
+                           proto::VectorIndexDescriptor& descriptor) {
+  storehouse::FileInfo info;
+  if (storage->get_file_info(path, info) != storehouse::StoreResult::Success) {
+    return false;
+  }
+  std::unique_ptr<storehouse::RandomReadFile> file;
+  STORE_CHECK(storehouse::make_unique_random_read_file(storage, path, file));
+  u64 pos = 0;
+  descriptor =
+      deserialize_db_proto<proto::VectorIndexDescriptor>(file.get(), pos);
+  return true;
+}
+}
+
+proto::Result build_vector_index(storehouse::StorageConfig* config,
+                                 const TableMetadata& table, i32 column_id,
+                                 i32 dimension, i32 num_lists,
+                                 i32 num_subquantizers, i32 num_threads) {
+  proto::Result result;
+  result.set_success(true);
+  auto column = std::find_if(
+      table.columns().begin(), table.columns().end(),
+      [&](const proto::Column& c) { return c.id() == column_id; });
+  bool tensor = column != table.columns().end() &&
+                column->type() == ColumnType::Tensor &&
+                column->tensor_type() == proto::Column::FLOAT32;
+  bool other = column != table.columns().end() &&
+               column->type() == ColumnType::Other && dimension > 0;
+  if (!tensor && !other) {
+    RESULT_ERROR(&result,
+                 "Column %d of table %s is neither a Float32 Tensor column "
+                 "nor an Other column of embeddings",
+                 column_id, table.name().c_str());
+    return result;
+  }
+  i32 d = tensor ? tensor_element_size(*column) / sizeof(f32) : dimension;
+  i64 num_rows = table.num_rows();
+  if (num_rows == 0) {
+    RESULT_ERROR(&result, "Table %s has no rows to index",
+                 table.name().c_str());
+    return result;
+  }
+  if (d < 1 || num_lists < 1 || num_subquantizers < 1 ||
+      d % num_subquantizers != 0) {
+    RESULT_ERROR(&result,
+                 "Embeddings of %d values can not be indexed with %d lists and %d "
+                 "subquantizers",
+                 d, num_lists, num_subquantizers);
+    return result;
+  }
+  i32 sub_d = d / num_subquantizers;
+
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(config));
+  WorkStealingPool pool(num_threads);
+  std::vector<i64> end_rows = table.end_rows();
+  i32 num_items = end_rows.size();
+  auto item_rows = [&](i32 item) {
+    return end_rows[item] - (item == 0 ? 0 : end_rows[item - 1]);
+  };
+
+  // Whole items spread evenly over the table are read to train on
+  i64 train_rows = std::min(
+      MAX_TRAIN_ROWS,
+      std::max((i64)PQ_CENTROIDS, TRAIN_ROWS_PER_LIST * num_lists));
+  i64 train_items = (train_rows * num_items + num_rows - 1) / num_rows;
+  i64 item_stride = std::max((i64)1, num_items / std::max((i64)1, train_items));
+  std::vector<i32> sample_items;
+  for (i32 item = 0; item < num_items; item += item_stride) {
+    sample_items.push_back(item);
+  }
+  std::vector<std::vector<f32>> sample_values(sample_items.size());
+  for (size_t i = 0; i < sample_items.size(); ++i) {
+    pool.submit([&, i](i32 thread_id) {
+      std::vector<i64> rows;
+      read_item_embeddings(config, table, *column, sample_items[i], d,
+                           sample_values[i], rows);
+    });
+  }
+  pool.wait_idle();
+  std::vector<f32> sample;
+  for (std::vector<f32>& values : sample_values) {
+    sample.insert(sample.end(), values.begin(), values.end());
+    std::vector<f32>().swap(values);
+  }
+  i64 n = sample.size() / d;
+  if (n == 0) {
+    RESULT_ERROR(&result, "Column %d of table %s has no embeddings to index",
+                 column_id, table.name().c_str());
+    return result;
+  }
+  if (n > train_rows) {
+    for (i64 i = 0; i < train_rows; ++i) {
+      std::copy_n(sample.begin() + (i * n / train_rows) * d, d,
+                  sample.begin() + i * d);
+    }
+    n = train_rows;
+    sample.resize(n * d);
+  }
+  num_lists = std::min((i64)num_lists, n);
+
+  proto::VectorIndexDescriptor descriptor;
+  descriptor.set_table_id(table.id());
+  descriptor.set_column_id(column_id);
+  descriptor.set_dimension(d);
+  descriptor.set_num_lists(num_lists);
+  descriptor.set_num_subquantizers(num_subquantizers);
+  descriptor.set_num_rows(num_rows);
+  std::vector<f32> centroids = kmeans(pool, sample.data(), n, d, num_lists);
+  descriptor.set_centroids(centroids.data(), centroids.size() * sizeof(f32));
+
+  // Subquantizers are trained on the residuals of the sample
+  parallel_for(pool, n, [&](i64 start, i64 end) {
+    for (i64 i = start; i < end; ++i) {
+      f32* x = sample.data() + i * d;
+      const f32* centroid =
+          centroids.data() +
+          (i64)nearest_centroid(x, centroids.data(), num_lists, d) * d;
+      for (i32 j = 0; j < d; ++j) {
+        x[j] -= centroid[j];
+      }
+    }
+  });
+  std::vector<f32> codebooks;
+  std::vector<f32> subvectors(n * sub_d);
+  for (i32 j = 0; j < num_subquantizers; ++j) {
+    for (i64 i = 0; i < n; ++i) {
+      std::copy_n(sample.begin() + i * d + j * sub_d, sub_d,
+                  subvectors.begin() + i * sub_d);
+    }
+    std::vector<f32> codebook =
+        kmeans(pool, subvectors.data(), n, sub_d, PQ_CENTROIDS);
+    codebooks.insert(codebooks.end(), codebook.begin(), codebook.end());
+  }
+  descriptor.set_codebooks(codebooks.data(), codebooks.size() * sizeof(f32));
+  std::vector<f32>().swap(sample);
+
+  Quantizer quantizer(descriptor);
+  i64 entry_size = quantizer.entry_size();
+  i64 shard_rows = std::max((i64)1, SHARD_BYTES / entry_size);
+  for (i32 item = 0; item < num_items;) {
+    i32 end_item = item;
+    i64 rows = 0;
+    while (end_item < num_items &&
+           (end_item == item || rows + item_rows(end_item) <= shard_rows)) {
+      rows += item_rows(end_item++);
+    }
+    std::vector<std::vector<i32>> lists(end_item - item);
+    std::vector<std::string> entries(end_item - item);
+    for (i32 i = item; i < end_item; ++i) {
+      pool.submit([&, i](i32 thread_id) {
+        std::vector<f32> values;
+        std::vector<i64> rows;
+        read_item_embeddings(config, table, *column, i, d, values, rows);
+        std::vector<i32>& item_lists = lists[i - item];
+        std::string& item_entries = entries[i - item];
+        item_lists.resize(rows.size());
+        item_entries.resize(rows.size() * entry_size);
+        for (size_t r = 0; r < rows.size(); ++r) {
+          u8* entry = (u8*)&item_entries[r * entry_size];
+          std::memcpy(entry, &rows[r], sizeof(i64));
+          item_lists[r] =
+              quantizer.encode(values.data() + r * d, entry + sizeof(i64));
+        }
+      });
+    }
+    pool.wait_idle();
+
+    // The entries of each list are made contiguous, so a query reads one
+    // range of the shard per list it probes
+    std::vector<i64> offsets(num_lists + 1, 0);
+    for (auto& item_lists : lists) {
+      for (i32 list : item_lists) {
+        offsets[list + 1]++;
+      }
+    }
+    for (i32 l = 0; l < num_lists; ++l) {
+      offsets[l + 1] += offsets[l];
+    }
+    std::string shard(offsets[num_lists] * entry_size, '\0');
+    std::vector<i64> next(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < lists.size(); ++i) {
+      for (size_t r = 0; r < lists[i].size(); ++r) {
+        std::memcpy(&shard[next[lists[i][r]]++ * entry_size],
+                    &entries[i][r * entry_size], entry_size);
+      }
+      std::string().swap(entries[i]);
+    }
+    write_shard(storage.get(),
+                table_vector_index_shard_path(table.id(), column_id,
+                                              descriptor.shards_size()),
+                shard);
+    auto* shard_descriptor = descriptor.add_shards();
+    for (i64 offset : offsets) {
+      shard_descriptor->add_list_offsets(offset);
+    }
+    item = end_item;
+  }
+
+  // Shards of an earlier index that this one has no counterpart for
+  std::string path = table_vector_index_path(table.id(), column_id);
+  proto::VectorIndexDescriptor old_descriptor;
+  bool rebuilt = read_index_descriptor(storage.get(), path, old_descriptor);
+  std::unique_ptr<storehouse::WriteFile> file;
+  STORE_CHECK(storehouse::make_unique_write_file(storage.get(), path, file));
+  serialize_db_proto<proto::VectorIndexDescriptor>(file.get(), descriptor);
+  STORE_CHECK(file->save());
+  if (rebuilt) {
+    for (i32 s = descriptor.shards_size(); s < old_descriptor.shards_size();
+         ++s) {
+      storage->delete_file(
+          table_vector_index_shard_path(table.id(), column_id, s));
+    }
+  }
+  VLOG(1) << "Indexed the rows of table " << table.name() << " in "
+          << descriptor.shards_size() << " shards";
+  return result;
+}
+
+proto::Result search_vector_index(storehouse::StorageConfig* config,
+                                  const TableMetadata& table, i32 column_id,
+                                  const std::vector<f32>& queries, i32 k,
+                                  i32 num_probes, i32 num_threads,
+                                  std::vector<i64>& rows,
+                                  std::vector<f32>& distances) {
+  proto::Result result;
+  result.set_success(true);
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(config));
+  proto::VectorIndexDescriptor descriptor;
+  if (!read_index_descriptor(storage.get(),
+                             table_vector_index_path(table.id(), column_id),
+                             descriptor)) {
+    RESULT_ERROR(&result, "Column %d of table %s has no vector index",
+                 column_id, table.name().c_str());
+    return result;
+  }
+  Quantizer quantizer(descriptor);
+  i32 d = quantizer.d;
+  if (queries.size() % d != 0 || k < 1) {
+    RESULT_ERROR(&result, "Queries of the index of table %s have %d values",
+                 table.name().c_str(), d);
+    return result;
+  }
+  i64 num_queries = queries.size() / d;
+  num_probes = std::max(1, std::min(num_probes, quantizer.num_lists));
+  rows.assign(num_queries * k, -1);
+  distances.assign(num_queries * k, std::numeric_limits<f32>::infinity());
+
+  // Shard files are opened once per thread
+  std::vector<std::unique_ptr<storehouse::StorageBackend>> storages(
+      num_threads);
+  std::vector<std::vector<std::unique_ptr<storehouse::RandomReadFile>>> files(
+      num_threads);
+  for (i32 t = 0; t < num_threads; ++t) {
+    storages[t].reset(storehouse::StorageBackend::make_from_config(config));
+    files[t].resize(descriptor.shards_size());
+  }
+  i64 entry_size = quantizer.entry_size();
+  WorkStealingPool pool(num_threads);
+  for (i64 q = 0; q < num_queries; ++q) {
+    pool.submit([&, q](i32 thread_id) {
+      const f32* query = queries.data() + q * d;
+      std::vector<std::pair<f32, i32>> lists(quantizer.num_lists);
+      for (i32 l = 0; l < quantizer.num_lists; ++l) {
+        lists[l] = {l2_distance(query, quantizer.centroid(l), d), l};
+      }
+      std::partial_sort(lists.begin(), lists.begin() + num_probes,
+                        lists.end());
+
+      // Farthest of the nearest rows found so far on top
+      std::priority_queue<std::pair<f32, i64>> nearest;
+      std::vector<f32> residual(d);
+      std::vector<f32> code_distances(quantizer.m * PQ_CENTROIDS);
+      std::string entries;
+      for (i32 p = 0; p < num_probes; ++p) {
+        i32 list = lists[p].second;
+        for (i32 i = 0; i < d; ++i) {
+          residual[i] = query[i] - quantizer.centroid(list)[i];
+        }
+        // Distances of the residual to every code, so that an entry only
+        // takes a lookup per subquantizer
+        for (i32 j = 0; j < quantizer.m; ++j) {
+          for (i32 c = 0; c < PQ_CENTROIDS; ++c) {
+            code_distances[j * PQ_CENTROIDS + c] = l2_distance(
+                residual.data() + j * quantizer.sub_d,
+                quantizer.codebook(j) + c * quantizer.sub_d, quantizer.sub_d);
+          }
+        }
+        for (i32 s = 0; s < descriptor.shards_size(); ++s) {
+          const auto& offsets = descriptor.shards(s).list_offsets();
+          i64 begin = offsets.Get(list);
+          i64 end = offsets.Get(list + 1);
+          if (begin == end) {
+            continue;
+          }
+          auto& file = files[thread_id][s];
+          if (!file) {
+            STORE_CHECK(storehouse::make_unique_random_read_file(
+                storages[thread_id].get(),
+                table_vector_index_shard_path(table.id(), column_id, s),
+                file));
+          }
+          entries.resize((end - begin) * entry_size);
+          u64 pos = begin * entry_size;
+          s_read(file.get(), (u8*)&entries[0], entries.size(), pos);
+          for (i64 e = 0; e < end - begin; ++e) {
+            const u8* entry = (const u8*)&entries[e * entry_size];
+            const u8* codes = entry + sizeof(i64);
+            f32 distance = 0;
+            for (i32 j = 0; j < quantizer.m; ++j) {
+              distance += code_distances[j * PQ_CENTROIDS + codes[j]];
+            }
+            if ((i32)nearest.size() == k && distance >= nearest.top().first) {
+              continue;
+            }
+            i64 row;
+            std::memcpy(&row, entry, sizeof(i64));
+            nearest.push({distance, row});
+            if ((i32)nearest.size() > k) {
+              nearest.pop();
+            }
+          }
+        }
+      }
+      for (i64 i = (i64)nearest.size() - 1; i >= 0; --i) {
+        rows[q * k + i] = nearest.top().second;
+        distances[q * k + i] = nearest.top().first;
+        nearest.pop();
+      }
+    });
+  }
+  pool.wait_idle();
+  return result;
+}
+
+void vector_index_paths(storehouse::StorageBackend* storage,
+                        const TableMetadata& table,
+                        std::vector<std::string>& shard_paths,
+                        std::vector<std::string>& descriptor_paths) {
+  // Both Tensor and Other columns can be indexed, so every column is checked
+  // for a descriptor
+  for (const proto::Column& column : table.columns()) {
+    std::string path = table_vector_index_path(table.id(), column.id());
+    proto::VectorIndexDescriptor descriptor;
+    if (!read_index_descriptor(storage, path, descriptor)) {
+      continue;
+    }
+    for (i32 s = 0; s < descriptor.shards_size(); ++s) {
+      shard_paths.push_back(
+          table_vector_index_shard_path(table.id(), column.id(), s));
+    }
+    descriptor_paths.push_back(path);
+  }
+}
+}
+}
@@ -0,0 +1,75 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+#include "storehouse/storage_backend.h"
+#include "storehouse/storage_config.h"
+
+#include <string>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+//! Builds an approximate nearest neighbor index over the embeddings of a
+//! column and stores it with the table, for search_vector_index to find
+//! rows by L2 distance. Float32 Tensor columns have one embedding per row.
+//! Rows of Other columns hold any number of float32 embeddings of
+//! dimension values back to back, such as one per detected face, and each
+//! embedding is indexed under its row.
+//
+// The index is an inverted file of product quantized residuals (IVF-PQ).
+// Coarse centroids from k-means over a sample of the rows split them into
+// num_lists lists, and each row is kept as its row number and
+// num_subquantizers bytes, one per subvector of its residual to the
+// centroid, which index 256 centroids trained for that subvector. Items
+// are encoded in parallel on num_threads threads, in shards of up to a few
+// hundred megabytes of entries so that the rows are never all in memory,
+// and searching a list reads one range of each shard. Rows the table gets
+// after the index is built are not indexed.
+proto::Result build_vector_index(storehouse::StorageConfig* config,
+                                 const TableMetadata& table, i32 column_id,
+                                 i32 dimension, i32 num_lists,
+                                 i32 num_subquantizers, i32 num_threads);
+
+//! Finds the k embeddings of the indexed column nearest each query, which
+//! are dimension float32 values each. rows and distances get the rows of
+//! the embeddings and their approximate squared distances, k per query and
+//! nearest first. Queries whose lists have fewer than k embeddings are
+//! padded with row -1.
+//
+// Each query searches the num_probes lists whose centroids are nearest to
+// it, so more probes find more of the true neighbors at the cost of
+// reading more entries. Queries are searched in parallel on num_threads
+// threads.
+proto::Result search_vector_index(storehouse::StorageConfig* config,
+                                  const TableMetadata& table, i32 column_id,
+                                  const std::vector<f32>& queries, i32 k,
+                                  i32 num_probes, i32 num_threads,
+                                  std::vector<i64>& rows,
+                                  std::vector<f32>& distances);
+
+//! Files of the vector indexes of a table, for deleting them with it. The
+//! shards go in shard_paths, and the descriptors that name them in
+//! descriptor_paths.
+void vector_index_paths(storehouse::StorageBackend* storage,
+                        const TableMetadata& table,
+                        std::vector<std::string>& shard_paths,
+                        std::vector<std::string>& descriptor_paths);
+}
+}
@@ -14,27 +14,114 @@
  */
 
 #include "scanner/engine/video_index_entry.h"
+#include "scanner/util/annexb.h"
+#include "scanner/util/block_cache.h"
+
+#include <algorithm>
 
 namespace scanner {
 namespace internal {
 
-std::unique_ptr<storehouse::RandomReadFile> VideoIndexEntry::open_file() const {
+SourceVideoFile::SourceVideoFile(
+    std::unique_ptr<storehouse::RandomReadFile> file,
+    std::shared_ptr<const SourceVideo> source)
+  : file_(std::move(file)), source_(source) {}
+
+storehouse::StoreResult SourceVideoFile::read(uint64_t offset, size_t size,
+                                              uint8_t* data,
+                                              size_t& size_read) {
+  const std::vector<u64>& stream_offsets = source_->stream_offsets;
+  const std::vector<i64>& packet_offsets = source_->packet_offsets;
+  const std::vector<i64>& packet_sizes = source_->packet_sizes;
+  u64 stream_size = stream_offsets.back();
+  size_read = 0;
+  if (offset >= stream_size) {
+    return size == 0 ? storehouse::StoreResult::Success
+                     : storehouse::StoreResult::EndOfFile;
+  }
+  u64 end = std::min(offset + size, stream_size);
+
+  // Packets overlapping the range are read from the source at once
+  size_t first_packet =
+      std::upper_bound(stream_offsets.begin(), stream_offsets.end(), offset) -
+      stream_offsets.begin() - 1;
+  size_t end_packet =
+      std::lower_bound(stream_offsets.begin(), stream_offsets.end(), end) -
+      stream_offsets.begin();
+  i64 source_start = packet_offsets[first_packet];
+  i64 source_end = source_start;
+  for (size_t p = first_packet; p < end_packet; ++p) {
+    source_start = std::min(source_start, packet_offsets[p]);
+    source_end = std::max(source_end, packet_offsets[p] + packet_sizes[p]);
+  }
+  size_t source_size = source_end - source_start;
+  source_data_.resize(source_size);
+  size_t source_read = 0;
+  storehouse::StoreResult result =
+      file_->read(source_start, source_size, source_data_.data(), source_read);
+  if (source_read != source_size) {
+    return result;
+  }
+
+  for (size_t p = first_packet; p < end_packet; ++p) {
+    // Laid out as the index creators write packets
+    i32 packet_size = stream_offsets[p + 1] - stream_offsets[p] - sizeof(i32);
+    packet_.resize(sizeof(i32));
+    memcpy(packet_.data(), &packet_size, sizeof(i32));
+    if (source_->keyframes[p]) {
+      packet_.insert(packet_.end(), source_->parameter_sets.begin(),
+                     source_->parameter_sets.end());
+    }
+    if (!length_prefixed_to_annexb(
+            source_data_.data() + (packet_offsets[p] - source_start),
+            packet_sizes[p], source_->nal_length_size, packet_) ||
+        packet_.size() != stream_offsets[p + 1] - stream_offsets[p]) {
+      LOG(FATAL) << "Packet " << p << " of " << source_->path
+                 << " changed since it was ingested";
+    }
+    u64 copy_start = std::max(offset, stream_offsets[p]);
+    u64 copy_end = std::min(end, stream_offsets[p + 1]);
+    memcpy(data + (copy_start - offset),
+           packet_.data() + (copy_start - stream_offsets[p]),
+           copy_end - copy_start);
+  }
+  size_read = end - offset;
+  return size_read < size ? storehouse::StoreResult::EndOfFile
+                          : storehouse::StoreResult::Success;
+}
+
+storehouse::StoreResult SourceVideoFile::get_size(uint64_t& size) {
+  size = source_->stream_offsets.back();
+  return storehouse::StoreResult::Success;
+}
+
+const std::string SourceVideoFile::path() { return file_->path(); }
+
+std::unique_ptr<storehouse::RandomReadFile> VideoIndexEntry::open_file(
+    Profiler* profiler) const {
   std::unique_ptr<storehouse::RandomReadFile> file;
-  BACKOFF_FAIL(storehouse::make_unique_random_read_file(
-      storage, table_item_output_path(table_id, column_id, item_id),
-      file));
+  if (source) {
+    STORE_CHECK(
+        make_cached_random_read_file(storage, source->path, file, profiler));
+    return std::unique_ptr<storehouse::RandomReadFile>(
+        new SourceVideoFile(std::move(file), source));
+  }
+  STORE_CHECK(open_item_file(storage, packed, table_id, column_id, item_id,
+                             file, profiler));
   return std::move(file);
 }
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
-                                 i32 table_id, i32 column_id, i32 item_id) {
+                                 i32 table_id, i32 column_id, i32 item_id,
+                                 bool packed) {
   VideoMetadata video_meta = read_video_metadata(
       storage, VideoMetadata::descriptor_path(table_id, column_id, item_id));
-  return read_video_index(storage, video_meta);
+  return read_video_index(storage, video_meta, packed);
 }
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
-                                 const VideoMetadata& video_meta) {
+                                 const VideoMetadata& video_meta,
+                                 bool packed) {
   VideoIndexEntry index_entry;
 
   i32 table_id = video_meta.table_id();
@@ -46,19 +133,63 @@ VideoIndexEntry read_video_index(storehouse::StorageBackend* storage,
   index_entry.table_id = table_id;
   index_entry.column_id = column_id;
   index_entry.item_id = item_id;
+  index_entry.packed = packed;
   index_entry.width = video_meta.width();
   index_entry.height = video_meta.height();
   index_entry.channels = video_meta.channels();
   index_entry.frame_type = video_meta.frame_type();
   index_entry.codec_type = video_meta.codec_type();
 
+  const proto::VideoDescriptor& descriptor = video_meta.get_descriptor();
+  index_entry.frame_rate =
+      descriptor.time_base_num() > 0 && descriptor.time_base_denom() > 0
+          ? descriptor.time_base_denom() / (f64)descriptor.time_base_num()
+          : 0;
   std::unique_ptr<storehouse::RandomReadFile> file;
-  BACKOFF_FAIL(storehouse::make_unique_random_read_file(
-      storage, table_item_output_path(table_id, column_id, item_id),
-      file));
-  BACKOFF_FAIL(file->get_size(index_entry.file_size));
+  if (!descriptor.source_path().empty()) {
+    // Keyframes are the packets at keyframe byte offsets, which are
+    // preceded by the parameter sets
+    auto source = std::make_shared<SourceVideo>();
+    source->path = descriptor.source_path();
+    source->packet_offsets.assign(descriptor.source_packet_offsets().begin(),
+                                  descriptor.source_packet_offsets().end());
+    source->packet_sizes.assign(descriptor.source_packet_sizes().begin(),
+                                descriptor.source_packet_sizes().end());
+    source->parameter_sets.assign(descriptor.source_parameter_sets().begin(),
+                                  descriptor.source_parameter_sets().end());
+    source->nal_length_size = descriptor.source_nal_length_size();
+    u64 stream_offset = 0;
+    i32 keyframe = 0;
+    for (i64 packet_size : source->packet_sizes) {
+      bool is_keyframe = keyframe < descriptor.keyframe_byte_offsets_size() &&
+                         descriptor.keyframe_byte_offsets(keyframe) ==
+                             (i64)stream_offset;
+      keyframe += is_keyframe ? 1 : 0;
+      source->stream_offsets.push_back(stream_offset);
+      source->keyframes.push_back(is_keyframe);
+      stream_offset += sizeof(i32) + packet_size +
+                       (is_keyframe ? source->parameter_sets.size() : 0);
+    }
+    source->stream_offsets.push_back(stream_offset);
+    LOG_IF(FATAL, keyframe != descriptor.keyframe_byte_offsets_size())
+        << "Keyframes of " << source->path << " do not match its packets";
+    index_entry.source = source;
+    index_entry.file_size = stream_offset;
+  } else if (packed) {
+    STORE_CHECK(open_item_file(storage, packed, table_id, column_id, item_id,
+                               file));
+  } else {
+    std::string path = item_file_path(
+        table_id, table_item_output_path(table_id, column_id, item_id));
+    STORE_CHECK(storehouse::make_unique_random_read_file(
+        item_storage(storage, path), path, file));
+  }
+  if (file) {
+    STORE_CHECK(file->get_size(index_entry.file_size));
+  }
   index_entry.keyframe_positions = video_meta.keyframe_positions();
   index_entry.keyframe_byte_offsets = video_meta.keyframe_byte_offsets();
+  index_entry.keyframe_packet_sizes = video_meta.keyframe_packet_sizes();
   // Place total frames at the end of keyframe positions and total file size
   // at the end of byte offsets to make interval calculation not need to
   // deal with edge cases surrounding those
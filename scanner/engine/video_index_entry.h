@@ -21,30 +21,83 @@
 
 #include "storehouse/storage_backend.h"
 
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace scanner {
 namespace internal {
 
+//! Where the packets of a video ingested in place are in its source file.
+struct SourceVideo {
+  std::string path;
+  std::vector<i64> packet_offsets;
+  std::vector<i64> packet_sizes;
+  // Offset of each packet in the bytestream produced from the source, with
+  // the size of the bytestream at the end
+  std::vector<u64> stream_offsets;
+  std::vector<bool> keyframes;
+  std::vector<u8> parameter_sets;
+  i32 nal_length_size;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// SourceVideoFile
+//! Reads the bytestream of a video ingested in place, which is produced from
+//! the packets of its source file as a copying ingest would have written it.
+class SourceVideoFile : public storehouse::RandomReadFile {
+ public:
+  SourceVideoFile(std::unique_ptr<storehouse::RandomReadFile> file,
+                  std::shared_ptr<const SourceVideo> source);
+
+  storehouse::StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                               size_t& size_read) override;
+
+  storehouse::StoreResult get_size(uint64_t& size) override;
+
+  const std::string path() override;
+
+ private:
+  std::unique_ptr<storehouse::RandomReadFile> file_;
+  std::shared_ptr<const SourceVideo> source_;
+  std::vector<u8> source_data_;
+  std::vector<u8> packet_;
+};
+
 struct VideoIndexEntry {
-  std::unique_ptr<storehouse::RandomReadFile> open_file() const;
+  //! Opens the video through the block cache, counting cache hits in
+  //! profiler if one is given.
+  std::unique_ptr<storehouse::RandomReadFile> open_file(
+      Profiler* profiler = nullptr) const;
 
   storehouse::StorageBackend* storage;
   i32 table_id;
   i32 column_id;
   i32 item_id;
+  // Stored as a column of a packed item file
+  bool packed;
   i32 width;
   i32 height;
   i32 channels;
   FrameType frame_type;
   proto::VideoDescriptor::VideoCodecType codec_type;
+  // Frames a second, from the time base, or 0 if the video has none
+  f64 frame_rate;
   u64 file_size;
   std::vector<i64> keyframe_positions;
   std::vector<i64> keyframe_byte_offsets;
+  // Empty for videos indexed before packet sizes were recorded
+  std::vector<i64> keyframe_packet_sizes;
+  // Set for videos ingested in place
+  std::shared_ptr<const SourceVideo> source;
 };
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend *storage,
-                                 i32 table_id, i32 column_id, i32 item_id);
+                                 i32 table_id, i32 column_id, i32 item_id,
+                                 bool packed = false);
 
 VideoIndexEntry read_video_index(storehouse::StorageBackend *storage,
-                                 const VideoMetadata& video_meta);
+                                 const VideoMetadata& video_meta,
+                                 bool packed = false);
 }
 }
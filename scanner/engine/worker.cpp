@@ -15,11 +15,18 @@
 
 #include "scanner/engine/worker.h"
 #include "scanner/engine/evaluate_worker.h"
+#include "scanner/engine/ingest.h"
+#include "scanner/engine/kernel_cache.h"
 #include "scanner/engine/kernel_registry.h"
 #include "scanner/engine/load_worker.h"
+#include "scanner/engine/metadata_cache.h"
 #include "scanner/engine/runtime.h"
 #include "scanner/engine/save_worker.h"
+#include "scanner/util/block_cache.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/metrics.h"
+#include "scanner/util/numa.h"
+#include "scanner/video/decoder_pool.h"
 
 #include <arpa/inet.h>
 #include <grpc/grpc_posix.h>
@@ -30,6 +37,10 @@
 #include <boost/python.hpp>
 #include <boost/python/numpy.hpp>
 #include <omp.h>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
 
 // For avcodec_register_all()... should go in software video with global mutex
 extern "C" {
@@ -48,23 +59,126 @@ inline bool operator==(const MemoryPoolConfig& lhs,
                        const MemoryPoolConfig& rhs) {
   return (lhs.cpu().use_pool() == rhs.cpu().use_pool()) &&
          (lhs.cpu().free_space() == rhs.cpu().free_space()) &&
+         (lhs.cpu().soft_limit() == rhs.cpu().soft_limit()) &&
+         (lhs.cpu().overflow_size() == rhs.cpu().overflow_size()) &&
          (lhs.gpu().use_pool() == rhs.gpu().use_pool()) &&
-         (lhs.gpu().free_space() == rhs.gpu().free_space());
+         (lhs.gpu().free_space() == rhs.gpu().free_space()) &&
+         (lhs.gpu().soft_limit() == rhs.gpu().soft_limit()) &&
+         (lhs.gpu().overflow_size() == rhs.gpu().overflow_size()) &&
+         (lhs.pinned_cpu() == rhs.pinned_cpu()) &&
+         (lhs.gpu_staging_size() == rhs.gpu_staging_size()) &&
+         (lhs.cpu_huge_page_size() == rhs.cpu_huge_page_size());
 }
 inline bool operator!=(const MemoryPoolConfig& lhs,
                        const MemoryPoolConfig& rhs) {
   return !(lhs == rhs);
 }
 
+// Outstanding asynchronous NextWork request to the master
+struct PendingLease {
+  grpc::ClientContext context;
+  grpc::Status status;
+  proto::WorkLease lease;
+  i32 num_items;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<proto::WorkLease>> rpc;
+};
+
+// How often the IO split between load and save tasks is re-evaluated
+const i32 STAGE_CONTROL_INTERVAL_MS = 100;
+// Consecutive samples that must agree before threads are moved between stages
+const i32 STAGE_CONTROL_HYSTERESIS = 3;
+
+// Splits the IO pool threads between load and save tasks based on the
+// occupancy of the pipeline queues, and tracks which stage is holding the
+// pipeline back.
+//
+// If the evaluate queues are running dry while loads are waiting, loading is
+// the bottleneck. If finished output is waiting to be written, saving is.
+// Otherwise the evaluate stages are the bottleneck. After a stage has been
+// the bottleneck for a few samples in a row one thread is moved to it from
+// the other IO stage, keeping at least one thread on each.
+class StageController {
+ public:
+  StageController(i32 num_threads, i32 initial_load_threads,
+                  timepoint_t start, Profiler& profiler)
+    : num_threads_(std::max(num_threads, 2)),
+      profiler_(profiler),
+      stage_start_(start) {
+    load_limit_ = std::max(1, std::min(initial_load_threads, num_threads_ - 1));
+  }
+
+  i32 load_limit() const { return load_limit_; }
+
+  i32 save_limit() const { return num_threads_ - load_limit_; }
+
+  void update(i32 load_backlog, i32 eval_backlog, i32 eval_capacity,
+              i32 save_backlog) {
+    std::string stage;
+    if (load_backlog > load_limit_ && eval_backlog * 2 < eval_capacity) {
+      stage = "load";
+    } else if (save_backlog > save_limit()) {
+      stage = "save";
+    } else {
+      stage = "eval";
+    }
+
+    timepoint_t current = now();
+    if (stage != stage_) {
+      finish(current);
+      stage_ = stage;
+      stage_samples_ = 0;
+    }
+    stage_samples_++;
+
+    if (stage_samples_ >= STAGE_CONTROL_HYSTERESIS) {
+      if (stage == "load" && save_limit() > 1) {
+        load_limit_++;
+        profiler_.increment("threads_to_load", 1);
+        stage_samples_ = 0;
+      } else if (stage == "save" && load_limit_ > 1) {
+        load_limit_--;
+        profiler_.increment("threads_to_save", 1);
+        stage_samples_ = 0;
+      }
+    }
+  }
+
+  //! Records the time spent in the current bottleneck stage.
+  void finish(timepoint_t end) {
+    if (!stage_.empty()) {
+      profiler_.add_interval("bottleneck_" + stage_, stage_start_, end);
+      profiler_.increment(
+          "bottleneck_" + stage_ + "_ms",
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+              end - stage_start_).count());
+    }
+    stage_start_ = end;
+  }
+
+ private:
+  const i32 num_threads_;
+  Profiler& profiler_;
+  i32 load_limit_;
+  std::string stage_;
+  i32 stage_samples_ = 0;
+  timepoint_t stage_start_;
+};
+
 struct AnalysisResults {
   std::vector<std::vector<std::tuple<i32, std::string>>> live_columns;
   std::vector<std::vector<i32>> dead_columns;
   std::vector<std::vector<i32>> unused_outputs;
   std::vector<std::vector<i32>> column_mapping;
 
+  // Warmup rows at the start of a task each kernel's op asks for
   std::vector<i32> warmup_sizes;
   std::vector<i32> batch_sizes;
   std::vector<std::vector<i32>> stencils;
+  // Whether each kernel is fused with the next one
+  std::vector<bool> fuse_with_next;
+  // Per kernel -> per live column -> device types of the later kernels that
+  // read it
+  std::vector<std::vector<std::vector<DeviceType>>> consumer_devices;
 };
 
 AnalysisResults analyze_dag(const proto::TaskSet& task_set) {
@@ -89,8 +203,8 @@ AnalysisResults analyze_dag(const proto::TaskSet& task_set) {
     auto& input_op = ops.Get(0);
     for (const std::string& input_col : input_op.inputs(0).columns()) {
       // Set last used to first op so that all input ops are live to start
-      // with. We could eliminate input columns which aren't used, but this
-      // also requires modifying the samples.
+      // with. The master already left out the input columns no op reads,
+      // along with their columns in the samples.
       intermediates[0].push_back(std::make_tuple(input_col, 1));
     }
   }
@@ -125,7 +239,12 @@ AnalysisResults analyze_dag(const proto::TaskSet& task_set) {
     // Use default batch if not specified
     i32 batch_size =
         op.batch() != -1 ? op.batch() : kernel_factory->preferred_batch_size();
+    if (kernel_factory->max_batch_size() > 0) {
+      batch_size = std::min(batch_size, kernel_factory->max_batch_size());
+    }
+    batch_size = std::max(batch_size, 1);
     batch_sizes.push_back(batch_size);
+    warmup_sizes.push_back(std::max(op.warmup(), 0));
     // Use default stencil if not specified
     std::vector<i32> stencil;
     if (op.stencil_size() > 0) {
@@ -136,6 +255,25 @@ AnalysisResults analyze_dag(const proto::TaskSet& task_set) {
     stencils.push_back(stencil);
   }
 
+  // Consecutive kernels on the same device type with degenerate stencils
+  // consume the rows the previous one produces as they are produced, so they
+  // can be evaluated a few rows at a time while their inputs are still in
+  // cache instead of each one over a whole item. Filters drop rows from the
+  // whole item at once and are never fused.
+  std::vector<bool>& fuse_with_next = results.fuse_with_next;
+  fuse_with_next.resize(stencils.size(), false);
+  for (size_t i = 0; i + 1 < stencils.size(); ++i) {
+    bool degenerate = stencils[i].size() == 1 && stencils[i][0] == 0 &&
+                      stencils[i + 1].size() == 1 && stencils[i + 1][0] == 0;
+    bool filter = op_registry->get_op_info(ops.Get(i + 1).name())
+                      ->is_filter() ||
+                  op_registry->get_op_info(ops.Get(i + 2).name())
+                      ->is_filter();
+    fuse_with_next[i] =
+        degenerate && !filter &&
+        ops.Get(i + 1).device_type() == ops.Get(i + 2).device_type();
+  }
+
   // The live columns at each op index
   live_columns.resize(ops.size());
   for (size_t i = 0; i < ops.size(); ++i) {
@@ -153,6 +291,33 @@ AnalysisResults analyze_dag(const proto::TaskSet& task_set) {
     }
   }
 
+  // Devices on which the kernels after each kernel read its live columns, so
+  // that a column moved to one device can keep its copy on the other for them
+  std::vector<std::vector<std::vector<DeviceType>>>& consumer_devices =
+      results.consumer_devices;
+  consumer_devices.resize(ops.size() - 2);
+  for (size_t i = 0; i + 2 < ops.size(); ++i) {
+    for (auto& col : live_columns[i]) {
+      consumer_devices[i].emplace_back();
+      std::vector<DeviceType>& devices = consumer_devices[i].back();
+      for (size_t j = i + 2; j + 1 < ops.size(); ++j) {
+        auto& op = ops.Get(j);
+        for (auto& eval_input : op.inputs()) {
+          if (eval_input.op_index() != std::get<0>(col)) {
+            continue;
+          }
+          for (const std::string& name : eval_input.columns()) {
+            if (name == std::get<1>(col) &&
+                std::find(devices.begin(), devices.end(),
+                          op.device_type()) == devices.end()) {
+              devices.push_back(op.device_type());
+            }
+          }
+        }
+      }
+    }
+  }
+
   // The columns to remove for the current kernel
   dead_columns.resize(ops.size() - 1);
   // Outputs from the current kernel that are not used
@@ -250,14 +415,50 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
   i64 last_row = sample.rows(sample.rows_size() - 1);
   std::string table_path = TableMetadata::descriptor_path(sample.table_id());
   TableMetadata meta = read_table_metadata(storage, table_path);
-  {
-    current_rows = std::vector<i64>(sample.rows().begin(), sample.rows().end());
+  // The warmup rows of the sample come before its other rows. Kernels only
+  // produce the ones their op asks for, and earlier kernels the ones the
+  // stencils of later kernels read, so that ops without a warmup skip the
+  // warmup rows when a later op needs them. If no op asks for a warmup, every
+  // kernel produces all of the warmup rows of the sampler.
+  i64 sample_warmup = std::min((i64)sample.warmup_size(),
+                               (i64)sample.rows_size());
+  bool declared_warmup = false;
+  for (i32 w : analysis_results.warmup_sizes) {
+    declared_warmup |= w > 0;
+  }
+  auto sample_rows_of_kernel = [&](i64 k) {
+    i64 skipped = 0;
+    if (declared_warmup) {
+      skipped = sample_warmup -
+                std::min(sample_warmup,
+                         (i64)analysis_results.warmup_sizes[k]);
+    }
+    return std::vector<i64>(sample.rows().begin() + skipped,
+                            sample.rows().end());
+  };
+  i64 first_task_row = sample_warmup < sample.rows_size()
+                           ? sample.rows(sample_warmup)
+                           : last_row + 1;
+  auto push_stream = [&](const std::vector<i64>& rows) {
     TaskStream s;
-    s.valid_output_rows = current_rows;
+    s.valid_output_rows = rows;
+    if (sample_warmup > 0) {
+      s.warmup_rows = std::lower_bound(rows.begin(), rows.end(),
+                                       first_task_row) -
+                      rows.begin();
+    }
     task_streams.push_front(s);
+  };
+  {
+    current_rows = num_kernels > 0
+                       ? sample_rows_of_kernel(num_kernels - 1)
+                       : std::vector<i64>(sample.rows().begin(),
+                                          sample.rows().end());
+    push_stream(current_rows);
     // For each kernel, derive the required elements via its stencil
     for (i64 i = 0; i < num_kernels; ++i) {
-      const std::vector<i32>& stencil = stencils[num_kernels - 1 - i];
+      i64 k = num_kernels - 1 - i;
+      const std::vector<i32>& stencil = stencils[k];
       std::unordered_set<i64> new_rows;
       new_rows.reserve(current_rows.size());
       for (i64 r : current_rows) {
@@ -268,11 +469,14 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
           new_rows.insert(r + s);
         }
       }
+      if (k > 0) {
+        for (i64 r : sample_rows_of_kernel(k - 1)) {
+          new_rows.insert(r);
+        }
+      }
       current_rows = std::vector<i64>(new_rows.begin(), new_rows.end());
       std::sort(current_rows.begin(), current_rows.end());
-      TaskStream s;
-      s.valid_output_rows = current_rows;
-      task_streams.push_front(s);
+      push_stream(current_rows);
     }
   }
   // Compute the required work item sizes to produce the minimal amount of
@@ -297,6 +501,14 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
         const std::vector<i32> stencil = analysis_results.stencils[k - 1];
         i64 batch_size = analysis_results.batch_sizes[k - 1];
 
+        // Once a kernel has produced all of its rows, the earlier ones still
+        // produce the warmup rows only they need
+        if (pos >= s.valid_output_rows.size()) {
+          work_item_size =
+              prev_s.valid_output_rows.size() - produced_rows[k - 1];
+          continue;
+        }
+
         // If the kernel is batched, we need to make sure we round up to
         // request a batch of input.
         if (work_item_size % batch_size != 0) {
@@ -305,7 +517,7 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
 
         // If we are at the end of the task, then we can not provide
         // a full batch and must provide a partial one
-        if (pos + work_item_size > prev_s.valid_output_rows.size()) {
+        if (pos + work_item_size > s.valid_output_rows.size()) {
           work_item_size = s.valid_output_rows.size() - pos;
         }
 
@@ -321,19 +533,18 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
                                            required_input_rows.end());
         std::sort(sorted_input_rows.begin(), sorted_input_rows.end());
 
-        // For all the rows not in the stencil cache, we will request them
-        // from the upstream kernel by setting the work item size
+        // The upstream kernel produces its rows in order, so we request all
+        // of the ones after the stencil cache up to the last row needed,
+        // including warmup rows this kernel skips, by setting the work item
+        // size
         i64 rows_to_request = 0;
         {
-          i64 i = 0;
-          for (; i < sorted_input_rows.size(); ++i) {
-            // If the requested row is not in the stencil cache, we are done
-            // with this work item
-            if (sorted_input_rows[i] > last_stencil_cache_row[k - 1]) {
-              break;
-            }
-          }
-          rows_to_request = (sorted_input_rows.size() - i);
+          const std::vector<i64>& prev_rows = prev_s.valid_output_rows;
+          auto first = std::upper_bound(prev_rows.begin(), prev_rows.end(),
+                                        last_stencil_cache_row[k - 1]);
+          auto last = std::upper_bound(first, prev_rows.end(),
+                                       sorted_input_rows.back());
+          rows_to_request = last - first;
         }
         assert(rows_to_request > 0);
         work_item_size = rows_to_request;
@@ -361,6 +572,11 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
             break;
           }
         }
+        if (rows == 0) {
+          // The input so far only covers warmup rows this kernel skips
+          work_item_size = 0;
+          continue;
+        }
         assert(pos + rows - 1 < ts.valid_output_rows.size());
         // Round down if we don't have enough for a batch unless this is
         // the end of the task
@@ -399,51 +615,10 @@ void derive_stencil_requirements(storehouse::StorageBackend* storage,
   }
 }
 
-void load_driver(LoadInputQueue& load_work,
-                 std::vector<EvalQueue>& initial_eval_work,
-                 LoadWorkerArgs args) {
-  Profiler& profiler = args.profiler;
-  LoadWorker worker(args);
-  while (true) {
-    auto idle_start = now();
-
-    std::tuple<i32, std::deque<TaskStream>, IOItem, LoadWorkEntry> entry;
-    load_work.pop(entry);
-    i32& output_queue_idx = std::get<0>(entry);
-    auto& task_streams = std::get<1>(entry);
-    IOItem& io_item = std::get<2>(entry);
-    LoadWorkEntry& load_work_entry = std::get<3>(entry);
-
-    args.profiler.add_interval("idle", idle_start, now());
-
-    if (load_work_entry.io_item_index() == -1) {
-      break;
-    }
-
-    VLOG(2) << "Load (N/PU: " << args.node_id << "/" << args.worker_id
-            << "): processing item " << load_work_entry.io_item_index();
-
-    auto work_start = now();
-
-    auto input_entry = std::make_tuple(io_item, load_work_entry);
-    std::tuple<IOItem, EvalWorkEntry> output_entry =
-        worker.execute(input_entry);
-
-    profiler.add_interval("task", work_start, now());
-
-    initial_eval_work[output_queue_idx].push(std::make_tuple(
-        task_streams, std::get<0>(output_entry), std::get<1>(output_entry)));
-  }
-  VLOG(1) << "Load (N/PU: " << args.node_id << "/" << args.worker_id
-          << "): thread finished";
-}
-
-std::mutex no_pipelining_lock;
-std::condition_variable no_pipelining_cvar;
-
 void pre_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
                          PreEvaluateWorkerArgs args) {
   Profiler& profiler = args.profiler;
+  MemoryTagScope memory_tag("decode");
   PreEvaluateWorker worker(args);
   while (true) {
     auto idle_start = now();
@@ -502,69 +677,316 @@ void pre_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
     }
 
 
-    profiler.add_interval("task", work_start, now());
+    profiler.add_interval("task", work_start, now(),
+                          work_entry.io_item_index);
   }
 
   VLOG(1) << "Pre-evaluate (N/PU: " << args.node_id << "/" << args.worker_id
           << "): thread finished ";
 }
 
-void evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
-                     EvaluateWorkerArgs args) {
+using EvalQueueEntry =
+    std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry>;
+
+void evaluate_entry(EvaluateWorker& worker, const EvaluateWorkerArgs& args,
+                    EvalQueueEntry& entry, EvalQueue& output_work) {
   Profiler& profiler = args.profiler;
-  EvaluateWorker worker(args);
-  while (true) {
-    auto idle_pull_start = now();
+  auto& task_streams = std::get<0>(entry);
+  IOItem& io_item = std::get<1>(entry);
+  EvalWorkEntry& work_entry = std::get<2>(entry);
+
+  VLOG(2) << "Evaluate (N/KI/G: " << args.node_id << "/" << args.ki << "/"
+          << args.kg << "): processing item " << work_entry.io_item_index;
+
+  auto work_start = now();
+
+  if (task_streams.size() > 0) {
+    // Start of a new task. Tell kernels what outputs they should produce.
+    std::vector<TaskStream> streams;
+    for (i32 i = 0; i < args.kernel_factories.size(); ++i) {
+      assert(!task_streams.empty());
+      streams.push_back(task_streams.front());
+      task_streams.pop_front();
+    }
+    worker.new_task(streams);
+  }
 
-    std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry> entry;
-    input_work.pop(entry);
+  i32 work_item_size = 0;
+  for (size_t i = 0; i < work_entry.columns.size(); ++i) {
+    work_item_size =
+        std::max(work_item_size, (i32)work_entry.columns[i].size());
+  }
 
-    auto& task_streams = std::get<0>(entry);
-    IOItem& io_item = std::get<1>(entry);
-    EvalWorkEntry& work_entry = std::get<2>(entry);
+  auto input_entry = std::make_tuple(io_item, work_entry);
+  worker.feed(input_entry);
+  std::tuple<IOItem, EvalWorkEntry> output_entry;
+  bool result = worker.yield(work_item_size, output_entry);
+  (void)result;
+  assert(result);
 
-    args.profiler.add_interval("idle_pull", idle_pull_start, now());
+  profiler.add_interval("task", work_start, now(), work_entry.io_item_index);
 
-    if (work_entry.io_item_index == -1) {
-      break;
-    }
+  auto idle_push_start = now();
+  output_work.push(std::make_tuple(task_streams, std::get<0>(output_entry),
+                                   std::get<1>(output_entry)));
+  profiler.add_interval("idle_push", idle_push_start, now());
+}
 
-    VLOG(2) << "Evaluate (N/KI/G: " << args.node_id << "/" << args.ki << "/"
-            << args.kg << "): processing item " << work_entry.io_item_index;
+// Whether entry is a task of a single item that can be evaluated together
+// with the tasks in pending
+bool can_batch_task(const std::vector<EvalQueueEntry>& pending,
+                    const EvalQueueEntry& entry) {
+  const EvalWorkEntry& work_entry = std::get<2>(entry);
+  if (std::get<0>(entry).empty() || !work_entry.last_in_task ||
+      work_entry.warmup_rows > 0 || work_entry.row_ids.empty()) {
+    return false;
+  }
+  if (pending.empty()) {
+    return true;
+  }
+  // Batched kernels expect the elements of a batch to have the same shape
+  const EvalWorkEntry& first_entry = std::get<2>(pending.front());
+  if (first_entry.columns.size() != work_entry.columns.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < work_entry.columns.size(); ++i) {
+    const DeviceHandle& first_handle = first_entry.column_handles[i];
+    const DeviceHandle& handle = work_entry.column_handles[i];
+    if (first_handle.type != handle.type || first_handle.id != handle.id) {
+      return false;
+    }
+    const Element& first_element = first_entry.columns[i][0];
+    const Element& element = work_entry.columns[i][0];
+    if (first_element.is_frame != element.is_frame ||
+        (element.is_frame &&
+         first_element.as_const_frame()->as_frame_info() !=
+             element.as_const_frame()->as_frame_info())) {
+      return false;
+    }
+  }
+  return true;
+}
 
-    auto work_start = now();
+// Evaluates tasks of a single item as one task, with the rows of each task
+// shifted past those of the one before so that they stay increasing, and
+// pushes the output of each task with its own rows
+void evaluate_batched_tasks(EvaluateWorker& worker,
+                            const EvaluateWorkerArgs& args,
+                            std::vector<EvalQueueEntry>& tasks,
+                            EvalQueue& output_work) {
+  if (tasks.size() == 1) {
+    evaluate_entry(worker, args, tasks[0], output_work);
+    return;
+  }
+  Profiler& profiler = args.profiler;
+  auto work_start = now();
+
+  size_t num_kernels = args.kernel_factories.size();
+  std::vector<TaskStream> streams(num_kernels);
+  EvalWorkEntry batched_entry = std::get<2>(tasks[0]);
+  batched_entry.row_ids.clear();
+  for (ElementList& column : batched_entry.columns) {
+    column.clear();
+  }
+  batched_entry.replicas.clear();
+  batched_entry.filtered_rows.clear();
+  std::vector<i64> offsets;
+  // Row after the last one of each task in the batched rows
+  std::vector<i64> task_ends;
+  i64 next_row = 0;
+  for (EvalQueueEntry& task : tasks) {
+    std::deque<TaskStream>& task_streams = std::get<0>(task);
+    EvalWorkEntry& work_entry = std::get<2>(task);
+    assert(task_streams.size() >= num_kernels);
+    i64 first_row = work_entry.row_ids.front();
+    i64 last_row = work_entry.row_ids.back();
+    for (size_t k = 0; k < num_kernels; ++k) {
+      const std::vector<i64>& rows = task_streams[k].valid_output_rows;
+      if (!rows.empty()) {
+        first_row = std::min(first_row, rows.front());
+        last_row = std::max(last_row, rows.back());
+      }
+    }
+    i64 offset = next_row - first_row;
+    for (size_t k = 0; k < num_kernels; ++k) {
+      for (i64 row : task_streams[k].valid_output_rows) {
+        streams[k].valid_output_rows.push_back(row + offset);
+      }
+    }
+    for (i64 row : work_entry.row_ids) {
+      batched_entry.row_ids.push_back(row + offset);
+    }
+    for (size_t c = 0; c < work_entry.columns.size(); ++c) {
+      batched_entry.columns[c].insert(batched_entry.columns[c].end(),
+                                      work_entry.columns[c].begin(),
+                                      work_entry.columns[c].end());
+    }
+    for (auto& kv : work_entry.replicas) {
+      ColumnReplicas& replicas = batched_entry.replicas[kv.first];
+      for (auto& replica : kv.second) {
+        replicas[replica.first + offset] = replica.second;
+      }
+    }
+    for (i64 row : work_entry.filtered_rows) {
+      batched_entry.filtered_rows.push_back(row + offset);
+    }
+    offsets.push_back(offset);
+    next_row = last_row + offset + 1;
+    task_ends.push_back(next_row);
+  }
 
-    if (task_streams.size() > 0) {
-      // Start of a new task. Tell kernels what outputs they should produce.
-      std::vector<TaskStream> streams;
-      for (i32 i = 0; i < args.kernel_factories.size(); ++i) {
-        assert(!task_streams.empty());
-        streams.push_back(task_streams.front());
-        task_streams.pop_front();
+  worker.new_task(streams);
+  auto input_entry = std::make_tuple(std::get<1>(tasks[0]), batched_entry);
+  worker.feed(input_entry);
+  std::tuple<IOItem, EvalWorkEntry> output_entry;
+  bool result = worker.yield(batched_entry.row_ids.size(), output_entry);
+  (void)result;
+  assert(result);
+  EvalWorkEntry& batched_output = std::get<1>(output_entry);
+
+  // The other items of the batch are linked to the same interval under a key
+  // of their own, so that totals count the time once
+  auto work_end = now();
+  profiler.add_interval("task", work_start, work_end,
+                        std::get<2>(tasks[0]).io_item_index);
+  for (size_t t = 1; t < tasks.size(); ++t) {
+    profiler.add_interval("task_shared", work_start, work_end,
+                          std::get<2>(tasks[t]).io_item_index);
+  }
+  profiler.increment("batched_tasks", tasks.size());
+
+  // Filters may have dropped some of the rows of each task, so the output
+  // rows of a task are those in its range
+  size_t pos = 0;
+  const std::vector<i64>& batched_rows = batched_output.row_ids;
+  const std::vector<i64>& batched_filtered = batched_output.filtered_rows;
+  for (size_t t = 0; t < tasks.size(); ++t) {
+    EvalQueueEntry& task = tasks[t];
+    std::deque<TaskStream>& task_streams = std::get<0>(task);
+    const EvalWorkEntry& work_entry = std::get<2>(task);
+    std::vector<i64> output_rows;
+    while (pos + output_rows.size() < batched_rows.size() &&
+           batched_rows[pos + output_rows.size()] < task_ends[t]) {
+      output_rows.push_back(batched_rows[pos + output_rows.size()] -
+                            offsets[t]);
+    }
+    EvalWorkEntry output;
+    output.io_item_index = work_entry.io_item_index;
+    output.needs_configure = work_entry.needs_configure;
+    output.needs_reset = work_entry.needs_reset;
+    output.last_in_task = work_entry.last_in_task;
+    output.warmup_rows = work_entry.warmup_rows;
+    output.frame_rate = work_entry.frame_rate;
+    output.row_ids = output_rows;
+    output.column_handles = batched_output.column_handles;
+    output.columns.resize(batched_output.columns.size());
+    for (size_t c = 0; c < batched_output.columns.size(); ++c) {
+      ElementList& column = batched_output.columns[c];
+      output.columns[c].assign(column.begin() + pos,
+                               column.begin() + pos + output_rows.size());
+    }
+    for (auto& kv : batched_output.replicas) {
+      for (i64 row : output_rows) {
+        auto it = kv.second.find(row + offsets[t]);
+        if (it != kv.second.end()) {
+          output.replicas[kv.first][row] = it->second;
+        }
       }
-      worker.new_task(streams);
+    }
+    for (i64 row : batched_filtered) {
+      if (row < task_ends[t] && (t == 0 || row >= task_ends[t - 1])) {
+        output.filtered_rows.push_back(row - offsets[t]);
+      }
+    }
+    pos += output_rows.size();
+    for (size_t k = 0; k < num_kernels; ++k) {
+      task_streams.pop_front();
     }
 
-    i32 work_item_size = 0;
-    for (size_t i = 0; i < work_entry.columns.size(); ++i) {
-      work_item_size =
-          std::max(work_item_size, (i32)work_entry.columns[i].size());
+    auto idle_push_start = now();
+    output_work.push(std::make_tuple(task_streams, std::get<1>(task), output));
+    profiler.add_interval("idle_push", idle_push_start, now());
+  }
+  assert(pos == batched_output.row_ids.size());
+}
+
+void evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
+                     EvaluateWorkerArgs args) {
+  MemoryTagScope memory_tag("eval");
+  EvaluateWorker worker(args);
+
+  // Tasks of a single item, as from sparse sampling, leave batched kernels
+  // with undersized batches. They wait up to batch_latency_ms for the tasks
+  // after them, until together they fill the largest batch of the group.
+  // Kernels with stencils read rows around their own, so their groups keep
+  // evaluating each task on its own.
+  i64 batch_rows = 0;
+  if (args.batch_latency_ms > 0) {
+    bool degenerate = true;
+    i32 max_batch = 1;
+    for (size_t k = 0; k < args.kernel_stencils.size(); ++k) {
+      const std::vector<i32>& stencil = args.kernel_stencils[k];
+      degenerate &= stencil.size() == 1 && stencil[0] == 0;
+      max_batch = std::max(max_batch, args.kernel_batch_sizes[k]);
     }
+    if (degenerate && max_batch > 1) {
+      batch_rows = max_batch;
+    }
+  }
+  std::vector<EvalQueueEntry> pending;
+  i64 pending_rows = 0;
+  timepoint_t pending_deadline;
+  auto evaluate_pending = [&]() {
+    if (!pending.empty()) {
+      evaluate_batched_tasks(worker, args, pending, output_work);
+    }
+    pending.clear();
+    pending_rows = 0;
+  };
 
-    auto input_entry = std::make_tuple(io_item, work_entry);
-    worker.feed(input_entry);
-    std::tuple<IOItem, EvalWorkEntry> output_entry;
-    bool result = worker.yield(work_item_size, output_entry);
-    (void)result;
-    assert(result);
+  while (true) {
+    auto idle_pull_start = now();
 
-    profiler.add_interval("task", work_start, now());
+    EvalQueueEntry entry;
+    if (pending.empty()) {
+      input_work.pop(entry);
+    } else if (!input_work.try_pop_for(
+                   entry, std::max(pending_deadline - now(),
+                                   timepoint_t::duration::zero()))) {
+      args.profiler.add_interval("idle_pull", idle_pull_start, now());
+      evaluate_pending();
+      continue;
+    }
 
-    auto idle_push_start = now();
-    output_work.push(std::make_tuple(task_streams, std::get<0>(output_entry),
-                                     std::get<1>(output_entry)));
-    args.profiler.add_interval("idle_push", idle_push_start, now());
+    EvalWorkEntry& work_entry = std::get<2>(entry);
+
+    args.profiler.add_interval("idle_pull", idle_pull_start, now());
 
+    if (batch_rows > 0 && work_entry.io_item_index != -1) {
+      if (!can_batch_task(pending, entry)) {
+        evaluate_pending();
+      }
+      if (can_batch_task(pending, entry)) {
+        if (pending.empty()) {
+          pending_deadline =
+              now() + std::chrono::milliseconds(args.batch_latency_ms);
+        }
+        pending_rows += work_entry.row_ids.size();
+        pending.push_back(entry);
+        if (pending_rows >= batch_rows) {
+          evaluate_pending();
+        }
+        continue;
+      }
+    } else {
+      evaluate_pending();
+    }
+
+    if (work_entry.io_item_index == -1) {
+      break;
+    }
+
+    evaluate_entry(worker, args, entry, output_work);
   }
   VLOG(1) << "Evaluate (N/KI: " << args.node_id << "/" << args.ki
           << "): thread finished";
@@ -573,6 +995,7 @@ void evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
 void post_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
                           PostEvaluateWorkerArgs args) {
   Profiler& profiler = args.profiler;
+  MemoryTagScope memory_tag("post");
   PostEvaluateWorker worker(args);
   while (true) {
     auto idle_start = now();
@@ -597,7 +1020,8 @@ void post_evaluate_driver(EvalQueue& input_work, EvalQueue& output_work,
     worker.feed(input_entry);
     std::tuple<IOItem, EvalWorkEntry> output_entry;
     bool result = worker.yield(output_entry);
-    profiler.add_interval("task", work_start, now());
+    profiler.add_interval("task", work_start, now(),
+                          work_entry.io_item_index);
 
     if (result) {
       output_work.push(std::make_tuple(std::get<0>(entry),
@@ -654,6 +1078,19 @@ WorkerImpl::WorkerImpl(DatabaseParameters& db_params,
 
   storage_ =
       storehouse::StorageBackend::make_from_config(db_params_.storage_config);
+  init_block_cache(db_params_.block_cache_size, db_params_.block_cache_dir,
+                   db_params_.block_cache_disk_size);
+  // Databases sharing the directory each get their own part of it
+  if (!db_params_.local_table_dir.empty()) {
+    set_local_table_path(
+        db_params_.local_table_dir + "/" +
+        std::to_string(std::hash<std::string>()(db_params_.db_path)));
+  }
+
+  // Load and save work for every job runs on one pool sized to the machine
+  io_pool_.reset(new WorkStealingPool(
+      std::max(db_params_.num_load_workers + db_params_.num_save_workers, 1)));
+  kernel_pool_.reset(new WorkStealingPool(std::max(db_params_.num_cpus, 1)));
 
   // Set up Python runtime if any kernels need it
   Py_Initialize();
@@ -666,6 +1103,10 @@ WorkerImpl::~WorkerImpl() {
     watchdog_thread_.join();
   }
   delete storage_;
+  // Idle decoders hold device contexts that must go before the devices do,
+  // and idle kernels may hold buffers from the memory pools
+  decoder_pool().clear();
+  kernel_cache().clear();
   if (memory_pool_initialized_) {
     destroy_memory_allocators();
   }
@@ -677,16 +1118,37 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   job_result->set_success(true);
   set_database_path(db_params_.db_path);
 
-  // Load table metadata for use in other operations
-  // TODO(apoms): only load needed tables
-  DatabaseMetadata meta =
-      read_database_metadata(storage_, DatabaseMetadata::descriptor_path());
+  // Jobs may run at the same time, each with its own pipelines, so the state
+  // they share is only set up while holding the lock
+  std::unique_lock<std::mutex> setup_lk(job_setup_mutex_);
+  bool other_jobs_running = active_jobs_ > 0;
+  active_jobs_++;
+  struct ActiveJob {
+    std::atomic<i32>& count;
+    ~ActiveJob() { count--; }
+  } active_job{active_jobs_};
+
+  // The master sends the descriptors of tables this job uses that changed
+  // since the last job, so nothing needs to be read from storage here
+  for (auto& descriptor : job_params->table_descriptors()) {
+    known_metadata_.tables[descriptor.id()] = descriptor;
+    if (descriptor.local_items()) {
+      add_local_table(descriptor.id());
+    }
+  }
+  for (auto& descriptor : job_params->video_descriptors()) {
+    known_metadata_.videos[std::make_tuple(descriptor.table_id(),
+                                           descriptor.column_id(),
+                                           descriptor.item_id())] = descriptor;
+  }
+  auto manifest = std::make_shared<const Manifest>(known_metadata_);
   std::map<std::string, TableMetadata> table_meta;
-  for (const std::string& table_name : meta.table_names()) {
-    std::string table_path =
-        TableMetadata::descriptor_path(meta.get_table_id(table_name));
-    table_meta[table_name] = read_table_metadata(storage_, table_path);
+  for (auto& kv : known_metadata_.tables) {
+    table_meta[kv.second.name()] = TableMetadata(kv.second);
   }
+  VLOG(1) << "Received " << job_params->table_descriptors_size()
+          << " changed table descriptors (metadata version "
+          << job_params->metadata_version() << ")";
 
   i32 local_id = job_params->local_id();
   i32 local_total = job_params->local_total();
@@ -696,7 +1158,19 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   bool distribute_work_evenly = false;
 
   timepoint_t base_time = now();
-  const i32 work_item_size = job_params->work_item_size();
+  if (!other_jobs_running) {
+    // Report memory high-water marks for this job only
+    reset_memory_peaks();
+    // Tables may have been rewritten since the last job
+    metadata_cache().clear();
+    // Local items of tables deleted since are only removed here, since no
+    // job reads them while none is running
+    if (!get_local_table_path().empty()) {
+      remove_unused_local_tables(read_database_metadata(
+          storage_, DatabaseMetadata::descriptor_path()));
+    }
+  }
+  metadata_cache().set_manifest(manifest);
   i32 warmup_size = 0;
 
   OpRegistry* op_registry = get_op_registry();
@@ -705,6 +1179,34 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   // Analyze op DAG to determine what inputs need to be pipped along
   // and when intermediates can be retired -- essentially liveness analysis
   AnalysisResults analysis_results = analyze_dag(job_params->task_set());
+  // Work items are a multiple of the batch sizes of the kernels, so that
+  // only the last item of a task leaves batches undersized. Batch sizes
+  // without a small common multiple only round to the largest one.
+  i32 work_item_size = job_params->work_item_size();
+  {
+    i64 max_batch = 1;
+    for (i32 batch : analysis_results.batch_sizes) {
+      max_batch = std::max(max_batch, (i64)batch);
+    }
+    i64 batch_multiple = 1;
+    for (i32 batch : analysis_results.batch_sizes) {
+      i64 a = batch_multiple;
+      i64 b = batch;
+      while (b != 0) {
+        i64 t = a % b;
+        a = b;
+        b = t;
+      }
+      batch_multiple = batch_multiple / a * batch;
+      if (batch_multiple > std::max((i64)work_item_size, max_batch)) {
+        batch_multiple = max_batch;
+        break;
+      }
+    }
+    if (work_item_size % batch_multiple != 0) {
+      work_item_size += batch_multiple - work_item_size % batch_multiple;
+    }
+  }
   // The live columns at each op index
   std::vector<std::vector<std::tuple<i32, std::string>>>& live_columns =
       analysis_results.live_columns;
@@ -723,11 +1225,38 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   // Read final output columns for use in post-evaluate worker
   // (needed for determining column types)
   std::vector<Column> final_output_columns;
+  std::vector<i32> output_column_tables(
+      job_params->task_set().output_column_tables().begin(),
+      job_params->task_set().output_column_tables().end());
+  // Output table -> the output tables of the jobs merged into it
+  std::map<i32, std::vector<i32>> shared_output_tables;
   {
-    std::string output_name =
-        job_params->task_set().tasks(0).output_table_name();
-    TableMetadata& table = table_meta[output_name];
-    final_output_columns = table.columns();
+    // Only the output table names are read from the task. The master sends
+    // tasks without their samples, which come with each item's load entry.
+    const proto::Task& task = job_params->task_set().tasks(0);
+    std::vector<const TableMetadata*> tables = {
+        &table_meta[task.output_table_name()]};
+    for (auto& name : task.shared_output_table_names()) {
+      tables.push_back(&table_meta[name]);
+    }
+    if (output_column_tables.empty()) {
+      final_output_columns = tables[0]->columns();
+    } else {
+      // Columns of the merged jobs are interleaved in the order of the
+      // output op's inputs
+      std::vector<i32> next_column(tables.size());
+      for (i32 t : output_column_tables) {
+        final_output_columns.push_back(
+            tables.at(t)->columns().at(next_column[t]++));
+      }
+    }
+    for (auto& task : job_params->task_set().tasks()) {
+      std::vector<i32>& shared =
+          shared_output_tables[table_meta[task.output_table_name()].id()];
+      for (auto& name : task.shared_output_table_names()) {
+        shared.push_back(table_meta[name].id());
+      }
+    }
   }
   std::vector<ColumnCompressionOptions> final_compression_options;
   for (auto& opts : job_params->task_set().compression()) {
@@ -739,6 +1268,16 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     final_compression_options.push_back(o);
   }
   assert(final_output_columns.size() == final_compression_options.size());
+  // Output columns whose rows are sent to the client
+  std::map<i32, std::string> stream_columns;
+  for (const std::string& name : job_params->stream_columns()) {
+    for (size_t i = 0; i < final_output_columns.size(); ++i) {
+      if (final_output_columns[i].name() == name) {
+        stream_columns[i] = name;
+        break;
+      }
+    }
+  }
 
   // Setup kernel factories and the kernel configs that will be used
   // to instantiate instances of the op pipeline
@@ -814,6 +1353,47 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     kernel_configs.push_back(kernel_config);
   }
 
+  // Pipeline instances that evaluate GPU ops with their CPU kernels
+  i32 cpu_pipeline_instances =
+      std::max(job_params->cpu_pipeline_instances(), 0);
+
+  // Decoders can hand frames over as NV12 instead of converting them to RGB
+  // if every op reading the input columns accepts that layout. The output op
+  // is excluded since frames are saved as RGB. Ops reading motion vectors
+  // never see the frames, and the master checked that no other op reads
+  // their input columns as frames.
+  auto& input_names = ops.Get(0).inputs(0).columns();
+  std::vector<bool> motion_vector_columns(input_names.size(), false);
+  bool nv12_frames = true;
+  for (size_t i = 1; i < ops.size(); ++i) {
+    if (i < ops.size() - 1 &&
+        op_registry->get_op_info(ops.Get(i).name())->motion_vector_inputs()) {
+      for (auto& input : ops.Get(i).inputs()) {
+        for (const std::string& name : input.columns()) {
+          auto it = std::find(input_names.begin(), input_names.end(), name);
+          if (input.op_index() == 0 && it != input_names.end()) {
+            motion_vector_columns[it - input_names.begin()] = true;
+          }
+        }
+      }
+      continue;
+    }
+    for (auto& input : ops.Get(i).inputs()) {
+      if (input.op_index() == 0 &&
+          (i == ops.size() - 1 ||
+           !kernel_factories[i - 1]->accepts_nv12_frames())) {
+        nv12_frames = false;
+      }
+      if (input.op_index() == 0 && i < ops.size() - 1 &&
+          cpu_pipeline_instances > 0 &&
+          kernel_registry->has_kernel(ops.Get(i).name(), DeviceType::CPU) &&
+          !kernel_registry->get_kernel(ops.Get(i).name(), DeviceType::CPU)
+               ->accepts_nv12_frames()) {
+        nv12_frames = false;
+      }
+    }
+  }
+
   // Break up kernels into groups that run on the same device
   std::vector<std::vector<std::tuple<KernelFactory*, KernelConfig>>>
       kernel_groups;
@@ -824,6 +1404,9 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   std::vector<std::vector<std::vector<i32>>> kg_column_mapping;
   std::vector<std::vector<std::vector<i32>>> kg_stencils;
   std::vector<std::vector<i32>> kg_batch_sizes;
+  std::vector<std::vector<bool>> kg_fuse_with_next;
+  std::vector<std::vector<std::vector<std::vector<DeviceType>>>>
+      kg_consumer_devices;
   if (!kernel_factories.empty()) {
     DeviceType last_device_type = kernel_factories[0]->get_device_type();
     kernel_groups.emplace_back();
@@ -833,6 +1416,8 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     kg_column_mapping.emplace_back();
     kg_stencils.emplace_back();
     kg_batch_sizes.emplace_back();
+    kg_fuse_with_next.emplace_back();
+    kg_consumer_devices.emplace_back();
     for (size_t i = 0; i < kernel_factories.size(); ++i) {
       KernelFactory* factory = kernel_factories[i];
       if (factory->get_device_type() != last_device_type) {
@@ -846,6 +1431,8 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
         kg_column_mapping.emplace_back();
         kg_stencils.emplace_back();
         kg_batch_sizes.emplace_back();
+        kg_fuse_with_next.emplace_back();
+        kg_consumer_devices.emplace_back();
       }
       auto& group = kernel_groups.back();
       auto& lc = kg_live_columns.back();
@@ -861,12 +1448,66 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       cm.push_back(column_mapping[i]);
       st.push_back(analysis_results.stencils[i]);
       bt.push_back(analysis_results.batch_sizes[i]);
+      kg_consumer_devices.back().push_back(
+          analysis_results.consumer_devices[i]);
+      // Kernels are only fused within a group
+      kg_fuse_with_next.back().push_back(
+          analysis_results.fuse_with_next[i] &&
+          i + 1 < kernel_factories.size() &&
+          kernel_factories[i + 1]->get_device_type() == last_device_type);
     }
   }
 
   i32 num_kernel_groups = static_cast<i32>(kernel_groups.size());
   assert(num_kernel_groups > 0);  // is this actually necessary?
 
+  // The CPU pipeline instances have the same kernel groups, except that the
+  // GPU groups whose ops all have a CPU kernel use those kernels instead
+  std::vector<std::vector<std::tuple<KernelFactory*, KernelConfig>>>
+      cpu_kernel_groups = kernel_groups;
+  std::vector<std::vector<i32>> cpu_kg_batch_sizes = kg_batch_sizes;
+  if (cpu_pipeline_instances > 0) {
+    for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
+      auto& group = cpu_kernel_groups[kg];
+      if (std::get<0>(group[0])->get_device_type() != DeviceType::GPU) {
+        continue;
+      }
+      bool has_cpu_kernels = true;
+      for (auto& kernel : group) {
+        has_cpu_kernels &= kernel_registry->has_kernel(
+            std::get<0>(kernel)->get_op_name(), DeviceType::CPU);
+      }
+      if (!has_cpu_kernels) {
+        VLOG(1) << "Kernel group " << kg << " has ops without a CPU kernel, "
+                << "so CPU pipeline instances evaluate it on the GPU";
+        continue;
+      }
+      for (size_t k = 0; k < group.size(); ++k) {
+        KernelFactory* cpu_factory = kernel_registry->get_kernel(
+            std::get<0>(group[k])->get_op_name(), DeviceType::CPU);
+        std::get<0>(group[k]) = cpu_factory;
+        if (cpu_factory->max_batch_size() > 0) {
+          cpu_kg_batch_sizes[kg][k] = std::min(cpu_kg_batch_sizes[kg][k],
+                                               cpu_factory->max_batch_size());
+        }
+      }
+    }
+  }
+
+  // Load workers slice rows using the seek cost of the decoder the pre
+  // evaluate workers will pick for the first kernel group
+  VideoDecoderType load_decoder_type = VideoDecoderType::SOFTWARE;
+  bool cpu_decode =
+      std::getenv("FORCE_CPU_DECODE") ||
+      std::get<0>(kernel_groups[0][0])->get_device_type() == DeviceType::CPU;
+  if (!cpu_decode &&
+      VideoDecoder::has_decoder_type(VideoDecoderType::NVIDIA)) {
+    load_decoder_type = VideoDecoderType::NVIDIA;
+  } else if (cpu_decode &&
+             VideoDecoder::has_decoder_type(VideoDecoderType::INTEL)) {
+    load_decoder_type = VideoDecoderType::INTEL;
+  }
+
   i32 pipeline_instances_per_node = job_params->pipeline_instances_per_node();
   // If ki per node is -1, we set a smart default. Currently, we calculate the
   // maximum possible kernel instances without oversubscribing any part of the
@@ -903,57 +1544,391 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                  " greater than 0 for manual configuration.");
     return grpc::Status::OK;
   }
+  // The CPU pipeline instances come after the others
+  i32 first_cpu_instance = pipeline_instances_per_node;
+  pipeline_instances_per_node += cpu_pipeline_instances;
+
+  // Software codecs share the CPUs of the node between pipeline instances
+  // unless the job sets their thread count, and the decoders or encoders of
+  // a column share the threads of their pipeline instance
+  i32 codec_threads = job_params->codec_threads();
+  if (codec_threads <= 0) {
+    codec_threads = std::max(
+        db_params_.num_cpus / local_total / pipeline_instances_per_node, 1);
+  }
+  i32 decoder_threads = codec_threads;
+  if (job_params->codec_threads() <= 0) {
+    decoder_threads =
+        std::max(codec_threads / std::max(job_params->decode_parallelism(), 1),
+                 1);
+  }
+  i32 encoder_threads = codec_threads;
+  if (job_params->codec_threads() <= 0) {
+    encoder_threads =
+        std::max(codec_threads / std::max(job_params->encode_parallelism(), 1),
+                 1);
+  }
+  // Rows that consecutive items share because of kernel stencils, on top of
+  // their warmup, which pre-evaluate workers keep decoded between items
+  i32 stencil_overlap_rows = 0;
+  for (const std::vector<i32>& stencil : analysis_results.stencils) {
+    if (!stencil.empty()) {
+      stencil_overlap_rows += stencil.back() - stencil.front();
+    }
+  }
 
-  // Set up memory pool if different than previous memory pool
-  if (!memory_pool_initialized_ ||
+  // Set up memory pool if different than previous memory pool. Jobs running
+  // at the same time share the pool of the first one.
+  if (other_jobs_running &&
       job_params->memory_pool_config() != cached_memory_pool_config_) {
+    LOG(WARNING) << "Job " << job_params->job_name() << " uses the memory "
+                 << "pool of the jobs already running on node " << node_id_;
+  } else if (!memory_pool_initialized_ ||
+             job_params->memory_pool_config() != cached_memory_pool_config_) {
     if (db_params_.num_cpus < local_total * pipeline_instances_per_node &&
         job_params->memory_pool_config().cpu().use_pool()) {
       RESULT_ERROR(job_result,
                    "Cannot oversubscribe CPUs and also use CPU memory pool");
       return grpc::Status::OK;
     }
-    if (db_params_.gpu_ids.size() < local_total * pipeline_instances_per_node &&
+    if (db_params_.gpu_ids.size() < local_total * first_cpu_instance &&
         job_params->memory_pool_config().gpu().use_pool()) {
       RESULT_ERROR(job_result,
                    "Cannot oversubscribe GPUs and also use GPU memory pool");
       return grpc::Status::OK;
     }
     if (memory_pool_initialized_) {
+      // Idle kernels may hold buffers from the pools being replaced
+      kernel_cache().clear();
       destroy_memory_allocators();
     }
     init_memory_allocators(job_params->memory_pool_config(), gpu_ids);
     cached_memory_pool_config_ = job_params->memory_pool_config();
     memory_pool_initialized_ = true;
   }
+  setup_lk.unlock();
 
   omp_set_num_threads(std::thread::hardware_concurrency());
 
   // Setup shared resources for distributing work to processing threads
   i64 accepted_items = 0;
-  LoadInputQueue load_work;
   std::vector<EvalQueue> initial_eval_work(pipeline_instances_per_node);
   std::vector<std::vector<EvalQueue>> eval_work(pipeline_instances_per_node);
   EvalQueue save_work;
   std::atomic<i64> retired_items{0};
-
-  // Setup load workers
-  i32 num_load_workers = db_params_.num_load_workers;
-  std::vector<Profiler> load_thread_profilers;
-  for (i32 i = 0; i < num_load_workers; ++i) {
-    load_thread_profilers.emplace_back(Profiler(base_time));
+  // Unbounded so that save workers never block on the main loop
+  Queue<IOItem> finished_items(std::numeric_limits<i32>::max());
+  Queue<proto::StreamedItem> streamed_items(std::numeric_limits<i32>::max());
+  CancelledItems cancelled_items;
+
+  // Load and save work runs as tasks on the shared IO pool. Each pool thread
+  // lazily creates its own load and save worker for this job so that storage
+  // backends and metadata caches are not shared between threads.
+  i32 num_io_threads = io_pool_->num_threads();
+  std::vector<Profiler> load_thread_profilers(num_io_threads,
+                                              Profiler(base_time));
+  std::vector<Profiler> save_thread_profilers(num_io_threads,
+                                              Profiler(base_time));
+  std::vector<std::unique_ptr<LoadWorker>> load_workers(num_io_threads);
+  std::vector<std::unique_ptr<SaveWorker>> save_workers(num_io_threads);
+  // Save tasks hand finished items to the upload queue instead of waiting on
+  // storage themselves
+  std::unique_ptr<UploadQueue> upload_queue;
+  if (job_params->save_upload_parallelism() > 0) {
+    upload_queue.reset(new UploadQueue(db_params_.storage_config,
+                                       job_params->save_upload_parallelism(),
+                                       job_params->save_upload_size()));
   }
-  std::vector<std::thread> load_threads;
-  for (i32 i = 0; i < num_load_workers; ++i) {
-    LoadWorkerArgs args{// Uniform arguments
-                        node_id_,
-                        // Per worker arguments
-                        i, db_params_.storage_config, load_thread_profilers[i],
-                        job_params->load_sparsity_threshold()};
+  std::atomic<i64> pending_loads{0};
+  std::atomic<i64> pending_saves{0};
+  // Set when the job fails so queued IO tasks are skipped
+  std::atomic<bool> cancel_io{false};
+  // Decides how many pool threads loads and saves may occupy at a time
+  Profiler controller_profiler(base_time);
+  // Storage throttling is counted per process, so jobs running at the same
+  // time see each other's
+  i64 throttle_events_start = storage_limiter().throttle_events();
+  i64 throttle_wait_start = storage_limiter().throttle_wait_us();
+  StageController stage_controller(num_io_threads,
+                                   db_params_.num_load_workers, base_time,
+                                   controller_profiler);
+  // Loads waiting for a free load slot in the IO pool, with the bytes of the
+  // frames they will decode
+  std::deque<
+      std::tuple<i32, std::deque<TaskStream>, IOItem, LoadWorkEntry, i64>>
+      load_backlog;
+
+  i32 load_memory_tag = memory_tag_id("load");
+  i32 save_memory_tag = memory_tag_id("save");
+
+  std::atomic<i64>& loaded_items =
+      metric_counter("scanner_stage_items_total{stage=\"load\"}");
+  std::atomic<i64>& evaluated_items =
+      metric_counter("scanner_stage_items_total{stage=\"eval\"}");
+  std::atomic<i64>& saved_items =
+      metric_counter("scanner_stage_items_total{stage=\"save\"}");
+  // Queue depths of this job, reported until it ends
+  struct QueueGauges {
+    explicit QueueGauges(i32 job_id) {
+      std::string labels = "{job=\"" + std::to_string(job_id) + "\",queue=\"";
+      load = "scanner_queue_depth" + labels + "load_work\"}";
+      eval = "scanner_queue_depth" + labels + "eval_work\"}";
+      save = "scanner_queue_depth" + labels + "save_work\"}";
+    }
+    ~QueueGauges() {
+      clear_metric_gauge(load);
+      clear_metric_gauge(eval);
+      clear_metric_gauge(save);
+    }
+    std::string load;
+    std::string eval;
+    std::string save;
+  } queue_gauges(job_params->job_id());
+
+  auto get_load_worker = [&](i32 thread_id) -> LoadWorker* {
+    Profiler& profiler = load_thread_profilers[thread_id];
+    std::unique_ptr<LoadWorker>& worker = load_workers[thread_id];
+    if (!worker) {
+      auto setup_start = now();
+      worker.reset(new LoadWorker(LoadWorkerArgs{
+          // Uniform arguments
+          node_id_,
+          // Per worker arguments
+          thread_id, db_params_.storage_config, profiler,
+          job_params->load_sparsity_threshold(),
+          job_params->read_coalesce_gap(),
+          job_params->load_read_parallelism(), job_params->load_mmap(),
+          job_params->direct_reads(), load_decoder_type}));
+      profiler.add_interval("setup", setup_start, now());
+    }
+    return worker.get();
+  };
 
-    load_threads.emplace_back(load_driver, std::ref(load_work),
-                              std::ref(initial_eval_work), args);
-  }
+  // Loads waiting in the backlog are read ahead into the block cache, one at
+  // a time, up to a number of items and a byte budget. Bytes of items read
+  // ahead are charged to the budget until their load starts.
+  const i32 readahead_items_limit = job_params->load_readahead_items();
+  const i64 readahead_size_limit = job_params->load_readahead_size();
+  std::atomic<bool> readahead_running{false};
+  std::atomic<i64> readahead_bytes{0};
+  // Only touched by the main thread
+  std::set<i64> readahead_items;
+  std::mutex readahead_mutex;
+  // Bytes read ahead per item, or -1 if its load started before the read
+  // ahead finished
+  std::map<i64, i64> readahead_item_bytes;
+
+  auto submit_readahead = [&](const LoadWorkEntry& load_work_entry,
+                              i64 max_bytes) {
+    readahead_running = true;
+    io_pool_->submit([&, load_work_entry, max_bytes](i32 thread_id) {
+      i64 bytes = 0;
+      if (!cancel_io) {
+        MemoryTagScope memory_tag(load_memory_tag);
+        bytes =
+            get_load_worker(thread_id)->prefetch(load_work_entry, max_bytes);
+      }
+      {
+        std::lock_guard<std::mutex> guard(readahead_mutex);
+        i64 item = load_work_entry.io_item_index();
+        if (readahead_item_bytes.count(item) > 0) {
+          readahead_item_bytes.erase(item);
+        } else {
+          readahead_item_bytes[item] = bytes;
+          readahead_bytes += bytes;
+        }
+      }
+      readahead_running = false;
+    });
+  };
+
+  // Stops charging the budget for an item that was read ahead
+  auto release_readahead = [&](i64 item) {
+    std::lock_guard<std::mutex> guard(readahead_mutex);
+    auto it = readahead_item_bytes.find(item);
+    if (it == readahead_item_bytes.end()) {
+      readahead_item_bytes[item] = -1;
+      return;
+    }
+    readahead_bytes -= it->second;
+    readahead_item_bytes.erase(it);
+  };
+
+  auto submit_load = [&](i32 output_queue_idx,
+                         const std::deque<TaskStream>& task_streams,
+                         const IOItem& io_item,
+                         const LoadWorkEntry& load_work_entry) {
+    pending_loads++;
+    bool read_ahead = readahead_items.erase(load_work_entry.io_item_index());
+    io_pool_->submit([&, output_queue_idx, task_streams, io_item,
+                      load_work_entry, read_ahead](i32 thread_id) {
+      if (read_ahead) {
+        release_readahead(load_work_entry.io_item_index());
+      }
+      if (cancel_io) {
+        pending_loads--;
+        return;
+      }
+      MemoryTagScope memory_tag(load_memory_tag);
+      Profiler& profiler = load_thread_profilers[thread_id];
+      LoadWorker* worker = get_load_worker(thread_id);
+
+      VLOG(2) << "Load (N/PU: " << node_id_ << "/" << thread_id
+              << "): processing item " << load_work_entry.io_item_index();
+
+      auto work_start = now();
+
+      auto input_entry = std::make_tuple(io_item, load_work_entry);
+      std::tuple<IOItem, EvalWorkEntry> output_entry =
+          worker->execute(input_entry);
+
+      profiler.add_interval("task", work_start, now(),
+                            load_work_entry.io_item_index());
+
+      initial_eval_work[output_queue_idx].push(
+          std::make_tuple(task_streams, std::get<0>(output_entry),
+                          std::get<1>(output_entry)));
+      loaded_items++;
+      pending_loads--;
+    });
+  };
+
+  // Decoded frame bytes of the loads admitted into the pipeline, by io item,
+  // which are charged against the budget of the pool the frames decode into
+  // until the item is handed to the save stage. Only touched by the main
+  // thread, and by the save drainer once no more loads are admitted.
+  const i64 decode_budget = memory_pool_budget(
+      load_decoder_type == VideoDecoderType::NVIDIA ? DeviceType::GPU
+                                                    : DeviceType::CPU);
+  std::map<i64, i64> admitted_item_bytes;
+  i64 admitted_bytes = 0;
+  auto admit_item = [&](i64 io_item_index, i64 bytes) {
+    admitted_item_bytes[io_item_index] += bytes;
+    admitted_bytes += bytes;
+  };
+  auto retire_item = [&](i64 io_item_index) {
+    auto it = admitted_item_bytes.find(io_item_index);
+    if (it != admitted_item_bytes.end()) {
+      admitted_bytes -= it->second;
+      admitted_item_bytes.erase(it);
+    }
+  };
+
+  auto submit_save = [&](
+      const std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry>&
+          entry) {
+    retire_item(std::get<2>(entry).io_item_index);
+    evaluated_items++;
+    pending_saves++;
+    io_pool_->submit([&, entry](i32 thread_id) mutable {
+      if (cancel_io) {
+        pending_saves--;
+        return;
+      }
+      MemoryTagScope memory_tag(save_memory_tag);
+      Profiler& profiler = save_thread_profilers[thread_id];
+      std::unique_ptr<SaveWorker>& worker = save_workers[thread_id];
+      if (!worker) {
+        auto setup_start = now();
+        worker.reset(new SaveWorker(SaveWorkerArgs{
+            // Uniform arguments
+            node_id_, job_params->job_name(), output_column_tables,
+            shared_output_tables, stream_columns, job_params->stream_only(),
+
+            // Per worker arguments
+            thread_id, db_params_.storage_config, profiler,
+
+            // Shared state
+            retired_items, finished_items, streamed_items, cancelled_items,
+            upload_queue.get()}));
+        profiler.add_interval("setup", setup_start, now());
+      }
+      worker->feed(entry);
+      saved_items++;
+      pending_saves--;
+    });
+  };
+
+  // Hands finished pipeline output to the IO pool to be written out, up to
+  // the number of save slots unless flushing
+  auto drain_save_work = [&](bool flush) {
+    std::tuple<std::deque<TaskStream>, IOItem, EvalWorkEntry> entry;
+    while ((flush || pending_saves < stage_controller.save_limit()) &&
+           save_work.try_pop(entry)) {
+      submit_save(entry);
+    }
+  };
+
+  // Moves queued loads into the IO pool as load slots free up
+  // True if no item is waiting in any queue of the pipeline
+  auto pipeline_drained = [&]() {
+    if (pending_loads > 0 || pending_saves > 0 || save_work.size() > 0) {
+      return false;
+    }
+    for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+      if (initial_eval_work[pu].size() > 0) {
+        return false;
+      }
+      for (auto& q : eval_work[pu]) {
+        if (q.size() > 0) {
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+
+  // Loads are held back while a memory pool is over its soft limit, or while
+  // the frames of the next item would not fit in the budget of the pool
+  // next to those of the items admitted before it, so that the memory held
+  // by items in flight can drain. A load is still let through once the
+  // pipeline has drained, in case the memory is held elsewhere.
+  bool memory_throttled = false;
+  timepoint_t memory_throttle_start;
+  auto dispatch_loads = [&]() {
+    while (!load_backlog.empty() &&
+           pending_loads < stage_controller.load_limit()) {
+      i64 item_bytes = std::get<4>(load_backlog.front());
+      bool over_budget = decode_budget > 0 && admitted_bytes > 0 &&
+                         admitted_bytes + item_bytes > decode_budget;
+      bool over_limit =
+          (memory_over_soft_limit() || over_budget) && !pipeline_drained();
+      if (over_limit != memory_throttled) {
+        if (over_limit) {
+          memory_throttle_start = now();
+        } else {
+          controller_profiler.add_interval("memory_throttle",
+                                           memory_throttle_start, now());
+        }
+        memory_throttled = over_limit;
+      }
+      if (over_limit) {
+        break;
+      }
+      auto& load = load_backlog.front();
+      admit_item(std::get<3>(load).io_item_index(), item_bytes);
+      submit_load(std::get<0>(load), std::get<1>(load), std::get<2>(load),
+                  std::get<3>(load));
+      load_backlog.pop_front();
+    }
+    if (readahead_items_limit <= 0 || readahead_running ||
+        cancel_io || !block_cache_enabled()) {
+      return;
+    }
+    i32 num_items = 0;
+    for (auto& load : load_backlog) {
+      if (num_items++ >= readahead_items_limit ||
+          readahead_bytes >= readahead_size_limit) {
+        break;
+      }
+      const LoadWorkEntry& load_work_entry = std::get<3>(load);
+      if (readahead_items.insert(load_work_entry.io_item_index()).second) {
+        submit_readahead(load_work_entry,
+                         readahead_size_limit - readahead_bytes);
+        break;
+      }
+    }
+  };
 
   // Setup evaluate workers
   std::vector<std::vector<Profiler>> eval_profilers(
@@ -967,11 +1942,108 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       pipeline_instances_per_node);
   std::vector<std::vector<EvaluateWorkerArgs>> eval_args(
       pipeline_instances_per_node);
+  // Kernels declared shared have one instance per device for the job
+  SharedKernels shared_kernels;
   std::vector<std::tuple<EvalQueue*, EvalQueue*>> post_eval_queues;
   std::vector<PostEvaluateWorkerArgs> post_eval_args;
 
+  // GPUs of each GPU kernel group of each pipeline instance. Groups take
+  // the GPUs in turn, unless their kernels declare the device memory they
+  // need. Then the groups needing the most are placed first, each on the
+  // GPUs with the most room left, so that the large networks of a pipeline
+  // end up on different GPUs, and each kernel gets a budget of the memory
+  // its placed instances declared.
+  std::vector<std::vector<std::vector<i32>>> kg_gpus(
+      pipeline_instances_per_node,
+      std::vector<std::vector<i32>>(num_kernel_groups));
+  std::map<std::string, i64> kernel_gpu_budgets;
+  {
+    struct GroupPlacement {
+      i32 ki;
+      i32 kg;
+      i32 num_devices;
+      i64 bytes;
+    };
+    std::vector<GroupPlacement> placements;
+    bool declared = false;
+    for (i32 ki = 0; ki < pipeline_instances_per_node; ++ki) {
+      bool cpu_instance = ki >= first_cpu_instance;
+      for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
+        auto& group = cpu_instance ? cpu_kernel_groups[kg] : kernel_groups[kg];
+        KernelFactory* factory = std::get<0>(group[0]);
+        if (factory->get_device_type() != DeviceType::GPU) {
+          continue;
+        }
+        i32 num_devices = factory->get_max_devices();
+        if (num_devices == Kernel::UnlimitedDevices) {
+          num_devices = num_gpus;
+        }
+        i64 bytes = 0;
+        for (auto& kernel : group) {
+          bytes += std::get<0>(kernel)->device_memory();
+        }
+        declared |= bytes > 0;
+        placements.push_back({ki, kg, num_devices, bytes});
+      }
+    }
+
+    if (!declared) {
+      i32 next_gpu_idx = 0;
+      for (auto& p : placements) {
+        for (i32 i = 0; i < p.num_devices; ++i) {
+          kg_gpus[p.ki][p.kg].push_back(gpu_ids[next_gpu_idx++ % num_gpus]);
+        }
+      }
+    } else {
+      std::map<i32, i64> room;
+      for (i32 id : gpu_ids) {
+        room[id] = device_memory_capacity({DeviceType::GPU, id});
+      }
+      // Shared kernels have one instance per device
+      std::set<std::tuple<std::string, i32>> placed_shared;
+      std::stable_sort(placements.begin(), placements.end(),
+                       [](const GroupPlacement& a, const GroupPlacement& b) {
+                         return a.bytes > b.bytes;
+                       });
+      for (auto& p : placements) {
+        std::vector<i32> order = gpu_ids;
+        std::stable_sort(order.begin(), order.end(), [&](i32 a, i32 b) {
+          return room[a] > room[b];
+        });
+        bool cpu_instance = p.ki >= first_cpu_instance;
+        auto& group =
+            cpu_instance ? cpu_kernel_groups[p.kg] : kernel_groups[p.kg];
+        for (i32 i = 0; i < p.num_devices; ++i) {
+          i32 device_id = order[i % order.size()];
+          kg_gpus[p.ki][p.kg].push_back(device_id);
+          for (auto& kernel : group) {
+            KernelFactory* factory = std::get<0>(kernel);
+            if (factory->shared() &&
+                !placed_shared
+                     .insert(std::make_tuple(factory->get_op_name(),
+                                             device_id))
+                     .second) {
+              continue;
+            }
+            room[device_id] -= factory->device_memory();
+            kernel_gpu_budgets[factory->get_op_name()] +=
+                factory->device_memory();
+          }
+          LOG_IF(WARNING, room[device_id] < 0)
+              << "Kernels placed on GPU " << device_id << " need "
+              << -room[device_id] << " bytes more than it has";
+        }
+      }
+      for (auto& kv : kernel_gpu_budgets) {
+        if (kv.second > 0) {
+          set_memory_tag_budget(memory_tag_id("kernel:" + kv.first),
+                                DeviceType::GPU, kv.second);
+        }
+      }
+    }
+  }
+
   i32 next_cpu_num = 0;
-  i32 next_gpu_idx = 0;
   for (i32 ki = 0; ki < pipeline_instances_per_node; ++ki) {
     auto& work_queues = eval_work[ki];
     std::vector<Profiler>& eval_thread_profilers = eval_profilers[ki];
@@ -987,14 +2059,17 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
     // Evaluate worker
     DeviceHandle first_kernel_type;
+    bool cpu_instance = ki >= first_cpu_instance;
     for (i32 kg = 0; kg < num_kernel_groups; ++kg) {
-      auto& group = kernel_groups[kg];
+      auto& group = cpu_instance ? cpu_kernel_groups[kg] : kernel_groups[kg];
       auto& lc = kg_live_columns[kg];
       auto& dc = kg_dead_columns[kg];
       auto& uo = kg_unused_outputs[kg];
       auto& cm = kg_column_mapping[kg];
       auto& st = kg_stencils[kg];
-      auto& bt = kg_batch_sizes[kg];
+      auto& bt = cpu_instance ? cpu_kg_batch_sizes[kg] : kg_batch_sizes[kg];
+      auto& fn = kg_fuse_with_next[kg];
+      auto& cd = kg_consumer_devices[kg];
       std::vector<EvaluateWorkerArgs>& thread_args = eval_args[ki];
       std::vector<std::tuple<EvalQueue*, EvalQueue*>>& thread_qs =
           eval_queues[ki];
@@ -1003,22 +2078,28 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
       // for (size_t i = 0; i < group.size(); ++i) {
       KernelFactory* factory = std::get<0>(group[0]);
       DeviceType device_type = factory->get_device_type();
+      // Kernels with unlimited devices get every GPU of the node, which is
+      // why they run a single pipeline instance
+      i32 num_devices = factory->get_max_devices();
+      if (num_devices == Kernel::UnlimitedDevices) {
+        num_devices = device_type == DeviceType::CPU ? 1 : num_gpus;
+      }
+      for (size_t i = 0; i < group.size(); ++i) {
+        std::get<1>(group[i]).devices.clear();
+      }
       if (device_type == DeviceType::CPU) {
-        for (i32 i = 0; i < factory->get_max_devices(); ++i) {
+        for (i32 i = 0; i < num_devices; ++i) {
           i32 device_id = 0;
           next_cpu_num++ % num_cpus;
           for (size_t i = 0; i < group.size(); ++i) {
             KernelConfig& config = std::get<1>(group[i]);
-            config.devices.clear();
             config.devices.push_back({device_type, device_id});
           }
         }
       } else {
-        for (i32 i = 0; i < factory->get_max_devices(); ++i) {
-          i32 device_id = gpu_ids[next_gpu_idx++ % num_gpus];
+        for (i32 device_id : kg_gpus[ki][kg]) {
           for (size_t i = 0; i < group.size(); ++i) {
             KernelConfig& config = std::get<1>(group[i]);
-            config.devices.clear();
             config.devices.push_back({device_type, device_id});
           }
         }
@@ -1037,11 +2118,12 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
           std::make_tuple(input_work_queue, output_work_queue));
       thread_args.emplace_back(EvaluateWorkerArgs{
           // Uniform arguments
-          node_id_,
+          node_id_, job_params->batch_latency_ms(), kernel_pool_.get(),
+          &shared_kernels,
 
           // Per worker arguments
-          ki, kg, group, lc, dc, uo, cm, st, bt, eval_thread_profilers[kg + 1],
-          results[kg]});
+          ki, kg, group, lc, dc, uo, cm, st, bt, fn, cd,
+          eval_thread_profilers[kg + 1], results[kg]});
     }
     // Pre evaluate worker
     {
@@ -1061,7 +2143,12 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
         : first_kernel_type;
       pre_eval_args.emplace_back(PreEvaluateWorkerArgs{
           // Uniform arguments
-          node_id_, num_cpus,
+          node_id_, num_cpus, nv12_frames, job_params->decode_width(),
+          job_params->decode_height(), job_params->decode_parallelism(),
+          decoder_threads, job_params->codec_slice_threads(),
+          job_params->gpu_decode_surfaces(),
+          job_params->balance_gpu_decode() ? gpu_ids : std::vector<i32>(),
+          stencil_overlap_rows, motion_vector_columns,
 
           // Per worker arguments
           ki, decoder_type, eval_thread_profilers.front(),
@@ -1085,7 +2172,8 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
           std::make_tuple(input_work_queue, output_work_queue));
       post_eval_args.emplace_back(PostEvaluateWorkerArgs{
           // Uniform arguments
-          node_id_,
+          node_id_, encoder_threads, job_params->codec_slice_threads(),
+          job_params->encode_parallelism(),
 
           // Per worker arguments
           ki, eval_thread_profilers.back(), column_mapping.back(),
@@ -1094,6 +2182,29 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     }
   }
 
+  // Place each pipeline instance on the NUMA node closest to the device of
+  // its first kernel so that its threads and their CPU allocations stay
+  // local to that device. CPU only pipelines are spread over the nodes.
+  i32 num_numa = num_numa_nodes();
+  std::vector<i32> instance_numa_nodes(pipeline_instances_per_node, -1);
+  if (num_numa > 1) {
+    for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+      i32 node = -1;
+      for (auto& args : eval_args[pu]) {
+        DeviceHandle device = std::get<1>(args.kernel_factories[0]).devices[0];
+        node = numa_node_for_device(device);
+        if (node >= 0) {
+          break;
+        }
+      }
+      if (node < 0) {
+        node = pu % num_numa;
+      }
+      instance_numa_nodes[pu] = node;
+      VLOG(1) << "Pipeline instance " << pu << " on NUMA node " << node;
+    }
+  }
+
   // Launch eval worker threads
   std::vector<std::thread> pre_eval_threads;
   std::vector<std::vector<std::thread>> eval_threads;
@@ -1115,28 +2226,14 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     post_eval_threads.emplace_back(
         post_evaluate_driver, std::ref(*std::get<0>(post_eval_queues[pu])),
         std::ref(*std::get<1>(post_eval_queues[pu])), post_eval_args[pu]);
-  }
-
-  // Setup save workers
-  i32 num_save_workers = db_params_.num_save_workers;
-  std::vector<Profiler> save_thread_profilers(num_save_workers,
-                                              Profiler(base_time));
-  std::vector<SaveThreadArgs> save_thread_args;
-  for (i32 i = 0; i < num_save_workers; ++i) {
-    // Create IO thread for reading and decoding data
-    save_thread_args.emplace_back(SaveThreadArgs{
-        // Uniform arguments
-        node_id_, job_params->job_name(),
-
-        // Per worker arguments
-        i, db_params_.storage_config, save_thread_profilers[i],
-
-        // Queues
-        save_work, retired_items});
-  }
-  std::vector<pthread_t> save_threads(num_save_workers);
-  for (i32 i = 0; i < num_save_workers; ++i) {
-    pthread_create(&save_threads[i], NULL, save_thread, &save_thread_args[i]);
+    i32 node = instance_numa_nodes[pu];
+    if (node >= 0) {
+      pin_thread_to_numa_node(pre_eval_threads.back(), node);
+      for (auto& thread : threads) {
+        pin_thread_to_numa_node(thread, node);
+      }
+      pin_thread_to_numa_node(post_eval_threads.back(), node);
+    }
   }
 
   if (job_params->profiling()) {
@@ -1148,27 +2245,138 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   // Round robin work
   i32 last_work_queue = 0;
+  // Keep up to tasks_in_queue_per_pu NextWork requests in flight so that the
+  // load queue does not run dry while waiting on a master round-trip
+  const i32 max_local_work =
+      pipeline_instances_per_node * job_params->tasks_in_queue_per_pu();
+  const i32 max_outstanding_leases =
+      std::max(job_params->tasks_in_queue_per_pu(), 1);
+  grpc::CompletionQueue lease_cq;
+  std::map<i64, std::unique_ptr<PendingLease>> pending_leases;
+  i64 next_lease_tag = 0;
+  i32 requested_items = 0;
+  bool work_exhausted = false;
+  // When the master has no work to give out yet, wait before asking again
+  timepoint_t next_lease_time = now();
+  auto cancel_items = [&](
+      const google::protobuf::RepeatedPtrField<proto::IOItem>& items) {
+    std::unique_lock<std::mutex> lk(cancelled_items.mutex);
+    for (auto& item : items) {
+      cancelled_items.items.insert(
+          std::make_tuple(item.table_id(), item.item_id()));
+    }
+  };
+  timepoint_t next_control_time = now();
   while (true) {
+    if (now() >= next_control_time) {
+      i32 eval_backlog = 0;
+      i32 eval_capacity = 0;
+      for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
+        eval_backlog += std::max(initial_eval_work[pu].size(), 0);
+        eval_capacity += initial_eval_work[pu].capacity();
+        for (auto& q : eval_work[pu]) {
+          eval_backlog += std::max(q.size(), 0);
+          eval_capacity += q.capacity();
+        }
+      }
+      i64 load_depth = load_backlog.size() + pending_loads;
+      i64 save_depth = std::max(save_work.size(), 0) + pending_saves;
+      stage_controller.update(load_depth, eval_backlog, eval_capacity,
+                              save_depth);
+      set_metric_gauge(queue_gauges.load, load_depth);
+      set_metric_gauge(queue_gauges.eval, eval_backlog);
+      set_metric_gauge(queue_gauges.save, save_depth);
+      next_control_time =
+          now() + std::chrono::milliseconds(STAGE_CONTROL_INTERVAL_MS);
+    }
+    dispatch_loads();
+    drain_save_work(false);
+
+    // Report items written by the save workers
+    {
+      proto::FinishedWorkParameters finished_params;
+      IOItem item;
+      while (finished_items.try_pop(item)) {
+        finished_params.add_io_items()->CopyFrom(item);
+      }
+      // Popped after the items, so that the output of every reported item
+      // is sent along with it or before it
+      proto::StreamedItem output;
+      while (streamed_items.try_pop(output)) {
+        finished_params.add_outputs()->Swap(&output);
+      }
+      if (finished_params.io_items_size() > 0 ||
+          finished_params.outputs_size() > 0) {
+        grpc::ClientContext context;
+        proto::FinishedWorkReply finished_reply;
+        finished_params.set_node_id(node_id_);
+        finished_params.set_job_id(job_params->job_id());
+        grpc::Status status =
+            master_->FinishedWork(&context, finished_params, &finished_reply);
+        if (!status.ok()) {
+          RESULT_ERROR(job_result,
+                       "Worker %d could not report finished work to master",
+                       node_id_);
+          break;
+        }
+        cancel_items(finished_reply.cancelled_items());
+      }
+    }
+
     i32 local_work = accepted_items - retired_items;
-    if (local_work < pipeline_instances_per_node * job_params->tasks_in_queue_per_pu()) {
-      grpc::ClientContext context;
-      proto::NodeInfo node_info;
-      proto::NewWork new_work;
+    while (!work_exhausted && now() >= next_lease_time &&
+           (i32)pending_leases.size() < max_outstanding_leases &&
+           local_work + requested_items < max_local_work) {
+      i32 num_items = std::min(pipeline_instances_per_node,
+                               max_local_work - local_work - requested_items);
+      PendingLease* pending = new PendingLease;
+      pending->num_items = num_items;
 
+      proto::NodeInfo node_info;
       node_info.set_node_id(node_id_);
-      grpc::Status status = master_->NextWork(&context, node_info, &new_work);
-      if (!status.ok()) {
+      node_info.set_num_items(num_items);
+      node_info.set_job_id(job_params->job_id());
+      pending->rpc =
+          master_->AsyncNextWork(&pending->context, node_info, &lease_cq);
+      pending->rpc->Finish(&pending->lease, &pending->status,
+                           (void*)next_lease_tag);
+      pending_leases[next_lease_tag++].reset(pending);
+      requested_items += num_items;
+    }
+
+    if (work_exhausted && pending_leases.empty()) {
+      // No more work left
+      VLOG(1) << "Node " << node_id_ << " received done signal.";
+      break;
+    }
+
+    void* got_tag;
+    bool ok = false;
+    grpc::CompletionQueue::NextStatus lease_status = lease_cq.AsyncNext(
+        &got_tag, &ok, std::chrono::system_clock::now());
+    if (lease_status == grpc::CompletionQueue::GOT_EVENT) {
+      auto it = pending_leases.find((i64)got_tag);
+      assert(it != pending_leases.end());
+      std::unique_ptr<PendingLease> pending = std::move(it->second);
+      pending_leases.erase(it);
+      requested_items -= pending->num_items;
+
+      if (!ok || !pending->status.ok()) {
         RESULT_ERROR(job_result,
                      "Worker %d could not get next work from master", node_id_);
         break;
       }
-
-      i32 next_item = new_work.io_item().item_id();
-      if (next_item == -1) {
-        // No more work left
-        VLOG(1) << "Node " << node_id_ << " received done signal.";
-        break;
-      } else {
+      cancel_items(pending->lease.cancelled_items());
+      if (pending->lease.work_size() == 0) {
+        if (pending->lease.retry()) {
+          // Items are still in flight elsewhere and may need to be re-run
+          next_lease_time = now() + std::chrono::milliseconds(100);
+        } else {
+          // Master is out of work, drain the remaining requests
+          work_exhausted = true;
+        }
+      }
+      for (const proto::NewWork& new_work : pending->lease.work()) {
         // Perform analysis on load work entry to determine upstream
         // requirements and when to discard elements.
         std::deque<TaskStream> task_stream;
@@ -1179,8 +2387,12 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
                                     stenciled_entry, task_stream);
 
         i32 target_work_queue = distribute_work_evenly ? last_work_queue++ : 0;
-        load_work.push(std::make_tuple(target_work_queue, task_stream,
-                                       new_work.io_item(), stenciled_entry));
+        i64 decoded_bytes = LoadWorker::decoded_bytes(
+            storage_, stenciled_entry, job_params->decode_width(),
+            job_params->decode_height(), nv12_frames);
+        load_backlog.emplace_back(target_work_queue, task_stream,
+                                  new_work.io_item(), stenciled_entry,
+                                  decoded_bytes);
         last_work_queue %= pipeline_instances_per_node;
         accepted_items++;
       }
@@ -1206,11 +2418,26 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     std::this_thread::yield();
   }
 
+  // Cancel and drain any NextWork requests still in flight so the completion
+  // queue can be torn down safely
+  for (auto& kv : pending_leases) {
+    kv.second->context.TryCancel();
+  }
+  lease_cq.Shutdown();
+  {
+    void* got_tag;
+    bool ok = false;
+    while (lease_cq.Next(&got_tag, &ok)) {
+      pending_leases.erase((i64)got_tag);
+    }
+  }
+
   // If the job failed, can't expect queues to have drained, so
   // attempt to flush all all queues here (otherwise we could block
   // on pushing into a queue)
   if (!job_result->success()) {
-    load_work.clear();
+    cancel_io = true;
+    load_backlog.clear();
     for (i32 pu = 0; pu < pipeline_instances_per_node; ++pu) {
       initial_eval_work[pu].clear();
     }
@@ -1231,19 +2458,29 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     q.push(std::make_tuple(std::deque<TaskStream>(), IOItem{}, entry));
   };
 
-  // Push sentinel work entries into queue to terminate load threads
-  for (i32 i = 0; i < num_load_workers; ++i) {
-    LoadWorkEntry entry;
-    entry.set_io_item_index(-1);
-    load_work.push(
-        std::make_tuple(0, std::deque<TaskStream>(), IOItem{}, entry));
+  // Wait for outstanding loads, writing out any pipeline output in the
+  // meantime so that the pipeline does not stall on a full save queue
+  while (!load_backlog.empty() || pending_loads > 0) {
+    dispatch_loads();
+    drain_save_work(false);
+    std::this_thread::yield();
   }
-
-  for (i32 i = 0; i < num_load_workers; ++i) {
-    // Wait until all load threads have finished
-    load_threads[i].join();
+  stage_controller.finish(now());
+  if (memory_throttled) {
+    controller_profiler.add_interval("memory_throttle", memory_throttle_start,
+                                     now());
   }
 
+  // Keep writing out pipeline output while the eval threads shut down, since
+  // post eval blocks once the save queue is full
+  std::atomic<bool> pipeline_joined{false};
+  std::thread save_drainer([&]() {
+    while (!pipeline_joined) {
+      drain_save_work(true);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+
   // Push sentinel work entries into queue to terminate eval threads
   for (i32 i = 0; i < pipeline_instances_per_node; ++i) {
     if (distribute_work_evenly) {
@@ -1277,16 +2514,22 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
     post_eval_threads[pu].join();
   }
 
-  // Push sentinel work entries into queue to terminate save threads
-  for (i32 i = 0; i < num_save_workers; ++i) {
-    push_exit_message(save_work);
+  for (auto& kv : kernel_gpu_budgets) {
+    set_memory_tag_budget(memory_tag_id("kernel:" + kv.first),
+                          DeviceType::GPU, 0);
   }
-  for (i32 i = 0; i < num_save_workers; ++i) {
-    // Wait until eval has finished
-    void* result;
-    i32 err = pthread_join(save_threads[i], &result);
-    LOG_IF(FATAL, err != 0) << "error in pthread_join of save thread";
-    free(result);
+
+  pipeline_joined = true;
+  save_drainer.join();
+
+  // Write out the remaining output. The IO pool is shared with other jobs,
+  // so only this job's tasks are waited for.
+  drain_save_work(true);
+  while (pending_loads > 0 || pending_saves > 0 || readahead_running) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (upload_queue) {
+    upload_queue->wait_idle();
   }
 
   // Ensure all files are flushed
@@ -1303,11 +2546,10 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   timepoint_t end_time = now();
 
   // Execution done, write out profiler intervals for each worker
-  // TODO: job_name -> job_id?
-  i32 job_id = meta.get_job_id(job_params->job_name());
+  i32 job_id = job_params->job_id();
   std::string profiler_file_name = job_profiler_path(job_id, node_id_);
   std::unique_ptr<WriteFile> profiler_output;
-  BACKOFF_FAIL(
+  STORE_CHECK(
       make_unique_write_file(storage_, profiler_file_name, profiler_output));
 
   i64 base_time_ns =
@@ -1327,9 +2569,9 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
 
   i64 out_rank = node_id_;
   // Load worker profilers
-  u8 load_worker_count = num_load_workers;
+  u8 load_worker_count = num_io_threads;
   s_write(profiler_output.get(), load_worker_count);
-  for (i32 i = 0; i < num_load_workers; ++i) {
+  for (i32 i = 0; i < num_io_threads; ++i) {
     write_profiler_to_file(profiler_output.get(), out_rank, "load", "", i,
                            load_thread_profilers[i]);
   }
@@ -1359,14 +2601,45 @@ grpc::Status WorkerImpl::NewJob(grpc::ServerContext* context,
   }
 
   // Save worker profilers
-  u8 save_worker_count = num_save_workers;
+  u8 save_worker_count = num_io_threads;
   s_write(profiler_output.get(), save_worker_count);
-  for (i32 i = 0; i < num_save_workers; ++i) {
+  for (i32 i = 0; i < num_io_threads; ++i) {
     write_profiler_to_file(profiler_output.get(), out_rank, "save", "", i,
                            save_thread_profilers[i]);
   }
 
-  BACKOFF_FAIL(profiler_output->save());
+  // Memory held by each stage and op, as <device>_live:<tag> and
+  // <device>_peak:<tag> counters
+  Profiler memory_profiler(base_time);
+  for (const MemoryUsage& usage : memory_usage()) {
+    if (usage.peak_bytes == 0) {
+      continue;
+    }
+    std::string device = usage.device_type == DeviceType::GPU ? "gpu" : "cpu";
+    memory_profiler.increment(device + "_live:" + usage.tag, usage.live_bytes);
+    memory_profiler.increment(device + "_peak:" + usage.tag,
+                              usage.peak_bytes);
+  }
+  memory_profiler.increment("cpu_pool_page_size", cpu_pool_page_size());
+
+  controller_profiler.increment(
+      "storage_throttled",
+      storage_limiter().throttle_events() - throttle_events_start);
+  controller_profiler.increment(
+      "storage_throttle_wait_us",
+      storage_limiter().throttle_wait_us() - throttle_wait_start);
+  controller_profiler.increment("storage_request_limit",
+                                storage_limiter().limit());
+
+  // Stage controller and memory profilers
+  u8 controller_count = 2;
+  s_write(profiler_output.get(), controller_count);
+  write_profiler_to_file(profiler_output.get(), out_rank, "control", "", 0,
+                         controller_profiler);
+  write_profiler_to_file(profiler_output.get(), out_rank, "memory", "", 0,
+                         memory_profiler);
+
+  STORE_CHECK(profiler_output->save());
 
   VLOG(1) << "Worker " << node_id_ << " finished NewJob";
 
@@ -1383,6 +2656,34 @@ grpc::Status WorkerImpl::LoadOp(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status WorkerImpl::IngestVideos(grpc::ServerContext* context,
+                                      const proto::IngestWork* work,
+                                      proto::IngestWorkResult* result) {
+  set_database_path(db_params_.db_path);
+  std::vector<u8> failed;
+  std::vector<std::string> failed_messages;
+  std::vector<Profiler> profilers;
+  ingest_video_tables(
+      storage_, std::vector<std::string>(work->table_names().begin(),
+                                         work->table_names().end()),
+      std::vector<i32>(work->table_ids().begin(), work->table_ids().end()),
+      std::vector<u8>(work->appended().begin(), work->appended().end()),
+      std::vector<std::string>(work->video_paths().begin(),
+                               work->video_paths().end()),
+      work->num_threads(), work->segment_size(), work->in_place(),
+      work->transcode(), failed, failed_messages, *result->mutable_manifest(),
+      profilers);
+  result->set_profile(serialize_ingest_profilers(node_id_, "", profilers));
+  for (size_t i = 0; i < failed.size(); ++i) {
+    if (failed[i]) {
+      result->add_failed_videos(i);
+      result->add_failed_messages(failed_messages[i]);
+    }
+  }
+  result->mutable_result()->set_success(true);
+  return grpc::Status::OK;
+}
+
 grpc::Status WorkerImpl::Shutdown(grpc::ServerContext* context,
                                   const proto::Empty* empty, Result* result) {
   trigger_shutdown_.set();
@@ -1390,6 +2691,37 @@ grpc::Status WorkerImpl::Shutdown(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status WorkerImpl::Drain(grpc::ServerContext* context,
+                               const proto::Empty* empty, Result* result) {
+  result->CopyFrom(drain());
+  return grpc::Status::OK;
+}
+
+Result WorkerImpl::drain() {
+  Result result;
+  grpc::ClientContext context;
+  proto::NodeInfo node_info;
+  node_info.set_node_id(node_id_);
+  proto::Empty empty;
+  grpc::Status status =
+      master_->UnregisterWorker(&context, node_info, &empty);
+  if (!status.ok()) {
+    RESULT_ERROR(&result, "Worker %d could not unregister from the master",
+                 node_id_);
+    return result;
+  }
+  VLOG(1) << "Node " << node_id_ << " draining " << active_jobs_
+          << " running jobs";
+  // Running jobs get an empty lease from the master now, so they retire the
+  // items they hold and return
+  while (active_jobs_ > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  trigger_shutdown_.set();
+  result.set_success(true);
+  return result;
+}
+
 grpc::Status WorkerImpl::PokeWatchdog(grpc::ServerContext* context,
                                       const proto::Empty* empty,
                                       proto::Empty* result) {
@@ -1397,6 +2729,27 @@ grpc::Status WorkerImpl::PokeWatchdog(grpc::ServerContext* context,
   return grpc::Status::OK;
 }
 
+grpc::Status WorkerImpl::GetMetrics(grpc::ServerContext* context,
+                                    const proto::Empty* empty,
+                                    proto::NodeMetrics* metrics) {
+  metrics->set_node_id(node_id_);
+  MetricValues values = metric_values();
+  metrics->mutable_counters()->insert(values.counters.begin(),
+                                      values.counters.end());
+  metrics->mutable_gauges()->insert(values.gauges.begin(),
+                                    values.gauges.end());
+  auto& gauges = *metrics->mutable_gauges();
+  for (const MemoryUsage& usage : memory_usage()) {
+    std::string labels =
+        std::string("{device=\"") +
+        (usage.device_type == DeviceType::CPU ? "cpu" : "gpu") +
+        "\",tag=\"" + usage.tag + "\"}";
+    gauges["scanner_memory_live_bytes" + labels] = usage.live_bytes;
+    gauges["scanner_memory_peak_bytes" + labels] = usage.peak_bytes;
+  }
+  return grpc::Status::OK;
+}
+
 void WorkerImpl::start_watchdog(grpc::Server* server, i32 timeout_ms) {
   watchdog_thread_ = std::thread([this, server, timeout_ms]() {
     double time_since_check = 0;
@@ -1405,6 +2758,7 @@ void WorkerImpl::start_watchdog(grpc::Server* server, i32 timeout_ms) {
       auto sleep_start = now();
       trigger_shutdown_.wait_for(timeout_ms);
       time_since_check += nano_since(sleep_start) / 1e6;
+      kernel_cache().evict_idle();
       if (time_since_check > timeout_ms) {
         if (!watchdog_awake_) {
           // Watchdog not woken, time to bail out
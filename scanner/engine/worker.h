@@ -18,10 +18,12 @@
 #include "scanner/engine/metadata.h"
 #include "scanner/engine/rpc.grpc.pb.h"
 #include "scanner/engine/runtime.h"
+#include "scanner/util/thread_pool.h"
 
 #include <grpc/grpc_posix.h>
 #include <grpc/support/log.h>
 #include <atomic>
+#include <mutex>
 #include <thread>
 
 namespace scanner {
@@ -41,12 +43,28 @@ class WorkerImpl final : public proto::Worker::Service {
   grpc::Status LoadOp(grpc::ServerContext* context,
                       const proto::OpPath* op_path, proto::Empty* empty);
 
+  grpc::Status IngestVideos(grpc::ServerContext* context,
+                            const proto::IngestWork* work,
+                            proto::IngestWorkResult* result);
+
   grpc::Status Shutdown(grpc::ServerContext* context, const proto::Empty* empty,
                         Result* result);
 
+  grpc::Status Drain(grpc::ServerContext* context, const proto::Empty* empty,
+                     Result* result);
+
+  // Leaves the cluster gracefully: the master hands this worker no more
+  // items, and the worker shuts down once its running jobs have finished
+  // the items they hold. Blocks until then.
+  Result drain();
+
   grpc::Status PokeWatchdog(grpc::ServerContext* context,
                             const proto::Empty* empty, proto::Empty* result);
 
+  grpc::Status GetMetrics(grpc::ServerContext* context,
+                          const proto::Empty* empty,
+                          proto::NodeMetrics* metrics);
+
   void start_watchdog(grpc::Server* server, i32 timeout_ms = 50000);
 
  private:
@@ -59,8 +77,19 @@ class WorkerImpl final : public proto::Worker::Service {
   i32 node_id_;
   storehouse::StorageBackend* storage_;
   std::map<std::string, TableMetadata*> table_metas_;
+  // Table and video descriptors sent by the master, kept across jobs
+  Manifest known_metadata_;
+  // Guards the state above and the memory pool while a job sets up, since
+  // jobs may run at the same time
+  std::mutex job_setup_mutex_;
+  std::atomic<i32> active_jobs_{0};
   bool memory_pool_initialized_ = false;
   MemoryPoolConfig cached_memory_pool_config_;
+  // Shared by the load and save stages of every job
+  std::unique_ptr<WorkStealingPool> io_pool_;
+  // Executes the rows of batches of parallel kernels for every pipeline
+  // instance
+  std::unique_ptr<WorkStealingPool> kernel_pool_;
 };
 }
 }
@@ -0,0 +1,127 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <vector>
+
+namespace scanner {
+
+// Containers such as MP4 and MKV store H.264 and HEVC NAL units prefixed by
+// their length instead of separated by Annex B start codes, and keep the
+// parameter sets in the codec extradata (avcC or hvcC) instead of the stream.
+
+const u8 ANNEXB_START_CODE[4] = {0, 0, 0, 1};
+
+inline u32 read_big_endian(const u8* data, i32 bytes) {
+  u32 v = 0;
+  for (i32 i = 0; i < bytes; ++i) {
+    v = (v << 8) | data[i];
+  }
+  return v;
+}
+
+//! Appends the NAL units of a packet with nal_length_size byte lengths to
+//! annexb, each after a four byte start code. A nal_length_size of 0 means
+//! the packet is Annex B already. Returns false if a length runs past the
+//! packet.
+inline bool length_prefixed_to_annexb(const u8* data, size_t size,
+                                      i32 nal_length_size,
+                                      std::vector<u8>& annexb) {
+  if (nal_length_size == 0) {
+    annexb.insert(annexb.end(), data, data + size);
+    return true;
+  }
+  size_t pos = 0;
+  while (pos + nal_length_size <= size) {
+    u32 nal_size = read_big_endian(data + pos, nal_length_size);
+    pos += nal_length_size;
+    if (nal_size > size - pos) {
+      return false;
+    }
+    annexb.insert(annexb.end(), ANNEXB_START_CODE, ANNEXB_START_CODE + 4);
+    annexb.insert(annexb.end(), data + pos, data + pos + nal_size);
+    pos += nal_size;
+  }
+  return pos == size;
+}
+
+// Appends count NAL units each prefixed by a two byte length, starting at
+// data[pos], to annexb
+inline bool append_extradata_nals(const u8* data, size_t size, size_t& pos,
+                                  u32 count, std::vector<u8>& annexb) {
+  for (u32 i = 0; i < count; ++i) {
+    if (pos + 2 > size) {
+      return false;
+    }
+    u32 nal_size = read_big_endian(data + pos, 2);
+    pos += 2;
+    if (nal_size > size - pos) {
+      return false;
+    }
+    annexb.insert(annexb.end(), ANNEXB_START_CODE, ANNEXB_START_CODE + 4);
+    annexb.insert(annexb.end(), data + pos, data + pos + nal_size);
+    pos += nal_size;
+  }
+  return true;
+}
+
+//! Reads the NAL length size and the SPS and PPS, as Annex B, from an avcC
+//! record.
+inline bool parse_avcc_extradata(const u8* data, size_t size,
+                                 i32& nal_length_size,
+                                 std::vector<u8>& parameter_sets) {
+  if (size < 7 || data[0] != 1) {
+    return false;
+  }
+  nal_length_size = (data[4] & 0x3) + 1;
+  u32 num_sps = data[5] & 0x1F;
+  size_t pos = 6;
+  if (!append_extradata_nals(data, size, pos, num_sps, parameter_sets) ||
+      pos >= size) {
+    return false;
+  }
+  u32 num_pps = data[pos];
+  pos++;
+  return append_extradata_nals(data, size, pos, num_pps, parameter_sets);
+}
+
+//! Reads the NAL length size and the VPS, SPS and PPS, as Annex B, from an
+//! hvcC record.
+inline bool parse_hvcc_extradata(const u8* data, size_t size,
+                                 i32& nal_length_size,
+                                 std::vector<u8>& parameter_sets) {
+  if (size < 23 || data[0] != 1) {
+    return false;
+  }
+  nal_length_size = (data[21] & 0x3) + 1;
+  u32 num_arrays = data[22];
+  size_t pos = 23;
+  for (u32 i = 0; i < num_arrays; ++i) {
+    // NAL unit type and number of NAL units in the array
+    if (pos + 3 > size) {
+      return false;
+    }
+    u32 count = read_big_endian(data + pos + 1, 2);
+    pos += 3;
+    if (!append_extradata_nals(data, size, pos, count, parameter_sets)) {
+      return false;
+    }
+  }
+  return true;
+}
+}
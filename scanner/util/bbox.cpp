@@ -1,109 +1,153 @@
 #include "scanner/util/bbox.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
 
-#include <queue>
+#include <algorithm>
+#include <numeric>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace scanner {
+namespace {
 
-std::vector<BoundingBox> best_nms(const std::vector<BoundingBox>& boxes,
-                                  f32 overlap) {
-  std::vector<bool> valid(boxes.size(), true);
-  auto cmp = [](std::pair<f32, i32> left, std::pair<f32, i32> right) {
-    return left.first < right.first;
-  };
-  std::priority_queue<std::pair<f32, i32>, std::vector<std::pair<f32, i32>>,
-                      decltype(cmp)>
-      q(cmp);
-  for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-    q.emplace(boxes[i].score(), i);
+// The coordinates and areas of boxes in separate arrays, so the overlaps of
+// several boxes with one box can be computed at once
+struct BoxArrays {
+  BoxArrays(const std::vector<BoundingBox>& boxes) {
+    size_t n = boxes.size();
+    x1.resize(n);
+    y1.resize(n);
+    x2.resize(n);
+    y2.resize(n);
+    area.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      x1[i] = boxes[i].x1();
+      y1[i] = boxes[i].y1();
+      x2[i] = boxes[i].x2();
+      y2[i] = boxes[i].y2();
+      area[i] = (x2[i] - x1[i] + 1) * (y2[i] - y1[i] + 1);
+    }
   }
-  std::vector<i32> best;
-  while (!q.empty()) {
-    std::pair<f32, i32> entry = q.top();
-    q.pop();
-    i32 c_idx = entry.second;
-    if (!valid[c_idx]) continue;
 
-    best.push_back(c_idx);
+  std::vector<f32> x1;
+  std::vector<f32> y1;
+  std::vector<f32> x2;
+  std::vector<f32> y2;
+  std::vector<f32> area;
+};
 
-    for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-      if (!valid[i]) continue;
+// Indices of boxes from the highest score to the lowest
+std::vector<i32> score_order(const std::vector<BoundingBox>& boxes) {
+  std::vector<i32> order(boxes.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](i32 left, i32 right) {
+    return boxes[left].score() > boxes[right].score();
+  });
+  return order;
+}
 
-      f32 x1 = std::max(boxes[c_idx].x1(), boxes[i].x1());
-      f32 y1 = std::max(boxes[c_idx].y1(), boxes[i].y1());
-      f32 x2 = std::min(boxes[c_idx].x2(), boxes[i].x2());
-      f32 y2 = std::min(boxes[c_idx].y2(), boxes[i].y2());
+// Clears valid for the valid boxes that box c covers at least overlap of,
+// and appends them to suppressed in increasing order
+void suppress(const BoxArrays& b, i32 c, f32 overlap, std::vector<u8>& valid,
+              std::vector<i32>& suppressed) {
+  i32 n = (i32)valid.size();
+  i32 i = 0;
+#if defined(__SSE2__)
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 threshold = _mm_set1_ps(overlap);
+  const __m128 cx1 = _mm_set1_ps(b.x1[c]);
+  const __m128 cy1 = _mm_set1_ps(b.y1[c]);
+  const __m128 cx2 = _mm_set1_ps(b.x2[c]);
+  const __m128 cy2 = _mm_set1_ps(b.y2[c]);
+  for (; i + 4 <= n; i += 4) {
+    i32 live = valid[i] | (valid[i + 1] << 1) | (valid[i + 2] << 2) |
+               (valid[i + 3] << 3);
+    if (live == 0) {
+      continue;
+    }
+    __m128 x1 = _mm_max_ps(_mm_loadu_ps(&b.x1[i]), cx1);
+    __m128 y1 = _mm_max_ps(_mm_loadu_ps(&b.y1[i]), cy1);
+    __m128 x2 = _mm_min_ps(_mm_loadu_ps(&b.x2[i]), cx2);
+    __m128 y2 = _mm_min_ps(_mm_loadu_ps(&b.y2[i]), cy2);
+    __m128 o_w = _mm_max_ps(_mm_add_ps(_mm_sub_ps(x2, x1), one), zero);
+    __m128 o_h = _mm_max_ps(_mm_add_ps(_mm_sub_ps(y2, y1), one), zero);
+    __m128 box_overlap =
+        _mm_div_ps(_mm_mul_ps(o_w, o_h), _mm_loadu_ps(&b.area[i]));
+    i32 below = _mm_movemask_ps(_mm_cmplt_ps(box_overlap, threshold));
+    i32 hit = live & ~below;
+    for (i32 k = 0; hit != 0; ++k, hit >>= 1) {
+      if (hit & 1) {
+        valid[i + k] = 0;
+        suppressed.push_back(i + k);
+      }
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    if (!valid[i]) continue;
 
-      f32 o_w = std::max(0.0f, x2 - x1 + 1);
-      f32 o_h = std::max(0.0f, y2 - y1 + 1);
+    f32 x1 = std::max(b.x1[c], b.x1[i]);
+    f32 y1 = std::max(b.y1[c], b.y1[i]);
+    f32 x2 = std::min(b.x2[c], b.x2[i]);
+    f32 y2 = std::min(b.y2[c], b.y2[i]);
 
-      f32 box_overlap = o_w * o_h / ((boxes[i].x2() - boxes[i].x1() + 1) *
-                                     (boxes[i].y2() - boxes[i].y1() + 1));
+    f32 o_w = std::max(0.0f, x2 - x1 + 1);
+    f32 o_h = std::max(0.0f, y2 - y1 + 1);
 
-      valid[i] = box_overlap < overlap;
+    f32 box_overlap = o_w * o_h / b.area[i];
+    if (!(box_overlap < overlap)) {
+      valid[i] = 0;
+      suppressed.push_back(i);
     }
   }
+}
+}
 
+std::vector<BoundingBox> best_nms(const std::vector<BoundingBox>& boxes,
+                                  f32 overlap) {
+  BoxArrays arrays(boxes);
+  std::vector<u8> valid(boxes.size(), 1);
+  std::vector<i32> suppressed;
   std::vector<BoundingBox> out_boxes;
-  for (i32 i : best) {
-    out_boxes.push_back(boxes[i]);
+  for (i32 c_idx : score_order(boxes)) {
+    if (!valid[c_idx]) continue;
+
+    out_boxes.push_back(boxes[c_idx]);
+    suppressed.clear();
+    suppress(arrays, c_idx, overlap, valid, suppressed);
   }
   return out_boxes;
 }
 
 std::vector<BoundingBox> average_nms(const std::vector<BoundingBox>& boxes,
                                      f32 overlap) {
+  BoxArrays arrays(boxes);
+  std::vector<u8> valid(boxes.size(), 1);
+  std::vector<i32> suppressed;
   std::vector<BoundingBox> best_boxes;
-  std::vector<bool> valid(boxes.size(), true);
-  auto cmp = [](std::pair<f32, i32> left, std::pair<f32, i32> right) {
-    return left.first < right.first;
-  };
-  std::priority_queue<std::pair<f32, i32>, std::vector<std::pair<f32, i32>>,
-                      decltype(cmp)>
-      q(cmp);
-  for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-    q.emplace(boxes[i].score(), i);
-  }
-  std::vector<i32> best;
-  while (!q.empty()) {
-    std::pair<f32, i32> entry = q.top();
-    q.pop();
-    i32 c_idx = entry.second;
+  for (i32 c_idx : score_order(boxes)) {
     if (!valid[c_idx]) continue;
 
-    best.push_back(c_idx);
-
     const BoundingBox& current_box = boxes[c_idx];
     f64 total_weight = current_box.score();
     f64 best_x1 = current_box.x1() * current_box.score();
     f64 best_y1 = current_box.y1() * current_box.score();
     f64 best_x2 = current_box.x2() * current_box.score();
     f64 best_y2 = current_box.y2() * current_box.score();
-    for (i32 i = 0; i < (i32)boxes.size(); ++i) {
-      if (!valid[i]) continue;
 
+    suppressed.clear();
+    suppress(arrays, c_idx, overlap, valid, suppressed);
+    // Add the suppressed boxes to the average for this box
+    for (i32 i : suppressed) {
       const BoundingBox& candidate = boxes[i];
-
-      f32 x1 = std::max(current_box.x1(), candidate.x1());
-      f32 y1 = std::max(current_box.y1(), candidate.y1());
-      f32 x2 = std::min(current_box.x2(), candidate.x2());
-      f32 y2 = std::min(current_box.y2(), candidate.y2());
-
-      f32 o_w = std::max(0.0f, x2 - x1 + 1);
-      f32 o_h = std::max(0.0f, y2 - y1 + 1);
-
-      f32 box_overlap = o_w * o_h / ((candidate.x2() - candidate.x1() + 1) *
-                                     (candidate.y2() - candidate.y1() + 1));
-
-      valid[i] = box_overlap < overlap;
-
-      // Add to average for this box
-      if (!valid[i]) {
-        total_weight += candidate.score();
-        best_x1 += candidate.x1() * candidate.score();
-        best_y1 += candidate.y1() * candidate.score();
-        best_x2 += candidate.x2() * candidate.score();
-        best_y2 += candidate.y2() * candidate.score();
-      }
+      total_weight += candidate.score();
+      best_x1 += candidate.x1() * candidate.score();
+      best_y1 += candidate.y1() * candidate.score();
+      best_x2 += candidate.x2() * candidate.score();
+      best_y2 += candidate.y2() * candidate.score();
     }
     best_x1 /= total_weight;
     best_y1 /= total_weight;
@@ -122,4 +166,105 @@ std::vector<BoundingBox> average_nms(const std::vector<BoundingBox>& boxes,
 
   return best_boxes;
 }
+
+std::vector<f32> iou_matrix(const std::vector<BoundingBox>& a,
+                            const std::vector<BoundingBox>& b) {
+  i32 n = (i32)b.size();
+  std::vector<f32> bx1(n), by1(n), bx2(n), by2(n), barea(n);
+  for (i32 i = 0; i < n; ++i) {
+    bx1[i] = b[i].x1();
+    by1[i] = b[i].y1();
+    bx2[i] = b[i].x2();
+    by2[i] = b[i].y2();
+    barea[i] = (bx2[i] - bx1[i]) * (by2[i] - by1[i]);
+  }
+
+  std::vector<f32> ious(a.size() * n);
+  for (size_t r = 0; r < a.size(); ++r) {
+    f32 ax1 = a[r].x1();
+    f32 ay1 = a[r].y1();
+    f32 ax2 = a[r].x2();
+    f32 ay2 = a[r].y2();
+    f32 aarea = (ax2 - ax1) * (ay2 - ay1);
+    f32* out = ious.data() + r * n;
+    i32 i = 0;
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 cx1 = _mm_set1_ps(ax1);
+    const __m128 cy1 = _mm_set1_ps(ay1);
+    const __m128 cx2 = _mm_set1_ps(ax2);
+    const __m128 cy2 = _mm_set1_ps(ay2);
+    const __m128 carea = _mm_set1_ps(aarea);
+    for (; i + 4 <= n; i += 4) {
+      __m128 x1 = _mm_max_ps(_mm_loadu_ps(&bx1[i]), cx1);
+      __m128 y1 = _mm_max_ps(_mm_loadu_ps(&by1[i]), cy1);
+      __m128 x2 = _mm_min_ps(_mm_loadu_ps(&bx2[i]), cx2);
+      __m128 y2 = _mm_min_ps(_mm_loadu_ps(&by2[i]), cy2);
+      __m128 inter = _mm_mul_ps(_mm_max_ps(_mm_sub_ps(x2, x1), zero),
+                                _mm_max_ps(_mm_sub_ps(y2, y1), zero));
+      __m128 uni =
+          _mm_sub_ps(_mm_add_ps(carea, _mm_loadu_ps(&barea[i])), inter);
+      __m128 iou = _mm_div_ps(inter, uni);
+      // Zero where there is no intersection, which also drops 0 / 0
+      _mm_storeu_ps(out + i, _mm_and_ps(iou, _mm_cmpgt_ps(inter, zero)));
+    }
+#endif
+    for (; i < n; ++i) {
+      f32 w = std::max(std::min(ax2, bx2[i]) - std::max(ax1, bx1[i]), 0.0f);
+      f32 h = std::max(std::min(ay2, by2[i]) - std::max(ay1, by1[i]), 0.0f);
+      f32 inter = w * h;
+      out[i] = inter > 0 ? inter / (aarea + barea[i] - inter) : 0.0f;
+    }
+  }
+  return ious;
+}
+
+#ifdef HAVE_CUDA
+std::vector<BoundingBox> best_nms_gpu(DeviceHandle device, DeviceBox* boxes,
+                                      i32 count, f32 overlap,
+                                      cudaStream_t stream) {
+  std::vector<BoundingBox> out_boxes;
+  if (count == 0) {
+    return out_boxes;
+  }
+  i32 words = (count + NMS_BLOCK_SIZE - 1) / NMS_BLOCK_SIZE;
+  size_t mask_size = (size_t)count * words * sizeof(u64);
+  u64* mask_dev = (u64*)new_buffer(device, mask_size);
+  CU_CHECK(sortBoxesByScore(boxes, count, stream));
+  CU_CHECK(nmsMask(boxes, count, overlap, mask_dev, stream));
+
+  std::vector<u64> mask((size_t)count * words);
+  std::vector<DeviceBox> sorted(count);
+  CU_CHECK(cudaMemcpyAsync(mask.data(), mask_dev, mask_size,
+                           cudaMemcpyDeviceToHost, stream));
+  CU_CHECK(cudaMemcpyAsync(sorted.data(), boxes, count * sizeof(DeviceBox),
+                           cudaMemcpyDeviceToHost, stream));
+  CU_CHECK(cudaStreamSynchronize(stream));
+  delete_buffer(device, (u8*)mask_dev);
+
+  // Boxes suppressed by the boxes kept so far
+  std::vector<u64> removed(words, 0);
+  for (i32 i = 0; i < count; ++i) {
+    i32 word = i / NMS_BLOCK_SIZE;
+    if (removed[word] & (1ULL << (i % NMS_BLOCK_SIZE))) continue;
+
+    const DeviceBox& b = sorted[i];
+    BoundingBox box;
+    box.set_x1(b.x1);
+    box.set_y1(b.y1);
+    box.set_x2(b.x2);
+    box.set_y2(b.y2);
+    box.set_score(b.score);
+    box.set_label(b.label);
+    box.set_track_id(b.index);
+    out_boxes.push_back(box);
+
+    const u64* row = mask.data() + (size_t)i * words;
+    for (i32 w = word; w < words; ++w) {
+      removed[w] |= row[w];
+    }
+  }
+  return out_boxes;
+}
+#endif
 }
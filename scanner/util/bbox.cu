@@ -0,0 +1,130 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/bbox_cuda.h"
+
+#include <cfloat>
+#include <thrust/execution_policy.h>
+#include <thrust/sort.h>
+
+namespace scanner {
+namespace {
+
+__host__ __device__ __forceinline__ int divUp(int total, int grain) {
+  return (total + grain - 1) / grain;
+}
+
+__global__ void decode_proposal_boxes(const float* rois,
+                                      const float* class_probs, int count,
+                                      int num_classes, double threshold,
+                                      DeviceBox* boxes, int* num_boxes) {
+  const int j = blockIdx.x * blockDim.x + threadIdx.x;
+  if (j >= count) return;
+
+  // Start at 1 to skip the background
+  const float* scores = class_probs + (size_t)j * num_classes;
+  float max_score = FLT_MIN;
+  int max_cls = 0;
+  for (int cls = 1; cls < num_classes; ++cls) {
+    if (scores[cls] > max_score) {
+      max_score = scores[cls];
+      max_cls = cls;
+    }
+  }
+  if (max_score > threshold) {
+    const float* ro = rois + (size_t)j * 5;
+    DeviceBox box = {ro[1], ro[2], ro[3], ro[4], max_score, max_cls, j};
+    boxes[atomicAdd(num_boxes, 1)] = box;
+  }
+}
+
+struct ScoreOrder {
+  __host__ __device__ bool operator()(const DeviceBox& left,
+                                      const DeviceBox& right) const {
+    return left.score > right.score ||
+           (left.score == right.score && left.index < right.index);
+  }
+};
+
+// Block (x, y) compares the boxes of row block y with those of column block
+// x, one row box per thread
+__global__ void nms_mask(const DeviceBox* boxes, int count, float overlap,
+                         uint64_t* mask) {
+  const int row_block = blockIdx.y;
+  const int col_block = blockIdx.x;
+  if (row_block > col_block) return;
+
+  const int row_size = min(count - row_block * NMS_BLOCK_SIZE, NMS_BLOCK_SIZE);
+  const int col_size = min(count - col_block * NMS_BLOCK_SIZE, NMS_BLOCK_SIZE);
+
+  __shared__ float4 col_boxes[NMS_BLOCK_SIZE];
+  __shared__ float col_areas[NMS_BLOCK_SIZE];
+  if (threadIdx.x < col_size) {
+    const DeviceBox& b = boxes[col_block * NMS_BLOCK_SIZE + threadIdx.x];
+    col_boxes[threadIdx.x] = make_float4(b.x1, b.y1, b.x2, b.y2);
+    col_areas[threadIdx.x] = (b.x2 - b.x1 + 1) * (b.y2 - b.y1 + 1);
+  }
+  __syncthreads();
+
+  if (threadIdx.x >= row_size) return;
+  const int row = row_block * NMS_BLOCK_SIZE + threadIdx.x;
+  const DeviceBox b = boxes[row];
+  uint64_t bits = 0;
+  int start = row_block == col_block ? threadIdx.x + 1 : 0;
+  for (int i = start; i < col_size; ++i) {
+    const float4 c = col_boxes[i];
+    float o_w = ::fmax(0.0f, ::fmin(b.x2, c.z) - ::fmax(b.x1, c.x) + 1);
+    float o_h = ::fmax(0.0f, ::fmin(b.y2, c.w) - ::fmax(b.y1, c.y) + 1);
+    float box_overlap = o_w * o_h / col_areas[i];
+    if (!(box_overlap < overlap)) {
+      bits |= 1ULL << i;
+    }
+  }
+  mask[(size_t)row * divUp(count, NMS_BLOCK_SIZE) + col_block] = bits;
+}
+}
+
+cudaError_t decodeProposalBoxes(const float* rois, const float* class_probs,
+                                int count, int num_classes, double threshold,
+                                DeviceBox* boxes, int* num_boxes,
+                                cudaStream_t stream) {
+  if (count == 0) return cudaSuccess;
+  dim3 block(128);
+  dim3 grid(divUp(count, block.x));
+
+  decode_proposal_boxes<<<grid, block, 0, stream>>>(
+      rois, class_probs, count, num_classes, threshold, boxes, num_boxes);
+  return cudaPeekAtLastError();
+}
+
+cudaError_t sortBoxesByScore(DeviceBox* boxes, int count,
+                             cudaStream_t stream) {
+  thrust::sort(thrust::cuda::par.on(stream), boxes, boxes + count,
+               ScoreOrder());
+  return cudaPeekAtLastError();
+}
+
+cudaError_t nmsMask(const DeviceBox* boxes, int count, float overlap,
+                    uint64_t* mask, cudaStream_t stream) {
+  if (count == 0) return cudaSuccess;
+  int blocks = divUp(count, NMS_BLOCK_SIZE);
+  dim3 block(NMS_BLOCK_SIZE);
+  dim3 grid(blocks, blocks);
+
+  nms_mask<<<grid, block, 0, stream>>>(boxes, count, overlap, mask);
+  return cudaPeekAtLastError();
+}
+
+}
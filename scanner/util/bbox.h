@@ -1,5 +1,6 @@
 #pragma once
 
+#include "scanner/util/bbox_cuda.h"
 #include "scanner/util/common.h"
 
 namespace scanner {
@@ -9,4 +10,19 @@ std::vector<BoundingBox> best_nms(const std::vector<BoundingBox>& boxes,
 
 std::vector<BoundingBox> average_nms(const std::vector<BoundingBox>& boxes,
                                      f32 overlap);
+
+//! Intersection over union of each box of a with each box of b, a.size() rows
+//! of b.size() values. Boxes that do not overlap have 0.
+std::vector<f32> iou_matrix(const std::vector<BoundingBox>& a,
+                            const std::vector<BoundingBox>& b);
+
+#ifdef HAVE_CUDA
+//! best_nms of count boxes in the memory of a GPU device, which it sorts in
+//! place. Which boxes suppress which is computed on the GPU, leaving only a
+//! pass over bit masks to the host. The index of each box is kept as its
+//! track_id.
+std::vector<BoundingBox> best_nms_gpu(DeviceHandle device, DeviceBox* boxes,
+                                      i32 count, f32 overlap,
+                                      cudaStream_t stream);
+#endif
 }
@@ -0,0 +1,63 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#ifdef HAVE_CUDA
+#include <cuda_runtime.h>
+#endif
+
+namespace scanner {
+
+#ifdef HAVE_CUDA
+//! A detection in device memory, at index in the output of its net
+struct DeviceBox {
+  float x1;
+  float y1;
+  float x2;
+  float y2;
+  float score;
+  int label;
+  int index;
+};
+
+//! Boxes per word of the masks of nmsMask
+const int NMS_BLOCK_SIZE = 64;
+
+//! Appends to boxes a box for each of count Faster R-CNN proposals whose most
+//! likely class, other than the background class 0, scores above threshold.
+//! rois holds rows of (batch index, x1, y1, x2, y2) and class_probs rows of
+//! num_classes scores. num_boxes is in device memory and counts the boxes
+//! appended, so it must be 0 before the first call.
+cudaError_t decodeProposalBoxes(const float* rois, const float* class_probs,
+                                int count, int num_classes, double threshold,
+                                DeviceBox* boxes, int* num_boxes,
+                                cudaStream_t stream);
+
+//! Sorts count boxes by decreasing score, and boxes of equal score by index.
+cudaError_t sortBoxesByScore(DeviceBox* boxes, int count,
+                             cudaStream_t stream);
+
+//! For each of count boxes sorted by score, writes which of the boxes after
+//! it in the order it covers at least overlap of the area of, as the
+//! suppression test of best_nms. Box i owns the row of
+//! divUp(count, NMS_BLOCK_SIZE) words at mask + i * words, of which only
+//! the words from i / NMS_BLOCK_SIZE on are written.
+cudaError_t nmsMask(const DeviceBox* boxes, int count, float overlap,
+                    uint64_t* mask, cudaStream_t stream);
+#endif
+}
@@ -0,0 +1,344 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/block_cache.h"
+#include "scanner/util/fs.h"
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+using storehouse::StoreResult;
+
+namespace scanner {
+
+const size_t BlockCache::BLOCK_SIZE;
+
+BlockCache::BlockCache(size_t memory_size, const std::string& disk_dir,
+                       size_t disk_size)
+  : memory_size_(memory_size), disk_dir_(disk_dir), disk_size_(disk_size) {
+  if (!disk_dir_.empty() && disk_size_ > 0) {
+    if (mkdir_p(disk_dir_.c_str(), S_IRWXU) != 0) {
+      LOG(WARNING) << "Could not create block cache directory " << disk_dir_
+                   << ", caching in memory only";
+      disk_size_ = 0;
+    }
+  } else {
+    disk_size_ = 0;
+  }
+}
+
+BlockCache::~BlockCache() {
+  for (auto& kv : disk_blocks_) {
+    std::remove(disk_path(kv.first).c_str());
+  }
+}
+
+BlockCache::Block BlockCache::get(const std::string& path, u64 file_size,
+                                  u64 block) {
+  std::string key = block_key(path, file_size, block);
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = memory_blocks_.find(key);
+    if (it != memory_blocks_.end()) {
+      memory_lru_.splice(memory_lru_.begin(), memory_lru_, it->second.lru);
+      return it->second.data;
+    }
+    if (disk_blocks_.count(key) == 0) {
+      return nullptr;
+    }
+  }
+  Block data = read_from_disk(key);
+  if (data) {
+    put(path, file_size, block, data);
+  }
+  return data;
+}
+
+void BlockCache::put(const std::string& path, u64 file_size, u64 block,
+                     Block data) {
+  if (data->size() > memory_size_) {
+    return;
+  }
+  std::string key = block_key(path, file_size, block);
+  std::vector<std::tuple<std::string, Block>> evicted;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (memory_blocks_.count(key) > 0) {
+      return;
+    }
+    memory_lru_.push_front(key);
+    memory_blocks_[key] = MemoryEntry{data, memory_lru_.begin()};
+    memory_used_ += data->size();
+    while (memory_used_ > memory_size_) {
+      const std::string& victim = memory_lru_.back();
+      MemoryEntry& entry = memory_blocks_.at(victim);
+      memory_used_ -= entry.data->size();
+      if (disk_size_ > 0 && disk_blocks_.count(victim) == 0) {
+        evicted.emplace_back(victim, entry.data);
+      }
+      memory_blocks_.erase(victim);
+      memory_lru_.pop_back();
+    }
+  }
+  // Spill evicted blocks to the disk tier without holding the lock
+  for (auto& e : evicted) {
+    write_to_disk(std::get<0>(e), std::get<1>(e));
+  }
+}
+
+std::string BlockCache::block_key(const std::string& path, u64 file_size,
+                                  u64 block) {
+  return path + '\0' + std::to_string(file_size) + ':' +
+         std::to_string(block);
+}
+
+std::string BlockCache::disk_path(const std::string& key) {
+  return disk_dir_ + "/" + std::to_string(std::hash<std::string>()(key)) +
+         ".block";
+}
+
+BlockCache::Block BlockCache::read_from_disk(const std::string& key) {
+  std::ifstream file(disk_path(key), std::ios::binary);
+  if (!file.good()) {
+    return nullptr;
+  }
+  // Blocks start with their key in case two keys hash to the same file
+  u64 key_size = 0;
+  file.read((char*)&key_size, sizeof(key_size));
+  std::string file_key(key_size, '\0');
+  file.read(&file_key[0], key_size);
+  if (!file.good() || file_key != key) {
+    return nullptr;
+  }
+  u64 data_size = 0;
+  file.read((char*)&data_size, sizeof(data_size));
+  std::vector<u8>* data = new std::vector<u8>(data_size);
+  file.read((char*)data->data(), data_size);
+  if (!file.good()) {
+    delete data;
+    return nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = disk_blocks_.find(key);
+    if (it != disk_blocks_.end()) {
+      disk_lru_.splice(disk_lru_.begin(), disk_lru_, it->second.lru);
+    }
+  }
+  return Block(data);
+}
+
+void BlockCache::write_to_disk(const std::string& key, const Block& data) {
+  if (data->size() > disk_size_) {
+    return;
+  }
+  std::vector<std::string> evicted;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (disk_blocks_.count(key) > 0) {
+      return;
+    }
+    disk_lru_.push_front(key);
+    disk_blocks_[key] = DiskEntry{data->size(), disk_lru_.begin()};
+    disk_used_ += data->size();
+    while (disk_used_ > disk_size_) {
+      const std::string& victim = disk_lru_.back();
+      disk_used_ -= disk_blocks_.at(victim).size;
+      evicted.push_back(victim);
+      disk_blocks_.erase(victim);
+      disk_lru_.pop_back();
+    }
+  }
+  for (const std::string& victim : evicted) {
+    std::remove(disk_path(victim).c_str());
+  }
+
+  std::ofstream file(disk_path(key), std::ios::binary | std::ios::trunc);
+  u64 key_size = key.size();
+  u64 data_size = data->size();
+  file.write((const char*)&key_size, sizeof(key_size));
+  file.write(key.data(), key_size);
+  file.write((const char*)&data_size, sizeof(data_size));
+  file.write((const char*)data->data(), data_size);
+  if (!file.good()) {
+    LOG(WARNING) << "Failed to write block cache file " << disk_path(key);
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = disk_blocks_.find(key);
+    if (it != disk_blocks_.end()) {
+      disk_used_ -= it->second.size;
+      disk_lru_.erase(it->second.lru);
+      disk_blocks_.erase(it);
+    }
+  }
+}
+
+CachedRandomReadFile::CachedRandomReadFile(
+    BlockCache* cache, std::unique_ptr<storehouse::RandomReadFile> file,
+    u64 file_size, Profiler* profiler)
+  : cache_(cache),
+    file_(std::move(file)),
+    path_(file_->path()),
+    file_size_(file_size),
+    profiler_(profiler) {}
+
+StoreResult CachedRandomReadFile::read(uint64_t offset, size_t size,
+                                       uint8_t* data, size_t& size_read) {
+  const size_t block_size = BlockCache::BLOCK_SIZE;
+  size_read = 0;
+  if (size == 0) {
+    return StoreResult::Success;
+  }
+  if (offset >= file_size_) {
+    return StoreResult::EndOfFile;
+  }
+  u64 end = std::min(offset + size, file_size_);
+  std::vector<BlockCache::Block> blocks;
+  StoreResult result = fetch_blocks(offset, end, blocks);
+  if (result != StoreResult::Success) {
+    if (result == StoreResult::EndOfFile) {
+      // The file is shorter than it claimed, so skip the cache
+      return file_->read(offset, size, data, size_read);
+    }
+    return result;
+  }
+
+  u64 first_block = offset / block_size;
+  for (u64 i = 0; i < blocks.size(); ++i) {
+    u64 block_start = (first_block + i) * block_size;
+    u64 copy_start = std::max(offset, block_start);
+    u64 copy_end = std::min(end, block_start + blocks[i]->size());
+    std::memcpy(data + (copy_start - offset),
+                blocks[i]->data() + (copy_start - block_start),
+                copy_end - copy_start);
+  }
+  size_read = end - offset;
+  return offset + size > file_size_ ? StoreResult::EndOfFile
+                                    : StoreResult::Success;
+}
+
+StoreResult CachedRandomReadFile::prefetch(u64 offset, size_t size) {
+  if (size == 0 || offset >= file_size_) {
+    return StoreResult::Success;
+  }
+  std::vector<BlockCache::Block> blocks;
+  return fetch_blocks(offset, std::min(offset + size, file_size_), blocks);
+}
+
+StoreResult CachedRandomReadFile::fetch_blocks(
+    u64 offset, u64 end, std::vector<BlockCache::Block>& blocks) {
+  const size_t block_size = BlockCache::BLOCK_SIZE;
+  u64 first_block = offset / block_size;
+  u64 num_blocks = (end - 1) / block_size - first_block + 1;
+
+  blocks.resize(num_blocks);
+  i64 hits = 0;
+  i64 hit_bytes = 0;
+  for (u64 i = 0; i < num_blocks; ++i) {
+    blocks[i] = cache_->get(path_, file_size_, first_block + i);
+    if (blocks[i]) {
+      hits++;
+      hit_bytes += blocks[i]->size();
+    }
+  }
+
+  // Fetch each run of missing blocks with a single read
+  for (u64 i = 0; i < num_blocks;) {
+    if (blocks[i]) {
+      ++i;
+      continue;
+    }
+    u64 j = i;
+    while (j < num_blocks && !blocks[j]) {
+      ++j;
+    }
+    u64 run_start = (first_block + i) * block_size;
+    u64 run_end = std::min((first_block + j) * block_size, file_size_);
+    std::vector<u8> run(run_end - run_start);
+    size_t run_read = 0;
+    StoreResult result =
+        file_->read(run_start, run.size(), run.data(), run_read);
+    if (result != StoreResult::Success && result != StoreResult::EndOfFile) {
+      return result;
+    }
+    if (run_read != run.size()) {
+      return StoreResult::EndOfFile;
+    }
+    for (u64 b = i; b < j; ++b) {
+      u64 block_start = (first_block + b) * block_size - run_start;
+      u64 block_end = std::min(block_start + block_size, (u64)run.size());
+      BlockCache::Block block(new std::vector<u8>(
+          run.begin() + block_start, run.begin() + block_end));
+      cache_->put(path_, file_size_, first_block + b, block);
+      blocks[b] = block;
+    }
+    i = j;
+  }
+
+  if (profiler_ != nullptr) {
+    profiler_->increment("cache_hits", hits);
+    profiler_->increment("cache_misses", num_blocks - hits);
+    profiler_->increment("cache_hit_bytes", hit_bytes);
+  }
+  return StoreResult::Success;
+}
+
+StoreResult CachedRandomReadFile::get_size(uint64_t& size) {
+  size = file_size_;
+  return StoreResult::Success;
+}
+
+const std::string CachedRandomReadFile::path() { return path_; }
+
+namespace {
+std::unique_ptr<BlockCache> node_block_cache;
+}
+
+void init_block_cache(size_t memory_size, const std::string& disk_dir,
+                      size_t disk_size) {
+  if (memory_size == 0) {
+    node_block_cache.reset();
+    return;
+  }
+  node_block_cache.reset(new BlockCache(memory_size, disk_dir, disk_size));
+  VLOG(1) << "Caching up to " << memory_size << " bytes of storage reads in "
+          << "memory and " << disk_size << " bytes in " << disk_dir;
+}
+
+bool block_cache_enabled() { return node_block_cache != nullptr; }
+
+StoreResult make_cached_random_read_file(
+    storehouse::StorageBackend* storage, const std::string& path,
+    std::unique_ptr<storehouse::RandomReadFile>& file, Profiler* profiler) {
+  std::unique_ptr<storehouse::RandomReadFile> base_file;
+  StoreResult result =
+      storehouse::make_unique_random_read_file(storage, path, base_file);
+  if (result != StoreResult::Success || !node_block_cache) {
+    file = std::move(base_file);
+    return result;
+  }
+  u64 file_size = 0;
+  result = base_file->get_size(file_size);
+  if (result != StoreResult::Success) {
+    return result;
+  }
+  file.reset(new CachedRandomReadFile(node_block_cache.get(),
+                                      std::move(base_file), file_size,
+                                      profiler));
+  return StoreResult::Success;
+}
+}
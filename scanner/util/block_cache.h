@@ -0,0 +1,134 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/util/profiler.h"
+#include "storehouse/storage_backend.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace scanner {
+
+//! Node wide cache of fixed size blocks of files read from storage.
+//
+// Blocks are kept in memory in LRU order up to a byte budget. If a directory
+// is given, blocks evicted from memory are written there, again in LRU order
+// with a separate budget, so that they can be read back from local disk
+// instead of remote storage. Blocks are keyed by path and file size so that a
+// table rewritten with different contents is unlikely to be served stale
+// data.
+class BlockCache {
+ public:
+  static const size_t BLOCK_SIZE = 1024 * 1024;
+
+  using Block = std::shared_ptr<const std::vector<u8>>;
+
+  BlockCache(size_t memory_size, const std::string& disk_dir,
+             size_t disk_size);
+
+  ~BlockCache();
+
+  //! Returns the block or nullptr if it is not cached.
+  Block get(const std::string& path, u64 file_size, u64 block);
+
+  void put(const std::string& path, u64 file_size, u64 block, Block data);
+
+ private:
+  struct MemoryEntry {
+    Block data;
+    std::list<std::string>::iterator lru;
+  };
+
+  struct DiskEntry {
+    size_t size;
+    std::list<std::string>::iterator lru;
+  };
+
+  static std::string block_key(const std::string& path, u64 file_size,
+                               u64 block);
+
+  std::string disk_path(const std::string& key);
+
+  Block read_from_disk(const std::string& key);
+
+  void write_to_disk(const std::string& key, const Block& data);
+
+  size_t memory_size_;
+  std::string disk_dir_;
+  size_t disk_size_;
+
+  std::mutex lock_;
+  // Most recently used first
+  std::list<std::string> memory_lru_;
+  std::unordered_map<std::string, MemoryEntry> memory_blocks_;
+  size_t memory_used_ = 0;
+  std::list<std::string> disk_lru_;
+  std::unordered_map<std::string, DiskEntry> disk_blocks_;
+  size_t disk_used_ = 0;
+};
+
+//! Read file that serves whole blocks out of a BlockCache and only reads the
+//! blocks it misses from the underlying file.
+class CachedRandomReadFile : public storehouse::RandomReadFile {
+ public:
+  CachedRandomReadFile(BlockCache* cache,
+                       std::unique_ptr<storehouse::RandomReadFile> file,
+                       u64 file_size, Profiler* profiler);
+
+  storehouse::StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                               size_t& size_read) override;
+
+  storehouse::StoreResult get_size(uint64_t& size) override;
+
+  const std::string path() override;
+
+  //! Reads the blocks covering [offset, offset + size) into the cache
+  //! without copying them out.
+  storehouse::StoreResult prefetch(u64 offset, size_t size);
+
+ private:
+  // Fills blocks with the cached or freshly read blocks covering
+  // [offset, end)
+  storehouse::StoreResult fetch_blocks(u64 offset, u64 end,
+                                       std::vector<BlockCache::Block>& blocks);
+
+  BlockCache* cache_;
+  std::unique_ptr<storehouse::RandomReadFile> file_;
+  std::string path_;
+  u64 file_size_;
+  Profiler* profiler_;
+};
+
+//! Sets up the block cache shared by every reader in this process. A memory
+//! size of zero disables caching.
+void init_block_cache(size_t memory_size, const std::string& disk_dir,
+                      size_t disk_size);
+
+bool block_cache_enabled();
+
+//! Opens path for reading through the block cache if it is enabled. Cache
+//! hits and misses are counted in profiler if one is given.
+storehouse::StoreResult make_cached_random_read_file(
+    storehouse::StorageBackend* storage, const std::string& path,
+    std::unique_ptr<storehouse::RandomReadFile>& file,
+    Profiler* profiler = nullptr);
+}
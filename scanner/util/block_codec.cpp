@@ -0,0 +1,142 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/block_codec.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace scanner {
+
+bool block_codec_available(proto::Column::BlockCodec codec) {
+  switch (codec) {
+    case proto::Column::NONE:
+      return true;
+    case proto::Column::LZ4:
+#ifdef HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case proto::Column::ZSTD:
+#ifdef HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+    default:
+      return false;
+  }
+}
+
+bool parse_block_codec(const std::string& name,
+                       proto::Column::BlockCodec& codec) {
+  if (name == "lz4") {
+    codec = proto::Column::LZ4;
+  } else if (name == "zstd") {
+    codec = proto::Column::ZSTD;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void compress_block(proto::Column::BlockCodec codec, i32 level,
+                    const u8* data, size_t size, std::vector<u8>& output) {
+  size_t output_start = output.size();
+  switch (codec) {
+    case proto::Column::NONE: {
+      output.insert(output.end(), data, data + size);
+      return;
+    }
+#ifdef HAVE_LZ4
+    case proto::Column::LZ4: {
+      output.resize(output_start + LZ4_compressBound(size));
+      i32 compressed_size = LZ4_compress_fast(
+          (const char*)data, (char*)output.data() + output_start, size,
+          output.size() - output_start, std::max(level, 1));
+      if (compressed_size <= 0) {
+        LOG(FATAL) << "LZ4 failed to compress a block of " << size
+                   << " bytes";
+      }
+      output.resize(output_start + compressed_size);
+      return;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case proto::Column::ZSTD: {
+      output.resize(output_start + ZSTD_compressBound(size));
+      size_t compressed_size =
+          ZSTD_compress(output.data() + output_start,
+                        output.size() - output_start, data, size, level);
+      if (ZSTD_isError(compressed_size)) {
+        LOG(FATAL) << "Zstd failed to compress a block of " << size
+                   << " bytes: " << ZSTD_getErrorName(compressed_size);
+      }
+      output.resize(output_start + compressed_size);
+      return;
+    }
+#endif
+    default:
+      LOG(FATAL) << "Scanner was built without block codec "
+                 << proto::Column::BlockCodec_Name(codec);
+  }
+}
+
+void decompress_block(proto::Column::BlockCodec codec, const u8* data,
+                      size_t size, u8* output, size_t output_size) {
+  switch (codec) {
+    case proto::Column::NONE: {
+      if (size != output_size) {
+        LOG(FATAL) << "Uncompressed block has " << size << " bytes instead of "
+                   << output_size;
+      }
+      memcpy(output, data, size);
+      return;
+    }
+#ifdef HAVE_LZ4
+    case proto::Column::LZ4: {
+      i32 decompressed_size = LZ4_decompress_safe(
+          (const char*)data, (char*)output, size, output_size);
+      if (decompressed_size != (i32)output_size) {
+        LOG(FATAL) << "Corrupt LZ4 block of " << size << " bytes";
+      }
+      return;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case proto::Column::ZSTD: {
+      size_t decompressed_size =
+          ZSTD_decompress(output, output_size, data, size);
+      if (ZSTD_isError(decompressed_size) ||
+          decompressed_size != output_size) {
+        LOG(FATAL) << "Corrupt Zstd block of " << size << " bytes";
+      }
+      return;
+    }
+#endif
+    default:
+      LOG(FATAL) << "Scanner was built without block codec "
+                 << proto::Column::BlockCodec_Name(codec);
+  }
+}
+}
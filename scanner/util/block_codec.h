@@ -0,0 +1,48 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <string>
+#include <vector>
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// Block codecs
+//
+// General purpose compression for blocks of column data. LZ4 favours speed
+// and Zstd density. Each codec is only available when Scanner is built with
+// its library.
+
+bool block_codec_available(proto::Column::BlockCodec codec);
+
+//! Maps the name of an output column codec, "lz4" or "zstd", to its block
+//! codec. Returns false if the name is not a block codec.
+bool parse_block_codec(const std::string& name,
+                       proto::Column::BlockCodec& codec);
+
+//! Appends the compressed bytes of data to output. A level of 0 uses the
+//! codec default. For LZ4 the level is the acceleration, so higher levels
+//! are faster and compress less.
+void compress_block(proto::Column::BlockCodec codec, i32 level,
+                    const u8* data, size_t size, std::vector<u8>& output);
+
+//! Decompresses a block that expands to exactly output_size bytes.
+void decompress_block(proto::Column::BlockCodec codec, const u8* data,
+                      size_t size, u8* output, size_t output_size);
+}
@@ -58,4 +58,13 @@ inline void cudAssert(CUresult code, const char* file, int line) {
   }
 }
 
+//! Makes the work queued on stream after this call wait for the work queued
+//! on other before it, without blocking the host. event is recorded on
+//! other to do so.
+inline void stream_wait_stream(cudaStream_t stream, cudaStream_t other,
+                               cudaEvent_t event) {
+  CU_CHECK(cudaEventRecord(event, other));
+  CU_CHECK(cudaStreamWaitEvent(stream, event, 0));
+}
+
 #endif
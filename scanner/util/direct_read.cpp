@@ -0,0 +1,124 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/direct_read.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
+
+#ifdef HAVE_CUFILE
+#include <cufile.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace scanner {
+
+namespace {
+bool read_fully(i32 fd, u64 offset, size_t size, u8* buffer) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = pread(fd, buffer + done, size - done, offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+}
+
+bool gpu_direct_storage_available() {
+#ifdef HAVE_CUFILE
+  static bool available = cuFileDriverOpen().err == CU_FILE_SUCCESS;
+  return available;
+#else
+  return false;
+#endif
+}
+
+bool read_file_ranges(DeviceHandle device,
+                      const std::vector<FileRange>& ranges) {
+  bool direct = device.type == DeviceType::GPU &&
+                gpu_direct_storage_available();
+#ifdef HAVE_CUDA
+  if (device.type == DeviceType::GPU) {
+    CU_CHECK(cudaSetDevice(device.id));
+  }
+#endif
+  // Bytes for a GPU without GPUDirect Storage go through this buffer
+  std::vector<u8> staging;
+  size_t i = 0;
+  while (i < ranges.size()) {
+    // Ranges of one file are read through one descriptor
+    size_t end = i + 1;
+    while (end < ranges.size() && ranges[end].path == ranges[i].path) {
+      end++;
+    }
+    i32 fd = open(ranges[i].path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+    if (fd == -1) {
+      return false;
+    }
+    bool success = true;
+#ifdef HAVE_CUFILE
+    CUfileHandle_t handle;
+    bool registered = false;
+    if (direct) {
+      CUfileDescr_t descr;
+      memset(&descr, 0, sizeof(descr));
+      descr.handle.fd = fd;
+      descr.type = CU_FILE_HANDLE_TYPE_OPAQUE_FD;
+      registered =
+          cuFileHandleRegister(&handle, &descr).err == CU_FILE_SUCCESS;
+      success = registered;
+    }
+#endif
+    for (size_t r = i; r < end && success; ++r) {
+      const FileRange& range = ranges[r];
+      if (device.type == DeviceType::CPU) {
+        success = read_fully(fd, range.offset, range.size, range.buffer);
+      } else if (direct) {
+#ifdef HAVE_CUFILE
+        success = cuFileRead(handle, range.buffer, range.size, range.offset,
+                             0) == (ssize_t)range.size;
+#endif
+      } else {
+        staging.resize(range.size);
+        success = read_fully(fd, range.offset, range.size, staging.data());
+        if (success) {
+          memcpy_buffer(range.buffer, device, staging.data(), CPU_DEVICE,
+                        range.size);
+        }
+      }
+    }
+#ifdef HAVE_CUFILE
+    if (registered) {
+      cuFileHandleDeregister(handle);
+    }
+#endif
+    close(fd);
+    if (!success) {
+      return false;
+    }
+    i = end;
+  }
+  return true;
+}
+}
@@ -0,0 +1,47 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <string>
+#include <vector>
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// Direct reads
+//
+// Reads of local files into the memory of a device. With GPUDirect Storage,
+// which is used when Scanner is built with cuFile and its driver is loaded,
+// bytes for a GPU go from storage to device memory without passing through a
+// host buffer.
+
+//! Bytes of a local file to read into a buffer.
+struct FileRange {
+  std::string path;
+  u64 offset;
+  size_t size;
+  u8* buffer;
+};
+
+bool gpu_direct_storage_available();
+
+//! Reads each range into its buffer, which is on device. Ranges of the same
+//! file should be next to each other. Returns false if a read fails.
+bool read_file_ranges(DeviceHandle device,
+                      const std::vector<FileRange>& ranges);
+}
@@ -17,6 +17,16 @@
 
 #include "scanner/util/common.h"
 
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 namespace scanner {
 
 struct GetBitsState {
@@ -32,59 +42,116 @@ inline u32 get_bit(GetBitsState& gb) {
   return v;
 }
 
+// Reads up to 32 bits a byte at a time rather than a bit at a time, without
+// reading any byte past the last one holding the bits
 inline u32 get_bits(GetBitsState& gb, i32 bits) {
-  u32 v = 0;
-  for (i32 i = bits - 1; i >= 0; i--) {
-    v |= get_bit(gb) << i;
+  if (bits <= 0) {
+    return 0;
   }
-  return v;
+  const u8* data = gb.buffer + (gb.offset >> 0x3);
+  i32 shift = gb.offset & 0x7;
+  i32 bytes = (shift + bits + 7) >> 0x3;
+  u64 v = 0;
+  for (i32 i = 0; i < bytes; ++i) {
+    v = (v << 8) | data[i];
+  }
+  gb.offset += bits;
+  return (v >> (bytes * 8 - shift - bits)) & ((1ull << bits) - 1);
 }
 
 inline u32 get_ue_golomb(GetBitsState& gb) {
-  // calculate zero bits. Will be optimized.
+  // Count the leading zero bits a byte at a time
   i32 zeros = 0;
-  while (0 == get_bit(gb)) {
-    zeros++;
+  while (true) {
+    i32 shift = gb.offset & 0x7;
+    u32 byte = (gb.buffer[gb.offset >> 0x3] << shift) & 0xFF;
+    if (byte == 0) {
+      zeros += 8 - shift;
+      gb.offset += 8 - shift;
+      continue;
+    }
+    i32 leading = __builtin_clz(byte) - 24;
+    zeros += leading;
+    // Skip the first 1 bit as well
+    gb.offset += leading + 1;
+    break;
   }
 
   // insert first 1 bit
   u32 info = 1 << zeros;
-
-  for (i32 i = zeros - 1; i >= 0; i--) {
-    info |= get_bit(gb) << i;
-  }
+  info |= get_bits(gb, zeros);
 
   return (info - 1);
 }
 
-inline u32 get_se_golomb(GetBitsState& gb) {
-  // calculate zero bits. Will be optimized.
-  i32 zeros = 0;
-  while (0 == get_bit(gb)) {
-    zeros++;
-  }
+// The sign is not applied, which only matters to callers comparing values
+inline u32 get_se_golomb(GetBitsState& gb) { return get_ue_golomb(gb); }
 
-  // insert first 1 bit
-  u32 info = 1 << zeros;
-
-  for (i32 i = zeros - 1; i >= 0; i--) {
-    info |= get_bit(gb) << i;
+// Offset of the first 0x000001 start code in data, or also of the first
+// 0x000000 if match_zero, which ends a NAL unit as well. Returns size - 2, or
+// 0 if size is smaller, when there is none. Candidates are found 16 or 32
+// bytes at a time as positions where a zero byte is followed by another.
+inline i32 start_code_offset(const u8* data, i32 size, bool match_zero) {
+  i32 p = 0;
+#if defined(__AVX2__)
+  const __m256i zero = _mm256_setzero_si256();
+  for (; p + 34 <= size; p += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)(data + p));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(data + p + 1));
+    u32 mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)));
+    for (; mask != 0; mask &= mask - 1) {
+      i32 q = p + __builtin_ctz(mask);
+      if (data[q + 2] == 1 || (match_zero && data[q + 2] == 0)) {
+        return q;
+      }
+    }
   }
-
-  return (info - 1);
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; p + 18 <= size; p += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(data + p));
+    __m128i b = _mm_loadu_si128((const __m128i*)(data + p + 1));
+    u32 mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)));
+    for (; mask != 0; mask &= mask - 1) {
+      i32 q = p + __builtin_ctz(mask);
+      if (data[q + 2] == 1 || (match_zero && data[q + 2] == 0)) {
+        return q;
+      }
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  // NEON has no movemask, so blocks with a candidate are checked byte by byte
+  for (; p + 18 <= size; p += 16) {
+    uint8x16_t a = vceqzq_u8(vld1q_u8(data + p));
+    uint8x16_t b = vceqzq_u8(vld1q_u8(data + p + 1));
+    if (vmaxvq_u8(vandq_u8(a, b)) == 0) {
+      continue;
+    }
+    for (i32 q = p; q < p + 16; ++q) {
+      if (data[q] == 0 && data[q + 1] == 0 &&
+          (data[q + 2] == 1 || (match_zero && data[q + 2] == 0))) {
+        return q;
+      }
+    }
+  }
+#endif
+  for (; p + 2 < size; ++p) {
+    if (data[p] == 0 && data[p + 1] == 0 &&
+        (data[p + 2] == 1 || (match_zero && data[p + 2] == 0))) {
+      return p;
+    }
+  }
+  return std::max(size - 2, 0);
 }
 
 inline void next_nal(const u8*& buffer, i32& buffer_size_left,
                      const u8*& nal_start, i32& nal_size) {
-  bool found = false;
-  while (buffer_size_left > 2) {
-    if (buffer[0] == 0x00 && buffer[1] == 0x00 && buffer[2] == 0x01) {
-      found = true;
-      break;
-    }
-    buffer++;
-    buffer_size_left--;
-  }
+  i32 offset = start_code_offset(buffer, buffer_size_left, false);
+  bool found = offset + 2 < buffer_size_left;
+  buffer += offset;
+  buffer_size_left -= offset;
 
   buffer += 3;
   buffer_size_left -= 3;
@@ -95,13 +162,10 @@ inline void next_nal(const u8*& buffer, i32& buffer_size_left,
   if (!found) {
     return;
   }
-  while (buffer_size_left > 2 &&
-         !(buffer[0] == 0x00 && buffer[1] == 0x00 &&
-           (buffer[2] == 0x00 || buffer[2] == 0x01))) {
-    buffer++;
-    buffer_size_left--;
-    nal_size++;
-  }
+  offset = start_code_offset(buffer, buffer_size_left, true);
+  buffer += offset;
+  buffer_size_left -= offset;
+  nal_size += offset;
   if (!(buffer_size_left > 3)) {
     nal_size += buffer_size_left;
     // Not sure if this is needed or not...
@@ -0,0 +1,112 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/half.h"
+
+#include <cstring>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+namespace scanner {
+namespace {
+
+u16 float_to_half_bits(f32 value) {
+  u32 x;
+  std::memcpy(&x, &value, sizeof(x));
+  u16 sign = (x >> 16) & 0x8000;
+  u32 abs = x & 0x7fffffff;
+  if (abs >= 0x7f800000) {
+    // Infinity, or NaN with a quiet bit kept
+    return sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0);
+  }
+  if (abs >= 0x477ff000) {
+    // Rounds past 65504, the largest half
+    return sign | 0x7c00;
+  }
+  if (abs >= 0x38800000) {
+    // Normal: rebias the exponent and round off 13 bits of mantissa
+    u32 half = (abs >> 13) - (112 << 10);
+    u32 rest = abs & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+      half++;
+    }
+    return sign | half;
+  }
+  if (abs <= 0x33000000) {
+    // At most half of the smallest subnormal, 2^-24, rounds to zero
+    return sign;
+  }
+  // Subnormal: the mantissa in units of 2^-24
+  u32 mantissa = (abs & 0x7fffff) | 0x800000;
+  u32 shift = 126 - (abs >> 23);
+  u32 half = mantissa >> shift;
+  u32 rest = mantissa & ((1u << shift) - 1);
+  u32 halfway = 1u << (shift - 1);
+  if (rest > halfway || (rest == halfway && (half & 1))) {
+    half++;
+  }
+  return sign | half;
+}
+
+f32 half_bits_to_float(u16 half) {
+  u32 sign = (u32)(half & 0x8000) << 16;
+  u32 exponent = (half >> 10) & 0x1f;
+  u32 mantissa = half & 0x3ff;
+  u32 x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else {
+    // Zero or subnormal, mantissa units of 2^-24
+    f32 value = mantissa * (1.0f / 16777216.0f);
+    std::memcpy(&x, &value, sizeof(x));
+    x |= sign;
+  }
+  f32 value;
+  std::memcpy(&value, &x, sizeof(value));
+  return value;
+}
+}
+
+void float_to_half(const f32* in, u16* out, size_t count) {
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= count; i += 8) {
+    __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + i),
+                                   _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(out + i), half);
+  }
+#endif
+  for (; i < count; ++i) {
+    out[i] = float_to_half_bits(in[i]);
+  }
+}
+
+void half_to_float(const u16* in, f32* out, size_t count) {
+  size_t i = 0;
+#if defined(__F16C__)
+  for (; i + 8 <= count; i += 8) {
+    __m128i half = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(half));
+  }
+#endif
+  for (; i < count; ++i) {
+    out[i] = half_bits_to_float(in[i]);
+  }
+}
+}
@@ -0,0 +1,32 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <cstddef>
+
+namespace scanner {
+
+//! Converts count floats to IEEE half precision values, stored as their
+//! bits, rounding to the nearest even value. Values too large for half
+//! precision become infinities.
+void float_to_half(const f32* in, u16* out, size_t count);
+
+//! Converts count IEEE half precision values, stored as their bits, to
+//! floats, which represent all of them exactly.
+void half_to_float(const u16* in, f32* out, size_t count);
+}
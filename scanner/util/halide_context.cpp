@@ -1,4 +1,10 @@
 #include "scanner/util/cuda.h"
+#include "scanner/util/common.h"
+
+#include "HalideRuntime.h"
+
+#include <algorithm>
+#include <utility>
 
 namespace Halide {
 namespace Runtime {
@@ -9,3 +15,49 @@ CUcontext context = 0;
 }
 }
 }
+
+namespace scanner {
+namespace {
+
+// Compute capability, as major * 10 + minor, that each CUDA feature of a Halide
+// target needs
+const std::pair<halide_target_feature_t, i32> CUDA_CAPABILITIES[] = {
+    {halide_target_feature_cuda_capability30, 30},
+    {halide_target_feature_cuda_capability32, 32},
+    {halide_target_feature_cuda_capability35, 35},
+    {halide_target_feature_cuda_capability50, 50},
+    {halide_target_feature_cuda_capability61, 61}};
+
+// Ops built for several targets run the first variant whose features this
+// accepts. Halide only checks CPU features by default, which would run a
+// variant built for a newer GPU on any device.
+int can_use_target_features(int count, const uint64_t* features) {
+  if (!halide_default_can_use_target_features(count, features)) {
+    return 0;
+  }
+  for (auto& capability : CUDA_CAPABILITIES) {
+    i32 feature = capability.first;
+    if (feature / 64 >= count ||
+        !((features[feature / 64] >> (feature % 64)) & 1)) {
+      continue;
+    }
+    i32 device = std::max(halide_get_gpu_device(nullptr), 0);
+    i32 major, minor;
+    if (cudaDeviceGetAttribute(&major, cudaDevAttrComputeCapabilityMajor,
+                               device) != cudaSuccess ||
+        cudaDeviceGetAttribute(&minor, cudaDevAttrComputeCapabilityMinor,
+                               device) != cudaSuccess ||
+        capability.second > major * 10 + minor) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+struct RegisterCanUseTargetFeatures {
+  RegisterCanUseTargetFeatures() {
+    halide_set_custom_can_use_target_features(can_use_target_features);
+  }
+} register_can_use_target_features;
+}
+}
@@ -0,0 +1,91 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/util/h264.h"
+
+namespace scanner {
+
+// HEVC NAL units share the Annex B start codes of H.264, so next_nal and
+// GetBitsState from h264.h apply to them as well. Their header is two bytes.
+
+const i32 HEVC_VPS_NAL = 32;
+const i32 HEVC_SPS_NAL = 33;
+const i32 HEVC_PPS_NAL = 34;
+
+inline i32 get_hevc_nal_unit_type(const u8* nal_start) {
+  return (nal_start[0] >> 1) & 0x3F;
+}
+
+inline bool is_hevc_vcl_nal(i32 nal_type) { return nal_type < 32; }
+
+// IDR pictures. CRA pictures are random access points too, but the leading
+// pictures after them reference pictures before the CRA and so can not be
+// decoded after seeking to it.
+inline bool is_hevc_idr_nal(i32 nal_type) {
+  return nal_type == 19 || nal_type == 20;
+}
+
+// first_slice_segment_in_pic_flag of a VCL NAL unit, which starts a picture
+inline bool is_hevc_first_slice_segment(const u8* nal_start, i32 nal_size) {
+  return nal_size > 2 && (nal_start[2] & 0x80);
+}
+
+inline void skip_bits(GetBitsState& gb, i32 bits) { gb.offset += bits; }
+
+inline u32 parse_hevc_vps_id(GetBitsState& gb) {
+  // vps_video_parameter_set_id
+  return get_bits(gb, 4);
+}
+
+inline u32 parse_hevc_sps_id(GetBitsState& gb) {
+  // sps_video_parameter_set_id
+  get_bits(gb, 4);
+  // sps_max_sub_layers_minus1
+  u32 max_sub_layers_minus1 = get_bits(gb, 3);
+  // sps_temporal_id_nesting_flag
+  get_bit(gb);
+  // profile_tier_level: general profile space, tier, idc, compatibility and
+  // constraint flags take 88 bits followed by the 8 bit level
+  skip_bits(gb, 88 + 8);
+  std::vector<bool> profile_present(max_sub_layers_minus1);
+  std::vector<bool> level_present(max_sub_layers_minus1);
+  for (u32 i = 0; i < max_sub_layers_minus1; ++i) {
+    profile_present[i] = get_bit(gb);
+    level_present[i] = get_bit(gb);
+  }
+  if (max_sub_layers_minus1 > 0) {
+    // reserved_zero_2bits
+    skip_bits(gb, 2 * (8 - max_sub_layers_minus1));
+  }
+  for (u32 i = 0; i < max_sub_layers_minus1; ++i) {
+    if (profile_present[i]) {
+      skip_bits(gb, 88);
+    }
+    if (level_present[i]) {
+      skip_bits(gb, 8);
+    }
+  }
+  // sps_seq_parameter_set_id
+  return get_ue_golomb(gb);
+}
+
+inline u32 parse_hevc_pps_id(GetBitsState& gb) {
+  // pps_pic_parameter_set_id
+  return get_ue_golomb(gb);
+}
+}
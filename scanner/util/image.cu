@@ -226,6 +226,250 @@ __host__ __device__ __forceinline__ int divUp(int total, int grain) {
 }
 // End OpenCV code
 
+namespace {
+
+// Bilinearly samples a plane with step bytes between horizontally adjacent
+// samples at the center of output pixel (x, y)
+__device__ float sample_plane(const u8* plane, size_t pitch, int step,
+                              int width, int height, float x, float y) {
+  x = ::fmin(::fmax(x - 0.5f, 0.0f), (float)(width - 1));
+  y = ::fmin(::fmax(y - 0.5f, 0.0f), (float)(height - 1));
+  int x0 = (int)x;
+  int y0 = (int)y;
+  int x1 = ::min(x0 + 1, width - 1);
+  int y1 = ::min(y0 + 1, height - 1);
+  float fx = x - x0;
+  float fy = y - y0;
+  float top = plane[y0 * pitch + x0 * step] * (1.0f - fx) +
+              plane[y0 * pitch + x1 * step] * fx;
+  float bottom = plane[y1 * pitch + x0 * step] * (1.0f - fx) +
+                 plane[y1 * pitch + x1 * step] * fx;
+  return top * (1.0f - fy) + bottom * fy;
+}
+
+// Converts NV12 to RGB, resizes, subtracts the mean color and writes planar
+// BGR floats in one pass, so the full resolution RGB frame is never stored
+__global__ void NV12_to_net_input(const u8* srcImage, size_t nSourcePitch,
+                                  int width, int height, float* dstImage,
+                                  int dstWidth, int dstHeight, float scale,
+                                  float mean_r, float mean_g, float mean_b) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+
+  if (x >= dstWidth || y >= dstHeight) return;
+
+  float sx = (x + 0.5f) * width / dstWidth;
+  float sy = (y + 0.5f) * height / dstHeight;
+  const u8* chroma = srcImage + nSourcePitch * height;
+  float luma = sample_plane(srcImage, nSourcePitch, 1, width, height, sx, sy);
+  float cb = sample_plane(chroma, nSourcePitch, 2, width / 2, height / 2,
+                          sx * 0.5f, sy * 0.5f);
+  float cr = sample_plane(chroma + 1, nSourcePitch, 2, width / 2, height / 2,
+                          sx * 0.5f, sy * 0.5f);
+
+  // BT.601 limited range
+  luma = 1.1644f * (luma - 16.0f);
+  cb -= 128.0f;
+  cr -= 128.0f;
+  float red = ::fmin(::fmax(luma + 1.596f * cr, 0.0f), 255.0f);
+  float green =
+      ::fmin(::fmax(luma - 0.3918f * cb - 0.813f * cr, 0.0f), 255.0f);
+  float blue = ::fmin(::fmax(luma + 2.0172f * cb, 0.0f), 255.0f);
+
+  const size_t channel_size = (size_t)dstWidth * dstHeight;
+  const size_t offset = y * dstWidth + x;
+  dstImage[channel_size * 0 + offset] = (blue - mean_b) * scale;
+  dstImage[channel_size * 1 + offset] = (green - mean_g) * scale;
+  dstImage[channel_size * 2 + offset] = (red - mean_r) * scale;
+}
+
+// Each thread writes the luma of a 2x2 block of pixels and their averaged
+// chroma sample
+__global__ void RGB_to_NV12(const u8* srcImage, size_t nSourcePitch,
+                            u8* dstImage, size_t nDestPitch, int width,
+                            int height) {
+  const int x = 2 * (blockIdx.x * blockDim.x + threadIdx.x);
+  const int y = 2 * (blockIdx.y * blockDim.y + threadIdx.y);
+
+  if (x >= width || y >= height) return;
+
+  float cb = 0.0f;
+  float cr = 0.0f;
+  for (int dy = 0; dy < 2; ++dy) {
+    for (int dx = 0; dx < 2; ++dx) {
+      const u8* pixel = &srcImage[(y + dy) * nSourcePitch + (x + dx) * 3];
+      float red = pixel[0];
+      float green = pixel[1];
+      float blue = pixel[2];
+      // BT.601 limited range
+      float luma = 16.0f + 0.2568f * red + 0.5041f * green + 0.0979f * blue;
+      dstImage[(y + dy) * nDestPitch + x + dx] = (u8)(luma + 0.5f);
+      cb += -0.1482f * red - 0.2910f * green + 0.4392f * blue;
+      cr += 0.4392f * red - 0.3678f * green - 0.0714f * blue;
+    }
+  }
+  u8* chroma = dstImage + nDestPitch * height + (y / 2) * nDestPitch + x;
+  chroma[0] = (u8)::fmin(::fmax(128.0f + cb / 4 + 0.5f, 0.0f), 255.0f);
+  chroma[1] = (u8)::fmin(::fmax(128.0f + cr / 4 + 0.5f, 0.0f), 255.0f);
+}
+
+// Ints per box given to drawBoxesRGB
+const int BOX_FIELDS = 5;
+
+// Frames resized by one launch, passed as a kernel parameter so that
+// nothing has to be copied to the device ahead of the launch
+const int RESIZE_BATCH_FRAMES = 64;
+
+struct FramePointers {
+  const u8* frames[RESIZE_BATCH_FRAMES];
+};
+
+// Resizes frame blockIdx.z of the batch into the output frame at the same
+// position in out
+__global__ void resize_RGB_batch(FramePointers in, size_t nSourcePitch,
+                                 int width, int height, u8* out, int dstWidth,
+                                 int dstHeight) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+
+  if (x >= dstWidth || y >= dstHeight) return;
+
+  float sx = (x + 0.5f) * width / dstWidth;
+  float sy = (y + 0.5f) * height / dstHeight;
+  const u8* src = in.frames[blockIdx.z];
+  u8* dst = out + (size_t)blockIdx.z * dstWidth * dstHeight * 3 +
+            (y * dstWidth + x) * 3;
+  for (int c = 0; c < 3; ++c) {
+    float v = sample_plane(src + c, nSourcePitch, 3, width, height, sx, sy);
+    dst[c] = (u8)::fmin(::fmax(v + 0.5f, 0.0f), 255.0f);
+  }
+}
+
+// Keys cubic convolution weight with a = -0.75, as OpenCV uses
+__device__ float cubic_weight(float d) {
+  const float A = -0.75f;
+  d = ::fabs(d);
+  if (d <= 1.0f) return ((A + 2.0f) * d - (A + 3.0f)) * d * d + 1.0f;
+  if (d < 2.0f) return ((A * d - 5.0f * A) * d + 8.0f * A) * d - 4.0f * A;
+  return 0.0f;
+}
+
+// Bicubically samples a plane like sample_plane, replicating the border
+__device__ float sample_plane_cubic(const u8* plane, size_t pitch, int step,
+                                    int width, int height, float x, float y) {
+  x -= 0.5f;
+  y -= 0.5f;
+  int x0 = (int)::floor(x);
+  int y0 = (int)::floor(y);
+  float fx = x - x0;
+  float fy = y - y0;
+  float sum = 0.0f;
+  for (int j = -1; j <= 2; ++j) {
+    int yy = ::min(::max(y0 + j, 0), height - 1);
+    float row = 0.0f;
+    for (int i = -1; i <= 2; ++i) {
+      int xx = ::min(::max(x0 + i, 0), width - 1);
+      row += plane[yy * pitch + xx * step] * cubic_weight(fx - i);
+    }
+    sum += row * cubic_weight(fy - j);
+  }
+  return sum;
+}
+
+// Writes frame blockIdx.z of the batch as the net input at the same
+// position in out
+__global__ void RGB_batch_to_net_input(FramePointers in, size_t nSourcePitch,
+                                       int width, int height, float* out,
+                                       NetInputFormat format) {
+  const int x = blockIdx.x * blockDim.x + threadIdx.x;
+  const int y = blockIdx.y * blockDim.y + threadIdx.y;
+
+  if (x >= format.width || y >= format.height) return;
+
+  const u8* src = in.frames[blockIdx.z];
+  size_t plane_size = (size_t)format.width * format.height;
+  float* dst = out + blockIdx.z * 3 * plane_size +
+               (format.transpose ? (size_t)x * format.height + y
+                                 : (size_t)y * format.width + x);
+  bool inside = x < format.resize_width && y < format.resize_height;
+  float sx = (x + 0.5f) * width / format.resize_width;
+  float sy = (y + 0.5f) * height / format.resize_height;
+  for (int c = 0; c < 3; ++c) {
+    float v = format.pad_value;
+    if (inside) {
+      const u8* plane = src + (format.bgr ? 2 - c : c);
+      v = format.cubic ? sample_plane_cubic(plane, nSourcePitch, 3, width,
+                                            height, sx, sy)
+                       : sample_plane(plane, nSourcePitch, 3, width, height,
+                                      sx, sy);
+      // Rounded to 8 bits like the output of an 8 bit resize
+      v = ::fmin(::fmax(::floor(v + 0.5f), 0.0f), 255.0f);
+    }
+    dst[c * plane_size] = v * format.scale - format.mean[c];
+  }
+}
+
+// Draws the outline of box blockIdx.x. The outline is the band, thickness
+// pixels wide, inside the rectangle that extends the edges x1, y1, x2 - 1
+// and y2 - 1 of the box by thickness / 2 outwards. The threads of a block
+// walk the top and bottom rows of the band and then its sides.
+__global__ void draw_boxes_RGB(u8* frames, int width, int height,
+                               const int* boxes, int thickness, uchar3 color) {
+  const int* box = boxes + blockIdx.x * BOX_FIELDS;
+  int half = thickness / 2;
+  int ox0 = box[1] - half;
+  int oy0 = box[2] - half;
+  int ox1 = box[3] - 1 + thickness - 1 - half;
+  int oy1 = box[4] - 1 + thickness - 1 - half;
+  int outer_w = ox1 - ox0 + 1;
+  int outer_h = oy1 - oy0 + 1;
+  if (outer_w <= 0 || outer_h <= 0) return;
+  int side_h = ::max(outer_h - 2 * thickness, 0);
+  int rows_pixels = 2 * thickness * outer_w;
+  int total = rows_pixels + 2 * thickness * side_h;
+
+  u8* frame = frames + (size_t)box[0] * width * height * 3;
+  for (int i = threadIdx.x; i < total; i += blockDim.x) {
+    int x, y;
+    if (i < rows_pixels) {
+      int r = i / outer_w;
+      x = ox0 + i % outer_w;
+      y = r < thickness ? oy0 + r : oy1 - (r - thickness);
+    } else {
+      int k = i - rows_pixels;
+      int c = k % (2 * thickness);
+      y = oy0 + thickness + k / (2 * thickness);
+      x = c < thickness ? ox0 + c : ox1 - (c - thickness);
+    }
+    if (x < 0 || y < 0 || x >= width || y >= height) continue;
+    u8* pixel = frame + ((size_t)y * width + x) * 3;
+    pixel[0] = color.x;
+    pixel[1] = color.y;
+    pixel[2] = color.z;
+  }
+}
+
+// Inline conversions instead of cuda_fp16.h, whose __half type changed
+// between CUDA versions
+__global__ void convert_float_to_half(const float* in, unsigned short* out,
+                                      size_t count) {
+  size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= count) return;
+  unsigned short h;
+  asm("cvt.rn.f16.f32 %0, %1;" : "=h"(h) : "f"(in[i]));
+  out[i] = h;
+}
+
+__global__ void convert_half_to_float(const unsigned short* in,
+                                      float* out, size_t count) {
+  size_t i = (size_t)blockIdx.x * blockDim.x + threadIdx.x;
+  if (i >= count) return;
+  float f;
+  asm("cvt.f32.f16 %0, %1;" : "=f"(f) : "h"(in[i]));
+  out[i] = f;
+}
+}
+
 cudaError_t convertNV12toRGBA(const u8 *in, size_t in_pitch,
                               u8 *out, size_t out_pitch,
                               int width, int height,
@@ -249,4 +493,101 @@ cudaError_t convertRGBInterleavedToPlanar(const u8 *in, size_t in_pitch,
   return cudaPeekAtLastError();
 }
 
+cudaError_t convertRGBtoNV12(const u8* in, size_t in_pitch, u8* out,
+                             size_t out_pitch, int width, int height,
+                             cudaStream_t stream) {
+  dim3 block(32, 8);
+  dim3 grid(divUp(width, 2 * block.x), divUp(height, 2 * block.y));
+
+  RGB_to_NV12<<<grid, block, 0, stream>>>(in, in_pitch, out, out_pitch, width,
+                                          height);
+  return cudaPeekAtLastError();
+}
+
+cudaError_t convertNV12toNetInput(const u8* in, size_t in_pitch, int width,
+                                  int height, float* out, int out_width,
+                                  int out_height, bool normalize,
+                                  float mean_r, float mean_g, float mean_b,
+                                  cudaStream_t stream) {
+  dim3 block(32, 8);
+  dim3 grid(divUp(out_width, block.x), divUp(out_height, block.y));
+
+  NV12_to_net_input<<<grid, block, 0, stream>>>(
+      in, in_pitch, width, height, out, out_width, out_height,
+      normalize ? 1.0f / 255.0f : 1.0f, mean_r, mean_g, mean_b);
+  return cudaPeekAtLastError();
+}
+
+cudaError_t resizeRGBBatch(const u8* const* in, int count, size_t in_pitch,
+                           int width, int height, u8* out, int out_width,
+                           int out_height, cudaStream_t stream) {
+  dim3 block(32, 8);
+  size_t out_size = (size_t)out_width * out_height * 3;
+  for (int start = 0; start < count; start += RESIZE_BATCH_FRAMES) {
+    int frames = ::min(count - start, RESIZE_BATCH_FRAMES);
+    FramePointers batch;
+    for (int i = 0; i < frames; ++i) {
+      batch.frames[i] = in[start + i];
+    }
+    dim3 grid(divUp(out_width, block.x), divUp(out_height, block.y), frames);
+
+    resize_RGB_batch<<<grid, block, 0, stream>>>(
+        batch, in_pitch, width, height, out + start * out_size, out_width,
+        out_height);
+  }
+  return cudaPeekAtLastError();
+}
+
+cudaError_t convertRGBBatchToNetInput(const u8* const* in, int count,
+                                      size_t in_pitch, int width, int height,
+                                      float* out, const NetInputFormat& format,
+                                      cudaStream_t stream) {
+  dim3 block(32, 8);
+  size_t out_size = (size_t)format.width * format.height * 3;
+  for (int start = 0; start < count; start += RESIZE_BATCH_FRAMES) {
+    int frames = ::min(count - start, RESIZE_BATCH_FRAMES);
+    FramePointers batch;
+    for (int i = 0; i < frames; ++i) {
+      batch.frames[i] = in[start + i];
+    }
+    dim3 grid(divUp(format.width, block.x), divUp(format.height, block.y),
+              frames);
+
+    RGB_batch_to_net_input<<<grid, block, 0, stream>>>(
+        batch, in_pitch, width, height, out + start * out_size, format);
+  }
+  return cudaPeekAtLastError();
+}
+
+cudaError_t drawBoxesRGB(u8* frames, int width, int height, const int* boxes,
+                         int count, int thickness, u8 r, u8 g, u8 b,
+                         cudaStream_t stream) {
+  if (count == 0) {
+    return cudaSuccess;
+  }
+  draw_boxes_RGB<<<count, 256, 0, stream>>>(frames, width, height, boxes,
+                                            thickness, make_uchar3(r, g, b));
+  return cudaPeekAtLastError();
+}
+
+cudaError_t convertFloatToHalf(const float* in, uint16_t* out, size_t count,
+                               cudaStream_t stream) {
+  if (count == 0) {
+    return cudaSuccess;
+  }
+  convert_float_to_half<<<divUp((int)count, 256), 256, 0, stream>>>(in, out,
+                                                                    count);
+  return cudaPeekAtLastError();
+}
+
+cudaError_t convertHalfToFloat(const uint16_t* in, float* out, size_t count,
+                               cudaStream_t stream) {
+  if (count == 0) {
+    return cudaSuccess;
+  }
+  convert_half_to_float<<<divUp((int)count, 256), 256, 0, stream>>>(in, out,
+                                                                    count);
+  return cudaPeekAtLastError();
+}
+
 }
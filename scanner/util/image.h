@@ -35,5 +35,75 @@ cudaError_t convertNV12toRGBA(const u8* in, size_t in_pitch, u8* out,
 cudaError_t convertRGBInterleavedToPlanar(const u8* in, size_t in_pitch,
                                           u8* out, size_t out_pitch, int width,
                                           int height, cudaStream_t stream);
+
+//! Converts an interleaved RGB frame of even width and height to NV12 with
+//! BT.601 limited range, the inverse of convertNV12toRGBA.
+cudaError_t convertRGBtoNV12(const u8* in, size_t in_pitch, u8* out,
+                             size_t out_pitch, int width, int height,
+                             cudaStream_t stream);
+
+//! Converts an NV12 frame to a planar BGR float image of the given size
+//! with the mean color subtracted, divided by 255 if normalize is set.
+cudaError_t convertNV12toNetInput(const u8* in, size_t in_pitch, int width,
+                                  int height, float* out, int out_width,
+                                  int out_height, bool normalize,
+                                  float mean_r, float mean_g, float mean_b,
+                                  cudaStream_t stream);
+
+//! Bilinearly resizes count interleaved RGB frames of the same size into
+//! consecutive frames starting at out, sampling at pixel centers as
+//! cv::resize does. Launches one kernel per 64 frames.
+cudaError_t resizeRGBBatch(const u8* const* in, int count, size_t in_pitch,
+                           int width, int height, u8* out, int out_width,
+                           int out_height, cudaStream_t stream);
+
+//! How convertRGBBatchToNetInput lays out a frame as planar float net input
+struct NetInputFormat {
+  //! Size of the output planes
+  int width;
+  int height;
+  //! Size the frame is resized to, at the top left of the planes. Pixels
+  //! past it take pad_value.
+  int resize_width;
+  int resize_height;
+  //! Bicubic instead of bilinear resizing
+  bool cubic = false;
+  //! Planes in BGR instead of RGB order
+  bool bgr = false;
+  //! Each plane stored column-major, width rows of height values
+  bool transpose = false;
+  float pad_value = 0.0f;
+  //! Each 8 bit value v becomes v * scale - mean[c], with c in plane order
+  float scale = 1.0f;
+  float mean[3] = {0.0f, 0.0f, 0.0f};
+};
+
+//! Resizes count interleaved RGB frames of the same size and writes each one
+//! as three float planes, one frame after the other, starting at out. This
+//! fuses the resize, conversion, mean subtraction and planarization into one
+//! launch per 64 frames. The resized frame is rounded to 8 bits, as an 8 bit
+//! resize would.
+cudaError_t convertRGBBatchToNetInput(const u8* const* in, int count,
+                                      size_t in_pitch, int width, int height,
+                                      float* out, const NetInputFormat& format,
+                                      cudaStream_t stream);
+
+//! Draws the outlines of count boxes into consecutive interleaved RGB
+//! frames starting at frames, all with one launch. boxes is on the device
+//! and holds five ints per box: the index of its frame, then x1, y1, x2 and
+//! y2 with x2 and y2 exclusive.
+cudaError_t drawBoxesRGB(u8* frames, int width, int height, const int* boxes,
+                         int count, int thickness, u8 r, u8 g, u8 b,
+                         cudaStream_t stream);
+
+//! Converts count floats to IEEE half precision bits, rounding to nearest
+//! even, as float_to_half in scanner/util/half.h does on the CPU.
+cudaError_t convertFloatToHalf(const float* in, uint16_t* out, size_t count,
+                               cudaStream_t stream);
+
+//! Converts count IEEE half precision values, stored as their bits, to
+//! floats.
+cudaError_t convertHalfToFloat(const uint16_t* in, float* out, size_t count,
+                               cudaStream_t stream);
 #endif
 }
@@ -0,0 +1,94 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace scanner {
+
+//! Bounded multi-producer multi-consumer queue.
+//
+// Items live in a fixed size ring buffer where each cell carries a sequence
+// number, so producers and consumers only contend on an atomic position
+// counter instead of a shared mutex. Threads spin briefly when the queue is
+// full or empty and then fall back to sleeping on a condition variable, so
+// idle pipeline stages do not burn a core.
+//
+// This has the same interface as Queue<T> minus peek, which can not be
+// supported without a lock when there are multiple consumers. It holds at
+// least two items.
+template <typename T>
+class LockFreeQueue {
+ public:
+  LockFreeQueue(int max_size = 4);
+  LockFreeQueue(LockFreeQueue<T>&& o);
+
+  int size();
+
+  int capacity() const;
+
+  template <typename... Args>
+  void emplace(Args&&... args);
+
+  void push(T item);
+
+  bool try_pop(T& item);
+
+  //! Pops an item if one arrives within timeout.
+  template <typename Rep, typename Period>
+  bool try_pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout);
+
+  void pop(T& item);
+
+  void clear();
+
+  void wait_until_empty();
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T data;
+  };
+
+  bool try_enqueue(T& item);
+
+  bool try_dequeue(T& item);
+
+  void notify(std::condition_variable& cv, std::atomic<int>& waiters);
+
+  const size_t capacity_;
+  std::unique_ptr<Cell[]> cells_;
+  // Producer and consumer positions are kept on separate cache lines
+  alignas(64) std::atomic<size_t> enqueue_pos_;
+  alignas(64) std::atomic<size_t> dequeue_pos_;
+
+  // Blocking fallback
+  std::mutex mutex_;
+  std::condition_variable empty_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::atomic<int> pop_waiters_{0};
+  std::atomic<int> push_waiters_{0};
+  std::atomic<int> empty_waiters_{0};
+};
+}
+
+#include "lockfree_queue.inl"
@@ -0,0 +1,223 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "lockfree_queue.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace scanner {
+
+// Number of attempts a blocked producer or consumer makes before sleeping
+const int LOCKFREE_QUEUE_SPIN_COUNT = 64;
+
+// The sequence number of a lone cell reads the same whether its item is
+// waiting or already popped, so rings have at least two cells
+template <typename T>
+LockFreeQueue<T>::LockFreeQueue(int max_size)
+  : capacity_(std::max(max_size, 2)), cells_(new Cell[capacity_]) {
+  for (size_t i = 0; i < capacity_; ++i) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  enqueue_pos_.store(0, std::memory_order_relaxed);
+  dequeue_pos_.store(0, std::memory_order_relaxed);
+}
+
+template <typename T>
+LockFreeQueue<T>::LockFreeQueue(LockFreeQueue<T>&& o)
+  : LockFreeQueue(o.capacity_) {
+  T item;
+  while (o.try_pop(item)) {
+    try_enqueue(item);
+  }
+}
+
+template <typename T>
+int LockFreeQueue<T>::size() {
+  size_t enqueued = enqueue_pos_.load();
+  size_t dequeued = dequeue_pos_.load();
+  int items = enqueued > dequeued ? (int)(enqueued - dequeued) : 0;
+  return items - pop_waiters_ + push_waiters_;
+}
+
+template <typename T>
+int LockFreeQueue<T>::capacity() const {
+  return capacity_;
+}
+
+template <typename T>
+template <typename... Args>
+void LockFreeQueue<T>::emplace(Args&&... args) {
+  push(T(std::forward<Args>(args)...));
+}
+
+template <typename T>
+void LockFreeQueue<T>::push(T item) {
+  for (int i = 0; i < LOCKFREE_QUEUE_SPIN_COUNT; ++i) {
+    if (try_enqueue(item)) {
+      notify(not_empty_, pop_waiters_);
+      return;
+    }
+    std::this_thread::yield();
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    push_waiters_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    not_full_.wait(lock, [&] { return try_enqueue(item); });
+    push_waiters_--;
+  }
+  notify(not_empty_, pop_waiters_);
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_pop(T& item) {
+  if (!try_dequeue(item)) {
+    return false;
+  }
+  notify(not_full_, push_waiters_);
+  if (empty_waiters_ > 0 && size() <= 0) {
+    notify(empty_, empty_waiters_);
+  }
+  return true;
+}
+
+template <typename T>
+void LockFreeQueue<T>::pop(T& item) {
+  for (int i = 0; i < LOCKFREE_QUEUE_SPIN_COUNT; ++i) {
+    if (try_pop(item)) {
+      return;
+    }
+    std::this_thread::yield();
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    pop_waiters_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    not_empty_.wait(lock, [&] { return try_dequeue(item); });
+    pop_waiters_--;
+  }
+  notify(not_full_, push_waiters_);
+  if (empty_waiters_ > 0 && size() <= 0) {
+    notify(empty_, empty_waiters_);
+  }
+}
+
+template <typename T>
+template <typename Rep, typename Period>
+bool LockFreeQueue<T>::try_pop_for(
+    T& item, const std::chrono::duration<Rep, Period>& timeout) {
+  if (try_pop(item)) {
+    return true;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    pop_waiters_++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool ready =
+        not_empty_.wait_for(lock, timeout, [&] { return try_dequeue(item); });
+    pop_waiters_--;
+    if (!ready) {
+      return false;
+    }
+  }
+  notify(not_full_, push_waiters_);
+  if (empty_waiters_ > 0 && size() <= 0) {
+    notify(empty_, empty_waiters_);
+  }
+  return true;
+}
+
+template <typename T>
+void LockFreeQueue<T>::clear() {
+  T item;
+  while (try_dequeue(item)) {
+  }
+  notify(not_full_, push_waiters_);
+  notify(empty_, empty_waiters_);
+}
+
+template <typename T>
+void LockFreeQueue<T>::wait_until_empty() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  empty_waiters_++;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  empty_.wait(lock, [this] {
+    return enqueue_pos_.load() == dequeue_pos_.load();
+  });
+  empty_waiters_--;
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_enqueue(T& item) {
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  while (true) {
+    Cell& cell = cells_[pos % capacity_];
+    size_t seq = cell.sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      // Cell is free for this position, try to claim it
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        cell.data = std::move(item);
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // Consumers have not freed this cell yet, so the queue is full
+      return false;
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename T>
+bool LockFreeQueue<T>::try_dequeue(T& item) {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  while (true) {
+    Cell& cell = cells_[pos % capacity_];
+    size_t seq = cell.sequence.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      // Cell holds the item for this position, try to claim it
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        item = std::move(cell.data);
+        cell.sequence.store(pos + capacity_, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      // Producer has not filled this cell yet, so the queue is empty
+      return false;
+    } else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+template <typename T>
+void LockFreeQueue<T>::notify(std::condition_variable& cv,
+                              std::atomic<int>& waiters) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (waiters > 0) {
+    // Taking the lock ensures the waiter is either not yet checking its
+    // predicate or already sleeping, so the notification is not lost
+    std::unique_lock<std::mutex> lock(mutex_);
+    lock.unlock();
+    cv.notify_all();
+  }
+}
+}
@@ -0,0 +1,80 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace scanner {
+
+//! Thread safe map holding at most a fixed number of entries, evicting the
+//! least recently used one first.
+//
+// Values are handed out as shared pointers so that an entry evicted by one
+// thread stays valid for threads still using it.
+template <typename K, typename V>
+class LruCache {
+ public:
+  LruCache(size_t max_entries) : max_entries_(max_entries) {}
+
+  //! Returns the cached value or nullptr if there is none.
+  std::shared_ptr<const V> get(const K& key) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return it->second.value;
+  }
+
+  //! Caches value unless key is already cached, and returns the cached value.
+  std::shared_ptr<const V> put(const K& key, std::shared_ptr<const V> value) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      return it->second.value;
+    }
+    lru_.push_front(key);
+    entries_[key] = Entry{value, lru_.begin()};
+    while (entries_.size() > max_entries_) {
+      entries_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    return value;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> guard(lock_);
+    entries_.clear();
+    lru_.clear();
+  }
+
+ private:
+  struct Entry {
+    std::shared_ptr<const V> value;
+    typename std::list<K>::iterator lru;
+  };
+
+  size_t max_entries_;
+  std::mutex lock_;
+  // Most recently used first
+  std::list<K> lru_;
+  std::map<K, Entry> entries_;
+};
+}
@@ -15,12 +15,25 @@
 
 #include "scanner/util/memory.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/numa.h"
 
+#include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
 #ifdef HAVE_CUDA
 #include <cuda.h>
@@ -71,6 +84,16 @@ class Allocator {
 
   virtual u8* allocate(size_t size) = 0;
   virtual void free(u8* buffer) = 0;
+
+  //! Like allocate, but returns nullptr when out of memory.
+  virtual u8* try_allocate(size_t size) { return allocate(size); }
+
+  //! Alignment of the buffers returned by allocate.
+  virtual size_t alignment() { return 16; }
+
+  //! Bytes handed out, and the most that can be, or 0 if unbounded.
+  virtual size_t used_bytes() { return 0; }
+  virtual size_t capacity() { return 0; }
 };
 
 class SystemAllocator : public Allocator {
@@ -140,65 +163,359 @@ class SystemAllocator : public Allocator {
   bool pinned_;
 };
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+const size_t HUGE_PAGE_2MB = 2L * 1024L * 1024L;
+const size_t HUGE_PAGE_1GB = 1024L * 1024L * 1024L;
+
+// Backs large CPU allocations, i.e. memory pools, with huge pages to cut TLB
+// misses when kernels sweep over whole frames.
+//
+// Explicit huge pages have to be reserved by the administrator, so if there
+// are not enough pages of the requested size this falls back to 2 MB pages,
+// then to ordinary pages marked for transparent huge pages. The page size
+// that was obtained is available from page_size().
+class HugePageAllocator : public Allocator {
+ public:
+  HugePageAllocator(size_t huge_page_size, bool pinned)
+    : huge_page_size_(huge_page_size),
+      pinned_(pinned),
+      page_size_(sysconf(_SC_PAGESIZE)) {}
+
+  u8* allocate(size_t size) {
+    std::vector<size_t> page_sizes = {huge_page_size_};
+    if (huge_page_size_ > HUGE_PAGE_2MB) {
+      page_sizes.push_back(HUGE_PAGE_2MB);
+    }
+    u8* buffer = nullptr;
+    size_t mapped_size = 0;
+    size_t obtained_page_size = 0;
+    for (size_t page_size : page_sizes) {
+      mapped_size = round_up(size, page_size);
+      i32 page_shift = __builtin_ctzl(page_size);
+      void* ptr =
+          mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                   (page_shift << MAP_HUGE_SHIFT),
+               -1, 0);
+      if (ptr != MAP_FAILED) {
+        buffer = (u8*)ptr;
+        obtained_page_size = page_size;
+        break;
+      }
+      LOG(WARNING) << "Could not map " << mapped_size << " bytes of "
+                   << page_size / 1024 << " KB huge pages: "
+                   << strerror(errno);
+    }
+    if (buffer == nullptr) {
+      mapped_size = round_up(size, HUGE_PAGE_2MB);
+      void* ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      LOG_IF(FATAL, ptr == MAP_FAILED) << "CPU memory allocation failed: "
+                                       << strerror(errno);
+      buffer = (u8*)ptr;
+      obtained_page_size = page_size_;
+#ifdef MADV_HUGEPAGE
+      if (madvise(buffer, mapped_size, MADV_HUGEPAGE) == 0) {
+        LOG(WARNING) << "Falling back to transparent huge pages";
+      } else {
+        LOG(WARNING) << "Falling back to " << page_size_ << " byte pages";
+      }
+#endif
+    } else {
+      LOG(INFO) << "Mapped " << mapped_size << " bytes of "
+                << obtained_page_size / 1024 << " KB huge pages";
+    }
+    if (pinned_) {
+      CUDA_PROTECT({
+        CU_CHECK(cudaHostRegister(buffer, mapped_size,
+                                  cudaHostRegisterDefault));
+      });
+    }
+
+    std::lock_guard<std::mutex> guard(lock_);
+    mapped_sizes_[buffer] = mapped_size;
+    obtained_page_size_ = std::max(obtained_page_size_, obtained_page_size);
+    return buffer;
+  }
+
+  void free(u8* buffer) {
+    size_t mapped_size;
+    {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto it = mapped_sizes_.find(buffer);
+      LOG_IF(FATAL, it == mapped_sizes_.end())
+          << "Huge page allocator freed unknown buffer";
+      mapped_size = it->second;
+      mapped_sizes_.erase(it);
+    }
+    if (pinned_) {
+      CUDA_PROTECT({ CU_CHECK(cudaHostUnregister(buffer)); });
+    }
+    munmap(buffer, mapped_size);
+  }
+
+  //! Largest page size backing any allocation so far.
+  size_t page_size() {
+    std::lock_guard<std::mutex> guard(lock_);
+    return obtained_page_size_;
+  }
+
+ private:
+  static size_t round_up(size_t size, size_t multiple) {
+    return (size + multiple - 1) / multiple * multiple;
+  }
+
+  size_t huge_page_size_;
+  bool pinned_;
+  size_t page_size_;
+  std::mutex lock_;
+  std::unordered_map<u8*, size_t> mapped_sizes_;
+  size_t obtained_page_size_ = 0;
+};
+
 bool pointer_in_buffer(u8* ptr, u8* buf_start, u8* buf_end) {
   return (size_t)ptr >= (size_t)buf_start && (size_t)ptr < (size_t)buf_end;
 }
 
+// Memory accounting. Every allocation made through new_buffer or
+// new_block_buffer is attributed to the memory tag of the allocating thread
+// and given back to that tag when it is freed, no matter which thread frees
+// it. Tags are never removed, so the counters live in a fixed table that is
+// updated without locking.
+const i32 MAX_MEMORY_TAGS = 256;
+const i32 UNTAGGED_MEMORY_TAG = 0;
+
+struct MemoryTagStats {
+  std::atomic<i64> live_bytes{0};
+  std::atomic<i64> peak_bytes{0};
+  // Most live bytes allowed, or 0 for no limit
+  std::atomic<i64> budget_bytes{0};
+};
+
+static std::mutex memory_tags_mutex;
+static std::vector<std::string> memory_tag_names = {"untagged"};
+static std::map<std::string, i32> memory_tag_ids = {{"untagged", 0}};
+// Indexed by tag and then by whether the memory is on a GPU
+static MemoryTagStats memory_tag_stats[MAX_MEMORY_TAGS][2];
+static thread_local i32 current_memory_tag = UNTAGGED_MEMORY_TAG;
+
+MemoryTagStats& memory_stats_for(DeviceHandle device, i32 tag) {
+  return memory_tag_stats[tag][device.type == DeviceType::GPU ? 1 : 0];
+}
+
+void account_allocation(DeviceHandle device, i32 tag, size_t size) {
+  MemoryTagStats& stats = memory_stats_for(device, tag);
+  i64 live = stats.live_bytes += size;
+  i64 budget = stats.budget_bytes.load();
+  if (budget > 0 && live > budget) {
+    std::lock_guard<std::mutex> guard(memory_tags_mutex);
+    LOG(FATAL) << "Exceeded the budget of " << budget << " bytes of "
+               << memory_tag_names[tag] << " on "
+               << (device.type == DeviceType::GPU ? "GPUs" : "CPUs");
+  }
+  i64 peak = stats.peak_bytes.load();
+  while (live > peak && !stats.peak_bytes.compare_exchange_weak(peak, live)) {
+  }
+}
+
+void account_free(DeviceHandle device, i32 tag, size_t size) {
+  memory_stats_for(device, tag).live_bytes -= size;
+}
+
+void log_memory_usage() {
+  for (const MemoryUsage& usage : memory_usage()) {
+    if (usage.peak_bytes == 0) {
+      continue;
+    }
+    LOG(WARNING) << (usage.device_type == DeviceType::GPU ? "GPU" : "CPU")
+                 << " memory held by " << usage.tag << ": "
+                 << usage.live_bytes << " bytes (peak " << usage.peak_bytes
+                 << ")";
+  }
+}
+
+i32 memory_tag_id(const std::string& name) {
+  std::lock_guard<std::mutex> guard(memory_tags_mutex);
+  auto it = memory_tag_ids.find(name);
+  if (it != memory_tag_ids.end()) {
+    return it->second;
+  }
+  if (memory_tag_names.size() >= MAX_MEMORY_TAGS) {
+    LOG(WARNING) << "Too many memory tags, not tracking " << name;
+    return UNTAGGED_MEMORY_TAG;
+  }
+  i32 id = memory_tag_names.size();
+  memory_tag_names.push_back(name);
+  memory_tag_ids[name] = id;
+  return id;
+}
+
+MemoryTagScope::MemoryTagScope(const std::string& name)
+  : MemoryTagScope(memory_tag_id(name)) {}
+
+MemoryTagScope::MemoryTagScope(i32 tag_id) : previous_(current_memory_tag) {
+  current_memory_tag = tag_id;
+}
+
+MemoryTagScope::~MemoryTagScope() { current_memory_tag = previous_; }
+
+std::vector<MemoryUsage> memory_usage() {
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> guard(memory_tags_mutex);
+    names = memory_tag_names;
+  }
+  std::vector<MemoryUsage> usage;
+  for (i32 tag = 0; tag < names.size(); ++tag) {
+    for (DeviceType type : {DeviceType::CPU, DeviceType::GPU}) {
+      MemoryTagStats& stats = memory_stats_for(DeviceHandle{type, 0}, tag);
+      usage.push_back(MemoryUsage{names[tag], type, stats.live_bytes.load(),
+                                  stats.peak_bytes.load()});
+    }
+  }
+  return usage;
+}
+
+void set_memory_tag_budget(i32 tag_id, DeviceType device_type, i64 bytes) {
+  memory_stats_for(DeviceHandle{device_type, 0}, tag_id).budget_bytes = bytes;
+}
+
+void reset_memory_peaks() {
+  for (i32 tag = 0; tag < MAX_MEMORY_TAGS; ++tag) {
+    for (MemoryTagStats& stats : memory_tag_stats[tag]) {
+      stats.peak_bytes = stats.live_bytes.load();
+    }
+  }
+}
+
+// Smallest block handed out by the pool, which also keeps every block aligned
+// for both CPU and GPU use
+const i32 POOL_MIN_ORDER = 8;
+// Allocations at least this large that waste more than 1/8th of their buddy
+// block become candidates for their own size class
+const size_t SLAB_MIN_OBJECT_SIZE = 64 * 1024;
+// Times an odd size has to be seen before it gets its own size class
+const i32 SLAB_PROMOTE_COUNT = 4;
+const i32 MAX_SIZE_CLASSES = 64;
+// Most objects carved out of a single slab
+const i32 SLAB_OBJECTS = 8;
+// Fraction of a slab's buddy block that should hold objects
+const f64 SLAB_MIN_USE = 0.9;
+// Buddy allocations keep their block rounded up to a multiple of this
+// fraction of it and hand the rest back, so a size just past a power of two
+// wastes at most 1/16th of its block instead of almost half
+const size_t BUDDY_TRIM_FRACTION = 16;
+
+// Allocates from a fixed size memory pool in O(1) for common sizes.
+//
+// Frame buffers of the same resolution are allocated and freed at very high
+// rates, so sizes that repeat get their own size class. A size class carves
+// blocks of the pool into slabs of equally sized objects and keeps a free
+// list per slab. Everything else is served by a binary buddy allocator over
+// the pool, which also provides the blocks for the slabs. The end of a buddy
+// block past what an allocation needs is split into smaller blocks and freed
+// right away, and the pieces coalesce with it again when it is freed. A slab
+// is handed back to the buddy allocator once all of its objects are free,
+// unless it is the only slab with free space left in its class, in which case
+// it is kept until the buddy allocator runs out of space.
+//
+// All bookkeeping is kept on the host so the same allocator works for GPU
+// memory.
 class PoolAllocator : public Allocator {
  public:
-  PoolAllocator(DeviceHandle device, SystemAllocator* allocator,
-                size_t pool_size)
+  PoolAllocator(DeviceHandle device, Allocator* allocator, size_t pool_size)
     : device_(device), system_allocator(allocator), pool_size_(pool_size) {
     pool_ = system_allocator->allocate(pool_size_);
+
+    // Split the pool into the largest aligned power of two blocks that fit.
+    // Each block's offset is a multiple of its size, so buddies can be found
+    // by flipping a single bit of the offset.
+    size_t offset = 0;
+    for (i32 order = 63; order >= POOL_MIN_ORDER; --order) {
+      size_t block_size = (size_t)1 << order;
+      if (pool_size_ - offset >= block_size) {
+        if (free_blocks_.size() <= (size_t)order) {
+          free_blocks_.resize(order + 1);
+        }
+        free_blocks_[order].insert(offset);
+        offset += block_size;
+      }
+    }
+    max_order_ = (i32)free_blocks_.size() - 1;
+
+    // Seed size classes with the frame sizes of common video resolutions
+    const std::vector<std::tuple<size_t, size_t>> resolutions = {
+        std::make_tuple(640, 480), std::make_tuple(1280, 720),
+        std::make_tuple(1920, 1080), std::make_tuple(3840, 2160)};
+    for (auto& res : resolutions) {
+      size_t frame_size = std::get<0>(res) * std::get<1>(res) * 3;
+      add_size_class(align(frame_size));
+    }
   }
 
   ~PoolAllocator() {
+    for (Slab* slab : slabs_) {
+      delete slab;
+    }
     system_allocator->free(pool_);
   }
 
+  u8* buffer() { return pool_; }
+
+  bool owns(u8* buffer) {
+    return pointer_in_buffer(buffer, pool_, pool_ + pool_size_);
+  }
+
   u8* allocate(size_t size) {
-    Allocation alloc;
-    alloc.length = size;
+    u8* buffer = try_allocate(size);
+    if (buffer == nullptr) {
+      log_memory_usage();
+      LOG(FATAL) << "Exceeded pool size";
+    }
+    return buffer;
+  }
+
+  u8* try_allocate(size_t size) {
+    size_t aligned_size = align(std::max(size, (size_t)1));
 
     std::lock_guard<std::mutex> guard(lock_);
-    bool found = false;
-    i32 num_alloc = allocations_.size();
-    for (i32 i = 0; i < num_alloc; ++i) {
-      Allocation lower;
-      if (i == 0) {
-        lower.offset = 0;
-        lower.length = 0;
-      } else {
-        lower = allocations_[i - 1];
-      }
-      Allocation higher = allocations_[i];
-      assert(higher.offset >= lower.offset + lower.length);
-      size_t base = align(lower.offset + lower.length);
-      if ((higher.offset - base) >= size) {
-        alloc.offset = base;
-        allocations_.insert(allocations_.begin() + i, alloc);
-        found = true;
-        break;
-      }
+    size_t offset;
+    SizeClass* size_class = find_size_class(aligned_size);
+    if (size_class != nullptr && slab_allocate(*size_class, offset)) {
+      used_bytes_ += size_class->object_size;
+      return pool_ + offset;
     }
 
+    i32 order = order_for_size(aligned_size);
+    bool found = buddy_allocate(order, offset);
+    if (!found && release_empty_slabs()) {
+      found = buddy_allocate(order, offset);
+    }
     if (!found) {
-      if (num_alloc > 0) {
-        Allocation& last = allocations_[num_alloc - 1];
-        alloc.offset = align(last.offset + last.length);
-      } else {
-        alloc.offset = 0;
-      }
-      allocations_.push_back(alloc);
+      return nullptr;
     }
+    size_t block_size = (size_t)1 << order;
+    size_t granule = std::max(block_size / BUDDY_TRIM_FRACTION,
+                              (size_t)1 << POOL_MIN_ORDER);
+    size_t kept_size = (aligned_size + granule - 1) / granule * granule;
+    buddy_trim(offset, order, kept_size);
 
-    LOG_IF(FATAL, alloc.offset + alloc.length >= pool_size_)
-        << "Exceeded pool size";
-
-    u8* buffer = pool_ + alloc.offset;
-    return buffer;
+    Allocation alloc;
+    alloc.order = order;
+    alloc.size = kept_size;
+    alloc.slab = nullptr;
+    allocations_[offset] = alloc;
+    used_bytes_ += kept_size;
+    return pool_ + offset;
   }
 
+  size_t used_bytes() { return used_bytes_; }
+
+  size_t capacity() { return pool_size_; }
+
   size_t align(size_t ptr) {
     size_t alignment = system_allocator->alignment();
     size_t remainder = ptr % alignment;
@@ -214,112 +531,570 @@ class PoolAllocator : public Allocator {
         << "Pool allocator tried to free buffer not in pool";
 
     std::lock_guard<std::mutex> guard(lock_);
-    i32 index;
-    bool found = find_buffer(buffer, index);
-    LOG_IF(FATAL, !found) << "Attempted to free unallocated buffer in pool";
-
-    Allocation& alloc = allocations_[index];
-    allocations_.erase(allocations_.begin() + index);
+    size_t offset = buffer - pool_;
+    auto it = allocations_.find(offset);
+    LOG_IF(FATAL, it == allocations_.end())
+        << "Attempted to free unallocated buffer in pool";
+
+    Allocation alloc = it->second;
+    allocations_.erase(it);
+    if (alloc.slab != nullptr) {
+      used_bytes_ -= alloc.slab->size_class->object_size;
+      slab_free(alloc.slab, alloc.index);
+    } else {
+      used_bytes_ -= alloc.size;
+      buddy_free_trimmed(offset, alloc.order, alloc.size);
+    }
   }
 
  private:
-  bool find_buffer(u8* buffer, i32& index) {
-    i32 num_alloc = allocations_.size();
-    for (i32 i = 0; i < num_alloc; ++i) {
-      Allocation alloc = allocations_[i];
-      if ((size_t)buffer == (size_t)pool_ + alloc.offset) {
-        index = i;
-        return true;
+  struct SizeClass;
+
+  struct Slab {
+    SizeClass* size_class;
+    size_t offset;
+    i32 order;
+    i32 num_objects;
+    std::vector<u32> free_objects;
+    // Position in the size class' list of slabs with free objects, or -1
+    i32 partial_index;
+  };
+
+  struct SizeClass {
+    size_t object_size;
+    std::vector<Slab*> partial_slabs;
+  };
+
+  struct Allocation {
+    // Buddy block order and the bytes kept of it, unused for slab objects
+    i32 order;
+    size_t size;
+    Slab* slab;
+    u32 index;
+  };
+
+  i32 order_for_size(size_t size) {
+    i32 order = POOL_MIN_ORDER;
+    while (((size_t)1 << order) < size) {
+      order++;
+    }
+    return order;
+  }
+
+  SizeClass* add_size_class(size_t object_size) {
+    std::unique_ptr<SizeClass>& size_class = size_classes_[object_size];
+    if (!size_class) {
+      size_class.reset(new SizeClass);
+      size_class->object_size = object_size;
+    }
+    return size_class.get();
+  }
+
+  SizeClass* find_size_class(size_t size) {
+    auto it = size_classes_.find(size);
+    if (it != size_classes_.end()) {
+      return it->second.get();
+    }
+    // Only promote sizes that would waste a noticeable part of a buddy block
+    size_t block_size = (size_t)1 << order_for_size(size);
+    if (size < SLAB_MIN_OBJECT_SIZE || block_size - size <= block_size / 8 ||
+        size_classes_.size() >= MAX_SIZE_CLASSES) {
+      return nullptr;
+    }
+    if (size_counts_.size() > 1024) {
+      size_counts_.clear();
+    }
+    if (++size_counts_[size] < SLAB_PROMOTE_COUNT) {
+      return nullptr;
+    }
+    size_counts_.erase(size);
+    return add_size_class(size);
+  }
+
+  bool slab_allocate(SizeClass& size_class, size_t& offset) {
+    if (size_class.partial_slabs.empty() && !add_slab(size_class)) {
+      return false;
+    }
+    Slab* slab = size_class.partial_slabs.back();
+    u32 index = slab->free_objects.back();
+    slab->free_objects.pop_back();
+    if (slab->free_objects.empty()) {
+      size_class.partial_slabs.pop_back();
+      slab->partial_index = -1;
+    }
+
+    offset = slab->offset + index * size_class.object_size;
+    Allocation alloc;
+    alloc.order = 0;
+    alloc.size = 0;
+    alloc.slab = slab;
+    alloc.index = index;
+    allocations_[offset] = alloc;
+    return true;
+  }
+
+  bool add_slab(SizeClass& size_class) {
+    // Pick the smallest slab that uses most of its buddy block
+    size_t object_size = size_class.object_size;
+    i32 min_order = order_for_size(object_size);
+    i32 max_order =
+        std::min(order_for_size(object_size * SLAB_OBJECTS), max_order_);
+    i32 slab_order = min_order;
+    f64 best_use = 0;
+    for (i32 order = min_order; order <= max_order; ++order) {
+      size_t block_size = (size_t)1 << order;
+      f64 use = (f64)(block_size / object_size * object_size) / block_size;
+      if (use > best_use) {
+        slab_order = order;
+        best_use = use;
+      }
+      if (use >= SLAB_MIN_USE) {
+        break;
+      }
+    }
+    // Use smaller slabs as the pool fills up
+    for (i32 order = slab_order; order >= min_order; --order) {
+      size_t offset;
+      if (order > max_order_ || !buddy_allocate(order, offset)) {
+        continue;
+      }
+      Slab* slab = new Slab;
+      slab->size_class = &size_class;
+      slab->offset = offset;
+      slab->order = order;
+      slab->num_objects = ((size_t)1 << order) / size_class.object_size;
+      for (i32 i = slab->num_objects - 1; i >= 0; --i) {
+        slab->free_objects.push_back(i);
       }
+      slab->partial_index = size_class.partial_slabs.size();
+      size_class.partial_slabs.push_back(slab);
+      slabs_.insert(slab);
+      return true;
     }
     return false;
   }
 
-  typedef struct {
-    size_t offset;
-    size_t length;
-  } Allocation;
+  void slab_free(Slab* slab, u32 index) {
+    SizeClass& size_class = *slab->size_class;
+    slab->free_objects.push_back(index);
+    if (slab->partial_index < 0) {
+      slab->partial_index = size_class.partial_slabs.size();
+      size_class.partial_slabs.push_back(slab);
+    }
+
+    if ((i32)slab->free_objects.size() < slab->num_objects ||
+        size_class.partial_slabs.size() <= 1) {
+      return;
+    }
+    // Slab is empty and another slab has room, so return it to the pool
+    remove_partial_slab(slab);
+  }
+
+  void remove_partial_slab(Slab* slab) {
+    SizeClass& size_class = *slab->size_class;
+    Slab* last = size_class.partial_slabs.back();
+    size_class.partial_slabs[slab->partial_index] = last;
+    last->partial_index = slab->partial_index;
+    size_class.partial_slabs.pop_back();
+    buddy_free(slab->offset, slab->order);
+    slabs_.erase(slab);
+    delete slab;
+  }
+
+  //! Returns the memory of every empty slab to the buddy allocator.
+  bool release_empty_slabs() {
+    bool released = false;
+    for (auto& kv : size_classes_) {
+      std::vector<Slab*> partial = kv.second->partial_slabs;
+      for (Slab* slab : partial) {
+        if ((i32)slab->free_objects.size() == slab->num_objects) {
+          remove_partial_slab(slab);
+          released = true;
+        }
+      }
+    }
+    return released;
+  }
+
+  bool buddy_allocate(i32 order, size_t& offset) {
+    i32 current = order;
+    while (current <= max_order_ && free_blocks_[current].empty()) {
+      current++;
+    }
+    if (current > max_order_) {
+      return false;
+    }
+    auto it = free_blocks_[current].begin();
+    offset = *it;
+    free_blocks_[current].erase(it);
+    // Split down to the requested order, keeping the lower half each time
+    while (current > order) {
+      current--;
+      free_blocks_[current].insert(offset + ((size_t)1 << current));
+    }
+    return true;
+  }
+
+  void buddy_free(size_t offset, i32 order) {
+    while (order < max_order_) {
+      size_t buddy = offset ^ ((size_t)1 << order);
+      auto it = free_blocks_[order].find(buddy);
+      if (it == free_blocks_[order].end()) {
+        break;
+      }
+      free_blocks_[order].erase(it);
+      offset = std::min(offset, buddy);
+      order++;
+    }
+    free_blocks_[order].insert(offset);
+  }
+
+  //! Frees all of a block of the given order past its first size bytes, as
+  //! the aligned blocks it splits into. size must be a multiple of the
+  //! smallest block.
+  void buddy_trim(size_t offset, i32 order, size_t size) {
+    while (size < ((size_t)1 << order)) {
+      order--;
+      size_t half = (size_t)1 << order;
+      if (size <= half) {
+        buddy_free(offset + half, order);
+      } else {
+        offset += half;
+        size -= half;
+      }
+    }
+  }
+
+  //! Frees the first size bytes of a block that buddy_trim left them of.
+  void buddy_free_trimmed(size_t offset, i32 order, size_t size) {
+    while (size < ((size_t)1 << order)) {
+      order--;
+      size_t half = (size_t)1 << order;
+      if (size > half) {
+        buddy_free(offset, order);
+        offset += half;
+        size -= half;
+      }
+    }
+    buddy_free(offset, order);
+  }
 
   DeviceHandle device_;
   u8* pool_ = nullptr;
   size_t pool_size_;
   std::mutex lock_;
-  std::vector<Allocation> allocations_;
+  // Free buddy block offsets indexed by order
+  std::vector<std::unordered_set<size_t>> free_blocks_;
+  i32 max_order_;
+  std::unordered_map<size_t, Allocation> allocations_;
+  std::unordered_map<size_t, std::unique_ptr<SizeClass>> size_classes_;
+  std::unordered_map<size_t, i32> size_counts_;
+  std::unordered_set<Slab*> slabs_;
+  // Bytes of buddy blocks and slab objects handed out
+  std::atomic<size_t> used_bytes_{0};
+
+  Allocator* system_allocator;
+};
 
-  SystemAllocator* system_allocator;
+// Splits the CPU pool into one pool per NUMA node so that threads allocate
+// from memory local to the socket they run on. Frees go back to whichever
+// pool owns the buffer, which may be on a different node than the caller.
+class NumaPoolAllocator : public Allocator {
+ public:
+  NumaPoolAllocator(Allocator* allocator, size_t pool_size, bool bind_pages) {
+    i32 num_nodes = num_numa_nodes();
+    size_t node_pool_size = pool_size / num_nodes;
+    for (i32 node = 0; node < num_nodes; ++node) {
+      PoolAllocator* pool =
+          new PoolAllocator(CPU_DEVICE, allocator, node_pool_size);
+      // Pinned pages are already resident, so they can not be moved
+      if (bind_pages) {
+        bind_memory_to_numa_node(pool->buffer(), node_pool_size, node);
+      }
+      pools_.push_back(pool);
+    }
+  }
+
+  ~NumaPoolAllocator() {
+    for (PoolAllocator* pool : pools_) {
+      delete pool;
+    }
+  }
+
+  u8* allocate(size_t size) {
+    u8* buffer = try_allocate(size);
+    if (buffer == nullptr) {
+      log_memory_usage();
+      LOG(FATAL) << "Exceeded pool size on every NUMA node";
+    }
+    return buffer;
+  }
+
+  u8* try_allocate(size_t size) {
+    i32 node = current_numa_node();
+    if (node >= (i32)pools_.size()) {
+      node = 0;
+    }
+    // Remote memory is still better than none
+    for (size_t i = 0; i < pools_.size(); ++i) {
+      u8* buffer = pools_[(node + i) % pools_.size()]->try_allocate(size);
+      if (buffer != nullptr) {
+        return buffer;
+      }
+    }
+    return nullptr;
+  }
+
+  size_t used_bytes() {
+    size_t used = 0;
+    for (PoolAllocator* pool : pools_) {
+      used += pool->used_bytes();
+    }
+    return used;
+  }
+
+  size_t capacity() {
+    size_t total = 0;
+    for (PoolAllocator* pool : pools_) {
+      total += pool->capacity();
+    }
+    return total;
+  }
+
+  void free(u8* buffer) {
+    for (PoolAllocator* pool : pools_) {
+      if (pool->owns(buffer)) {
+        pool->free(buffer);
+        return;
+      }
+    }
+    LOG(FATAL) << "NUMA pool allocator tried to free buffer not in any pool";
+  }
+
+ private:
+  std::vector<PoolAllocator*> pools_;
+};
+
+// Serves allocations from a pool and, once the pool is full, from the system
+// allocator up to a fixed number of bytes. This lets a tight pool ride out a
+// burst instead of aborting the worker.
+class OverflowAllocator : public Allocator {
+ public:
+  OverflowAllocator(Allocator* pool, SystemAllocator* system_allocator,
+                    size_t overflow_size)
+    : pool_(pool),
+      system_allocator_(system_allocator),
+      overflow_size_(overflow_size) {}
+
+  ~OverflowAllocator() {
+    for (auto& kv : overflow_buffers_) {
+      system_allocator_->free(kv.first);
+    }
+    delete pool_;
+  }
+
+  u8* allocate(size_t size) {
+    u8* buffer = try_allocate(size);
+    if (buffer == nullptr) {
+      log_memory_usage();
+      LOG(FATAL) << "Exceeded pool size and " << overflow_size_
+                 << " bytes of overflow";
+    }
+    return buffer;
+  }
+
+  u8* try_allocate(size_t size) {
+    u8* buffer = pool_->try_allocate(size);
+    if (buffer != nullptr) {
+      return buffer;
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    if (overflow_used_ + size > overflow_size_) {
+      return nullptr;
+    }
+    buffer = system_allocator_->allocate(size);
+    overflow_buffers_[buffer] = size;
+    overflow_used_ += size;
+    num_overflow_buffers_++;
+    VLOG(1) << "Pool full, " << overflow_used_ << " bytes of overflow in use";
+    return buffer;
+  }
+
+  void free(u8* buffer) {
+    // Skip the lock in the common case of nothing having overflowed
+    if (num_overflow_buffers_ > 0) {
+      std::lock_guard<std::mutex> guard(lock_);
+      auto it = overflow_buffers_.find(buffer);
+      if (it != overflow_buffers_.end()) {
+        overflow_used_ -= it->second;
+        overflow_buffers_.erase(it);
+        num_overflow_buffers_--;
+        system_allocator_->free(buffer);
+        return;
+      }
+    }
+    pool_->free(buffer);
+  }
+
+  size_t alignment() { return pool_->alignment(); }
+
+  size_t used_bytes() {
+    std::lock_guard<std::mutex> guard(lock_);
+    return pool_->used_bytes() + overflow_used_;
+  }
+
+  size_t capacity() { return pool_->capacity(); }
+
+ private:
+  Allocator* pool_;
+  SystemAllocator* system_allocator_;
+  size_t overflow_size_;
+  std::mutex lock_;
+  std::unordered_map<u8*, size_t> overflow_buffers_;
+  size_t overflow_used_ = 0;
+  std::atomic<i64> num_overflow_buffers_{0};
 };
 
+// Buffers a thread may keep in its cache for each size
+const i32 THREAD_CACHE_BUFFERS_PER_SIZE = 4;
+// Total bytes a thread may keep in its cache
+const size_t THREAD_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+// Cached buffers unused for this long are returned to the allocator
+const i64 THREAD_CACHE_IDLE_MS = 1000;
+// Threads are hashed onto this many caches
+const i32 NUM_THREAD_CACHES = 64;
+// Total bytes all caches of an allocator may keep, and the most of its pool
+// they may keep
+const size_t BLOCK_CACHE_MAX_BYTES = 256 * 1024 * 1024;
+const size_t BLOCK_CACHE_MAX_POOL_FRACTION = 8;
+
+i32 thread_cache_index() {
+  static std::atomic<i32> next_index{0};
+  static thread_local i32 index = next_index++ % NUM_THREAD_CACHES;
+  return index;
+}
+
 class BlockAllocator {
  public:
-  BlockAllocator(Allocator* allocator) : allocator_(allocator) {}
+  BlockAllocator(DeviceHandle device, Allocator* allocator)
+    : device_(device), allocator_(allocator), caches_(NUM_THREAD_CACHES) {
+    max_cached_bytes_ = BLOCK_CACHE_MAX_BYTES;
+    if (allocator_->capacity() > 0) {
+      max_cached_bytes_ =
+          std::min(max_cached_bytes_,
+                   allocator_->capacity() / BLOCK_CACHE_MAX_POOL_FRACTION);
+    }
+  }
 
   ~BlockAllocator() {
     std::lock_guard<std::mutex> guard(lock_);
 
-    for (Allocation& alloc : allocations_) {
+    for (auto& kv : allocations_) {
+      Allocation& alloc = kv.second;
       assert(alloc.refs > 0);
       allocator_->free(alloc.buffer);
     }
+    for (ThreadCache& cache : caches_) {
+      std::lock_guard<std::mutex> cache_guard(cache.lock);
+      for (auto& kv : cache.buffers) {
+        for (CachedBuffer& cached : kv.second) {
+          allocator_->free(cached.buffer);
+        }
+      }
+    }
   }
 
   u8* allocate(size_t size, i32 refs) {
-    u8* buffer = allocator_->allocate(size);
+    u8* buffer = take_cached(size);
+    if (buffer == nullptr) {
+      std::vector<u8*> idle;
+      trim_other_caches(idle);
+      for (u8* b : idle) {
+        allocator_->free(b);
+      }
+      buffer = allocator_->try_allocate(size);
+    }
+    if (buffer == nullptr) {
+      // The caches of other threads may hold the memory this needs
+      flush_caches();
+      buffer = allocator_->allocate(size);
+    }
 
     Allocation alloc;
     alloc.buffer = buffer;
     alloc.size = size;
     alloc.refs = refs;
+    alloc.tag = current_memory_tag;
+    account_allocation(device_, alloc.tag, size);
 
     std::lock_guard<std::mutex> guard(lock_);
-    allocations_.push_back(alloc);
+    allocations_[(size_t)buffer] = alloc;
 
     return buffer;
   }
 
   void add_ref(u8* buffer) {
-    std::lock_guard<std::mutex> guard(lock_);
-
-    i32 index;
-    bool found = find_buffer(buffer, index);
+    bool found = try_add_ref(buffer);
     LOG_IF(FATAL, !found)
         << "Block allocator tried to add ref to non-block buffer";
+  }
+
+  //! Adds a reference if the buffer is in a block, otherwise returns false.
+  bool try_add_ref(u8* buffer) {
+    std::lock_guard<std::mutex> guard(lock_);
+
+    auto it = find_buffer(buffer);
+    if (it == allocations_.end()) {
+      return false;
+    }
 
-    Allocation& alloc = allocations_[index];
+    Allocation& alloc = it->second;
     alloc.refs += 1;
+    return true;
   }
 
   void free(u8* buffer) {
-    std::lock_guard<std::mutex> guard(lock_);
-
-    i32 index;
-    bool found = find_buffer(buffer, index);
+    bool found = try_free(buffer);
     LOG_IF(FATAL, !found) << "Block allocator freed non-block buffer";
+  }
 
-    Allocation& alloc = allocations_[index];
-    assert(alloc.refs > 0);
-    alloc.refs -= 1;
+  //! Drops a reference if the buffer is in a block, otherwise returns false.
+  bool try_free(u8* buffer) {
+    Allocation alloc;
+    {
+      std::lock_guard<std::mutex> guard(lock_);
 
-    if (alloc.refs == 0) {
-      allocator_->free(alloc.buffer);
-      allocations_.erase(allocations_.begin() + index);
-      return;
+      auto it = find_buffer(buffer);
+      if (it == allocations_.end()) {
+        return false;
+      }
+
+      Allocation& found = it->second;
+      assert(found.refs > 0);
+      found.refs -= 1;
+      if (found.refs > 0) {
+        return true;
+      }
+      alloc = found;
+      allocations_.erase(it);
     }
+    account_free(device_, alloc.tag, alloc.size);
+    give_cached(alloc.buffer, alloc.size);
+    return true;
   }
 
   bool buffers_in_same_block(std::vector<u8*> buffers) {
     assert(buffers.size() > 0);
 
     std::lock_guard<std::mutex> guard(lock_);
-    i32 base_index;
-    bool found = find_buffer(buffers[0], base_index);
-    if (!found) {
+    auto base = find_buffer(buffers[0]);
+    if (base == allocations_.end()) {
       return false;
     }
 
     for (i32 i = 1; i < buffers.size(); ++i) {
-      i32 index;
-      found = find_buffer(buffers[i], index);
-      if (!found || base_index != index) {
+      auto it = find_buffer(buffers[i]);
+      if (it == allocations_.end() || base != it) {
         return false;
       }
     }
@@ -329,40 +1104,372 @@ class BlockAllocator {
 
   bool buffer_in_block(u8* buffer) {
     std::lock_guard<std::mutex> guard(lock_);
-    i32 index;
-    return find_buffer(buffer, index);
+    return find_buffer(buffer) != allocations_.end();
   }
 
- private:
-  bool find_buffer(u8* buffer, i32& index) {
-    i32 num_alloc = allocations_.size();
-    for (i32 i = 0; i < num_alloc; ++i) {
-      Allocation alloc = allocations_[i];
-      if (pointer_in_buffer(buffer, alloc.buffer, alloc.buffer + alloc.size)) {
-        index = i;
-        return true;
-      }
+  //! Bytes of free blocks kept in the caches, which the allocator below
+  //! counts as used.
+  size_t cached_bytes() { return cached_bytes_; }
+
+  //! Hands every cached block back to the allocator below.
+  void flush_caches() {
+    std::vector<u8*> to_free;
+    for (ThreadCache& cache : caches_) {
+      std::lock_guard<std::mutex> guard(cache.lock);
+      trim_cache(cache, std::chrono::steady_clock::now(), true, to_free);
+    }
+    for (u8* b : to_free) {
+      allocator_->free(b);
     }
-    return false;
   }
 
+ private:
   typedef struct {
     u8* buffer;
     size_t size;
     i32 refs;
+    i32 tag;
   } Allocation;
 
+  typedef struct {
+    u8* buffer;
+    std::chrono::steady_clock::time_point last_used;
+  } CachedBuffer;
+
+  // Free blocks kept around for reuse by the threads hashed onto this cache,
+  // since the same thread usually allocates identically sized blocks in a
+  // loop. The lock is only contended by threads sharing a cache.
+  struct ThreadCache {
+    std::mutex lock;
+    std::map<size_t, std::vector<CachedBuffer>> buffers;
+    size_t bytes = 0;
+    std::chrono::steady_clock::time_point last_trim;
+  };
+
+  std::map<size_t, Allocation>::iterator find_buffer(u8* buffer) {
+    // Last block starting at or before the buffer
+    auto it = allocations_.upper_bound((size_t)buffer);
+    if (it == allocations_.begin()) {
+      return allocations_.end();
+    }
+    --it;
+    Allocation& alloc = it->second;
+    if (!pointer_in_buffer(buffer, alloc.buffer, alloc.buffer + alloc.size)) {
+      return allocations_.end();
+    }
+    return it;
+  }
+
+  u8* take_cached(size_t size) {
+    ThreadCache& cache = caches_[thread_cache_index()];
+    std::lock_guard<std::mutex> guard(cache.lock);
+    auto it = cache.buffers.find(size);
+    if (it == cache.buffers.end() || it->second.empty()) {
+      return nullptr;
+    }
+    u8* buffer = it->second.back().buffer;
+    it->second.pop_back();
+    cache.bytes -= size;
+    cached_bytes_ -= size;
+    return buffer;
+  }
+
+  // Removes the buffers of a cache unused for THREAD_CACHE_IDLE_MS, or all
+  // of them, adding them to to_free. Must be called with the cache locked.
+  void trim_cache(ThreadCache& cache,
+                  std::chrono::steady_clock::time_point current, bool all,
+                  std::vector<u8*>& to_free) {
+    auto idle = std::chrono::milliseconds(THREAD_CACHE_IDLE_MS);
+    for (auto& kv : cache.buffers) {
+      std::vector<CachedBuffer>& entries = kv.second;
+      auto keep = std::partition(
+          entries.begin(), entries.end(), [&](const CachedBuffer& c) {
+            return !all && current - c.last_used <= idle;
+          });
+      for (auto e = keep; e != entries.end(); ++e) {
+        to_free.push_back(e->buffer);
+        cache.bytes -= kv.first;
+        cached_bytes_ -= kv.first;
+      }
+      entries.erase(keep, entries.end());
+    }
+    cache.last_trim = current;
+  }
+
+  void give_cached(u8* buffer, size_t size) {
+    std::vector<u8*> to_free;
+    {
+      ThreadCache& cache = caches_[thread_cache_index()];
+      std::lock_guard<std::mutex> guard(cache.lock);
+      auto current = std::chrono::steady_clock::now();
+      std::vector<CachedBuffer>& cached = cache.buffers[size];
+      if (cached.size() < THREAD_CACHE_BUFFERS_PER_SIZE &&
+          cache.bytes + size <= THREAD_CACHE_MAX_BYTES &&
+          cached_bytes_ + size <= max_cached_bytes_) {
+        cached.push_back(CachedBuffer{buffer, current});
+        cache.bytes += size;
+        cached_bytes_ += size;
+      } else {
+        to_free.push_back(buffer);
+      }
+      // Periodically hand buffers that have not been reused back to the
+      // allocator so other threads can use the memory
+      auto idle = std::chrono::milliseconds(THREAD_CACHE_IDLE_MS);
+      if (current - cache.last_trim > idle) {
+        trim_cache(cache, current, false, to_free);
+      }
+    }
+    trim_other_caches(to_free);
+    for (u8* b : to_free) {
+      allocator_->free(b);
+    }
+  }
+
+  // Trims the caches of threads which stopped freeing, and so never trim
+  // their own, about once every THREAD_CACHE_IDLE_MS. Called on frees and
+  // cache misses of any thread.
+  void trim_other_caches(std::vector<u8*>& to_free) {
+    auto current = std::chrono::steady_clock::now();
+    i64 current_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         current.time_since_epoch())
+                         .count();
+    i64 last_ms = last_trim_ms_;
+    if (current_ms - last_ms < THREAD_CACHE_IDLE_MS ||
+        !last_trim_ms_.compare_exchange_strong(last_ms, current_ms)) {
+      return;
+    }
+    auto idle = std::chrono::milliseconds(THREAD_CACHE_IDLE_MS);
+    for (ThreadCache& cache : caches_) {
+      std::unique_lock<std::mutex> lk(cache.lock, std::try_to_lock);
+      if (lk.owns_lock() && current - cache.last_trim > idle) {
+        trim_cache(cache, current, false, to_free);
+      }
+    }
+  }
+
+  DeviceHandle device_;
   std::mutex lock_;
-  std::vector<Allocation> allocations_;
+  // Live blocks indexed by start address
+  std::map<size_t, Allocation> allocations_;
   Allocator* allocator_;
+  std::vector<ThreadCache> caches_;
+  std::atomic<size_t> cached_bytes_{0};
+  size_t max_cached_bytes_;
+  std::atomic<i64> last_trim_ms_{0};
+};
+
+#ifdef HAVE_CUDA
+// Fixed size pinned host buffer that pageable host data is copied through on
+// its way to a GPU. Space is handed out in order around the ring and reclaimed
+// once the transfer that used it has completed, so only this buffer has to be
+// page locked instead of the whole CPU pool.
+class StagingRing {
+ public:
+  StagingRing(i32 device_id, size_t size) : device_id_(device_id), size_(size) {
+    CU_CHECK(cudaSetDevice(device_id_));
+    CU_CHECK(cudaMallocHost((void**)&buffer_, size_));
+  }
+
+  ~StagingRing() {
+    for (Region& region : in_flight_) {
+      if (region.recorded) {
+        cudaEventSynchronize(region.done);
+        cudaEventDestroy(region.done);
+      }
+    }
+    for (cudaEvent_t event : free_events_) {
+      cudaEventDestroy(event);
+    }
+    cudaFreeHost(buffer_);
+  }
+
+  size_t capacity() const { return size_; }
+
+  //! Blocks until size contiguous bytes are free and returns them.
+  u8* reserve(size_t size) {
+    assert(size <= size_);
+    std::unique_lock<std::mutex> lock(lock_);
+    size_t offset;
+    while (!try_reserve(size, offset)) {
+      // Wait for the oldest transfer so its space can be reused
+      Region& oldest = in_flight_.front();
+      if (!oldest.recorded) {
+        recorded_.wait(lock);
+        continue;
+      }
+      cudaEvent_t done = oldest.done;
+      lock.unlock();
+      CU_CHECK(cudaEventSynchronize(done));
+      lock.lock();
+      reclaim();
+    }
+    Region region;
+    region.offset = offset;
+    region.size = size;
+    region.recorded = false;
+    in_flight_.push_back(region);
+    head_ = offset + size;
+    return buffer_ + offset;
+  }
+
+  //! Keeps the reservation at buffer in use until stream passes this point.
+  void release_after(u8* buffer, cudaStream_t stream) {
+    std::unique_lock<std::mutex> lock(lock_);
+    size_t offset = buffer - buffer_;
+    for (Region& region : in_flight_) {
+      if (region.offset == offset && !region.recorded) {
+        if (free_events_.empty()) {
+          CU_CHECK(cudaSetDevice(device_id_));
+          cudaEvent_t event;
+          CU_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+          free_events_.push_back(event);
+        }
+        region.done = free_events_.back();
+        free_events_.pop_back();
+        CU_CHECK(cudaEventRecord(region.done, stream));
+        region.recorded = true;
+        break;
+      }
+    }
+    recorded_.notify_all();
+  }
+
+ private:
+  struct Region {
+    size_t offset;
+    size_t size;
+    bool recorded;
+    cudaEvent_t done;
+  };
+
+  bool try_reserve(size_t size, size_t& offset) {
+    reclaim();
+    if (in_flight_.empty()) {
+      head_ = 0;
+      offset = 0;
+      return true;
+    }
+    size_t tail = in_flight_.front().offset;
+    if (head_ > tail) {
+      // Free space runs from head to the end and then from the start to tail
+      if (size_ - head_ >= size) {
+        offset = head_;
+        return true;
+      }
+      if (tail >= size) {
+        offset = 0;
+        return true;
+      }
+      return false;
+    }
+    // Used space has wrapped, so the free space lies between head and tail
+    if (tail - head_ >= size) {
+      offset = head_;
+      return true;
+    }
+    return false;
+  }
+
+  // Drops regions whose transfers have finished, oldest first
+  void reclaim() {
+    while (!in_flight_.empty()) {
+      Region& oldest = in_flight_.front();
+      if (!oldest.recorded || cudaEventQuery(oldest.done) != cudaSuccess) {
+        break;
+      }
+      free_events_.push_back(oldest.done);
+      in_flight_.pop_front();
+    }
+  }
+
+  const i32 device_id_;
+  const size_t size_;
+  u8* buffer_ = nullptr;
+  size_t head_ = 0;
+  std::mutex lock_;
+  std::condition_variable recorded_;
+  std::deque<Region> in_flight_;
+  std::vector<cudaEvent_t> free_events_;
+};
+#endif
+
+// Extra references held on buffers that came from a system allocator rather
+// than a block. A buffer without an entry has a single reference.
+static std::mutex system_buffer_refs_mutex;
+static std::unordered_map<u8*, i32> system_buffer_refs;
+static std::atomic<i64> num_system_buffer_refs{0};
+
+// Size and memory tag of each live system buffer, sharded by address so that
+// threads allocating at the same time rarely wait on each other
+const i32 NUM_SYSTEM_BUFFER_SHARDS = 16;
+
+struct SystemBufferShard {
+  std::mutex lock;
+  std::unordered_map<u8*, std::tuple<i32, size_t>> buffers;
+};
+
+static SystemBufferShard system_buffer_shards[NUM_SYSTEM_BUFFER_SHARDS];
+
+SystemBufferShard& system_buffer_shard(u8* buffer) {
+  return system_buffer_shards[((size_t)buffer >> 8) %
+                              NUM_SYSTEM_BUFFER_SHARDS];
+}
+
+// Memory owned outside of the allocators that buffers may point into, keyed
+// by start address
+struct ExternalBuffer {
+  size_t size;
+  i32 refs;
+  std::function<void()> release;
 };
 
+static std::mutex external_buffers_mutex;
+static std::map<size_t, ExternalBuffer> external_buffers;
+static std::atomic<i64> num_external_buffers{0};
+
+// Adds delta references to the external buffer containing buffer and
+// releases it if none are left. Returns false if no external buffer
+// contains buffer.
+bool try_update_external_buffer(u8* buffer, i32 delta) {
+  if (num_external_buffers == 0) {
+    return false;
+  }
+  std::function<void()> release;
+  {
+    std::lock_guard<std::mutex> guard(external_buffers_mutex);
+    auto it = external_buffers.upper_bound((size_t)buffer);
+    if (it == external_buffers.begin()) {
+      return false;
+    }
+    --it;
+    if ((size_t)buffer >= it->first + it->second.size) {
+      return false;
+    }
+    it->second.refs += delta;
+    if (it->second.refs > 0) {
+      return true;
+    }
+    release = std::move(it->second.release);
+    external_buffers.erase(it);
+    num_external_buffers--;
+  }
+  release();
+  return true;
+}
+
 static SystemAllocator* cpu_system_allocator = nullptr;
 static std::map<i32, SystemAllocator*> gpu_system_allocators;
-static PoolAllocator* cpu_pool_allocator = nullptr;
+static HugePageAllocator* cpu_huge_page_allocator = nullptr;
+static Allocator* cpu_pool_allocator = nullptr;
 static BlockAllocator* cpu_block_allocator = nullptr;
-static std::map<i32, PoolAllocator*> gpu_pool_allocators;
+static std::map<i32, Allocator*> gpu_pool_allocators;
+// Fraction of each pool that may be in use before memory_over_soft_limit()
+static f64 cpu_pool_soft_limit = 0;
+static f64 gpu_pool_soft_limit = 0;
 static std::map<i32, BlockAllocator*> gpu_block_allocators;
+#ifdef HAVE_CUDA
+static std::map<i32, StagingRing*> gpu_staging_rings;
+#endif
 
 void init_memory_allocators(MemoryPoolConfig config,
                             std::vector<i32> gpu_device_ids) {
@@ -376,12 +1483,34 @@ void init_memory_allocators(MemoryPoolConfig config,
     LOG_IF(FATAL, config.cpu().free_space() > total_mem)
         << "Requested CPU free space (" << config.cpu().free_space() << ") "
         << "larger than total CPU memory size ( " << total_mem << ")";
-    cpu_pool_allocator =
-        new PoolAllocator(CPU_DEVICE, cpu_system_allocator,
-                          total_mem - config.cpu().free_space());
+    size_t pool_size = total_mem - config.cpu().free_space();
+    Allocator* cpu_pool_base = cpu_system_allocator;
+    if (config.cpu_huge_page_size() > 0) {
+      LOG_IF(FATAL, config.cpu_huge_page_size() != HUGE_PAGE_2MB &&
+                        config.cpu_huge_page_size() != HUGE_PAGE_1GB)
+          << "Huge page size must be 2 MB or 1 GB, not "
+          << config.cpu_huge_page_size();
+      cpu_huge_page_allocator = new HugePageAllocator(
+          config.cpu_huge_page_size(), config.pinned_cpu());
+      cpu_pool_base = cpu_huge_page_allocator;
+    }
+    if (num_numa_nodes() > 1) {
+      cpu_pool_allocator = new NumaPoolAllocator(cpu_pool_base, pool_size,
+                                                 !config.pinned_cpu());
+    } else {
+      cpu_pool_allocator =
+          new PoolAllocator(CPU_DEVICE, cpu_pool_base, pool_size);
+    }
+    if (config.cpu().overflow_size() > 0) {
+      cpu_pool_allocator =
+          new OverflowAllocator(cpu_pool_allocator, cpu_system_allocator,
+                                config.cpu().overflow_size());
+    }
+    cpu_pool_soft_limit = config.cpu().soft_limit();
     cpu_block_allocator_base = cpu_pool_allocator;
   }
-  cpu_block_allocator = new BlockAllocator(cpu_block_allocator_base);
+  cpu_block_allocator =
+      new BlockAllocator(CPU_DEVICE, cpu_block_allocator_base);
 
 #ifdef HAVE_CUDA
   for (i32 device_id : gpu_device_ids) {
@@ -397,12 +1526,23 @@ void init_memory_allocators(MemoryPoolConfig config,
           << "Requested GPU free space (" << config.gpu().free_space() << ") "
           << "larger than total GPU memory size ( " << total_mem << ") "
           << "on device " << device_id;
-      gpu_pool_allocators[device.id] = new PoolAllocator(
+      Allocator* gpu_pool = new PoolAllocator(
           device, gpu_system_allocator, total_mem - config.gpu().free_space());
-      gpu_block_allocator_base = gpu_pool_allocators[device.id];
+      if (config.gpu().overflow_size() > 0) {
+        gpu_pool = new OverflowAllocator(gpu_pool, gpu_system_allocator,
+                                         config.gpu().overflow_size());
+      }
+      gpu_pool_allocators[device.id] = gpu_pool;
+      gpu_pool_soft_limit = config.gpu().soft_limit();
+      gpu_block_allocator_base = gpu_pool;
     }
     gpu_block_allocators[device.id] =
-        new BlockAllocator(gpu_block_allocator_base);
+        new BlockAllocator(device, gpu_block_allocator_base);
+    // A pinned CPU pool can already be copied from at full speed
+    if (config.gpu_staging_size() > 0 && !config.pinned_cpu()) {
+      gpu_staging_rings[device.id] =
+          new StagingRing(device.id, config.gpu_staging_size());
+    }
   }
 #endif
 }
@@ -413,6 +1553,12 @@ void destroy_memory_allocators() {
     delete cpu_pool_allocator;
     cpu_pool_allocator = nullptr;
   }
+  if (cpu_huge_page_allocator) {
+    delete cpu_huge_page_allocator;
+    cpu_huge_page_allocator = nullptr;
+  }
+  cpu_pool_soft_limit = 0;
+  gpu_pool_soft_limit = 0;
   delete cpu_system_allocator;
 
 #ifdef HAVE_CUDA
@@ -425,12 +1571,83 @@ void destroy_memory_allocators() {
   for (auto entry : gpu_system_allocators) {
     delete entry.second;
   }
+  for (auto entry : gpu_staging_rings) {
+    delete entry.second;
+  }
+  gpu_staging_rings.clear();
   gpu_block_allocators.clear();
   gpu_pool_allocators.clear();
   gpu_system_allocators.clear();
 #endif
 }
 
+bool memory_over_soft_limit() {
+  // Cached free blocks are used as far as the pool can tell, but are handed
+  // back as soon as it runs out
+  auto over_limit = [](Allocator* pool, BlockAllocator* blocks,
+                       f64 soft_limit) {
+    size_t used = pool->used_bytes();
+    used -= std::min(used, blocks->cached_bytes());
+    return soft_limit > 0 && used > soft_limit * pool->capacity();
+  };
+  if (cpu_pool_allocator != nullptr &&
+      over_limit(cpu_pool_allocator, cpu_block_allocator,
+                 cpu_pool_soft_limit)) {
+    return true;
+  }
+  for (auto& kv : gpu_pool_allocators) {
+    if (over_limit(kv.second, gpu_block_allocators.at(kv.first),
+                   gpu_pool_soft_limit)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static i64 pool_budget(Allocator* pool, f64 soft_limit) {
+  return (i64)((soft_limit > 0 ? soft_limit : 1.0) * pool->capacity());
+}
+
+i64 memory_pool_budget(DeviceType device_type) {
+  if (device_type == DeviceType::CPU) {
+    return cpu_pool_allocator != nullptr
+               ? pool_budget(cpu_pool_allocator, cpu_pool_soft_limit)
+               : 0;
+  }
+  i64 total = 0;
+  for (auto& kv : gpu_pool_allocators) {
+    total += pool_budget(kv.second, gpu_pool_soft_limit);
+  }
+  return total;
+}
+
+i64 device_memory_capacity(DeviceHandle device) {
+  if (device.type != DeviceType::GPU) {
+    return 0;
+  }
+  auto it = gpu_pool_allocators.find(device.id);
+  if (it != gpu_pool_allocators.end()) {
+    return pool_budget(it->second, gpu_pool_soft_limit);
+  }
+#ifdef HAVE_CUDA
+  cudaDeviceProp prop;
+  CU_CHECK(cudaGetDeviceProperties(&prop, device.id));
+  return prop.totalGlobalMem;
+#else
+  return 0;
+#endif
+}
+
+size_t cpu_pool_page_size() {
+  if (cpu_pool_allocator == nullptr) {
+    return 0;
+  }
+  if (cpu_huge_page_allocator != nullptr) {
+    return cpu_huge_page_allocator->page_size();
+  }
+  return sysconf(_SC_PAGESIZE);
+}
+
 SystemAllocator* system_allocator_for_device(DeviceHandle device) {
   if (device.type == DeviceType::CPU) {
     return cpu_system_allocator;
@@ -456,7 +1673,12 @@ BlockAllocator* block_allocator_for_device(DeviceHandle device) {
 u8* new_buffer(DeviceHandle device, size_t size) {
   assert(size > 0);
   SystemAllocator* allocator = system_allocator_for_device(device);
-  return allocator->allocate(size);
+  u8* buffer = allocator->allocate(size);
+  account_allocation(device, current_memory_tag, size);
+  SystemBufferShard& shard = system_buffer_shard(buffer);
+  std::lock_guard<std::mutex> guard(shard.lock);
+  shard.buffers[buffer] = std::make_tuple(current_memory_tag, size);
+  return buffer;
 }
 
 u8* new_block_buffer(DeviceHandle device, size_t size, i32 refs) {
@@ -465,34 +1687,174 @@ u8* new_block_buffer(DeviceHandle device, size_t size, i32 refs) {
   return allocator->allocate(size, refs);
 }
 
+u8* new_external_buffer(u8* data, size_t size, i32 refs,
+                        std::function<void()> release) {
+  assert(size > 0);
+  if (refs <= 0) {
+    release();
+    return data;
+  }
+  std::lock_guard<std::mutex> guard(external_buffers_mutex);
+  external_buffers[(size_t)data] = ExternalBuffer{size, refs, release};
+  num_external_buffers++;
+  return data;
+}
+
 void add_buffer_ref(DeviceHandle device, u8* buffer) {
   assert(buffer != nullptr);
   BlockAllocator* block_allocator = block_allocator_for_device(device);
-  block_allocator->add_ref(buffer);
+  if (block_allocator->try_add_ref(buffer)) {
+    return;
+  }
+  if (device.type == DeviceType::CPU &&
+      try_update_external_buffer(buffer, 1)) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(system_buffer_refs_mutex);
+  system_buffer_refs[buffer]++;
+  num_system_buffer_refs++;
 }
 
 void delete_buffer(DeviceHandle device, u8* buffer) {
   assert(buffer != nullptr);
   BlockAllocator* block_allocator = block_allocator_for_device(device);
-  if (block_allocator->buffer_in_block(buffer)) {
-    block_allocator->free(buffer);
-  } else {
-    SystemAllocator* system_allocator = system_allocator_for_device(device);
-    system_allocator->free(buffer);
+  if (block_allocator->try_free(buffer)) {
+    return;
+  }
+  if (device.type == DeviceType::CPU &&
+      try_update_external_buffer(buffer, -1)) {
+    return;
+  }
+  // Skip the lock when no system buffer is shared
+  if (num_system_buffer_refs > 0) {
+    std::lock_guard<std::mutex> guard(system_buffer_refs_mutex);
+    auto it = system_buffer_refs.find(buffer);
+    if (it != system_buffer_refs.end()) {
+      num_system_buffer_refs--;
+      if (--it->second == 0) {
+        system_buffer_refs.erase(it);
+      }
+      return;
+    }
+  }
+  {
+    SystemBufferShard& shard = system_buffer_shard(buffer);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto it = shard.buffers.find(buffer);
+    if (it != shard.buffers.end()) {
+      account_free(device, std::get<0>(it->second), std::get<1>(it->second));
+      shard.buffers.erase(it);
+    }
+  }
+  SystemAllocator* system_allocator = system_allocator_for_device(device);
+  system_allocator->free(buffer);
+}
+
+#ifdef HAVE_CUDA
+namespace {
+
+bool is_pinned_host_buffer(const u8* buffer) {
+  cudaPointerAttributes attributes;
+  if (cudaPointerGetAttributes(&attributes, buffer) != cudaSuccess) {
+    // Pageable memory unknown to CUDA reports an error, so clear it
+    cudaGetLastError();
+    return false;
+  }
+#if CUDART_VERSION >= 10000
+  return attributes.type == cudaMemoryTypeHost;
+#else
+  return attributes.memoryType == cudaMemoryTypeHost;
+#endif
+}
+
+StagingRing* staging_ring_for_device(DeviceHandle device) {
+  auto it = gpu_staging_rings.find(device.id);
+  return it == gpu_staging_rings.end() ? nullptr : it->second;
+}
+
+// Copies host data to the GPU through the staging ring in chunks, so that
+// filling one chunk overlaps the transfer of the previous one
+void staged_memcpy_async(StagingRing* ring, std::vector<u8*>& dest_buffers,
+                         const std::vector<u8*>& src_buffers,
+                         std::vector<size_t>& sizes, cudaStream_t stream) {
+  const size_t chunk_size = std::max(ring->capacity() / 4, (size_t)1);
+  i32 n = dest_buffers.size();
+  i32 element = 0;
+  size_t element_offset = 0;
+  while (true) {
+    // Skip empty elements
+    while (element < n && sizes[element] == 0) {
+      element++;
+    }
+    if (element >= n) {
+      break;
+    }
+    size_t remaining = 0;
+    for (i32 i = element; i < n && remaining < chunk_size; ++i) {
+      remaining += sizes[i] - (i == element ? element_offset : 0);
+    }
+    size_t chunk = std::min(chunk_size, remaining);
+    u8* staged = ring->reserve(chunk);
+    size_t filled = 0;
+    while (filled < chunk) {
+      size_t piece =
+          std::min(sizes[element] - element_offset, chunk - filled);
+      memcpy(staged + filled, src_buffers[element] + element_offset, piece);
+      CU_CHECK(cudaMemcpyAsync(dest_buffers[element] + element_offset,
+                               staged + filled, piece, cudaMemcpyDefault,
+                               stream));
+      filled += piece;
+      element_offset += piece;
+      if (element_offset == sizes[element]) {
+        element++;
+        element_offset = 0;
+      }
+    }
+    ring->release_after(staged, stream);
+  }
+}
+}
+#endif
+
+#ifdef HAVE_CUDA
+// Copies between GPUs use a peer to peer link if the two have one. Otherwise
+// cudaMemcpyDefault has the driver stage them through host memory.
+static void enable_peer_access(DeviceHandle src_device,
+                               DeviceHandle dest_device) {
+  if (src_device.type != DeviceType::GPU ||
+      dest_device.type != DeviceType::GPU || src_device.id == dest_device.id) {
+    return;
+  }
+  static std::mutex peer_mutex;
+  static std::set<std::tuple<i32, i32>> peer_pairs;
+  std::lock_guard<std::mutex> lock(peer_mutex);
+  if (!peer_pairs.insert(std::make_tuple(src_device.id, dest_device.id))
+           .second) {
+    return;
+  }
+  int can_access = 0;
+  CU_CHECK(cudaDeviceCanAccessPeer(&can_access, src_device.id,
+                                   dest_device.id));
+  if (can_access) {
+    CU_CHECK(cudaSetDevice(src_device.id));
+    cudaError_t err = cudaDeviceEnablePeerAccess(dest_device.id, 0);
+    if (err == cudaErrorPeerAccessAlreadyEnabled) {
+      cudaGetLastError();
+    } else {
+      CU_CHECK(err);
+    }
   }
 }
+#endif
 
-// FIXME(wcrichto): case if transferring between two different GPUs
 void memcpy_buffer(u8* dest_buffer, DeviceHandle dest_device,
                    const u8* src_buffer, DeviceHandle src_device, size_t size) {
   if (dest_device.type == DeviceType::CPU &&
       src_device.type == DeviceType::CPU) {
     memcpy(dest_buffer, src_buffer, size);
   } else {
-    assert(!(dest_device.type == DeviceType::GPU &&
-             src_device.type == DeviceType::GPU &&
-             dest_device.id != src_device.id));
     CUDA_PROTECT({
+      enable_peer_access(src_device, dest_device);
       CU_CHECK(cudaSetDevice(src_device.id));
       //CU_CHECK(cudaMemcpyAsync(dest_buffer, src_buffer, size, cudaMemcpyDefault, 0));
       CU_CHECK(
@@ -508,7 +1870,6 @@ void memcpy_buffer(u8* dest_buffer, DeviceHandle dest_device,
 void memcpy_vec(std::vector<u8*> dest_buffers, DeviceHandle dest_device,
                 const std::vector<u8*> src_buffers, DeviceHandle src_device,
                 std::vector<size_t> sizes) {
-  assert(src_device.can_copy_to(dest_device));
   assert(dest_buffers.size() > 0);
   assert(src_buffers.size() > 0);
   assert(dest_buffers.size() == src_buffers.size());
@@ -524,6 +1885,31 @@ void memcpy_vec(std::vector<u8*> dest_buffers, DeviceHandle dest_device,
   if (dest_device.type == DeviceType::GPU ||
       src_device.type == DeviceType::GPU) {
 #ifdef HAVE_CUDA
+    enable_peer_access(src_device, dest_device);
+    // Pageable host memory goes through the staging ring at full bandwidth
+    if (src_device.type == DeviceType::CPU &&
+        dest_device.type == DeviceType::GPU &&
+        staging_ring_for_device(dest_device) != nullptr &&
+        !is_pinned_host_buffer(src_buffers[0])) {
+      static thread_local std::map<i32, std::tuple<cudaStream_t, cudaEvent_t>>
+          staging_streams;
+      auto it = staging_streams.find(dest_device.id);
+      if (it == staging_streams.end()) {
+        CU_CHECK(cudaSetDevice(dest_device.id));
+        cudaStream_t stream;
+        cudaEvent_t done;
+        CU_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+        CU_CHECK(cudaEventCreateWithFlags(&done, cudaEventDisableTiming));
+        it = staging_streams
+                 .emplace(dest_device.id, std::make_tuple(stream, done))
+                 .first;
+      }
+      memcpy_vec_async(dest_buffers, dest_device, src_buffers, src_device,
+                       sizes, std::get<0>(it->second), std::get<1>(it->second));
+      CU_CHECK(cudaEventSynchronize(std::get<1>(it->second)));
+      return;
+    }
+
     static thread_local std::vector<cudaStream_t> streams;
     if (streams.size() == 0) {
       streams.resize(NUM_CUDA_STREAMS);
@@ -577,4 +1963,57 @@ void memcpy_vec(std::vector<u8*> dest_buffers, DeviceHandle dest_device,
     }
   }
 }
+
+#ifdef HAVE_CUDA
+void memcpy_vec_async(std::vector<u8*> dest_buffers, DeviceHandle dest_device,
+                      const std::vector<u8*> src_buffers,
+                      DeviceHandle src_device, std::vector<size_t> sizes,
+                      cudaStream_t stream, cudaEvent_t done) {
+  assert(dest_buffers.size() == src_buffers.size());
+  enable_peer_access(src_device, dest_device);
+  assert(dest_buffers.size() == sizes.size());
+
+  if (src_device.type == DeviceType::GPU) {
+    CU_CHECK(cudaSetDevice(src_device.id));
+  } else if (dest_device.type == DeviceType::GPU) {
+    CU_CHECK(cudaSetDevice(dest_device.id));
+  }
+
+  size_t total_size = 0;
+  for (auto size : sizes) {
+    total_size += size;
+  }
+  i32 n = dest_buffers.size();
+  if (n == 0) {
+    CU_CHECK(cudaEventRecord(done, stream));
+    return;
+  }
+
+  BlockAllocator* dest_allocator = block_allocator_for_device(dest_device);
+  bool dest_contiguous = dest_allocator->buffers_in_same_block(dest_buffers);
+
+  StagingRing* ring = nullptr;
+  if (src_device.type == DeviceType::CPU &&
+      dest_device.type == DeviceType::GPU &&
+      !is_pinned_host_buffer(src_buffers[0])) {
+    ring = staging_ring_for_device(dest_device);
+  }
+
+  BlockAllocator* src_allocator = block_allocator_for_device(src_device);
+  if (ring != nullptr) {
+    staged_memcpy_async(ring, dest_buffers, src_buffers, sizes, stream);
+  } else if (dest_contiguous &&
+             src_allocator->buffers_in_same_block(src_buffers)) {
+    CU_CHECK(cudaMemcpyAsync(dest_buffers[0], src_buffers[0], total_size,
+                             cudaMemcpyDefault, stream));
+  } else {
+    for (i32 i = 0; i < n; ++i) {
+      CU_CHECK(cudaMemcpyAsync(dest_buffers[i], src_buffers[i], sizes[i],
+                               cudaMemcpyDefault, stream));
+    }
+  }
+
+  CU_CHECK(cudaEventRecord(done, stream));
+}
+#endif
 }
@@ -18,6 +18,11 @@
 #include "scanner/util/common.h"
 
 #include <cstddef>
+#include <functional>
+
+#ifdef HAVE_CUDA
+#include <cuda_runtime_api.h>
+#endif
 
 namespace scanner {
 
@@ -28,14 +33,81 @@ void init_memory_allocators(MemoryPoolConfig config,
 
 void destroy_memory_allocators();
 
+//! True if any memory pool has more than its soft limit in use. Stages that
+//! admit new work should hold off until this clears.
+bool memory_over_soft_limit();
+
+//! Bytes of the memory pools of a device type that admitted work may fill,
+//! summed over devices: their soft limit, or all of them if they have none.
+//! 0 if the device type has no pool.
+i64 memory_pool_budget(DeviceType device_type);
+
+//! Bytes of a GPU that kernels may be placed against: the budget of its
+//! pool, or all of its memory if it has none. 0 for CPUs.
+i64 device_memory_capacity(DeviceHandle device);
+
+//! Page size backing the CPU memory pool, or 0 if there is no pool.
+size_t cpu_pool_page_size();
+
 u8* new_buffer(DeviceHandle device, size_t size);
 
 u8* new_block_buffer(DeviceHandle device, size_t size, i32 refs);
 
+//! Wraps CPU memory owned elsewhere, such as a memory mapped file, as a
+//! buffer with refs references. Like a block buffer, any pointer into
+//! [data, data + size) may be passed to add_buffer_ref and delete_buffer.
+//! release is called once the last reference is dropped.
+u8* new_external_buffer(u8* data, size_t size, i32 refs,
+                        std::function<void()> release);
+
+//! Adds a reference to a buffer from new_buffer, new_block_buffer or
+//! new_external_buffer. Each reference is released by a call to
+//! delete_buffer.
 void add_buffer_ref(DeviceHandle device, u8* buffer);
 
 void delete_buffer(DeviceHandle device, u8* buffer);
 
+///////////////////////////////////////////////////////////////////////////////
+/// Memory accounting
+//
+// Buffers are attributed to the memory tag that was active on the allocating
+// thread, e.g. the pipeline stage or op that asked for them, and are released
+// from that tag when they are freed.
+
+struct MemoryUsage {
+  std::string tag;
+  DeviceType device_type;
+  i64 live_bytes;
+  i64 peak_bytes;
+};
+
+//! Id of the named tag, registering it on first use.
+i32 memory_tag_id(const std::string& name);
+
+//! Sets the memory tag of the calling thread until the scope is destroyed.
+//! Scopes nest, and the innermost one wins.
+class MemoryTagScope {
+ public:
+  MemoryTagScope(const std::string& name);
+
+  MemoryTagScope(i32 tag_id);
+
+  ~MemoryTagScope();
+
+ private:
+  i32 previous_;
+};
+
+//! Live and peak bytes per tag and device type, summed over devices.
+std::vector<MemoryUsage> memory_usage();
+
+//! Most bytes the tag may hold on devices of a type, summed over devices.
+//! Allocations past it fail as if the pool were full. 0 removes the budget.
+void set_memory_tag_budget(i32 tag_id, DeviceType device_type, i64 bytes);
+
+//! Starts a new high-water mark for every tag at its current live bytes.
+void reset_memory_peaks();
+
 void memcpy_buffer(u8* dest_buffer, DeviceHandle dest_device,
                    const u8* src_buffer, DeviceHandle src_device, size_t size);
 
@@ -43,6 +115,20 @@ void memcpy_vec(std::vector<u8*> dest_buffers, DeviceHandle dest_device,
                 const std::vector<u8*> src_buffers, DeviceHandle src_device,
                 std::vector<size_t> sizes);
 
+#ifdef HAVE_CUDA
+//! Queues the copies on stream and records done once they have finished.
+//!
+//! Host sources that are not page locked are first copied into a pinned
+//! staging buffer so that the transfer does not block the calling thread.
+//! Pinned sources are read by the transfer itself, so the source buffers
+//! must be kept until done has completed, as must the destination buffers
+//! before they are read.
+void memcpy_vec_async(std::vector<u8*> dest_buffers, DeviceHandle dest_device,
+                      const std::vector<u8*> src_buffers,
+                      DeviceHandle src_device, std::vector<size_t> sizes,
+                      cudaStream_t stream, cudaEvent_t done);
+#endif
+
 std::vector<u8*> duplicate_buffers(DeviceHandle dest_device,
                                    const std::vector<u8*> src_buffers,
                                    DeviceHandle src_device,
@@ -0,0 +1,61 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/metrics.h"
+
+#include <deque>
+#include <mutex>
+
+namespace scanner {
+
+namespace {
+std::mutex metrics_mutex;
+// A deque so that counters stay put as more are added
+std::deque<std::atomic<i64>> counter_values;
+std::map<std::string, std::atomic<i64>*> counters;
+std::map<std::string, i64> gauges;
+}
+
+std::atomic<i64>& metric_counter(const std::string& name) {
+  std::lock_guard<std::mutex> guard(metrics_mutex);
+  auto it = counters.find(name);
+  if (it != counters.end()) {
+    return *it->second;
+  }
+  counter_values.emplace_back(0);
+  counters[name] = &counter_values.back();
+  return counter_values.back();
+}
+
+void set_metric_gauge(const std::string& name, i64 value) {
+  std::lock_guard<std::mutex> guard(metrics_mutex);
+  gauges[name] = value;
+}
+
+void clear_metric_gauge(const std::string& name) {
+  std::lock_guard<std::mutex> guard(metrics_mutex);
+  gauges.erase(name);
+}
+
+MetricValues metric_values() {
+  MetricValues values;
+  std::lock_guard<std::mutex> guard(metrics_mutex);
+  for (auto& kv : counters) {
+    values.counters[kv.first] = kv.second->load();
+  }
+  values.gauges = gauges;
+  return values;
+}
+}
@@ -0,0 +1,51 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <atomic>
+#include <map>
+#include <string>
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// Live metrics
+//
+// Values a running process reports through the GetMetrics RPCs. Names follow
+// Prometheus conventions, with labels in braces, e.g.
+// scanner_queue_depth{job="3",queue="load_work"}.
+
+//! Counter of a total since the process started, such as bytes read. The
+//! reference stays valid for the life of the process, so callers on hot paths
+//! can look it up once.
+std::atomic<i64>& metric_counter(const std::string& name);
+
+//! Sets a gauge, such as the depth of a queue, to its current value.
+void set_metric_gauge(const std::string& name, i64 value);
+
+//! Drops a gauge whose owner, such as a job, has gone away.
+void clear_metric_gauge(const std::string& name);
+
+struct MetricValues {
+  std::map<std::string, i64> counters;
+  std::map<std::string, i64> gauges;
+};
+
+//! Current value of every counter and gauge.
+MetricValues metric_values();
+}
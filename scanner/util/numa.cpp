@@ -0,0 +1,188 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/numa.h"
+#include "scanner/util/cuda.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#ifdef HAVE_CUDA
+#include <cuda_runtime_api.h>
+#endif
+
+namespace scanner {
+
+namespace {
+
+// From linux/mempolicy.h
+const int NUMA_MPOL_PREFERRED = 1;
+
+struct NumaTopology {
+  std::vector<std::vector<i32>> node_cpus;
+  std::map<i32, i32> cpu_to_node;
+};
+
+// Parses sysfs cpu lists such as "0-7,16-23"
+std::vector<i32> parse_cpu_list(const std::string& list) {
+  std::vector<i32> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || !std::isdigit(range[0])) {
+      continue;
+    }
+    size_t dash = range.find('-');
+    i32 first = std::stoi(range.substr(0, dash));
+    i32 last = first;
+    if (dash != std::string::npos) {
+      last = std::stoi(range.substr(dash + 1));
+    }
+    for (i32 cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+const NumaTopology& topology() {
+  static NumaTopology topo;
+  static std::once_flag flag;
+  std::call_once(flag, []() {
+    for (i32 node = 0;; ++node) {
+      std::ifstream file("/sys/devices/system/node/node" +
+                         std::to_string(node) + "/cpulist");
+      if (!file.good()) {
+        break;
+      }
+      std::string line;
+      std::getline(file, line);
+      topo.node_cpus.push_back(parse_cpu_list(line));
+    }
+    if (topo.node_cpus.empty()) {
+      std::vector<i32> cpus;
+      i32 num_cpus = std::thread::hardware_concurrency();
+      for (i32 cpu = 0; cpu < num_cpus; ++cpu) {
+        cpus.push_back(cpu);
+      }
+      topo.node_cpus.push_back(cpus);
+    }
+    for (size_t node = 0; node < topo.node_cpus.size(); ++node) {
+      for (i32 cpu : topo.node_cpus[node]) {
+        topo.cpu_to_node[cpu] = node;
+      }
+    }
+    VLOG(1) << "Found " << topo.node_cpus.size() << " NUMA node(s)";
+  });
+  return topo;
+}
+}
+
+i32 num_numa_nodes() { return topology().node_cpus.size(); }
+
+std::vector<i32> numa_node_cpus(i32 node) {
+  const NumaTopology& topo = topology();
+  if (node < 0 || node >= (i32)topo.node_cpus.size()) {
+    return {};
+  }
+  return topo.node_cpus[node];
+}
+
+i32 current_numa_node() {
+  const NumaTopology& topo = topology();
+  i32 cpu = sched_getcpu();
+  auto it = topo.cpu_to_node.find(cpu);
+  if (cpu < 0 || it == topo.cpu_to_node.end()) {
+    return 0;
+  }
+  return it->second;
+}
+
+i32 numa_node_for_device(DeviceHandle device) {
+  if (device.type != DeviceType::GPU) {
+    return -1;
+  }
+#ifdef HAVE_CUDA
+  char bus_id[32];
+  if (cudaDeviceGetPCIBusId(bus_id, sizeof(bus_id), device.id) !=
+      cudaSuccess) {
+    return -1;
+  }
+  // sysfs uses lower case bus ids
+  std::string id(bus_id);
+  std::transform(id.begin(), id.end(), id.begin(), ::tolower);
+  std::ifstream file("/sys/bus/pci/devices/" + id + "/numa_node");
+  i32 node = -1;
+  if (file.good()) {
+    file >> node;
+  }
+  if (node >= num_numa_nodes()) {
+    node = -1;
+  }
+  return node;
+#else
+  return -1;
+#endif
+}
+
+bool pin_thread_to_numa_node(std::thread& thread, i32 node) {
+  std::vector<i32> cpus = numa_node_cpus(node);
+  if (cpus.empty()) {
+    return false;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (i32 cpu : cpus) {
+    CPU_SET(cpu, &cpu_set);
+  }
+  i32 err = pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t),
+                                   &cpu_set);
+  LOG_IF(WARNING, err != 0) << "Failed to pin thread to NUMA node " << node
+                            << ": " << strerror(err);
+  return err == 0;
+}
+
+bool bind_memory_to_numa_node(u8* buffer, size_t size, i32 node) {
+#ifdef SYS_mbind
+  if (node < 0 || node >= 63) {
+    return false;
+  }
+  // mbind works on whole pages, so only bind the pages fully inside buffer
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t start = ((size_t)buffer + page_size - 1) / page_size * page_size;
+  size_t end = ((size_t)buffer + size) / page_size * page_size;
+  if (end <= start) {
+    return false;
+  }
+  unsigned long node_mask = 1UL << node;
+  long err = syscall(SYS_mbind, (void*)start, end - start,
+                     NUMA_MPOL_PREFERRED, &node_mask, 64, 0);
+  LOG_IF(WARNING, err != 0) << "Failed to bind memory to NUMA node " << node
+                            << ": " << strerror(errno);
+  return err == 0;
+#else
+  return false;
+#endif
+}
+}
@@ -0,0 +1,47 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <thread>
+#include <vector>
+
+namespace scanner {
+
+///////////////////////////////////////////////////////////////////////////////
+/// NUMA topology
+//
+// Topology is read from sysfs so that no libnuma dependency is needed. On
+// machines without NUMA information every helper behaves as if there is a
+// single node 0 which owns all cpus.
+
+i32 num_numa_nodes();
+
+std::vector<i32> numa_node_cpus(i32 node);
+
+//! NUMA node of the cpu the calling thread is currently running on.
+i32 current_numa_node();
+
+//! NUMA node closest to the device, or -1 if it is unknown.
+i32 numa_node_for_device(DeviceHandle device);
+
+//! Restricts the thread to the cpus of the given NUMA node.
+bool pin_thread_to_numa_node(std::thread& thread, i32 node);
+
+//! Asks the kernel to back [buffer, buffer + size) with memory from node.
+bool bind_memory_to_numa_node(u8* buffer, size_t size, i32 node);
+}
@@ -25,6 +25,10 @@ int frame_to_cv_type(FrameType type, int channels) {
       cv_type = CV_64F;
       break;
     }
+    case FrameType::F16: {
+      // OpenCV has no half precision matrices, see scanner/util/half.h
+      LOG(FATAL) << "OpenCV does not support F16 frames";
+    }
   }
   return CV_MAKETYPE(cv_type, channels);
 }
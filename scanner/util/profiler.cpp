@@ -17,28 +17,229 @@
 #include "scanner/util/storehouse.h"
 #include "storehouse/storage_backend.h"
 
-#include <cmath>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
 #include <map>
 #include <string>
+#include <thread>
+#include <unordered_map>
 
 namespace scanner {
 
-Profiler::Profiler(timepoint_t base_time) : base_time_(base_time), lock_(0) {}
+namespace {
 
-Profiler::Profiler(const Profiler& other)
-  : base_time_(other.base_time_), records_(other.records_), lock_(0) {}
+struct ProfilerKeys {
+  std::mutex mutex;
+  std::unordered_map<std::string, i32> ids;
+  // A deque so that names handed out stay put as keys are added
+  std::deque<std::string> names;
+};
 
-const std::vector<Profiler::TaskRecord>& Profiler::get_records() const {
-  return records_;
+ProfilerKeys& profiler_keys() {
+  static ProfilerKeys keys;
+  return keys;
 }
 
-const std::map<std::string, int64_t>& Profiler::get_counters() const {
-  return counters_;
+std::atomic<u64> next_profiler_id{0};
+
+// Profilers a thread has written to recently, so that it can skip the lookup
+// of its buffer under the profiler's lock. Profilers live for a job while pool
+// threads outlive them, so only the last few are remembered.
+const size_t MAX_THREAD_PROFILERS = 8;
+}
+
+i32 profiler_key(const std::string& key) {
+  thread_local std::unordered_map<std::string, i32> cache;
+  auto it = cache.find(key);
+  if (it != cache.end()) {
+    return it->second;
+  }
+  ProfilerKeys& keys = profiler_keys();
+  std::lock_guard<std::mutex> lock(keys.mutex);
+  auto inserted = keys.ids.emplace(key, (i32)keys.names.size());
+  if (inserted.second) {
+    keys.names.push_back(key);
+  }
+  cache.emplace(key, inserted.first->second);
+  return inserted.first->second;
+}
+
+const std::string& profiler_key_name(i32 key) {
+  ProfilerKeys& keys = profiler_keys();
+  std::lock_guard<std::mutex> lock(keys.mutex);
+  return keys.names.at(key);
+}
+
+Profiler::Profiler(timepoint_t base_time)
+  : base_time_(base_time), id_(next_profiler_id++) {
+  const char* spill_dir = std::getenv("PROFILER_SPILL_DIR");
+  if (spill_dir != nullptr && spill_dir[0] != '\0') {
+    spill_path_ = std::string(spill_dir) + "/profiler_" +
+                  std::to_string(getpid()) + "_" + std::to_string(id_) +
+                  ".bin";
+  }
+}
+
+Profiler::Profiler(const Profiler& other) : Profiler(other.base_time_) {
+  // Copies are taken before any thread records, but keep whatever the other
+  // profiler holds in a buffer of its own
+  std::unique_ptr<ThreadBuffer> buffer(new ThreadBuffer);
+  other.for_each_record([&](const Record& record) {
+    buffer->chunk.push_back(record);
+    if (buffer->chunk.size() == CHUNK_RECORDS) {
+      buffer->full_chunks.push_back(std::move(buffer->chunk));
+      buffer->chunk.clear();
+    }
+  });
+  for (auto& other_buffer : other.threads_) {
+    for (size_t k = 0; k < other_buffer->counters.size(); ++k) {
+      if (!other_buffer->counter_used[k]) {
+        continue;
+      }
+      if (k >= buffer->counters.size()) {
+        buffer->counters.resize(k + 1, 0);
+        buffer->counter_used.resize(k + 1, false);
+      }
+      buffer->counters[k] += other_buffer->counters[k];
+      buffer->counter_used[k] = true;
+    }
+  }
+  threads_.push_back(std::move(buffer));
+}
+
+Profiler::~Profiler() {
+  if (spill_.is_open()) {
+    spill_.close();
+    std::remove(spill_path_.c_str());
+  }
+}
+
+Profiler::ThreadBuffer* Profiler::thread_buffer() {
+  thread_local std::deque<std::pair<u64, ThreadBuffer*>> buffers;
+  for (auto& entry : buffers) {
+    if (entry.first == id_) {
+      return entry.second;
+    }
+  }
+  ThreadBuffer* buffer;
+  {
+    std::lock_guard<std::mutex> lock(threads_mutex_);
+    ThreadBuffer*& owned = thread_buffers_[std::this_thread::get_id()];
+    if (owned == nullptr) {
+      owned = new ThreadBuffer;
+      owned->chunk.reserve(CHUNK_RECORDS);
+      threads_.emplace_back(owned);
+    }
+    buffer = owned;
+  }
+  if (buffers.size() == MAX_THREAD_PROFILERS) {
+    buffers.pop_back();
+  }
+  buffers.emplace_front(id_, buffer);
+  return buffer;
+}
+
+void Profiler::retire_chunk(ThreadBuffer* buffer) {
+  if (spill_path_.empty()) {
+    buffer->full_chunks.push_back(std::move(buffer->chunk));
+  } else {
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    if (!spill_.is_open()) {
+      spill_.open(spill_path_, std::ios::in | std::ios::out |
+                                   std::ios::trunc | std::ios::binary);
+    }
+    if (spill_) {
+      spill_.write((const char*)buffer->chunk.data(),
+                   buffer->chunk.size() * sizeof(Record));
+      spilled_records_ += buffer->chunk.size();
+    } else {
+      // Keep the records in memory rather than lose them
+      LOG_EVERY_N(WARNING, 1000) << "Could not spill profiler records to "
+                                 << spill_path_;
+      buffer->full_chunks.push_back(std::move(buffer->chunk));
+    }
+  }
+  buffer->chunk.clear();
+  buffer->chunk.reserve(CHUNK_RECORDS);
+}
+
+template <typename Fn>
+void Profiler::for_each_record(Fn fn) const {
+  {
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    if (spilled_records_ > 0) {
+      spill_.flush();
+      spill_.seekg(0);
+      std::vector<Record> records(CHUNK_RECORDS);
+      for (int64_t read = 0; read < spilled_records_;) {
+        size_t count =
+            std::min((int64_t)CHUNK_RECORDS, spilled_records_ - read);
+        spill_.read((char*)records.data(), count * sizeof(Record));
+        for (size_t i = 0; i < count; ++i) {
+          fn(records[i]);
+        }
+        read += count;
+      }
+      spill_.clear();
+      spill_.seekp(0, std::ios::end);
+    }
+  }
+  for (auto& buffer : threads_) {
+    for (auto& chunk : buffer->full_chunks) {
+      for (const Record& record : chunk) {
+        fn(record);
+      }
+    }
+    for (const Record& record : buffer->chunk) {
+      fn(record);
+    }
+  }
+}
+
+std::vector<Profiler::TaskRecord> Profiler::get_records() const {
+  std::vector<TaskRecord> records;
+  for_each_record([&](const Record& record) {
+    records.push_back(TaskRecord{profiler_key_name(record.key), record.start,
+                                 record.end, record.item});
+  });
+  return records;
+}
+
+std::map<std::string, int64_t> Profiler::get_counters() const {
+  std::map<std::string, int64_t> counters;
+  for (auto& buffer : threads_) {
+    for (size_t k = 0; k < buffer->counters.size(); ++k) {
+      if (buffer->counter_used[k]) {
+        counters[profiler_key_name(k)] += buffer->counters[k];
+      }
+    }
+  }
+  return counters;
+}
+
+namespace {
+
+void write_varint(std::vector<u8>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back((u8)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((u8)value);
+}
+
+uint64_t zigzag(int64_t value) {
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
 }
 
 void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
                             std::string type_name, std::string tag,
                             int64_t worker_num, const Profiler& profiler) {
+  s_write(file, PROFILER_SECTION_MAGIC);
+  s_write(file, PROFILER_FORMAT_VERSION);
   // Write worker header information
   // Node
   s_write(file, node);
@@ -48,45 +249,42 @@ void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
   s_write(file, tag);
   // Worker number
   s_write(file, worker_num);
-  // Intervals
-  const std::vector<scanner::Profiler::TaskRecord>& records =
-      profiler.get_records();
-  // Perform dictionary compression on interval key names
-  uint8_t record_key_id = 0;
-  std::map<std::string, uint8_t> key_names;
-  for (size_t j = 0; j < records.size(); j++) {
-    const std::string& key = records[j].key;
-    if (key_names.count(key) == 0) {
-      key_names.insert({key, record_key_id++});
+  // Intervals, with keys numbered in order of first use
+  std::unordered_map<i32, uint64_t> key_ids;
+  std::vector<i32> keys;
+  std::vector<u8> key_column;
+  std::vector<u8> start_column;
+  std::vector<u8> duration_column;
+  std::vector<u8> item_column;
+  int64_t num_records = 0;
+  int64_t last_start = 0;
+  int64_t last_item = -1;
+  profiler.for_each_record([&](const Profiler::Record& record) {
+    auto inserted = key_ids.emplace(record.key, keys.size());
+    if (inserted.second) {
+      keys.push_back(record.key);
     }
-  }
-  if (key_names.size() > std::pow(2, sizeof(record_key_id) * 8)) {
-    fprintf(stderr,
-            "WARNING: Number of record keys (%lu) greater than "
-            "max key id (%lu). Recorded intervals will alias in "
-            "profiler file.\n",
-            key_names.size(), std::pow(2, sizeof(record_key_id) * 8));
-  }
+    write_varint(key_column, inserted.first->second);
+    write_varint(start_column, zigzag(record.start - last_start));
+    write_varint(duration_column, zigzag(record.end - record.start));
+    write_varint(item_column, zigzag(record.item - last_item));
+    last_start = record.start;
+    last_item = record.item;
+    num_records++;
+  });
   // Write out key name dictionary
-  int64_t num_keys = static_cast<int64_t>(key_names.size());
+  int64_t num_keys = static_cast<int64_t>(keys.size());
   s_write(file, num_keys);
-  for (auto& kv : key_names) {
-    std::string key = kv.first;
-    uint8_t key_index = kv.second;
-    s_write(file, key);
-    s_write(file, key_index);
+  for (i32 key : keys) {
+    s_write(file, profiler_key_name(key));
   }
   // Number of intervals
-  int64_t num_records = static_cast<int64_t>(records.size());
   s_write(file, num_records);
-  for (size_t j = 0; j < records.size(); j++) {
-    const scanner::Profiler::TaskRecord& record = records[j];
-    uint8_t key_index = key_names[record.key];
-    int64_t start = record.start;
-    int64_t end = record.end;
-    s_write(file, key_index);
-    s_write(file, start);
-    s_write(file, end);
+  for (auto* column :
+       {&key_column, &start_column, &duration_column, &item_column}) {
+    int64_t column_size = static_cast<int64_t>(column->size());
+    s_write(file, column_size);
+    s_write(file, column->data(), column->size());
   }
   // S_Write out counters
   const std::map<std::string, int64_t>& counters = profiler.get_counters();
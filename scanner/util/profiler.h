@@ -17,10 +17,13 @@
 
 #include "scanner/util/util.h"
 
-#include <atomic>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace storehouse {
@@ -29,36 +32,122 @@ class WriteFile;
 
 namespace scanner {
 
+//! Interns a profiler key. Intervals and counters are recorded against the
+//! returned id, so callers on hot paths can look the key up once and skip
+//! hashing the string on every call.
+i32 profiler_key(const std::string& key);
+
+const std::string& profiler_key_name(i32 key);
+
+//! Records intervals and counters of the threads of a worker.
+//
+// Every thread that writes to a profiler gets its own buffers, so recording
+// takes no lock even when a profiler is shared between threads. Intervals are
+// kept in fixed size chunks. When the PROFILER_SPILL_DIR environment variable
+// names a local directory, full chunks are written to a file there instead of
+// being held for the whole job.
+//
+// The records and counters of a profiler can only be read once the threads
+// writing to it are done.
 class Profiler {
  public:
   Profiler(timepoint_t base_time);
 
   Profiler(const Profiler& other);
 
+  ~Profiler();
+
   void add_interval(const std::string& key, timepoint_t start, timepoint_t end);
 
+  void add_interval(i32 key, timepoint_t start, timepoint_t end);
+
+  //! Records an interval spent on one work item, which links the intervals
+  //! of the stages the item passed through.
+  void add_interval(const std::string& key, timepoint_t start,
+                    timepoint_t end, i64 item);
+
+  void add_interval(i32 key, timepoint_t start, timepoint_t end, i64 item);
+
   void increment(const std::string& key, int64_t value);
 
+  void increment(i32 key, int64_t value);
+
   struct TaskRecord {
     std::string key;
     int64_t start;
     int64_t end;
+    // Work item of the interval, or -1
+    int64_t item;
   };
 
-  const std::vector<TaskRecord>& get_records() const;
+  std::vector<TaskRecord> get_records() const;
 
-  const std::map<std::string, int64_t>& get_counters() const;
+  std::map<std::string, int64_t> get_counters() const;
 
  protected:
-  void spin_lock();
-  void unlock();
+  friend void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
+                                     std::string type_name, std::string tag,
+                                     int64_t worker_num,
+                                     const Profiler& profiler);
+
+  static const size_t CHUNK_RECORDS = 4096;
+
+  struct Record {
+    i32 key;
+    // Fits in the padding after the key, so records stay 24 bytes
+    i32 item;
+    int64_t start;
+    int64_t end;
+  };
+
+  // Only the owning thread writes to its buffer
+  struct ThreadBuffer {
+    std::vector<Record> chunk;
+    std::vector<std::vector<Record>> full_chunks;
+    // Indexed by key
+    std::vector<int64_t> counters;
+    std::vector<u8> counter_used;
+  };
+
+  ThreadBuffer* thread_buffer();
+
+  void retire_chunk(ThreadBuffer* buffer);
+
+  // Calls fn with every record, spilled or not
+  template <typename Fn>
+  void for_each_record(Fn fn) const;
 
   timepoint_t base_time_;
-  std::atomic_flag lock_;
-  std::vector<TaskRecord> records_;
-  std::map<std::string, int64_t> counters_;
+  // Tells apart profilers in the per thread buffer lookup, where addresses
+  // can be reused
+  u64 id_;
+
+  std::mutex threads_mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer>> threads_;
+  // Each thread keeps writing to the same buffer however often it comes back
+  std::unordered_map<std::thread::id, ThreadBuffer*> thread_buffers_;
+
+  mutable std::mutex spill_mutex_;
+  std::string spill_path_;
+  mutable std::fstream spill_;
+  int64_t spilled_records_ = 0;
 };
 
+//! Starts a profiler section in format version 2 or later, in place of the
+//! node id that starts a version 1 section.
+const int64_t PROFILER_SECTION_MAGIC = 0x454c49464f525053;  // "SPROFILE"
+const uint32_t PROFILER_FORMAT_VERSION = 3;
+
+//! Writes the intervals and counters of a profiler as one section.
+//
+// After the magic and version come the node, worker type, tag and worker
+// number, the key names with each key's id being its index, and the number
+// of intervals. The intervals follow as four columns, each preceded by its
+// size in bytes: key ids as varints, starts as zigzag varints of the
+// difference to the previous start, durations as zigzag varints, and work
+// items as zigzag varints of the difference to the previous item, with -1
+// for none. Version 2 has no item column. Counters come last as name and
+// value pairs.
 void write_profiler_to_file(storehouse::WriteFile* file, int64_t node,
                             std::string type_name, std::string tag,
                             int64_t worker_num, const Profiler& profiler);
@@ -24,28 +24,46 @@ inline void Profiler::add_interval(
   timepoint_t start,
   timepoint_t end)
 {
-  spin_lock();
-  records_.emplace_back(TaskRecord{
+  add_interval(profiler_key(key), start, end, -1);
+}
+
+inline void Profiler::add_interval(i32 key, timepoint_t start,
+                                   timepoint_t end) {
+  add_interval(key, start, end, -1);
+}
+
+inline void Profiler::add_interval(const std::string& key, timepoint_t start,
+                                   timepoint_t end, i64 item) {
+  add_interval(profiler_key(key), start, end, item);
+}
+
+inline void Profiler::add_interval(i32 key, timepoint_t start,
+                                   timepoint_t end, i64 item) {
+  ThreadBuffer* buffer = thread_buffer();
+  buffer->chunk.push_back(Record{
     key,
+    (i32)item,
     std::chrono::duration_cast<std::chrono::nanoseconds>(
       start - base_time_).count(),
     std::chrono::duration_cast<std::chrono::nanoseconds>(
       end - base_time_).count()});
-  unlock();
+  if (buffer->chunk.size() == CHUNK_RECORDS) {
+    retire_chunk(buffer);
+  }
 }
 
 inline void Profiler::increment(const std::string& key, int64_t value) {
-  spin_lock();
-  counters_[key] += value;
-  unlock();
-}
-
-inline void Profiler::spin_lock() {
-  while (lock_.test_and_set(std::memory_order_acquire));
+  increment(profiler_key(key), value);
 }
 
-inline void Profiler::unlock() {
-  lock_.clear(std::memory_order_release);
+inline void Profiler::increment(i32 key, int64_t value) {
+  ThreadBuffer* buffer = thread_buffer();
+  if (key >= (i32)buffer->counters.size()) {
+    buffer->counters.resize(key + 1, 0);
+    buffer->counter_used.resize(key + 1, false);
+  }
+  buffer->counters[key] += value;
+  buffer->counter_used[key] = true;
 }
 
 }
@@ -16,6 +16,7 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <deque>
 #include <mutex>
@@ -30,6 +31,8 @@ class Queue {
 
   int size();
 
+  int capacity() const;
+
   template <typename... Args>
   void emplace(Args&&... args);
 
@@ -37,6 +40,10 @@ class Queue {
 
   bool try_pop(T& item);
 
+  //! Pops an item if one arrives within timeout.
+  template <typename Rep, typename Period>
+  bool try_pop_for(T& item, const std::chrono::duration<Rep, Period>& timeout);
+
   void pop(T& item);
 
   void peek(T& item);
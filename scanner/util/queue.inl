@@ -31,6 +31,11 @@ int Queue<T>::size() {
   return data_.size() - pop_waiters_ + push_waiters_;
 }
 
+template <typename T>
+int Queue<T>::capacity() const {
+  return max_size_;
+}
+
 template <typename T>
 template <typename... Args>
 void Queue<T>::emplace(Args&&... args) {
@@ -76,6 +81,30 @@ bool Queue<T>::try_pop(T& item) {
   }
 }
 
+template <typename T>
+template <typename Rep, typename Period>
+bool Queue<T>::try_pop_for(
+    T& item, const std::chrono::duration<Rep, Period>& timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  pop_waiters_++;
+  bool ready =
+      not_empty_.wait_for(lock, timeout, [this] { return data_.size() > 0; });
+  pop_waiters_--;
+  if (!ready) {
+    return false;
+  }
+
+  item = data_.front();
+  data_.pop_front();
+
+  lock.unlock();
+  if (size() <= 0) {
+    empty_.notify_all();
+  }
+  not_full_.notify_one();
+  return true;
+}
+
 template <typename T>
 void Queue<T>::pop(T& item) {
   std::unique_lock<std::mutex> lock(mutex_);
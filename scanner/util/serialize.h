@@ -117,14 +117,121 @@ std::vector<T> deserialize_proto_vector(const u8* buffer, size_t size) {
   return elements;
 }
 
+// Boxes are packed as PACKED_BBOXES_MAGIC and the number of boxes n,
+// followed by one array of n values per field: track_score as f64, then
+// x1, y1, x2, y2 and score as f32, then label and track_id as i32. Each
+// field is read in place, without parsing a message per box. Elements that
+// do not start with the magic are proto vectors from serialize_proto_vector.
+const u64 PACKED_BBOXES_MAGIC = 0xffffffff0bb00001;
+
+//! Fields of a list of boxes as arrays, pointing into a packed element, or
+//! into a packed copy of a proto vector element.
+class PackedBBoxes {
+ public:
+  PackedBBoxes(const u8* buffer, size_t size) {
+    if (size < 2 * sizeof(u64) || *(const u64*)buffer != PACKED_BBOXES_MAGIC) {
+      auto boxes = deserialize_proto_vector<BoundingBox>(buffer, size);
+      owned_.resize(packed_size(boxes.size()));
+      pack(boxes, owned_.data());
+      buffer = owned_.data();
+    }
+    size_ = ((const u64*)buffer)[1];
+    track_score_ = (const f64*)(buffer + 2 * sizeof(u64));
+    x1_ = (const f32*)(track_score_ + size_);
+    y1_ = x1_ + size_;
+    x2_ = y1_ + size_;
+    y2_ = x2_ + size_;
+    score_ = y2_ + size_;
+    label_ = (const i32*)(score_ + size_);
+    track_id_ = label_ + size_;
+  }
+
+  // Fields may point into owned_
+  PackedBBoxes(const PackedBBoxes&) = delete;
+  PackedBBoxes& operator=(const PackedBBoxes&) = delete;
+
+  size_t size() const { return size_; }
+
+  const f32* x1() const { return x1_; }
+  const f32* y1() const { return y1_; }
+  const f32* x2() const { return x2_; }
+  const f32* y2() const { return y2_; }
+  const f32* score() const { return score_; }
+  const i32* label() const { return label_; }
+  const i32* track_id() const { return track_id_; }
+  const f64* track_score() const { return track_score_; }
+
+  BoundingBox box(size_t i) const {
+    BoundingBox box;
+    box.set_x1(x1_[i]);
+    box.set_y1(y1_[i]);
+    box.set_x2(x2_[i]);
+    box.set_y2(y2_[i]);
+    box.set_score(score_[i]);
+    box.set_label(label_[i]);
+    box.set_track_id(track_id_[i]);
+    box.set_track_score(track_score_[i]);
+    return box;
+  }
+
+  std::vector<BoundingBox> boxes() const {
+    std::vector<BoundingBox> boxes(size_);
+    for (size_t i = 0; i < size_; ++i) {
+      boxes[i] = box(i);
+    }
+    return boxes;
+  }
+
+  static size_t packed_size(size_t num_boxes) {
+    return 2 * sizeof(u64) +
+           num_boxes * (sizeof(f64) + 5 * sizeof(f32) + 2 * sizeof(i32));
+  }
+
+  //! Writes boxes to buffer, which holds packed_size(boxes.size()) bytes.
+  static void pack(const std::vector<BoundingBox>& boxes, u8* buffer) {
+    size_t n = boxes.size();
+    ((u64*)buffer)[0] = PACKED_BBOXES_MAGIC;
+    ((u64*)buffer)[1] = n;
+    f64* track_score = (f64*)(buffer + 2 * sizeof(u64));
+    f32* fields = (f32*)(track_score + n);
+    i32* ids = (i32*)(fields + 5 * n);
+    for (size_t i = 0; i < n; ++i) {
+      const BoundingBox& box = boxes[i];
+      track_score[i] = box.track_score();
+      fields[i] = box.x1();
+      fields[n + i] = box.y1();
+      fields[2 * n + i] = box.x2();
+      fields[3 * n + i] = box.y2();
+      fields[4 * n + i] = box.score();
+      ids[i] = box.label();
+      ids[n + i] = box.track_id();
+    }
+  }
+
+ private:
+  std::vector<u8> owned_;
+  size_t size_;
+  const f32* x1_;
+  const f32* y1_;
+  const f32* x2_;
+  const f32* y2_;
+  const f32* score_;
+  const i32* label_;
+  const i32* track_id_;
+  const f64* track_score_;
+};
+
 inline void serialize_bbox_vector(const std::vector<BoundingBox>& bboxes,
                                   u8*& buffer, size_t& size) {
-  serialize_proto_vector(bboxes, buffer, size);
+  size = PackedBBoxes::packed_size(bboxes.size());
+  buffer = new_buffer(CPU_DEVICE, size);
+  PackedBBoxes::pack(bboxes, buffer);
 }
 
+//! Reads boxes serialized either packed or as a proto vector.
 inline std::vector<BoundingBox> deserialize_bbox_vector(const u8* buffer,
                                                          size_t size) {
-  return deserialize_proto_vector<BoundingBox>(buffer, size);
+  return PackedBBoxes(buffer, size).boxes();
 }
 
 // inline void serialize_decode_args(const DecodeArgs& args, u8*& buffer,
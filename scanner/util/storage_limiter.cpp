@@ -0,0 +1,161 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/storage_limiter.h"
+#include "scanner/util/metrics.h"
+
+#include <algorithm>
+#include <random>
+#include <thread>
+
+namespace scanner {
+namespace {
+
+const i32 MIN_STORAGE_REQUESTS = 4;
+const i32 MAX_STORAGE_REQUESTS = 512;
+const i32 INITIAL_STORAGE_REQUESTS = 64;
+const f64 STORAGE_DECREASE_INTERVAL_SECONDS = 0.5;
+// The limit shrinks while the recent latency is this many times the base
+const f64 SLOW_REQUEST_FACTOR = 4.0;
+const f64 SLOW_REQUEST_DECREASE = 0.9;
+const f64 THROTTLED_DECREASE = 0.5;
+// Weights of each request in the moving averages. The recent one spans a few
+// requests, so that one slow read among fast ones does not count as the store
+// slowing down, and the base one a few hundred.
+const f64 RECENT_LATENCY_WEIGHT = 0.1;
+const f64 BASE_LATENCY_WEIGHT = 0.01;
+// Requests seen before the averages are trusted
+const i64 MIN_LATENCY_SAMPLES = 16;
+// Retries of a throttled request wait a random time up to this, doubling
+// with each attempt
+const f64 BACKOFF_BASE_SECONDS = 0.05;
+const f64 MAX_BACKOFF_SECONDS = 30.0;
+const i32 MAX_ATTEMPTS = 16;
+
+// Slots held by the calling thread
+thread_local i32 held_slots = 0;
+}
+
+StorageLimiter::StorageLimiter(i32 min_limit, i32 max_limit,
+                               i32 initial_limit, f64 decrease_interval)
+  : min_limit_(min_limit),
+    max_limit_(max_limit),
+    decrease_interval_(decrease_interval),
+    limit_(initial_limit) {
+  set_metric_gauge("scanner_storage_request_limit", initial_limit);
+}
+
+timepoint_t StorageLimiter::acquire() {
+  if (held_slots++ > 0) {
+    return now();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (in_flight_ >= (i32)limit_) {
+    timepoint_t wait_start = now();
+    slot_free_.wait(lock, [&] { return in_flight_ < (i32)limit_; });
+    throttle_wait_us_ += (i64)(nano_since(wait_start) / 1000);
+  }
+  in_flight_++;
+  return now();
+}
+
+void StorageLimiter::release(timepoint_t start, bool throttled) {
+  // Nested requests only count when they are throttled
+  bool outermost = --held_slots == 0;
+  if (!outermost && !throttled) {
+    return;
+  }
+  f64 latency = nano_since(start) / 1e9;
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (outermost) {
+    in_flight_--;
+  }
+  bool can_decrease = nano_since(last_decrease_) / 1e9 >= decrease_interval_;
+  if (throttled) {
+    throttle_events_++;
+    static std::atomic<i64>& throttled_requests =
+        metric_counter("scanner_storage_throttled_total");
+    throttled_requests++;
+    if (can_decrease) {
+      update_limit(limit_ * THROTTLED_DECREASE);
+    }
+  } else {
+    if (latency_samples_ == 0) {
+      recent_latency_ = latency;
+      base_latency_ = latency;
+    } else {
+      recent_latency_ += (latency - recent_latency_) * RECENT_LATENCY_WEIGHT;
+      base_latency_ += (latency - base_latency_) * BASE_LATENCY_WEIGHT;
+    }
+    latency_samples_++;
+    if (latency_samples_ >= MIN_LATENCY_SAMPLES &&
+        recent_latency_ > base_latency_ * SLOW_REQUEST_FACTOR) {
+      if (can_decrease) {
+        update_limit(limit_ * SLOW_REQUEST_DECREASE);
+      }
+    } else {
+      update_limit(limit_ + 1.0 / limit_);
+    }
+  }
+  slot_free_.notify_all();
+}
+
+void StorageLimiter::backoff(i32 attempt) {
+  LOG_IF(FATAL, attempt + 1 >= MAX_ATTEMPTS)
+      << "Storage request still throttled after " << MAX_ATTEMPTS
+      << " attempts";
+  // Full jitter, so that threads throttled together retry apart
+  thread_local std::mt19937 rng(std::random_device{}());
+  f64 cap = std::min(MAX_BACKOFF_SECONDS,
+                     BACKOFF_BASE_SECONDS * (f64)(1 << std::min(attempt, 20)));
+  f64 seconds = std::uniform_real_distribution<f64>(0, cap)(rng);
+  std::this_thread::sleep_for(std::chrono::duration<f64>(seconds));
+  std::unique_lock<std::mutex> lock(mutex_);
+  throttle_wait_us_ += (i64)(seconds * 1e6);
+}
+
+i32 StorageLimiter::limit() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return (i32)limit_;
+}
+
+i64 StorageLimiter::throttle_events() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return throttle_events_;
+}
+
+i64 StorageLimiter::throttle_wait_us() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return throttle_wait_us_;
+}
+
+void StorageLimiter::update_limit(f64 limit) {
+  limit = std::max(min_limit_, std::min(max_limit_, limit));
+  if (limit < limit_) {
+    last_decrease_ = now();
+  }
+  if ((i32)limit != (i32)limit_) {
+    set_metric_gauge("scanner_storage_request_limit", (i32)limit);
+  }
+  limit_ = limit;
+}
+
+StorageLimiter& storage_limiter() {
+  static StorageLimiter limiter(MIN_STORAGE_REQUESTS, MAX_STORAGE_REQUESTS,
+                                INITIAL_STORAGE_REQUESTS,
+                                STORAGE_DECREASE_INTERVAL_SECONDS);
+  return limiter;
+}
+}
@@ -0,0 +1,115 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/util/util.h"
+#include "storehouse/storage_backend.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+namespace scanner {
+
+//! Bounds the storage requests a process has in flight.
+//
+// Object stores answer too many requests at once by throttling them, and
+// threads that each retry on their own then retry together. The limit grows
+// by one request per limit's worth of requests that complete quickly, and
+// shrinks by half when a request is throttled, or by a tenth when the recent
+// average latency is much higher than the long run average. It shrinks at
+// most once per decrease interval, so that one burst of throttling counts
+// once. Only requests to the store belong here: appends to a file that is
+// buffered until it is saved would pull the averages down to memory speed.
+//
+// A thread that already holds a slot, such as one opening a file whose
+// header it reads, does not take another, so nested requests can not
+// deadlock. Their throttling still counts.
+class StorageLimiter {
+ public:
+  StorageLimiter(i32 min_limit, i32 max_limit, i32 initial_limit,
+                 f64 decrease_interval);
+
+  //! Waits for a slot and returns the start time of the request.
+  timepoint_t acquire();
+
+  //! Frees the slot of a request that started at start.
+  void release(timepoint_t start, bool throttled);
+
+  //! Sleeps before retry attempt + 1 of a throttled request. Fails after too
+  //! many attempts, as storehouse's EXP_BACKOFF does.
+  void backoff(i32 attempt);
+
+  i32 limit();
+
+  //! Throttled requests and the microseconds spent waiting for slots or
+  //! backing off, since the process started.
+  i64 throttle_events();
+  i64 throttle_wait_us();
+
+ private:
+  void update_limit(f64 limit);
+
+  std::mutex mutex_;
+  std::condition_variable slot_free_;
+  const f64 min_limit_;
+  const f64 max_limit_;
+  // Seconds after a decrease before the limit can shrink again
+  const f64 decrease_interval_;
+  f64 limit_;
+  i32 in_flight_ = 0;
+  // Moving averages of the latencies of requests that were not throttled, in
+  // seconds. The base one follows the store when it gets slower for good.
+  f64 recent_latency_ = 0;
+  f64 base_latency_ = 0;
+  i64 latency_samples_ = 0;
+  // Starts at the epoch so that the first decrease is never held back
+  timepoint_t last_decrease_;
+  i64 throttle_events_ = 0;
+  i64 throttle_wait_us_ = 0;
+};
+
+//! The limiter shared by the storage requests of this process.
+StorageLimiter& storage_limiter();
+
+//! Like storehouse's EXP_BACKOFF, but each attempt takes a slot from
+//! storage_limiter() and retries wait with jitter.
+#define STORE_RETRY(expression__, status__)                                 \
+  do {                                                                      \
+    scanner::StorageLimiter& limiter__ = scanner::storage_limiter();        \
+    for (i32 attempt__ = 0;; ++attempt__) {                                 \
+      timepoint_t start__ = limiter__.acquire();                            \
+      const storehouse::StoreResult result__ = (expression__);              \
+      bool throttled__ =                                                    \
+          result__ == storehouse::StoreResult::TransientFailure;            \
+      limiter__.release(start__, throttled__);                              \
+      if (!throttled__) {                                                   \
+        status__ = result__;                                                \
+        break;                                                              \
+      }                                                                     \
+      limiter__.backoff(attempt__);                                         \
+    }                                                                       \
+  } while (0)
+
+//! Like storehouse's BACKOFF_FAIL, through STORE_RETRY.
+#define STORE_CHECK(expression__)              \
+  do {                                         \
+    storehouse::StoreResult store_result__;    \
+    STORE_RETRY(expression__, store_result__); \
+    exit_on_error(store_result__);             \
+  } while (0)
+}
@@ -16,6 +16,8 @@
 #pragma once
 
 #include "scanner/util/common.h"
+#include "scanner/util/metrics.h"
+#include "scanner/util/storage_limiter.h"
 #include "storehouse/storage_backend.h"
 
 #include <cassert>
@@ -26,6 +28,8 @@ namespace scanner {
 inline void s_write(storehouse::WriteFile* file, const u8* buffer,
                     size_t size) {
   storehouse::StoreResult result;
+  // Appends only fill a local buffer until the file is saved, so they are
+  // not storage requests and stay out of the limiter
   EXP_BACKOFF(file->append(size, buffer), result);
   exit_on_error(result);
 }
@@ -46,12 +50,15 @@ inline void s_read(storehouse::RandomReadFile* file, u8* buffer, size_t size,
           << ")";
   storehouse::StoreResult result;
   size_t size_read;
-  EXP_BACKOFF(file->read(pos, size, buffer, size_read), result);
+  STORE_RETRY(file->read(pos, size, buffer, size_read), result);
   if (result != storehouse::StoreResult::EndOfFile) {
     exit_on_error(result);
   }
   assert(size_read == size);
   pos += size_read;
+  static std::atomic<i64>& read_bytes =
+      metric_counter("scanner_io_read_bytes_total");
+  read_bytes += size_read;
 }
 
 template <typename T>
@@ -72,7 +79,7 @@ inline std::string s_read(storehouse::RandomReadFile* file, u64& pos) {
 
     storehouse::StoreResult result;
     size_t size_read;
-    EXP_BACKOFF(file->read(pos, buf_size, buf, size_read), result);
+    STORE_RETRY(file->read(pos, buf_size, buf, size_read), result);
     if (result != storehouse::StoreResult::EndOfFile) {
       exit_on_error(result);
       assert(size_read == buf_size);
@@ -0,0 +1,111 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/thread_pool.h"
+
+namespace scanner {
+
+WorkStealingPool::WorkStealingPool(i32 num_threads) {
+  assert(num_threads > 0);
+  for (i32 i = 0; i < num_threads; ++i) {
+    deques_.emplace_back(new TaskDeque);
+  }
+  for (i32 i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&WorkStealingPool::run, this, i);
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  work_available_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+i32 WorkStealingPool::num_threads() const { return threads_.size(); }
+
+void WorkStealingPool::submit(Task task) {
+  i64 idx = next_deque_++ % deques_.size();
+  pending_tasks_++;
+  {
+    TaskDeque& deque = *deques_[idx];
+    std::unique_lock<std::mutex> lock(deque.mutex);
+    deque.tasks.push_back(std::move(task));
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    queued_tasks_++;
+  }
+  work_available_.notify_one();
+}
+
+void WorkStealingPool::wait_idle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return pending_tasks_ <= 0; });
+}
+
+void WorkStealingPool::run(i32 thread_id) {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_available_.wait(lock,
+                           [this] { return shutdown_ || queued_tasks_ > 0; });
+      if (shutdown_) {
+        break;
+      }
+    }
+    if (!try_get_task(thread_id, task)) {
+      // Another thread took the task first
+      continue;
+    }
+    task(thread_id);
+    if (--pending_tasks_ <= 0) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.notify_all();
+    }
+  }
+}
+
+bool WorkStealingPool::try_get_task(i32 thread_id, Task& task) {
+  // Own deque first, oldest task first
+  {
+    TaskDeque& deque = *deques_[thread_id];
+    std::unique_lock<std::mutex> lock(deque.mutex);
+    if (!deque.tasks.empty()) {
+      task = std::move(deque.tasks.front());
+      deque.tasks.pop_front();
+      queued_tasks_--;
+      return true;
+    }
+  }
+  // Steal the newest task from another thread
+  for (size_t i = 1; i < deques_.size(); ++i) {
+    TaskDeque& deque = *deques_[(thread_id + i) % deques_.size()];
+    std::unique_lock<std::mutex> lock(deque.mutex);
+    if (!deque.tasks.empty()) {
+      task = std::move(deque.tasks.back());
+      deque.tasks.pop_back();
+      queued_tasks_--;
+      return true;
+    }
+  }
+  return false;
+}
+}
@@ -0,0 +1,76 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace scanner {
+
+//! Fixed size thread pool where idle threads steal work from busy ones.
+//
+// Each thread owns a deque of tasks. Submitted tasks are spread round robin
+// over the deques, a thread runs tasks from the front of its own deque, and
+// once that is empty it takes tasks from the back of the other threads'
+// deques. Tasks receive the id of the thread running them so that they can
+// use per thread state such as storage backends.
+class WorkStealingPool {
+ public:
+  using Task = std::function<void(i32 thread_id)>;
+
+  WorkStealingPool(i32 num_threads);
+
+  ~WorkStealingPool();
+
+  i32 num_threads() const;
+
+  void submit(Task task);
+
+  //! Blocks until every submitted task has finished.
+  void wait_idle();
+
+ private:
+  struct TaskDeque {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void run(i32 thread_id);
+
+  bool try_get_task(i32 thread_id, Task& task);
+
+  std::vector<std::unique_ptr<TaskDeque>> deques_;
+  std::vector<std::thread> threads_;
+  std::atomic<i64> next_deque_{0};
+  // Tasks submitted but not yet finished
+  std::atomic<i64> pending_tasks_{0};
+  // Tasks submitted but not yet started
+  std::atomic<i64> queued_tasks_{0};
+  std::atomic<bool> shutdown_{false};
+
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable idle_;
+};
+}
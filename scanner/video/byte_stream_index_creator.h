@@ -0,0 +1,76 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include "storehouse/storage_backend.h"
+
+#include <string>
+
+namespace scanner {
+namespace internal {
+
+///////////////////////////////////////////////////////////////////////////////
+/// ByteStreamIndexCreator
+//! Writes the Annex B packets of a video as a demuxed bytestream, prefixing
+//! each with its size and keyframes with the parameter sets they need, and
+//! records where the keyframes are.
+class ByteStreamIndexCreator {
+ public:
+  ByteStreamIndexCreator(storehouse::WriteFile* demuxed_bytestream)
+    : demuxed_bytestream_(demuxed_bytestream) {}
+
+  virtual ~ByteStreamIndexCreator() {}
+
+  //! Appends one packet to the bytestream. Returns false, with the reason in
+  //! error_message(), if the packet could not be parsed.
+  virtual bool feed_packet(u8* data, size_t size) = 0;
+
+  const std::vector<u8>& metadata_bytes() { return metadata_bytes_; }
+  const std::vector<i64>& keyframe_positions() { return keyframe_positions_; }
+  const std::vector<i64>& keyframe_timestamps() { return keyframe_timestamps_; }
+  const std::vector<i64>& keyframe_byte_offsets() {
+    return keyframe_byte_offsets_;
+  };
+  const std::vector<i64>& keyframe_packet_sizes() {
+    return keyframe_packet_sizes_;
+  };
+
+  i32 frames() { return frame_; };
+  i32 num_non_ref_frames() { return num_non_ref_frames_; };
+  i32 nals_parsed() { return nals_parsed_; };
+
+  std::string error_message() { return error_message_; }
+
+ protected:
+  std::string error_message_;
+
+  storehouse::WriteFile* demuxed_bytestream_;
+
+  u64 bytestream_pos_ = 0;
+  std::vector<u8> metadata_bytes_;
+  std::vector<i64> keyframe_positions_;
+  std::vector<i64> keyframe_timestamps_;
+  std::vector<i64> keyframe_byte_offsets_;
+  std::vector<i64> keyframe_packet_sizes_;
+
+  i64 frame_ = 0;
+  i32 num_non_ref_frames_ = 0;
+  i32 nals_parsed_ = 0;
+};
+}
+}
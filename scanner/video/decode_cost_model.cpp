@@ -0,0 +1,81 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/video/decode_cost_model.h"
+
+#include <algorithm>
+
+namespace scanner {
+namespace internal {
+
+namespace {
+// Seek costs assumed before any interval has been timed. Restarting the
+// software decoder drains its frame threads, while the hardware decoder also
+// has to refill a deeper pipeline of surfaces.
+const f64 SOFTWARE_PRIOR_SEEK_COST = 16;
+const f64 NVIDIA_PRIOR_SEEK_COST = 48;
+}
+
+DecodeCostModel::DecodeCostModel(f64 prior_seek_cost)
+  : prior_seek_cost_(prior_seek_cost) {}
+
+void DecodeCostModel::record_interval(i64 frames, f64 seconds) {
+  if (frames <= 0 || seconds <= 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  f64 n = frames;
+  weight_ = weight_ * DECAY + 1;
+  frames_ = frames_ * DECAY + n;
+  seconds_ = seconds_ * DECAY + seconds;
+  frames_sq_ = frames_sq_ * DECAY + n * n;
+  frames_seconds_ = frames_seconds_ * DECAY + n * seconds;
+  samples_++;
+}
+
+f64 DecodeCostModel::seek_cost() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (samples_ < MIN_SAMPLES) {
+    return prior_seek_cost_;
+  }
+  // Without intervals of different lengths the two costs can not be told
+  // apart
+  f64 denom = weight_ * frames_sq_ - frames_ * frames_;
+  if (denom <= 1e-6 * weight_ * frames_sq_) {
+    return prior_seek_cost_;
+  }
+  f64 frame_seconds = (weight_ * frames_seconds_ - frames_ * seconds_) / denom;
+  if (frame_seconds <= 0) {
+    return prior_seek_cost_;
+  }
+  f64 seek_seconds = (seconds_ - frame_seconds * frames_) / weight_;
+  return std::min(std::max(seek_seconds / frame_seconds, 0.0), MAX_SEEK_COST);
+}
+
+DecodeCostModel& decode_cost_model(VideoDecoderType type) {
+  static DecodeCostModel software_model(SOFTWARE_PRIOR_SEEK_COST);
+  static DecodeCostModel nvidia_model(NVIDIA_PRIOR_SEEK_COST);
+  static DecodeCostModel intel_model(SOFTWARE_PRIOR_SEEK_COST);
+  switch (type) {
+    case VideoDecoderType::NVIDIA:
+      return nvidia_model;
+    case VideoDecoderType::INTEL:
+      return intel_model;
+    default:
+      return software_model;
+  }
+}
+}
+}
@@ -0,0 +1,65 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/video/video_decoder.h"
+
+#include <mutex>
+
+namespace scanner {
+namespace internal {
+
+///////////////////////////////////////////////////////////////////////////////
+/// DecodeCostModel
+//! Estimates what restarting a decoder at a keyframe costs compared to
+//! decoding one more frame, so that rows can be sliced into intervals that
+//! seek only when it is cheaper than decoding through.
+//
+// The time to decode an interval is modelled as a fixed seek cost plus a cost
+// per decoded frame, fit by least squares over exponentially decayed sums of
+// the intervals timed by DecoderAutomata. Until the fit is usable a prior per
+// decoder type is returned.
+class DecodeCostModel {
+ public:
+  DecodeCostModel(f64 prior_seek_cost);
+
+  //! Records that an interval decoding frames frames took seconds seconds,
+  //! including the flush of the decoder at its end.
+  void record_interval(i64 frames, f64 seconds);
+
+  //! The cost of a seek measured in decoded frames.
+  f64 seek_cost() const;
+
+ private:
+  const i32 MIN_SAMPLES = 8;
+  const f64 DECAY = 0.98;
+  const f64 MAX_SEEK_COST = 1024;
+
+  mutable std::mutex mutex_;
+  f64 prior_seek_cost_;
+  i64 samples_ = 0;
+  f64 weight_ = 0;
+  f64 frames_ = 0;
+  f64 seconds_ = 0;
+  f64 frames_sq_ = 0;
+  f64 frames_seconds_ = 0;
+};
+
+//! The process wide cost model of a decoder type.
+DecodeCostModel& decode_cost_model(VideoDecoderType type);
+}
+}
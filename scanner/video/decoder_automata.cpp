@@ -15,26 +15,40 @@
 
 #include "scanner/video/decoder_automata.h"
 #include "scanner/metadata.pb.h"
+#include "scanner/video/decode_cost_model.h"
 
 #include "scanner/util/h264.h"
+#include "scanner/util/hevc.h"
 #include "scanner/util/memory.h"
+#include "scanner/util/metrics.h"
 
+#include <algorithm>
 #include <thread>
 
 namespace scanner {
 namespace internal {
 
-DecoderAutomata::DecoderAutomata(DeviceHandle device_handle, i32 num_devices,
-                                 VideoDecoderType decoder_type)
-  : device_handle_(device_handle),
+DecoderAutomata::DecoderAutomata(
+    DeviceHandle device_handle, i32 num_devices, VideoDecoderType decoder_type,
+    proto::VideoDescriptor::VideoCodecType codec_type, bool slice_threads,
+    i32 gpu_surfaces)
+  : max_buffered_frames_(DEFAULT_BUFFERED_FRAMES),
+    device_handle_(device_handle),
     num_devices_(num_devices),
     decoder_type_(decoder_type),
+    codec_type_(codec_type),
     decoder_(VideoDecoder::make_from_config(device_handle, num_devices,
-                                            decoder_type)),
+                                            decoder_type, codec_type,
+                                            slice_threads, gpu_surfaces)),
     feeder_waiting_(false),
     not_done_(true),
     frames_retrieved_(0),
     skip_frames_(false) {
+  // Frames decoded ahead keep the decoder busy while the retriever copies
+  // out as many frames as there are surfaces
+  if (decoder_type == VideoDecoderType::NVIDIA && gpu_surfaces > 0) {
+    max_buffered_frames_ = std::max(gpu_surfaces, DEFAULT_BUFFERED_FRAMES);
+  }
   feeder_thread_ = std::thread(&DecoderAutomata::feeder, this);
 }
 
@@ -64,7 +78,8 @@ DecoderAutomata::~DecoderAutomata() {
 }
 
 void DecoderAutomata::initialize(
-    const std::vector<proto::DecodeArgs>& encoded_data) {
+    const std::vector<proto::DecodeArgs>& encoded_data,
+    const FrameInfo& output_info) {
   assert(!encoded_data.empty());
   while (decoder_->discard_frame()) {
   }
@@ -77,7 +92,6 @@ void DecoderAutomata::initialize(
   }
 
   encoded_data_ = encoded_data;
-  frame_size_ = encoded_data[0].width() * encoded_data[0].height() * 3;
   current_frame_ = encoded_data[0].start_keyframe();
   next_frame_.store(encoded_data[0].valid_frames(0), std::memory_order_release);
   retriever_data_idx_.store(0, std::memory_order_release);
@@ -85,9 +99,15 @@ void DecoderAutomata::initialize(
 
   FrameInfo info(encoded_data[0].height(), encoded_data[0].width(), 3,
                  FrameType::U8);
+  FrameInfo output = output_info;
+  if (output.width() <= 0 || output.height() <= 0) {
+    output = FrameInfo(info.height(), info.width(), 3, FrameType::U8,
+                       output_info.layout);
+  }
+  frame_size_ = output.size();
 
-  if (info_ != info) {
-    decoder_->configure(info);
+  if (info_ != info || output_info_ != output) {
+    decoder_->configure(info, output);
   }
   if (frames_retrieved_ > 0) {
     decoder_->feed(nullptr, 0, true);
@@ -95,6 +115,7 @@ void DecoderAutomata::initialize(
 
   set_feeder_idx(0);
   info_ = info;
+  output_info_ = output;
   std::atomic_thread_fence(std::memory_order_release);
   seeking_ = false;
 }
@@ -133,6 +154,13 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
     profiler_->add_interval("get_frames_wait", start, now());
   }
 
+  // Intervals decoded entirely within this call, from the first frame fed to
+  // the flush at their end, calibrate the cost model used to slice rows
+  DecodeCostModel& cost_model = decode_cost_model(decoder_type_);
+  bool timing_interval = retriever_valid_idx_ == 0;
+  auto interval_start = now();
+  i64 interval_frames = 0;
+
   while (frames_retrieved_ < frames_to_get_) {
     if (decoder_->decoded_frames_buffered() > 0) {
       auto iter = now();
@@ -159,9 +187,11 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
                 // Wait until feeder is waiting
                 // skip_frames_ = true;
                 std::unique_lock<std::mutex> lk(feeder_mutex_);
-                wake_feeder_.wait(lk, [this, &total_frames_decoded] {
+                wake_feeder_.wait(lk, [this, &total_frames_decoded,
+                                       &interval_frames] {
                   while (decoder_->discard_frame()) {
                     total_frames_decoded++;
+                    interval_frames++;
                   }
                   return feeder_waiting_.load();
                 });
@@ -172,6 +202,15 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
                 decoder_->feed(nullptr, 0, true);
                 seeking_ = false;
               }
+              if (timing_interval) {
+                cost_model.record_interval(
+                    interval_frames + 1,
+                    nano_since(interval_start) / 1000000000.0);
+              }
+              timing_interval = true;
+              interval_start = now();
+              // The frame just retrieved is counted below
+              interval_frames = -1;
 
               {
                 std::unique_lock<std::mutex> lk(feeder_mutex_);
@@ -198,6 +237,7 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
         }
         current_frame_++;
         total_frames_decoded++;
+        interval_frames++;
         // printf("curr frame %d, frames decoded %d\n", current_frame_,
         //        total_frames_decoded);
       }
@@ -208,6 +248,9 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
     std::this_thread::yield();
   }
   decoder_->wait_until_frames_copied();
+  static std::atomic<i64>& decoded_frames =
+      metric_counter("scanner_decoded_frames_total");
+  decoded_frames += total_frames_decoded;
   if (profiler_) {
     profiler_->add_interval("get_frames", start, now());
     profiler_->increment("frames_used", total_frames_used);
@@ -215,6 +258,19 @@ void DecoderAutomata::get_frames(u8* buffer, i32 num_frames) {
   }
 }
 
+void DecoderAutomata::finish() {
+  while (decoder_->discard_frame()) {
+  }
+
+  std::unique_lock<std::mutex> lk(feeder_mutex_);
+  wake_feeder_.wait(lk, [this] { return feeder_waiting_.load(); });
+
+  for (auto& args : encoded_data_) {
+    delete_buffer(CPU_DEVICE, (u8*)args.encoded_video());
+  }
+  encoded_data_.clear();
+}
+
 void DecoderAutomata::set_profiler(Profiler* profiler) {
   profiler_ = profiler;
   decoder_->set_profiler(profiler);
@@ -250,9 +306,8 @@ void DecoderAutomata::feeder() {
     frames_fed = 0;
     bool seen_metadata = false;
     while (frames_retrieved_ < frames_to_get_) {
-      i32 frames_to_wait = 8;
       while (frames_retrieved_ < frames_to_get_ &&
-             decoder_->decoded_frames_buffered() > frames_to_wait) {
+             decoder_->decoded_frames_buffered() > max_buffered_frames_) {
         wake_feeder_.notify_one();
         std::this_thread::yield();
       }
@@ -292,9 +347,10 @@ void DecoderAutomata::feeder() {
           if (encoded_packet_size == 0) {
             break;
           }
-          i32 nal_type = get_nal_unit_type(nal_start);
-          i32 nal_ref = get_nal_ref_idc(nal_start);
-          if (is_vcl_nal(nal_type)) {
+          bool vcl = codec_type_ == proto::VideoDescriptor::HEVC
+                         ? is_hevc_vcl_nal(get_hevc_nal_unit_type(nal_start))
+                         : is_vcl_nal(get_nal_unit_type(nal_start));
+          if (vcl) {
             encoded_packet = nal_start -= 3;
             encoded_packet_size = nal_size + encoded_packet_size + 3;
             break;
@@ -340,6 +396,9 @@ void DecoderAutomata::set_feeder_idx(i32 data_idx) {
   feeder_valid_idx_ = 0;
   feeder_buffer_offset_ = 0;
   if (feeder_data_idx_ < encoded_data_.size()) {
+    // Args trimmed to a later keyframe keep their buffer and start inside it
+    feeder_buffer_offset_ =
+        encoded_data_[feeder_data_idx_].keyframe_byte_offsets(0);
     feeder_current_frame_ = encoded_data_[feeder_data_idx_].keyframes(0);
     feeder_next_frame_ = encoded_data_[feeder_data_idx_].valid_frames(0);
     feeder_next_keyframe_ = encoded_data_[feeder_data_idx_].keyframes(1);
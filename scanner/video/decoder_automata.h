@@ -31,14 +31,28 @@ class DecoderAutomata {
   DecoderAutomata(const DecoderAutomata&& other) = delete;
 
  public:
+  //! NVIDIA decoders map gpu_surfaces surfaces at once and may decode as
+  //! many frames ahead of those retrieved, zero for the defaults.
   DecoderAutomata(DeviceHandle device_handle, i32 num_devices,
-                  VideoDecoderType decoder_type);
+                  VideoDecoderType decoder_type,
+                  proto::VideoDescriptor::VideoCodecType codec_type =
+                      proto::VideoDescriptor::H264,
+                  bool slice_threads = false, i32 gpu_surfaces = 0);
   ~DecoderAutomata();
 
-  void initialize(const std::vector<proto::DecodeArgs>& encoded_data);
+  //! Frames are written to the buffer passed to get_frames with the size and
+  //! layout of output_info. A zero width or height keeps the size of the
+  //! video.
+  void initialize(const std::vector<proto::DecodeArgs>& encoded_data,
+                  const FrameInfo& output_info = FrameInfo());
 
   void get_frames(u8* buffer, i32 num_frames);
 
+  //! Stops decoding the current decode args and frees their encoded data.
+  //! The decoder stays configured, so it can be initialized again with args
+  //! of the same shape without being recreated.
+  void finish();
+
   void set_profiler(Profiler* profiler);
 
  private:
@@ -46,19 +60,25 @@ class DecoderAutomata {
 
   void set_feeder_idx(i32 data_idx);
 
-  const i32 MAX_BUFFERED_FRAMES = 8;
+  const i32 DEFAULT_BUFFERED_FRAMES = 8;
+
+  // Decoded frames the feeder lets the decoder hold before it waits for the
+  // retriever
+  i32 max_buffered_frames_;
 
   Profiler* profiler_ = nullptr;
 
   DeviceHandle device_handle_;
   i32 num_devices_;
   VideoDecoderType decoder_type_;
+  proto::VideoDescriptor::VideoCodecType codec_type_;
   std::unique_ptr<VideoDecoder> decoder_;
   std::atomic<bool> feeder_waiting_;
   std::thread feeder_thread_;
   std::atomic<bool> not_done_;
 
   FrameInfo info_{};
+  FrameInfo output_info_{};
   size_t frame_size_;
   i32 current_frame_;
   std::atomic<i32> reset_current_frame_;
@@ -0,0 +1,104 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/video/decoder_pool.h"
+
+namespace scanner {
+namespace internal {
+
+bool DecoderKey::operator==(const DecoderKey& other) const {
+  return codec_type == other.codec_type &&
+         decoder_type == other.decoder_type &&
+         device_handle.type == other.device_handle.type &&
+         device_handle.id == other.device_handle.id &&
+         num_devices == other.num_devices &&
+         slice_threads == other.slice_threads &&
+         gpu_surfaces == other.gpu_surfaces && width == other.width &&
+         height == other.height && output_info == other.output_info;
+}
+
+bool DecoderKey::operator!=(const DecoderKey& other) const {
+  return !(*this == other);
+}
+
+std::unique_ptr<DecoderAutomata> DecoderPool::acquire(const DecoderKey& key) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (key.decoder_type == VideoDecoderType::NVIDIA) {
+      gpu_sessions_[key.device_handle.id]++;
+    }
+    // Prefer the most recently returned decoder
+    for (auto it = idle_.rbegin(); it != idle_.rend(); ++it) {
+      if (std::get<0>(*it) == key) {
+        std::unique_ptr<DecoderAutomata> decoder = std::move(std::get<1>(*it));
+        idle_.erase(std::next(it).base());
+        return decoder;
+      }
+    }
+  }
+  return std::unique_ptr<DecoderAutomata>(
+      new DecoderAutomata(key.device_handle, key.num_devices, key.decoder_type,
+                          key.codec_type, key.slice_threads,
+                          key.gpu_surfaces));
+}
+
+void DecoderPool::release(const DecoderKey& key,
+                          std::unique_ptr<DecoderAutomata> decoder) {
+  // The encoded data belongs to the memory pools of the current job
+  decoder->finish();
+  decoder->set_profiler(nullptr);
+  std::unique_ptr<DecoderAutomata> evicted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (key.decoder_type == VideoDecoderType::NVIDIA) {
+      gpu_sessions_[key.device_handle.id]--;
+    }
+    idle_.emplace_back(key, std::move(decoder));
+    if (idle_.size() > MAX_IDLE_DECODERS) {
+      evicted = std::move(std::get<1>(idle_.front()));
+      idle_.pop_front();
+    }
+  }
+}
+
+void DecoderPool::clear() {
+  std::list<std::tuple<DecoderKey, std::unique_ptr<DecoderAutomata>>> idle;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle.swap(idle_);
+  }
+}
+
+i32 DecoderPool::least_loaded_gpu(const std::vector<i32>& gpu_ids,
+                                  i32 preferred_gpu) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  i32 best_gpu = preferred_gpu;
+  i32 best_sessions = gpu_sessions_[preferred_gpu];
+  for (i32 gpu : gpu_ids) {
+    i32 sessions = gpu_sessions_[gpu];
+    if (sessions < best_sessions) {
+      best_gpu = gpu;
+      best_sessions = sessions;
+    }
+  }
+  return best_gpu;
+}
+
+DecoderPool& decoder_pool() {
+  static DecoderPool pool;
+  return pool;
+}
+}
+}
@@ -0,0 +1,85 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/metadata.pb.h"
+#include "scanner/video/decoder_automata.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace scanner {
+namespace internal {
+
+//! Identifies decoders that can be reused for an item without being
+//! reconfigured.
+struct DecoderKey {
+  bool operator==(const DecoderKey& other) const;
+  bool operator!=(const DecoderKey& other) const;
+
+  proto::VideoDescriptor::VideoCodecType codec_type;
+  VideoDecoderType decoder_type;
+  DeviceHandle device_handle;
+  i32 num_devices;
+  bool slice_threads;
+  // Surfaces of NVIDIA decoders, zero for the default
+  i32 gpu_surfaces;
+  // Size of the encoded video
+  i32 width;
+  i32 height;
+  // Frames produced by the decoder
+  FrameInfo output_info;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+/// DecoderPool
+//! Keeps decoders that are not in use so that creating them, which is
+//! expensive for hardware decoder sessions, happens once per shape rather
+//! than once per task.
+class DecoderPool {
+ public:
+  //! Returns an idle decoder for key, or a new one if there is none. A
+  //! decoder configured for key is only produced once it is initialized with
+  //! the matching decode args.
+  std::unique_ptr<DecoderAutomata> acquire(const DecoderKey& key);
+
+  //! Hands a decoder last configured for key back to the pool, dropping the
+  //! least recently returned decoder if more than MAX_IDLE_DECODERS are idle.
+  void release(const DecoderKey& key,
+               std::unique_ptr<DecoderAutomata> decoder);
+
+  //! Destroys all idle decoders.
+  void clear();
+
+  //! The GPU in gpu_ids with the fewest NVIDIA decoders in use, preferring
+  //! preferred_gpu among the least loaded.
+  i32 least_loaded_gpu(const std::vector<i32>& gpu_ids, i32 preferred_gpu);
+
+ private:
+  const size_t MAX_IDLE_DECODERS = 16;
+
+  std::mutex mutex_;
+  // NVIDIA decoders acquired and not yet released on each GPU
+  std::map<i32, i32> gpu_sessions_;
+  std::list<std::tuple<DecoderKey, std::unique_ptr<DecoderAutomata>>> idle_;
+};
+
+//! The decoder pool shared by the workers of this process.
+DecoderPool& decoder_pool();
+}
+}
@@ -47,7 +47,7 @@ namespace scanner {
 namespace internal {
 
 H264ByteStreamIndexCreator::H264ByteStreamIndexCreator(WriteFile* b)
-  : demuxed_bytestream_(b) {}
+  : ByteStreamIndexCreator(b) {}
 
 bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
   u8* orig_data = data;
@@ -88,33 +88,34 @@ bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
         saw_sps_nal_ = false;
       }
     }
+    // Only parameter sets are parsed from their RBSP, so slices, which make
+    // up nearly all of the bytes, are not copied
     std::vector<u8> rbsp_buffer;
-    rbsp_buffer.reserve(64 * 1024);
-    u32 consecutive_zeros = 0;
-    i32 bytes = nal_size - 1;
-    const u8* pb = nal_start + 1;
-    while (bytes > 0) {
-      /* Copy the byte into the rbsp, unless it
-       * is the 0x03 in a 0x000003 */
-      if (consecutive_zeros < 2 || *pb != 0x03) {
-        rbsp_buffer.push_back(*pb);
-      }
-      if (*pb == 0) {
-        ++consecutive_zeros;
-      } else {
-        consecutive_zeros = 0;
+    if (nal_unit_type == 7 || nal_unit_type == 8) {
+      rbsp_buffer.reserve(nal_size);
+      u32 consecutive_zeros = 0;
+      i32 bytes = nal_size - 1;
+      const u8* pb = nal_start + 1;
+      while (bytes > 0) {
+        /* Copy the byte into the rbsp, unless it
+         * is the 0x03 in a 0x000003 */
+        if (consecutive_zeros < 2 || *pb != 0x03) {
+          rbsp_buffer.push_back(*pb);
+        }
+        if (*pb == 0) {
+          ++consecutive_zeros;
+        } else {
+          consecutive_zeros = 0;
+        }
+        ++pb;
+        --bytes;
       }
-      ++pb;
-      --bytes;
     }
 
     // We need to track the last SPS NAL because some streams do
     // not insert an SPS every keyframe and we need to insert it
     // ourselves.
-    // fprintf(stderr, "nal_size %d, rbsp size %lu\n", nal_size,
-    // rbsp_buffer.size());
     const u8* rbsp_start = rbsp_buffer.data();
-    i32 rbsp_size = rbsp_buffer.size();
 
     // SPS
     if (nal_unit_type == 7) {
@@ -159,8 +160,12 @@ bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
               << ", frame " << frame_;
     }
     if (is_vcl_nal(nal_unit_type)) {
-      assert(last_pps_ != -1);
-      assert(last_sps_ != -1);
+      // Streams cut at a keyframe without its parameter sets can not be
+      // parsed
+      if (last_pps_ == (u32)-1 || last_sps_ == (u32)-1) {
+        error_message_ = "Slice before any sps and pps";
+        return false;
+      }
       GetBitsState gb;
       gb.buffer = nal_start;
       gb.offset = 8;
@@ -211,6 +216,7 @@ bool H264ByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
           s_write(demuxed_bytestream_, orig_data, orig_size);
 
           bytestream_pos_ += sizeof(size) + size;
+          keyframe_packet_sizes_.push_back(sizeof(size) + size);
         } else {
           s_write(demuxed_bytestream_, orig_size);
           // Append the packet to the stream
@@ -0,0 +1,169 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/video/hevc_byte_stream_index_creator.h"
+#include "scanner/util/storehouse.h"
+
+#include <glog/logging.h>
+
+using storehouse::WriteFile;
+
+namespace scanner {
+namespace internal {
+
+HEVCByteStreamIndexCreator::HEVCByteStreamIndexCreator(WriteFile* b)
+  : ByteStreamIndexCreator(b) {}
+
+bool HEVCByteStreamIndexCreator::feed_packet(u8* data, size_t size) {
+  i32 orig_size = size;
+  i64 nal_bytestream_offset = bytestream_pos_;
+
+  bool has_picture = false;
+  bool is_keyframe = false;
+  const u8* nal_parse = data;
+  i32 size_left = size;
+  while (size_left > 3) {
+    const u8* nal_start = nullptr;
+    i32 nal_size = 0;
+    next_nal(nal_parse, size_left, nal_start, nal_size);
+
+    if (size_left < 0 || nal_size < 2) {
+      continue;
+    }
+    nals_parsed_++;
+
+    i32 nal_unit_type = get_hevc_nal_unit_type(nal_start);
+    VLOG(2) << "frame " << frame_ << ", nal size " << nal_size
+            << ", nal unit " << nal_unit_type;
+
+    if (nal_unit_type == HEVC_VPS_NAL || nal_unit_type == HEVC_SPS_NAL ||
+        nal_unit_type == HEVC_PPS_NAL) {
+      // Parameter set ids are read from the payload after the two byte NAL
+      // header, with emulation prevention bytes removed
+      std::vector<u8> rbsp_buffer;
+      u32 consecutive_zeros = 0;
+      for (const u8* pb = nal_start + 2; pb < nal_start + nal_size; ++pb) {
+        if (consecutive_zeros < 2 || *pb != 0x03) {
+          rbsp_buffer.push_back(*pb);
+        }
+        consecutive_zeros = (*pb == 0) ? consecutive_zeros + 1 : 0;
+      }
+      // Set bits after the payload stop exp-Golomb codes from reading past
+      // the buffer when the parameter set is truncated
+      size_t rbsp_size = rbsp_buffer.size();
+      rbsp_buffer.resize(rbsp_size + 64, 0xFF);
+      GetBitsState gb;
+      gb.buffer = rbsp_buffer.data();
+      gb.offset = 0;
+
+      std::map<u32, std::vector<u8>>* nal_bytes;
+      u32 id;
+      if (nal_unit_type == HEVC_VPS_NAL) {
+        id = parse_hevc_vps_id(gb);
+        nal_bytes = &vps_nal_bytes_;
+        saw_vps_ = true;
+      } else if (nal_unit_type == HEVC_SPS_NAL) {
+        id = parse_hevc_sps_id(gb);
+        nal_bytes = &sps_nal_bytes_;
+        saw_sps_ = true;
+      } else {
+        id = parse_hevc_pps_id(gb);
+        nal_bytes = &pps_nal_bytes_;
+        saw_pps_ = true;
+      }
+      if (gb.offset > static_cast<i64>(rbsp_size) * 8) {
+        error_message_ = "Failed to parse parameter set";
+        return false;
+      }
+      // Keep the start code with the NAL so it can be replayed as is
+      std::vector<u8>& bytes = (*nal_bytes)[id];
+      bytes.assign(nal_start - 3, nal_start + nal_size);
+      VLOG(2) << "Parameter set " << nal_unit_type << " (" << id << ")"
+              << " seen at frame " << frame_;
+      continue;
+    }
+
+    if (!is_hevc_vcl_nal(nal_unit_type) ||
+        !is_hevc_first_slice_segment(nal_start, nal_size)) {
+      continue;
+    }
+
+    // The first slice segment of a picture. Packets hold one picture, so the
+    // rest of the packet is not examined.
+    has_picture = true;
+    is_keyframe = is_hevc_idr_nal(nal_unit_type);
+    break;
+  }
+
+  // Packets without a picture (parameter sets, SEI, end of sequence) are
+  // carried into the next picture's packet, since the decoder counts one
+  // frame per stored packet
+  if (!has_picture) {
+    pending_bytes_.insert(pending_bytes_.end(), data, data + orig_size);
+    return true;
+  }
+
+  frame_++;
+  i32 size = static_cast<i32>(pending_bytes_.size()) + orig_size;
+  // Keyframes must carry every parameter set type so that decoding can start
+  // at them; the stored ones are added only when the stream did not repeat
+  // them in front of this picture
+  bool prepend_parameter_sets = false;
+  if (is_keyframe) {
+    if (sps_nal_bytes_.empty() || pps_nal_bytes_.empty()) {
+      error_message_ = "Keyframe before any parameter sets";
+      return false;
+    }
+    keyframe_byte_offsets_.push_back(nal_bytestream_offset);
+    keyframe_positions_.push_back(frame_ - 1);
+    keyframe_timestamps_.push_back(frame_ - 1);
+    VLOG(2) << "keyframe " << frame_ - 1 << ", byte offset "
+            << nal_bytestream_offset;
+
+    prepend_parameter_sets = !(saw_vps_ && saw_sps_ && saw_pps_);
+    if (prepend_parameter_sets) {
+      for (auto* m : {&vps_nal_bytes_, &sps_nal_bytes_, &pps_nal_bytes_}) {
+        for (auto& kv : *m) {
+          size += static_cast<i32>(kv.second.size());
+        }
+      }
+    }
+  }
+
+  s_write(demuxed_bytestream_, size);
+  if (prepend_parameter_sets) {
+    for (auto* m : {&vps_nal_bytes_, &sps_nal_bytes_, &pps_nal_bytes_}) {
+      for (auto& kv : *m) {
+        s_write(demuxed_bytestream_, kv.second.data(), kv.second.size());
+      }
+    }
+  }
+  if (!pending_bytes_.empty()) {
+    s_write(demuxed_bytestream_, pending_bytes_.data(), pending_bytes_.size());
+  }
+  s_write(demuxed_bytestream_, data, orig_size);
+  bytestream_pos_ += sizeof(size) + size;
+  if (is_keyframe) {
+    keyframe_packet_sizes_.push_back(sizeof(size) + size);
+  }
+
+  pending_bytes_.clear();
+  saw_vps_ = false;
+  saw_sps_ = false;
+  saw_pps_ = false;
+  return true;
+}
+}
+}
@@ -0,0 +1,48 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+#include "scanner/util/hevc.h"
+#include "scanner/video/byte_stream_index_creator.h"
+
+#include <map>
+
+namespace scanner {
+namespace internal {
+
+//! Index creator for HEVC streams. Only IDR pictures are recorded as
+//! keyframes, since decoding can not start cleanly at other random access
+//! points.
+class HEVCByteStreamIndexCreator : public ByteStreamIndexCreator {
+ public:
+  HEVCByteStreamIndexCreator(storehouse::WriteFile* demuxed_bytestream);
+
+  bool feed_packet(u8* data, size_t size) override;
+
+ private:
+  std::map<u32, std::vector<u8>> vps_nal_bytes_;
+  std::map<u32, std::vector<u8>> sps_nal_bytes_;
+  std::map<u32, std::vector<u8>> pps_nal_bytes_;
+  //! Packets without a picture, written in front of the next picture
+  std::vector<u8> pending_bytes_;
+  //! Parameter set types seen since the last picture was written
+  bool saw_vps_ = false;
+  bool saw_sps_ = false;
+  bool saw_pps_ = false;
+};
+}
+}
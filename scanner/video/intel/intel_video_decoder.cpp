@@ -14,238 +14,384 @@
  */
 
 #include "scanner/video/intel/intel_video_decoder.h"
-#include "scanner/util/h264.h"
 
 extern "C" {
-#include "libavcodec/avcodec.h"
-#include "libavformat/avformat.h"
+#include "libavfilter/buffersink.h"
+#include "libavfilter/buffersrc.h"
 #include "libavutil/error.h"
 #include "libavutil/frame.h"
 #include "libavutil/imgutils.h"
-#include "libavutil/opt.h"
-#include "libswscale/swscale.h"
 }
 
-#ifdef HAVE_CUDA
-#include "scanner/util/cuda.h"
-#endif
+namespace scanner {
+namespace internal {
 
-#include <cassert>
+namespace {
 
-namespace scanner {
+// Host frames only borrow the buffers that frames are copied into
+void borrow_buffer(void* opaque, uint8_t* data) {}
+
+const char* decoder_name(proto::VideoDescriptor::VideoCodecType codec_type) {
+  return codec_type == proto::VideoDescriptor::HEVC ? "hevc_qsv" : "h264_qsv";
+}
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 /// IntelVideoDecoder
-IntelVideoDecoder::IntelVideoDecoder(int device_id, DeviceType output_type)
+bool IntelVideoDecoder::is_available() {
+  static bool available = [] {
+    if (avcodec_find_decoder_by_name(
+            decoder_name(proto::VideoDescriptor::H264)) == nullptr) {
+      return false;
+    }
+    AVBufferRef* device_ctx = nullptr;
+    if (av_hwdevice_ctx_create(&device_ctx, AV_HWDEVICE_TYPE_QSV, nullptr,
+                               nullptr, 0) < 0) {
+      return false;
+    }
+    av_buffer_unref(&device_ctx);
+    return true;
+  }();
+  return available;
+}
+
+IntelVideoDecoder::IntelVideoDecoder(
+    i32 device_id, DeviceType output_type,
+    proto::VideoDescriptor::VideoCodecType codec_type)
   : device_id_(device_id),
     output_type_(output_type),
+    device_ctx_(nullptr),
     codec_(nullptr),
     cc_(nullptr),
-    reset_context_(true),
-    sws_context_(nullptr) {
-  if (output_type != DeviceType::CPU && output_type != DeviceType::GPU) {
-    LOG(FATAL) << "Unsupported output type for intel decoder";
-  }
+    vpp_format_(AV_PIX_FMT_NV12),
+    use_vpp_(false),
+    vpp_graph_(nullptr),
+    vpp_source_(nullptr),
+    vpp_sink_(nullptr),
+    sws_context_(nullptr),
+    frame_pool_(1024),
+    decoded_frame_queue_(1024) {
+  LOG_IF(FATAL, output_type != DeviceType::CPU)
+      << "Intel decoders only output frames to the CPU";
   av_init_packet(&packet_);
 
-  codec_ = avcodec_find_decoder_by_name("h264_qsv");
-  if (!codec_) {
-    fprintf(stderr, "could not find h264_qsv decoder\n");
-    exit(EXIT_FAILURE);
+  if (av_hwdevice_ctx_create(&device_ctx_, AV_HWDEVICE_TYPE_QSV, nullptr,
+                             nullptr, 0) < 0) {
+    LOG(FATAL) << "Could not open a QuickSync device";
   }
 
+  const char* codec_name = decoder_name(codec_type);
+  codec_ = avcodec_find_decoder_by_name(codec_name);
+  LOG_IF(FATAL, codec_ == nullptr) << "Could not find the " << codec_name
+                                   << " decoder";
+
   cc_ = avcodec_alloc_context3(codec_);
-  if (!cc_) {
-    fprintf(stderr, "could not alloc codec context");
-    exit(EXIT_FAILURE);
-  }
+  LOG_IF(FATAL, cc_ == nullptr) << "Could not alloc codec context";
+
+  // Frames are decoded into surfaces of the QuickSync device, which the
+  // codec allocates as one pool when it sees the first sequence header
+  cc_->hw_device_ctx = av_buffer_ref(device_ctx_);
+  cc_->get_format = IntelVideoDecoder::get_format;
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 18, 100)
+  cc_->extra_hw_frames = extra_surfaces_;
+#endif
 
   if (avcodec_open2(cc_, codec_, NULL) < 0) {
-    fprintf(stderr, "could not open codec\n");
-    assert(false);
+    LOG(FATAL) << "Could not open codec " << codec_name;
   }
+
+  vpp_frame_ = av_frame_alloc();
+  host_frame_ = av_frame_alloc();
 }
 
 IntelVideoDecoder::~IntelVideoDecoder() {
-#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(55, 53, 0)
-  avcodec_free_context(&cc_);
-#else
-  avcodec_close(cc_);
-  av_freep(&cc_);
-#endif
-  for (AVFrame* frame : frame_pool_) {
+  free_vpp();
+  while (decoded_frame_queue_.size() > 0) {
+    AVFrame* frame;
+    decoded_frame_queue_.pop(frame);
     av_frame_free(&frame);
   }
-  for (AVFrame* frame : decoded_frame_queue_) {
+  while (frame_pool_.size() > 0) {
+    AVFrame* frame;
+    frame_pool_.pop(frame);
     av_frame_free(&frame);
   }
+  av_frame_free(&vpp_frame_);
+  av_frame_free(&host_frame_);
+  avcodec_free_context(&cc_);
+  sws_freeContext(sws_context_);
+  av_buffer_unref(&device_ctx_);
 }
 
-void IntelVideoDecoder::configure(const InputFormat& metadata) {
-  metadata_ = metadata;
-  reset_context_ = true;
+void IntelVideoDecoder::configure(const FrameInfo& metadata,
+                                  const FrameInfo& output_info) {
+  frame_width_ = metadata.width();
+  frame_height_ = metadata.height();
+  output_width_ = output_info.width();
+  output_height_ = output_info.height();
+  output_layout_ = output_info.layout;
 
-  int required_size = av_image_get_buffer_size(
-      AV_PIX_FMT_RGB24, metadata_.width(), metadata_.height(), 1);
+  // Surfaces are NV12, so VPP only runs to scale them or to convert them
+  // for RGB output
+  vpp_format_ = output_layout_ == FrameLayout::NV12 ? AV_PIX_FMT_NV12
+                                                    : AV_PIX_FMT_BGRA;
+  use_vpp_ = vpp_format_ != AV_PIX_FMT_NV12 ||
+             output_width_ != frame_width_ ||
+             output_height_ != frame_height_;
+  // The graph is built for the surfaces of the first frame decoded
+  free_vpp();
 
-  conversion_buffer_.resize(required_size);
+  if (vpp_format_ == AV_PIX_FMT_BGRA) {
+    conversion_buffer_.resize(av_image_get_buffer_size(
+        AV_PIX_FMT_BGRA, output_width_, output_height_, 1));
+    sws_context_ = sws_getCachedContext(
+        sws_context_, output_width_, output_height_, AV_PIX_FMT_BGRA,
+        output_width_, output_height_, AV_PIX_FMT_RGB24, SWS_POINT, NULL,
+        NULL, NULL);
+    LOG_IF(FATAL, sws_context_ == NULL)
+        << "Could not get sws_context for rgb conversion";
+  }
 }
 
 bool IntelVideoDecoder::feed(const u8* encoded_buffer, size_t encoded_size,
                              bool discontinuity) {
-// Debug read packets
-#if 0
-  i32 es = (i32)encoded_size;
-  const u8* b = encoded_buffer;
-  while (es > 0) {
-    const u8* nal_start;
-    i32 nal_size;
-    next_nal(b, es, nal_start, nal_size);
-    i32 nal_unit_type = get_nal_unit_type(nal_start);
-    printf("nal unit type %d\n", nal_unit_type);
-
-    if (nal_unit_type == 7) {
-      i32 offset = 32;
-      i32 sps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      printf("SPS NAL (%d)\n", sps_id);
-    }
-    if (nal_unit_type == 8) {
-      i32 offset = 8;
-      i32 pps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      i32 sps_id = parse_exp_golomb(nal_start, nal_size, offset);
-      printf("PPS id: %d, SPS id: %d\n", pps_id, sps_id);
-    }
-  }
-#endif
   if (discontinuity) {
-    avcodec_flush_buffers(cc_);
-  }
-  if (av_new_packet(&packet_, encoded_size) < 0) {
-    fprintf(stderr, "could not allocate packet for feeding into decoder\n");
-    assert(false);
-  }
-  memcpy(packet_.data, encoded_buffer, encoded_size);
-
-  uint8_t* orig_data = packet_.data;
-  int orig_size = packet_.size;
-  int got_picture = 0;
-  do {
-    // Get frame from pool of allocated frames to decode video into
-    if (frame_pool_.empty()) {
-      // Create a new frame if our pool is empty
-      frame_pool_.push_back(av_frame_alloc());
+    while (decoded_frame_queue_.size() > 0) {
+      AVFrame* frame;
+      decoded_frame_queue_.pop(frame);
+      av_frame_unref(frame);
+      frame_pool_.push(frame);
     }
-    AVFrame* frame = frame_pool_.back();
-    frame_pool_.pop_back();
 
-    int consumed_length =
-        avcodec_decode_video2(cc_, frame, &got_picture, &packet_);
-    if (consumed_length < 0) {
-      char err_msg[256];
-      av_strerror(consumed_length, err_msg, 256);
-      fprintf(stderr, "Error while decoding frame (%d): %s\n", consumed_length,
-              err_msg);
-      assert(false);
-    }
-    if (got_picture) {
-      if (frame->buf[0] == NULL) {
-        // Must copy packet as data is stored statically
-        AVFrame* cloned_frame = av_frame_clone(frame);
-        if (cloned_frame == NULL) {
-          fprintf(stderr, "could not clone frame\n");
-          assert(false);
-        }
-        decoded_frame_queue_.push_back(cloned_frame);
-        av_frame_free(&frame);
-      } else {
-        // Frame is reference counted so we can just take it directly
-        decoded_frame_queue_.push_back(frame);
-      }
-    } else {
-      frame_pool_.push_back(frame);
+    packet_.data = NULL;
+    packet_.size = 0;
+    feed_packet(true);
+    return false;
+  }
+  if (encoded_size > 0) {
+    if (av_new_packet(&packet_, encoded_size) < 0) {
+      LOG(FATAL) << "Could not allocate packet for feeding into decoder";
     }
-    packet_.data += consumed_length;
-    packet_.size -= consumed_length;
-  } while (packet_.size > 0 || (orig_size == 0 && got_picture));
-  packet_.data = orig_data;
-  packet_.size = orig_size;
+    memcpy(packet_.data, encoded_buffer, encoded_size);
+  } else {
+    packet_.data = NULL;
+    packet_.size = 0;
+  }
+
+  feed_packet(false);
   av_packet_unref(&packet_);
 
   return decoded_frame_queue_.size() > 0;
 }
 
 bool IntelVideoDecoder::discard_frame() {
-  AVFrame* frame = decoded_frame_queue_.front();
-  decoded_frame_queue_.pop_front();
-  av_frame_unref(frame);
-  frame_pool_.push_back(frame);
+  if (decoded_frame_queue_.size() > 0) {
+    AVFrame* frame;
+    decoded_frame_queue_.pop(frame);
+    av_frame_unref(frame);
+    frame_pool_.push(frame);
+  }
 
   return decoded_frame_queue_.size() > 0;
 }
 
 bool IntelVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
-  int64_t size_left = decoded_size;
+  AVFrame* frame;
+  if (decoded_frame_queue_.size() > 0) {
+    decoded_frame_queue_.pop(frame);
+  } else {
+    return false;
+  }
 
-  AVFrame* frame = decoded_frame_queue_.front();
-  decoded_frame_queue_.pop_front();
+  AVFrame* surface = frame;
+  if (use_vpp_) {
+    if (vpp_graph_ == nullptr) {
+      init_vpp(frame->hw_frames_ctx);
+    }
+    auto vpp_start = now();
+    if (av_buffersrc_add_frame(vpp_source_, frame) < 0) {
+      LOG(FATAL) << "Could not feed a frame to VPP";
+    }
+    if (av_buffersink_get_frame(vpp_sink_, vpp_frame_) < 0) {
+      LOG(FATAL) << "Could not get a frame from VPP";
+    }
+    if (profiler_) {
+      profiler_->add_interval("qsv:vpp", vpp_start, now());
+    }
+    surface = vpp_frame_;
+  }
 
-  if (reset_context_) {
-    AVPixelFormat decoder_pixel_format = cc_->pix_fmt;
-    sws_context_ = sws_getCachedContext(
-        sws_context_, metadata_.width(), metadata_.height(),
-        decoder_pixel_format, metadata_.width(), metadata_.height(),
-        AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+  if (vpp_format_ == AV_PIX_FMT_NV12) {
+    transfer_frame(surface, AV_PIX_FMT_NV12, decoded_buffer, decoded_size);
+  } else {
+    transfer_frame(surface, AV_PIX_FMT_BGRA, conversion_buffer_.data(),
+                   conversion_buffer_.size());
+    uint8_t* in_slices[4];
+    int in_linesizes[4];
+    av_image_fill_arrays(in_slices, in_linesizes, conversion_buffer_.data(),
+                         AV_PIX_FMT_BGRA, output_width_, output_height_, 1);
+    uint8_t* out_slices[4];
+    int out_linesizes[4];
+    int required_size = av_image_fill_arrays(
+        out_slices, out_linesizes, decoded_buffer, AV_PIX_FMT_RGB24,
+        output_width_, output_height_, 1);
+    if (required_size < 0 || required_size > decoded_size) {
+      LOG(FATAL) << "Decode buffer not large enough for image";
+    }
+    auto scale_start = now();
+    if (sws_scale(sws_context_, in_slices, in_linesizes, 0, output_height_,
+                  out_slices, out_linesizes) < 0) {
+      LOG(FATAL) << "sws_scale failed";
+    }
+    if (profiler_) {
+      profiler_->add_interval("ffmpeg:scale_frame", scale_start, now());
+    }
   }
 
-  if (sws_context_ == NULL) {
-    fprintf(stderr, "Could not get sws_context for rgb conversion\n");
-    exit(EXIT_FAILURE);
+  av_frame_unref(vpp_frame_);
+  av_frame_unref(frame);
+  frame_pool_.push(frame);
+
+  return decoded_frame_queue_.size() > 0;
+}
+
+int IntelVideoDecoder::decoded_frames_buffered() {
+  return decoded_frame_queue_.size();
+}
+
+void IntelVideoDecoder::wait_until_frames_copied() {}
+
+AVPixelFormat IntelVideoDecoder::get_format(AVCodecContext* cc,
+                                            const AVPixelFormat* formats) {
+  for (const AVPixelFormat* format = formats; *format != AV_PIX_FMT_NONE;
+       ++format) {
+    if (*format == AV_PIX_FMT_QSV) {
+      return *format;
+    }
   }
+  LOG(FATAL) << "QuickSync decoder does not offer video memory surfaces";
+  return AV_PIX_FMT_NONE;
+}
 
-  u8* scale_buffer = nullptr;
-  if (output_type_ == DeviceType::GPU) {
-    scale_buffer = conversion_buffer_.data();
-  } else if (output_type_ == DeviceType::CPU) {
-    scale_buffer = decoded_buffer;
+void IntelVideoDecoder::feed_packet(bool flush) {
+  auto send_start = now();
+  int error = avcodec_send_packet(cc_, &packet_);
+  if (error != AVERROR_EOF && error < 0) {
+    char err_msg[256];
+    av_strerror(error, err_msg, 256);
+    LOG(FATAL) << "Error while sending packet (" << error << "): " << err_msg;
   }
+  auto send_end = now();
 
-  uint8_t* out_slices[4];
-  int out_linesizes[4];
-  int required_size = av_image_fill_arrays(
-      out_slices, out_linesizes, scale_buffer, AV_PIX_FMT_RGB24,
-      metadata_.width(), metadata_.height(), 1);
-  if (required_size < 0) {
-    fprintf(stderr, "Error in av_image_fill_arrays\n");
-    exit(EXIT_FAILURE);
+  auto received_start = now();
+  while (true) {
+    if (frame_pool_.size() <= 0) {
+      // Create a new frame if our pool is empty
+      frame_pool_.push(av_frame_alloc());
+    }
+    AVFrame* frame;
+    frame_pool_.pop(frame);
+
+    error = avcodec_receive_frame(cc_, frame);
+    if (error == 0 && !flush) {
+      decoded_frame_queue_.push(frame);
+      continue;
+    }
+    av_frame_unref(frame);
+    frame_pool_.push(frame);
+    if (error == AVERROR_EOF || error == AVERROR(EAGAIN)) {
+      break;
+    } else if (error < 0) {
+      char err_msg[256];
+      av_strerror(error, err_msg, 256);
+      LOG(FATAL) << "Error while receiving frame (" << error
+                 << "): " << err_msg;
+    }
   }
-  if (required_size > decoded_size) {
-    fprintf(stderr, "Decode buffer not large enough for image\n");
-    exit(EXIT_FAILURE);
+  auto received_end = now();
+  if (profiler_) {
+    profiler_->add_interval("ffmpeg:send_packet", send_start, send_end);
+    profiler_->add_interval("ffmpeg:receive_frame", received_start,
+                            received_end);
   }
-  if (sws_scale(sws_context_, frame->data, frame->linesize, 0, frame->height,
-                out_slices, out_linesizes) < 0) {
-    fprintf(stderr, "sws_scale failed\n");
-    exit(EXIT_FAILURE);
+  if (packet_.size == 0) {
+    avcodec_flush_buffers(cc_);
   }
+}
 
-  if (output_type_ == DeviceType::GPU) {
-#ifdef HAVE_CUDA
-    cudaMemcpy(decoded_buffer, scale_buffer, required_size,
-               cudaMemcpyHostToDevice);
-#else
-    LOG(FATAL) << "Unsupported output type for software decoder";
-#endif
-  }
+void IntelVideoDecoder::init_vpp(AVBufferRef* frames_ctx) {
+  vpp_graph_ = avfilter_graph_alloc();
+  LOG_IF(FATAL, vpp_graph_ == nullptr) << "Could not alloc VPP filter graph";
 
-  av_frame_unref(frame);
-  frame_pool_.push_back(frame);
+  char args[256];
+  snprintf(args, sizeof(args),
+           "video_size=%dx%d:pix_fmt=%d:time_base=1/25:pixel_aspect=1/1",
+           frame_width_, frame_height_, AV_PIX_FMT_QSV);
+  if (avfilter_graph_create_filter(&vpp_source_,
+                                   avfilter_get_by_name("buffer"), "in", args,
+                                   nullptr, vpp_graph_) < 0) {
+    LOG(FATAL) << "Could not create VPP source";
+  }
+  // Frames stay in the surfaces the codec decoded them into
+  AVBufferSrcParameters* params = av_buffersrc_parameters_alloc();
+  params->hw_frames_ctx = frames_ctx;
+  if (av_buffersrc_parameters_set(vpp_source_, params) < 0) {
+    LOG(FATAL) << "Could not set the surfaces of the VPP source";
+  }
+  av_free(params);
 
-  return decoded_frame_queue_.size() > 0;
+  AVFilterContext* vpp = nullptr;
+  snprintf(args, sizeof(args), "w=%d:h=%d:format=%s", output_width_,
+           output_height_, vpp_format_ == AV_PIX_FMT_NV12 ? "nv12" : "rgb32");
+  if (avfilter_graph_create_filter(&vpp, avfilter_get_by_name("vpp_qsv"),
+                                   "vpp", args, nullptr, vpp_graph_) < 0) {
+    LOG(FATAL) << "Could not create vpp_qsv filter with " << args;
+  }
+  if (avfilter_graph_create_filter(&vpp_sink_,
+                                   avfilter_get_by_name("buffersink"), "out",
+                                   nullptr, nullptr, vpp_graph_) < 0) {
+    LOG(FATAL) << "Could not create VPP sink";
+  }
+  if (avfilter_link(vpp_source_, 0, vpp, 0) < 0 ||
+      avfilter_link(vpp, 0, vpp_sink_, 0) < 0 ||
+      avfilter_graph_config(vpp_graph_, nullptr) < 0) {
+    LOG(FATAL) << "Could not configure VPP filter graph";
+  }
 }
 
-int IntelVideoDecoder::decoded_frames_buffered() {
-  return decoded_frame_queue_.size();
+void IntelVideoDecoder::free_vpp() {
+  avfilter_graph_free(&vpp_graph_);
+  vpp_source_ = nullptr;
+  vpp_sink_ = nullptr;
 }
 
-void IntelVideoDecoder::wait_until_frames_copied() {}
+void IntelVideoDecoder::transfer_frame(AVFrame* frame, AVPixelFormat format,
+                                       u8* buffer, size_t size) {
+  host_frame_->format = format;
+  host_frame_->width = output_width_;
+  host_frame_->height = output_height_;
+  int required_size =
+      av_image_fill_arrays(host_frame_->data, host_frame_->linesize, buffer,
+                           format, output_width_, output_height_, 1);
+  if (required_size < 0) {
+    LOG(FATAL) << "Error in av_image_fill_arrays";
+  }
+  if (required_size > size) {
+    LOG(FATAL) << "Decode buffer not large enough for image";
+  }
+  // With a buffer attached, the transfer writes into it instead of
+  // allocating a frame of its own
+  host_frame_->buf[0] =
+      av_buffer_create(buffer, size, borrow_buffer, nullptr, 0);
+
+  auto transfer_start = now();
+  if (av_hwframe_transfer_data(host_frame_, frame, 0) < 0) {
+    LOG(FATAL) << "Could not copy a frame out of video memory";
+  }
+  if (profiler_) {
+    profiler_->add_interval("qsv:transfer_frame", transfer_start, now());
+  }
+  av_frame_unref(host_frame_);
+}
+}
 }
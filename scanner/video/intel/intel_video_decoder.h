@@ -15,34 +15,41 @@
 
 #pragma once
 
-#include "scanner/eval/evaluator.h"
+#include "scanner/api/kernel.h"
+#include "scanner/util/queue.h"
 #include "scanner/video/video_decoder.h"
 
 extern "C" {
 #include "libavcodec/avcodec.h"
 #include "libavfilter/avfilter.h"
-#include "libavformat/avformat.h"
-#include "libavformat/avio.h"
-#include "libavutil/error.h"
-#include "libavutil/opt.h"
-#include "libavutil/pixdesc.h"
+#include "libavutil/buffer.h"
+#include "libavutil/hwcontext.h"
 #include "libswscale/swscale.h"
 }
 
-#include <deque>
 #include <vector>
 
 namespace scanner {
+namespace internal {
 
 ///////////////////////////////////////////////////////////////////////////////
 /// IntelVideoDecoder
+//! Decodes with Intel QuickSync into surfaces in video memory, drawn from the
+//! frame pool of the codec. Scaling and color conversion run on the device
+//! in VPP, so each frame takes a single copy out of its mapped surface, which
+//! for NV12 output goes straight into the buffer passed to get_frame.
 class IntelVideoDecoder : public VideoDecoder {
  public:
-  IntelVideoDecoder(int device_id, DeviceType output_type);
+  //! Whether a QuickSync device can be opened on this machine
+  static bool is_available();
+
+  IntelVideoDecoder(i32 device_id, DeviceType output_type,
+                    proto::VideoDescriptor::VideoCodecType codec_type);
 
   ~IntelVideoDecoder();
 
-  void configure(const InputFormat& metadata) override;
+  void configure(const FrameInfo& metadata,
+                 const FrameInfo& output_info) override;
 
   bool feed(const u8* encoded_buffer, size_t encoded_size,
             bool discontinuity = false) override;
@@ -56,18 +63,50 @@ class IntelVideoDecoder : public VideoDecoder {
   void wait_until_frames_copied() override;
 
  private:
-  int device_id_;
+  static AVPixelFormat get_format(AVCodecContext* cc,
+                                  const AVPixelFormat* formats);
+
+  void feed_packet(bool flush);
+
+  //! Builds the VPP graph that scales and converts surfaces of frames_ctx
+  void init_vpp(AVBufferRef* frames_ctx);
+
+  void free_vpp();
+
+  //! Copies a frame in video memory to size bytes of host memory at buffer
+  void transfer_frame(AVFrame* frame, AVPixelFormat format, u8* buffer,
+                      size_t size);
+
+  // Surfaces allocated beyond those the codec references, so that decoded
+  // frames can wait in the queue while decoding goes on
+  static const i32 extra_surfaces_ = 16;
+
+  i32 device_id_;
   DeviceType output_type_;
+  AVBufferRef* device_ctx_;
   AVPacket packet_;
   AVCodec* codec_;
   AVCodecContext* cc_;
 
-  InputFormat metadata_;
+  i32 frame_width_;
+  i32 frame_height_;
+  i32 output_width_;
+  i32 output_height_;
+  FrameLayout output_layout_;
+  // Format VPP converts surfaces to, NV12 or BGRA for RGB output
+  AVPixelFormat vpp_format_;
+  bool use_vpp_;
+  AVFilterGraph* vpp_graph_;
+  AVFilterContext* vpp_source_;
+  AVFilterContext* vpp_sink_;
+  AVFrame* vpp_frame_;
+  AVFrame* host_frame_;
+  // BGRA frames copied out of video memory, which are repacked into RGB24
   std::vector<u8> conversion_buffer_;
-  bool reset_context_;
   SwsContext* sws_context_;
 
-  std::vector<AVFrame*> frame_pool_;
-  std::deque<AVFrame*> decoded_frame_queue_;
+  Queue<AVFrame*> frame_pool_;
+  Queue<AVFrame*> decoded_frame_queue_;
 };
 }
+}
@@ -20,6 +20,7 @@
 
 #include "storehouse/storage_backend.h"
 
+#include <algorithm>
 #include <cassert>
 #include <thread>
 
@@ -29,25 +30,36 @@
 namespace scanner {
 namespace internal {
 
-NVIDIAVideoDecoder::NVIDIAVideoDecoder(int device_id, DeviceType output_type,
-                                       CUcontext cuda_context)
+NVIDIAVideoDecoder::NVIDIAVideoDecoder(
+    int device_id, DeviceType output_type, CUcontext cuda_context,
+    proto::VideoDescriptor::VideoCodecType codec_type, i32 num_surfaces)
   : device_id_(device_id),
     output_type_(output_type),
     cuda_context_(cuda_context),
-    streams_(max_mapped_frames_),
+    codec_type_(codec_type == proto::VideoDescriptor::HEVC
+                    ? cudaVideoCodec_HEVC
+                    : cudaVideoCodec_H264),
     parser_(nullptr),
     decoder_(nullptr),
     frame_queue_read_pos_(0),
     frame_queue_elements_(0),
-    last_displayed_frame_(-1) {
+    last_displayed_frame_(-1),
+    next_mapped_frame_(0) {
+  num_mapped_frames_ = default_mapped_frames_;
+  if (num_surfaces > 0) {
+    num_mapped_frames_ = std::min(num_surfaces, max_output_frames_ / 2);
+  }
+  streams_.resize(num_mapped_frames_);
+  mapped_frames_.resize(num_mapped_frames_, 0);
+  mapped_pictures_.resize(num_mapped_frames_, -1);
+
   CUcontext dummy;
 
   CUD_CHECK(cuCtxPushCurrent(cuda_context_));
   cudaSetDevice(device_id_);
 
-  for (int i = 0; i < max_mapped_frames_; ++i) {
-    cudaStreamCreate(&streams_[i]);
-    mapped_frames_[i] = 0;
+  for (int i = 0; i < num_mapped_frames_; ++i) {
+    CU_CHECK(cudaStreamCreateWithFlags(&streams_[i], cudaStreamNonBlocking));
   }
   for (i32 i = 0; i < max_output_frames_; ++i) {
     frame_in_use_[i] = false;
@@ -63,10 +75,9 @@ NVIDIAVideoDecoder::~NVIDIAVideoDecoder() {
   CUD_CHECK(cuCtxPushCurrent(cuda_context_));
   cudaSetDevice(device_id_);
 
-  for (int i = 0; i < max_mapped_frames_; ++i) {
-    if (mapped_frames_[i] != 0) {
-      CUD_CHECK(cuvidUnmapVideoFrame(decoder_, mapped_frames_[i]));
-    }
+  {
+    std::lock_guard<std::mutex> lock(mapped_frames_mutex_);
+    unmap_frames();
   }
 
   if (parser_) {
@@ -77,7 +88,7 @@ NVIDIAVideoDecoder::~NVIDIAVideoDecoder() {
     CUD_CHECK(cuvidDestroyDecoder(decoder_));
   }
 
-  for (int i = 0; i < max_mapped_frames_; ++i) {
+  for (int i = 0; i < num_mapped_frames_; ++i) {
     CU_CHECK(cudaStreamDestroy(streams_[i]));
   }
 
@@ -90,18 +101,21 @@ NVIDIAVideoDecoder::~NVIDIAVideoDecoder() {
   CUD_CHECK(cuDevicePrimaryCtxRelease(device_id_));
 }
 
-void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
+void NVIDIAVideoDecoder::configure(const FrameInfo& metadata,
+                                   const FrameInfo& output_info) {
   frame_width_ = metadata.width();
   frame_height_ = metadata.height();
+  output_width_ = output_info.width();
+  output_height_ = output_info.height();
+  output_layout_ = output_info.layout;
 
   CUcontext dummy;
   CUD_CHECK(cuCtxPushCurrent(cuda_context_));
   cudaSetDevice(device_id_);
 
-  for (int i = 0; i < max_mapped_frames_; ++i) {
-    if (mapped_frames_[i] != 0) {
-      CUD_CHECK(cuvidUnmapVideoFrame(decoder_, mapped_frames_[i]));
-    }
+  {
+    std::lock_guard<std::mutex> lock(mapped_frames_mutex_);
+    unmap_frames();
   }
 
   if (parser_) {
@@ -112,9 +126,7 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
     CUD_CHECK(cuvidDestroyDecoder(decoder_));
   }
 
-  for (int i = 0; i < max_mapped_frames_; ++i) {
-    mapped_frames_[i] = 0;
-  }
+  next_mapped_frame_ = 0;
   for (i32 i = 0; i < max_output_frames_; ++i) {
     frame_in_use_[i] = false;
     undisplayed_frames_[i] = false;
@@ -124,8 +136,7 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
   frame_queue_elements_ = 0;
 
   CUVIDPARSERPARAMS cuparseinfo = {};
-  // cuparseinfo.CodecType = metadata.codec_type;
-  cuparseinfo.CodecType = cudaVideoCodec_H264;
+  cuparseinfo.CodecType = codec_type_;
   cuparseinfo.ulMaxNumDecodeSurfaces = max_output_frames_;
   cuparseinfo.ulMaxDisplayDelay = 1;
   cuparseinfo.pUserData = this;
@@ -139,24 +150,24 @@ void NVIDIAVideoDecoder::configure(const FrameInfo& metadata) {
   CUD_CHECK(cuvidCreateVideoParser(&parser_, &cuparseinfo));
 
   CUVIDDECODECREATEINFO cuinfo = {};
-  // cuinfo.CodecType = metadata.codec_type;
-  cuinfo.CodecType = cudaVideoCodec_H264;
+  cuinfo.CodecType = codec_type_;
   // cuinfo.ChromaFormat = metadata.chroma_format;
   cuinfo.ChromaFormat = cudaVideoChromaFormat_420;
   cuinfo.OutputFormat = cudaVideoSurfaceFormat_NV12;
 
   cuinfo.ulWidth = frame_width_;
   cuinfo.ulHeight = frame_height_;
-  cuinfo.ulTargetWidth = cuinfo.ulWidth;
-  cuinfo.ulTargetHeight = cuinfo.ulHeight;
+  // NVDEC scales the decoded surface to the output size for free
+  cuinfo.ulTargetWidth = output_width_;
+  cuinfo.ulTargetHeight = output_height_;
 
   cuinfo.target_rect.left = 0;
   cuinfo.target_rect.top = 0;
-  cuinfo.target_rect.right = cuinfo.ulWidth;
-  cuinfo.target_rect.bottom = cuinfo.ulHeight;
+  cuinfo.target_rect.right = cuinfo.ulTargetWidth;
+  cuinfo.target_rect.bottom = cuinfo.ulTargetHeight;
 
   cuinfo.ulNumDecodeSurfaces = max_output_frames_;
-  cuinfo.ulNumOutputSurfaces = max_mapped_frames_;
+  cuinfo.ulNumOutputSurfaces = num_mapped_frames_;
   cuinfo.ulCreationFlags = cudaVideoCreate_PreferCUVID;
 
   cuinfo.DeinterlaceMode = cudaVideoDeinterlaceMode_Weave;
@@ -274,35 +285,44 @@ bool NVIDIAVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
     frame_queue_elements_--;
     lock.unlock();
 
+    std::lock_guard<std::mutex> mapped_lock(mapped_frames_mutex_);
+    // Surfaces are reused round robin, so the copy waited on here is the
+    // oldest one in flight
+    i32 mapped_frame_index = next_mapped_frame_;
+    next_mapped_frame_ = (next_mapped_frame_ + 1) % num_mapped_frames_;
+    unmap_frame(mapped_frame_index);
+    cudaStream_t stream = streams_[mapped_frame_index];
+
     CUVIDPROCPARAMS params = {};
     params.progressive_frame = dispinfo.progressive_frame;
     params.second_field = 0;
     params.top_field_first = dispinfo.top_field_first;
+    // Post-processing of the surface runs on the stream of the copy below,
+    // which is ordered after it without blocking this thread
+    params.output_stream = (CUstream)stream;
 
-    int mapped_frame_index = dispinfo.picture_index % max_mapped_frames_;
     auto start_map = now();
     unsigned int pitch = 0;
     CUD_CHECK(cuvidMapVideoFrame(decoder_, dispinfo.picture_index,
                                  &mapped_frames_[mapped_frame_index], &pitch,
                                  &params));
-    // cuvidMapVideoFrame does not wait for convert kernel to finish so sync
-    // TODO(apoms): make this an event insertion and have the async 2d memcpy
-    //              depend on the event
+    mapped_pictures_[mapped_frame_index] = dispinfo.picture_index;
     if (profiler_) {
       profiler_->add_interval("map_frame", start_map, now());
     }
     CUdeviceptr mapped_frame = mapped_frames_[mapped_frame_index];
-    CU_CHECK(convertNV12toRGBA((const u8*)mapped_frame, pitch, decoded_buffer,
-                               frame_width_ * 3, frame_width_, frame_height_,
-                               0));
-    CU_CHECK(cudaDeviceSynchronize());
-
-    CUD_CHECK(
-        cuvidUnmapVideoFrame(decoder_, mapped_frames_[mapped_frame_index]));
-    mapped_frames_[mapped_frame_index] = 0;
-
-    std::unique_lock<std::mutex> lock(frame_queue_mutex_);
-    frame_in_use_[dispinfo.picture_index] = false;
+    if (output_layout_ == FrameLayout::NV12) {
+      // The chroma plane directly follows the luma plane in the mapped
+      // surface, so both can be copied out with a single pitched copy
+      CU_CHECK(cudaMemcpy2DAsync(decoded_buffer, output_width_,
+                                 (const u8*)mapped_frame, pitch,
+                                 output_width_, output_height_ * 3 / 2,
+                                 cudaMemcpyDeviceToDevice, stream));
+    } else {
+      CU_CHECK(convertNV12toRGBA((const u8*)mapped_frame, pitch,
+                                 decoded_buffer, output_width_ * 3,
+                                 output_width_, output_height_, stream));
+    }
   }
 
   CUcontext dummy;
@@ -319,7 +339,45 @@ int NVIDIAVideoDecoder::decoded_frames_buffered() {
   return frame_queue_elements_;
 }
 
-void NVIDIAVideoDecoder::wait_until_frames_copied() {}
+void NVIDIAVideoDecoder::wait_until_frames_copied() {
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+  {
+    std::lock_guard<std::mutex> lock(mapped_frames_mutex_);
+    unmap_frames();
+  }
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+}
+
+void NVIDIAVideoDecoder::unmap_frame(i32 mapped_frame_index) {
+  if (mapped_frames_[mapped_frame_index] == 0) {
+    return;
+  }
+  CU_CHECK(cudaStreamSynchronize(streams_[mapped_frame_index]));
+  CUD_CHECK(
+      cuvidUnmapVideoFrame(decoder_, mapped_frames_[mapped_frame_index]));
+  mapped_frames_[mapped_frame_index] = 0;
+
+  std::unique_lock<std::mutex> lock(frame_queue_mutex_);
+  frame_in_use_[mapped_pictures_[mapped_frame_index]] = false;
+  mapped_pictures_[mapped_frame_index] = -1;
+}
+
+void NVIDIAVideoDecoder::unmap_picture(i32 picture_index) {
+  std::lock_guard<std::mutex> lock(mapped_frames_mutex_);
+  for (i32 i = 0; i < num_mapped_frames_; ++i) {
+    if (mapped_frames_[i] != 0 && mapped_pictures_[i] == picture_index) {
+      unmap_frame(i);
+    }
+  }
+}
+
+void NVIDIAVideoDecoder::unmap_frames() {
+  for (i32 i = 0; i < num_mapped_frames_; ++i) {
+    unmap_frame(i);
+  }
+}
 
 int NVIDIAVideoDecoder::cuvid_handle_video_sequence(void* opaque,
                                                     CUVIDEOFORMAT* format) {
@@ -331,9 +389,12 @@ int NVIDIAVideoDecoder::cuvid_handle_picture_decode(void* opaque,
                                                     CUVIDPICPARAMS* picparams) {
   NVIDIAVideoDecoder& decoder = *reinterpret_cast<NVIDIAVideoDecoder*>(opaque);
 
-  int mapped_frame_index = picparams->CurrPicIdx;
   while (decoder.frame_in_use_[picparams->CurrPicIdx]) {
-    usleep(500);
+    // The surface may only be held by a copy that is still in flight
+    decoder.unmap_picture(picparams->CurrPicIdx);
+    if (decoder.frame_in_use_[picparams->CurrPicIdx]) {
+      usleep(500);
+    }
   };
   std::unique_lock<std::mutex> lock(decoder.frame_queue_mutex_);
   decoder.undisplayed_frames_[picparams->CurrPicIdx] = true;
@@ -29,14 +29,21 @@ namespace internal {
 
 ///////////////////////////////////////////////////////////////////////////////
 /// NVIDIAVideoDecoder
+//! Frames are copied or converted out of num_surfaces mapped output surfaces,
+//! each with its own stream, so the copies of several frames are in flight
+//! while later frames decode. A surface stays mapped until it is reused or
+//! wait_until_frames_copied is called.
 class NVIDIAVideoDecoder : public VideoDecoder {
  public:
   NVIDIAVideoDecoder(int device_id, DeviceType output_type,
-                     CUcontext cuda_context);
+                     CUcontext cuda_context,
+                     proto::VideoDescriptor::VideoCodecType codec_type,
+                     i32 num_surfaces = 0);
 
   ~NVIDIAVideoDecoder();
 
-  void configure(const FrameInfo& metadata) override;
+  void configure(const FrameInfo& metadata,
+                 const FrameInfo& output_info) override;
 
   bool feed(const u8* encoded_buffer, size_t encoded_size,
             bool discontinuity = false) override;
@@ -58,15 +65,32 @@ class NVIDIAVideoDecoder : public VideoDecoder {
   static int cuvid_handle_picture_display(void* opaque,
                                           CUVIDPARSERDISPINFO* dispinfo);
 
+  //! Waits for the copy out of a mapped surface and unmaps it. Requires
+  //! mapped_frames_mutex_.
+  void unmap_frame(i32 mapped_frame_index);
+
+  //! Unmaps the surface that picture_index is mapped to, if any.
+  void unmap_picture(i32 picture_index);
+
+  //! Unmaps all surfaces. Requires mapped_frames_mutex_.
+  void unmap_frames();
+
   int device_id_;
   DeviceType output_type_;
   CUcontext cuda_context_;
+  cudaVideoCodec codec_type_;
   static const int max_output_frames_ = 32;
-  static const int max_mapped_frames_ = 8;
+  static const int default_mapped_frames_ = 8;
+  // Output surfaces, at most half of the decode surfaces so that the rest
+  // are left for reference frames
+  i32 num_mapped_frames_;
   std::vector<cudaStream_t> streams_;
 
   i32 frame_width_;
   i32 frame_height_;
+  i32 output_width_;
+  i32 output_height_;
+  FrameLayout output_layout_;
   std::vector<char> metadata_packets_;
   CUvideoparser parser_;
   CUvideodecoder decoder_;
@@ -81,7 +105,11 @@ class NVIDIAVideoDecoder : public VideoDecoder {
   i32 frame_queue_read_pos_;
   i32 frame_queue_elements_;
 
-  CUdeviceptr mapped_frames_[max_mapped_frames_];
+  std::mutex mapped_frames_mutex_;
+  std::vector<CUdeviceptr> mapped_frames_;
+  // Picture each output surface was mapped from
+  std::vector<i32> mapped_pictures_;
+  i32 next_mapped_frame_;
 };
 }
 }
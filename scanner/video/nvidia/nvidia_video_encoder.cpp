@@ -0,0 +1,280 @@
+/* Copyright 2016 Carnegie Mellon University, NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/video/nvidia/nvidia_video_encoder.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#define NVENC_CHECK(ans)                                                   \
+  {                                                                        \
+    NVENCSTATUS status = (ans);                                            \
+    LOG_IF(FATAL, status != NV_ENC_SUCCESS)                                \
+        << "NVENC error " << status << " " << __FILE__ << " " << __LINE__; \
+  }
+
+namespace scanner {
+namespace internal {
+
+namespace {
+// Keyframe distance of the software encoder, used if none is given
+const i32 DEFAULT_KEYFRAME_DISTANCE = 120;
+// Frames a second of streams whose source frame rate is not known
+const i32 DEFAULT_FRAME_RATE = 24;
+}
+
+NVIDIAVideoEncoder::NVIDIAVideoEncoder(i32 device_id, DeviceType output_type,
+                                       CUcontext cuda_context)
+  : device_id_(device_id),
+    output_type_(output_type),
+    cuda_context_(cuda_context) {
+  memset(&nvenc_, 0, sizeof(nvenc_));
+  nvenc_.version = NV_ENCODE_API_FUNCTION_LIST_VER;
+  NVENC_CHECK(NvEncodeAPICreateInstance(&nvenc_));
+
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  CU_CHECK(cudaSetDevice(device_id_));
+  CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+}
+
+NVIDIAVideoEncoder::~NVIDIAVideoEncoder() {
+  destroy_session();
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+  cudaStreamDestroy(stream_);
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+  CUD_CHECK(cuDevicePrimaryCtxRelease(device_id_));
+}
+
+void NVIDIAVideoEncoder::configure(const FrameInfo& metadata,
+                                   const EncodeOptions& opts) {
+  ready_packets_.clear();
+  frame_id_ = 0;
+  // After a flush the session only has to start a new stream
+  if (encoder_ != nullptr && metadata.width() == frame_width_ &&
+      metadata.height() == frame_height_ && opts.quality == opts_.quality &&
+      opts.bitrate == opts_.bitrate &&
+      opts.keyframe_distance == opts_.keyframe_distance &&
+      opts.frame_rate == opts_.frame_rate) {
+    force_idr_ = true;
+    return;
+  }
+  destroy_session();
+  frame_width_ = metadata.width();
+  frame_height_ = metadata.height();
+  opts_ = opts;
+  force_idr_ = false;
+
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  CU_CHECK(cudaSetDevice(device_id_));
+
+  NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS session_params;
+  memset(&session_params, 0, sizeof(session_params));
+  session_params.version = NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER;
+  session_params.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+  session_params.device = cuda_context_;
+  session_params.apiVersion = NVENCAPI_VERSION;
+  NVENC_CHECK(nvenc_.nvEncOpenEncodeSessionEx(&session_params, &encoder_));
+
+  NV_ENC_PRESET_CONFIG preset_config;
+  memset(&preset_config, 0, sizeof(preset_config));
+  preset_config.version = NV_ENC_PRESET_CONFIG_VER;
+  preset_config.presetCfg.version = NV_ENC_CONFIG_VER;
+  NVENC_CHECK(nvenc_.nvEncGetEncodePresetConfig(
+      encoder_, NV_ENC_CODEC_H264_GUID, NV_ENC_PRESET_HQ_GUID,
+      &preset_config));
+  NV_ENC_CONFIG config = preset_config.presetCfg;
+  // Without B frames or lookahead every frame fed comes out as one packet
+  // right away, so nothing is left in the encoder to flush
+  config.frameIntervalP = 1;
+  config.rcParams.enableLookahead = 0;
+  config.gopLength = opts.keyframe_distance > 0 ? opts.keyframe_distance
+                                                : DEFAULT_KEYFRAME_DISTANCE;
+  config.encodeCodecConfig.h264Config.idrPeriod = config.gopLength;
+  config.encodeCodecConfig.h264Config.repeatSPSPPS = 1;
+  if (opts.bitrate != -1) {
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+    config.rcParams.averageBitRate = opts.bitrate;
+  } else if (opts.quality != -1) {
+    // The closest NVENC has to the CRF of the software encoder
+    config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CONSTQP;
+    config.rcParams.constQP.qpInterP = opts.quality;
+    config.rcParams.constQP.qpInterB = opts.quality;
+    config.rcParams.constQP.qpIntra = opts.quality;
+  }
+
+  NV_ENC_INITIALIZE_PARAMS init_params;
+  memset(&init_params, 0, sizeof(init_params));
+  init_params.version = NV_ENC_INITIALIZE_PARAMS_VER;
+  init_params.encodeGUID = NV_ENC_CODEC_H264_GUID;
+  init_params.presetGUID = NV_ENC_PRESET_HQ_GUID;
+  init_params.encodeWidth = frame_width_;
+  init_params.encodeHeight = frame_height_;
+  init_params.darWidth = frame_width_;
+  init_params.darHeight = frame_height_;
+  if (opts.frame_rate > 0) {
+    // Keeps rates such as 30000/1001 exact to three decimals
+    init_params.frameRateNum = (u32)std::round(opts.frame_rate * 1000);
+    init_params.frameRateDen = 1000;
+  } else {
+    init_params.frameRateNum = DEFAULT_FRAME_RATE;
+    init_params.frameRateDen = 1;
+  }
+  init_params.enablePTD = 1;
+  init_params.encodeConfig = &config;
+  NVENC_CHECK(nvenc_.nvEncInitializeEncoder(encoder_, &init_params));
+
+  CU_CHECK(cudaMallocPitch((void**)&input_buffer_, &input_pitch_,
+                           frame_width_, frame_height_ * 3 / 2));
+  NV_ENC_REGISTER_RESOURCE resource;
+  memset(&resource, 0, sizeof(resource));
+  resource.version = NV_ENC_REGISTER_RESOURCE_VER;
+  resource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+  resource.width = frame_width_;
+  resource.height = frame_height_;
+  resource.pitch = input_pitch_;
+  resource.resourceToRegister = input_buffer_;
+  resource.bufferFormat = NV_ENC_BUFFER_FORMAT_NV12;
+  NVENC_CHECK(nvenc_.nvEncRegisterResource(encoder_, &resource));
+  registered_input_ = resource.registeredResource;
+
+  NV_ENC_CREATE_BITSTREAM_BUFFER bitstream;
+  memset(&bitstream, 0, sizeof(bitstream));
+  bitstream.version = NV_ENC_CREATE_BITSTREAM_BUFFER_VER;
+  NVENC_CHECK(nvenc_.nvEncCreateBitstreamBuffer(encoder_, &bitstream));
+  bitstream_ = bitstream.bitstreamBuffer;
+
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+}
+
+bool NVIDIAVideoEncoder::feed(const u8* frame_buffer, size_t frame_size) {
+  assert(frame_size >= (size_t)frame_width_ * frame_height_ * 3);
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  CU_CHECK(cudaSetDevice(device_id_));
+
+  auto convert_start = now();
+  CU_CHECK(convertRGBtoNV12(frame_buffer, frame_width_ * 3, input_buffer_,
+                            input_pitch_, frame_width_, frame_height_,
+                            stream_));
+  CU_CHECK(cudaStreamSynchronize(stream_));
+  if (profiler_) {
+    profiler_->add_interval("nvenc:convert_frame", convert_start, now());
+  }
+
+  auto encode_start = now();
+  NV_ENC_MAP_INPUT_RESOURCE map;
+  memset(&map, 0, sizeof(map));
+  map.version = NV_ENC_MAP_INPUT_RESOURCE_VER;
+  map.registeredResource = registered_input_;
+  NVENC_CHECK(nvenc_.nvEncMapInputResource(encoder_, &map));
+
+  NV_ENC_PIC_PARAMS pic_params;
+  memset(&pic_params, 0, sizeof(pic_params));
+  pic_params.version = NV_ENC_PIC_PARAMS_VER;
+  pic_params.inputWidth = frame_width_;
+  pic_params.inputHeight = frame_height_;
+  pic_params.inputPitch = input_pitch_;
+  pic_params.inputBuffer = map.mappedResource;
+  pic_params.bufferFmt = map.mappedBufferFmt;
+  pic_params.outputBitstream = bitstream_;
+  pic_params.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+  pic_params.inputTimeStamp = frame_id_++;
+  if (force_idr_) {
+    pic_params.encodePicFlags =
+        NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+    force_idr_ = false;
+  }
+  NVENC_CHECK(nvenc_.nvEncEncodePicture(encoder_, &pic_params));
+
+  NV_ENC_LOCK_BITSTREAM lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.version = NV_ENC_LOCK_BITSTREAM_VER;
+  lock.outputBitstream = bitstream_;
+  NVENC_CHECK(nvenc_.nvEncLockBitstream(encoder_, &lock));
+  const u8* data = (const u8*)lock.bitstreamBufferPtr;
+  ready_packets_.emplace_back(data, data + lock.bitstreamSizeInBytes);
+  NVENC_CHECK(nvenc_.nvEncUnlockBitstream(encoder_, bitstream_));
+  NVENC_CHECK(nvenc_.nvEncUnmapInputResource(encoder_, map.mappedResource));
+  if (profiler_) {
+    profiler_->add_interval("nvenc:encode_frame", encode_start, now());
+  }
+
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+  return !ready_packets_.empty();
+}
+
+bool NVIDIAVideoEncoder::flush() {
+  // The encoder holds no frames, so only the next stream has to begin with
+  // an IDR frame
+  force_idr_ = true;
+  return !ready_packets_.empty();
+}
+
+bool NVIDIAVideoEncoder::get_packet(u8* packet_buffer, size_t packet_size,
+                                    size_t& actual_packet_size) {
+  actual_packet_size = 0;
+  if (ready_packets_.empty()) {
+    return false;
+  }
+  std::vector<u8>& packet = ready_packets_.front();
+  // Make sure we have space for this packet, otherwise return
+  actual_packet_size = packet.size();
+  if (actual_packet_size > packet_size) {
+    return true;
+  }
+  memcpy(packet_buffer, packet.data(), packet.size());
+  ready_packets_.pop_front();
+  return !ready_packets_.empty();
+}
+
+int NVIDIAVideoEncoder::decoded_packets_buffered() {
+  return ready_packets_.size();
+}
+
+void NVIDIAVideoEncoder::wait_until_packets_copied() {}
+
+void NVIDIAVideoEncoder::destroy_session() {
+  if (encoder_ == nullptr) {
+    return;
+  }
+  CUcontext dummy;
+  CUD_CHECK(cuCtxPushCurrent(cuda_context_));
+  cudaSetDevice(device_id_);
+  if (registered_input_ != nullptr) {
+    nvenc_.nvEncUnregisterResource(encoder_, registered_input_);
+    registered_input_ = nullptr;
+  }
+  if (bitstream_ != nullptr) {
+    nvenc_.nvEncDestroyBitstreamBuffer(encoder_, bitstream_);
+    bitstream_ = nullptr;
+  }
+  nvenc_.nvEncDestroyEncoder(encoder_);
+  encoder_ = nullptr;
+  if (input_buffer_ != nullptr) {
+    cudaFree(input_buffer_);
+    input_buffer_ = nullptr;
+  }
+  CUD_CHECK(cuCtxPopCurrent(&dummy));
+}
+}
+}
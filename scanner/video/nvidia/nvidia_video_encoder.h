@@ -0,0 +1,80 @@
+/* Copyright 2016 Carnegie Mellon University, NVIDIA Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/util/common.h"
+#include "scanner/video/video_encoder.h"
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+#include <nvEncodeAPI.h>
+
+#include <deque>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+
+///////////////////////////////////////////////////////////////////////////////
+/// NVIDIAVideoEncoder
+//! Encodes RGB frames in GPU memory to H.264 with NVENC. Frames are
+//! converted to NV12 on the GPU, so they are never copied to the host.
+class NVIDIAVideoEncoder : public VideoEncoder {
+ public:
+  NVIDIAVideoEncoder(i32 device_id, DeviceType output_type,
+                     CUcontext cuda_context);
+
+  ~NVIDIAVideoEncoder();
+
+  void configure(const FrameInfo& metadata, const EncodeOptions& opts) override;
+
+  bool feed(const u8* frame_buffer, size_t frame_size) override;
+
+  bool flush() override;
+
+  bool get_packet(u8* packet_buffer, size_t packet_size,
+                  size_t& actual_packet_size) override;
+
+  int decoded_packets_buffered() override;
+
+  void wait_until_packets_copied() override;
+
+ private:
+  void destroy_session();
+
+  i32 device_id_;
+  DeviceType output_type_;
+  CUcontext cuda_context_;
+  cudaStream_t stream_;
+  NV_ENCODE_API_FUNCTION_LIST nvenc_;
+  void* encoder_ = nullptr;
+
+  i32 frame_width_ = 0;
+  i32 frame_height_ = 0;
+  EncodeOptions opts_;
+  // NV12 copy of the frame being encoded, registered with the encoder
+  u8* input_buffer_ = nullptr;
+  size_t input_pitch_ = 0;
+  NV_ENC_REGISTERED_PTR registered_input_ = nullptr;
+  NV_ENC_OUTPUT_PTR bitstream_ = nullptr;
+  // The next frame starts a new stream with an IDR frame and SPS/PPS
+  bool force_idr_ = false;
+  i64 frame_id_ = 0;
+  std::deque<std::vector<u8>> ready_packets_;
+};
+}
+}
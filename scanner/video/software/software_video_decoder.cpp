@@ -22,6 +22,7 @@ extern "C" {
 #include "libavutil/error.h"
 #include "libavutil/frame.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/motion_vector.h"
 #include "libavutil/opt.h"
 #include "libswscale/swscale.h"
 }
@@ -30,6 +31,7 @@ extern "C" {
 #include "scanner/util/cuda.h"
 #endif
 
+#include <algorithm>
 #include <cassert>
 
 namespace scanner {
@@ -37,22 +39,27 @@ namespace internal {
 
 ///////////////////////////////////////////////////////////////////////////////
 /// SoftwareVideoDecoder
-SoftwareVideoDecoder::SoftwareVideoDecoder(i32 device_id,
-                                           DeviceType output_type,
-                                           i32 thread_count)
+SoftwareVideoDecoder::SoftwareVideoDecoder(
+    i32 device_id, DeviceType output_type,
+    proto::VideoDescriptor::VideoCodecType codec_type, i32 thread_count,
+    bool slice_threads)
   : device_id_(device_id),
     output_type_(output_type),
     codec_(nullptr),
     cc_(nullptr),
+    output_format_(AV_PIX_FMT_RGB24),
+    motion_vectors_(false),
     reset_context_(true),
     sws_context_(nullptr),
     frame_pool_(1024),
     decoded_frame_queue_(1024) {
   av_init_packet(&packet_);
 
-  codec_ = avcodec_find_decoder(AV_CODEC_ID_H264);
+  codec_ = avcodec_find_decoder(codec_type == proto::VideoDescriptor::HEVC
+                                    ? AV_CODEC_ID_HEVC
+                                    : AV_CODEC_ID_H264);
   if (!codec_) {
-    fprintf(stderr, "could not find h264 decoder\n");
+    fprintf(stderr, "could not find video decoder\n");
     exit(EXIT_FAILURE);
   }
 
@@ -62,8 +69,11 @@ SoftwareVideoDecoder::SoftwareVideoDecoder(i32 device_id,
     exit(EXIT_FAILURE);
   }
 
-  // cc_->thread_count = thread_count;
-  cc_->thread_count = 4;
+  // Frame threading decodes several frames at once, which delays the first
+  // frame of every interval, while slice threading only helps videos encoded
+  // with several slices per frame
+  cc_->thread_count = std::max(thread_count, 1);
+  cc_->thread_type = slice_threads ? FF_THREAD_SLICE : FF_THREAD_FRAME;
 
   if (avcodec_open2(cc_, codec_, NULL) < 0) {
     fprintf(stderr, "could not open codec\n");
@@ -92,14 +102,31 @@ SoftwareVideoDecoder::~SoftwareVideoDecoder() {
   sws_freeContext(sws_context_);
 }
 
-void SoftwareVideoDecoder::configure(const FrameInfo& metadata) {
+void SoftwareVideoDecoder::configure(const FrameInfo& metadata,
+                                     const FrameInfo& output_info) {
   metadata_ = metadata;
   frame_width_ = metadata_.width();
   frame_height_ = metadata_.height();
+  output_width_ = output_info.width();
+  output_height_ = output_info.height();
+  output_format_ = output_info.layout == FrameLayout::NV12 ? AV_PIX_FMT_NV12
+                                                            : AV_PIX_FMT_RGB24;
   reset_context_ = true;
 
-  int required_size = av_image_get_buffer_size(AV_PIX_FMT_RGB24, frame_width_,
-                                               frame_height_, 1);
+  // Only the motion vectors are read, so the deblocking filter, which is a
+  // large part of the cost of decoding, is skipped. The decoder checks both
+  // settings for every frame, so they can change once it is open.
+  motion_vectors_ = output_info.layout == FrameLayout::MOTION_VECTORS;
+  if (motion_vectors_) {
+    cc_->flags2 |= AV_CODEC_FLAG2_EXPORT_MVS;
+    cc_->skip_loop_filter = AVDISCARD_ALL;
+    return;
+  }
+  cc_->flags2 &= ~AV_CODEC_FLAG2_EXPORT_MVS;
+  cc_->skip_loop_filter = AVDISCARD_DEFAULT;
+
+  int required_size = av_image_get_buffer_size(output_format_, output_width_,
+                                               output_height_, 1);
 
   conversion_buffer_.resize(required_size);
 }
@@ -185,13 +212,24 @@ bool SoftwareVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
     return false;
   }
 
+  if (motion_vectors_) {
+    write_motion_vectors(frame, decoded_buffer, decoded_size);
+    av_frame_unref(frame);
+    frame_pool_.push(frame);
+    return decoded_frame_queue_.size() > 0;
+  }
+
   if (reset_context_) {
     auto get_context_start = now();
     AVPixelFormat decoder_pixel_format = cc_->pix_fmt;
     sws_freeContext(sws_context_);
+    // Frames are scaled down during the conversion, which is much cheaper
+    // than materializing the full resolution frame and resizing it later
     sws_context_ = sws_getContext(
-        frame_width_, frame_height_, decoder_pixel_format, frame_width_,
-        frame_height_, AV_PIX_FMT_RGB24, SWS_BICUBIC, NULL, NULL, NULL);
+        frame_width_, frame_height_, decoder_pixel_format, output_width_,
+        output_height_, output_format_,
+        output_width_ < frame_width_ ? SWS_AREA : SWS_BICUBIC, NULL, NULL,
+        NULL);
     reset_context_ = false;
     auto get_context_end = now();
     if (profiler_) {
@@ -201,7 +239,8 @@ bool SoftwareVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
   }
 
   if (sws_context_ == NULL) {
-    LOG(FATAL) << "Could not get sws_context for rgb conversion";
+    LOG(FATAL) << "Could not get sws_context for "
+               << av_get_pix_fmt_name(output_format_) << " conversion";
   }
 
   u8* scale_buffer = decoded_buffer;
@@ -210,7 +249,7 @@ bool SoftwareVideoDecoder::get_frame(u8* decoded_buffer, size_t decoded_size) {
   int out_linesizes[4];
   int required_size =
       av_image_fill_arrays(out_slices, out_linesizes, scale_buffer,
-                           AV_PIX_FMT_RGB24, frame_width_, frame_height_, 1);
+                           output_format_, output_width_, output_height_, 1);
   if (required_size < 0) {
     LOG(FATAL) << "Error in av_image_fill_arrays";
   }
@@ -240,6 +279,49 @@ int SoftwareVideoDecoder::decoded_frames_buffered() {
 
 void SoftwareVideoDecoder::wait_until_frames_copied() {}
 
+void SoftwareVideoDecoder::write_motion_vectors(AVFrame* frame, u8* buffer,
+                                                size_t size) {
+  i32 cols = output_width_;
+  i32 rows = output_height_;
+  if ((size_t)rows * cols * 3 * sizeof(f32) > size) {
+    LOG(FATAL) << "Decode buffer not large enough for motion vectors";
+  }
+  f32* field = (f32*)buffer;
+  // Blocks without a vector are intra coded. Partitions of a macroblock
+  // each have their own vector, which are averaged by area.
+  std::vector<f32> area(rows * cols, 0);
+  for (i32 i = 0; i < rows * cols; ++i) {
+    field[i * 3] = 0;
+    field[i * 3 + 1] = 0;
+    field[i * 3 + 2] = 1;
+  }
+  AVFrameSideData* side_data =
+      av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
+  if (side_data == nullptr) {
+    return;
+  }
+  const AVMotionVector* vectors = (const AVMotionVector*)side_data->data;
+  size_t num_vectors = side_data->size / sizeof(AVMotionVector);
+  for (size_t i = 0; i < num_vectors; ++i) {
+    const AVMotionVector& mv = vectors[i];
+    // Partitions lie within one macroblock, which holds their center
+    i32 col = std::min(std::max(mv.dst_x / 16, 0), cols - 1);
+    i32 row = std::min(std::max(mv.dst_y / 16, 0), rows - 1);
+    i32 cell = row * cols + col;
+    // Vectors of blocks predicted from a later frame point backwards
+    f32 sign = mv.source < 0 ? 1 : -1;
+    f32 weight = mv.w * mv.h;
+    f32 dx = sign * (mv.dst_x - mv.src_x);
+    f32 dy = sign * (mv.dst_y - mv.src_y);
+    field[cell * 3] = (field[cell * 3] * area[cell] + dx * weight) /
+                      (area[cell] + weight);
+    field[cell * 3 + 1] = (field[cell * 3 + 1] * area[cell] + dy * weight) /
+                          (area[cell] + weight);
+    field[cell * 3 + 2] = 0;
+    area[cell] += weight;
+  }
+}
+
 void SoftwareVideoDecoder::feed_packet(bool flush) {
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 25, 0)
   auto send_start = now();
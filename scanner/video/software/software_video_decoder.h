@@ -41,11 +41,14 @@ namespace internal {
 /// SoftwareVideoDecoder
 class SoftwareVideoDecoder : public VideoDecoder {
  public:
-  SoftwareVideoDecoder(i32 device_id, DeviceType output_type, i32 thread_count);
+  SoftwareVideoDecoder(i32 device_id, DeviceType output_type,
+                       proto::VideoDescriptor::VideoCodecType codec_type,
+                       i32 thread_count, bool slice_threads);
 
   ~SoftwareVideoDecoder();
 
-  void configure(const FrameInfo& metadata) override;
+  void configure(const FrameInfo& metadata,
+                 const FrameInfo& output_info) override;
 
   bool feed(const u8* encoded_buffer, size_t encoded_size,
             bool discontinuity = false) override;
@@ -61,6 +64,9 @@ class SoftwareVideoDecoder : public VideoDecoder {
  private:
   void feed_packet(bool flush);
 
+  //! Writes the FrameLayout::MOTION_VECTORS field of frame to buffer
+  void write_motion_vectors(AVFrame* frame, u8* buffer, size_t size);
+
   int device_id_;
   DeviceType output_type_;
   AVPacket packet_;
@@ -70,6 +76,12 @@ class SoftwareVideoDecoder : public VideoDecoder {
   FrameInfo metadata_;
   i32 frame_width_;
   i32 frame_height_;
+  i32 output_width_;
+  i32 output_height_;
+  // RGB24, or NV12 when the frames are handed over in FrameLayout::NV12
+  AVPixelFormat output_format_;
+  // Frames are handed over as FrameLayout::MOTION_VECTORS fields
+  bool motion_vectors_;
   std::vector<u8> conversion_buffer_;
   bool reset_context_;
   SwsContext* sws_context_;
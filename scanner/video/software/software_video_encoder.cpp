@@ -30,6 +30,7 @@ extern "C" {
 #include "scanner/util/cuda.h"
 #endif
 
+#include <algorithm>
 #include <cassert>
 
 #if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 5, 0)
@@ -47,9 +48,12 @@ namespace internal {
 /// SoftwareVideoEncoder
 SoftwareVideoEncoder::SoftwareVideoEncoder(i32 device_id,
                                            DeviceType output_type,
-                                           i32 thread_count)
+                                           i32 thread_count,
+                                           bool slice_threads)
   : device_id_(device_id),
     output_type_(output_type),
+    thread_count_(std::max(thread_count, 1)),
+    slice_threads_(slice_threads),
     codec_(nullptr),
     cc_(nullptr),
     sws_context_(nullptr),
@@ -117,12 +121,16 @@ void SoftwareVideoEncoder::configure(const FrameInfo& metadata,
   int required_size = av_image_get_buffer_size(AV_PIX_FMT_RGB24, frame_width_,
                                                frame_height_, 1);
 
-  cc_->thread_count = 4;
+  cc_->thread_count = thread_count_;
+  cc_->thread_type = slice_threads_ ? FF_THREAD_SLICE : FF_THREAD_FRAME;
   cc_->width = frame_width_;    // Note Resolution must be a multiple of 2!!
   cc_->height = frame_height_;  // Note Resolution must be a multiple of 2!!
-  // TODO(apoms): figure out this fps from the input video automatically
-  cc_->time_base.den = 24;
-  cc_->time_base.num = 1;
+  if (opts.frame_rate > 0) {
+    cc_->time_base = av_inv_q(av_d2q(opts.frame_rate, 1 << 16));
+  } else {
+    cc_->time_base.den = 24;
+    cc_->time_base.num = 1;
+  }
   cc_->gop_size = 120;  // Intra frames per x P frames
   cc_->pix_fmt =
       AV_PIX_FMT_YUV420P;  // Do not change this, H264 needs YUV format not RGB
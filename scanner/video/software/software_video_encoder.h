@@ -41,7 +41,8 @@ namespace internal {
 /// SoftwareVideoEncoder
 class SoftwareVideoEncoder : public VideoEncoder {
  public:
-  SoftwareVideoEncoder(i32 device_id, DeviceType output_type, i32 thread_count);
+  SoftwareVideoEncoder(i32 device_id, DeviceType output_type, i32 thread_count,
+                       bool slice_threads);
 
   ~SoftwareVideoEncoder();
 
@@ -63,6 +64,8 @@ class SoftwareVideoEncoder : public VideoEncoder {
 
   int device_id_;
   DeviceType output_type_;
+  i32 thread_count_;
+  bool slice_threads_;
   AVCodec* codec_;
   AVCodecContext* cc_;
   AVBitStreamFilterContext* annexb_;
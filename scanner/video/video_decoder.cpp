@@ -37,7 +37,10 @@ std::vector<VideoDecoderType> VideoDecoder::get_supported_decoder_types() {
   decoder_types.push_back(VideoDecoderType::NVIDIA);
 #endif
 #ifdef HAVE_INTEL_VIDEO_HARDWARE
-  decoder_types.push_back(VideoDecoderType::INTEL);
+  // Builds with QuickSync also run on machines without an Intel GPU
+  if (IntelVideoDecoder::is_available()) {
+    decoder_types.push_back(VideoDecoderType::INTEL);
+  }
 #endif
   decoder_types.push_back(VideoDecoderType::SOFTWARE);
 
@@ -55,9 +58,10 @@ bool VideoDecoder::has_decoder_type(VideoDecoderType type) {
   return false;
 }
 
-VideoDecoder* VideoDecoder::make_from_config(DeviceHandle device_handle,
-                                             i32 num_devices,
-                                             VideoDecoderType type) {
+VideoDecoder* VideoDecoder::make_from_config(
+    DeviceHandle device_handle, i32 num_devices, VideoDecoderType type,
+    proto::VideoDescriptor::VideoCodecType codec_type, bool slice_threads,
+    i32 gpu_surfaces) {
   VideoDecoder* decoder = nullptr;
 
   switch (type) {
@@ -78,21 +82,23 @@ VideoDecoder* VideoDecoder::make_from_config(DeviceHandle device_handle,
       CUD_CHECK(cuDevicePrimaryCtxRetain(&cuda_context, device_handle.id));
 
       decoder = new NVIDIAVideoDecoder(device_handle.id, device_handle.type,
-                                       cuda_context);
+                                       cuda_context, codec_type, gpu_surfaces);
 #else
 #endif
       break;
     }
     case VideoDecoderType::INTEL: {
 #ifdef HAVE_INTEL_VIDEO_HARDWARE
-      decoder = new IntelVideoDecoder(device_handle.id, device_handle.type);
+      decoder = new IntelVideoDecoder(device_handle.id, device_handle.type,
+                                      codec_type);
 #else
 #endif
       break;
     }
     case VideoDecoderType::SOFTWARE: {
       decoder = new SoftwareVideoDecoder(device_handle.id, device_handle.type,
-                                         num_devices);
+                                         codec_type, num_devices,
+                                         slice_threads);
       break;
     }
     default: {}
@@ -41,12 +41,23 @@ class VideoDecoder {
 
   static bool has_decoder_type(VideoDecoderType type);
 
-  static VideoDecoder* make_from_config(DeviceHandle device_handle,
-                                        i32 num_devices, VideoDecoderType type);
+  //! Software decoders use num_devices threads, which split each frame into
+  //! slices instead of decoding several frames at once if slice_threads is
+  //! set. codec_type is the codec of the encoded video, H264 or HEVC.
+  //! NVIDIA decoders copy frames out of gpu_surfaces surfaces at once, zero
+  //! for their default.
+  static VideoDecoder* make_from_config(
+      DeviceHandle device_handle, i32 num_devices, VideoDecoderType type,
+      proto::VideoDescriptor::VideoCodecType codec_type =
+          proto::VideoDescriptor::H264,
+      bool slice_threads = false, i32 gpu_surfaces = 0);
 
   virtual ~VideoDecoder(){};
 
-  virtual void configure(const FrameInfo& metadata) = 0;
+  //! metadata describes the encoded video and output_info the frames written
+  //! by get_frame, which may be smaller than the video and laid out as NV12.
+  virtual void configure(const FrameInfo& metadata,
+                         const FrameInfo& output_info) = 0;
 
   virtual bool feed(const u8* encoded_buffer, size_t encoded_size,
                     bool discontinuity = false) = 0;
@@ -17,7 +17,7 @@
 
 #ifdef HAVE_NVIDIA_VIDEO_HARDWARE
 #include "scanner/util/cuda.h"
-//#include "scanner/video/nvidia/nvidia_video_encoder.h"
+#include "scanner/video/nvidia/nvidia_video_encoder.h"
 #endif
 
 #ifdef HAVE_INTEL_VIDEO_HARDWARE
@@ -34,7 +34,7 @@ namespace internal {
 std::vector<VideoEncoderType> VideoEncoder::get_supported_encoder_types() {
   std::vector<VideoEncoderType> encoder_types;
 #ifdef HAVE_NVIDIA_VIDEO_HARDWARE
-// encoder_types.push_back(VideoEncoderType::NVIDIA);
+  encoder_types.push_back(VideoEncoderType::NVIDIA);
 #endif
 #ifdef HAVE_INTEL_VIDEO_HARDWARE
   encoder_types.push_back(VideoEncoderType::INTEL);
@@ -57,7 +57,8 @@ bool VideoEncoder::has_encoder_type(VideoEncoderType type) {
 
 VideoEncoder* VideoEncoder::make_from_config(DeviceHandle device_handle,
                                              i32 num_devices,
-                                             VideoEncoderType type) {
+                                             VideoEncoderType type,
+                                             bool slice_threads) {
   VideoEncoder* encoder = nullptr;
 
   switch (type) {
@@ -77,8 +78,8 @@ VideoEncoder* VideoEncoder::make_from_config(DeviceHandle device_handle,
       CUcontext cuda_context;
       CUD_CHECK(cuDevicePrimaryCtxRetain(&cuda_context, device_handle.id));
 
-// encoder = new NVIDIAVideoEncoder(device_handle.id, device_handle.type,
-//                                  cuda_context);
+      encoder = new NVIDIAVideoEncoder(device_handle.id, device_handle.type,
+                                       cuda_context);
 #else
 #endif
       break;
@@ -92,7 +93,7 @@ VideoEncoder* VideoEncoder::make_from_config(DeviceHandle device_handle,
     }
     case VideoEncoderType::SOFTWARE: {
       encoder = new SoftwareVideoEncoder(device_handle.id, device_handle.type,
-                                         num_devices);
+                                         num_devices, slice_threads);
       break;
     }
     default: {}
@@ -35,6 +35,8 @@ struct EncodeOptions {
   i32 quality = -1;
   i64 bitrate = -1;
   i64 keyframe_distance = -1;
+  // Frames a second the stream plays at, or 0 for the encoder's default
+  f64 frame_rate = 0;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -45,8 +47,12 @@ class VideoEncoder {
 
   static bool has_encoder_type(VideoEncoderType type);
 
+  //! Software encoders use num_devices threads, which split each frame into
+  //! slices instead of encoding several frames at once if slice_threads is
+  //! set.
   static VideoEncoder* make_from_config(DeviceHandle device_handle,
-                                        i32 num_devices, VideoEncoderType type);
+                                        i32 num_devices, VideoEncoderType type,
+                                        bool slice_threads = false);
 
   virtual ~VideoEncoder(){};
 
@@ -1,4 +1,5 @@
 #include "stdlib/caffe/caffe_input_kernel.h"
+#include "scanner/util/half.h"
 #include "scanner/util/memory.h"
 
 #include "caffe/blob.hpp"
@@ -7,13 +8,14 @@
 #ifdef HAVE_CUDA
 #include "HalideRuntimeCuda.h"
 #include "scanner/util/halide_context.h"
+#include "scanner/util/image.h"
 #endif
 
 namespace scanner {
 
-CaffeInputKernel::CaffeInputKernel(const KernelConfig& config)
-  : BatchedKernel(config), device_(config.devices[0]) {
-  args_.ParseFromArray(config.args.data(), config.args.size());
+CaffeInputTransformer::CaffeInputTransformer(
+    DeviceHandle device, const proto::NetDescriptor& descriptor)
+  : device_(device), descriptor_(descriptor) {
   if (device_.type == DeviceType::GPU) {
     CUDA_PROTECT({
       CUD_CHECK(cuDevicePrimaryCtxRetain(&context_, device_.id));
@@ -23,26 +25,38 @@ CaffeInputKernel::CaffeInputKernel(const KernelConfig& config)
   }
 }
 
-CaffeInputKernel::~CaffeInputKernel() {
-  CUDA_PROTECT({
-    cudaSetDevice(device_.id);
-    Halide::Runtime::Internal::Cuda::context = 0;
-    CUD_CHECK(cuDevicePrimaryCtxRelease(device_.id));
-  });
+CaffeInputTransformer::~CaffeInputTransformer() {
+  if (device_.type == DeviceType::GPU) {
+    CUDA_PROTECT({
+      cudaSetDevice(device_.id);
+      Halide::Runtime::Internal::Cuda::context = 0;
+      CUD_CHECK(cuDevicePrimaryCtxRelease(device_.id));
+    });
+  }
 }
 
-void CaffeInputKernel::new_frame_info() {
-  if (args_.net_descriptor().input_width() == -1) {
+void CaffeInputTransformer::configure(const FrameInfo& frame_info) {
+  frame_info_ = frame_info;
+  if (descriptor_.input_width() == -1) {
     net_input_width_ = frame_info_.width();
     net_input_height_ = frame_info_.height();
   } else {
-    net_input_width_ = args_.net_descriptor().input_width();
-    net_input_height_ = args_.net_descriptor().input_height();
+    net_input_width_ = descriptor_.input_width();
+    net_input_height_ = descriptor_.input_height();
   }
 }
 
-void CaffeInputKernel::set_halide_buf(buffer_t& halide_buf, u8* buf,
-                                      size_t size) {
+void CaffeInputTransformer::transform(const u8* input_buffer,
+                                      u8* output_buffer) {
+  if (frame_info_.layout == FrameLayout::NV12) {
+    transform_nv12(input_buffer, output_buffer);
+  } else {
+    transform_halide(input_buffer, output_buffer);
+  }
+}
+
+void CaffeInputTransformer::set_halide_buf(buffer_t& halide_buf, u8* buf,
+                                           size_t size) {
   if (device_.type == DeviceType::GPU) {
     CUDA_PROTECT({
       halide_buf.dev = (uintptr_t) nullptr;
@@ -65,14 +79,14 @@ void CaffeInputKernel::set_halide_buf(buffer_t& halide_buf, u8* buf,
   }
 }
 
-void CaffeInputKernel::unset_halide_buf(buffer_t& halide_buf) {
+void CaffeInputTransformer::unset_halide_buf(buffer_t& halide_buf) {
   if (device_.type == DeviceType::GPU) {
     CUDA_PROTECT({ halide_cuda_detach_device_ptr(nullptr, &halide_buf); });
   }
 }
 
-void CaffeInputKernel::transform_halide(const u8* input_buffer,
-                                        u8* output_buffer) {
+void CaffeInputTransformer::transform_halide(const u8* input_buffer,
+                                             u8* output_buffer) {
   i32 frame_width = frame_info_.width();
   i32 frame_height = frame_info_.height();
   size_t net_input_size =
@@ -111,18 +125,29 @@ void CaffeInputKernel::transform_halide(const u8* input_buffer,
   } else {
     func = caffe_input_transformer_cpu;
   }
-  auto descriptor = args_.net_descriptor();
-  int error =
-      func(&input_buf, frame_width, frame_height, net_input_width_,
-           net_input_height_, descriptor.normalize(), descriptor.mean_colors(2),
-           descriptor.mean_colors(1), descriptor.mean_colors(0), &output_buf);
+  int error = func(&input_buf, frame_width, frame_height, net_input_width_,
+                   net_input_height_, descriptor_.normalize(),
+                   descriptor_.mean_colors(2), descriptor_.mean_colors(1),
+                   descriptor_.mean_colors(0), &output_buf);
   LOG_IF(FATAL, error != 0) << "Halide error " << error;
 
   unset_halide_buf(input_buf);
   unset_halide_buf(output_buf);
 }
 
-void CaffeInputKernel::transform_caffe(u8* input_buffer, u8* output_buffer) {
+void CaffeInputTransformer::transform_nv12(const u8* input_buffer,
+                                           u8* output_buffer) {
+  CUDA_PROTECT({
+    CU_CHECK(convertNV12toNetInput(
+        input_buffer, frame_info_.width(), frame_info_.width(),
+        frame_info_.height(), (f32*)output_buffer, net_input_width_,
+        net_input_height_, descriptor_.normalize(), descriptor_.mean_colors(2),
+        descriptor_.mean_colors(1), descriptor_.mean_colors(0), 0));
+  });
+}
+
+void CaffeInputTransformer::transform_caffe(u8* input_buffer,
+                                            u8* output_buffer) {
   i32 frame_width = frame_info_.width();
   i32 frame_height = frame_info_.height();
   size_t net_input_size =
@@ -142,10 +167,9 @@ void CaffeInputKernel::transform_caffe(u8* input_buffer, u8* output_buffer) {
   output_blob.set_cpu_data((f32*)output_buffer);
 
   caffe::TransformationParameter param;
-  auto& descriptor = args_.net_descriptor();
-  auto& mean_colors = descriptor.mean_colors();
+  auto& mean_colors = descriptor_.mean_colors();
   param.set_force_color(true);
-  if (descriptor.normalize()) {
+  if (descriptor_.normalize()) {
     param.set_scale(1.0 / 255.0);
   }
   for (i32 i = 0; i < mean_colors.size(); i++) {
@@ -156,6 +180,27 @@ void CaffeInputKernel::transform_caffe(u8* input_buffer, u8* output_buffer) {
   transformer.Transform(input_mats, &output_blob);
 }
 
+void CaffeInputTransformer::set_device() {
+  if (device_.type == DeviceType::GPU) {
+    CUDA_PROTECT({
+      cv::cuda::setDevice(device_.id);
+      CU_CHECK(cudaSetDevice(device_.id));
+      halide_set_gpu_device(device_.id);
+    });
+  }
+}
+
+CaffeInputKernel::CaffeInputKernel(const KernelConfig& config)
+  : BatchedKernel(config), device_(config.devices[0]) {
+  args_.ParseFromArray(config.args.data(), config.args.size());
+  transformer_.reset(
+      new CaffeInputTransformer(device_, args_.net_descriptor()));
+}
+
+void CaffeInputKernel::new_frame_info() {
+  transformer_->configure(frame_info_);
+}
+
 void CaffeInputKernel::execute(const BatchedColumns& input_columns,
                                BatchedColumns& output_columns) {
   auto& frame_col = input_columns[0];
@@ -163,19 +208,42 @@ void CaffeInputKernel::execute(const BatchedColumns& input_columns,
 
   auto eval_start = now();
   i32 input_count = num_rows(frame_col);
-  size_t net_input_size =
-      net_input_width_ * net_input_height_ * 3 * sizeof(float);
 
   set_device();
 
-  FrameInfo info(3, net_input_height_, net_input_width_, FrameType::F32);
+  bool half = args_.half_precision();
+  FrameInfo info(3, transformer_->net_input_height(),
+                 transformer_->net_input_width(),
+                 half ? FrameType::F16 : FrameType::F32);
   std::vector<Frame*> frames = new_frames(device_, info, input_count);
+  // Half precision frames are transformed one at a time into floats first
+  size_t values = transformer_->net_input_size() / sizeof(f32);
+  u8* scratch =
+      half ? new_buffer(device_, transformer_->net_input_size()) : nullptr;
   for (i32 frame = 0; frame < input_count; frame++) {
     const u8* input_buffer = frame_col[frame].as_const_frame()->data;
-    transform_halide(input_buffer, frames[frame]->data);
+    if (!half) {
+      transformer_->transform(input_buffer, frames[frame]->data);
+    } else if (device_.type == DeviceType::GPU) {
+      transformer_->transform(input_buffer, scratch);
+      CUDA_PROTECT({
+        CU_CHECK(convertFloatToHalf((const f32*)scratch,
+                                    (u16*)frames[frame]->data, values, 0));
+      });
+    } else {
+      transformer_->transform(input_buffer, scratch);
+      float_to_half((const f32*)scratch, (u16*)frames[frame]->data, values);
+    }
 
     insert_frame(output_columns[0], frames[frame]);
   }
+  if (scratch != nullptr) {
+    if (device_.type == DeviceType::GPU) {
+      // The last conversion reads the scratch buffer until it finishes
+      CUDA_PROTECT({ CU_CHECK(cudaStreamSynchronize(0)); });
+    }
+    delete_buffer(device_, scratch);
+  }
 
   extra_inputs(input_columns, output_columns);
 
@@ -184,11 +252,5 @@ void CaffeInputKernel::execute(const BatchedColumns& input_columns,
   }
 }
 
-void CaffeInputKernel::set_device() {
-  CUDA_PROTECT({
-    cv::cuda::setDevice(device_.id);
-    CU_CHECK(cudaSetDevice(device_.id));
-    halide_set_gpu_device(device_.id);
-  });
-}
+void CaffeInputKernel::set_device() { transformer_->set_device(); }
 }
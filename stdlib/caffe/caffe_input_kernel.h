@@ -6,6 +6,8 @@
 #include "scanner/util/opencv.h"
 #include "stdlib/stdlib.pb.h"
 
+#include <memory>
+
 #ifdef HAVE_CUDA
 #include "caffe_input_transformer_gpu/caffe_input_transformer_gpu.h"
 #endif
@@ -13,33 +15,68 @@
 
 namespace scanner {
 
-class CaffeInputKernel : public BatchedKernel, public VideoKernel {
+//! Resizes frames to the input of a net, converts them to planar floats and
+//! subtracts the mean color. CaffeInput writes the result to a column, while
+//! Caffe kernels with transform_input write it into their input blob.
+class CaffeInputTransformer {
  public:
-  CaffeInputKernel(const KernelConfig& config);
-  ~CaffeInputKernel();
+  CaffeInputTransformer(DeviceHandle device,
+                        const proto::NetDescriptor& descriptor);
+  ~CaffeInputTransformer();
 
-  void new_frame_info() override;
+  //! Sizes the net input for frames of frame_info
+  void configure(const FrameInfo& frame_info);
 
-  void execute(const BatchedColumns& input_columns,
-               BatchedColumns& output_columns) override;
+  i32 net_input_width() const { return net_input_width_; }
 
-  void set_device();
+  i32 net_input_height() const { return net_input_height_; }
 
-  virtual void extra_inputs(const BatchedColumns& input_columns,
-                            BatchedColumns& output_columns) {}
+  //! Bytes of the net input of one frame
+  size_t net_input_size() const {
+    return net_input_width_ * net_input_height_ * 3 * sizeof(float);
+  }
 
- protected:
+  //! Writes the net input of a frame, which may be NV12 on the GPU, to
+  //! output_buffer on the device
+  void transform(const u8* input_buffer, u8* output_buffer);
+
+  void set_device();
+
+ private:
   void set_halide_buf(buffer_t& halide_buf, u8* buf, size_t size);
   void unset_halide_buf(buffer_t& halide_buf);
   void transform_halide(const u8* input_buffer, u8* output_buffer);
+  //! Fused color conversion, resize and mean subtraction of an NV12 frame
+  void transform_nv12(const u8* input_buffer, u8* output_buffer);
   void transform_caffe(u8* input_buffer, u8* output_buffer);
 
   DeviceHandle device_;
-  proto::CaffeInputArgs args_;
+  proto::NetDescriptor descriptor_;
+  FrameInfo frame_info_;
   i32 net_input_width_;
   i32 net_input_height_;
 #ifdef HAVE_CUDA
   CUcontext context_;
 #endif
 };
+
+class CaffeInputKernel : public BatchedKernel, public VideoKernel {
+ public:
+  CaffeInputKernel(const KernelConfig& config);
+
+  void new_frame_info() override;
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override;
+
+  void set_device();
+
+  virtual void extra_inputs(const BatchedColumns& input_columns,
+                            BatchedColumns& output_columns) {}
+
+ protected:
+  DeviceHandle device_;
+  proto::CaffeInputArgs args_;
+  std::unique_ptr<CaffeInputTransformer> transformer_;
+};
 }
@@ -5,5 +5,6 @@ namespace scanner {
 REGISTER_KERNEL(CaffeInput, CaffeInputKernel)
     .device(DeviceType::GPU)
     .batch()
-    .num_devices(1);
+    .num_devices(1)
+    .accepts_nv12_frames();
 }
@@ -90,16 +90,21 @@ class CaffeInputTransformer : public Halide::Generator<CaffeInputTransformer> {
 
     input.dim(0).set_stride(3).dim(2).set_stride(1);
 
-    Target target = Halide::get_target_from_environment();
+    // The generator is run once per target it is built for, so schedules
+    // are fit to the features of each variant
+    const Target& target = get_target();
 #ifdef HALIDE_USE_GPU
-    target.set_feature(Target::CUDA);
-    target.set_feature(Target::CUDACapability50);
-    resized_x.compute_root().reorder(c, x, y).unroll(c).gpu_tile(x, y, 8, 8);
-    rescaled.reorder(c, x, y).unroll(c).gpu_tile(x, y, 8, 8);
+    // Rows of a warp read consecutive pixels on GPUs that can keep more
+    // blocks resident
+    int tile_width = target.has_feature(Target::CUDACapability61) ? 32 : 8;
+    resized_x.compute_root().reorder(c, x, y).unroll(c).gpu_tile(
+        x, y, tile_width, 8);
+    rescaled.reorder(c, x, y).unroll(c).gpu_tile(x, y, tile_width, 8);
 #else
-    rescaled.reorder(x, c, y).parallel(y).vectorize(x, 8);
-    resized_x.compute_at(rescaled, y).vectorize(x, 8);
-    resized_y.compute_at(rescaled, y).vectorize(x, 8);
+    const int vector_size = target.natural_vector_size<float>();
+    rescaled.reorder(x, c, y).parallel(y).vectorize(x, vector_size);
+    resized_x.compute_at(rescaled, y).vectorize(x, vector_size);
+    resized_y.compute_at(rescaled, y).vectorize(x, vector_size);
 #endif
 
     return rescaled;
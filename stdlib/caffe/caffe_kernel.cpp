@@ -1,5 +1,7 @@
 #include "stdlib/caffe/caffe_kernel.h"
 #include "scanner/engine/metadata.h"
+#include "scanner/util/half.h"
+#include "scanner/util/image.h"
 
 #include "caffe/blob.hpp"
 #include "caffe/common.hpp"
@@ -260,6 +262,21 @@ CaffeKernel::CaffeKernel(const KernelConfig& config)
   input_blob->Reshape({args_.batch_size(), input_blob->shape(1),
                        input_blob->shape(2), input_blob->shape(3)});
 
+  if (args_.transform_input()) {
+    input_transformer_.reset(new CaffeInputTransformer(device_, descriptor));
+  }
+
+#ifdef HAVE_CUDA
+  if (device_.type == DeviceType::GPU) {
+    CU_CHECK(cudaStreamCreateWithFlags(&copy_stream_, cudaStreamNonBlocking));
+    for (i32 i = 0; i < 2; ++i) {
+      CU_CHECK(cudaEventCreateWithFlags(&staged_[i], cudaEventDisableTiming));
+      CU_CHECK(
+          cudaEventCreateWithFlags(&forward_done_[i], cudaEventDisableTiming));
+    }
+  }
+#endif
+
   size_t intended_output = descriptor.output_layer_names().size();
   size_t actual_output = config.output_columns.size();
 
@@ -274,6 +291,25 @@ CaffeKernel::CaffeKernel(const KernelConfig& config)
   }
 }
 
+CaffeKernel::~CaffeKernel() {
+#ifdef HAVE_CUDA
+  if (copy_stream_ != nullptr) {
+    set_device();
+    CU_CHECK(cudaStreamSynchronize(copy_stream_));
+    for (i32 i = 0; i < 2; ++i) {
+      for (u8* buffer : staging_[i]) {
+        if (buffer != nullptr) {
+          delete_buffer(device_, buffer);
+        }
+      }
+      cudaEventDestroy(staged_[i]);
+      cudaEventDestroy(forward_done_[i]);
+    }
+    cudaStreamDestroy(copy_stream_);
+  }
+#endif
+}
+
 void CaffeKernel::validate(proto::Result* result) {
   result->set_msg(valid_.msg());
   result->set_success(valid_.success());
@@ -282,6 +318,11 @@ void CaffeKernel::validate(proto::Result* result) {
 void CaffeKernel::new_frame_info() {
   i32 frame_width = frame_info_.shape[2];
   i32 frame_height = frame_info_.shape[1];
+  if (input_transformer_) {
+    input_transformer_->configure(frame_info_);
+    frame_width = input_transformer_->net_input_width();
+    frame_height = input_transformer_->net_input_height();
+  }
 
   set_device();
 
@@ -332,6 +373,7 @@ void CaffeKernel::new_frame_info() {
 
 void CaffeKernel::execute(const BatchedColumns& input_columns,
                           BatchedColumns& output_columns) {
+  std::lock_guard<std::mutex> lock(execute_mutex_);
   check_frame(device_, input_columns[0][0]);
   set_device();
 
@@ -350,6 +392,15 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
   size_t num_outputs = descriptor.output_layer_names().size();
   i32 input_count = (i32)input_columns[0].size();
   i32 batch_size = args_.batch_size();
+  // On the GPU the inputs of the next batch are staged while the net runs on
+  // the current one, and the outputs are copied out without waiting on them
+  bool pipelined = false;
+#ifdef HAVE_CUDA
+  pipelined = device_.type == DeviceType::GPU;
+  if (pipelined) {
+    stage_batch(input_columns, 0, std::min(input_count, batch_size), 0);
+  }
+#endif
   for (i32 frame = 0; frame < input_count; frame += batch_size) {
     i32 batch_count = std::min(input_count - frame, batch_size);
     if (input_blobs[0]->shape(0) != batch_count) {
@@ -358,20 +409,24 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
                                input_blobs[0]->shape(3)});
     }
 
-    for (i32 i = 0; i < input_blobs.size(); ++i) {
-      f32* net_input_buffer = nullptr;
-      if (device_.type == DeviceType::GPU) {
-        net_input_buffer = input_blobs[i]->mutable_gpu_data();
-      } else {
-        net_input_buffer = input_blobs[i]->mutable_cpu_data();
+#ifdef HAVE_CUDA
+    i32 slot = (frame / batch_size) % 2;
+    if (pipelined) {
+      for (size_t i = 0; i < input_blobs.size(); ++i) {
+        input_blobs[i]->set_gpu_data((f32*)staging_[slot][i]);
       }
-
-      size_t offset = 0;
-      for (i32 j = 0; j < batch_count; ++j) {
-        const Frame* fr = input_columns[i][frame + j].as_const_frame();
-        memcpy_buffer((u8*)net_input_buffer + offset, device_, fr->data,
-                      device_, fr->size());
-        offset += fr->size();
+      CU_CHECK(cudaStreamWaitEvent(0, staged_[slot], 0));
+      i32 next = frame + batch_size;
+      if (next < input_count) {
+        stage_batch(input_columns, next,
+                    std::min(input_count - next, batch_size), 1 - slot);
+      }
+    }
+#endif
+    if (!pipelined) {
+      for (i32 i = 0; i < input_blobs.size(); ++i) {
+        fill_input(input_columns, i, frame, batch_count,
+                   (u8*)input_blobs[i]->mutable_cpu_data());
       }
     }
 
@@ -383,6 +438,11 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
       PyErr_Print();
       exit(0);
     }
+#ifdef HAVE_CUDA
+    if (pipelined) {
+      CU_CHECK(cudaEventRecord(forward_done_[slot], 0));
+    }
+#endif
     if (profiler_) {
       // #ifdef SCANNER_PROFILING
       //      CUDA_PROTECT({ cudaDeviceSynchronize(); });
@@ -396,7 +456,6 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
       const std::string& output_layer_name = descriptor.output_layer_names(i);
       const boost::shared_ptr<caffe::Blob<float>> output_blob{
           net_->blob_by_name(output_layer_name)};
-
       i32 num_axes = output_blob->num_axes();
       FrameInfo info(output_blob->shape(1),
                      num_axes >= 3 ? output_blob->shape(2) : 1,
@@ -407,21 +466,120 @@ void CaffeKernel::execute(const BatchedColumns& input_columns,
       u8* src_buffer =
           (u8*)(device_.type == DeviceType::CPU ? output_blob->cpu_data()
                                                 : output_blob->gpu_data());
-      memcpy_buffer(output_block, device_, src_buffer, device_,
-                    info.size() * batch_count);
+      if (pipelined) {
+        // Ordered before the next batch overwrites the output blob
+        CUDA_PROTECT({
+          CU_CHECK(cudaMemcpyAsync(output_block, src_buffer,
+                                   info.size() * batch_count,
+                                   cudaMemcpyDeviceToDevice, 0));
+        });
+      } else {
+        memcpy_buffer(output_block, device_, src_buffer, device_,
+                      info.size() * batch_count);
+      }
       for (i32 b = 0; b < batch_count; b++) {
         insert_frame(output_columns[i],
                      new Frame(info, output_block + info.size() * b));
       }
     }
   }
+  if (pipelined) {
+    CUDA_PROTECT({ CU_CHECK(cudaStreamSynchronize(0)); });
+  }
 
   if (descriptor.uses_python()) {
     PyGILState_Release(gstate);
   }
 }
 
+void CaffeKernel::fill_input(const BatchedColumns& input_columns, i32 input,
+                             i32 frame, i32 batch_count, u8* buffer) {
+  // Transformed frames are written straight into the buffer instead of
+  // going through a column of net inputs
+  if (input == 0 && input_transformer_) {
+    auto transform_start = now();
+    size_t net_input_size = input_transformer_->net_input_size();
+    for (i32 j = 0; j < batch_count; ++j) {
+      const Frame* fr = input_columns[input][frame + j].as_const_frame();
+      input_transformer_->transform(fr->data, buffer + j * net_input_size);
+    }
+    if (profiler_) {
+      profiler_->add_interval("caffe:transform_input", transform_start,
+                              now());
+    }
+    return;
+  }
+
+  // Half precision frames, such as those of CaffeInput with half_precision,
+  // widen to the floats of the blob as they are copied
+  size_t offset = 0;
+  for (i32 j = 0; j < batch_count; ++j) {
+    const Frame* fr = input_columns[input][frame + j].as_const_frame();
+    bool half = fr->type == FrameType::F16;
+    size_t values = fr->size() / sizeof(u16);
+#ifdef HAVE_CUDA
+    if (device_.type == DeviceType::GPU) {
+      if (half) {
+        CU_CHECK(convertHalfToFloat((const u16*)fr->data,
+                                    (f32*)(buffer + offset), values,
+                                    copy_stream_));
+        offset += values * sizeof(f32);
+      } else {
+        CU_CHECK(cudaMemcpyAsync(buffer + offset, fr->data, fr->size(),
+                                 cudaMemcpyDeviceToDevice, copy_stream_));
+        offset += fr->size();
+      }
+      continue;
+    }
+#endif
+    if (half) {
+      half_to_float((const u16*)fr->data, (f32*)(buffer + offset), values);
+      offset += values * sizeof(f32);
+    } else {
+      memcpy_buffer(buffer + offset, device_, fr->data, device_, fr->size());
+      offset += fr->size();
+    }
+  }
+}
+
+#ifdef HAVE_CUDA
+void CaffeKernel::stage_batch(const BatchedColumns& input_columns, i32 frame,
+                              i32 batch_count, i32 slot) {
+  size_t num_inputs = args_.net_descriptor().input_layer_names_size();
+  std::vector<u8*>& buffers = staging_[slot];
+  std::vector<size_t>& sizes = staging_sizes_[slot];
+  buffers.resize(num_inputs, nullptr);
+  sizes.resize(num_inputs, 0);
+  // Copies into the buffers wait for the batch that last read them
+  CU_CHECK(cudaStreamWaitEvent(copy_stream_, forward_done_[slot], 0));
+  for (size_t i = 0; i < num_inputs; ++i) {
+    size_t size = 0;
+    if (i == 0 && input_transformer_) {
+      size = input_transformer_->net_input_size() * batch_count;
+    } else {
+      for (i32 j = 0; j < batch_count; ++j) {
+        const Frame* fr = input_columns[i][frame + j].as_const_frame();
+        size += fr->type == FrameType::F16 ? fr->size() * 2 : fr->size();
+      }
+    }
+    if (size > sizes[i]) {
+      CU_CHECK(cudaEventSynchronize(forward_done_[slot]));
+      if (buffers[i] != nullptr) {
+        delete_buffer(device_, buffers[i]);
+      }
+      buffers[i] = new_buffer(device_, size);
+      sizes[i] = size;
+    }
+    fill_input(input_columns, i, frame, batch_count, buffers[i]);
+  }
+  CU_CHECK(cudaEventRecord(staged_[slot], copy_stream_));
+}
+#endif
+
 void CaffeKernel::set_device() {
+  if (input_transformer_) {
+    input_transformer_->set_device();
+  }
   caffe::Caffe::set_mode(device_type_to_caffe_mode(device_.type));
   if (device_.type == DeviceType::GPU) {
     CUDA_PROTECT({
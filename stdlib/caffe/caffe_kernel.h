@@ -4,6 +4,7 @@
 #include "scanner/api/op.h"
 #include "scanner/util/cuda.h"
 #include "scanner/util/memory.h"
+#include "stdlib/caffe/caffe_input_kernel.h"
 #include "stdlib/stdlib.pb.h"
 
 #include "caffe/blob.hpp"
@@ -13,6 +14,8 @@
 #include "caffe/util/db.hpp"
 #include "caffe/util/io.hpp"
 
+#include <mutex>
+
 namespace scanner {
 
 using CustomNetConfiguration = void (*)(const FrameInfo& frame_info,
@@ -21,6 +24,7 @@ using CustomNetConfiguration = void (*)(const FrameInfo& frame_info,
 class CaffeKernel : public BatchedKernel, public VideoKernel {
  public:
   CaffeKernel(const KernelConfig& config);
+  ~CaffeKernel();
   void validate(proto::Result* result) override;
   void new_frame_info() override;
   void execute(const BatchedColumns& input_columns,
@@ -35,6 +39,32 @@ class CaffeKernel : public BatchedKernel, public VideoKernel {
   proto::CaffeArgs args_;
   std::unique_ptr<caffe::Net<float>> net_;
   CustomNetConfiguration net_config_;
+  // Writes the frames of the first input into its blob with transform_input
+  std::unique_ptr<CaffeInputTransformer> input_transformer_;
+
+ private:
+  //! Writes the rows of a batch of an input column to buffer on the device.
+  //! Copies on the GPU are queued on copy_stream_.
+  void fill_input(const BatchedColumns& input_columns, i32 input, i32 frame,
+                  i32 batch_count, u8* buffer);
+
+#ifdef HAVE_CUDA
+  //! Queues the copies of the inputs of a batch into the buffers of slot
+  void stage_batch(const BatchedColumns& input_columns, i32 frame,
+                   i32 batch_count, i32 slot);
+
+  // Batches alternate between two slots of input buffers, so the inputs of
+  // one are copied on copy_stream_ while the net reads the other
+  cudaStream_t copy_stream_ = nullptr;
+  cudaEvent_t staged_[2];
+  cudaEvent_t forward_done_[2];
+  // Per slot -> per input -> device buffer and its size
+  std::vector<u8*> staging_[2];
+  std::vector<size_t> staging_sizes_[2];
+#endif
+  // Pipeline instances on a device share the kernel, so their batches take
+  // turns on the network
+  std::mutex execute_mutex_;
 };
 
 proto::NetDescriptor descriptor_from_net_file(const std::string& path);
@@ -5,5 +5,7 @@ namespace scanner {
 REGISTER_KERNEL(Caffe, CaffeKernel)
     .device(DeviceType::GPU)
     .batch()
-    .num_devices(1);
+    .num_devices(1)
+    .shared()
+    .accepts_nv12_frames();
 }
@@ -119,8 +119,6 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
     args.ParseFromArray(config.args.data(), config.args.size());
     scale_ = args.scale();
     modeldesc.reset(new MPIModelDescriptor());
-
-    joints_.resize(max_people_ * 3 * max_num_parts_);
   }
 
   void new_frame_info() override {
@@ -151,6 +149,11 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
 
     i32 input_count = (i32)num_rows(input_columns[0]);
 
+    // Frames of the batch are connected on their own threads, each into its
+    // own joints, and serialized in order on this one
+    std::vector<std::vector<std::vector<scanner::Point>>> batch_bodies(
+        input_count);
+#pragma omp parallel for schedule(dynamic)
     for (i32 b = 0; b < input_count; ++b) {
       const Frame* heatmap_frame =
           input_columns[heatmap_idx][b].as_const_frame();
@@ -162,19 +165,21 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
       const float* heatmap = reinterpret_cast<float*>(heatmap_frame->data);
       const float* peaks = reinterpret_cast<float*>(joints_frame->data);
 
+      std::vector<float> joints(max_people_ * 3 * max_num_parts_);
       std::vector<std::vector<double>> subset;
       std::vector<std::vector<std::vector<double>>> connection;
       int count =
-          connect_limbs(subset, connection, heatmap, peaks, joints_.data());
+          connect_limbs(subset, connection, heatmap, peaks, joints.data());
 
-      std::vector<std::vector<scanner::Point>> bodies(count);
+      std::vector<std::vector<scanner::Point>>& bodies = batch_bodies[b];
+      bodies.resize(count);
       for (int p = 0; p < count; ++p) {
         std::vector<scanner::Point>& body_joints = bodies[p];
         for (i32 j = 0; j < num_joints_; ++j) {
           int offset = p * num_joints_ * 3 + j * 3;
-          float score = joints_[offset + 2];
-          float y = joints_[offset + 1];
-          float x = joints_[offset + 0];
+          float score = joints[offset + 2];
+          float y = joints[offset + 1];
+          float x = joints[offset + 0];
 
           scanner::Point joint;
           joint.set_x(x);
@@ -183,9 +188,12 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
           body_joints.push_back(joint);
         }
       }
+    }
+
+    for (i32 b = 0; b < input_count; ++b) {
       size_t size;
       u8* buffer;
-      serialize_proto_vector_of_vectors(bodies, buffer, size);
+      serialize_proto_vector_of_vectors(batch_bodies[b], buffer, size);
       insert_element(output_columns.at(heatmap_idx), buffer, size);
     }
   }
@@ -485,7 +493,6 @@ class CPM2OutputKernel : public BatchedKernel, public VideoKernel {
   float connect_min_subset_score_ = 0.4;
   float connect_inter_threshold_ = 0.01;
   int connect_inter_min_above_threshold_ = 8;
-  std::vector<float> joints_;
 };
 
 REGISTER_OP(CPM2Output)
@@ -496,5 +503,6 @@ REGISTER_OP(CPM2Output)
 
 REGISTER_KERNEL(CPM2Output, CPM2OutputKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -0,0 +1,9 @@
+#pragma once
+
+// Output of the Faster R-CNN net: class scores and proposals of BOX_SIZE
+// floats (batch index, x1, y1, x2, y2), with a fc7 feature vector each
+#define CLASSES 81
+#define SCORE_THRESHOLD 0.7
+#define BOX_SIZE 5
+#define FEATURES 4096
+#define NMS_OVERLAP 0.3
@@ -4,15 +4,11 @@
 #include "scanner/util/bbox.h"
 #include "scanner/util/opencv.h"
 #include "scanner/util/serialize.h"
+#include "stdlib/caffe/faster_rcnn_output_kernel.h"
 #include "stdlib/stdlib.pb.h"
 
 namespace scanner {
 
-#define CLASSES 81
-#define SCORE_THRESHOLD 0.7
-#define BOX_SIZE 5
-#define FEATURES 4096
-
 class FasterRCNNOutputKernel : public BatchedKernel {
  public:
   FasterRCNNOutputKernel(const KernelConfig& config) : BatchedKernel(config) {}
@@ -71,7 +67,7 @@ class FasterRCNNOutputKernel : public BatchedKernel {
       }
 
       std::vector<BoundingBox> best_bboxes;
-      best_bboxes = best_nms(bboxes, 0.3);
+      best_bboxes = best_nms(bboxes, NMS_OVERLAP);
 
       {
         size_t size;
@@ -0,0 +1,116 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/types.pb.h"
+#include "scanner/util/bbox.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/serialize.h"
+#include "stdlib/caffe/faster_rcnn_output_kernel.h"
+#include "stdlib/stdlib.pb.h"
+
+namespace scanner {
+
+//! Picks the classes of the proposals and suppresses overlapping ones on the
+//! GPU, so only the boxes that are kept, and none of the scores, are copied
+//! to the host
+class FasterRCNNOutputKernelGPU : public BatchedKernel {
+ public:
+  FasterRCNNOutputKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+    num_boxes_ = (i32*)new_buffer(device_, sizeof(i32));
+  }
+
+  ~FasterRCNNOutputKernelGPU() {
+    set_device();
+    if (boxes_ != nullptr) {
+      delete_buffer(device_, (u8*)boxes_);
+    }
+    delete_buffer(device_, (u8*)num_boxes_);
+    cudaStreamDestroy(stream_);
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    assert(input_columns.size() == 3);
+    set_device();
+
+    i32 input_count = num_rows(input_columns[0]);
+    const ElementList &cls_prob = input_columns[0], &rois = input_columns[1],
+                      &fc7 = input_columns[2];
+    check_frame(device_, cls_prob[0]);
+
+    for (i32 i = 0; i < input_count; ++i) {
+      const Frame* cls = cls_prob[i].as_const_frame();
+      const Frame* roi = rois[i].as_const_frame();
+      const Frame* fc = fc7[i].as_const_frame();
+
+      i32 proposal_count = roi->size() / (BOX_SIZE * sizeof(f32));
+      assert(roi->size() == BOX_SIZE * sizeof(f32) * proposal_count);
+      assert(cls->size() == CLASSES * sizeof(f32) * proposal_count);
+      if (proposal_count > max_boxes_) {
+        if (boxes_ != nullptr) {
+          delete_buffer(device_, (u8*)boxes_);
+        }
+        boxes_ = (DeviceBox*)new_buffer(device_,
+                                        proposal_count * sizeof(DeviceBox));
+        max_boxes_ = proposal_count;
+      }
+
+      i32 num_boxes = 0;
+      CU_CHECK(cudaMemsetAsync(num_boxes_, 0, sizeof(i32), stream_));
+      CU_CHECK(decodeProposalBoxes((const f32*)roi->data,
+                                   (const f32*)cls->data, proposal_count,
+                                   CLASSES, SCORE_THRESHOLD, boxes_,
+                                   num_boxes_, stream_));
+      CU_CHECK(cudaMemcpyAsync(&num_boxes, num_boxes_, sizeof(i32),
+                               cudaMemcpyDeviceToHost, stream_));
+      CU_CHECK(cudaStreamSynchronize(stream_));
+
+      std::vector<BoundingBox> best_bboxes =
+          best_nms_gpu(device_, boxes_, num_boxes, NMS_OVERLAP, stream_);
+
+      {
+        size_t size;
+        u8* host_buffer;
+        serialize_bbox_vector(best_bboxes, host_buffer, size);
+        u8* buffer = new_buffer(device_, size);
+        memcpy_buffer(buffer, device_, host_buffer, CPU_DEVICE, size);
+        delete_buffer(CPU_DEVICE, host_buffer);
+        insert_element(output_columns[0], buffer, size);
+      }
+
+      {
+        // The features of the kept boxes are gathered on the device
+        size_t size =
+            std::max(best_bboxes.size() * FEATURES * sizeof(f32), (size_t)1);
+        u8* buffer = new_buffer(device_, size);
+        for (i32 k = 0; k < best_bboxes.size(); ++k) {
+          i32 j = best_bboxes[k].track_id();
+          CU_CHECK(cudaMemcpyAsync(buffer + (k * FEATURES * sizeof(f32)),
+                                   fc->data + (j * FEATURES * sizeof(f32)),
+                                   FEATURES * sizeof(f32),
+                                   cudaMemcpyDeviceToDevice, stream_));
+        }
+        insert_element(output_columns[1], buffer, size);
+      }
+    }
+    CU_CHECK(cudaStreamSynchronize(stream_));
+  }
+
+  void set_device() { CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); }); }
+
+ private:
+  DeviceHandle device_;
+  cudaStream_t stream_;
+  // Candidates of a frame, room for max_boxes_
+  DeviceBox* boxes_ = nullptr;
+  i32 max_boxes_ = 0;
+  i32* num_boxes_;
+};
+
+REGISTER_KERNEL(FasterRCNNOutput, FasterRCNNOutputKernelGPU)
+    .device(DeviceType::GPU)
+    .num_devices(1);
+}
@@ -54,9 +54,6 @@ class YoloOutputKernel : public BatchedKernel, public VideoKernel {
           category_confidences_vector + feature_vector_lengths_[0];
       f32* bbox_vector = objectness_vector += feature_vector_lengths_[1];
 
-      std::vector<f32> pixel_confidences(
-          input_height_ * input_width_ * num_categories_, 0.0f);
-
       // Get bounding box data from output feature vector and turn it
       // into canonical center x, center y, width, height
       std::vector<BoundingBox> bboxes;
@@ -81,29 +78,12 @@ class YoloOutputKernel : public BatchedKernel, public VideoKernel {
                          2) *
                 input_height_;
 
-            std::vector<f32> category_probabilities(num_categories_);
             for (i32 c = 0; c < num_categories_; ++c) {
               f64 prob = objectness_vector[vec_offset * num_bboxes_ + bi] *
                          category_confidences_vector[vec_offset + c];
-              category_probabilities[c] = prob;
 
               if (prob < threshold_) continue;
 
-              for (i32 bbox_y = std::max(y - height / 2, 0.0f);
-                   bbox_y < std::min(y + height / 2, (f32)input_height_);
-                   ++bbox_y) {
-                for (i32 bbox_x = std::max(x - width / 2, 0.0f);
-                     bbox_x < std::min(x + width / 2, (f32)input_width_);
-                     ++bbox_x) {
-                  f32& max_confidence =
-                      pixel_confidences[bbox_y * input_width_ +
-                                        bbox_x * num_categories_ + c];
-                  if (prob > max_confidence) {
-                    max_confidence = prob;
-                  }
-                }
-              }
-
               if (width < 0 || height < 0) continue;
 
               BoundingBox bbox;
@@ -119,31 +99,6 @@ class YoloOutputKernel : public BatchedKernel, public VideoKernel {
         }
       }
 
-      i32 non_thresholded_pixels = 1;
-      f64 certainty = 0.0f;
-      for (i32 yi = 0; yi < input_height_; ++yi) {
-        for (i32 xi = 0; xi < input_width_; ++xi) {
-          // For each pixel, compute difference between two most
-          // confident classes
-          f32 max1 = std::numeric_limits<f32>::lowest();
-          f32 max2 = std::numeric_limits<f32>::lowest();
-          for (i32 c = 0; c < num_categories_; ++c) {
-            const f32& confidence =
-                pixel_confidences[yi * input_width_ + xi * num_categories_ + c];
-            if (confidence > max1) {
-              max2 = max1;
-              max1 = confidence;
-            } else if (confidence > max2) {
-              max2 = confidence;
-            }
-          }
-          certainty += (max1 - max2);
-          if (max1 > threshold_ || max2 > threshold_) {
-            non_thresholded_pixels++;
-          }
-        }
-      }
-
       size_t size;
       u8* buffer;
       serialize_bbox_vector(bboxes, buffer, size);
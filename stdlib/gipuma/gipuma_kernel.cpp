@@ -9,17 +9,30 @@
 #include "gipuma/cameraGeometryUtils.h"
 #include "gipuma/gipuma.h"
 
+#include <thread>
+
 namespace scanner {
 
-class GipumaKernel : public VideoKernel {
+namespace {
+// Gipuma state on one of the devices of the kernel. The grayscale views
+// are made on the first device, where the inputs are, and copied into the
+// texture arrays of this one.
+struct GipumaDevice {
+  DeviceHandle device;
+  std::unique_ptr<GlobalState> state;
+  std::unique_ptr<AlgorithmParameters> params;
+  cvc::Stream stream;
+  std::vector<cvc::GpuMat> gray_u8;
+  std::vector<cvc::GpuMat> gray;
+  // Whether the texture arrays exist for the current resolution
+  bool textures = false;
+};
+}
+
+class GipumaKernel : public BatchedKernel, public VideoKernel {
  public:
   GipumaKernel(const KernelConfig& config)
-    : VideoKernel(config), device_(config.devices[0]), was_reset_(true) {
-    set_device();
-
-    state_.reset(new GlobalState);
-    algo_params_ = new AlgorithmParameters;
-
+    : BatchedKernel(config), devices_(config.devices), was_reset_(true) {
     valid_.set_success(true);
     if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
       RESULT_ERROR(&valid_, "GipumaKernel could not parse protobuf args");
@@ -27,55 +40,71 @@ class GipumaKernel : public VideoKernel {
     }
 
     num_cameras_ = config.input_columns.size() / 3;
-    algo_params_->num_img_processed = num_cameras_;
-    algo_params_->min_angle = 1.00;
-    algo_params_->max_angle = 70.00;
-
-    algo_params_->min_disparity = args_.min_disparity();
-    algo_params_->max_disparity = args_.max_disparity();
-    algo_params_->depthMin = args_.min_depth();
-    algo_params_->depthMax = args_.max_depth();
-    algo_params_->iterations = args_.iterations();
-    algo_params_->box_hsize = args_.kernel_width();
-    algo_params_->box_vsize = args_.kernel_height();
-
-    algo_params_->n_best = 3;
-    algo_params_->normTol = 0.1f;
+    for (DeviceHandle device : devices_) {
+      set_device(device);
+      gipuma_.emplace_back();
+      GipumaDevice& g = gipuma_.back();
+      g.device = device;
+      g.state.reset(new GlobalState);
+      g.params.reset(new AlgorithmParameters);
+      AlgorithmParameters* params = g.params.get();
+      params->num_img_processed = num_cameras_;
+      params->min_angle = 1.00;
+      params->max_angle = 70.00;
+
+      params->min_disparity = args_.min_disparity();
+      params->max_disparity = args_.max_disparity();
+      params->depthMin = args_.min_depth();
+      params->depthMax = args_.max_depth();
+      params->iterations = args_.iterations();
+      params->box_hsize = args_.kernel_width();
+      params->box_vsize = args_.kernel_height();
+
+      params->n_best = 3;
+      params->normTol = 0.1f;
+
+      // With the grayscale views on the first device
+      set_device(devices_[0]);
+      g.stream = cvc::Stream();
+    }
   }
 
-  ~GipumaKernel() { delete algo_params_; }
+  ~GipumaKernel() {
+    for (GipumaDevice& g : gipuma_) {
+      release_textures(g);
+    }
+  }
 
   void validate(proto::Result* result) {
     result->set_msg(valid_.msg());
     result->set_success(valid_.success());
   }
 
-  void reset() {
-    camera_params_ = CameraParameters();
-    delete state_->cameras;
-    state_->cameras = new CameraParameters_cu;
+  void reset() override {
+    for (GipumaDevice& g : gipuma_) {
+      set_device(g.device);
+      release_textures(g);
+      delete g.state->cameras;
+      g.state->cameras = new CameraParameters_cu;
+    }
     was_reset_ = true;
   }
 
-  void setup_gipuma(const BatchedColumns& input_columns) {
+  void new_frame_info() override { was_reset_ = true; }
+
+  void setup_gipuma(GipumaDevice& g, const std::vector<proto::Camera>& cams) {
     i32 frame_width = frame_info_.width();
     i32 frame_height = frame_info_.height();
+    GlobalState* state = g.state.get();
+    AlgorithmParameters* params = g.params.get();
 
-    // Read camera calibration matrix from columns
-    for (i32 i = 0; i < num_cameras_; ++i) {
-      i32 col_idx = 2 + 3 * i;
-      auto& calibration_col = input_columns[col_idx];
-      // Read camera parameters from camera calibration column
-
-      u8* buffer = new_buffer(CPU_DEVICE, calibration_col.rows[0].size);
-      memcpy_buffer((u8*)buffer, CPU_DEVICE, calibration_col.rows[0].buffer,
-                    device_, calibration_col.rows[0].size);
-      proto::Camera cam;
-      cam.ParseFromArray(buffer, calibration_col.rows[0].size);
-      delete_buffer(CPU_DEVICE, buffer);
-
-      camera_params_.cameras.emplace_back();
-      auto& c = camera_params_.cameras.back();
+    set_device(g.device);
+    release_textures(g);
+
+    CameraParameters camera_params;
+    for (const proto::Camera& cam : cams) {
+      camera_params.cameras.emplace_back();
+      auto& c = camera_params.cameras.back();
       for (i32 i = 0; i < 3; ++i) {
         for (i32 j = 0; j < 4; ++j) {
           i32 idx = i * 4 + j;
@@ -83,57 +112,75 @@ class GipumaKernel : public VideoKernel {
         }
       }
     }
-    camera_params_ = getCameraParameters(*(state_->cameras), camera_params_);
+    camera_params = getCameraParameters(*(state->cameras), camera_params);
 
-    selectViews(camera_params_, frame_width, frame_height, *algo_params_);
-    i32 selected_views = camera_params_.viewSelectionSubset.size();
+    selectViews(camera_params, frame_width, frame_height, *params);
+    i32 selected_views = camera_params.viewSelectionSubset.size();
     assert(selected_views > 0);
-    printf("Num cameras selected %d\n", selected_views);
 
     for (i32 i = 0; i < num_cameras_; ++i) {
-      camera_params_.cameras[i].depthMin = algo_params_->depthMin;
-      camera_params_.cameras[i].depthMax = algo_params_->depthMax;
-      state_->cameras->cameras[i].depthMin = algo_params_->depthMin;
-      state_->cameras->cameras[i].depthMax = algo_params_->depthMax;
-
-      algo_params_->min_disparity = disparityDepthConversion(
-          camera_params_.f, camera_params_.cameras[i].baseline,
-          camera_params_.cameras[i].depthMax);
-
-      algo_params_->max_disparity = disparityDepthConversion(
-          camera_params_.f, camera_params_.cameras[i].baseline,
-          camera_params_.cameras[i].depthMin);
+      camera_params.cameras[i].depthMin = params->depthMin;
+      camera_params.cameras[i].depthMax = params->depthMax;
+      state->cameras->cameras[i].depthMin = params->depthMin;
+      state->cameras->cameras[i].depthMax = params->depthMax;
+
+      params->min_disparity = disparityDepthConversion(
+          camera_params.f, camera_params.cameras[i].baseline,
+          camera_params.cameras[i].depthMax);
+
+      params->max_disparity = disparityDepthConversion(
+          camera_params.f, camera_params.cameras[i].baseline,
+          camera_params.cameras[i].depthMin);
     }
 
     for (i32 i = 0; i < selected_views; ++i) {
-      state_->cameras->viewSelectionSubset[i] =
-          camera_params_.viewSelectionSubset[i];
+      state->cameras->viewSelectionSubset[i] =
+          camera_params.viewSelectionSubset[i];
     }
 
-    state_->params = algo_params_;
-    state_->cameras->viewSelectionSubsetNumber = selected_views;
+    state->params = params;
+    state->cameras->viewSelectionSubsetNumber = selected_views;
 
-    state_->cameras->cols = frame_width;
-    state_->cameras->rows = frame_height;
-    algo_params_->cols = frame_width;
-    algo_params_->rows = frame_height;
+    state->cameras->cols = frame_width;
+    state->cameras->rows = frame_height;
+    params->cols = frame_width;
+    params->rows = frame_height;
 
     // Resize lines
-    state_->lines->n = frame_height * frame_width;
-    state_->lines->resize(frame_height * frame_width);
-    state_->lines->s = frame_width;
-    state_->lines->l = frame_width;
+    state->lines->n = frame_height * frame_width;
+    state->lines->resize(frame_height * frame_width);
+    state->lines->s = frame_width;
+    state->lines->l = frame_width;
+
+    // Grayscale views on the device of the inputs
+    set_device(devices_[0]);
+    g.gray_u8.clear();
+    g.gray.clear();
+    for (i32 c = 0; c < num_cameras_; ++c) {
+      g.gray_u8.emplace_back(frame_height, frame_width, CV_8UC1);
+      g.gray.emplace_back(frame_height, frame_width, CV_32FC1);
+    }
   }
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
-    set_device();
-
-    auto& frame_info = input_columns[1];
-    check_frame_info(device_, frame_info);
+    set_device(devices_[0]);
+    check_frame(devices_[0], input_columns[0][0]);
 
     if (was_reset_) {
-      setup_gipuma(input_columns);
+      // Read camera calibration matrix from columns
+      std::vector<proto::Camera> cams(num_cameras_);
+      for (i32 i = 0; i < num_cameras_; ++i) {
+        const Element& calibration = input_columns[2 + 3 * i][0];
+        std::vector<u8> buffer(calibration.size);
+        memcpy_buffer(buffer.data(), CPU_DEVICE, calibration.buffer,
+                      devices_[0], calibration.size);
+        cams[i].ParseFromArray(buffer.data(), buffer.size());
+      }
+      for (GipumaDevice& g : gipuma_) {
+        setup_gipuma(g, cams);
+      }
+      was_reset_ = false;
     }
 
     i32 width = frame_info_.width();
@@ -141,70 +188,117 @@ class GipumaKernel : public VideoKernel {
     i32 points_output_size = width * height * sizeof(float4);
     i32 cost_output_size = width * height * sizeof(float);
 
-    i32 input_count = (i32)input_columns[0].rows.size();
-    std::vector<cvc::GpuMat> grayscale_images_gpu(num_cameras_);
-    std::vector<cv::Mat> grayscale_images(num_cameras_);
-    u8* points_output_buffer = new_block_buffer(
-        device_, points_output_size * input_count, input_count);
-    u8* cost_output_buffer =
-        new_block_buffer(device_, cost_output_size * input_count, input_count);
-    for (i32 i = 0; i < input_count; ++i) {
-      for (i32 c = 0; c < num_cameras_; ++c) {
-        auto& frame_column = input_columns[c * 3];
-        cvc::GpuMat frame_input(frame_info_.height(), frame_info_.width(),
-                                CV_8UC3, frame_column.rows[i].buffer);
-        assert(frame_column.rows[i].size == width * height * 3);
-
-        grayscale_images[c] =
-            cv::Mat(frame_info_.height(), frame_info_.width(), CV_8UC3);
-        frame_input.download(grayscale_images[c]);
-        cv::cvtColor(grayscale_images[c], grayscale_images[c], CV_BGR2GRAY, 0);
-        grayscale_images[c].convertTo(grayscale_images[c], CV_32FC1);
+    i32 input_count = num_rows(input_columns[0]);
+    points_output_ = new_block_buffer(
+        devices_[0], points_output_size * input_count, input_count);
+    cost_output_ = new_block_buffer(
+        devices_[0], cost_output_size * input_count, input_count);
+
+    // Rows of the batch are spread over the devices, with a thread driving
+    // each device through its share
+    if (gipuma_.size() == 1) {
+      execute_rows(gipuma_[0], input_columns, 0, 1);
+    } else {
+      std::vector<std::thread> threads;
+      for (size_t d = 0; d < gipuma_.size(); ++d) {
+        threads.emplace_back([&, d]() {
+          execute_rows(gipuma_[d], input_columns, d, gipuma_.size());
+        });
+      }
+      for (std::thread& t : threads) {
+        t.join();
       }
+    }
+
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_element(output_columns[0], points_output_ + points_output_size * i,
+                     points_output_size);
+      insert_element(output_columns[1], cost_output_ + cost_output_size * i,
+                     cost_output_size);
+    }
+  }
 
-      addImageToTextureFloatGray(grayscale_images, state_->imgs,
-                                 state_->cuArray);
+  void execute_rows(GipumaDevice& g, const BatchedColumns& input_columns,
+                    i32 first, i32 step) {
+    i32 width = frame_info_.width();
+    i32 height = frame_info_.height();
+    i32 points_output_size = width * height * sizeof(float4);
+    i32 cost_output_size = width * height * sizeof(float);
+    GlobalState* state = g.state.get();
 
-      runcuda(*state_.get());
+    i32 input_count = num_rows(input_columns[0]);
+    for (i32 i = first; i < input_count; i += step) {
+      set_device(devices_[0]);
+      for (i32 c = 0; c < num_cameras_; ++c) {
+        cvc::GpuMat frame_input =
+            frame_to_gpu_mat(input_columns[c * 3][i].as_const_frame());
+        cvc::cvtColor(frame_input, g.gray_u8[c], CV_BGR2GRAY, 0, g.stream);
+        g.gray_u8[c].convertTo(g.gray[c], CV_32FC1, g.stream);
+      }
+      g.stream.waitForCompletion();
+
+      set_device(g.device);
+      if (!g.textures) {
+        // The arrays and their textures are made once per resolution
+        std::vector<cv::Mat> grayscale_images(num_cameras_);
+        for (i32 c = 0; c < num_cameras_; ++c) {
+          g.gray[c].download(grayscale_images[c]);
+        }
+        addImageToTextureFloatGray(grayscale_images, state->imgs,
+                                   state->cuArray);
+        g.textures = true;
+      } else {
+        for (i32 c = 0; c < num_cameras_; ++c) {
+          CU_CHECK(cudaMemcpy2DToArray(
+              state->cuArray[c], 0, 0, g.gray[c].data, g.gray[c].step,
+              width * sizeof(float), height, cudaMemcpyDefault));
+        }
+      }
 
-      // Copy estiamted points to output buffer
-      cudaMemcpy(points_output_buffer + points_output_size * i,
-                 state_->lines->norm4, points_output_size, cudaMemcpyDefault);
-      insert_element(output_columns[0],
-                     points_output_buffer + points_output_size * i,
-                     points_output_size);
+      runcuda(*state);
 
-      // Copy costs to output buffer
-      cudaMemcpy(cost_output_buffer + cost_output_size * i, state_->lines->c,
-                 cost_output_size, cudaMemcpyDefault);
-      insert_element(output_columns[1],
-                     cost_output_buffer + cost_output_size * i,
-                     cost_output_size);
+      // Copy estimated points and costs to the output buffers
+      CU_CHECK(cudaMemcpy(points_output_ + points_output_size * i,
+                          state->lines->norm4, points_output_size,
+                          cudaMemcpyDefault));
+      CU_CHECK(cudaMemcpy(cost_output_ + cost_output_size * i,
+                          state->lines->c, cost_output_size,
+                          cudaMemcpyDefault));
+    }
+  }
 
-      delTexture(algo_params_->num_img_processed, state_->imgs,
-                 state_->cuArray);
+  void release_textures(GipumaDevice& g) {
+    if (g.textures) {
+      set_device(g.device);
+      delTexture(g.params->num_img_processed, g.state->imgs,
+                 g.state->cuArray);
+      g.textures = false;
     }
   }
 
-  void set_device() {
-    cudaSetDevice(device_.id);
-    cvc::setDevice(device_.id);
+  void set_device(DeviceHandle device) {
+    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device.id)); });
+    cvc::setDevice(device.id);
   }
 
  private:
-  DeviceHandle device_;
+  std::vector<DeviceHandle> devices_;
   proto::Result valid_;
   proto::GipumaArgs args_;
-  CameraParameters camera_params_;
-  AlgorithmParameters* algo_params_;
-  std::unique_ptr<GlobalState> state_;
+  std::vector<GipumaDevice> gipuma_;
   i32 num_cameras_;
   bool was_reset_;
+  u8* points_output_;
+  u8* cost_output_;
 };
 
 REGISTER_OP(Gipuma).variadic_inputs().outputs({"points", "cost"});
 
-REGISTER_KERNEL(Gipuma, GipumaKernel).device(DeviceType::GPU).num_devices(1);
+// Any number of GPUs, each taking a share of the rows of a batch
+REGISTER_KERNEL(Gipuma, GipumaKernel)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(Kernel::UnlimitedDevices);
 }
 
 // {
@@ -0,0 +1,59 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "scanner/util/common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace scanner {
+
+//! Widths of the box filters a Blur applies in turn. Without a sigma it is a
+//! single box of kernel_size. With one, it is the three boxes that together
+//! approximate a Gaussian of that sigma, as in Kovesi's "Fast Almost-Gaussian
+//! Filtering", each at most kernel_size wide. Boxes of width one are left
+//! out since they do not change the image.
+inline std::vector<i32> blur_box_widths(i32 kernel_size, f32 sigma) {
+  std::vector<i32> widths;
+  if (sigma <= 0) {
+    if (kernel_size > 1) {
+      widths.push_back(kernel_size);
+    }
+    return widths;
+  }
+  const i32 n = 3;
+  f64 variance = 12.0 * sigma * sigma;
+  i32 lower = (i32)std::floor(std::sqrt(variance / n + 1));
+  if (lower % 2 == 0) {
+    lower--;
+  }
+  i32 num_lower = (i32)std::round((variance - n * lower * lower -
+                                   4 * n * lower - 3 * n) /
+                                  (-4.0 * lower - 4));
+  for (i32 i = 0; i < n; ++i) {
+    i32 width = i < num_lower ? lower : lower + 2;
+    if (kernel_size > 0) {
+      width = std::min(width, kernel_size);
+    }
+    if (width > 1) {
+      widths.push_back(width);
+    }
+  }
+  return widths;
+}
+}
@@ -13,18 +13,100 @@
  * limitations under the License.
  */
 
-#include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
+#include "scanner/api/typed_kernel.h"
 #include "scanner/util/memory.h"
+#include "stdlib/imgproc/blur.h"
 #include "stdlib/stdlib.pb.h"
 
-#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace scanner {
+namespace {
+// Adds add[i] - sub[i] to sums[i] for the n values of a row, 16 at a time
+inline void add_row_difference(i32* sums, const u8* add, const u8* sub,
+                               i32 n) {
+  i32 i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(add + i));
+    __m128i s = _mm_loadu_si128((const __m128i*)(sub + i));
+    // Differences of bytes fit in 16 bits and are sign extended to 32
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero),
+                               _mm_unpacklo_epi8(s, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero),
+                               _mm_unpackhi_epi8(s, zero));
+    __m128i d[4] = {_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16),
+                    _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16),
+                    _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16),
+                    _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)};
+    for (i32 j = 0; j < 4; ++j) {
+      __m128i* p = (__m128i*)(sums + i + 4 * j);
+      _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), d[j]));
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    sums[i] += (i32)add[i] - (i32)sub[i];
+  }
+}
 
-class BlurKernel : public Kernel, public VideoKernel {
+// Blurs the interleaved RGB image src into dst with a box of left + 1 + right
+// pixels on each side. The sums of the columns of the box are updated from
+// one row to the next, across all channels of the row at once, and the sum
+// of the box from one pixel to the next, so each pixel costs the same for
+// any box size. Pixels past the edges repeat the edge pixels.
+void box_blur(const u8* src, u8* dst, i32 width, i32 height, i32 left,
+              i32 right) {
+  i32 stride = width * 3;
+  auto row = [&](i32 y) {
+    return src + std::min(std::max(y, 0), height - 1) * stride;
+  };
+  auto column = [&](i32 x) { return std::min(std::max(x, 0), width - 1) * 3; };
+
+  std::vector<i32> sums(stride, 0);
+  std::vector<u8> zeros(stride, 0);
+  for (i32 y = -left; y <= right; ++y) {
+    add_row_difference(sums.data(), row(y), zeros.data(), stride);
+  }
+  f32 scale = 1.0f / ((left + 1 + right) * (left + 1 + right));
+  for (i32 y = 0; y < height; ++y) {
+    if (y > 0) {
+      add_row_difference(sums.data(), row(y + right), row(y - left - 1),
+                         stride);
+    }
+    i32 box[3] = {0, 0, 0};
+    for (i32 x = -left; x <= right; ++x) {
+      for (i32 c = 0; c < 3; ++c) {
+        box[c] += sums[column(x) + c];
+      }
+    }
+    u8* out = dst + y * stride;
+    for (i32 x = 0; x < width; ++x) {
+      if (x > 0) {
+        i32 added = column(x + right);
+        i32 removed = column(x - left - 1);
+        for (i32 c = 0; c < 3; ++c) {
+          box[c] += sums[added + c] - sums[removed + c];
+        }
+      }
+      for (i32 c = 0; c < 3; ++c) {
+        out[x * 3 + c] = (u8)(box[c] * scale + 0.5f);
+      }
+    }
+  }
+}
+}
+
+class BlurKernel : public TypedKernel<BlurKernel, Inputs<FrameIn>,
+                                      Outputs<FrameOut>> {
  public:
-  BlurKernel(const KernelConfig& config) : Kernel(config) {
+  BlurKernel(const KernelConfig& config) : TypedKernel(config) {
     scanner::proto::BlurArgs args;
     bool parsed = args.ParseFromArray(config.args.data(), config.args.size());
     if (!parsed || config.args.size() == 0) {
@@ -32,65 +114,52 @@ class BlurKernel : public Kernel, public VideoKernel {
       return;
     }
 
-    kernel_size_ = args.kernel_size();
-    sigma_ = args.sigma();
-
-    filter_left_ = std::ceil(kernel_size_ / 2.0) - 1;
-    filter_right_ = kernel_size_ / 2;
+    box_widths_ = blur_box_widths(args.kernel_size(), args.sigma());
 
     valid_.set_success(true);
   }
 
   void validate(Result* result) override { result->CopyFrom(valid_); }
 
-  void new_frame_info() {
-    frame_width_ = frame_info_.width();
-    frame_height_ = frame_info_.height();
-  }
+  // Rows are blurred concurrently, so the frame size is read from each frame
+  // instead of being kept in the kernel
+  void execute_row(const Frame* frame, Frame*& output_frame) {
+    FrameInfo info = frame->as_frame_info();
+    i32 width = info.width();
+    i32 height = info.height();
+    output_frame = new_frame(CPU_DEVICE, info);
 
-  void execute(const Columns& input_columns,
-               Columns& output_columns) override {
-    auto& frame_col = input_columns[0];
-    check_frame(CPU_DEVICE, frame_col);
-
-    i32 width = frame_width_;
-    i32 height = frame_height_;
-    size_t frame_size = width * height * 3 * sizeof(u8);
-    FrameInfo info = frame_col.as_const_frame()->as_frame_info();
-    Frame* output_frame = new_frame(CPU_DEVICE, info);
-
-    const u8* frame_buffer = frame_col.as_const_frame()->data;
-    u8* blurred_buffer = output_frame->data;
-    for (i32 y = filter_left_; y < height - filter_right_; ++y) {
-      for (i32 x = filter_left_; x < width - filter_right_; ++x) {
-        for (i32 c = 0; c < 3; ++c) {
-          u32 value = 0;
-          for (i32 ry = -filter_left_; ry < filter_right_ + 1; ++ry) {
-            for (i32 rx = -filter_left_; rx < filter_right_ + 1; ++rx) {
-              value += frame_buffer[(y + ry) * width * 3 + (x + rx) * 3 + c];
-            }
-          }
-          blurred_buffer[y * width * 3 + x * 3 + c] =
-              value / ((filter_right_ + filter_left_ + 1) *
-                       (filter_right_ + filter_left_ + 1));
-        }
-      }
+    if (box_widths_.empty()) {
+      std::memcpy(output_frame->data, frame->data, frame->size());
+      return;
+    }
+
+    // Passes alternate between the output and a scratch image so that the
+    // last one writes the output
+    std::vector<u8> scratch;
+    if (box_widths_.size() > 1) {
+      scratch.resize(frame->size());
+    }
+    const u8* src = frame->data;
+    for (size_t i = 0; i < box_widths_.size(); ++i) {
+      u8* dst = (box_widths_.size() - 1 - i) % 2 == 0 ? output_frame->data
+                                                      : scratch.data();
+      i32 w = box_widths_[i];
+      box_blur(src, dst, width, height, (i32)std::ceil(w / 2.0) - 1, w / 2);
+      src = dst;
     }
-    insert_frame(output_columns[0], output_frame);
   }
 
  private:
-  i32 kernel_size_;
-  i32 filter_left_;
-  i32 filter_right_;
-  f64 sigma_;
+  std::vector<i32> box_widths_;
 
-  i32 frame_width_;
-  i32 frame_height_;
   Result valid_;
 };
 
 REGISTER_OP(Blur).frame_input("frame").frame_output("frame");
 
-REGISTER_KERNEL(Blur, BlurKernel).device(DeviceType::CPU).num_devices(1);
+REGISTER_KERNEL(Blur, BlurKernel)
+    .device(DeviceType::CPU)
+    .num_devices(1)
+    .parallel();
 }
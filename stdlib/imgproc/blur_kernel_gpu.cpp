@@ -0,0 +1,127 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/opencv.h"
+#include "stdlib/imgproc/blur.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <opencv2/core/cuda_stream_accessor.hpp>
+#include <opencv2/cudafilters.hpp>
+#include <opencv2/cudaimgproc.hpp>
+
+namespace scanner {
+
+class BlurKernelGPU : public BatchedKernel {
+ public:
+  BlurKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config),
+      device_(config.devices[0]),
+      stream_(config.stream) {
+    scanner::proto::BlurArgs args;
+    bool parsed = args.ParseFromArray(config.args.data(), config.args.size());
+    if (!parsed || config.args.size() == 0) {
+      RESULT_ERROR(&valid_, "Could not parse BlurArgs");
+      return;
+    }
+
+    set_device();
+    // On the device of the kernel
+    cv_stream_ = cvc::Stream();
+    CU_CHECK(cudaEventCreateWithFlags(&joined_, cudaEventDisableTiming));
+    // The CUDA box filters only take one or four channels, so the frames
+    // are filtered as RGBA
+    for (i32 w : blur_box_widths(args.kernel_size(), args.sigma())) {
+      i32 left = (i32)std::ceil(w / 2.0) - 1;
+      cv::Point anchor(left, left);
+      filters_.push_back(cvc::createBoxFilter(CV_8UC4, CV_8UC4, cv::Size(w, w),
+                                              anchor, cv::BORDER_REPLICATE));
+    }
+
+    valid_.set_success(true);
+  }
+
+  ~BlurKernelGPU() {
+    if (valid_.success()) {
+      cudaEventDestroy(joined_);
+    }
+  }
+
+  void validate(Result* result) override { result->CopyFrom(valid_); }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    set_device();
+
+    FrameInfo info = frame_col[0].as_const_frame()->as_frame_info();
+    i32 input_count = num_rows(frame_col);
+    std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
+
+    // The frames are blurred on cv_stream_, ordered after the engine's
+    // stream for the kernel and back. The RGBA images are reused for every
+    // frame, which the single stream keeps in order.
+    cudaStream_t cv_stream = cvc::StreamAccessor::getStream(cv_stream_);
+    if (stream_ != nullptr) {
+      stream_wait_stream(cv_stream, stream_, joined_);
+    }
+    for (i32 i = 0; i < input_count; ++i) {
+      cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
+      cvc::GpuMat out = frame_to_gpu_mat(output_frames[i]);
+      if (filters_.empty()) {
+        img.copyTo(out, cv_stream_);
+      } else {
+        cvc::cvtColor(img, rgba_[0], CV_RGB2RGBA, 0, cv_stream_);
+        i32 current = 0;
+        for (auto& filter : filters_) {
+          filter->apply(rgba_[current], rgba_[1 - current], cv_stream_);
+          current = 1 - current;
+        }
+        cvc::cvtColor(rgba_[current], out, CV_RGBA2RGB, 0, cv_stream_);
+      }
+      insert_frame(output_columns[0], output_frames[i]);
+    }
+
+    if (stream_ != nullptr) {
+      stream_wait_stream(stream_, cv_stream, joined_);
+    } else {
+      cv_stream_.waitForCompletion();
+    }
+  }
+
+  void set_device() {
+    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
+    cvc::setDevice(device_.id);
+  }
+
+ private:
+  DeviceHandle device_;
+  cudaStream_t stream_;
+  cvc::Stream cv_stream_;
+  cudaEvent_t joined_;
+  std::vector<cv::Ptr<cvc::Filter>> filters_;
+  cvc::GpuMat rgba_[2];
+
+  Result valid_;
+};
+
+REGISTER_KERNEL(Blur, BlurKernelGPU)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
+}
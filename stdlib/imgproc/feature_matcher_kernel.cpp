@@ -37,20 +37,18 @@ class FeatureMatcherKernel : public StenciledKernel, public VideoKernel {
     set_device();
 
     matcher_ = cvc::DescriptorMatcher::createBFMatcher();
-    features_suffix_.resize(C_.w);
-    kps_suffix_.resize(C_.w);
+    streams_.resize(NUM_STREAMS);
   }
 
   void new_frame_info() override {
     set_device();
 
     C_ = Constants(frame_info_.width(), frame_info_.height(), 0);
-    features_suffix_.clear();
-    kps_suffix_.clear();
-    features_suffix_.resize(C_.w);
-    kps_suffix_.resize(C_.w);
+    last_row_ = -1;
   }
 
+  void reset() override { last_row_ = -1; }
+
   void set_device() {
     CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
     cvc::setDevice(device_.id);
@@ -68,21 +66,48 @@ protected:
 
     i32 window_size = features_col.size();
 
-    std::vector<cvc::GpuMat> features;
-    std::vector<std::vector<proto::Keypoint>> kps;
+    // Each row pairs its frame with the rest of its window, so the pairs of
+    // consecutive rows differ but their windows overlap in all frames but
+    // one. The keypoints and descriptors of the frames still in the window
+    // are kept instead of downloaded and parsed again.
+    i64 row = rows_.empty() ? -1 : rows_[0];
+    i32 cached = 0;
+    if (last_row_ >= 0 && row == last_row_ + 1 &&
+        (i32)window_buffers_.size() == window_size) {
+      cached = window_size - 1;
+      for (i32 i = 0; i < cached; ++i) {
+        if (features_col[i].buffer != window_buffers_[i + 1] ||
+            keypoints_col[i].buffer != window_kp_buffers_[i + 1]) {
+          cached = 0;
+          break;
+        }
+      }
+    }
+    if (cached > 0) {
+      window_kps_.erase(window_kps_.begin());
+      window_features_.erase(window_features_.begin());
+      window_buffers_.erase(window_buffers_.begin());
+      window_kp_buffers_.erase(window_kp_buffers_.begin());
+    } else {
+      window_kps_.clear();
+      window_features_.clear();
+      window_buffers_.clear();
+      window_kp_buffers_.clear();
+    }
+    last_row_ = row;
 
-    for (i32 i = 0; i < window_size; ++i) {
+    for (i32 i = cached; i < window_size; ++i) {
       size_t size = keypoints_col[i].size;
       u8* buf = new_buffer(CPU_DEVICE, size);
       memcpy_buffer(buf, CPU_DEVICE, keypoints_col[i].buffer, device_,
                     size);
       std::vector<proto::Keypoint> kp =
         deserialize_proto_vector<proto::Keypoint>(buf, size);
-      kps.push_back(kp);
+      delete_buffer(CPU_DEVICE, buf);
 
       size = features_col[i].size;
       if (kp.size() == 0) {
-        features.push_back(cvc::GpuMat());
+        window_features_.push_back(cvc::GpuMat());
       } else {
         i32 step = size / kp.size();
         i32 cols;
@@ -92,21 +117,36 @@ protected:
           cols = step / (sizeof(f32) * 2);
         }
         LOG_IF(FATAL, cols != 64) << "Not 64 cols: " << cols;
-        features.push_back(cvc::GpuMat(kp.size(), cols, CV_32F,
-                                       features_col[i].buffer, step));
+        window_features_.push_back(cvc::GpuMat(kp.size(), cols, CV_32F,
+                                               features_col[i].buffer, step));
       }
+      window_kps_.push_back(std::move(kp));
+      window_buffers_.push_back(features_col[i].buffer);
+      window_kp_buffers_.push_back(keypoints_col[i].buffer);
     }
+    std::vector<cvc::GpuMat>& features = window_features_;
+    std::vector<std::vector<proto::Keypoint>>& kps = window_kps_;
 
     size_t size = window_size * sizeof(f32);
     f32* cost_buf = (f32*)new_buffer(CPU_DEVICE, size);
 
+    // The pairs are matched on several streams at once
+    std::vector<cvc::GpuMat> gpu_matches(window_size);
+    for (i32 j = 1; j < window_size; j++) {
+      if (kps[0].size() == 0 || kps[j].size() == 0) {
+        continue;
+      }
+      matcher_->matchAsync(features[0], features[j], gpu_matches[j],
+                           streams_[j % NUM_STREAMS]);
+    }
     std::vector<std::vector<cv::DMatch>> matches;
     matches.resize(window_size);
     for (i32 j = 1; j < window_size; j++) {
       if (kps[0].size() == 0 || kps[j].size() == 0) {
         continue;
       }
-      matcher_->match(features[0], features[j], matches[j]);
+      streams_[j % NUM_STREAMS].waitForCompletion();
+      matcher_->matchConvert(gpu_matches[j], matches[j]);
     }
 
 #pragma omp parallel for
@@ -202,8 +242,15 @@ protected:
   DeviceHandle device_;
   Constants C_;
   cv::Ptr<cvc::DescriptorMatcher> matcher_;
-  std::vector<cvc::GpuMat> features_suffix_;
-  std::vector<std::vector<proto::Keypoint>> kps_suffix_;
+  static const i32 NUM_STREAMS = 4;
+  std::vector<cvc::Stream> streams_;
+  // Row of the last window, or -1, and per frame of the window -> keypoints,
+  // descriptors and the elements they were read from
+  i64 last_row_ = -1;
+  std::vector<std::vector<proto::Keypoint>> window_kps_;
+  std::vector<cvc::GpuMat> window_features_;
+  std::vector<const u8*> window_buffers_;
+  std::vector<const u8*> window_kp_buffers_;
 };
 
 REGISTER_OP(FeatureMatcher)
@@ -1,11 +1,63 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/memory.h"
-#include "scanner/util/opencv.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace scanner {
 namespace {
 const i32 BINS = 16;
+// 256 values spread over BINS bins
+const i32 BIN_SHIFT = 4;
+// Consecutive pixels count into different copies of the histogram, so that
+// increments of the same bin do not wait on each other's stores
+const i32 SUB_HISTOGRAMS = 4;
+
+// Counts the bins of the num_pixels interleaved RGB pixels of data into
+// hist, BINS per channel, in one pass over the frame
+void rgb_histogram(const u8* data, i64 num_pixels, i32* hist) {
+  u32 sub[SUB_HISTOGRAMS][3][BINS];
+  std::memset(sub, 0, sizeof(sub));
+  i64 p = 0;
+#if defined(__SSE2__)
+  // The bins of 16 pixels are computed 16 bytes at a time
+  const __m128i mask = _mm_set1_epi8(BINS - 1);
+  alignas(16) u8 bins[48];
+  for (; p + 16 <= num_pixels; p += 16) {
+    for (i32 j = 0; j < 3; ++j) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(data + p * 3 + j * 16));
+      _mm_store_si128((__m128i*)(bins + j * 16),
+                      _mm_and_si128(_mm_srli_epi16(v, BIN_SHIFT), mask));
+    }
+    for (i32 i = 0; i < 16; ++i) {
+      u32(&h)[3][BINS] = sub[i % SUB_HISTOGRAMS];
+      h[0][bins[i * 3]]++;
+      h[1][bins[i * 3 + 1]]++;
+      h[2][bins[i * 3 + 2]]++;
+    }
+  }
+#endif
+  for (; p < num_pixels; ++p) {
+    u32(&h)[3][BINS] = sub[p % SUB_HISTOGRAMS];
+    const u8* pixel = data + p * 3;
+    h[0][pixel[0] >> BIN_SHIFT]++;
+    h[1][pixel[1] >> BIN_SHIFT]++;
+    h[2][pixel[2] >> BIN_SHIFT]++;
+  }
+  for (i32 c = 0; c < 3; ++c) {
+    for (i32 b = 0; b < BINS; ++b) {
+      u32 count = 0;
+      for (i32 s = 0; s < SUB_HISTOGRAMS; ++s) {
+        count += sub[s][c][b];
+      }
+      hist[c * BINS + b] = count;
+    }
+  }
+}
 }
 
 class HistogramKernelCPU : public BatchedKernel {
@@ -22,24 +74,17 @@ class HistogramKernelCPU : public BatchedKernel {
     u8* output_block =
         new_block_buffer(device_, hist_size * input_count, input_count);
 
+    // Frames of the batch are counted on their own threads
+#pragma omp parallel for
     for (i32 i = 0; i < input_count; ++i) {
-      cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-
-      float range[] = {0, 256};
-      const float* histRange = {range};
-
-      u8* output_buf = output_block + i * hist_size;
-
-      for (i32 j = 0; j < 3; ++j) {
-        int channels[] = {j};
-        cv::Mat out(BINS, 1, CV_32S, output_buf + j * BINS * sizeof(int));
-        cv::calcHist(&img, 1, channels, cv::Mat(),
-                     out,
-                     1, &BINS,
-                     &histRange);
-      }
+      const Frame* frame = frame_col[i].as_const_frame();
+      rgb_histogram(frame->data, (i64)frame->width() * frame->height(),
+                    (i32*)(output_block + i * hist_size));
+    }
 
-      insert_element(output_columns[0], output_buf, hist_size);
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_element(output_columns[0], output_block + i * hist_size,
+                     hist_size);
     }
   }
 
@@ -47,7 +92,9 @@ class HistogramKernelCPU : public BatchedKernel {
   DeviceHandle device_;
 };
 
-REGISTER_OP(Histogram).frame_input("frame").output("histogram");
+REGISTER_OP(Histogram)
+    .frame_input("frame")
+    .tensor_output("histogram", Column::INT32, {3, BINS});
 
 REGISTER_KERNEL(Histogram, HistogramKernelCPU)
     .device(DeviceType::CPU)
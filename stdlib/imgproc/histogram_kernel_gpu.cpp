@@ -4,6 +4,8 @@
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
 
+#include <opencv2/core/cuda_stream_accessor.hpp>
+
 namespace scanner {
 namespace {
 const i32 BINS = 16;
@@ -14,13 +16,17 @@ class HistogramKernelGPU : public BatchedKernel, public VideoKernel {
   HistogramKernelGPU(const KernelConfig& config)
     : BatchedKernel(config),
       device_(config.devices[0]),
-      num_cuda_streams_(32),
-      streams_(num_cuda_streams_) {}
+      stream_(config.stream) {
+    set_device();
+    // On the device of the kernel
+    cv_stream_ = cvc::Stream();
+    CU_CHECK(cudaEventCreateWithFlags(&joined_, cudaEventDisableTiming));
+  }
+
+  ~HistogramKernelGPU() { cudaEventDestroy(joined_); }
 
   void new_frame_info() override {
     set_device();
-    streams_.resize(0);
-    streams_.resize(num_cuda_streams_);
     planes_.clear();
     for (i32 i = 0; i < 3; ++i) {
       planes_.push_back(
@@ -40,27 +46,32 @@ class HistogramKernelGPU : public BatchedKernel, public VideoKernel {
     u8* output_block =
         new_block_buffer(device_, hist_size * input_count, input_count);
 
+    // The histograms are queued on cv_stream_, ordered after the engine's
+    // stream for the kernel and back. The planes are reused for every
+    // frame, which the single stream keeps in order.
+    cudaStream_t cv_stream = cvc::StreamAccessor::getStream(cv_stream_);
+    if (stream_ != nullptr) {
+      stream_wait_stream(cv_stream, stream_, joined_);
+    }
     for (i32 i = 0; i < input_count; ++i) {
-      i32 sid = i % num_cuda_streams_;
-      cv::cuda::Stream& s = streams_[sid];
-
-      // TODO(wcrichto): implement correctly w/ streams
       cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
-      cvc::split(img, planes_);
+      cvc::split(img, planes_, cv_stream_);
 
       u8* output_buf = output_block + i * hist_size;
       cvc::GpuMat out_mat(1, BINS * 3, CV_32S, output_buf);
 
       for (i32 j = 0; j < 3; ++j) {
         cvc::histEven(planes_[j], out_mat(cv::Rect(j * BINS, 0, BINS, 1)), BINS,
-                      0, 256);
+                      0, 256, cv_stream_);
       }
 
       insert_element(output_columns[0], output_buf, hist_size);
     }
 
-    for (cv::cuda::Stream& s : streams_) {
-      s.waitForCompletion();
+    if (stream_ != nullptr) {
+      stream_wait_stream(stream_, cv_stream, joined_);
+    } else {
+      cv_stream_.waitForCompletion();
     }
   }
 
@@ -71,8 +82,9 @@ class HistogramKernelGPU : public BatchedKernel, public VideoKernel {
 
  private:
   DeviceHandle device_;
-  i32 num_cuda_streams_;
-  std::vector<cv::cuda::Stream> streams_;
+  cudaStream_t stream_;
+  cvc::Stream cv_stream_;
+  cudaEvent_t joined_;
   std::vector<cvc::GpuMat> planes_;
 };
 
@@ -4,6 +4,10 @@
 #include "scanner/util/opencv.h"
 #include "stdlib/stdlib.pb.h"
 
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
 namespace scanner {
 
 class ImageDecoderKernelCPU : public BatchedKernel {
@@ -12,18 +16,65 @@ class ImageDecoderKernelCPU : public BatchedKernel {
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
-    i32 input_count = num_rows(input_columns[0]);
+    auto& img_col = input_columns[0];
+    i32 input_count = num_rows(img_col);
+
+    // Frames are allocated on this thread, so JPEGs are sized from their
+    // headers before the images of the batch are decoded on their own
+    // threads straight into them
+    std::vector<Frame*> frames(input_count, nullptr);
+#ifdef HAVE_TURBOJPEG
+    tjhandle header_handle = tjInitDecompress();
+    for (i32 i = 0; i < input_count; ++i) {
+      i32 width, height, subsampling, colorspace;
+      if (tjDecompressHeader3(header_handle, img_col[i].buffer,
+                              img_col[i].size, &width, &height, &subsampling,
+                              &colorspace) == 0) {
+        frames[i] =
+            new_frame(CPU_DEVICE, FrameInfo(height, width, 3, FrameType::U8));
+      }
+    }
+    tjDestroy(header_handle);
+#endif
+
+    // Images libjpeg-turbo can not read go through OpenCV
+    std::vector<cv::Mat> fallback(input_count);
+#pragma omp parallel
+    {
+#ifdef HAVE_TURBOJPEG
+      tjhandle handle = tjInitDecompress();
+#endif
+#pragma omp for schedule(dynamic)
+      for (i32 i = 0; i < input_count; ++i) {
+#ifdef HAVE_TURBOJPEG
+        Frame* frame = frames[i];
+        if (frame != nullptr &&
+            tjDecompress2(handle, img_col[i].buffer, img_col[i].size,
+                          frame->data, frame->width(), 0, frame->height(),
+                          TJPF_BGR, 0) == 0) {
+          continue;
+        }
+#endif
+        cv::Mat input(1, img_col[i].size, CV_8UC1, img_col[i].buffer);
+        fallback[i] = cv::imdecode(input, CV_LOAD_IMAGE_COLOR);
+        LOG_IF(FATAL, fallback[i].empty()) << "Failed to decode image";
+      }
+#ifdef HAVE_TURBOJPEG
+      tjDestroy(handle);
+#endif
+    }
 
     for (i32 i = 0; i < input_count; ++i) {
-      std::vector<u8> input_buf(
-        input_columns[0][i].buffer,
-        input_columns[0][i].buffer + input_columns[0][i].size);
-      cv::Mat img = cv::imdecode(input_buf, CV_LOAD_IMAGE_COLOR);
-      LOG_IF(FATAL, img.empty() || !img.data) << "Failed to decode image";
-      size_t size = img.total() * img.elemSize();
-      Frame* frame = new_frame(CPU_DEVICE, mat_to_frame_info(img));
-      std::memcpy(frame->data, img.data, size);
-      insert_frame(output_columns[0], frame);
+      if (!fallback[i].empty()) {
+        if (frames[i] != nullptr) {
+          delete_buffer(CPU_DEVICE, frames[i]->data);
+          delete frames[i];
+        }
+        cv::Mat& img = fallback[i];
+        frames[i] = new_frame(CPU_DEVICE, mat_to_frame_info(img));
+        std::memcpy(frames[i]->data, img.data, img.total() * img.elemSize());
+      }
+      insert_frame(output_columns[0], frames[i]);
     }
   }
 };
@@ -32,5 +83,6 @@ REGISTER_OP(ImageDecoder).input("img").frame_output("frame");
 
 REGISTER_KERNEL(ImageDecoder, ImageDecoderKernelCPU)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -1,105 +1,115 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
-#include "scanner/util/cuda.h"
 #include "stdlib/stdlib.pb.h"
 
-namespace scanner {
-
-namespace codec = cv::cudacodec;
+#include <nvjpeg.h>
 
-class ImageSource : public codec::RawVideoSource {
-public:
-  ImageSource(const BatchedColumns& input_columns, const cv::Mat& img)
-    : input_columns_(input_columns), img_(img) {}
+namespace scanner {
 
-  bool getNextPacket(unsigned char** data, int* size, bool* endOfFile) override {
-    const Element& element = input_columns_[0][i_];
-    *data = element.buffer;
-    *size = element.size;
-    *endOfFile = false;
-    // Theoretically we should be able to set endOfFile to true at the last
-    // frame, but the OpenCV VideoReader appears to return false on a valid
-    // nextFrame request if I do this, so instead I just keep feeding packets
-    // until the loader thread dies.
-    i_ = (i_ + 1) % input_columns_[0].size();
-    return true;
+#define NVJPEG_CHECK(expr)                                   \
+  {                                                          \
+    nvjpegStatus_t status = (expr);                          \
+    LOG_IF(FATAL, status != NVJPEG_STATUS_SUCCESS)           \
+        << "nvJPEG error " << status << " in " #expr;        \
   }
 
-  codec::FormatInfo format() const override {
-    codec::FormatInfo format_info;
-    format_info.codec = codec::Codec::JPEG;
-    format_info.chromaFormat = codec::ChromaFormat::YUV420;
-    format_info.width = img_.cols;
-    format_info.height = img_.rows;
-    return format_info;
+class ImageDecoderKernelGPU : public BatchedKernel {
+ public:
+  ImageDecoderKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config),
+      device_(config.devices[0]),
+      stream_(config.stream) {
+    set_device();
+    NVJPEG_CHECK(nvjpegCreateSimple(&handle_));
+    NVJPEG_CHECK(nvjpegJpegStateCreate(handle_, &state_));
   }
 
-private:
-  int i_ = 0;
-  const cv::Mat& img_;
-  const BatchedColumns& input_columns_;
-};
-
-class ImageDecoderKernelGPU : public Kernel {
- public:
-  ImageDecoderKernelGPU(const Kernel::Config& config)
-    : Kernel(config), device_(config.devices[0]) {
-    if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
-      LOG(FATAL) << "Failed to parse args";
-    }
+  ~ImageDecoderKernelGPU() {
+    set_device();
+    nvjpegJpegStateDestroy(state_);
+    nvjpegDestroy(handle_);
   }
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
-    i32 input_count = num_rows(input_columns[0]);
+    auto& img_col = input_columns[0];
+    i32 input_count = num_rows(img_col);
 
     set_device();
 
-    // Assumes all images are the same size
-    size_t sz = input_columns[0][0].size;
-    u8* cpu_buf = new_buffer(CPU_DEVICE, sz);
-    memcpy_buffer(cpu_buf, CPU_DEVICE, input_columns[0][0].buffer,
-                  device_, sz);
-    std::vector<u8> input_buf(cpu_buf, cpu_buf + sz);
-    cv::Mat img = cv::imdecode(input_buf, CV_LOAD_IMAGE_COLOR);
-    FrameInfo frame_info(img.rows, img.cols, 3, FrameType::U8);
-    delete_buffer(CPU_DEVICE, cpu_buf);
-
-    proto::ImageDecoderArgs_ImageType image_type = args_.image_type();
-    std::vector<Frame*> frames = new_frames(device_, frame_info, input_count);
-
-    cv::Ptr<codec::RawVideoSource> src =
-      cv::Ptr<codec::RawVideoSource>(new ImageSource(input_columns, img));
-    cv::Ptr<codec::VideoReader> d_reader = codec::createVideoReader(src);
+    // nvJPEG parses the bitstreams on the host, so the encoded images, which
+    // are small next to the frames, are staged there
+    std::vector<std::vector<u8>> encoded(input_count);
+    for (i32 i = 0; i < input_count; ++i) {
+      encoded[i].resize(img_col[i].size);
+      memcpy_buffer(encoded[i].data(), CPU_DEVICE, img_col[i].buffer, device_,
+                    img_col[i].size);
+    }
 
+    // Images of the batch nvJPEG can read are decoded with one batched call,
+    // straight into their frames. The rest go through OpenCV on the host.
+    std::vector<Frame*> frames(input_count, nullptr);
+    std::vector<const u8*> batch_data;
+    std::vector<size_t> batch_sizes;
+    std::vector<nvjpegImage_t> batch_images;
     for (i32 i = 0; i < input_count; ++i) {
-      if (image_type == proto::ImageDecoderArgs_ImageType_JPEG) {
-        cvc::GpuMat gpu_mat = frame_to_gpu_mat(frames[i]);
-        if (!d_reader->nextFrame(gpu_mat)) {
-          LOG(FATAL) << "Failed to decode image";
-        }
-        insert_frame(output_columns[0], frames[i]);
-      } else if (image_type == proto::ImageDecoderArgs_ImageType_ANY) {
-        LOG(FATAL) << "Not yet supported";
+      i32 components;
+      nvjpegChromaSubsampling_t subsampling;
+      i32 widths[NVJPEG_MAX_COMPONENT];
+      i32 heights[NVJPEG_MAX_COMPONENT];
+      if (nvjpegGetImageInfo(handle_, encoded[i].data(), encoded[i].size(),
+                             &components, &subsampling, widths,
+                             heights) == NVJPEG_STATUS_SUCCESS &&
+          subsampling != NVJPEG_CSS_UNKNOWN) {
+        frames[i] = new_frame(
+            device_, FrameInfo(heights[0], widths[0], 3, FrameType::U8));
+        nvjpegImage_t image = {};
+        image.channel[0] = frames[i]->data;
+        image.pitch[0] = widths[0] * 3;
+        batch_data.push_back(encoded[i].data());
+        batch_sizes.push_back(encoded[i].size());
+        batch_images.push_back(image);
       } else {
-        LOG(FATAL) << "Invalid image type";
+        cv::Mat img = cv::imdecode(encoded[i], CV_LOAD_IMAGE_COLOR);
+        LOG_IF(FATAL, img.empty()) << "Failed to decode image";
+        frames[i] = new_frame(device_, mat_to_frame_info(img));
+        memcpy_buffer(frames[i]->data, device_, img.data, CPU_DEVICE,
+                      img.total() * img.elemSize());
       }
     }
+
+    if (!batch_data.empty()) {
+      // Interleaved BGR, the channel order of the CPU kernel
+      NVJPEG_CHECK(nvjpegDecodeBatchedInitialize(
+          handle_, state_, batch_data.size(), 1, NVJPEG_OUTPUT_BGRI));
+      NVJPEG_CHECK(nvjpegDecodeBatched(handle_, state_, batch_data.data(),
+                                       batch_sizes.data(), batch_images.data(),
+                                       stream_));
+      // The staged bitstreams are freed on return
+      CU_CHECK(cudaStreamSynchronize(stream_));
+    }
+
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_frame(output_columns[0], frames[i]);
+    }
   }
 
   void set_device() {
-    CU_CHECK(cudaSetDevice(device_.id));
-    cvc::setDevice(device_.id);
+    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
   }
 
-private:
-  proto::ImageDecoderArgs args_;
+ private:
   DeviceHandle device_;
+  cudaStream_t stream_;
+  nvjpegHandle_t handle_;
+  nvjpegJpegState_t state_;
 };
 
 REGISTER_KERNEL(ImageDecoder, ImageDecoderKernelGPU)
     .device(DeviceType::GPU)
+    .batch()
     .num_devices(1);
 }
@@ -2,12 +2,23 @@
 #include "scanner/api/op.h"
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
+#include "stdlib/stdlib.pb.h"
+
+#ifdef HAVE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
 
 namespace scanner {
 
 class ImageEncoderKernel : public BatchedKernel, public VideoKernel {
  public:
-  ImageEncoderKernel(const KernelConfig& config) : BatchedKernel(config) {}
+  ImageEncoderKernel(const KernelConfig& config) : BatchedKernel(config) {
+    proto::ImageEncoderArgs args;
+    if (!args.ParseFromArray(config.args.data(), config.args.size())) {
+      LOG(FATAL) << "Failed to parse args";
+    }
+    quality_ = args.quality() > 0 ? args.quality() : 100;
+  }
 
   void execute(const BatchedColumns& input_columns,
                BatchedColumns& output_columns) override {
@@ -16,24 +27,57 @@ class ImageEncoderKernel : public BatchedKernel, public VideoKernel {
 
     std::vector<i32> encode_params;
     encode_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-    encode_params.push_back(100);
+    encode_params.push_back(quality_);
 
+    // Frames of the batch are encoded on their own threads and copied into
+    // output buffers on this one
     i32 input_count = num_rows(frame_col);
+    std::vector<std::vector<u8>> encoded(input_count);
+#pragma omp parallel
+    {
+#ifdef HAVE_TURBOJPEG
+      tjhandle handle = tjInitCompress();
+#endif
+#pragma omp for schedule(dynamic)
+      for (i32 i = 0; i < input_count; ++i) {
+        const Frame* frame = frame_col[i].as_const_frame();
+#ifdef HAVE_TURBOJPEG
+        u8* jpeg = nullptr;
+        unsigned long jpeg_size = 0;
+        if (frame->type == FrameType::U8 && frame->channels() == 3 &&
+            tjCompress2(handle, frame->data, frame->width(), 0,
+                        frame->height(), TJPF_BGR, &jpeg, &jpeg_size,
+                        TJSAMP_420, quality_, 0) == 0) {
+          encoded[i].assign(jpeg, jpeg + jpeg_size);
+          tjFree(jpeg);
+          continue;
+        }
+        tjFree(jpeg);
+#endif
+        cv::Mat img = frame_to_mat(frame);
+        bool success = cv::imencode(".jpg", img, encoded[i], encode_params);
+        LOG_IF(FATAL, !success) << "Failed to encode image";
+      }
+#ifdef HAVE_TURBOJPEG
+      tjDestroy(handle);
+#endif
+    }
+
     for (i32 i = 0; i < input_count; ++i) {
-      cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-      std::vector<u8> buf;
-      bool success = cv::imencode(".jpg", img, buf, encode_params);
-      LOG_IF(FATAL, !success) << "Failed to encode image";
-      u8* output_buf = new_buffer(CPU_DEVICE, buf.size());
-      std::memcpy(output_buf, buf.data(), buf.size());
-      insert_element(output_columns[0], output_buf, buf.size());
+      u8* output_buf = new_buffer(CPU_DEVICE, encoded[i].size());
+      std::memcpy(output_buf, encoded[i].data(), encoded[i].size());
+      insert_element(output_columns[0], output_buf, encoded[i].size());
     }
   }
+
+ private:
+  i32 quality_;
 };
 
 REGISTER_OP(ImageEncoder).frame_input("frame").output("img");
 
 REGISTER_KERNEL(ImageEncoder, ImageEncoderKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -24,6 +24,7 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
     num_frames_ = args_.num_frames();
     target_width_ = args_.target_width();
     frames_per_row_ = args_.frames_per_row();
+    rows_per_tile_ = args_.rows_per_tile();
   }
 
   ~MontageKernelGPU() {
@@ -33,14 +34,12 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
   }
 
   void reset() {
-    if (montage_width_ != 0) {
-      montage_buffer_ =
-          new_buffer(device_, montage_width_ * montage_height_ * 3);
-      montage_image_ = cvc::GpuMat(montage_height_, montage_width_, CV_8UC3,
-                                   montage_buffer_);
-      montage_image_.setTo(0);
-      frames_seen_ = 0;
+    if (montage_buffer_ != nullptr) {
+      delete_buffer(device_, montage_buffer_);
+      montage_image_ = cvc::GpuMat();
+      montage_buffer_ = nullptr;
     }
+    frames_seen_ = 0;
   }
 
   void new_frame_info() override {
@@ -50,9 +49,13 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
 
     target_height_ = (target_width_ / (1.0 * frame_width_) * frame_height_);
 
+    // Without a tile size the whole montage is a single tile
+    i64 montage_rows = std::ceil(num_frames_ / (1.0 * frames_per_row_));
+    tile_rows_ = rows_per_tile_ > 0 ? std::min((i64)rows_per_tile_,
+                                               montage_rows)
+                                    : montage_rows;
     montage_width_ = frames_per_row_ * target_width_;
-    montage_height_ =
-        std::ceil(num_frames_ / (1.0 * frames_per_row_)) * target_height_;
+    montage_height_ = tile_rows_ * target_height_;
     reset();
   }
 
@@ -63,21 +66,33 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
 
     set_device();
 
-    assert(montage_buffer_ != nullptr);
+    i64 tile_frames = tile_rows_ * frames_per_row_;
     i32 input_count = num_rows(frame_col);
     for (i32 i = 0; i < input_count; ++i) {
+      // The buffer of a tile only lives until the tile fills, so at most one
+      // tile of the montage is held on the device at a time
+      if (montage_buffer_ == nullptr) {
+        montage_buffer_ =
+            new_buffer(device_, montage_width_ * montage_height_ * 3);
+        montage_image_ = cvc::GpuMat(montage_height_, montage_width_, CV_8UC3,
+                                     montage_buffer_);
+        montage_image_.setTo(0);
+      }
+
       cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
-      i64 x = frames_seen_ % frames_per_row_;
-      i64 y = frames_seen_ / frames_per_row_;
+      i64 tile_idx = frames_seen_ % tile_frames;
+      i64 x = tile_idx % frames_per_row_;
+      i64 y = tile_idx / frames_per_row_;
       cvc::GpuMat montage_subimg =
           montage_image_(cv::Rect(target_width_ * x, target_height_ * y,
                                   target_width_, target_height_));
       cvc::resize(img, montage_subimg, cv::Size(target_width_, target_height_));
 
       frames_seen_++;
-      if (frames_seen_ == num_frames_) {
-        assert(montage_buffer_ != nullptr);
-        FrameInfo info(montage_height_, montage_width_, 3, FrameType::U8);
+      if (tile_idx == tile_frames - 1 || frames_seen_ == num_frames_) {
+        // The last tile only covers the rows it has frames for
+        FrameInfo info((y + 1) * target_height_, montage_width_, 3,
+                       FrameType::U8);
         insert_frame(output_columns[0], new Frame(info, montage_buffer_));
         montage_image_ = cvc::GpuMat();
         montage_buffer_ = nullptr;
@@ -103,7 +118,10 @@ class MontageKernelGPU : public BatchedKernel, public VideoKernel {
   i32 target_width_;
   i32 target_height_;
   i32 frames_per_row_;
+  i32 rows_per_tile_;
+  i64 tile_rows_;
 
+  // Size of one tile
   i64 montage_width_;
   i64 montage_height_;
 
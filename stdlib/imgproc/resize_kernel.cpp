@@ -1,6 +1,8 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/cuda.h"
+#include "scanner/util/half.h"
+#include "scanner/util/image.h"
 #include "scanner/util/memory.h"
 #include "scanner/util/opencv.h"
 #include "stdlib/stdlib.pb.h"
@@ -12,6 +14,9 @@ class ResizeKernel : public BatchedKernel {
   ResizeKernel(const KernelConfig& config)
     : BatchedKernel(config), device_(config.devices[0]) {
     args_.ParseFromArray(config.args.data(), config.args.size());
+#ifdef HAVE_CUDA
+    stream_ = config.stream;
+#endif
   }
 
   void execute(const BatchedColumns& input_columns,
@@ -41,25 +46,73 @@ class ResizeKernel : public BatchedKernel {
     }
 
     i32 input_count = num_rows(frame_col);
-    FrameInfo info(target_height, target_width, 3, FrameType::U8);
+    // Frames keep their type, so that F16 frames stay half as large
+    FrameInfo info(target_height, target_width, 3, frame->type);
     std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
 
-    for (i32 i = 0; i < input_count; ++i) {
-      if (device_.type == DeviceType::CPU) {
-        cv::Mat img = frame_to_mat(frame_col[i].as_const_frame());
-        cv::Mat out_mat = frame_to_mat(output_frames[i]);
-        cv::resize(img, out_mat, cv::Size(target_width, target_height));
-      } else {
-        CUDA_PROTECT({
-          cvc::GpuMat img = frame_to_gpu_mat(frame_col[i].as_const_frame());
-          cvc::GpuMat out_mat = frame_to_gpu_mat(output_frames[i]);
-          cvc::resize(img, out_mat, cv::Size(target_width, target_height));
-        });
+    if (device_.type == DeviceType::CPU) {
+      for (i32 i = 0; i < input_count; ++i) {
+        const Frame* input = frame_col[i].as_const_frame();
+        if (input->type == FrameType::F16) {
+          resize_half(input, output_frames[i]);
+        } else {
+          cv::Mat img = frame_to_mat(input);
+          cv::Mat out_mat = frame_to_mat(output_frames[i]);
+          cv::resize(img, out_mat, cv::Size(target_width, target_height));
+        }
+        insert_frame(output_columns[0], output_frames[i]);
+      }
+      return;
+    }
+
+    LOG_IF(FATAL, frame->type != FrameType::U8)
+        << "Resize on the GPU only supports U8 frames";
+
+    // On the GPU the frames are resized straight into the output block, a
+    // launch for each run of frames of the same size instead of one per
+    // frame. The launches are queued on the engine's stream for the kernel,
+    // so that the engine can queue the next batch before this one is done.
+    CUDA_PROTECT({
+      std::vector<const u8*> sources(input_count);
+      for (i32 i = 0; i < input_count; ++i) {
+        sources[i] = frame_col[i].as_const_frame()->data;
       }
+      i32 start = 0;
+      while (start < input_count) {
+        const Frame* first = frame_col[start].as_const_frame();
+        i32 end = start + 1;
+        while (end < input_count &&
+               frame_col[end].as_const_frame()->width() == first->width() &&
+               frame_col[end].as_const_frame()->height() == first->height()) {
+          end++;
+        }
+        CU_CHECK(resizeRGBBatch(sources.data() + start, end - start,
+                                first->width() * 3, first->width(),
+                                first->height(), output_frames[start]->data,
+                                target_width, target_height, stream_));
+        start = end;
+      }
+      if (stream_ == nullptr) {
+        CU_CHECK(cudaStreamSynchronize(0));
+      }
+    });
+    for (i32 i = 0; i < input_count; ++i) {
       insert_frame(output_columns[0], output_frames[i]);
     }
   }
 
+  //! OpenCV has no half precision matrices, so F16 frames are resized as
+  //! floats
+  void resize_half(const Frame* input, Frame* output) {
+    cv::Mat img(input->height(), input->width(), CV_32FC3);
+    half_to_float((const u16*)input->data, (f32*)img.data,
+                  img.total() * img.channels());
+    cv::Mat out_mat;
+    cv::resize(img, out_mat, cv::Size(output->width(), output->height()));
+    float_to_half((const f32*)out_mat.data, (u16*)output->data,
+                  out_mat.total() * out_mat.channels());
+  }
+
   void set_device() {
     if (device_.type == DeviceType::GPU) {
       CUDA_PROTECT({
@@ -72,6 +125,9 @@ class ResizeKernel : public BatchedKernel {
  private:
   DeviceHandle device_;
   proto::ResizeArgs args_;
+#ifdef HAVE_CUDA
+  cudaStream_t stream_;
+#endif
 };
 
 REGISTER_OP(Resize).frame_input("frame").frame_output("frame");
@@ -1,27 +1,17 @@
-#include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
+#include "scanner/api/typed_kernel.h"
 #include "scanner/util/memory.h"
 
 namespace scanner {
 
-class DiscardKernel : public BatchedKernel {
+// Rows of both frame and byte columns are only passed on as elements
+class DiscardKernel
+    : public TypedKernel<DiscardKernel, Inputs<BytesIn>,
+                         Outputs<TensorOut<u8, 1>>> {
  public:
-  DiscardKernel(const KernelConfig& config)
-    : BatchedKernel(config),
-      device_(config.devices[0]),
-      work_item_size_(config.work_item_size) {}
-
-  void execute(const BatchedColumns& input_columns,
-               BatchedColumns& output_columns) override {
-    i32 input_count = (i32)num_rows(input_columns[0]);
-    for (i32 i = 0; i < input_count; ++i) {
-      insert_element(output_columns[0], new_buffer(device_, 1), 1);
-    }
-  }
-
- private:
-  DeviceHandle device_;
-  i32 work_item_size_;
+  DiscardKernel(const KernelConfig& config) : TypedKernel(config) {}
+
+  void execute_row(const Element& ignore, u8* dummy) {}
 };
 
 REGISTER_OP(Discard).input("ignore").output("dummy");
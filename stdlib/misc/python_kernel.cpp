@@ -1,10 +1,12 @@
 #include "scanner/api/kernel.h"
 #include "scanner/api/op.h"
 #include "scanner/util/memory.h"
+#include "stdlib/misc/python_kernel_process.h"
 #include "stdlib/stdlib.pb.h"
 
 #include <boost/python.hpp>
 #include <boost/python/numpy.hpp>
+#include <memory>
 
 namespace scanner {
 
@@ -31,15 +33,117 @@ std::string handle_pyerror() {
   return extract<std::string>(formatted);
 }
 
+namespace {
+np::ndarray frame_to_ndarray(const Frame* frame) {
+  return np::from_data(
+      frame->data, np::dtype::get_builtin<uint8_t>(),
+      py::make_tuple(frame->height(), frame->width(), frame->channels()),
+      py::make_tuple(frame->width() * frame->channels(), frame->channels(), 1),
+      py::object());
+}
+
+// Stacks the frames of a column into one (rows, height, width, channels)
+// array. Frames that sit back to back in one block, as decoded frames do,
+// are wrapped in place. Otherwise they are copied once into a new array.
+np::ndarray frames_to_ndarray(const ElementList& column) {
+  const Frame* first = column[0].as_const_frame();
+  size_t frame_size = first->size();
+  bool contiguous = true;
+  for (size_t i = 1; i < column.size(); ++i) {
+    const Frame* frame = column[i].as_const_frame();
+    LOG_IF(FATAL, frame->as_frame_info() != first->as_frame_info())
+        << "Frames of a batch must have the same shape";
+    contiguous = contiguous && frame->data == first->data + i * frame_size;
+  }
+  py::tuple shape = py::make_tuple(column.size(), first->height(),
+                                   first->width(), first->channels());
+  np::dtype dtype = np::dtype::get_builtin<uint8_t>();
+  if (contiguous) {
+    return np::from_data(
+        first->data, dtype, shape,
+        py::make_tuple(frame_size, first->width() * first->channels(),
+                       first->channels(), 1),
+        py::object());
+  }
+  np::ndarray stacked = np::empty(shape, dtype);
+  for (size_t i = 0; i < column.size(); ++i) {
+    std::memcpy(stacked.get_data() + i * frame_size,
+                column[i].as_const_frame()->data, frame_size);
+  }
+  return stacked;
+}
+
+// Copies the bytes of a str, or any object with the buffer protocol such as
+// an ndarray, into a new buffer
+void insert_pyobject(ElementList& column, DeviceHandle device,
+                     py::object obj) {
+  Py_buffer view;
+  if (PyObject_GetBuffer(obj.ptr(), &view, PyBUF_C_CONTIGUOUS) != 0) {
+    PyErr_Clear();
+    obj = py::import("numpy").attr("ascontiguousarray")(obj);
+    if (PyObject_GetBuffer(obj.ptr(), &view, PyBUF_C_CONTIGUOUS) != 0) {
+      py::throw_error_already_set();
+    }
+  }
+  u8* buf = new_buffer(device, view.len);
+  memcpy_buffer(buf, device, (const u8*)view.buf, CPU_DEVICE, view.len);
+  PyBuffer_Release(&view);
+  insert_element(column, buf, view.len);
+}
+
+// An array with a row per input row is copied once into a block and split
+// into its rows. Any other output is a sequence of one object per row.
+void insert_batched_pyobject(ElementList& column, DeviceHandle device,
+                             i32 rows, py::object obj) {
+  py::extract<np::ndarray> as_array(obj);
+  if (as_array.check()) {
+    np::ndarray array = as_array();
+    if (array.get_nd() > 0 && array.shape(0) == rows) {
+      obj = py::import("numpy").attr("ascontiguousarray")(array);
+      Py_buffer view;
+      if (PyObject_GetBuffer(obj.ptr(), &view, PyBUF_C_CONTIGUOUS) != 0) {
+        py::throw_error_already_set();
+      }
+      size_t row_size = view.len / rows;
+      u8* block = new_block_buffer(device, view.len, rows);
+      memcpy_buffer(block, device, (const u8*)view.buf, CPU_DEVICE, view.len);
+      PyBuffer_Release(&view);
+      for (i32 i = 0; i < rows; ++i) {
+        insert_element(column, block + i * row_size, row_size);
+      }
+      return;
+    }
+  }
+  LOG_IF(FATAL, py::len(obj) != rows)
+      << "Batched output has " << py::len(obj) << " rows. Expected " << rows;
+  for (i32 i = 0; i < rows; ++i) {
+    insert_pyobject(column, device, obj[i]);
+  }
+}
+}
+
 class PythonKernel : public BatchedKernel {
  public:
   PythonKernel(const KernelConfig& config)
-    : BatchedKernel(config), device_(config.devices[0]) {
+    : BatchedKernel(config), config_(config), device_(config.devices[0]) {
     if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
       LOG(FATAL) << "Failed to parse args";
     }
 
     PyGILState_STATE gstate = PyGILState_Ensure();
+    if (args_.subprocess()) {
+      std::string python;
+      try {
+        python = py::extract<std::string>(py::import("sys").attr("executable"));
+      } catch (py::error_already_set& e) {
+        LOG(FATAL) << handle_pyerror();
+      }
+      PyGILState_Release(gstate);
+      process_.reset(new PythonKernelProcess(
+          python.empty() ? "python" : python, args_.kernel_path(),
+          args_.py_args()));
+      return;
+    }
     try {
       py::object main = py::import("__main__");
       main.attr("path") = py::str(args_.kernel_path());
@@ -52,6 +156,8 @@ class PythonKernel : public BatchedKernel {
           "mod = importlib.import_module(osp.splitext(fil)[0])\n"
           "kernel = mod.Kernel(**pickle.loads(args))",
           main_namespace);
+      batched_ = PyObject_HasAttrString(main.attr("kernel").ptr(),
+                                        "execute_batch") != 0;
     } catch (py::error_already_set& e) {
       LOG(FATAL) << handle_pyerror();
     }
@@ -60,6 +166,10 @@ class PythonKernel : public BatchedKernel {
   }
 
   ~PythonKernel() {
+    if (process_) {
+      process_.reset();
+      return;
+    }
     PyGILState_STATE gstate = PyGILState_Ensure();
     try {
       py::object main = py::import("__main__");
@@ -75,43 +185,22 @@ class PythonKernel : public BatchedKernel {
                BatchedColumns& output_columns) override {
     i32 input_count = (i32)num_rows(input_columns[0]);
 
+    if (process_) {
+      process_->execute(input_columns, device_, output_columns);
+      return;
+    }
+
     PyGILState_STATE gstate = PyGILState_Ensure();
 
     try {
       py::object main = py::import("__main__");
       py::object kernel = main.attr("kernel");
 
-      for (i32 i = 0; i < input_count; ++i) {
-        py::list cols;
-        for (i32 j = 0; j < input_columns.size(); ++j) {
-          // HACK(wcrichto): should pass column type in config and check here
-          if (config_.input_columns[j] == "frame") {
-            const Frame* frame = input_columns[j][i].as_const_frame();
-            np::ndarray frame_np = np::from_data(
-              frame->data,
-              np::dtype::get_builtin<uint8_t>(),
-              py::make_tuple(frame->height(), frame->width(), frame->channels()),
-              py::make_tuple(frame->width() * frame->channels(),
-                             frame->channels(), 1),
-              py::object());
-            cols.append(frame_np);
-          } else {
-            cols.append(py::str((char const*)input_columns[j][i].buffer,
-                                input_columns[j][i].size));
-          }
-        }
-
-        py::list out_cols = py::extract<py::list>(kernel.attr("execute")(cols));
-        LOG_IF(FATAL, py::len(out_cols) != output_columns.size())
-            << "Incorrect number of output columns. Expected "
-            << output_columns.size();
-
-        for (i32 j = 0; j < py::len(out_cols); ++j) {
-          std::string field = py::extract<std::string>(out_cols[j]);
-          size_t size = field.size();
-          u8* buf = new_buffer(device_, size);
-          memcpy_buffer(buf, device_, (u8*)field.data(), CPU_DEVICE, size);
-          insert_element(output_columns[j], buf, size);
+      if (batched_) {
+        execute_batch(kernel, input_columns, output_columns);
+      } else {
+        for (i32 i = 0; i < input_count; ++i) {
+          execute_row(kernel, input_columns, i, output_columns);
         }
       }
     } catch (py::error_already_set& e) {
@@ -122,12 +211,67 @@ class PythonKernel : public BatchedKernel {
   }
 
  private:
+  // Calls execute_batch once with a stacked array for each frame column and
+  // a list for each other column
+  void execute_batch(py::object& kernel, const BatchedColumns& input_columns,
+                     BatchedColumns& output_columns) {
+    i32 input_count = (i32)num_rows(input_columns[0]);
+    py::list cols;
+    for (size_t j = 0; j < input_columns.size(); ++j) {
+      if (input_columns[j][0].is_frame) {
+        cols.append(frames_to_ndarray(input_columns[j]));
+      } else {
+        py::list rows;
+        for (i32 i = 0; i < input_count; ++i) {
+          rows.append(py::str((char const*)input_columns[j][i].buffer,
+                              input_columns[j][i].size));
+        }
+        cols.append(rows);
+      }
+    }
+
+    py::object out_cols = kernel.attr("execute_batch")(cols);
+    LOG_IF(FATAL, py::len(out_cols) != output_columns.size())
+        << "Incorrect number of output columns. Expected "
+        << output_columns.size();
+    for (size_t j = 0; j < output_columns.size(); ++j) {
+      insert_batched_pyobject(output_columns[j], device_, input_count,
+                              out_cols[j]);
+    }
+  }
+
+  void execute_row(py::object& kernel, const BatchedColumns& input_columns,
+                   i32 row, BatchedColumns& output_columns) {
+    py::list cols;
+    for (size_t j = 0; j < input_columns.size(); ++j) {
+      if (input_columns[j][row].is_frame) {
+        cols.append(frame_to_ndarray(input_columns[j][row].as_const_frame()));
+      } else {
+        cols.append(py::str((char const*)input_columns[j][row].buffer,
+                            input_columns[j][row].size));
+      }
+    }
+
+    py::object out_cols = kernel.attr("execute")(cols);
+    LOG_IF(FATAL, py::len(out_cols) != output_columns.size())
+        << "Incorrect number of output columns. Expected "
+        << output_columns.size();
+    for (size_t j = 0; j < output_columns.size(); ++j) {
+      insert_pyobject(output_columns[j], device_, out_cols[j]);
+    }
+  }
+
   KernelConfig config_;
   DeviceHandle device_;
   proto::PythonArgs args_;
+  bool batched_ = false;
+  std::unique_ptr<PythonKernelProcess> process_;
 };
 
 REGISTER_OP(Python).variadic_inputs().output("py_output");
 
-REGISTER_KERNEL(Python, PythonKernel).device(DeviceType::CPU).num_devices(1);
+REGISTER_KERNEL(Python, PythonKernel)
+    .device(DeviceType::CPU)
+    .batch()
+    .num_devices(1);
 }
@@ -0,0 +1,378 @@
+#include "stdlib/misc/python_kernel_process.h"
+#include "scanner/util/memory.h"
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+extern char** environ;
+
+namespace scanner {
+
+namespace {
+// Requests to the child are a command byte followed by, for 'e', the size of
+// the segment, the number of rows and columns and, for each column, whether
+// it holds frames and the offset, size and shape of each row in the segment.
+// Replies are a status byte followed by the formatted exception when it is
+// 1, or by the size of the segment and the offset and size of each output
+// row otherwise. Each message is prefixed by its length.
+const char* CHILD_SCRIPT = R"(
+import sys, os, mmap, struct, pickle, traceback, importlib, os.path as osp
+import numpy as np
+
+kernel_path, shm_path = sys.argv[1], sys.argv[2]
+rfd, wfd = int(sys.argv[3]), int(sys.argv[4])
+
+def read_exact(n):
+    buf = b''
+    while len(buf) < n:
+        chunk = os.read(rfd, n - len(buf))
+        if not chunk:
+            sys.exit(0)
+        buf += chunk
+    return buf
+
+def recv():
+    (n,) = struct.unpack('=Q', read_exact(8))
+    return read_exact(n)
+
+def send(data):
+    data = struct.pack('=Q', len(data)) + data
+    while data:
+        data = data[os.write(wfd, data):]
+
+def fail():
+    send(b'\x01' + traceback.format_exc().encode('utf-8'))
+
+def to_bytes(obj):
+    if isinstance(obj, np.ndarray):
+        return np.ascontiguousarray(obj).tobytes()
+    return memoryview(obj).tobytes()
+
+shm_fd = os.open(shm_path, os.O_RDWR)
+mm = None
+
+def remap(size):
+    global mm
+    if mm is None or len(mm) != size:
+        if mm is not None:
+            mm.close()
+        mm = mmap.mmap(shm_fd, size)
+
+try:
+    (d, f) = osp.split(kernel_path)
+    sys.path.append(d)
+    mod = importlib.import_module(osp.splitext(f)[0])
+    kernel = mod.Kernel(**pickle.loads(recv()))
+    batched = hasattr(kernel, 'execute_batch')
+    send(b'\x00')
+except Exception:
+    fail()
+    sys.exit(1)
+
+# Runs the kernel over a request and returns the bytes of each output row.
+# The arrays over the segment are gone once it returns, so the segment can
+# then be remapped.
+def run(msg):
+    (size, rows, num_cols) = struct.unpack_from('=QII', msg, 1)
+    remap(size)
+    pos = 17
+    cols = []
+    for j in range(num_cols):
+        is_frame = msg[pos:pos + 1] == b'\x01'
+        pos += 1
+        layout = []
+        for i in range(rows):
+            layout.append(struct.unpack_from('=QQiii', msg, pos))
+            pos += 28
+        if is_frame and batched:
+            (off, sz, h, w, c) = layout[0]
+            cols.append(np.frombuffer(mm, np.uint8, sz * rows, off)
+                        .reshape(rows, h, w, c))
+        elif is_frame:
+            cols.append([np.frombuffer(mm, np.uint8, sz, off).reshape(h, w, c)
+                         for (off, sz, h, w, c) in layout])
+        else:
+            cols.append([mm[off:off + sz] for (off, sz, _, _, _) in layout])
+
+    if batched:
+        outs = []
+        for out in kernel.execute_batch(cols):
+            if (isinstance(out, np.ndarray) and out.ndim > 0 and
+                out.shape[0] == rows):
+                out = np.ascontiguousarray(out)
+            outs.append([to_bytes(r) for r in out])
+        return outs
+    outs = []
+    for i in range(rows):
+        row_outs = kernel.execute([c[i] for c in cols])
+        if not outs:
+            outs = [[] for _ in row_outs]
+        for j, out in enumerate(row_outs):
+            outs[j].append(to_bytes(out))
+    return outs
+
+while True:
+    msg = recv()
+    if msg[0:1] == b'c':
+        try:
+            kernel.close()
+            send(b'\x00')
+        except Exception:
+            fail()
+        sys.exit(0)
+    try:
+        outs = run(msg)
+        total = sum(len(r) for out in outs for r in out)
+        if total > len(mm):
+            os.ftruncate(shm_fd, max(total, 2 * len(mm)))
+            remap(os.fstat(shm_fd).st_size)
+        # Outputs are written back to back from the start of the segment
+        reply = [struct.pack('=BQI', 0, len(mm), len(outs))]
+        off = 0
+        for out in outs:
+            reply.append(struct.pack('=I', len(out)))
+            for r in out:
+                mm[off:off + len(r)] = r
+                reply.append(struct.pack('=QQ', off, len(r)))
+                off += len(r)
+        send(b''.join(reply))
+    except Exception:
+        fail()
+)";
+
+std::atomic<i64> next_segment{0};
+
+void write_all(int fd, const u8* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    PCHECK(n > 0) << "Failed to write to Python kernel process";
+    data += n;
+    size -= n;
+  }
+}
+
+void read_all(int fd, u8* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = read(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    LOG_IF(FATAL, n == 0) << "Python kernel process exited";
+    PCHECK(n > 0) << "Failed to read from Python kernel process";
+    data += n;
+    size -= n;
+  }
+}
+
+template <typename T>
+void append(std::vector<u8>& message, T value) {
+  const u8* bytes = (const u8*)&value;
+  message.insert(message.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+T consume(const std::vector<u8>& message, size_t& pos) {
+  LOG_IF(FATAL, pos + sizeof(T) > message.size())
+      << "Truncated reply from Python kernel process";
+  T value;
+  std::memcpy(&value, message.data() + pos, sizeof(T));
+  pos += sizeof(T);
+  return value;
+}
+
+const size_t INITIAL_SEGMENT_SIZE = 1 << 20;
+const size_t ROW_ALIGNMENT = 64;
+}
+
+PythonKernelProcess::PythonKernelProcess(const std::string& python,
+                                         const std::string& kernel_path,
+                                         const std::string& py_args) {
+  shm_name_ = "/scanner-python-" + std::to_string(getpid()) + "-" +
+              std::to_string(next_segment++);
+  shm_fd_ = shm_open(shm_name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  PCHECK(shm_fd_ >= 0) << "Failed to create " << shm_name_;
+  reserve(INITIAL_SEGMENT_SIZE);
+
+  // The ends of the pipes the child uses are inherited by it, and closed on
+  // exec for any other process this one starts
+  int to_child[2];
+  int from_child[2];
+  PCHECK(pipe(to_child) == 0 && pipe(from_child) == 0);
+  fcntl(to_child[1], F_SETFD, FD_CLOEXEC);
+  fcntl(from_child[0], F_SETFD, FD_CLOEXEC);
+  to_child_ = to_child[1];
+  from_child_ = from_child[0];
+
+  std::string shm_path = "/dev/shm" + shm_name_;
+  std::string read_fd = std::to_string(to_child[0]);
+  std::string write_fd = std::to_string(from_child[1]);
+  std::vector<char*> argv = {
+      (char*)python.c_str(),   (char*)"-c",           (char*)CHILD_SCRIPT,
+      (char*)kernel_path.c_str(), (char*)shm_path.c_str(),
+      (char*)read_fd.c_str(),  (char*)write_fd.c_str(), nullptr};
+  int err = posix_spawnp(&pid_, python.c_str(), nullptr, nullptr, argv.data(),
+                         environ);
+  LOG_IF(FATAL, err != 0) << "Failed to start " << python << ": "
+                          << strerror(err);
+  close(to_child[0]);
+  close(from_child[1]);
+
+  send(std::vector<u8>(py_args.begin(), py_args.end()));
+  std::vector<u8> reply = receive();
+  LOG_IF(FATAL, reply.at(0) != 0)
+      << std::string(reply.begin() + 1, reply.end());
+}
+
+PythonKernelProcess::~PythonKernelProcess() {
+  send({'c'});
+  std::vector<u8> reply = receive();
+  LOG_IF(ERROR, reply.at(0) != 0)
+      << std::string(reply.begin() + 1, reply.end());
+  close(to_child_);
+  close(from_child_);
+  waitpid(pid_, nullptr, 0);
+  munmap(shm_, shm_size_);
+  close(shm_fd_);
+  shm_unlink(shm_name_.c_str());
+}
+
+void PythonKernelProcess::execute(const BatchedColumns& input_columns,
+                                  DeviceHandle device,
+                                  BatchedColumns& output_columns) {
+  i32 rows = (i32)num_rows(input_columns[0]);
+
+  // Frames of a column are laid out back to back so the child can stack
+  // them without a copy. Other rows start on a fresh cache line.
+  std::vector<std::vector<size_t>> offsets(input_columns.size());
+  size_t end = 0;
+  for (size_t j = 0; j < input_columns.size(); ++j) {
+    end = (end + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+    for (i32 i = 0; i < rows; ++i) {
+      const Element& element = input_columns[j][i];
+      if (!element.is_frame) {
+        end = (end + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+      }
+      offsets[j].push_back(end);
+      end += element.is_frame ? element.as_const_frame()->size()
+                              : element.size;
+    }
+  }
+  reserve(end);
+
+  std::vector<u8> request = {'e'};
+  append<u64>(request, shm_size_);
+  append<u32>(request, rows);
+  append<u32>(request, input_columns.size());
+  for (size_t j = 0; j < input_columns.size(); ++j) {
+    bool is_frame = input_columns[j][0].is_frame;
+    append<u8>(request, is_frame);
+    for (i32 i = 0; i < rows; ++i) {
+      const Element& element = input_columns[j][i];
+      if (is_frame) {
+        const Frame* frame = element.as_const_frame();
+        std::memcpy(shm_ + offsets[j][i], frame->data, frame->size());
+        append<u64>(request, offsets[j][i]);
+        append<u64>(request, frame->size());
+        append<i32>(request, frame->height());
+        append<i32>(request, frame->width());
+        append<i32>(request, frame->channels());
+      } else {
+        std::memcpy(shm_ + offsets[j][i], element.buffer, element.size);
+        append<u64>(request, offsets[j][i]);
+        append<u64>(request, element.size);
+        append<i32>(request, 0);
+        append<i32>(request, 0);
+        append<i32>(request, 0);
+      }
+    }
+  }
+  send(request);
+
+  std::vector<u8> reply = receive();
+  LOG_IF(FATAL, reply.at(0) != 0)
+      << std::string(reply.begin() + 1, reply.end());
+  size_t pos = 1;
+  // The child grows the segment when the outputs do not fit
+  size_t size = consume<u64>(reply, pos);
+  if (size != shm_size_) {
+    remap(size);
+  }
+  u32 num_outputs = consume<u32>(reply, pos);
+  LOG_IF(FATAL, num_outputs != output_columns.size())
+      << "Incorrect number of output columns. Expected "
+      << output_columns.size();
+  for (u32 j = 0; j < num_outputs; ++j) {
+    u32 output_rows = consume<u32>(reply, pos);
+    LOG_IF(FATAL, output_rows != (u32)rows)
+        << "Output has " << output_rows << " rows. Expected " << rows;
+    std::vector<std::tuple<u64, u64>> layout;
+    size_t total = 0;
+    for (u32 i = 0; i < output_rows; ++i) {
+      u64 offset = consume<u64>(reply, pos);
+      u64 row_size = consume<u64>(reply, pos);
+      LOG_IF(FATAL, offset + row_size > shm_size_)
+          << "Output row outside the shared memory segment";
+      layout.emplace_back(offset, row_size);
+      total += row_size;
+    }
+    // The rows of a column are consecutive in the segment, so they are
+    // copied into one block with a single copy
+    u8* block = new_block_buffer(device, total, rows);
+    if (total > 0) {
+      memcpy_buffer(block, device, shm_ + std::get<0>(layout[0]), CPU_DEVICE,
+                    total);
+    }
+    size_t block_offset = 0;
+    for (auto& row : layout) {
+      insert_element(output_columns[j], block + block_offset,
+                     std::get<1>(row));
+      block_offset += std::get<1>(row);
+    }
+  }
+}
+
+void PythonKernelProcess::reserve(size_t size) {
+  if (size <= shm_size_) {
+    return;
+  }
+  size = std::max(size, 2 * shm_size_);
+  PCHECK(ftruncate(shm_fd_, size) == 0) << "Failed to grow " << shm_name_;
+  remap(size);
+}
+
+void PythonKernelProcess::remap(size_t size) {
+  if (shm_ != nullptr) {
+    munmap(shm_, shm_size_);
+  }
+  void* addr =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd_, 0);
+  PCHECK(addr != MAP_FAILED) << "Failed to map " << shm_name_;
+  shm_ = (u8*)addr;
+  shm_size_ = size;
+}
+
+void PythonKernelProcess::send(const std::vector<u8>& message) {
+  u64 size = message.size();
+  write_all(to_child_, (const u8*)&size, sizeof(size));
+  write_all(to_child_, message.data(), message.size());
+}
+
+std::vector<u8> PythonKernelProcess::receive() {
+  u64 size;
+  read_all(from_child_, (u8*)&size, sizeof(size));
+  std::vector<u8> message(size);
+  read_all(from_child_, message.data(), size);
+  LOG_IF(FATAL, message.empty()) << "Empty reply from Python kernel process";
+  return message;
+}
+}
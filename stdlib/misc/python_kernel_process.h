@@ -0,0 +1,46 @@
+#pragma once
+
+#include "scanner/api/kernel.h"
+#include "scanner/util/common.h"
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+namespace scanner {
+
+//! Runs a Python kernel in a child interpreter, so that the Python kernels
+//! of one worker do not take turns on its GIL. The rows of each batch are
+//! copied into a shared memory segment, the child runs the kernel over
+//! arrays that map the segment and writes its outputs back into it, and
+//! only their offsets and shapes go through a pipe.
+class PythonKernelProcess {
+ public:
+  PythonKernelProcess(const std::string& python,
+                      const std::string& kernel_path,
+                      const std::string& py_args);
+
+  ~PythonKernelProcess();
+
+  void execute(const BatchedColumns& input_columns, DeviceHandle device,
+               BatchedColumns& output_columns);
+
+ private:
+  // Grows the segment to at least size bytes
+  void reserve(size_t size);
+
+  void remap(size_t size);
+
+  void send(const std::vector<u8>& message);
+
+  std::vector<u8> receive();
+
+  pid_t pid_ = -1;
+  int to_child_ = -1;
+  int from_child_ = -1;
+  std::string shm_name_;
+  int shm_fd_ = -1;
+  u8* shm_ = nullptr;
+  size_t shm_size_ = 0;
+};
+}
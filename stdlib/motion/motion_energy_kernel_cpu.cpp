@@ -0,0 +1,50 @@
+#include "scanner/api/op.h"
+#include "scanner/api/typed_kernel.h"
+
+#include <cmath>
+#include <limits>
+
+namespace scanner {
+
+// Summarizes the motion vectors of each frame of a video without decoding
+// its pixels, for gating the ops after it on motion. Motion is the mean
+// displacement in pixels of the inter coded macroblocks, or NaN for frames
+// that have none such as keyframes, and intra the fraction of macroblocks
+// coded without a motion vector, which rises at scene cuts.
+class MotionEnergyKernelCPU
+    : public TypedKernel<MotionEnergyKernelCPU, Inputs<FrameIn>,
+                         Outputs<TensorOut<f32, 1>, TensorOut<f32, 1>>> {
+ public:
+  MotionEnergyKernelCPU(const KernelConfig& config) : TypedKernel(config) {}
+
+  void execute_row(const Frame* field, f32* motion, f32* intra) {
+    LOG_IF(FATAL, field->layout != FrameLayout::MOTION_VECTORS)
+        << "MotionEnergy was given frames instead of motion vectors";
+    const f32* blocks = (const f32*)field->data;
+    i64 num_blocks = (i64)field->height() * field->width();
+    f64 displacement = 0;
+    i64 inter_blocks = 0;
+    for (i64 i = 0; i < num_blocks; ++i) {
+      const f32* block = blocks + i * 3;
+      if (block[2] == 0) {
+        displacement += std::sqrt(block[0] * block[0] + block[1] * block[1]);
+        inter_blocks++;
+      }
+    }
+    *motion = inter_blocks > 0 ? displacement / inter_blocks
+                               : std::numeric_limits<f32>::quiet_NaN();
+    *intra = num_blocks > 0 ? 1 - (f32)inter_blocks / num_blocks : 1;
+  }
+};
+
+REGISTER_OP(MotionEnergy)
+    .frame_input("frame")
+    .motion_vector_inputs()
+    .tensor_output("motion", Column::FLOAT32)
+    .tensor_output("intra", Column::FLOAT32);
+
+REGISTER_KERNEL(MotionEnergy, MotionEnergyKernelCPU)
+    .device(DeviceType::CPU)
+    .num_devices(1)
+    .parallel();
+}
@@ -23,8 +23,11 @@ class OpticalFlowKernelCPU : public StenciledKernel, public VideoKernel {
       grayscale_.emplace_back(frame_info_.height(), frame_info_.width(),
                               CV_8UC1);
     }
+    last_row_ = -1;
   }
 
+  void reset() override { last_row_ = -1; }
+
   void execute(const StenciledColumns& input_columns,
                Columns& output_columns) override {
     auto& frame_col = input_columns[0];
@@ -34,10 +37,21 @@ class OpticalFlowKernelCPU : public StenciledKernel, public VideoKernel {
                              FrameType::F32);
     Frame* output_frame = new_frame(device_, out_frame_info);
 
-    cv::Mat input0 = frame_to_mat(frame_col[0].as_const_frame());
+    // The second frame of the previous pair is the first frame of this one
+    // when the rows are consecutive, so its grayscale is reused
+    i64 row = rows_.empty() ? -1 : rows_[0];
+    if (last_row_ >= 0 && row == last_row_ + 1 &&
+        frame_col[0].buffer == last_buffer_) {
+      std::swap(grayscale_[0], grayscale_[1]);
+    } else {
+      cv::Mat input0 = frame_to_mat(frame_col[0].as_const_frame());
+      cv::cvtColor(input0, grayscale_[0], CV_BGR2GRAY);
+    }
     cv::Mat input1 = frame_to_mat(frame_col[1].as_const_frame());
-    cv::cvtColor(input0, grayscale_[0], CV_BGR2GRAY);
     cv::cvtColor(input1, grayscale_[1], CV_BGR2GRAY);
+    last_row_ = row;
+    last_buffer_ = frame_col[1].buffer;
+
     cv::Mat flow = frame_to_mat(output_frame);
     flow_finder_->calc(grayscale_[0], grayscale_[1], flow);
     insert_frame(output_columns[0], output_frame);
@@ -47,6 +61,9 @@ class OpticalFlowKernelCPU : public StenciledKernel, public VideoKernel {
   DeviceHandle device_;
   cv::Ptr<cv::DenseOpticalFlow> flow_finder_;
   std::vector<cv::Mat> grayscale_;
+  // Row of the last pair, or -1, and the element of its second frame
+  i64 last_row_ = -1;
+  const u8* last_buffer_ = nullptr;
   i32 work_item_size_;
 };
 
@@ -7,6 +7,8 @@
 
 #include <opencv2/video.hpp>
 
+#include <unordered_map>
+
 namespace scanner {
 
 class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
@@ -18,7 +20,9 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
       num_cuda_streams_(8) {
     set_device();
     cv::cuda::setBufferPoolUsage(true);
-    cv::cuda::setBufferPoolConfig(device_.id, 50 * 1024 * 1024, 5);
+    // A stack of buffers for each stream
+    cv::cuda::setBufferPoolConfig(device_.id, 50 * 1024 * 1024,
+                                  num_cuda_streams_);
     streams_.resize(num_cuda_streams_);
     for (i32 i = 0; i < num_cuda_streams_; ++i) {
       flow_finders_.push_back(
@@ -36,11 +40,12 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
 
   void new_frame_info() override {
     set_device();
+    last_row_ = -1;
   }
 
   void reset() override {
     set_device();
-    initial_frame_ = cvc::GpuMat();
+    last_row_ = -1;
   }
 
   void execute(const StenciledBatchedColumns& input_columns,
@@ -51,22 +56,49 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
     check_frame(device_, frame_col[0][0]);
 
     i32 input_count = (i32)frame_col.size();
+    bool known_rows = (i32)rows_.size() == input_count;
+    if (!known_rows || rows_[0] != last_row_ + 1 || last_row_ < 0) {
+      last_buffer_ = nullptr;
+    }
+
+    // Each distinct frame of the pairs is converted to grayscale once.
+    // Consecutive pairs share a frame, and the second frame of the last pair
+    // of the previous batch is kept in last_grayscale_ for the next one.
+    std::unordered_map<const u8*, i32> grayscale_index;
     std::vector<const Frame*> input_frames;
+    std::vector<i32> pair_grayscale(2 * input_count);
     for (i32 i = 0; i < input_count; ++i) {
-      input_frames.push_back(frame_col[i][0].as_const_frame());
+      for (i32 j = 0; j < 2; ++j) {
+        const Element& element = frame_col[i][j];
+        if (element.buffer == last_buffer_) {
+          pair_grayscale[2 * i + j] = -1;
+          continue;
+        }
+        auto it = grayscale_index.find(element.buffer);
+        if (it == grayscale_index.end()) {
+          it = grayscale_index
+                   .emplace(element.buffer, (i32)input_frames.size())
+                   .first;
+          input_frames.push_back(element.as_const_frame());
+        }
+        pair_grayscale[2 * i + j] = it->second;
+      }
     }
-    input_frames.push_back(frame_col.back()[1].as_const_frame());
+    auto grayscale = [&](i32 index) -> cvc::GpuMat& {
+      return index < 0 ? last_grayscale_ : grayscale_[index];
+    };
 
-    grayscale_.resize(input_count + 1);
+    if (grayscale_.size() < input_frames.size()) {
+      grayscale_.resize(input_frames.size());
+    }
 
     FrameInfo out_frame_info(frame_info_.height(), frame_info_.width(), 2,
                              FrameType::F32);
     std::vector<Frame*> output_frames =
         new_frames(device_, out_frame_info, input_count);
 
-    for (i32 i = 0; i < input_count + 1; ++i) {
+    for (i32 i = 0; i < (i32)input_frames.size(); ++i) {
       i32 sidx = i % num_cuda_streams_;
-      streams_[sidx].waitForCompletion();
       cvc::GpuMat input = frame_to_gpu_mat(input_frames[i]);
       cvc::cvtColor(input, grayscale_[i], CV_BGR2GRAY, 0, streams_[sidx]);
     }
@@ -74,23 +106,28 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
       s.waitForCompletion();
     }
 
-    for (i32 i = 1; i < input_count + 1; ++i) {
+    // The pairs are independent, so they are spread over the streams, each
+    // with its own flow finder
+    for (i32 i = 0; i < input_count; ++i) {
       i32 sidx = i % num_cuda_streams_;
 
-      i32 curr_idx = i;
-      i32 prev_idx = (i - 1);
-
-      cvc::GpuMat& input0 = grayscale_[curr_idx];
-      cvc::GpuMat& input1 = grayscale_[prev_idx];
+      cvc::GpuMat& input0 = grayscale(pair_grayscale[2 * i + 1]);
+      cvc::GpuMat& input1 = grayscale(pair_grayscale[2 * i]);
 
-      //streams_[sidx].waitForCompletion();
-      cvc::GpuMat output_mat = frame_to_gpu_mat(output_frames[i - 1]);
-      flow_finders_[0]->calc(input0, input1, output_mat);
-      insert_frame(output_columns[0], output_frames[i - 1]);
+      cvc::GpuMat output_mat = frame_to_gpu_mat(output_frames[i]);
+      flow_finders_[sidx]->calc(input0, input1, output_mat, streams_[sidx]);
+      insert_frame(output_columns[0], output_frames[i]);
     }
     for (auto& s : streams_) {
       s.waitForCompletion();
     }
+
+    i32 last = pair_grayscale.back();
+    if (last >= 0) {
+      std::swap(last_grayscale_, grayscale_[last]);
+    }
+    last_row_ = known_rows ? rows_.back() : -1;
+    last_buffer_ = frame_col.back()[1].buffer;
   }
 
  private:
@@ -101,8 +138,12 @@ class OpticalFlowKernelGPU : public StenciledBatchedKernel, public VideoKernel {
 
   DeviceHandle device_;
   std::vector<cv::Ptr<cvc::DenseOpticalFlow>> flow_finders_;
-  cvc::GpuMat initial_frame_;
   std::vector<cvc::GpuMat> grayscale_;
+  // Grayscale second frame of the last pair, the row of that pair, or -1,
+  // and the element of the frame
+  cvc::GpuMat last_grayscale_;
+  i64 last_row_ = -1;
+  const u8* last_buffer_ = nullptr;
   i32 work_item_size_;
   i32 num_cuda_streams_;
   std::vector<cv::cuda::Stream> streams_;
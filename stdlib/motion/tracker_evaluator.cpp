@@ -16,6 +16,7 @@
 #include "scanner/evaluators/tracker/tracker_evaluator.h"
 #include "scanner/evaluators/serialize.h"
 
+#include "scanner/util/bbox.h"
 #include "scanner/util/common.h"
 #include "scanner/util/util.h"
 
@@ -42,6 +43,8 @@ TrackerEvaluator::TrackerEvaluator(const EvaluatorConfig& config,
   if (device_type_ == DeviceType::GPU) {
     LOG(FATAL) << "GPU tracker support not implemented yet";
   }
+  pool_.reset(new WorkStealingPool(
+      std::max(std::thread::hardware_concurrency(), 1u)));
 }
 
 void TrackerEvaluator::configure(const BatchConfig& config) {
@@ -78,11 +81,19 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
     // For boxes which don't overlap existing ones, create a new track for them
     std::vector<BoundingBox> detected_bboxes;
     std::vector<BoundingBox> new_detected_bboxes;
-    for (const BoundingBox& box : all_boxes) {
+    std::vector<BoundingBox> tracked_boxes;
+    for (auto& track : tracks_) {
+      tracked_boxes.push_back(track.box);
+    }
+    // Overlaps are computed in one pass against the track boxes as they were
+    // at the start of the frame
+    std::vector<f32> ious = iou_matrix(all_boxes, tracked_boxes);
+    for (size_t d = 0; d < all_boxes.size(); ++d) {
+      const BoundingBox& box = all_boxes[d];
+      const f32* box_ious = ious.data() + d * tracked_boxes.size();
       i32 overlap_idx = -1;
-      for (size_t j = 0; j < tracks_.size(); ++j) {
-        auto& tracked_bbox = tracks_[j].box;
-        if (iou(box, tracked_bbox) > IOU_THRESHOLD) {
+      for (size_t j = 0; j < tracked_boxes.size(); ++j) {
+        if (box_ious[j] > IOU_THRESHOLD) {
           overlap_idx = j;
           break;
         }
@@ -107,25 +118,17 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
       cv::Mat frame(metadata_.height(), metadata_.width(), CV_8UC3, buffer);
       std::vector<f64> scores(tracks_.size());
       std::vector<struck::FloatRect> tracked_bboxes(tracks_.size());
-      std::vector<std::thread> tracker_threads(tracks_.size());
-      auto track_fn = [](struck::Tracker* tracker, const cv::Mat& frame,
-                         f64& score, struck::FloatRect& tracked_bbox) {
-        tracker->Track(frame);
-        score = tracker->GetScore();
-        tracked_bbox = tracker->GetBB();
-      };
-
       for (i32 i = 0; i < (i32)tracks_.size(); ++i) {
-        auto& track = tracks_[i];
-        auto& tracker = track.tracker;
-        tracker_threads[i] =
-            std::thread(track_fn, tracker.get(), std::ref(frame),
-                        std::ref(scores[i]), std::ref(tracked_bboxes[i]));
+        struck::Tracker* tracker = tracks_[i].tracker.get();
+        pool_->submit([&, tracker, i](i32) {
+          tracker->Track(frame);
+          scores[i] = tracker->GetScore();
+          tracked_bboxes[i] = tracker->GetBB();
+        });
       }
+      pool_->wait_idle();
       for (i32 i = 0, jid = 0; i < (i32)tracks_.size(); ++i, ++jid) {
         auto& track = tracks_[i];
-        auto& tracker = track.tracker;
-        tracker_threads[jid].join();
         f64 score = scores[jid];
         struck::FloatRect tracked_bbox = tracked_bboxes[jid];
         if (score < TRACK_SCORE_THRESHOLD) {
@@ -172,6 +175,10 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
       }
     }
     assert(tracks_.size() <= max_tracks_);
+    u8* buffer = input_columns[frame_idx].rows[b].buffer;
+    assert(input_columns[frame_idx].rows[b].size ==
+           metadata_.height() * metadata_.width() * 3);
+    cv::Mat frame(metadata_.height(), metadata_.width(), CV_8UC3, buffer);
     for (BoundingBox& box : new_detected_bboxes) {
       tracks_.resize(tracks_.size() + 1);
       Track& track = tracks_.back();
@@ -188,23 +195,21 @@ void TrackerEvaluator::evaluate(const BatchedColumns& input_columns,
       config.features.push_back(fkp);
       track.tracker.reset(new struck::Tracker(config));
 
-      u8* buffer = input_columns[frame_idx].rows[b].buffer;
-      assert(input_columns[frame_idx].rows[b].size ==
-             metadata_.height() * metadata_.width() * 3);
-      cv::Mat frame(metadata_.height(), metadata_.width(), CV_8UC3, buffer);
-
       // Clamp values
       float x1 = std::max(box.x1(), 0.0f);
       float y1 = std::max(box.y1(), 0.0f);
       float x2 = std::min(box.x2(), (f32)metadata_.width());
       float y2 = std::min(box.y2(), (f32)metadata_.height());
       struck::FloatRect r(x1, y1, x2 - x1, y2 - y1);
-      track.tracker->Initialise(frame, r);
+      struck::Tracker* tracker = track.tracker.get();
+      pool_->submit(
+          [&frame, tracker, r](i32) { tracker->Initialise(frame, r); });
 
       box.set_track_id(track.id);
       box.set_track_score(0.0f);
       track.frames_since_last_detection = 0;
     }
+    pool_->wait_idle();
 
     {
       size_t size;
@@ -18,6 +18,7 @@
 #include "scanner/eval/evaluator.h"
 #include "scanner/eval/evaluator_factory.h"
 #include "scanner/evaluators/types.pb.h"
+#include "scanner/util/thread_pool.h"
 
 #include "struck/Tracker.h"
 
@@ -64,6 +65,8 @@ class TrackerEvaluator : public Evaluator {
     i32 frames_since_last_detection;
   };
   std::vector<Track> tracks_;
+  // Tracks of a frame are updated independently, one task per track
+  std::unique_ptr<WorkStealingPool> pool_;
 };
 
 class TrackerEvaluatorFactory : public EvaluatorFactory {
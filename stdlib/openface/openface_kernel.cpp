@@ -11,19 +11,24 @@
 #include <boost/filesystem.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include <omp.h>
+
 namespace scanner {
 
 class OpenFaceKernel : public BatchedKernel, public VideoKernel {
  public:
-  OpenFaceKernel(const KernelConfig& config)
-    : BatchedKernel(config), clnf_model(det_parameters.model_location) {
+  OpenFaceKernel(const KernelConfig& config) : BatchedKernel(config) {
     boost::filesystem::path au_loc_path =
         boost::filesystem::path("AU_predictors/AU_all_static.txt");
     boost::filesystem::path tri_loc_path =
         boost::filesystem::path("model/tris_68_full.txt");
-    face_analyser_ =
-        FaceAnalysis::FaceAnalyser(vector<cv::Vec3d>(), 0.7, 112, 112,
-                                   au_loc_path.string(), tri_loc_path.string());
+    // The models carry the state of the face they last fit, so every thread
+    // gets its own set, loaded once here instead of once per batch
+    i32 num_threads = omp_get_max_threads();
+    for (i32 i = 0; i < num_threads; ++i) {
+      models_.emplace_back(new FaceModels(au_loc_path.string(),
+                                          tri_loc_path.string()));
+    }
   }
 
   void execute(const BatchedColumns& input_columns,
@@ -41,18 +46,25 @@ class OpenFaceKernel : public BatchedKernel, public VideoKernel {
     fx = (fx + fy) / 2.0;
     fy = fx;
 
+    // Faces of the whole batch are laid out in one list so that the threads
+    // share them evenly, however they are spread over the frames
+    struct Face {
+      i32 frame;
+      cv::Rect_<double> bbox;
+    };
     i32 input_count = num_rows(frame_col);
+    std::vector<Frame*> output_frames = new_frames(CPU_DEVICE, frame_info_,
+                                                   input_count);
+    std::vector<cv::Mat> imgs(input_count);
+    std::vector<cv::Mat> greys(input_count);
+    std::vector<Face> faces;
+    std::vector<u8> has_faces(input_count, false);
     for (i32 b = 0; b < input_count; ++b) {
-      Frame* output_frame = new_frame(CPU_DEVICE, frame_info_);
-      memcpy(output_frame->data, frame_col[b].as_const_frame()->data,
-             output_frame->size());
-      cv::Mat img = frame_to_mat(output_frame);
-      cv::Mat grey;
-      cv::cvtColor(img, grey, CV_BGR2GRAY);
+      memcpy(output_frames[b]->data, frame_col[b].as_const_frame()->data,
+             output_frames[b]->size());
+      imgs[b] = frame_to_mat(output_frames[b]);
       std::vector<BoundingBox> all_bboxes =
-          deserialize_proto_vector<BoundingBox>(bbox_col[b].buffer,
-                                                bbox_col[b].size);
-
+          deserialize_bbox_vector(bbox_col[b].buffer, bbox_col[b].size);
       for (auto& bbox : all_bboxes) {
         f64 x1 = bbox.x1(), y1 = bbox.y1(), x2 = bbox.x2(), y2 = bbox.y2();
         f64 w = x2 - x1, h = y2 - y1;
@@ -61,28 +73,55 @@ class OpenFaceKernel : public BatchedKernel, public VideoKernel {
         y1 = std::max(y1 - dh / 2, 0.0);
         x2 = std::min(x2 + dw / 2, (f64)(frame_info_.width() - 1));
         y2 = std::min(y2 + dh / 2, (f64)(frame_info_.height() - 1));
-        cv::Rect_<double> cv_bbox(x1, y1, x2 - x1, y2 - y1);
-        cv::rectangle(img, cv_bbox, cv::Scalar(0, 255, 0));
-
-        bool success = LandmarkDetector::DetectLandmarksInImage(
-            grey, cv_bbox, clnf_model, det_parameters);
-        if (success) {
-          std::vector<cv::Point2d> landmarks =
-              LandmarkDetector::CalculateLandmarks(clnf_model);
-
-          cv::Point3f gazeDirection0(0, 0, -1);
-          cv::Point3f gazeDirection1(0, 0, -1);
-          FaceAnalysis::EstimateGaze(clnf_model, gazeDirection0, fx, fy, cx, cy,
-                                     true);
-          FaceAnalysis::EstimateGaze(clnf_model, gazeDirection1, fx, fy, cx, cy,
-                                     false);
+        faces.push_back(Face{b, cv::Rect_<double>(x1, y1, x2 - x1, y2 - y1)});
+        has_faces[b] = true;
+      }
+    }
 
-          auto ActionUnits =
-              face_analyser_.PredictStaticAUs(grey, clnf_model, false);
+    // Frames without detections are passed through as they are
+#pragma omp parallel for
+    for (i32 b = 0; b < input_count; ++b) {
+      if (has_faces[b]) {
+        cv::cvtColor(imgs[b], greys[b], CV_BGR2GRAY);
+      }
+    }
 
-          cv::Vec6d headPose = LandmarkDetector::GetCorrectedPoseWorld(
-              clnf_model, fx, fy, cx, cy);
+    i32 num_faces = (i32)faces.size();
+#pragma omp parallel for schedule(dynamic)
+    for (i32 f = 0; f < num_faces; ++f) {
+      FaceModels& models = *models_[omp_get_thread_num()];
+      LandmarkDetector::CLNF& clnf_model = models.clnf_model;
+      cv::Mat& img = imgs[faces[f].frame];
+      const cv::Mat& grey = greys[faces[f].frame];
+      cv::Rect_<double> cv_bbox = faces[f].bbox;
+
+      bool success = LandmarkDetector::DetectLandmarksInImage(
+          grey, cv_bbox, clnf_model, models.det_parameters);
+
+      cv::Point3f gazeDirection0(0, 0, -1);
+      cv::Point3f gazeDirection1(0, 0, -1);
+      cv::Vec6d headPose;
+      if (success) {
+        std::vector<cv::Point2d> landmarks =
+            LandmarkDetector::CalculateLandmarks(clnf_model);
+
+        FaceAnalysis::EstimateGaze(clnf_model, gazeDirection0, fx, fy, cx, cy,
+                                   true);
+        FaceAnalysis::EstimateGaze(clnf_model, gazeDirection1, fx, fy, cx, cy,
+                                   false);
+
+        auto ActionUnits =
+            models.face_analyser.PredictStaticAUs(grey, clnf_model, false);
+
+        headPose = LandmarkDetector::GetCorrectedPoseWorld(clnf_model, fx, fy,
+                                                           cx, cy);
+      }
 
+      // Faces of one frame can overlap, so they are drawn one at a time
+#pragma omp critical
+      {
+        cv::rectangle(img, cv_bbox, cv::Scalar(0, 255, 0));
+        if (success) {
           LandmarkDetector::DrawBox(img, headPose, cv::Scalar(255.0, 0, 0), 3,
                                     fx, fy, cx, cy);
           FaceAnalysis::DrawGaze(img, clnf_model, gazeDirection0,
@@ -90,25 +129,32 @@ class OpenFaceKernel : public BatchedKernel, public VideoKernel {
           LandmarkDetector::Draw(img, clnf_model);
         }
       }
+    }
 
-      insert_frame(output_columns[0], output_frame);
+    for (i32 b = 0; b < input_count; ++b) {
+      insert_frame(output_columns[0], output_frames[b]);
     }
   }
 
  private:
-  LandmarkDetector::FaceModelParameters det_parameters;
-  LandmarkDetector::CLNF clnf_model;
-  std::vector<std::string> files, depth_files, output_images,
-      output_landmark_locations, output_pose_locations;
-  std::vector<cv::Rect_<double>> bounding_boxes;
-  int device;
+  struct FaceModels {
+    FaceModels(const std::string& au_loc, const std::string& tri_loc)
+      : clnf_model(det_parameters.model_location),
+        face_analyser(vector<cv::Vec3d>(), 0.7, 112, 112, au_loc, tri_loc) {}
+
+    LandmarkDetector::FaceModelParameters det_parameters;
+    LandmarkDetector::CLNF clnf_model;
+    FaceAnalysis::FaceAnalyser face_analyser;
+  };
+
+  std::vector<std::unique_ptr<FaceModels>> models_;
   float fx, fy, cx, cy;
-  FaceAnalysis::FaceAnalyser face_analyser_;
 };
 
 REGISTER_OP(OpenFace).frame_input("frame").input("faces").output("features");
 
 REGISTER_KERNEL(OpenFace, OpenFaceKernel)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
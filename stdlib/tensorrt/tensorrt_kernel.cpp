@@ -0,0 +1,494 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/fs.h"
+#include "scanner/util/memory.h"
+#include "stdlib/stdlib.pb.h"
+
+#include <NvCaffeParser.h>
+#include <NvInfer.h>
+#include <NvOnnxParser.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <sstream>
+
+namespace scanner {
+namespace {
+
+class TensorRTLogger : public nvinfer1::ILogger {
+ public:
+  void log(Severity severity, const char* msg) override {
+    if (severity == Severity::kINTERNAL_ERROR || severity == Severity::kERROR) {
+      LOG(ERROR) << "TensorRT: " << msg;
+    } else if (severity == Severity::kWARNING) {
+      LOG(WARNING) << "TensorRT: " << msg;
+    } else {
+      VLOG(1) << "TensorRT: " << msg;
+    }
+  }
+};
+
+struct TensorRTDeleter {
+  template <typename T>
+  void operator()(T* obj) const {
+    if (obj != nullptr) {
+      obj->destroy();
+    }
+  }
+};
+
+template <typename T>
+using TensorRTPtr = std::unique_ptr<T, TensorRTDeleter>;
+
+// Hands TensorRT the scales of a calibration cache instead of calibrating on
+// batches of the net's input
+class CalibrationCacheReader : public nvinfer1::IInt8EntropyCalibrator2 {
+ public:
+  CalibrationCacheReader(const std::vector<u8>& cache) : cache_(cache) {}
+
+  int getBatchSize() const override { return 1; }
+
+  bool getBatch(void* bindings[], const char* names[],
+                int nb_bindings) override {
+    return false;
+  }
+
+  const void* readCalibrationCache(size_t& length) override {
+    length = cache_.size();
+    return cache_.data();
+  }
+
+  void writeCalibrationCache(const void* cache, size_t length) override {}
+
+ private:
+  const std::vector<u8>& cache_;
+};
+
+bool file_exists(const std::string& path, struct stat* st = nullptr) {
+  struct stat buffer;
+  return stat(path.c_str(), st != nullptr ? st : &buffer) == 0;
+}
+
+bool ends_with(const std::string& s, const std::string& suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+size_t volume(const nvinfer1::Dims& dims, i32 first_axis) {
+  size_t v = 1;
+  for (i32 i = first_axis; i < dims.nbDims; ++i) {
+    v *= dims.d[i];
+  }
+  return v;
+}
+}
+
+//! Runs a net of a NetDescriptor as a TensorRT engine in place of Caffe. It
+//! reads the output of CaffeInput and writes the net outputs as Caffe does,
+//! so the output ops of Caffe nets can read it as well.
+class TensorRTKernel : public BatchedKernel {
+ public:
+  TensorRTKernel(const KernelConfig& config)
+    : BatchedKernel(config), device_(config.devices[0]) {
+    valid_.set_success(true);
+    if (!args_.ParseFromArray(config.args.data(), config.args.size())) {
+      RESULT_ERROR(&valid_, "TensorRTKernel could not parse protobuf args");
+      return;
+    }
+    auto& descriptor = args_.net_descriptor();
+    if (args_.batch_size() < 1) {
+      args_.set_batch_size(1);
+    }
+    if (descriptor.input_layer_names_size() !=
+        (i32)config.input_columns.size()) {
+      RESULT_ERROR(&valid_,
+                   "# input layers in net descriptor (%d) does not match "
+                   "number of input columns of op (%lu)",
+                   descriptor.input_layer_names_size(),
+                   config.input_columns.size());
+      return;
+    }
+    if (descriptor.output_layer_names_size() !=
+        (i32)config.output_columns.size()) {
+      RESULT_ERROR(&valid_,
+                   "# output layers in net descriptor (%d) does not match "
+                   "number of output columns of op (%lu)",
+                   descriptor.output_layer_names_size(),
+                   config.output_columns.size());
+      return;
+    }
+
+    set_device();
+    CU_CHECK(cudaStreamCreateWithFlags(&stream_, cudaStreamNonBlocking));
+
+    std::string cache_path = engine_cache_path();
+    if (!valid_.success()) {
+      return;
+    }
+    runtime_.reset(nvinfer1::createInferRuntime(logger_));
+    if (file_exists(cache_path)) {
+      std::vector<u8> plan = read_entire_file(cache_path);
+      engine_.reset(
+          runtime_->deserializeCudaEngine(plan.data(), plan.size(), nullptr));
+      if (!engine_) {
+        LOG(WARNING) << "Rebuilding TensorRT engine, could not load "
+                     << cache_path;
+      }
+    }
+    if (!engine_) {
+      build_engine(cache_path);
+      if (!valid_.success()) {
+        return;
+      }
+    }
+    context_.reset(engine_->createExecutionContext());
+    setup_bindings();
+  }
+
+  ~TensorRTKernel() {
+    set_device();
+    // The execution context and engine have to go before the runtime
+    context_.reset();
+    engine_.reset();
+    runtime_.reset();
+    for (i32 binding : input_bindings_) {
+      delete_buffer(device_, (u8*)inputs_[binding]);
+    }
+    if (stream_ != nullptr) {
+      cudaStreamDestroy(stream_);
+    }
+  }
+
+  void validate(proto::Result* result) override {
+    result->set_msg(valid_.msg());
+    result->set_success(valid_.success());
+  }
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    std::lock_guard<std::mutex> lock(execute_mutex_);
+    check_frame(device_, input_columns[0][0]);
+    set_device();
+
+    i32 input_count = num_rows(input_columns[0]);
+    i32 batch_size = args_.batch_size();
+    for (i32 frame = 0; frame < input_count; frame += batch_size) {
+      i32 batch_count = std::min(input_count - frame, batch_size);
+
+      for (size_t i = 0; i < input_bindings_.size(); ++i) {
+        i32 binding = input_bindings_[i];
+        u8* dst = (u8*)inputs_[binding];
+        for (i32 j = 0; j < batch_count; ++j) {
+          const Frame* fr = input_columns[i][frame + j].as_const_frame();
+          LOG_IF(FATAL, fr->size() != binding_sizes_[binding])
+              << "TensorRT: input " << i << " of " << fr->size()
+              << " bytes does not match the net input of "
+              << binding_sizes_[binding] << " bytes";
+          CU_CHECK(cudaMemcpyAsync(dst + j * fr->size(), fr->data, fr->size(),
+                                   cudaMemcpyDeviceToDevice, stream_));
+        }
+        if (explicit_batch_) {
+          nvinfer1::Dims dims = engine_->getBindingDimensions(binding);
+          dims.d[0] = batch_count;
+          context_->setBindingDimensions(binding, dims);
+        }
+      }
+
+      // The net writes its outputs straight into the output blocks
+      std::vector<void*> bindings = inputs_;
+      for (size_t i = 0; i < output_bindings_.size(); ++i) {
+        i32 binding = output_bindings_[i];
+        size_t size = binding_sizes_[binding];
+        u8* output_block =
+            new_block_buffer(device_, size * batch_count, batch_count);
+        bindings[binding] = output_block;
+        for (i32 b = 0; b < batch_count; b++) {
+          insert_frame(output_columns[i],
+                       new Frame(output_infos_[i], output_block + size * b));
+        }
+      }
+
+      auto net_start = now();
+      bool ok = explicit_batch_
+                    ? context_->enqueueV2(bindings.data(), stream_, nullptr)
+                    : context_->enqueue(batch_count, bindings.data(), stream_,
+                                        nullptr);
+      LOG_IF(FATAL, !ok) << "TensorRT: could not run the engine";
+      if (profiler_) {
+        profiler_->add_interval("tensorrt:net", net_start, now());
+      }
+    }
+    CU_CHECK(cudaStreamSynchronize(stream_));
+  }
+
+ private:
+  // Engines only run on the GPU model and TensorRT version they were built
+  // with, and for the model files, precision and batch size they were built
+  // from, so all of them go into the key of the cached engine
+  std::string engine_cache_path() {
+    auto& descriptor = args_.net_descriptor();
+    cudaDeviceProp prop;
+    CU_CHECK(cudaGetDeviceProperties(&prop, device_.id));
+
+    std::stringstream key;
+    key << prop.name << ":" << prop.major << "." << prop.minor << ":"
+        << getInferLibVersion() << ":" << args_.precision() << ":"
+        << args_.batch_size() << ":" << descriptor.input_width() << "x"
+        << descriptor.input_height();
+    std::vector<std::string> files = {descriptor.model_path()};
+    if (!onnx()) {
+      files.push_back(descriptor.model_weights_path());
+    }
+    if (args_.precision() == proto::TensorRTArgs::INT8) {
+      files.push_back(args_.int8_calibration_cache());
+    }
+    for (const std::string& path : files) {
+      struct stat st;
+      if (!file_exists(path, &st)) {
+        RESULT_ERROR(&valid_, "TensorRT: %s does not exist.", path.c_str());
+        return "";
+      }
+      key << ":" << path << ":" << st.st_size << ":" << st.st_mtime;
+    }
+    for (const std::string& name : descriptor.output_layer_names()) {
+      key << ":" << name;
+    }
+
+    std::string cache_dir = args_.engine_cache_dir();
+    if (cache_dir.empty()) {
+      const char* home = getenv("HOME");
+      cache_dir = std::string(home != nullptr ? home : "/tmp") +
+                  "/.scanner_tensorrt";
+    }
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx",
+             (unsigned long long)std::hash<std::string>()(key.str()));
+    std::string model = basename_s(descriptor.model_path());
+    return cache_dir + "/" + model.substr(0, model.rfind('.')) + "_" + hash +
+           ".engine";
+  }
+
+  bool onnx() const {
+    return ends_with(args_.net_descriptor().model_path(), ".onnx");
+  }
+
+  void build_engine(const std::string& cache_path) {
+    auto& descriptor = args_.net_descriptor();
+    TensorRTPtr<nvinfer1::IBuilder> builder(
+        nvinfer1::createInferBuilder(logger_));
+    u32 flags = 0;
+    if (onnx()) {
+      flags = 1U << static_cast<u32>(
+                  nvinfer1::NetworkDefinitionCreationFlag::kEXPLICIT_BATCH);
+    }
+    TensorRTPtr<nvinfer1::INetworkDefinition> network(
+        builder->createNetworkV2(flags));
+    TensorRTPtr<nvinfer1::IBuilderConfig> config(
+        builder->createBuilderConfig());
+    config->setMaxWorkspaceSize(1 << 30);
+
+    TensorRTPtr<nvcaffeparser1::ICaffeParser> caffe_parser;
+    TensorRTPtr<nvonnxparser::IParser> onnx_parser;
+    if (onnx()) {
+      onnx_parser.reset(nvonnxparser::createParser(*network, logger_));
+      if (!onnx_parser->parseFromFile(
+              descriptor.model_path().c_str(),
+              static_cast<int>(nvinfer1::ILogger::Severity::kWARNING))) {
+        RESULT_ERROR(&valid_, "TensorRT: could not parse %s",
+                     descriptor.model_path().c_str());
+        return;
+      }
+      // Batches of one up to the batch size run on the same engine
+      nvinfer1::IOptimizationProfile* profile =
+          builder->createOptimizationProfile();
+      for (i32 i = 0; i < network->getNbInputs(); ++i) {
+        nvinfer1::ITensor* input = network->getInput(i);
+        nvinfer1::Dims dims = input->getDimensions();
+        if (dims.nbDims == 4 && dims.d[2] == -1 &&
+            descriptor.input_height() > 0) {
+          dims.d[2] = descriptor.input_height();
+        }
+        if (dims.nbDims == 4 && dims.d[3] == -1 &&
+            descriptor.input_width() > 0) {
+          dims.d[3] = descriptor.input_width();
+        }
+        for (i32 d = 1; d < dims.nbDims; ++d) {
+          if (dims.d[d] < 0) {
+            RESULT_ERROR(&valid_,
+                         "TensorRT: input %s has a dynamic size, set the "
+                         "input_width and input_height of the net",
+                         input->getName());
+            return;
+          }
+        }
+        nvinfer1::Dims max_dims = dims;
+        max_dims.d[0] = args_.batch_size();
+        dims.d[0] = 1;
+        profile->setDimensions(input->getName(),
+                               nvinfer1::OptProfileSelector::kMIN, dims);
+        profile->setDimensions(input->getName(),
+                               nvinfer1::OptProfileSelector::kOPT, max_dims);
+        profile->setDimensions(input->getName(),
+                               nvinfer1::OptProfileSelector::kMAX, max_dims);
+      }
+      config->addOptimizationProfile(profile);
+    } else {
+      caffe_parser.reset(nvcaffeparser1::createCaffeParser());
+      const nvcaffeparser1::IBlobNameToTensor* blobs = caffe_parser->parse(
+          descriptor.model_path().c_str(),
+          descriptor.model_weights_path().c_str(), *network,
+          nvinfer1::DataType::kFLOAT);
+      if (blobs == nullptr) {
+        RESULT_ERROR(&valid_, "TensorRT: could not parse %s",
+                     descriptor.model_path().c_str());
+        return;
+      }
+      for (const std::string& name : descriptor.output_layer_names()) {
+        nvinfer1::ITensor* output = blobs->find(name.c_str());
+        if (output == nullptr) {
+          RESULT_ERROR(&valid_, "TensorRT: net has no output %s",
+                       name.c_str());
+          return;
+        }
+        network->markOutput(*output);
+      }
+      builder->setMaxBatchSize(args_.batch_size());
+    }
+
+    std::vector<u8> calibration_cache;
+    std::unique_ptr<CalibrationCacheReader> calibrator;
+    if (args_.precision() == proto::TensorRTArgs::FP16) {
+      if (!builder->platformHasFastFp16()) {
+        LOG(WARNING) << "TensorRT: GPU has no fast FP16, building FP32";
+      }
+      config->setFlag(nvinfer1::BuilderFlag::kFP16);
+    } else if (args_.precision() == proto::TensorRTArgs::INT8) {
+      if (!builder->platformHasFastInt8()) {
+        RESULT_ERROR(&valid_, "TensorRT: GPU does not support INT8");
+        return;
+      }
+      calibration_cache = read_entire_file(args_.int8_calibration_cache());
+      calibrator.reset(new CalibrationCacheReader(calibration_cache));
+      config->setFlag(nvinfer1::BuilderFlag::kINT8);
+      config->setInt8Calibrator(calibrator.get());
+    }
+
+    engine_.reset(builder->buildEngineWithConfig(*network, *config));
+    if (!engine_) {
+      RESULT_ERROR(&valid_, "TensorRT: could not build an engine for %s",
+                   descriptor.model_path().c_str());
+      return;
+    }
+
+    // Written under a temporary name first, since other workers on the node
+    // may be loading or building the same engine
+    TensorRTPtr<nvinfer1::IHostMemory> plan(engine_->serialize());
+    mkdir_p(dirname_s(cache_path).c_str(), S_IRWXU);
+    std::string temp_path = cache_path + "." + std::to_string(getpid());
+    {
+      std::ofstream file(temp_path, std::ios::binary);
+      file.write((const char*)plan->data(), plan->size());
+    }
+    if (rename(temp_path.c_str(), cache_path.c_str()) != 0) {
+      LOG(WARNING) << "TensorRT: could not cache engine at " << cache_path;
+      remove(temp_path.c_str());
+    }
+  }
+
+  void setup_bindings() {
+    auto& descriptor = args_.net_descriptor();
+    explicit_batch_ = !engine_->hasImplicitBatchDimension();
+    // Bytes of a single row of each binding
+    i32 first_axis = explicit_batch_ ? 1 : 0;
+    inputs_.assign(engine_->getNbBindings(), nullptr);
+    binding_sizes_.assign(engine_->getNbBindings(), 0);
+    for (const std::string& name : descriptor.input_layer_names()) {
+      i32 binding = engine_->getBindingIndex(name.c_str());
+      LOG_IF(FATAL, binding < 0) << "TensorRT: net has no input " << name;
+      nvinfer1::Dims dims =
+          explicit_batch_
+              ? engine_->getProfileDimensions(
+                    binding, 0, nvinfer1::OptProfileSelector::kMAX)
+              : engine_->getBindingDimensions(binding);
+      binding_sizes_[binding] = volume(dims, first_axis) * sizeof(f32);
+      inputs_[binding] =
+          new_buffer(device_, binding_sizes_[binding] * args_.batch_size());
+      input_bindings_.push_back(binding);
+    }
+    // The outputs of explicit batch engines get their sizes from the inputs,
+    // which are set for the largest batch here
+    if (explicit_batch_) {
+      for (i32 input : input_bindings_) {
+        context_->setBindingDimensions(
+            input, engine_->getProfileDimensions(
+                       input, 0, nvinfer1::OptProfileSelector::kMAX));
+      }
+    }
+    for (const std::string& name : descriptor.output_layer_names()) {
+      i32 binding = engine_->getBindingIndex(name.c_str());
+      LOG_IF(FATAL, binding < 0) << "TensorRT: net has no output " << name;
+      nvinfer1::Dims dims = explicit_batch_
+                                ? context_->getBindingDimensions(binding)
+                                : engine_->getBindingDimensions(binding);
+      binding_sizes_[binding] = volume(dims, first_axis) * sizeof(f32);
+      // Same shape as the outputs of the Caffe kernel
+      i32 num_axes = dims.nbDims - first_axis;
+      const i32* d = dims.d + first_axis;
+      output_infos_.emplace_back(d[0], num_axes >= 2 ? d[1] : 1,
+                                 num_axes >= 3 ? d[2] : 1, FrameType::F32);
+      output_bindings_.push_back(binding);
+    }
+  }
+
+  void set_device() { CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); }); }
+
+  proto::Result valid_;
+  DeviceHandle device_;
+  proto::TensorRTArgs args_;
+  TensorRTLogger logger_;
+  TensorRTPtr<nvinfer1::IRuntime> runtime_;
+  TensorRTPtr<nvinfer1::ICudaEngine> engine_;
+  TensorRTPtr<nvinfer1::IExecutionContext> context_;
+  cudaStream_t stream_ = nullptr;
+  bool explicit_batch_ = false;
+  // Per binding -> input buffer for a full batch, or null for outputs
+  std::vector<void*> inputs_;
+  // Per binding -> bytes of one row
+  std::vector<size_t> binding_sizes_;
+  std::vector<i32> input_bindings_;
+  std::vector<i32> output_bindings_;
+  std::vector<FrameInfo> output_infos_;
+  // Pipeline instances on a device share the engine, so their batches take
+  // turns on it
+  std::mutex execute_mutex_;
+};
+
+REGISTER_OP(TensorRT).frame_input("caffe_frame").frame_output("caffe_output");
+
+REGISTER_KERNEL(TensorRT, TensorRTKernel)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1)
+    .shared();
+}
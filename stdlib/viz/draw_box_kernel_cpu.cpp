@@ -25,15 +25,13 @@ class DrawBoxKernelCPU : public BatchedKernel {
       cv::Mat out_img = frame_to_mat(output_frames[i]);
       img.copyTo(out_img);
 
-      // Deserialize bboxes
-      std::vector<BoundingBox> bboxes =
-          deserialize_bbox_vector(bbox_col[i].buffer, bbox_col[i].size);
-
-      // Draw all bboxes
-      for (auto& bbox : bboxes) {
-        i32 width = bbox.x2() - bbox.x1();
-        i32 height = bbox.y2() - bbox.y1();
-        cv::rectangle(out_img, cv::Rect(bbox.x1(), bbox.y1(), width, height),
+      // Draw all bboxes, reading their coordinates in place
+      PackedBBoxes bboxes(bbox_col[i].buffer, bbox_col[i].size);
+      for (size_t b = 0; b < bboxes.size(); ++b) {
+        i32 width = bboxes.x2()[b] - bboxes.x1()[b];
+        i32 height = bboxes.y2()[b] - bboxes.y1()[b];
+        cv::rectangle(out_img,
+                      cv::Rect(bboxes.x1()[b], bboxes.y1()[b], width, height),
                       cv::Scalar(255, 0, 0), 2);
       }
       insert_frame(output_columns[0], output_frames[i]);
@@ -48,5 +46,6 @@ REGISTER_OP(DrawBox).frame_input("frame").input("bboxes").frame_output("frame");
 
 REGISTER_KERNEL(DrawBox, DrawBoxKernelCPU)
     .device(DeviceType::CPU)
+    .batch()
     .num_devices(1);
 }
@@ -0,0 +1,79 @@
+#include "scanner/api/kernel.h"
+#include "scanner/api/op.h"
+#include "scanner/util/cuda.h"
+#include "scanner/util/image.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/serialize.h"
+
+namespace scanner {
+
+class DrawBoxKernelGPU : public BatchedKernel {
+ public:
+  DrawBoxKernelGPU(const KernelConfig& config)
+    : BatchedKernel(config),
+      device_(config.devices[0]),
+      stream_(config.stream) {}
+
+  void execute(const BatchedColumns& input_columns,
+               BatchedColumns& output_columns) override {
+    auto& frame_col = input_columns[0];
+    auto& bbox_col = input_columns[1];
+
+    set_device();
+
+    i32 input_count = num_rows(frame_col);
+    FrameInfo info = frame_col[0].as_const_frame()->as_frame_info();
+    std::vector<Frame*> output_frames = new_frames(device_, info, input_count);
+
+    // The boxes of every frame go into one table so that a single launch
+    // draws the whole batch over the copied frames
+    std::vector<i32> boxes;
+    std::vector<u8> bbox_buf;
+    for (i32 i = 0; i < input_count; ++i) {
+      CU_CHECK(cudaMemcpyAsync(
+          output_frames[i]->data, frame_col[i].as_const_frame()->data,
+          info.size(), cudaMemcpyDeviceToDevice, stream_));
+
+      bbox_buf.resize(bbox_col[i].size);
+      memcpy_buffer(bbox_buf.data(), CPU_DEVICE, bbox_col[i].buffer, device_,
+                    bbox_col[i].size);
+      PackedBBoxes bboxes(bbox_buf.data(), bbox_buf.size());
+      for (size_t b = 0; b < bboxes.size(); ++b) {
+        boxes.insert(boxes.end(),
+                     {i, (i32)bboxes.x1()[b], (i32)bboxes.y1()[b],
+                      (i32)bboxes.x2()[b], (i32)bboxes.y2()[b]});
+      }
+    }
+
+    if (!boxes.empty()) {
+      size_t boxes_size = boxes.size() * sizeof(i32);
+      u8* device_boxes = new_buffer(device_, boxes_size);
+      memcpy_buffer(device_boxes, device_, (u8*)boxes.data(), CPU_DEVICE,
+                    boxes_size);
+      CU_CHECK(drawBoxesRGB(output_frames[0]->data, info.width(),
+                            info.height(), (const i32*)device_boxes,
+                            boxes.size() / 5, 2, 255, 0, 0, stream_));
+      // The table is read until the launch finishes
+      CU_CHECK(cudaStreamSynchronize(stream_));
+      delete_buffer(device_, device_boxes);
+    }
+
+    for (i32 i = 0; i < input_count; ++i) {
+      insert_frame(output_columns[0], output_frames[i]);
+    }
+  }
+
+  void set_device() {
+    CUDA_PROTECT({ CU_CHECK(cudaSetDevice(device_.id)); });
+  }
+
+ private:
+  DeviceHandle device_;
+  cudaStream_t stream_;
+};
+
+REGISTER_KERNEL(DrawBox, DrawBoxKernelGPU)
+    .device(DeviceType::GPU)
+    .batch()
+    .num_devices(1);
+}
@@ -0,0 +1,286 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of the components on the hot paths of a job, in isolation:
+//   decode:  DecoderAutomata over the test videos at several strides, with
+//            the software decoder and, if built in, the NVIDIA one
+//   alloc:   allocation churn from several threads with the block pool,
+//            the system allocator behind new_buffer and malloc
+//   reads:   reading every stride-th element of an item one read at a time
+//            against reading the whole range, which is the choice
+//            read_other_column makes at the load sparsity threshold
+// Pass the names of the benchmarks to run only some of them. Queues and
+// packet indexing are covered by QueueBenchmark and NalBenchmark.
+
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+#include "scanner/util/fs.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/storehouse.h"
+#include "scanner/util/util.h"
+#include "scanner/video/decoder_automata.h"
+#include "tests/videos.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace scanner {
+namespace internal {
+namespace {
+
+const i32 DECODE_ITERATIONS = 3;
+const i64 ALLOC_ITERATIONS = 100000;
+// Buffers each allocating thread keeps live at a time
+const size_t ALLOC_LIVE = 8;
+const i32 READ_ITERATIONS = 200;
+const i64 ITEM_ELEMENTS = 1024;
+
+storehouse::StorageBackend* storage() {
+  static std::unique_ptr<storehouse::StorageConfig> config(
+      storehouse::StorageConfig::make_posix_config());
+  static std::unique_ptr<storehouse::StorageBackend> backend(
+      storehouse::StorageBackend::make_from_config(config.get()));
+  return backend.get();
+}
+
+// Frames per second decoding every stride-th frame of a video
+f64 bench_decode(const VideoMetadata& meta, const std::vector<u8>& bytes,
+                 i64 stride, VideoDecoderType decoder_type) {
+  DeviceHandle device = decoder_type == VideoDecoderType::SOFTWARE
+                            ? CPU_DEVICE
+                            : DeviceHandle(DeviceType::GPU, 0);
+  DecoderAutomata decoder(device, 1, decoder_type);
+  FrameInfo info(meta.height(), meta.width(), 3, FrameType::U8);
+  u8* frame_buffer = new_buffer(device, info.size());
+  i64 frames = 0;
+  f64 seconds = 0;
+  for (i32 i = 0; i < DECODE_ITERATIONS; ++i) {
+    // The decoder frees the encoded data it is given
+    u8* video_buffer = new_buffer(CPU_DEVICE, bytes.size());
+    std::memcpy(video_buffer, bytes.data(), bytes.size());
+    std::vector<proto::DecodeArgs> args(1);
+    proto::DecodeArgs& decode_args = args[0];
+    decode_args.set_width(meta.width());
+    decode_args.set_height(meta.height());
+    decode_args.set_start_keyframe(0);
+    decode_args.set_end_keyframe(meta.frames());
+    i64 valid_frames = 0;
+    for (i64 r = 0; r < meta.frames(); r += stride) {
+      decode_args.add_valid_frames(r);
+      valid_frames++;
+    }
+    for (i64 k : meta.keyframe_positions()) {
+      decode_args.add_keyframes(k);
+    }
+    for (i64 k : meta.keyframe_byte_offsets()) {
+      decode_args.add_keyframe_byte_offsets(k);
+    }
+    decode_args.set_encoded_video((i64)video_buffer);
+    decode_args.set_encoded_video_size(bytes.size());
+
+    auto start = now();
+    decoder.initialize(args);
+    for (i64 f = 0; f < valid_frames; ++f) {
+      decoder.get_frames(frame_buffer, 1);
+    }
+    seconds += nano_since(start) / 1e9;
+    frames += valid_frames;
+  }
+  delete_buffer(device, frame_buffer);
+  return frames / seconds;
+}
+
+void run_decode() {
+  struct Video {
+    const char* name;
+    const TestVideoInfo& info;
+  };
+  std::vector<Video> videos = {{"short", short_video}, {"long", long_video}};
+  std::vector<std::tuple<const char*, VideoDecoderType>> decoders = {
+      std::make_tuple("software", VideoDecoderType::SOFTWARE)};
+#ifdef HAVE_CUDA
+  decoders.push_back(std::make_tuple("nvidia", VideoDecoderType::NVIDIA));
+#endif
+
+  printf("%-6s %-9s %6s %14s\n", "video", "decoder", "stride", "frames/s");
+  for (auto& video : videos) {
+    VideoMetadata meta =
+        read_video_metadata(storage(), download_video_meta(video.info));
+    std::vector<u8> bytes = read_entire_file(download_video(video.info));
+    for (auto& decoder : decoders) {
+      for (i64 stride : {1, 8, 30, 120}) {
+        f64 rate = bench_decode(meta, bytes, stride, std::get<1>(decoder));
+        printf("%-6s %-9s %6ld %14.1f\n", video.name, std::get<0>(decoder),
+               stride, rate);
+      }
+    }
+  }
+}
+
+// Allocations per second over all threads, each allocating and freeing
+// buffers of a size with a few live at a time
+template <typename Allocate, typename Free>
+f64 bench_alloc(i32 num_threads, size_t size, Allocate allocate,
+                Free free_buffer) {
+  auto start = now();
+  std::vector<std::thread> threads;
+  for (i32 t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&] {
+      std::vector<u8*> buffers(ALLOC_LIVE, nullptr);
+      for (i64 i = 0; i < ALLOC_ITERATIONS; ++i) {
+        u8*& buffer = buffers[i % ALLOC_LIVE];
+        if (buffer != nullptr) {
+          free_buffer(buffer);
+        }
+        buffer = allocate(size);
+        // Touch the buffer so the allocation can not be elided
+        buffer[0] = (u8)i;
+      }
+      for (u8* buffer : buffers) {
+        if (buffer != nullptr) {
+          free_buffer(buffer);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  f64 seconds = nano_since(start) / 1e9;
+  return num_threads * ALLOC_ITERATIONS / seconds;
+}
+
+void run_alloc() {
+  printf("%7s %8s %16s %16s %16s\n", "threads", "size", "block (alloc/s)",
+         "system (alloc/s)", "malloc (alloc/s)");
+  for (size_t size : {4 << 10, 64 << 10, 1 << 20, 16 << 20}) {
+    for (i32 num_threads : {1, 4, 16}) {
+      f64 block_rate = bench_alloc(
+          num_threads, size,
+          [](size_t s) { return new_block_buffer(CPU_DEVICE, s, 1); },
+          [](u8* b) { delete_buffer(CPU_DEVICE, b); });
+      f64 system_rate = bench_alloc(
+          num_threads, size,
+          [](size_t s) { return new_buffer(CPU_DEVICE, s); },
+          [](u8* b) { delete_buffer(CPU_DEVICE, b); });
+      f64 malloc_rate = bench_alloc(
+          num_threads, size, [](size_t s) { return (u8*)std::malloc(s); },
+          [](u8* b) { std::free(b); });
+      printf("%7d %7zuK %16.0f %16.0f %16.0f\n", num_threads, size >> 10,
+             block_rate, system_rate, malloc_rate);
+    }
+  }
+}
+
+// Elements per second reading every stride-th of ITEM_ELEMENTS elements,
+// one read per element if sparse, or with one read of the whole range that
+// the elements are copied out of otherwise. The file is small enough to stay
+// in the page cache, so this measures the cost of the reads themselves.
+f64 bench_reads(storehouse::RandomReadFile* file, i64 stride,
+                size_t element_size, bool sparse) {
+  std::vector<u8> range(ITEM_ELEMENTS * element_size);
+  i64 elements = 0;
+  auto start = now();
+  for (i32 r = 0; r < READ_ITERATIONS; ++r) {
+    for (i64 i = 0; i < ITEM_ELEMENTS; i += stride) {
+      u8* buffer = new_block_buffer(CPU_DEVICE, element_size, 1);
+      if (sparse) {
+        s_read(file, buffer, element_size, i * element_size);
+      } else {
+        if (i == 0) {
+          s_read(file, range.data(), range.size(), 0);
+        }
+        std::memcpy(buffer, range.data() + i * element_size, element_size);
+      }
+      delete_buffer(CPU_DEVICE, buffer);
+      elements++;
+    }
+  }
+  f64 seconds = nano_since(start) / 1e9;
+  return elements / seconds;
+}
+
+void run_reads() {
+  printf("%6s %8s %16s %16s %8s\n", "stride", "element", "dense (elem/s)",
+         "sparse (elem/s)", "speedup");
+  for (size_t element_size : {4 << 10, 64 << 10}) {
+    std::string path;
+    temp_file(path);
+    {
+      std::unique_ptr<storehouse::WriteFile> file;
+      BACKOFF_FAIL(storehouse::make_unique_write_file(storage(), path, file));
+      std::vector<u8> element(element_size, 1);
+      for (i64 i = 0; i < ITEM_ELEMENTS; ++i) {
+        s_write(file.get(), element.data(), element.size());
+      }
+      BACKOFF_FAIL(file->save());
+    }
+    std::unique_ptr<storehouse::RandomReadFile> file;
+    BACKOFF_FAIL(
+        storehouse::make_unique_random_read_file(storage(), path, file));
+    for (i64 stride : {1, 2, 4, 8, 16, 32}) {
+      f64 dense_rate = bench_reads(file.get(), stride, element_size, false);
+      f64 sparse_rate = bench_reads(file.get(), stride, element_size, true);
+      printf("%6ld %7zuK %16.0f %16.0f %8.2f\n", stride, element_size >> 10,
+             dense_rate, sparse_rate, sparse_rate / dense_rate);
+    }
+    std::remove(path.c_str());
+  }
+}
+}
+}
+}
+
+int main(int argc, char** argv) {
+  using namespace scanner;
+  using namespace scanner::internal;
+  avcodec_register_all();
+  av_register_all();
+
+  // The pooled CPU allocator of a worker
+  MemoryPoolConfig config;
+  config.mutable_cpu()->set_use_pool(true);
+  config.mutable_cpu()->set_free_space(4LL * 1024 * 1024 * 1024);
+  std::vector<i32> gpu_ids;
+#ifdef HAVE_CUDA
+  gpu_ids.push_back(0);
+#endif
+  init_memory_allocators(config, gpu_ids);
+
+  std::set<std::string> selected(argv + 1, argv + argc);
+  auto run = [&](const std::string& name, void (*benchmark)()) {
+    if (selected.empty() || selected.count(name) > 0) {
+      printf("%s\n", name.c_str());
+      benchmark();
+      printf("\n");
+    }
+  };
+  run("decode", run_decode);
+  run("alloc", run_alloc);
+  run("reads", run_reads);
+
+  destroy_memory_allocators();
+  return 0;
+}
@@ -1,6 +1,7 @@
 #include "scanner/api/database.h"
 #include "scanner/api/op.h"
 #include "scanner/util/fs.h"
+#include "scanner/util/half.h"
 #include "stdlib/stdlib.pb.h"
 
 #include <gtest/gtest.h>
@@ -50,6 +51,26 @@ class ScannerTest : public ::testing::Test {
     params_.work_item_size = 25;
     params_.load_sparsity_threshold = 8;
     params_.tasks_in_queue_per_pu = 4;
+    params_.read_coalesce_gap = 256 * 1024;
+    params_.load_read_parallelism = 4;
+    params_.load_mmap = false;
+    params_.load_readahead_items = 2;
+    params_.load_readahead_size = 512 * 1024 * 1024;
+    params_.save_upload_parallelism = 8;
+    params_.save_upload_size = 512 * 1024 * 1024;
+    params_.pack_output_items = false;
+    params_.decode_width = 0;
+    params_.decode_height = 0;
+    params_.decode_parallelism = 1;
+    params_.encode_parallelism = 1;
+    params_.direct_reads = false;
+    params_.codec_threads = 0;
+    params_.codec_slice_threads = false;
+    params_.gpu_decode_surfaces = 0;
+    params_.balance_gpu_decode = false;
+    params_.batch_latency_ms = 0;
+    params_.cpu_pipeline_instances = 0;
+    params_.priority = 1;
   }
 
   void TearDown() { delete db_; }
@@ -88,6 +109,7 @@ class ScannerTest : public ::testing::Test {
     params_.task_set.tasks.clear();
     params_.task_set.tasks.push_back(task);
     params_.task_set.output_op = op;
+    params_.task_set.compression.clear();
     for (auto& op_input : op->get_inputs()) {
       OutputColumnCompression compress;
       compress.codec = "default";
@@ -98,12 +120,15 @@ class ScannerTest : public ::testing::Test {
     ASSERT_TRUE(result.success()) << "Run job failed: " << result.msg();
   }
 
-  scanner::Task range_task(std::string output_table_name) {
+  scanner::Task range_task(std::string output_table_name,
+                           std::string input_table_name = "test",
+                           std::vector<std::string> columns = {"index",
+                                                               "frame"}) {
     scanner::Task task;
     task.output_table_name = output_table_name;
     scanner::TableSample sample;
-    sample.table_name = "test";
-    sample.column_names = {"index", "frame"};
+    sample.table_name = input_table_name;
+    sample.column_names = columns;
     sample.sampling_function = "Gather";
     scanner::proto::GatherSamplerArgs args;
     auto& gather_sample = *args.add_samples();
@@ -138,6 +163,64 @@ TEST_F(ScannerTest, NonLinearDAG) {
   run_task(range_task("NonLinearDAG"), output);
 }
 
+TEST_F(ScannerTest, MmapLoad) {
+  params_.load_mmap = true;
+
+  scanner::Op* input = scanner::make_input_op({"index", "frame"});
+  scanner::Op* hist = new scanner::Op(
+      "Histogram", {scanner::OpInput(input, {"frame"})},
+      scanner::DeviceType::CPU);
+  scanner::Op* output =
+      scanner::make_output_op({scanner::OpInput(input, {"index"}),
+                               scanner::OpInput(hist, {"histogram"})});
+
+  run_task(range_task("MmapLoad"), output);
+}
+
+TEST_F(ScannerTest, PackedOutputItems) {
+  params_.pack_output_items = true;
+  {
+    scanner::Op* input = scanner::make_input_op({"index", "frame"});
+    scanner::Op* hist = new scanner::Op(
+        "Histogram", {scanner::OpInput(input, {"frame"})},
+        scanner::DeviceType::CPU);
+    scanner::Op* output =
+        scanner::make_output_op({scanner::OpInput(input, {"index"}),
+                                 scanner::OpInput(hist, {"histogram"})});
+    run_task(range_task("PackedOutputItems"), output);
+  }
+
+  // Read both columns of the packed items back into an unpacked table
+  params_.pack_output_items = false;
+  scanner::Op* input = scanner::make_input_op({"index", "histogram"});
+  scanner::Op* output =
+      scanner::make_output_op({scanner::OpInput(input, {"index"}),
+                               scanner::OpInput(input, {"histogram"})});
+  run_task(range_task("PackedOutputItemsRead", "PackedOutputItems",
+                      {"index", "histogram"}),
+           output);
+}
+
+TEST(Half, Conversions) {
+  // More than one vector of values, with a remainder
+  std::vector<scanner::f32> values = {1.0f,  -2.0f,  0.1f, 65504.0f,
+                                      1e6f,  0.0f,   -0.0f, 5.9604645e-8f,
+                                      1e-9f, 0.333f, 1024.5f};
+  std::vector<scanner::u16> expected = {0x3c00, 0xc000, 0x2e66, 0x7bff,
+                                        0x7c00, 0x0000, 0x8000, 0x0001,
+                                        0x0000, 0x3554, 0x6400};
+  std::vector<scanner::u16> half(values.size());
+  scanner::float_to_half(values.data(), half.data(), values.size());
+  EXPECT_EQ(expected, half);
+
+  std::vector<scanner::f32> floats(half.size());
+  scanner::half_to_float(half.data(), floats.data(), half.size());
+  EXPECT_EQ(1.0f, floats[0]);
+  EXPECT_EQ(65504.0f, floats[3]);
+  EXPECT_EQ(5.9604645e-8f, floats[7]);
+  EXPECT_EQ(1024.0f, floats[10]);
+}
+
 #ifdef HAVE_CUDA
 
 TEST_F(ScannerTest, CPUToGPU) {
@@ -0,0 +1,135 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Ingests a fixed corpus, COPIES copies of each of the test videos in
+// tests/videos.h, into a fresh database for each configuration and reports
+// throughput along with the time the ingest threads spent in each stage:
+//   open:   opening and probing videos
+//   read:   reading from storage, which happens while demuxing
+//   demux:  splitting the container into packets
+//   index:  finding keyframes in the bytestream
+//   write:  saving items and their metadata
+//   commit: saving the database metadata and manifest
+
+#include "scanner/api/database.h"
+#include "scanner/engine/ingest.h"
+#include "scanner/util/common.h"
+#include "scanner/util/fs.h"
+#include "scanner/util/util.h"
+#include "tests/videos.h"
+
+#include <cstdio>
+#include <map>
+#include <vector>
+
+namespace scanner {
+namespace {
+
+const i32 COPIES = 8;
+
+struct Config {
+  i32 num_threads;
+  i64 segment_size;
+};
+
+// Seconds spent in each stage, summed over the ingest threads
+std::map<std::string, f64> stage_seconds(
+    const std::vector<Profiler>& profilers) {
+  std::map<std::string, f64> seconds;
+  for (const Profiler& profiler : profilers) {
+    for (const Profiler::TaskRecord& record : profiler.get_records()) {
+      seconds[record.key] += (record.end - record.start) / 1e9;
+    }
+  }
+  return seconds;
+}
+
+void run_benchmark(const Config& config, const std::vector<std::string>& paths,
+                   u64 total_bytes) {
+  std::string db_path;
+  temp_dir(db_path);
+  std::unique_ptr<storehouse::StorageConfig> sc(
+      storehouse::StorageConfig::make_posix_config());
+  Database db(sc.get(), db_path, "localhost:5001");
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(sc.get()));
+
+  std::vector<std::string> table_names;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    table_names.push_back("video" + std::to_string(i));
+  }
+  auto start = now();
+  internal::DatabaseMetadata meta = internal::read_database_metadata(
+      storage.get(), internal::DatabaseMetadata::descriptor_path());
+  std::vector<i32> table_ids;
+  std::vector<u8> appended;
+  Result result = internal::add_ingest_tables(meta, table_names, false,
+                                              table_ids, appended);
+  LOG_IF(FATAL, !result.success()) << result.msg();
+  std::vector<u8> failed;
+  std::vector<std::string> failed_messages;
+  proto::DatabaseManifest manifest;
+  std::vector<Profiler> profilers;
+  internal::ingest_video_tables(storage.get(), table_names, table_ids,
+                                appended, paths, config.num_threads,
+                                config.segment_size, false,
+                                proto::TranscodeOptions(), failed,
+                                failed_messages, manifest, profilers);
+  auto commit_start = now();
+  std::vector<FailedVideo> failed_videos;
+  result = internal::commit_ingest(storage.get(), meta, table_ids, appended,
+                                   paths, failed, failed_messages, manifest,
+                                   failed_videos);
+  f64 commit_seconds = nano_since(commit_start) / 1e9;
+  f64 seconds = nano_since(start) / 1e9;
+  LOG_IF(FATAL, !result.success() || !failed_videos.empty())
+      << "Failed to ingest the corpus";
+
+  std::map<std::string, f64> stages = stage_seconds(profilers);
+  printf("%7d %9ld %9.2f %8.1f %7.2f %7.2f %7.2f %7.2f %7.2f %7.3f\n",
+         config.num_threads, config.segment_size / (1024 * 1024), seconds,
+         total_bytes / seconds / (1024 * 1024), stages["open"],
+         stages["read"], stages["demux"], stages["index"], stages["write"],
+         commit_seconds);
+}
+}
+}
+
+int main(int argc, char** argv) {
+  using namespace scanner;
+  std::vector<std::string> paths;
+  u64 total_bytes = 0;
+  for (const TestVideoInfo* video : {&short_video, &long_video}) {
+    std::string path = download_video(*video);
+    u64 size = read_entire_file(path).size();
+    for (i32 i = 0; i < COPIES; ++i) {
+      paths.push_back(path);
+      total_bytes += size;
+    }
+  }
+
+  std::vector<Config> configs = {{1, 0},
+                                 {4, 0},
+                                 {8, 0},
+                                 {4, 16 * 1024 * 1024},
+                                 {8, 16 * 1024 * 1024}};
+  printf("%7s %9s %9s %8s %7s %7s %7s %7s %7s %7s\n", "threads", "seg (MB)",
+         "total (s)", "MB/s", "open", "read", "demux", "index", "write",
+         "commit");
+  for (const Config& config : configs) {
+    run_benchmark(config, paths, total_bytes);
+  }
+  return 0;
+}
@@ -0,0 +1,215 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/common.h"
+#include "scanner/util/lockfree_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace scanner {
+
+// Long enough for a blocked thread to give up spinning and go to sleep
+static const std::chrono::milliseconds SETTLE_TIME(100);
+
+TEST(LockFreeQueue, ManyProducersAndConsumers) {
+  const i32 num_producers = 4;
+  const i32 num_consumers = 4;
+  const i32 items_per_producer = 100000;
+  LockFreeQueue<i32> queue(8);
+
+  std::vector<std::vector<i32>> popped(num_consumers);
+  std::vector<std::thread> consumers;
+  for (i32 c = 0; c < num_consumers; ++c) {
+    consumers.emplace_back([&, c] {
+      while (true) {
+        i32 item;
+        queue.pop(item);
+        if (item < 0) {
+          break;
+        }
+        popped[c].push_back(item);
+      }
+    });
+  }
+  std::vector<std::thread> producers;
+  for (i32 p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&, p] {
+      for (i32 i = 0; i < items_per_producer; ++i) {
+        queue.push(p * items_per_producer + i);
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  // Shut down the consumers the way pipeline stages are, with one sentinel
+  // each
+  for (i32 c = 0; c < num_consumers; ++c) {
+    queue.push(-1);
+  }
+  for (std::thread& consumer : consumers) {
+    consumer.join();
+  }
+
+  // Every item comes out exactly once
+  std::vector<i32> all;
+  for (std::vector<i32>& items : popped) {
+    all.insert(all.end(), items.begin(), items.end());
+  }
+  std::sort(all.begin(), all.end());
+  ASSERT_EQ(all.size(), (size_t)(num_producers * items_per_producer));
+  for (size_t i = 0; i < all.size(); ++i) {
+    ASSERT_EQ(all[i], (i32)i);
+  }
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(LockFreeQueue, PushBlocksWhileFull) {
+  LockFreeQueue<i32> queue(2);
+  queue.push(0);
+  queue.push(1);
+
+  std::atomic<bool> pushed{false};
+  std::thread producer([&] {
+    queue.push(2);
+    pushed = true;
+  });
+  std::this_thread::sleep_for(SETTLE_TIME);
+  EXPECT_FALSE(pushed);
+
+  i32 item;
+  queue.pop(item);
+  EXPECT_EQ(item, 0);
+  producer.join();
+  EXPECT_TRUE(pushed);
+  queue.pop(item);
+  EXPECT_EQ(item, 1);
+  queue.pop(item);
+  EXPECT_EQ(item, 2);
+}
+
+TEST(LockFreeQueue, PopBlocksWhileEmpty) {
+  LockFreeQueue<i32> queue(2);
+
+  std::atomic<bool> popped{false};
+  i32 item = -1;
+  std::thread consumer([&] {
+    queue.pop(item);
+    popped = true;
+  });
+  std::this_thread::sleep_for(SETTLE_TIME);
+  EXPECT_FALSE(popped);
+
+  queue.push(7);
+  consumer.join();
+  EXPECT_TRUE(popped);
+  EXPECT_EQ(item, 7);
+}
+
+TEST(LockFreeQueue, TryPopForTimesOut) {
+  LockFreeQueue<i32> queue(2);
+  i32 item;
+  EXPECT_FALSE(queue.try_pop(item));
+  EXPECT_FALSE(queue.try_pop_for(item, std::chrono::milliseconds(10)));
+
+  std::thread producer([&] {
+    std::this_thread::sleep_for(SETTLE_TIME);
+    queue.push(3);
+  });
+  EXPECT_TRUE(queue.try_pop_for(item, std::chrono::seconds(10)));
+  EXPECT_EQ(item, 3);
+  producer.join();
+}
+
+TEST(LockFreeQueue, SentinelsWakeSleepingConsumers) {
+  const i32 num_consumers = 4;
+  LockFreeQueue<i32> queue(2);
+  std::atomic<i32> stopped{0};
+  std::vector<std::thread> consumers;
+  for (i32 c = 0; c < num_consumers; ++c) {
+    consumers.emplace_back([&] {
+      i32 item;
+      queue.pop(item);
+      stopped++;
+    });
+  }
+  std::this_thread::sleep_for(SETTLE_TIME);
+  EXPECT_EQ(stopped, 0);
+
+  // More sentinels than the queue holds, so pushes also have to wait on the
+  // consumers
+  for (i32 c = 0; c < num_consumers; ++c) {
+    queue.push(-1);
+  }
+  for (std::thread& consumer : consumers) {
+    consumer.join();
+  }
+  EXPECT_EQ(stopped, num_consumers);
+}
+
+TEST(LockFreeQueue, ClearWakesSleepingProducers) {
+  LockFreeQueue<i32> queue(2);
+  queue.push(0);
+  queue.push(1);
+  std::thread producer([&] { queue.push(2); });
+  std::this_thread::sleep_for(SETTLE_TIME);
+
+  queue.clear();
+  producer.join();
+  i32 item;
+  ASSERT_TRUE(queue.try_pop(item));
+  EXPECT_EQ(item, 2);
+  EXPECT_FALSE(queue.try_pop(item));
+}
+
+TEST(LockFreeQueue, HoldsAtLeastTwoItems) {
+  LockFreeQueue<i32> queue(1);
+  EXPECT_EQ(queue.capacity(), 2);
+  queue.push(0);
+  queue.push(1);
+  i32 item;
+  queue.pop(item);
+  EXPECT_EQ(item, 0);
+  queue.pop(item);
+  EXPECT_EQ(item, 1);
+}
+
+TEST(LockFreeQueue, WaitUntilEmpty) {
+  LockFreeQueue<i32> queue(4);
+  queue.push(0);
+  queue.push(1);
+
+  std::atomic<bool> empty{false};
+  std::thread waiter([&] {
+    queue.wait_until_empty();
+    empty = true;
+  });
+  std::this_thread::sleep_for(SETTLE_TIME);
+  EXPECT_FALSE(empty);
+
+  i32 item;
+  queue.pop(item);
+  queue.pop(item);
+  waiter.join();
+  EXPECT_TRUE(empty);
+}
+
+}
@@ -0,0 +1,212 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/memory.h"
+#include "scanner/util/queue.h"
+
+#include <gtest/gtest.h>
+
+#include <sys/sysinfo.h>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <tuple>
+
+namespace scanner {
+
+// The pool is kept small so that tests can fill it
+static const size_t POOL_SIZE = 128 * 1024 * 1024;
+static const size_t MB = 1024 * 1024;
+
+class MemoryTest : public ::testing::Test {
+ protected:
+  void TearDown() { destroy_memory_allocators(); }
+
+  void init_pool(f32 soft_limit = 0, size_t overflow_size = 0) {
+    struct sysinfo info;
+    ASSERT_EQ(sysinfo(&info), 0);
+    MemoryPoolConfig config;
+    config.mutable_cpu()->set_use_pool(true);
+    config.mutable_cpu()->set_free_space(info.totalram - POOL_SIZE);
+    config.mutable_cpu()->set_soft_limit(soft_limit);
+    config.mutable_cpu()->set_overflow_size(overflow_size);
+    init_memory_allocators(config, {});
+  }
+};
+
+using MemoryDeathTest = MemoryTest;
+
+TEST_F(MemoryTest, PoolCoalescesFreedBlocks) {
+  init_pool();
+
+  const std::vector<size_t> sizes = {256 * 1024, MB, 4 * MB};
+  std::vector<u8*> buffers;
+  size_t total = 0;
+  for (i32 i = 0; total + sizes.back() <= POOL_SIZE; ++i) {
+    size_t size = sizes[i % sizes.size()];
+    buffers.push_back(new_block_buffer(CPU_DEVICE, size, 1));
+    total += size;
+  }
+  std::shuffle(buffers.begin(), buffers.end(), std::mt19937(0));
+  for (u8* buffer : buffers) {
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+
+  // Only fits if every block merged back with its buddy
+  u8* buffer = new_block_buffer(CPU_DEVICE, POOL_SIZE, 1);
+  delete_buffer(CPU_DEVICE, buffer);
+}
+
+TEST_F(MemoryTest, PoolHandsBackEndOfLargeBlocks) {
+  init_pool();
+
+  // Rounded up to a power of two, this would take the whole pool
+  u8* large = new_block_buffer(CPU_DEVICE, POOL_SIZE / 2 + MB, 1);
+  std::vector<u8*> buffers;
+  for (i32 i = 0; i < 7; ++i) {
+    buffers.push_back(new_block_buffer(CPU_DEVICE, 8 * MB, 1));
+  }
+  delete_buffer(CPU_DEVICE, large);
+  for (u8* buffer : buffers) {
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+
+  u8* buffer = new_block_buffer(CPU_DEVICE, POOL_SIZE, 1);
+  delete_buffer(CPU_DEVICE, buffer);
+}
+
+TEST_F(MemoryTest, PoolOverflowsWhenFull) {
+  init_pool(0, 64 * MB);
+
+  u8* pool = new_block_buffer(CPU_DEVICE, POOL_SIZE, 1);
+  u8* overflow = new_block_buffer(CPU_DEVICE, 32 * MB, 1);
+  std::memset(overflow, 1, 32 * MB);
+  delete_buffer(CPU_DEVICE, overflow);
+  delete_buffer(CPU_DEVICE, pool);
+}
+
+TEST_F(MemoryDeathTest, PoolRunsOut) {
+  init_pool();
+
+  u8* pool = new_block_buffer(CPU_DEVICE, POOL_SIZE, 1);
+  EXPECT_DEATH(new_block_buffer(CPU_DEVICE, MB, 1), "Exceeded pool size");
+  delete_buffer(CPU_DEVICE, pool);
+}
+
+TEST_F(MemoryTest, SystemBuffersAreOutsidePool) {
+  init_pool(0.1);
+
+  u8* buffer = new_buffer(CPU_DEVICE, 2 * POOL_SIZE);
+  std::memset(buffer, 1, 2 * POOL_SIZE);
+  EXPECT_FALSE(memory_over_soft_limit());
+  delete_buffer(CPU_DEVICE, buffer);
+}
+
+TEST_F(MemoryTest, BlockBuffersFromManyThreads) {
+  init_pool();
+
+  // Half of the buffers are freed by another thread than the one which
+  // allocated them, which puts them into a different thread cache
+  using Freed = std::tuple<u8*, size_t, u8>;
+  Queue<Freed> to_free;
+  std::thread freer([&] {
+    Freed item;
+    while (true) {
+      to_free.pop(item);
+      u8* buffer = std::get<0>(item);
+      if (buffer == nullptr) {
+        break;
+      }
+      for (size_t i = 0; i < std::get<1>(item); i += 4096) {
+        ASSERT_EQ(buffer[i], std::get<2>(item));
+      }
+      delete_buffer(CPU_DEVICE, buffer);
+    }
+  });
+
+  const i32 num_threads = 8;
+  std::vector<std::thread> threads;
+  for (i32 t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 gen(t);
+      // Power of two sizes go to the buddy allocator and odd ones to slabs
+      const std::vector<size_t> sizes = {64 * 1024, 100 * 1024, 256 * 1024,
+                                         700 * 1024, MB};
+      std::vector<Freed> live;
+      for (i32 i = 0; i < 2000; ++i) {
+        size_t size = sizes[gen() % sizes.size()];
+        u8 value = (u8)(t * 16 + i % 16);
+        u8* buffer = new_block_buffer(CPU_DEVICE, size, 1);
+        std::memset(buffer, value, size);
+        live.emplace_back(buffer, size, value);
+        if (live.size() < 4) {
+          continue;
+        }
+        Freed item = live[gen() % live.size()];
+        live.erase(std::find(live.begin(), live.end(), item));
+        if (gen() % 2 == 0) {
+          to_free.push(item);
+          continue;
+        }
+        for (size_t j = 0; j < std::get<1>(item); j += 4096) {
+          ASSERT_EQ(std::get<0>(item)[j], std::get<2>(item));
+        }
+        delete_buffer(CPU_DEVICE, std::get<0>(item));
+      }
+      for (Freed& item : live) {
+        delete_buffer(CPU_DEVICE, std::get<0>(item));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  to_free.push(Freed(nullptr, 0, 0));
+  freer.join();
+}
+
+TEST_F(MemoryTest, BlockCachesAreFlushedWhenPoolIsFull) {
+  init_pool();
+
+  // Fill the caches of other threads with freed blocks
+  std::vector<std::thread> threads;
+  for (i32 t = 0; t < 16; ++t) {
+    threads.emplace_back([] {
+      u8* buffer = new_block_buffer(CPU_DEVICE, MB, 1);
+      delete_buffer(CPU_DEVICE, buffer);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  // The pool is a single block which is only free once the caches are
+  for (i32 i = 0; i < 2; ++i) {
+    u8* buffer = new_block_buffer(CPU_DEVICE, POOL_SIZE, 1);
+    delete_buffer(CPU_DEVICE, buffer);
+  }
+}
+
+TEST_F(MemoryTest, CachedBlocksAreUnderSoftLimit) {
+  init_pool(0.1);
+
+  u8* buffer = new_block_buffer(CPU_DEVICE, 16 * MB, 1);
+  EXPECT_TRUE(memory_over_soft_limit());
+  delete_buffer(CPU_DEVICE, buffer);
+  EXPECT_FALSE(memory_over_soft_limit());
+}
+
+}
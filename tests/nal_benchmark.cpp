@@ -0,0 +1,223 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares the start code scanner and bit reader of scanner/util/h264.h
+// against byte at a time and bit at a time versions over the test videos:
+//   next_nal:      splitting the whole bytestream into NAL units
+//   slice headers: reading the exp-Golomb fields at the start of each slice
+// and the throughput of the ingest index creator built on them:
+//   feed_packet:   indexing the packets the demuxer splits the videos into
+
+#include "scanner/util/common.h"
+#include "scanner/util/fs.h"
+#include "scanner/util/h264.h"
+#include "scanner/util/storehouse.h"
+#include "scanner/util/util.h"
+#include "scanner/video/h264_byte_stream_index_creator.h"
+#include "tests/videos.h"
+
+extern "C" {
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+namespace scanner {
+namespace {
+
+const i32 ITERATIONS = 20;
+// Exp-Golomb fields read from the start of each slice header
+const i32 SLICE_FIELDS = 4;
+
+void bytewise_next_nal(const u8*& buffer, i32& buffer_size_left,
+                       const u8*& nal_start, i32& nal_size) {
+  bool found = false;
+  while (buffer_size_left > 2) {
+    if (buffer[0] == 0x00 && buffer[1] == 0x00 && buffer[2] == 0x01) {
+      found = true;
+      break;
+    }
+    buffer++;
+    buffer_size_left--;
+  }
+  buffer += 3;
+  buffer_size_left -= 3;
+  nal_start = buffer;
+  nal_size = 0;
+  if (!found) {
+    return;
+  }
+  while (buffer_size_left > 2 &&
+         !(buffer[0] == 0x00 && buffer[1] == 0x00 &&
+           (buffer[2] == 0x00 || buffer[2] == 0x01))) {
+    buffer++;
+    buffer_size_left--;
+    nal_size++;
+  }
+  if (!(buffer_size_left > 3)) {
+    nal_size += buffer_size_left;
+  }
+}
+
+u32 bitwise_get_ue_golomb(GetBitsState& gb) {
+  i32 zeros = 0;
+  while (0 == get_bit(gb)) {
+    zeros++;
+  }
+  u32 info = 1 << zeros;
+  for (i32 i = zeros - 1; i >= 0; i--) {
+    info |= get_bit(gb) << i;
+  }
+  return (info - 1);
+}
+
+template <typename NextNal>
+std::vector<const u8*> split_nals(const std::vector<u8>& video,
+                                  NextNal next) {
+  std::vector<const u8*> slices;
+  const u8* buffer = video.data();
+  i32 size_left = video.size();
+  while (size_left > 3) {
+    const u8* nal_start;
+    i32 nal_size;
+    next(buffer, size_left, nal_start, nal_size);
+    if (size_left >= 0 && nal_size > 8 &&
+        is_vcl_nal(get_nal_unit_type(nal_start))) {
+      slices.push_back(nal_start);
+    }
+  }
+  return slices;
+}
+
+template <typename NextNal>
+f64 bench_next_nal(const std::vector<u8>& video, NextNal next,
+                   size_t& slices) {
+  auto start = now();
+  for (i32 i = 0; i < ITERATIONS; ++i) {
+    slices = split_nals(video, next).size();
+  }
+  f64 seconds = nano_since(start) / 1e9;
+  return video.size() * (f64)ITERATIONS / seconds / (1024 * 1024);
+}
+
+template <typename GetUe>
+f64 bench_slice_headers(const std::vector<const u8*>& slices, GetUe get_ue,
+                        u64& checksum) {
+  checksum = 0;
+  auto start = now();
+  for (i32 i = 0; i < ITERATIONS; ++i) {
+    for (const u8* slice : slices) {
+      GetBitsState gb;
+      gb.buffer = slice;
+      gb.offset = 8;
+      for (i32 f = 0; f < SLICE_FIELDS; ++f) {
+        checksum += get_ue(gb);
+      }
+    }
+  }
+  f64 seconds = nano_since(start) / 1e9;
+  return slices.size() * (f64)ITERATIONS / seconds;
+}
+
+std::vector<std::vector<u8>> demux_packets(const std::string& path) {
+  AVFormatContext* format_context = nullptr;
+  LOG_IF(FATAL, avformat_open_input(&format_context, path.c_str(), nullptr,
+                                    nullptr) < 0)
+      << "Could not open " << path;
+  std::vector<std::vector<u8>> packets;
+  AVPacket packet;
+  av_init_packet(&packet);
+  while (av_read_frame(format_context, &packet) >= 0) {
+    packets.emplace_back(packet.data, packet.data + packet.size);
+    av_packet_unref(&packet);
+  }
+  avformat_close_input(&format_context);
+  return packets;
+}
+
+f64 bench_feed_packet(const std::vector<std::vector<u8>>& packets) {
+  std::unique_ptr<storehouse::StorageConfig> config(
+      storehouse::StorageConfig::make_posix_config());
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(config.get()));
+  std::string path;
+  temp_file(path);
+  size_t bytes = 0;
+  f64 seconds = 0;
+  for (i32 i = 0; i < ITERATIONS; ++i) {
+    std::unique_ptr<storehouse::WriteFile> file;
+    BACKOFF_FAIL(storehouse::make_unique_write_file(storage.get(), path, file));
+    internal::H264ByteStreamIndexCreator index_creator(file.get());
+    auto start = now();
+    for (const std::vector<u8>& packet : packets) {
+      LOG_IF(FATAL,
+             !index_creator.feed_packet((u8*)packet.data(), packet.size()))
+          << index_creator.error_message();
+      bytes += packet.size();
+    }
+    seconds += nano_since(start) / 1e9;
+  }
+  std::remove(path.c_str());
+  return bytes / seconds / (1024 * 1024);
+}
+}
+}
+
+int main(int argc, char** argv) {
+  using namespace scanner;
+  struct Video {
+    const char* name;
+    const TestVideoInfo& info;
+  };
+  std::vector<Video> videos = {{"short", short_video}, {"long", long_video}};
+  av_register_all();
+
+  printf("%-6s %-14s %16s %16s %8s\n", "video", "benchmark", "bytewise",
+         "h264.h", "speedup");
+  for (auto& video : videos) {
+    std::string path = download_video(video.info);
+    std::vector<u8> bytes = read_entire_file(path);
+
+    size_t reference_slices;
+    size_t slices;
+    f64 reference_rate =
+        bench_next_nal(bytes, bytewise_next_nal, reference_slices);
+    f64 rate = bench_next_nal(bytes, next_nal, slices);
+    LOG_IF(FATAL, slices != reference_slices)
+        << "next_nal found " << slices << " slices instead of "
+        << reference_slices;
+    printf("%-6s %-14s %11.0f MB/s %11.0f MB/s %8.2f\n", video.name,
+           "next_nal", reference_rate, rate, rate / reference_rate);
+
+    std::vector<const u8*> slice_starts = split_nals(bytes, next_nal);
+    u64 reference_checksum;
+    u64 checksum;
+    reference_rate = bench_slice_headers(slice_starts, bitwise_get_ue_golomb,
+                                         reference_checksum);
+    rate = bench_slice_headers(slice_starts, get_ue_golomb, checksum);
+    LOG_IF(FATAL, checksum != reference_checksum)
+        << "get_ue_golomb read different slice headers";
+    printf("%-6s %-14s %10.0f hdr/s %10.0f hdr/s %8.2f\n", video.name,
+           "slice headers", reference_rate, rate, rate / reference_rate);
+
+    rate = bench_feed_packet(demux_packets(path));
+    printf("%-6s %-14s %16s %11.0f MB/s %8s\n", video.name, "feed_packet",
+           "-", rate, "-");
+  }
+  return 0;
+}
@@ -0,0 +1,328 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs a fixed set of pipelines over the test videos in tests/videos.h with
+// a master and worker in this process, and prints one JSON object per line
+// for each pipeline:
+//   {"pipeline": ..., "job": ..., "frames": ..., "seconds": ..., "fps": ...,
+//    "memory": {<tag>: {"cpu_peak": ..., "gpu_peak": ...}, ...}}
+// Memory peaks are the high-water marks of the job, by the stage or kernel
+// that allocated. The job profiles stay in the database for a per-stage
+// breakdown, which tests/pipeline_benchmark.py adds.
+//
+// Usage: PipelineBenchmark [db_path [net_descriptor]]
+// The Caffe pipeline only runs when given a serialized NetDescriptor.
+
+#include "scanner/api/database.h"
+#include "scanner/api/op.h"
+#include "scanner/engine/metadata.h"
+#include "scanner/util/common.h"
+#include "scanner/util/fs.h"
+#include "scanner/util/memory.h"
+#include "scanner/util/util.h"
+#include "stdlib/stdlib.pb.h"
+#include "tests/videos.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <vector>
+
+namespace scanner {
+namespace {
+
+const std::vector<std::string> TABLES = {"short", "long"};
+// Rows of each table the optical flow pipeline computes
+const i64 FLOW_ROWS = 300;
+// Stride between the rows of the sparse gather pipeline
+const i64 GATHER_STRIDE = 97;
+
+struct Pipeline {
+  std::string name;
+  // Pipeline from the input op to the op the output saves
+  std::function<Op*(Op*)> build;
+  // Column of that op the output saves
+  std::string output_column;
+  // Task over a table with the given number of rows
+  std::function<Task(const std::string&, i64)> task;
+};
+
+template <typename T>
+std::vector<u8> serialize(const T& message) {
+  std::vector<u8> data(message.ByteSize());
+  message.SerializeToArray(data.data(), data.size());
+  return data;
+}
+
+Op* make_op(const std::string& name, const std::vector<OpInput>& inputs,
+            DeviceType device_type,
+            const std::vector<u8>& args = std::vector<u8>()) {
+  char* buffer = nullptr;
+  if (!args.empty()) {
+    buffer = new char[args.size()];
+    std::copy(args.begin(), args.end(), buffer);
+  }
+  return new Op(name, inputs, device_type, buffer, args.size());
+}
+
+Op* discard(Op* input, const std::string& column) {
+  return make_op("DiscardFrame", {OpInput(input, {column})}, DeviceType::CPU);
+}
+
+Task all_task(const std::string& table, i64 num_rows) {
+  Task task;
+  task.output_table_name = "benchmark_" + table;
+  TableSample sample;
+  sample.table_name = table;
+  sample.column_names = {"index", "frame"};
+  sample.sampling_function = "All";
+  task.samples.push_back(sample);
+  return task;
+}
+
+Task flow_task(const std::string& table, i64 num_rows) {
+  Task task = all_task(table, num_rows);
+  TableSample& sample = task.samples[0];
+  sample.sampling_function = "StridedRange";
+  proto::StridedRangeSamplerArgs args;
+  args.set_stride(1);
+  args.add_warmup_starts(0);
+  args.add_starts(0);
+  args.add_ends(std::min(num_rows, FLOW_ROWS));
+  sample.sampling_args = serialize(args);
+  return task;
+}
+
+Task gather_task(const std::string& table, i64 num_rows) {
+  Task task = all_task(table, num_rows);
+  TableSample& sample = task.samples[0];
+  sample.sampling_function = "Gather";
+  proto::GatherSamplerArgs args;
+  auto& gather_sample = *args.add_samples();
+  for (i64 r = 0; r < num_rows; r += GATHER_STRIDE) {
+    gather_sample.add_rows(r);
+  }
+  sample.sampling_args = serialize(args);
+  return task;
+}
+
+// Rows a task samples from a table with the given number of rows
+i64 task_rows(const Task& task, i64 num_rows) {
+  const TableSample& sample = task.samples[0];
+  if (sample.sampling_function == "StridedRange") {
+    return std::min(num_rows, FLOW_ROWS);
+  } else if (sample.sampling_function == "Gather") {
+    return (num_rows + GATHER_STRIDE - 1) / GATHER_STRIDE;
+  }
+  return num_rows;
+}
+
+std::vector<Pipeline> pipelines(const std::string& net_descriptor_path) {
+  std::vector<Pipeline> result;
+  result.push_back({"decode", [](Op* input) { return discard(input, "frame"); },
+                    "dummy", all_task});
+
+  std::vector<DeviceType> devices = {DeviceType::CPU};
+#ifdef HAVE_CUDA
+  devices.push_back(DeviceType::GPU);
+#endif
+  for (DeviceType device : devices) {
+    std::string suffix = device == DeviceType::CPU ? "" : "_gpu";
+    result.push_back({"histogram" + suffix,
+                      [device](Op* input) {
+                        return make_op("Histogram",
+                                       {OpInput(input, {"frame"})}, device);
+                      },
+                      "histogram", all_task});
+    result.push_back(
+        {"resize" + suffix,
+         [device](Op* input) {
+           proto::ResizeArgs args;
+           args.set_width(224);
+           args.set_height(224);
+           return discard(make_op("Resize", {OpInput(input, {"frame"})},
+                                  device, serialize(args)),
+                          "frame");
+         },
+         "dummy", all_task});
+  }
+
+  if (!net_descriptor_path.empty()) {
+    proto::CaffeArgs caffe_args;
+    std::vector<u8> descriptor = read_entire_file(net_descriptor_path);
+    LOG_IF(FATAL, !caffe_args.mutable_net_descriptor()->ParseFromArray(
+                      descriptor.data(), descriptor.size()))
+        << "Could not parse the net descriptor " << net_descriptor_path;
+    caffe_args.set_batch_size(8);
+#ifdef HAVE_CUDA
+    DeviceType device = DeviceType::GPU;
+#else
+    DeviceType device = DeviceType::CPU;
+#endif
+    std::vector<u8> args = serialize(caffe_args);
+    result.push_back({"caffe",
+                      [device, args](Op* input) {
+                        Op* caffe_input = make_op(
+                            "CaffeInput", {OpInput(input, {"frame"})},
+                            device, args);
+                        Op* caffe = make_op(
+                            "Caffe", {OpInput(caffe_input, {"caffe_frame"})},
+                            device, args);
+                        return discard(caffe, "caffe_output");
+                      },
+                      "dummy", all_task});
+  }
+
+  result.push_back({"optical_flow",
+                    [](Op* input) {
+                      return discard(
+                          make_op("OpticalFlow", {OpInput(input, {"frame"})},
+                                  DeviceType::CPU),
+                          "flow");
+                    },
+                    "dummy", flow_task});
+  result.push_back({"sparse_gather",
+                    [](Op* input) {
+                      return make_op("Histogram", {OpInput(input, {"frame"})},
+                                     DeviceType::CPU);
+                    },
+                    "histogram", gather_task});
+  return result;
+}
+
+JobParameters default_job_params() {
+  JobParameters params;
+  params.pipeline_instances_per_node = -1;
+  params.work_item_size = 250;
+  params.load_sparsity_threshold = 8;
+  params.tasks_in_queue_per_pu = 4;
+  params.read_coalesce_gap = 256 * 1024;
+  params.load_read_parallelism = 4;
+  params.load_mmap = false;
+  params.direct_reads = false;
+  params.load_readahead_items = 2;
+  params.load_readahead_size = 512 * 1024 * 1024;
+  params.save_upload_parallelism = 8;
+  params.save_upload_size = 1024 * 1024 * 1024;
+  params.pack_output_items = false;
+  params.decode_width = 0;
+  params.decode_height = 0;
+  params.decode_parallelism = 1;
+  params.encode_parallelism = 1;
+  params.codec_threads = 0;
+  params.codec_slice_threads = false;
+  params.gpu_decode_surfaces = 0;
+  params.balance_gpu_decode = false;
+  params.batch_latency_ms = 0;
+  params.cpu_pipeline_instances = 0;
+  params.priority = 1;
+  return params;
+}
+
+void run_pipeline(Database& db, const Pipeline& pipeline,
+                  const std::map<std::string, i64>& table_rows) {
+  JobParameters params = default_job_params();
+  params.job_name = "benchmark_" + pipeline.name;
+  Op* input = make_input_op({"index", "frame"});
+  Op* output = make_output_op(
+      {OpInput(pipeline.build(input), {pipeline.output_column})});
+  params.task_set.output_op = output;
+  OutputColumnCompression compression;
+  compression.codec = "default";
+  params.task_set.compression.push_back(compression);
+  i64 frames = 0;
+  for (auto& kv : table_rows) {
+    Task task = pipeline.task(kv.first, kv.second);
+    task.output_table_name += "_" + pipeline.name;
+    frames += task_rows(task, kv.second);
+    params.task_set.tasks.push_back(task);
+  }
+
+  auto start = now();
+  Result result = db.new_job(params);
+  f64 seconds = nano_since(start) / 1e9;
+  LOG_IF(FATAL, !result.success())
+      << "Pipeline " << pipeline.name << " failed: " << result.msg();
+
+  // Peaks were reset when the job started
+  std::map<std::string, std::map<std::string, i64>> memory;
+  for (const MemoryUsage& usage : memory_usage()) {
+    memory[usage.tag][usage.device_type == DeviceType::CPU ? "cpu_peak"
+                                                           : "gpu_peak"] =
+        usage.peak_bytes;
+  }
+  printf("{\"pipeline\": \"%s\", \"job\": \"%s\", \"frames\": %ld, "
+         "\"seconds\": %.3f, \"fps\": %.2f, \"memory\": {",
+         pipeline.name.c_str(), params.job_name.c_str(), frames, seconds,
+         frames / seconds);
+  bool first_tag = true;
+  for (auto& tag : memory) {
+    printf("%s\"%s\": {", first_tag ? "" : ", ", tag.first.c_str());
+    bool first_kind = true;
+    for (auto& kind : tag.second) {
+      printf("%s\"%s\": %ld", first_kind ? "" : ", ", kind.first.c_str(),
+             kind.second);
+      first_kind = false;
+    }
+    printf("}");
+    first_tag = false;
+  }
+  printf("}}\n");
+  fflush(stdout);
+}
+}
+}
+
+int main(int argc, char** argv) {
+  using namespace scanner;
+  std::string db_path;
+  if (argc > 1) {
+    db_path = argv[1];
+  } else {
+    temp_dir(db_path);
+  }
+  std::string net_descriptor_path = argc > 2 ? argv[2] : "";
+
+  std::unique_ptr<storehouse::StorageConfig> sc(
+      storehouse::StorageConfig::make_posix_config());
+  Database db(sc.get(), db_path, "localhost:5001");
+  std::vector<FailedVideo> failed_videos;
+  Result result = db.ingest_videos(
+      TABLES, {download_video(short_video), download_video(long_video)},
+      failed_videos);
+  LOG_IF(FATAL, !result.success() || !failed_videos.empty())
+      << "Failed to ingest the test videos";
+
+  std::unique_ptr<storehouse::StorageBackend> storage(
+      storehouse::StorageBackend::make_from_config(sc.get()));
+  std::map<std::string, i64> table_rows;
+  for (i32 table_id = 0; table_id < (i32)TABLES.size(); ++table_id) {
+    internal::TableMetadata table = internal::read_table_metadata(
+        storage.get(), internal::TableMetadata::descriptor_path(table_id));
+    table_rows[table.name()] = table.num_rows();
+  }
+
+  MachineParameters machine_params = default_machine_params();
+  db.start_master(machine_params, "5001", false);
+  db.start_worker(machine_params, "5002", false);
+  for (const Pipeline& pipeline : pipelines(net_descriptor_path)) {
+    run_pipeline(db, pipeline, table_rows);
+  }
+  db.shutdown_master();
+  db.shutdown_worker();
+  db.wait_for_server_shutdown();
+  return 0;
+}
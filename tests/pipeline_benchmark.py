@@ -0,0 +1,146 @@
+"""
+Runs the pipeline benchmarks of PipelineBenchmark (pipeline_benchmark.cpp)
+and writes a JSON report of the throughput, memory high-water marks and
+per-stage breakdown of each pipeline.
+
+Given the report of an earlier run as a baseline, exits with an error if any
+pipeline got slower by more than the tolerance, so that throughput
+regressions show up before a release.
+
+Usage:
+    python tests/pipeline_benchmark.py --output report.json
+    python tests/pipeline_benchmark.py --baseline report.json
+
+The Caffe pipeline runs when the model of the --net descriptor has been
+downloaded, e.g. with nets/get_googlenet.sh.
+"""
+
+from scannerpy import Database, Config, NetDescriptor
+from subprocess import check_output
+import argparse
+import json
+import os
+import shutil
+import sys
+import tempfile
+import toml
+
+cwd = os.path.dirname(os.path.abspath(__file__))
+repo = os.path.dirname(cwd)
+
+
+def make_config(db_path):
+    cfg = Config.default_config()
+    cfg['storage']['db_path'] = db_path
+    with tempfile.NamedTemporaryFile(delete=False, suffix='.toml') as f:
+        f.write(toml.dumps(cfg))
+        return f.name
+
+
+def net_descriptor(cfg_path, net_path):
+    """Returns the path of the serialized descriptor of a net, or None."""
+    with open(net_path) as f:
+        if not os.path.isfile(os.path.join(repo, toml.loads(
+                f.read())['net']['model'])):
+            return None
+    with Database(config_path=cfg_path) as db:
+        descriptor = NetDescriptor.from_file(db, net_path).as_proto()
+        with tempfile.NamedTemporaryFile(delete=False, suffix='.bin') as f:
+            f.write(descriptor.SerializeToString())
+            return f.name
+
+
+def stage_breakdown(profiler):
+    utilization = profiler.utilization()
+    bottleneck = profiler.bottleneck()
+    return {
+        'stages': {str(node): stages
+                   for (node, stages) in utilization.iteritems()},
+        'bottleneck': {str(node): stage
+                       for (node, stage) in bottleneck.iteritems()}
+    }
+
+
+def run(harness, net_path):
+    db_path = tempfile.mkdtemp()
+    cfg_path = make_config(db_path)
+    descriptor_path = None
+    try:
+        args = [harness, db_path]
+        if net_path:
+            descriptor_path = net_descriptor(cfg_path, net_path)
+            if descriptor_path is None:
+                print('Skipping the Caffe pipeline, {} has no model'.format(
+                    net_path))
+            else:
+                args.append(descriptor_path)
+        output = check_output(args, cwd=repo)
+        results = {}
+        for line in output.splitlines():
+            if line.startswith('{'):
+                result = json.loads(line)
+                results[result['pipeline']] = result
+        with Database(config_path=cfg_path) as db:
+            for result in results.itervalues():
+                result.update(stage_breakdown(db.profiler(result['job'])))
+        return results
+    finally:
+        shutil.rmtree(db_path, ignore_errors=True)
+        os.remove(cfg_path)
+        if descriptor_path is not None:
+            os.remove(descriptor_path)
+
+
+def regressions(results, baseline, tolerance):
+    """Lists the pipelines slower than in baseline by more than tolerance."""
+    slower = []
+    for name, expected in baseline.iteritems():
+        if name not in results:
+            continue
+        fps = results[name]['fps']
+        if fps < expected['fps'] * (1 - tolerance):
+            slower.append('{}: {:.2f} fps, baseline {:.2f} fps'.format(
+                name, fps, expected['fps']))
+    return slower
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__.strip().split('\n\n')[0])
+    parser.add_argument(
+        '--harness',
+        default=os.path.join(repo, 'build', 'tests', 'PipelineBenchmark'),
+        help='Path of the PipelineBenchmark binary')
+    parser.add_argument(
+        '--net', default=os.path.join(repo, 'nets', 'googlenet.toml'),
+        help='Net descriptor of the Caffe pipeline')
+    parser.add_argument('--output', help='Path to write the report to')
+    parser.add_argument('--baseline', help='Report to compare against')
+    parser.add_argument(
+        '--tolerance', type=float, default=0.1,
+        help='Fraction of the baseline throughput a pipeline may lose')
+    args = parser.parse_args()
+
+    results = run(args.harness, args.net)
+    report = json.dumps(results, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(report)
+    else:
+        print(report)
+
+    for name in sorted(results):
+        print('{:>16} {:10.2f} fps'.format(name, results[name]['fps']))
+
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        slower = regressions(results, baseline, args.tolerance)
+        for line in slower:
+            print('Regression in {}'.format(line))
+        if len(slower) > 0:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
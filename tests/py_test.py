@@ -1,6 +1,8 @@
 from scannerpy import Database, Config, DeviceType, Job
 from scannerpy.stdlib import parsers
 import tempfile
+import glob
+import time
 import toml
 import pytest
 from subprocess import check_call as run
@@ -124,8 +126,34 @@ def test_collection(db):
         columns = [db.ops.Histogram(frame = frame)],
         name = '_ignore')
     db.run(job, show_progress=False, force=True)
+    loaded = dict((t.name(), rows) for (t, rows) in c.load(['index']))
+    assert len(loaded['test1']) == db.table('test1').num_rows()
     db.delete_collection('test')
 
+def test_keyframe_samplers(db):
+    table = db.table('test1')
+    frame = table.as_op().all(task_size=100, align_keyframes=True)
+    job = Job(
+        columns = [db.ops.Histogram(frame = frame)],
+        name = '_ignore')
+    output = db.run(job, show_progress=False, force=True)
+    assert output.num_rows() == table.num_rows()
+
+    frame = table.as_op().nearest_keyframes([0, 1, 2, 300, 301, 719])
+    job = Job(
+        columns = [db.ops.Histogram(frame = frame)],
+        name = '_ignore')
+    output = db.run(job, show_progress=False, force=True)
+    assert 0 < output.num_rows() <= 3
+
+    frame = table.as_op().time(1)
+    job = Job(
+        columns = [db.ops.Histogram(frame = frame)],
+        name = '_ignore')
+    output = db.run(job, show_progress=False, force=True)
+    # One frame a second of a 720 frame video
+    assert 20 <= output.num_rows() <= 30
+
 def test_summarize(db):
     db.summarize()
 
@@ -139,6 +167,67 @@ def test_load_video_column(db):
 def test_load_video_column(db):
     next(db.table('test1').load(['frame']))
 
+def test_load_frames(db):
+    rows = [0, 10, 100, 200]
+    frames = db.table('test1').column('frame').load_frames(rows=rows)
+    assert frames.shape[0] == len(rows) and frames.shape[3] == 3
+
+def test_export(db):
+    pq = pytest.importorskip('pyarrow.parquet')
+    table = db.table('test1')
+    with tempfile.NamedTemporaryFile(suffix='.parquet') as f:
+        table.export(f.name, columns=['index'])
+        exported = pq.read_table(f.name)
+    assert exported.column_names == ['row', 'index']
+    assert exported.num_rows == table.num_rows()
+
+def test_table_writer(db):
+    features = np.arange(1000 * 4, dtype=np.float32).reshape((1000, 4))
+    names = [str(i) for i in range(1000)]
+    writer = db.table_writer('test_writer', ['features', 'name'],
+                             rows_per_item=300, force=True)
+    writer.write_chunks([(features[i:i + 70], names[i:i + 70])
+                         for i in range(0, 1000, 70)])
+    table = writer.commit()
+    assert table.num_rows() == 1000
+    assert (table.column('features').load_array() == features).all()
+    assert [n for _, n in table.column('name').load()] == names
+    db.delete_table('test_writer')
+
+def test_vector_index(db):
+    rng = np.random.RandomState(0)
+    embeddings = rng.randn(2000, 16).astype(np.float32)
+    with db.table_writer('test_embeddings', ['embedding'],
+                         force=True) as writer:
+        writer.write([embeddings])
+    column = db.table('test_embeddings').column('embedding')
+    column.build_index(num_lists=8, num_subquantizers=4)
+    rows, distances = column.search(embeddings[[5, 1234]], k=10,
+                                    num_probes=8)
+    assert rows.shape == (2, 10)
+    assert 5 in rows[0] and 1234 in rows[1]
+    assert (np.diff(distances, axis=1) >= 0).all()
+    db.delete_table('test_embeddings')
+
+    # Indexes over Other columns of raw embeddings are deleted with the table
+    # as well
+    db.new_table('test_raw_embeddings', ['embedding'],
+                 [[e.tobytes()] for e in embeddings[:500]], force=True)
+    table = db.table('test_raw_embeddings')
+    column = table.column('embedding')
+    column.build_index(dimension=16, num_lists=4, num_subquantizers=4)
+    rows, _ = column.search(embeddings[[7]], k=5, num_probes=4)
+    assert 7 in rows[0]
+    index_files = os.path.join(db.config.db_path, 'tables', str(table.id()),
+                               '{}_index*.bin'.format(column.id()))
+    assert len(glob.glob(index_files)) > 1
+    db.delete_table('test_raw_embeddings')
+    # The master deletes the files between jobs, every few seconds
+    deadline = time.time() + 60
+    while glob.glob(index_files) and time.time() < deadline:
+        time.sleep(1)
+    assert glob.glob(index_files) == []
+
 def test_profiler(db):
     frame = db.table('test1').as_op().all()
     job = Job(
@@ -175,6 +264,8 @@ class TestHistogram:
     def run(self, db, job):
         table = db.run(job, force=True, show_progress=False)
         next(table.load([1], parsers.histograms))
+        histograms = table.column(1).load_array()
+        assert histograms.shape == (table.num_rows(), 3, 16)
 
 # @builder
 # class TestOpticalFlow:
@@ -216,6 +307,67 @@ def test_lossless(db):
     table = db.run(job, force=True, show_progress=False)
     next(table.load(['frame']))
 
+def test_local_tables(db):
+    frame = db.table('test1').as_op().range(0, 30, task_size=10)
+    blurred_frame = db.ops.Blur(frame = frame, kernel_size = 3)
+    job = Job(columns = [blurred_frame], name = 'test_blur_local')
+    local = db.run(job, force=True, show_progress=False, local_tables=True)
+    assert local._descriptor.local_items
+    assert len(local._descriptor.item_nodes) == 3
+
+    frame = local.as_op().all()
+    histogram = db.ops.Histogram(frame = frame)
+    job = Job(columns = [histogram], name = 'test_hist_local')
+    table = db.run(job, force=True, show_progress=False)
+    assert table.column(1).load_array().shape == (30, 3, 16)
+
+def test_memoize(db):
+    def memo_tables():
+        return set(t.name for t in db._load_db_metadata().tables
+                   if t.name.startswith('__memo_'))
+
+    def run_memoized(kernel_size):
+        frame = db.table('test1').as_op().range(0, 30, task_size=10)
+        blurred_frame = db.ops.Blur(frame = frame, kernel_size = kernel_size,
+                                    sigma = 0.5, memoize = True)
+        histogram = db.ops.Histogram(frame = blurred_frame)
+        job = Job(columns = [histogram], name = 'test_memoize')
+        table = db.run(job, force=True, show_progress=False)
+        assert table.column(1).load_array().shape == (30, 3, 16)
+        return memo_tables() - existing
+
+    existing = memo_tables()
+    # One table per task
+    saved = run_memoized(3)
+    assert len(saved) == 3
+    # The same job reads the tables it saved
+    assert run_memoized(3) == saved
+    # Other args compute the op again
+    assert len(run_memoized(5) - saved) == 3
+    for name in memo_tables() - existing:
+        db.delete_table(name)
+
+def test_resume(db):
+    def run_histogram(**kwargs):
+        frame = db.table('test1').as_op().range(0, 30, task_size=10)
+        histogram = db.ops.Histogram(frame = frame)
+        job = Job(columns = [histogram], name = 'test_resume')
+        return db.run(job, show_progress=False, **kwargs)
+
+    table = run_histogram(force=True)
+    expected = table.column(1).load_array()
+    # A worker that stopped while uploading item 1 left part of its output
+    # and no commit file
+    table_dir = os.path.join(db.config.db_path, 'tables', str(table.id()))
+    os.remove(os.path.join(table_dir, 'item_1_committed.bin'))
+    output = os.path.join(table_dir, '{}_1.bin'.format(table.column(1).id()))
+    with open(output, 'r+b') as f:
+        f.truncate(os.path.getsize(output) // 2)
+    table = run_histogram(resume=True)
+    assert (table.column(1).load_array() == expected).all()
+    assert os.path.exists(os.path.join(table_dir, 'item_1_committed.bin'))
+    db.delete_table('test_resume')
+
 def test_compress(db):
     frame = db.table('test1').as_op().range(0, 30)
     blurred_frame = db.ops.Blur(frame = frame, kernel_size = 3, sigma = 0.1)
@@ -0,0 +1,100 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Compares Queue<T> against LockFreeQueue<T> with the producer/consumer
+// counts used by the worker pipeline:
+//   load_work:          1 producer (main loop)  -> N load workers
+//   eval queues:        1 producer              -> 1 consumer
+//   save_work:          N pipeline instances    -> M save workers
+
+#include "scanner/util/common.h"
+#include "scanner/util/lockfree_queue.h"
+#include "scanner/util/queue.h"
+#include "scanner/util/util.h"
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+namespace scanner {
+namespace {
+
+const i64 ITEMS_PER_PRODUCER = 200000;
+
+template <typename QueueT>
+f64 run_benchmark(i32 producers, i32 consumers, i32 queue_size) {
+  QueueT queue(queue_size);
+  auto start = now();
+  std::vector<std::thread> threads;
+  for (i32 p = 0; p < producers; ++p) {
+    threads.emplace_back([&queue]() {
+      for (i64 i = 0; i < ITEMS_PER_PRODUCER; ++i) {
+        queue.push(i);
+      }
+    });
+  }
+  for (i32 c = 0; c < consumers; ++c) {
+    threads.emplace_back([&queue]() {
+      while (true) {
+        i64 item;
+        queue.pop(item);
+        if (item == -1) {
+          break;
+        }
+      }
+    });
+  }
+  // Wait for producers, then send one sentinel per consumer
+  for (i32 p = 0; p < producers; ++p) {
+    threads[p].join();
+  }
+  for (i32 c = 0; c < consumers; ++c) {
+    queue.push(-1);
+  }
+  for (i32 c = 0; c < consumers; ++c) {
+    threads[producers + c].join();
+  }
+  f64 seconds = nano_since(start) / 1e9;
+  return producers * ITEMS_PER_PRODUCER / seconds;
+}
+}
+}
+
+int main(int argc, char** argv) {
+  using namespace scanner;
+  struct Config {
+    const char* name;
+    i32 producers;
+    i32 consumers;
+  };
+  std::vector<Config> configs = {
+      {"load_work", 1, 8}, {"eval", 1, 1}, {"save_work", 4, 2}, {"many", 8, 8}};
+  std::vector<i32> queue_sizes = {4, 64};
+
+  printf("%-10s %4s %4s %5s %16s %16s %8s\n", "queue", "prod", "cons", "size",
+         "mutex (item/s)", "lockfree (item/s)", "speedup");
+  for (auto& config : configs) {
+    for (i32 size : queue_sizes) {
+      f64 mutex_rate =
+          run_benchmark<Queue<i64>>(config.producers, config.consumers, size);
+      f64 lockfree_rate = run_benchmark<LockFreeQueue<i64>>(
+          config.producers, config.consumers, size);
+      printf("%-10s %4d %4d %5d %16.0f %16.0f %8.2f\n", config.name,
+             config.producers, config.consumers, size, mutex_rate,
+             lockfree_rate, lockfree_rate / mutex_rate);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "scanner/util/common.h"
+#include "scanner/util/storage_limiter.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+
+namespace scanner {
+
+namespace {
+// Takes a slot and frees it as a request that took the given time
+void request(StorageLimiter& limiter, f64 seconds, bool throttled = false) {
+  limiter.acquire();
+  timepoint_t start =
+      now() - std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::duration<f64>(seconds));
+  limiter.release(start, throttled);
+}
+}
+
+TEST(StorageLimiter, MixedFastAndSlowRequestsGrowLimit) {
+  // Reads served from a cache take microseconds and the rest go to the
+  // store, which does not mean the store is overloaded
+  StorageLimiter limiter(4, 512, 64, 0);
+  std::mt19937 rng(0);
+  std::bernoulli_distribution remote(0.1);
+  for (i32 i = 0; i < 20000; ++i) {
+    request(limiter, remote(rng) ? 0.05 : 1e-6);
+  }
+  EXPECT_GT(limiter.limit(), 64);
+}
+
+TEST(StorageLimiter, SlowerStoreShrinksLimitUntilBaseCatchesUp) {
+  StorageLimiter limiter(4, 512, 64, 0);
+  for (i32 i = 0; i < 200; ++i) {
+    request(limiter, 0.001);
+  }
+  i32 fast_limit = limiter.limit();
+  EXPECT_GT(fast_limit, 64);
+
+  i32 lowest_limit = fast_limit;
+  for (i32 i = 0; i < 400; ++i) {
+    request(limiter, 0.02);
+    lowest_limit = std::min(lowest_limit, limiter.limit());
+  }
+  EXPECT_LT(lowest_limit, fast_limit);
+  EXPECT_GT(lowest_limit, 4);
+  // Once the store stays that slow it is the new normal
+  EXPECT_GT(limiter.limit(), lowest_limit);
+}
+
+TEST(StorageLimiter, ThrottlingHalvesLimitOncePerInterval) {
+  StorageLimiter limiter(4, 512, 64, 60);
+  request(limiter, 0.01, true);
+  EXPECT_EQ(limiter.limit(), 32);
+  request(limiter, 0.01, true);
+  EXPECT_EQ(limiter.limit(), 32);
+  EXPECT_EQ(limiter.throttle_events(), 2);
+
+  StorageLimiter no_interval(4, 512, 64, 0);
+  request(no_interval, 0.01, true);
+  request(no_interval, 0.01, true);
+  EXPECT_EQ(no_interval.limit(), 16);
+}
+
+TEST(StorageLimiter, LimitStaysWithinBounds) {
+  StorageLimiter limiter(4, 8, 6, 0);
+  for (i32 i = 0; i < 20; ++i) {
+    request(limiter, 0.01, true);
+  }
+  EXPECT_EQ(limiter.limit(), 4);
+  for (i32 i = 0; i < 1000; ++i) {
+    request(limiter, 0.001);
+  }
+  EXPECT_EQ(limiter.limit(), 8);
+}
+
+TEST(StorageLimiter, AcquireWaitsForFreeSlot) {
+  StorageLimiter limiter(1, 1, 1, 0);
+  timepoint_t start = limiter.acquire();
+  std::atomic<bool> acquired(false);
+  std::thread waiter([&] {
+    timepoint_t start = limiter.acquire();
+    acquired = true;
+    limiter.release(start, false);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(acquired);
+  limiter.release(start, false);
+  waiter.join();
+  EXPECT_TRUE(acquired);
+}
+
+TEST(StorageLimiter, NestedRequestsShareSlot) {
+  StorageLimiter limiter(1, 1, 1, 0);
+  timepoint_t outer = limiter.acquire();
+  timepoint_t inner = limiter.acquire();
+  limiter.release(inner, false);
+  limiter.release(outer, false);
+  // The slot is free again for another thread
+  std::thread other([&] { request(limiter, 0.001); });
+  other.join();
+}
+}